@@ -16,50 +16,78 @@ COMPILE_ARGS = ("-Wall -g -O2 -shared -fPIC"
                 " -flto -fwhole-program -fno-use-linker-plugin"
                 " -o %s %s")
 SSE_FLAGS = "-mfpmath=sse -msse2"
+# Set to "-DTRAPQ_FLOAT" to evaluate moves in single precision (see trapq.h)
+EXTRA_FLAGS = ""
 SOURCE_FILES = [
     'pyhelper.c', 'serialqueue.c', 'stepcompress.c', 'itersolve.c', 'trapq.c',
-    'pollreactor.c', 'msgblock.c', 'trdispatch.c',
+    'pollreactor.c', 'msgblock.c', 'trdispatch.c', 'stepgen.c', 'bulkreader.c',
     'kin_cartesian.c', 'kin_corexy.c', 'kin_corexz.c', 'kin_delta.c',
     'kin_deltesian.c', 'kin_polar.c', 'kin_rotary_delta.c', 'kin_winch.c',
-    'kin_extruder.c', 'kin_shaper.c', 'kin_idex.c', 'kin_generic.c'
+    'kin_extruder.c', 'kin_shaper.c', 'kin_idex.c', 'kin_generic.c',
+    'kin_mesh.c', 'kin_skew.c', 'kin_zoffset.c', 'lookahead.c', 'arcs.c',
+    'motionring.c', 'clocksync.c', 'pwmgen.c'
 ]
 DEST_LIB = "c_helper.so"
 OTHER_FILES = [
     'list.h', 'serialqueue.h', 'stepcompress.h', 'itersolve.h', 'pyhelper.h',
-    'trapq.h', 'pollreactor.h', 'msgblock.h'
+    'trapq.h', 'pollreactor.h', 'msgblock.h', 'stepgen.h', 'lookahead.h'
 ]
 
 defs_stepcompress = """
     struct pull_history_steps {
         uint64_t first_clock, last_clock;
         int64_t start_position;
-        int step_count, interval, add;
+        int step_count, interval, add, add2;
+    };
+
+    struct stepcompress_stats {
+        uint64_t move_count, step_count, error_limited_count;
+        uint64_t message_count, message_bytes;
     };
 
     struct stepcompress *stepcompress_alloc(uint32_t oid);
     void stepcompress_fill(struct stepcompress *sc, uint32_t max_error
         , int32_t queue_step_msgtag, int32_t set_next_step_dir_msgtag);
+    void stepcompress_fill_add2(struct stepcompress *sc
+        , int32_t queue_step2_msgtag);
+    void stepcompress_fill_queue_steps(struct stepcompress *sc
+        , int32_t queue_steps_msgtag);
     void stepcompress_set_invert_sdir(struct stepcompress *sc
         , uint32_t invert_sdir);
     void stepcompress_free(struct stepcompress *sc);
+    void stepcompress_set_move_reserve(struct stepcompress *sc
+        , int move_num);
+    void stepcompress_set_stepper_kinematics(struct stepcompress *sc
+        , struct stepper_kinematics *sk);
     int stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock);
     int stepcompress_set_last_position(struct stepcompress *sc
         , uint64_t clock, int64_t last_position);
     int64_t stepcompress_find_past_position(struct stepcompress *sc
         , uint64_t clock);
+    int stepcompress_append(struct stepcompress *sc, int sdir
+        , double print_time, double step_time);
     int stepcompress_queue_msg(struct stepcompress *sc
         , uint32_t *data, int len);
     int stepcompress_queue_mq_msg(struct stepcompress *sc, uint64_t req_clock
         , uint32_t *data, int len);
+    int stepcompress_queue_mq_batch(struct stepcompress *sc
+        , uint64_t req_clock, uint64_t last_clock, int move_count
+        , uint8_t *msg, int len);
     int stepcompress_extract_old(struct stepcompress *sc
         , struct pull_history_steps *p, int max
         , uint64_t start_clock, uint64_t end_clock);
+    void stepcompress_get_stats(struct stepcompress *sc
+        , struct stepcompress_stats *stats);
 
     struct steppersync *steppersync_alloc(struct serialqueue *sq
         , struct stepcompress **sc_list, int sc_num, int move_num);
     void steppersync_free(struct steppersync *ss);
+    void steppersync_fill_queue_step_multi(struct steppersync *ss
+        , int32_t queue_step_multi_msgtag);
     void steppersync_set_time(struct steppersync *ss
         , double time_offset, double mcu_freq);
+    int steppersync_generate_steps(struct steppersync *ss
+        , struct stepgen_pool *sgp, double flush_time);
     int steppersync_flush(struct steppersync *ss, uint64_t move_clock
         , uint64_t clear_history_clock);
 """
@@ -80,6 +108,22 @@ defs_itersolve = """
     double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
 """
 
+defs_stepgen = """
+    struct stepgen_stats {
+        double last_solve_time, max_solve_time, total_solve_time;
+        uint32_t flush_count;
+    };
+
+    struct stepgen_pool *stepgen_pool_alloc(int num_threads);
+    void stepgen_pool_free(struct stepgen_pool *sp);
+    void stepgen_pool_start(struct stepgen_pool *sp);
+    int32_t stepgen_pool_generate_steps(struct stepgen_pool *sp
+        , struct stepper_kinematics *sk, double flush_time);
+    int32_t stepgen_pool_flush(struct stepgen_pool *sp, double flush_time);
+    void stepgen_pool_get_stats(struct stepgen_pool *sp
+        , struct stepgen_stats *stats);
+"""
+
 defs_trapq = """
     struct pull_move {
         double print_time, move_t;
@@ -87,6 +131,9 @@ defs_trapq = """
         double start_x, start_y, start_z;
         double x_r, y_r, z_r;
     };
+    struct accel_seq_state {
+        double print_time, last_t, d, v, min_d, max_d;
+    };
 
     struct trapq *trapq_alloc(void);
     void trapq_free(struct trapq *tq);
@@ -101,6 +148,39 @@ defs_trapq = """
         , double pos_x, double pos_y, double pos_z);
     int trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
         , double start_time, double end_time);
+
+    struct trapq_pool_stats {
+        uint32_t block_count, move_count, free_count, alloc_count;
+    };
+    int trapq_find_positions(struct trapq *tq, double *times, double *coords
+        , int count);
+    void trapq_get_pool_stats(struct trapq *tq
+        , struct trapq_pool_stats *stats);
+    void trapq_append_accel_seq(struct trapq *tq
+        , struct accel_seq_state *as, double start_pos_x
+        , double start_pos_y, double start_pos_z, double axes_r_x
+        , double axes_r_y, double axes_r_z, double *times
+        , double *accels, int count);
+"""
+
+defs_lookahead = """
+    struct lookahead_timing {
+        double print_time, accel_t, cruise_t, decel_t;
+        double start_v, cruise_v, end_v;
+    };
+
+    struct lookahead *lookahead_alloc(void);
+    void lookahead_free(struct lookahead *la);
+    void lookahead_reset(struct lookahead *la);
+    void lookahead_add_move(struct lookahead *la, int is_kinematic_move
+        , double start_pos_x, double start_pos_y, double start_pos_z
+        , double axes_r_x, double axes_r_y, double axes_r_z, double move_d
+        , double accel, double junction_deviation
+        , double max_cruise_v2, double smooth_delta_v2, double extra_axes_v2);
+    void lookahead_limit_next_junction(struct lookahead *la, double max_v2);
+    int lookahead_flush(struct lookahead *la, int lazy);
+    double lookahead_queue_moves(struct lookahead *la, struct trapq *tq
+        , double print_time, int count, struct lookahead_timing *timings);
 """
 
 defs_kin_cartesian = """
@@ -124,6 +204,8 @@ defs_kin_corexz = """
 defs_kin_delta = """
     struct stepper_kinematics *delta_stepper_alloc(double arm2
         , double tower_x, double tower_y);
+    void delta_stepper_set_interpolation(struct stepper_kinematics *sk
+        , double max_error);
 """
 
 defs_kin_deltesian = """
@@ -150,7 +232,10 @@ defs_kin_extruder = """
     struct stepper_kinematics *extruder_stepper_alloc(void);
     void extruder_stepper_free(struct stepper_kinematics *sk);
     void extruder_set_pressure_advance(struct stepper_kinematics *sk
-        , double print_time, double pressure_advance, double smooth_time);
+        , double print_time, double pressure_advance
+        , double pressure_advance_quad, double smooth_time);
+    void extruder_set_flow_factor(struct stepper_kinematics *sk, double pos
+        , double factor);
 """
 
 defs_kin_shaper = """
@@ -158,10 +243,18 @@ defs_kin_shaper = """
         struct stepper_kinematics *sk);
     int input_shaper_set_shaper_params(struct stepper_kinematics *sk, char axis
         , int n, double a[], double t[]);
+    int input_shaper_set_smoother_params(struct stepper_kinematics *sk
+        , char axis, int n, double c[], double t_sm);
     int input_shaper_set_sk(struct stepper_kinematics *sk
         , struct stepper_kinematics *orig_sk);
+    int input_shaper_set_extruder_sk(struct stepper_kinematics *sk
+        , struct stepper_kinematics *orig_sk);
     void input_shaper_update_sk(struct stepper_kinematics *sk);
     struct stepper_kinematics * input_shaper_alloc(void);
+    struct input_shaper_cache *input_shaper_cache_alloc(void);
+    void input_shaper_cache_free(struct input_shaper_cache *isc);
+    void input_shaper_set_cache(struct stepper_kinematics *sk
+        , struct input_shaper_cache *isc);
 """
 
 defs_kin_idex = """
@@ -172,6 +265,72 @@ defs_kin_idex = """
     struct stepper_kinematics * dual_carriage_alloc(void);
 """
 
+defs_arcs = """
+    int arc_fill_segments(double *coords, int count, int alpha_axis
+        , int beta_axis, int helical_axis, double center_alpha
+        , double center_beta, double r_alpha, double r_beta
+        , double helical_start, double theta_per_segment
+        , double linear_per_segment);
+"""
+
+defs_kin_mesh = """
+    double bed_mesh_calc_z(struct bed_mesh_table *bm, double x, double y);
+    double bed_mesh_calc_z_adjust(struct bed_mesh_table *bm
+        , double x, double y, double z);
+    int bed_mesh_set_grid(struct bed_mesh_table *bm, int x_count
+        , int y_count, double x_min, double y_min, double x_dist
+        , double y_dist, double *z);
+    void bed_mesh_set_params(struct bed_mesh_table *bm, double x_offset
+        , double y_offset, double fade_start, double fade_end
+        , double fade_target, double tool_offset);
+    struct bed_mesh_table *bed_mesh_alloc(void);
+    void bed_mesh_free(struct bed_mesh_table *bm);
+    void mesh_stepper_set_active(struct stepper_kinematics *sk
+        , int is_active);
+    int mesh_stepper_set_sk(struct stepper_kinematics *sk
+        , struct stepper_kinematics *orig_sk, struct bed_mesh_table *bm);
+    struct stepper_kinematics *mesh_stepper_alloc(void);
+"""
+
+defs_kin_skew = """
+    void skew_stepper_set_factors(struct stepper_kinematics *sk
+        , double xy_factor, double xz_factor, double yz_factor);
+    void skew_stepper_set_active(struct stepper_kinematics *sk
+        , int is_active);
+    int skew_stepper_set_sk(struct stepper_kinematics *sk
+        , struct stepper_kinematics *orig_sk);
+    struct stepper_kinematics *skew_stepper_alloc(void);
+"""
+
+defs_kin_zoffset = """
+    double z_offset_get_offset(struct z_offset_table *zt, double print_time);
+    void z_offset_set_ramp(struct z_offset_table *zt, double start_time
+        , double end_time, double z);
+    void z_offset_set_offset(struct z_offset_table *zt, double z);
+    struct z_offset_table *z_offset_alloc(void);
+    void z_offset_free(struct z_offset_table *zt);
+    void zoffset_stepper_set_active(struct stepper_kinematics *sk
+        , int is_active);
+    int zoffset_stepper_set_sk(struct stepper_kinematics *sk
+        , struct stepper_kinematics *orig_sk, struct z_offset_table *zt);
+    struct stepper_kinematics *zoffset_stepper_alloc(void);
+"""
+
+defs_pwmgen = """
+    int32_t pwmgen_generate(struct pwmgen *pg, double flush_time);
+    void pwmgen_set_value(struct pwmgen *pg, double print_time
+        , double value);
+    void pwmgen_set_trapq(struct pwmgen *pg, struct trapq *tq
+        , double start_time);
+    void pwmgen_setup(struct pwmgen *pg, struct stepcompress *sc
+        , int32_t msgtag, uint32_t oid, uint32_t invert, double pwm_max
+        , uint32_t default_value, uint32_t duration_ticks
+        , uint64_t last_clock, uint32_t last_value
+        , double full_velocity, double update_time);
+    struct pwmgen *pwmgen_alloc(void);
+    void pwmgen_free(struct pwmgen *pg);
+"""
+
 defs_serialqueue = """
     #define MESSAGE_MAX 64
     struct pull_queue_message {
@@ -180,6 +339,12 @@ defs_serialqueue = """
         double sent_time, receive_time;
         uint64_t notify_id;
     };
+    struct serialqueue_traffic {
+        uint32_t bytes_write, bytes_read, bytes_retransmit;
+        uint32_t frames_write, frames_read;
+        int ready_bytes_max, need_ack_bytes_max;
+        double srtt, rttvar, receive_delay_max;
+    };
 
     struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
         , int client_id);
@@ -190,19 +355,80 @@ defs_serialqueue = """
     void serialqueue_send(struct serialqueue *sq, struct command_queue *cq
         , uint8_t *msg, int len, uint64_t min_clock, uint64_t req_clock
         , uint64_t notify_id);
+    void serialqueue_send_multi(struct serialqueue *sq
+        , struct command_queue *cq, uint8_t *msgs, int *lens, int count
+        , uint64_t min_clock, uint64_t req_clock);
     void serialqueue_pull(struct serialqueue *sq
         , struct pull_queue_message *pqm);
+    int serialqueue_set_capture(struct serialqueue *sq, const char *filename
+        , int record_count);
     void serialqueue_set_wire_frequency(struct serialqueue *sq
         , double frequency);
+    int serialqueue_set_canfd(struct serialqueue *sq);
     void serialqueue_set_receive_window(struct serialqueue *sq
         , int receive_window);
     void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
         , double conv_time, uint64_t conv_clock, uint64_t last_clock);
     void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
+    void serialqueue_get_traffic(struct serialqueue *sq
+        , struct serialqueue_traffic *traffic);
+    double serialqueue_get_rtt(struct serialqueue *sq);
     int serialqueue_extract_old(struct serialqueue *sq, int sentq
         , struct pull_queue_message *q, int max);
 """
 
+defs_msgblock = """
+    struct msgparser *msgparser_alloc(void);
+    void msgparser_free(struct msgparser *mp);
+    int msgparser_add_format(struct msgparser *mp, int msgid
+        , uint8_t *param_types, int num_params);
+    int msgparser_parse(struct msgparser *mp, uint8_t *msg, int msg_len
+        , int32_t *pmsgid, int64_t *params, int params_len);
+"""
+
+defs_bulkreader = """
+    struct bulkreader *bulkreader_alloc(struct serialqueue *sq, uint32_t oid
+        , uint32_t bulk_data_msgtag, int bytes_per_sample
+        , int samples_per_block, uint8_t *field_types, int num_fields);
+    void bulkreader_free(struct bulkreader *br);
+    void bulkreader_set_packed(struct bulkreader *br);
+    void bulkreader_start(struct bulkreader *br);
+    void bulkreader_stop(struct bulkreader *br);
+    int bulkreader_pull_samples(struct bulkreader *br, int64_t last_sequence
+        , double time_base, double chip_base, double inv_freq
+        , double *ptimes, int64_t *values, int max_samples
+        , int64_t *last_chip_clock);
+"""
+
+defs_clocksync = """
+    struct clocksync_state {
+        uint64_t last_clock;
+        double est_time, est_clock, est_freq;
+        double min_half_rtt, min_rtt_time;
+        double time_avg, time_variance, clock_avg, clock_covariance;
+        double prediction_variance, last_prediction_time;
+        uint32_t sample_count, reset_count;
+    };
+
+    struct clocksync *clocksync_alloc(struct serialqueue *sq
+        , uint32_t clock_msgtag, double mcu_freq);
+    void clocksync_free(struct clocksync *cs);
+    void clocksync_start(struct clocksync *cs, double sent_time
+        , uint64_t clock, int startup_samples);
+    void clocksync_get_state(struct clocksync *cs
+        , struct clocksync_state *state);
+"""
+
+defs_motionring = """
+    struct motionring *motionring_alloc(const char *filename, const char *name
+        , int record_type, int record_size, int record_count);
+    void motionring_free(struct motionring *mr);
+    void motionring_set_params(struct motionring *mr, double *params
+        , int count);
+    void motionring_append(struct motionring *mr, void *records, int count
+        , int newest_first);
+"""
+
 defs_trdispatch = """
     void trdispatch_start(struct trdispatch *td, uint32_t dispatch_reason);
     void trdispatch_stop(struct trdispatch *td);
@@ -214,6 +440,12 @@ defs_trdispatch = """
     void trdispatch_mcu_setup(struct trdispatch_mcu *tdm
         , uint64_t last_status_clock, uint64_t expire_clock
         , uint64_t expire_ticks, uint64_t min_extend_ticks);
+    struct trdispatch_stats {
+        double latency_max, latency_sum;
+        uint32_t report_count;
+    };
+    void trdispatch_mcu_get_stats(struct trdispatch_mcu *tdm
+        , struct trdispatch_stats *stats);
 """
 
 defs_pyhelper = """
@@ -227,11 +459,14 @@ defs_std = """
 
 defs_all = [
     defs_pyhelper, defs_serialqueue, defs_std, defs_stepcompress,
-    defs_itersolve, defs_trapq, defs_trdispatch,
+    defs_itersolve, defs_stepgen, defs_trapq, defs_msgblock, defs_trdispatch,
+    defs_bulkreader, defs_clocksync, defs_lookahead, defs_arcs,
+    defs_motionring,
     defs_kin_cartesian, defs_kin_corexy, defs_kin_corexz, defs_kin_delta,
     defs_kin_deltesian, defs_kin_polar, defs_kin_rotary_delta, defs_kin_winch,
     defs_kin_extruder, defs_kin_shaper, defs_kin_idex,
-    defs_kin_generic_cartesian,
+    defs_kin_generic_cartesian, defs_kin_mesh, defs_kin_skew, defs_kin_zoffset,
+    defs_pwmgen,
 ]
 
 # Update filenames to an absolute path
@@ -288,9 +523,10 @@ def get_ffi():
         destlib = get_abs_files(srcdir, [DEST_LIB])[0]
         if check_build_code(srcfiles+ofiles+[__file__], destlib):
             if check_gcc_option(SSE_FLAGS):
-                cmd = "%s %s %s" % (GCC_CMD, SSE_FLAGS, COMPILE_ARGS)
+                cmd = "%s %s %s %s" % (GCC_CMD, SSE_FLAGS, EXTRA_FLAGS,
+                                       COMPILE_ARGS)
             else:
-                cmd = "%s %s" % (GCC_CMD, COMPILE_ARGS)
+                cmd = "%s %s %s" % (GCC_CMD, EXTRA_FLAGS, COMPILE_ARGS)
             logging.info("Building C code module %s", DEST_LIB)
             do_build_code(cmd % (destlib, ' '.join(srcfiles)))
         FFI_main = cffi.FFI()
@@ -0,0 +1,39 @@
+// Generation of line segments for G2/G3 arc moves
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// The gcode_arcs module approximates an arc with many short linear
+// moves.  Calculating the coordinates of each segment in C allows
+// the entire arc to be generated with a single call from python.
+
+#include <math.h> // sin
+#include "compiler.h" // __visible
+
+// Fill 'coords' with the xyz position at the end of each of the
+// first 'count - 1' segments of an arc (the final segment ends at the
+// arc target).  The arc is in the plane of 'alpha_axis' and
+// 'beta_axis' with linear travel along 'helical_axis'.  The 'r_alpha'
+// and 'r_beta' parameters are the radius vector from the arc center
+// to the start position.  Returns the number of coordinates stored.
+int __visible
+arc_fill_segments(double *coords, int count, int alpha_axis, int beta_axis
+                  , int helical_axis, double center_alpha
+                  , double center_beta, double r_alpha, double r_beta
+                  , double helical_start, double theta_per_segment
+                  , double linear_per_segment)
+{
+    if (alpha_axis < 0 || alpha_axis > 2 || beta_axis < 0 || beta_axis > 2
+        || helical_axis < 0 || helical_axis > 2)
+        return -1;
+    int i;
+    for (i = 1; i < count; i++, coords += 3) {
+        double theta = i * theta_per_segment;
+        double cos_t = cos(theta), sin_t = sin(theta);
+        coords[alpha_axis] = center_alpha + r_alpha * cos_t - r_beta * sin_t;
+        coords[beta_axis] = center_beta + r_alpha * sin_t + r_beta * cos_t;
+        coords[helical_axis] = helical_start + i * linear_per_segment;
+    }
+    return count > 1 ? count - 1 : 0;
+}
@@ -0,0 +1,328 @@
+// Collection of "sensor_bulk_data" messages from sensor chips
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// High rate sensors (accelerometers, eddy current sensors, load cells)
+// report their measurements in "sensor_bulk_data" messages.  The code
+// here stores those messages from the serialqueue background thread
+// (via a fastreader) and later decodes them into arrays of sample
+// times and values.  This allows the host python code to process the
+// measurements in large chunks instead of one message at a time.
+
+#include <pthread.h> // pthread_mutex_lock
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // ARRAY_SIZE
+#include "pyhelper.h" // report_errno
+#include "serialqueue.h" // serialqueue_add_fastreader
+
+// Sample field types (size in bytes plus flags)
+#define BR_SIZE_MASK 0x0f
+#define BR_SIGNED    0x10
+#define BR_BIGENDIAN 0x20
+
+// Header byte of a packed block that was sent unmodified
+#define BR_PACKED_RAW 0xff
+
+#define MAX_FIELDS 16
+
+struct bulkreader_block {
+    uint16_t sequence;
+    uint8_t len;
+    uint8_t data[MESSAGE_PAYLOAD_MAX];
+};
+
+struct bulkreader {
+    struct fastreader fr;
+    struct serialqueue *sq;
+    struct msgparser *mp;
+    uint32_t oid;
+    int is_active, is_packed;
+    // Sample format
+    int bytes_per_sample, samples_per_block, num_fields;
+    uint8_t field_types[MAX_FIELDS];
+
+    pthread_mutex_t lock; // protects variables below
+    struct bulkreader_block *blocks;
+    int blocks_pos, blocks_count, blocks_alloc;
+};
+
+// Discard all queued blocks
+static void
+clear_blocks(struct bulkreader *br)
+{
+    pthread_mutex_lock(&br->lock);
+    br->blocks_pos = br->blocks_count = 0;
+    pthread_mutex_unlock(&br->lock);
+}
+
+// Find space for a new block at the end of the queue (caller must
+// hold br->lock)
+static struct bulkreader_block *
+add_block(struct bulkreader *br)
+{
+    if (br->blocks_pos + br->blocks_count >= br->blocks_alloc) {
+        if (br->blocks_pos) {
+            memmove(br->blocks, &br->blocks[br->blocks_pos]
+                    , br->blocks_count * sizeof(*br->blocks));
+            br->blocks_pos = 0;
+        }
+        if (br->blocks_count >= br->blocks_alloc) {
+            br->blocks_alloc = br->blocks_alloc ? br->blocks_alloc * 2 : 64;
+            br->blocks = realloc(br->blocks
+                                 , br->blocks_alloc * sizeof(*br->blocks));
+        }
+    }
+    return &br->blocks[br->blocks_pos + br->blocks_count++];
+}
+
+// Read a field as an unsigned integer
+static uint32_t
+get_raw_field(uint8_t *p, uint8_t field_type)
+{
+    int size = field_type & BR_SIZE_MASK, i;
+    uint32_t v = 0;
+    for (i = 0; i < size; i++)
+        v = (v << 8) | p[field_type & BR_BIGENDIAN ? i : size - 1 - i];
+    return v;
+}
+
+// Store the low bits of an unsigned integer into a field
+static void
+put_raw_field(uint8_t *p, uint8_t field_type, uint32_t v)
+{
+    int size = field_type & BR_SIZE_MASK, i;
+    for (i = 0; i < size; i++, v >>= 8)
+        p[field_type & BR_BIGENDIAN ? size - 1 - i : i] = v;
+}
+
+// Expand a "packed" sensor_bulk_data payload (see sensor_bulk_encode.c
+// in the mcu code) back into the chip's native sample format.
+// Returns the number of bytes stored in 'out'.
+static int
+unpack_block(struct bulkreader *br, uint8_t *out, uint8_t *data, int len)
+{
+    if (!len)
+        return 0;
+    int width = data[0];
+    data++;
+    len--;
+    if (width == BR_PACKED_RAW) {
+        memcpy(out, data, len);
+        return len;
+    }
+    int bytes_per_sample = br->bytes_per_sample, num_fields = br->num_fields;
+    if (!width || width > 32 || len < bytes_per_sample)
+        return 0;
+    int count = 1 + (len - bytes_per_sample) * 8 / (num_fields * width);
+    if (count * bytes_per_sample > MESSAGE_PAYLOAD_MAX)
+        return 0;
+    memcpy(out, data, bytes_per_sample);
+    uint8_t *p = &data[bytes_per_sample];
+    uint64_t acc = 0;
+    int acc_bits = 0, i, j;
+    for (i = 1; i < count; i++) {
+        uint8_t *prev = &out[(i - 1) * bytes_per_sample];
+        uint8_t *cur = &out[i * bytes_per_sample];
+        for (j = 0; j < num_fields; j++) {
+            while (acc_bits < width) {
+                acc |= (uint64_t)*p++ << acc_bits;
+                acc_bits += 8;
+            }
+            uint32_t zz = acc & ((1ULL << width) - 1);
+            acc >>= width;
+            acc_bits -= width;
+            uint32_t delta = (zz >> 1) ^ -(zz & 1);
+            uint8_t field_type = br->field_types[j];
+            put_raw_field(cur, field_type
+                          , get_raw_field(prev, field_type) + delta);
+            prev += field_type & BR_SIZE_MASK;
+            cur += field_type & BR_SIZE_MASK;
+        }
+    }
+    return count * bytes_per_sample;
+}
+
+// Handle a sensor_bulk_data message (callback from serialqueue fastreader)
+static void
+handle_bulk_data(struct fastreader *fr, uint8_t *data, int len)
+{
+    struct bulkreader *br = container_of(fr, struct bulkreader, fr);
+
+    // Parse: sensor_bulk_data oid=%c sequence=%hu data=%*s
+    int32_t msgid;
+    int64_t fields[3];
+    int ret = msgparser_parse(br->mp, data, len, &msgid
+                              , fields, ARRAY_SIZE(fields));
+    if (ret != ARRAY_SIZE(fields) || fields[0] != br->oid)
+        return;
+    int data_pos = fields[2] >> 8, data_len = fields[2] & 0xff;
+
+    // Store block
+    pthread_mutex_lock(&br->lock);
+    struct bulkreader_block *b = add_block(br);
+    b->sequence = fields[1];
+    if (br->is_packed) {
+        b->len = unpack_block(br, b->data, &data[data_pos], data_len);
+    } else {
+        b->len = data_len;
+        memcpy(b->data, &data[data_pos], data_len);
+    }
+    pthread_mutex_unlock(&br->lock);
+}
+
+// Extract a single integer field from a sample
+static int64_t
+decode_field(uint8_t *p, uint8_t field_type)
+{
+    int size = field_type & BR_SIZE_MASK, i;
+    uint32_t v = 0;
+    if (field_type & BR_BIGENDIAN)
+        for (i = 0; i < size; i++)
+            v = (v << 8) | p[i];
+    else
+        for (i = size - 1; i >= 0; i--)
+            v = (v << 8) | p[i];
+    if (field_type & BR_SIGNED) {
+        int shift = 32 - size * 8;
+        return (int32_t)(v << shift) >> shift;
+    }
+    return v;
+}
+
+// Decode queued blocks into arrays of sample times and values.  The
+// time of each sample is found from the clock translation of the
+// caller (see FixedFreqReader in bulk_sensor.py).  Returns the number
+// of samples stored (zero if there are no more queued blocks).
+int __visible
+bulkreader_pull_samples(struct bulkreader *br, int64_t last_sequence
+                        , double time_base, double chip_base
+                        , double inv_freq, double *ptimes, int64_t *values
+                        , int max_samples, int64_t *last_chip_clock)
+{
+    int num_fields = br->num_fields, bytes_per_sample = br->bytes_per_sample;
+    int samples_per_block = br->samples_per_block, count = 0;
+    pthread_mutex_lock(&br->lock);
+    while (br->blocks_count) {
+        struct bulkreader_block *b = &br->blocks[br->blocks_pos];
+        int block_samples = b->len / bytes_per_sample;
+        if (count + block_samples > max_samples)
+            break;
+        br->blocks_pos++;
+        br->blocks_count--;
+        if (!block_samples)
+            continue;
+        // Determine sequence number of this block
+        int32_t seq_diff = (b->sequence - last_sequence) & 0xffff;
+        seq_diff -= (seq_diff & 0x8000) << 1;
+        int64_t seq = last_sequence + seq_diff;
+        double msg_cdiff = (double)(seq * samples_per_block) - chip_base;
+        // Decode samples
+        uint8_t *p = b->data;
+        int i, j;
+        for (i = 0; i < block_samples; i++) {
+            ptimes[count] = time_base + (msg_cdiff + i) * inv_freq;
+            uint8_t *fp = p;
+            for (j = 0; j < num_fields; j++) {
+                uint8_t field_type = br->field_types[j];
+                *values++ = decode_field(fp, field_type);
+                fp += field_type & BR_SIZE_MASK;
+            }
+            p += bytes_per_sample;
+            count++;
+        }
+        *last_chip_clock = seq * samples_per_block + block_samples - 1;
+    }
+    if (!br->blocks_count)
+        br->blocks_pos = 0;
+    pthread_mutex_unlock(&br->lock);
+    return count;
+}
+
+// Note that the mcu sends blocks in the "packed" format
+void __visible
+bulkreader_set_packed(struct bulkreader *br)
+{
+    br->is_packed = 1;
+}
+
+// Start collecting sensor_bulk_data messages
+void __visible
+bulkreader_start(struct bulkreader *br)
+{
+    if (br->is_active)
+        return;
+    clear_blocks(br);
+    br->is_active = 1;
+    serialqueue_add_fastreader(br->sq, &br->fr);
+}
+
+// Stop collecting sensor_bulk_data messages
+void __visible
+bulkreader_stop(struct bulkreader *br)
+{
+    if (!br->is_active)
+        return;
+    br->is_active = 0;
+    serialqueue_rm_fastreader(br->sq, &br->fr);
+    clear_blocks(br);
+}
+
+// Create a new 'struct bulkreader' object
+struct bulkreader * __visible
+bulkreader_alloc(struct serialqueue *sq, uint32_t oid
+                 , uint32_t bulk_data_msgtag, int bytes_per_sample
+                 , int samples_per_block, uint8_t *field_types
+                 , int num_fields)
+{
+    if (num_fields > MAX_FIELDS)
+        return NULL;
+    struct bulkreader *br = malloc(sizeof(*br));
+    memset(br, 0, sizeof(*br));
+    br->sq = sq;
+    br->oid = oid;
+    br->bytes_per_sample = bytes_per_sample;
+    br->samples_per_block = samples_per_block;
+    br->num_fields = num_fields;
+    memcpy(br->field_types, field_types, num_fields);
+
+    int ret = pthread_mutex_init(&br->lock, NULL);
+    if (ret) {
+        report_errno("bulkreader_alloc pthread_mutex_init", ret);
+        free(br);
+        return NULL;
+    }
+
+    // Setup parser for sensor_bulk_data messages
+    uint8_t bulk_data_types[] = { MP_UINT32, MP_UINT32, MP_BUFFER };
+    br->mp = msgparser_alloc();
+    msgparser_add_format(br->mp, bulk_data_msgtag, bulk_data_types
+                         , ARRAY_SIZE(bulk_data_types));
+
+    // Setup fastreader to match (and consume) sensor_bulk_data messages
+    uint32_t bulk_data_prefix[] = {bulk_data_msgtag, oid};
+    struct queue_message *dummy = message_alloc_and_encode(
+        bulk_data_prefix, ARRAY_SIZE(bulk_data_prefix));
+    memcpy(br->fr.prefix, dummy->msg, dummy->len);
+    br->fr.prefix_len = dummy->len;
+    free(dummy);
+    br->fr.func = handle_bulk_data;
+    br->fr.is_exclusive = 1;
+
+    return br;
+}
+
+// Free memory associated with a 'struct bulkreader' object
+void __visible
+bulkreader_free(struct bulkreader *br)
+{
+    if (!br)
+        return;
+    bulkreader_stop(br);
+    msgparser_free(br->mp);
+    free(br->blocks);
+    free(br);
+}
@@ -0,0 +1,198 @@
+// Micro-controller clock synchronization regression
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// The mcu "clock" responses are processed here from the serialqueue
+// background thread (via a fastreader) so that the serialqueue clock
+// estimate is updated as soon as each sample arrives.  The host
+// python code (klippy/clocksync.py) only reads back the results.
+
+#include <math.h> // sqrt
+#include <pthread.h> // pthread_mutex_lock
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // ARRAY_SIZE
+#include "pyhelper.h" // report_errno
+#include "serialqueue.h" // serialqueue_add_fastreader
+
+#define RTT_AGE (.000010 / (60. * 60.))
+#define DECAY (1. / 30.)
+#define TRANSMIT_EXTRA .001
+
+struct clocksync_state {
+    uint64_t last_clock;
+    double est_time, est_clock, est_freq;
+    double min_half_rtt, min_rtt_time;
+    double time_avg, time_variance, clock_avg, clock_covariance;
+    double prediction_variance, last_prediction_time;
+    uint32_t sample_count, reset_count;
+};
+
+struct clocksync {
+    struct fastreader fr;
+    struct serialqueue *sq;
+    double mcu_freq;
+    int is_active;
+
+    pthread_mutex_t lock; // protects variables below
+    struct clocksync_state s;
+    int startup_samples;
+};
+
+// Add a clock sample to the linear regression
+static void
+clocksync_add_sample(struct clocksync *cs, uint32_t clock32
+                     , double sent_time, double receive_time)
+{
+    struct clocksync_state *s = &cs->s;
+    // Extend clock to 64bit
+    uint64_t clock = s->last_clock + (uint32_t)(clock32 - s->last_clock);
+    s->last_clock = clock;
+    if (!sent_time)
+        return;
+    s->sample_count++;
+    if (cs->startup_samples) {
+        // Don't ignore samples while the initial estimate is settling
+        cs->startup_samples--;
+        s->last_prediction_time = -9999.;
+    }
+    // Check if this is the best round-trip-time seen so far
+    double half_rtt = .5 * (receive_time - sent_time);
+    double aged_rtt = (sent_time - s->min_rtt_time) * RTT_AGE;
+    if (half_rtt < s->min_half_rtt + aged_rtt) {
+        s->min_half_rtt = half_rtt;
+        s->min_rtt_time = sent_time;
+    }
+    // Filter out samples that are extreme outliers
+    double exp_clock = ((sent_time - s->time_avg) * s->est_freq
+                        + s->clock_avg);
+    double clock_diff = (double)clock - exp_clock;
+    double clock_diff2 = clock_diff * clock_diff;
+    double max_diff = .000500 * cs->mcu_freq;
+    if (clock_diff2 > 25. * s->prediction_variance
+        && clock_diff2 > max_diff * max_diff) {
+        if (clock_diff > 0. && sent_time < s->last_prediction_time + 10.)
+            // Ignore clock sample
+            return;
+        // Reset prediction variance
+        double reset_stddev = .001 * cs->mcu_freq;
+        s->prediction_variance = reset_stddev * reset_stddev;
+        s->reset_count++;
+    } else {
+        s->last_prediction_time = sent_time;
+        s->prediction_variance = ((1. - DECAY) * (s->prediction_variance
+                                                  + clock_diff2 * DECAY));
+    }
+    // Add clock and sent_time to linear regression
+    double diff_sent_time = sent_time - s->time_avg;
+    s->time_avg += DECAY * diff_sent_time;
+    s->time_variance = (1. - DECAY) * (
+        s->time_variance + diff_sent_time * diff_sent_time * DECAY);
+    double diff_clock = (double)clock - s->clock_avg;
+    s->clock_avg += DECAY * diff_clock;
+    s->clock_covariance = (1. - DECAY) * (
+        s->clock_covariance + diff_sent_time * diff_clock * DECAY);
+    // Update prediction from linear regression
+    double new_freq = s->clock_covariance / s->time_variance;
+    double pred_stddev = sqrt(s->prediction_variance);
+    serialqueue_set_clock_est(cs->sq, new_freq, s->time_avg + TRANSMIT_EXTRA
+                              , (uint64_t)(s->clock_avg - 3. * pred_stddev)
+                              , clock);
+    s->est_time = s->time_avg + s->min_half_rtt;
+    s->est_clock = s->clock_avg;
+    s->est_freq = new_freq;
+}
+
+// Handle a clock message (callback from serialqueue fastreader)
+static void
+handle_clock(struct fastreader *fr, uint8_t *data, int len)
+{
+    struct clocksync *cs = container_of(fr, struct clocksync, fr);
+
+    // Parse: clock clock=%u
+    uint32_t fields[2];
+    int ret = msgblock_decode(fields, ARRAY_SIZE(fields), data, len);
+    if (ret)
+        return;
+
+    pthread_mutex_lock(&cs->lock);
+    clocksync_add_sample(cs, fields[1], fr->sent_time, fr->receive_time);
+    pthread_mutex_unlock(&cs->lock);
+}
+
+// Set the initial clock estimate and start processing clock messages
+void __visible
+clocksync_start(struct clocksync *cs, double sent_time, uint64_t clock
+                , int startup_samples)
+{
+    pthread_mutex_lock(&cs->lock);
+    struct clocksync_state *s = &cs->s;
+    memset(s, 0, sizeof(*s));
+    s->last_clock = clock;
+    s->clock_avg = s->est_clock = clock;
+    s->time_avg = s->est_time = sent_time;
+    s->est_freq = cs->mcu_freq;
+    s->min_half_rtt = 999999999.9;
+    double reset_stddev = .001 * cs->mcu_freq;
+    s->prediction_variance = reset_stddev * reset_stddev;
+    cs->startup_samples = startup_samples;
+    pthread_mutex_unlock(&cs->lock);
+
+    if (!cs->is_active) {
+        cs->is_active = 1;
+        serialqueue_add_fastreader(cs->sq, &cs->fr);
+    }
+}
+
+// Return the current regression state
+void __visible
+clocksync_get_state(struct clocksync *cs, struct clocksync_state *state)
+{
+    pthread_mutex_lock(&cs->lock);
+    memcpy(state, &cs->s, sizeof(*state));
+    pthread_mutex_unlock(&cs->lock);
+}
+
+// Create a new 'struct clocksync' object
+struct clocksync * __visible
+clocksync_alloc(struct serialqueue *sq, uint32_t clock_msgtag
+                , double mcu_freq)
+{
+    struct clocksync *cs = malloc(sizeof(*cs));
+    memset(cs, 0, sizeof(*cs));
+    cs->sq = sq;
+    cs->mcu_freq = mcu_freq;
+
+    int ret = pthread_mutex_init(&cs->lock, NULL);
+    if (ret) {
+        report_errno("clocksync_alloc pthread_mutex_init", ret);
+        free(cs);
+        return NULL;
+    }
+
+    // Setup fastreader to match clock messages (python code is also
+    // notified of them so that it can track pending queries)
+    uint32_t clock_prefix[] = {clock_msgtag};
+    struct queue_message *dummy = message_alloc_and_encode(
+        clock_prefix, ARRAY_SIZE(clock_prefix));
+    memcpy(cs->fr.prefix, dummy->msg, dummy->len);
+    cs->fr.prefix_len = dummy->len;
+    free(dummy);
+    cs->fr.func = handle_clock;
+
+    return cs;
+}
+
+// Free memory associated with a 'struct clocksync' object
+void __visible
+clocksync_free(struct clocksync *cs)
+{
+    if (!cs)
+        return;
+    if (cs->is_active)
+        serialqueue_rm_fastreader(cs->sq, &cs->fr);
+    free(cs);
+}
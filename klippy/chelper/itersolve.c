@@ -4,7 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <math.h> // fabs
+#include <math.h> // fabs, sqrt
 #include <stddef.h> // offsetof
 #include <string.h> // memset
 #include "compiler.h" // __visible
@@ -24,10 +24,44 @@ struct timepos {
 
 #define SEEK_TIME_RESET 0.000100
 
+// Kinematics that provide a calc_positions_cb callback calculate the
+// upcoming times of an exponential search together.  The search times
+// only depend on the time of the last step, so the search results are
+// identical to evaluating each time individually.
+#define SEARCH_BATCH 4
+
+struct search_batch {
+    int count, next;
+    double times[SEARCH_BATCH], positions[SEARCH_BATCH];
+};
+
+// Return the stepper position at a time of the exponential search
+static double
+search_batch_position(struct stepper_kinematics *sk, struct move *m
+                      , struct search_batch *sb, double time
+                      , double last_time, double end)
+{
+    if (sb->next < sb->count && sb->times[sb->next] == time)
+        return sb->positions[sb->next++];
+    int count = 0;
+    for (;;) {
+        sb->times[count++] = time;
+        if (count >= SEARCH_BATCH || time >= end)
+            break;
+        time = 2. * time - last_time;
+        if (time > end)
+            time = end;
+    }
+    sb->count = count;
+    sb->next = 1;
+    sk->calc_positions_cb(sk, m, sb->times, sb->positions, count);
+    return sb->positions[0];
+}
+
 // Generate step times for a portion of a move
 static int32_t
-itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
-                          , double abs_start, double abs_end)
+itersolve_gen_steps_iter(struct stepper_kinematics *sk, struct move *m
+                         , double abs_start, double abs_end)
 {
     sk_calc_callback calc_position_cb = sk->calc_position_cb;
     double half_step = .5 * sk->step_dist;
@@ -43,12 +77,22 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
     double last_time=start, low_time=start, high_time=start + SEEK_TIME_RESET;
     if (high_time > end)
         high_time = end;
+    int use_batch = sk->calc_positions_cb != NULL, is_search;
+    struct search_batch sb = { .count = 0 };
+    double last_interval = 0., predict_time = 0.;
     for (;;) {
         // Use the "secant method" to guess a new time from previous guesses
         double guess_dist = guess.position - target;
         double og_dist = old_guess.position - target;
         double next_time = ((old_guess.time*guess_dist - guess.time*og_dist)
                             / (guess_dist - og_dist));
+        if (predict_time) {
+            // Start from the time predicted by the previous step times
+            if (predict_time > low_time && predict_time < high_time)
+                next_time = predict_time;
+            predict_time = 0.;
+        }
+        is_search = 0;
         if (!(next_time > low_time && next_time < high_time)) { // or NaN
             // Next guess is outside bounds checks - validate it
             if (have_bracket) {
@@ -64,12 +108,17 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
                 high_time = 2. * high_time - last_time;
                 if (high_time > end)
                     high_time = end;
+                is_search = use_batch;
             }
         }
         // Calculate position at next_time guess
         old_guess = guess;
         guess.time = next_time;
-        guess.position = calc_position_cb(sk, m, next_time);
+        if (is_search)
+            guess.position = search_batch_position(sk, m, &sb, next_time
+                                                   , last_time, end);
+        else
+            guess.position = calc_position_cb(sk, m, next_time);
         guess_dist = guess.position - target;
         if (fabs(guess_dist) > .000000001) {
             // Guess does not look close enough - update bounds
@@ -110,7 +159,8 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
             return ret;
         target = sdir ? target+half_step+half_step : target-half_step-half_step;
         // Reset bounds checking
-        double seek_time_delta = 1.5 * (guess.time - last_time);
+        double interval = guess.time - last_time;
+        double seek_time_delta = 1.5 * interval;
         if (seek_time_delta < .000000001)
             seek_time_delta = .000000001;
         if (is_dir_change && seek_time_delta > SEEK_TIME_RESET)
@@ -119,6 +169,10 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
         high_time = guess.time + seek_time_delta;
         if (high_time > end)
             high_time = end;
+        // Predict the next step time from the change in step intervals
+        if (last_interval && !is_dir_change)
+            predict_time = guess.time + 2. * interval - last_interval;
+        last_interval = is_dir_change ? 0. : interval;
         is_dir_change = have_bracket = check_oscillate = 0;
     }
     sk->commanded_pos = target - (sdir ? half_step : -half_step);
@@ -128,6 +182,90 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
 }
 
 
+/****************************************************************
+ * Closed-form solver for linear kinematics
+ ****************************************************************/
+
+// Return the time a move takes to travel the given distance
+static inline double
+calc_move_time(struct move *m, double dist)
+{
+    if (dist <= 0.)
+        return 0.;
+    double start_v = m->start_v, half_accel = m->half_accel;
+    if (!half_accel)
+        return start_v ? dist / start_v : 0.;
+    // Solve "half_accel*t^2 + start_v*t - dist = 0" for smallest t >= 0
+    double disc = start_v*start_v + 4. * half_accel * dist;
+    if (disc < 0.)
+        disc = 0.;
+    return 2. * dist / (start_v + sqrt(disc));
+}
+
+// Generate step times for a portion of a move on a stepper whose
+// position is "base + ratio * move_distance".  Within a move the
+// distance never decreases, so the step times can be calculated
+// directly instead of searched for.
+static int32_t
+itersolve_gen_steps_linear(struct stepper_kinematics *sk, struct move *m
+                           , double abs_start, double abs_end)
+{
+    double start = abs_start - m->print_time, end = abs_end - m->print_time;
+    if (start < 0.)
+        start = 0.;
+    if (end > m->move_t)
+        end = m->move_t;
+    // Determine the linear coefficients of the stepper position
+    sk_calc_callback calc_position_cb = sk->calc_position_cb;
+    struct move lm = *m;
+    lm.start_v = 1.;
+    lm.half_accel = 0.;
+    double base = calc_position_cb(sk, m, 0.);
+    double ratio = calc_position_cb(sk, &lm, 1.) - base;
+    double end_pos = base + ratio * move_get_distance(m, end);
+    // Generate steps
+    int sdir = stepcompress_get_step_dir(sk->sc), mdir = ratio > 0.;
+    double step = mdir ? sk->step_dist : -sk->step_dist;
+    double commanded_pos = sk->commanded_pos;
+    if (ratio && end > start)
+        for (;;) {
+            double target = commanded_pos + .5 * step;
+            double rel_dist = mdir ? end_pos - target : target - end_pos;
+            if (rel_dist < -.000000001)
+                break;
+            double step_time = calc_move_time(m, (target - base) / ratio);
+            if (!(step_time > start))
+                step_time = start;
+            if (step_time > end)
+                step_time = end;
+            int ret = stepcompress_append(sk->sc, mdir, m->print_time
+                                          , step_time);
+            if (ret)
+                return ret;
+            commanded_pos += step;
+            sdir = mdir;
+        }
+    // Avoid rollback if stepper fully reaches step position
+    double rel_dist = sdir ? end_pos - commanded_pos : commanded_pos - end_pos;
+    if (rel_dist >= 0.)
+        stepcompress_commit(sk->sc);
+    sk->commanded_pos = commanded_pos;
+    if (sk->post_cb)
+        sk->post_cb(sk);
+    return 0;
+}
+
+// Generate step times for a portion of a move
+static int32_t
+itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
+                          , double abs_start, double abs_end)
+{
+    if (sk->kin_flags & SKF_LINEAR)
+        return itersolve_gen_steps_linear(sk, m, abs_start, abs_end);
+    return itersolve_gen_steps_iter(sk, m, abs_start, abs_end);
+}
+
+
 /****************************************************************
  * Interface functions
  ****************************************************************/
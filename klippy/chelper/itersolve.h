@@ -7,10 +7,18 @@ enum {
     AF_X = 1 << 0, AF_Y = 1 << 1, AF_Z = 1 << 2,
 };
 
+enum {
+    // Stepper position is a linear function of the move distance
+    SKF_LINEAR = 1 << 0,
+};
+
 struct stepper_kinematics;
 struct move;
 typedef double (*sk_calc_callback)(struct stepper_kinematics *sk, struct move *m
                                    , double move_time);
+typedef void (*sk_calc_batch_callback)(struct stepper_kinematics *sk
+                                       , struct move *m, double *move_times
+                                       , double *positions, int count);
 typedef void (*sk_post_callback)(struct stepper_kinematics *sk);
 struct stepper_kinematics {
     double step_dist, commanded_pos;
@@ -18,10 +26,12 @@ struct stepper_kinematics {
 
     double last_flush_time, last_move_time;
     struct trapq *tq;
-    int active_flags;
+    int active_flags, kin_flags;
     double gen_steps_pre_active, gen_steps_post_active;
 
     sk_calc_callback calc_position_cb;
+    // Optional - calculate the positions at several times in a move
+    sk_calc_batch_callback calc_positions_cb;
     sk_post_callback post_cb;
 };
 
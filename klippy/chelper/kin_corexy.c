@@ -36,5 +36,6 @@ corexy_stepper_alloc(char type)
     else if (type == '-')
         sk->calc_position_cb = corexy_stepper_minus_calc_position;
     sk->active_flags = AF_X | AF_Y;
+    sk->kin_flags = SKF_LINEAR;
     return sk;
 }
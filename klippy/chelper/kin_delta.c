@@ -4,7 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <math.h> // sqrt
+#include <math.h> // sqrt, fabs
 #include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
@@ -15,18 +15,115 @@
 struct delta_stepper {
     struct stepper_kinematics sk;
     double arm2, tower_x, tower_y;
+    // Cubic interpolation of the carriage position (if max_error set)
+    double max_error;
+    struct move *cache_m;
+    double cache_print_time, cache_start, cache_end;
+    double c0, c1, c2, c3;
 };
 
+// Calculate the carriage position and velocity at the given time
+static double
+delta_calc_carriage(struct delta_stepper *ds, struct move *m
+                    , double move_time, double *velocity)
+{
+    struct coord c = move_get_coord(m, move_time);
+    double dx = ds->tower_x - c.x, dy = ds->tower_y - c.y;
+    double arm_z = sqrt(ds->arm2 - dx*dx - dy*dy);
+    double v = m->start_v + 2. * m->half_accel * move_time;
+    *velocity = ((dx * m->axes_r.x + dy * m->axes_r.y) * v / arm_z
+                 + m->axes_r.z * v);
+    return arm_z + c.z;
+}
+
+// Time span covered by each interpolation (and the minimum span tried)
+#define INTERP_TIME .010
+#define MIN_INTERP_TIME .0005
+
+// Check the interpolation error at a few points within the span (the
+// error between the checked points may be slightly larger, so only
+// half of max_error is allowed at the checked points)
+static int
+delta_check_interp(struct delta_stepper *ds, struct move *m, double move_time
+                   , double span, double c0, double c1, double c2, double c3)
+{
+    double max_error = .5 * ds->max_error;
+    int i;
+    for (i = 1; i < 4; i++) {
+        double v, t = span * i * .25;
+        double p = delta_calc_carriage(ds, m, move_time + t, &v);
+        if (fabs(c0 + (c1 + (c2 + c3 * t) * t) * t - p) > max_error)
+            return 0;
+    }
+    return 1;
+}
+
+// The carriage position is smooth within a move, so it is replaced by
+// a cubic Hermite interpolation between two nearby times.  The
+// interpolation is only used if its error at the checked points is
+// within max_error.
+static int
+delta_update_interp(struct delta_stepper *ds, struct move *m
+                    , double move_time)
+{
+    double v0, v1;
+    double p0 = delta_calc_carriage(ds, m, move_time, &v0);
+    double span = m->move_t - move_time;
+    if (span > INTERP_TIME)
+        span = INTERP_TIME;
+    for (; span >= MIN_INTERP_TIME; span *= .5) {
+        double p1 = delta_calc_carriage(ds, m, move_time + span, &v1);
+        double slope = (p1 - p0) / span, inv_span = 1. / span;
+        double c2 = (3. * slope - 2. * v0 - v1) * inv_span;
+        double c3 = (v0 + v1 - 2. * slope) * inv_span * inv_span;
+        if (!delta_check_interp(ds, m, move_time, span, p0, v0, c2, c3))
+            continue;
+        ds->cache_m = m;
+        ds->cache_print_time = m->print_time;
+        ds->cache_start = move_time;
+        ds->cache_end = move_time + span;
+        ds->c0 = p0;
+        ds->c1 = v0;
+        ds->c2 = c2;
+        ds->c3 = c3;
+        return 0;
+    }
+    return -1;
+}
+
 static double
 delta_stepper_calc_position(struct stepper_kinematics *sk, struct move *m
                             , double move_time)
 {
     struct delta_stepper *ds = container_of(sk, struct delta_stepper, sk);
+    if (ds->max_error) {
+        if (likely(m == ds->cache_m && move_time >= ds->cache_start
+                   && move_time <= ds->cache_end
+                   && m->print_time == ds->cache_print_time)) {
+            double t = move_time - ds->cache_start;
+            return ds->c0 + (ds->c1 + (ds->c2 + ds->c3 * t) * t) * t;
+        }
+        // Stationary moves (such as those from input shaping) are
+        // always calculated directly
+        if ((m->start_v || m->half_accel) && move_time < m->move_t
+            && !delta_update_interp(ds, m, move_time))
+            return ds->c0;
+    }
     struct coord c = move_get_coord(m, move_time);
     double dx = ds->tower_x - c.x, dy = ds->tower_y - c.y;
     return sqrt(ds->arm2 - dx*dx - dy*dy) + c.z;
 }
 
+// Allow the carriage position to be interpolated within max_error
+void __visible
+delta_stepper_set_interpolation(struct stepper_kinematics *sk
+                                , double max_error)
+{
+    struct delta_stepper *ds = container_of(sk, struct delta_stepper, sk);
+    ds->max_error = max_error;
+    ds->cache_m = NULL;
+}
+
 struct stepper_kinematics * __visible
 delta_stepper_alloc(double arm2, double tower_x, double tower_y)
 {
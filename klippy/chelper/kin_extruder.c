@@ -14,7 +14,7 @@
 #include "trapq.h" // move_get_distance
 
 struct pa_params {
-    double pressure_advance, active_print_time;
+    double pressure_advance, pressure_advance_quad, active_print_time;
     struct list_node node;
 };
 
@@ -24,7 +24,11 @@ struct pa_params {
 // into the extruder during acceleration (and retracted during
 // deceleration). The formula is:
 //     pa_position(t) = (nominal_position(t)
-//                       + pressure_advance * nominal_velocity(t))
+//                       + pressure_advance * nominal_velocity(t)
+//                       + pressure_advance_quad * nominal_velocity(t)**2)
+// The optional quadratic term makes the amount of advance depend on
+// the extrusion velocity.  As the nominal velocity is linear within a
+// move, pa_position(t) remains a quadratic function of time.
 // Which is then "smoothed" using a weighted average:
 //     smooth_position(t) = (
 //         definitive_integral(pa_position(x) * (smooth_time/2 - abs(t-x)) * dx,
@@ -56,10 +60,10 @@ extruder_integrate_time(double base, double start_v, double half_accel
     return ei - si;
 }
 
-// Calculate the definitive integral of extruder for a given move
-static double
-pa_move_integrate(struct move *m, struct list_head *pa_list
-                  , double base, double start, double end, double time_offset)
+// Calculate the definitive integrals of extruder for a given move
+static void
+pa_move_integrals(struct move *m, struct list_head *pa_list, double base
+                  , double start, double end, double *iext, double *wgt_ext)
 {
     if (start < 0.)
         start = 0.;
@@ -67,7 +71,7 @@ pa_move_integrate(struct move *m, struct list_head *pa_list
         end = m->move_t;
     // Determine pressure_advance value
     int can_pressure_advance = m->axes_r.y != 0.;
-    double pressure_advance = 0.;
+    double pressure_advance = 0., pa_quad = 0.;
     if (can_pressure_advance) {
         struct pa_params *pa = list_last_entry(pa_list, struct pa_params, node);
         while (unlikely(pa->active_print_time > m->print_time) &&
@@ -75,52 +79,229 @@ pa_move_integrate(struct move *m, struct list_head *pa_list
             pa = list_prev_entry(pa, node);
         }
         pressure_advance = pa->pressure_advance;
+        pa_quad = pa->pressure_advance_quad;
     }
-    // Calculate base position and velocity with pressure advance
-    base += pressure_advance * m->start_v;
-    double start_v = m->start_v + pressure_advance * 2. * m->half_accel;
+    // Calculate base position, velocity, and half accel with pressure advance
+    double sv = m->start_v, ha = m->half_accel;
+    base += (pressure_advance + pa_quad * sv) * sv;
+    double start_v = sv + (pressure_advance + 2. * pa_quad * sv) * 2. * ha;
+    ha += pa_quad * 4. * ha * ha;
     // Calculate definitive integral
-    double ha = m->half_accel;
-    double iext = extruder_integrate(base, start_v, ha, start, end);
-    double wgt_ext = extruder_integrate_time(base, start_v, ha, start, end);
+    *iext = extruder_integrate(base, start_v, ha, start, end);
+    *wgt_ext = extruder_integrate_time(base, start_v, ha, start, end);
+}
+
+// Calculate the definitive integral of extruder for a given move
+static double
+pa_move_integrate(struct move *m, struct list_head *pa_list
+                  , double base, double start, double end, double time_offset)
+{
+    double iext, wgt_ext;
+    pa_move_integrals(m, pa_list, base, start, end, &iext, &wgt_ext);
+    return wgt_ext - time_offset * iext;
+}
+
+// The integrals of the moves surrounding the current move are cached
+// so that each evaluation only needs to integrate the moves at the
+// edges of the smoothing window.  The cache holds a sequence of
+// consecutive moves along with running sums of their integrals.  Times
+// are relative to the start of the first cached move and positions are
+// relative to the start position of that move.
+#define PA_CACHE_SIZE 256
+#define PA_CACHE_MAX_TIME 1.0
+
+struct pa_cache_entry {
+    struct move *m;
+    double print_time, start, sum_int, sum_wgt;
+};
+
+struct pa_range_cache {
+    double flush_time, base;
+    int count, last;
+    // Entry 'count' only holds the end time and sums of the last move
+    struct pa_cache_entry e[PA_CACHE_SIZE + 1];
+};
+
+// Add a move to the end of the cache
+static void
+pa_cache_append(struct pa_range_cache *rc, struct move *m
+                , struct list_head *pa_list)
+{
+    struct pa_cache_entry *e = &rc->e[rc->count++], *ne = e + 1;
+    e->m = m;
+    e->print_time = m->print_time;
+    double iext, wgt_ext, base = m->start_pos.x - rc->base;
+    pa_move_integrals(m, pa_list, base, 0., m->move_t, &iext, &wgt_ext);
+    ne->start = e->start + m->move_t;
+    ne->sum_int = e->sum_int + iext;
+    ne->sum_wgt = e->sum_wgt + wgt_ext + e->start * iext;
+}
+
+// Refill the cache starting with the first move of a smoothing window
+static int
+pa_cache_reset(struct pa_range_cache *rc, struct move *m, double start
+               , struct list_head *pa_list)
+{
+    struct move *fm = m;
+    int count = 1;
+    while (start < 0. && count < PA_CACHE_SIZE) {
+        fm = list_prev_entry(fm, node);
+        start += fm->move_t;
+        count++;
+    }
+    rc->base = fm->start_pos.x;
+    rc->count = 0;
+    rc->e[0].start = rc->e[0].sum_int = rc->e[0].sum_wgt = 0.;
+    for (;;) {
+        pa_cache_append(rc, fm, pa_list);
+        if (fm == m)
+            break;
+        fm = list_next_entry(fm, node);
+    }
+    return rc->last = rc->count - 1;
+}
+
+// Find the cache index of a move (or -1 if not cached)
+static int
+pa_cache_find(struct pa_range_cache *rc, struct move *m)
+{
+    int i;
+    for (i = rc->last; i < rc->count; i++)
+        if (rc->e[i].m == m && rc->e[i].print_time == m->print_time)
+            return rc->last = i;
+    for (i = rc->last - 1; i >= 0; i--)
+        if (rc->e[i].m == m && rc->e[i].print_time == m->print_time)
+            return rc->last = i;
+    return -1;
+}
+
+// Calculate the definitive integral of the cached moves in a range
+static double
+pa_cache_integrate(struct pa_range_cache *rc, int first, int last
+                   , double base, double time_offset)
+{
+    struct pa_cache_entry *fe = &rc->e[first], *le = &rc->e[last];
+    double fs = fe->start, ls = le->start;
+    double iext = le->sum_int - fe->sum_int - base * (ls - fs);
+    double wgt_ext = (le->sum_wgt - fe->sum_wgt
+                      - base * .5 * (ls * ls - fs * fs));
     return wgt_ext - time_offset * iext;
 }
 
 // Calculate the definitive integral of the extruder over a range of moves
 static double
 pa_range_integrate(struct move *m, double move_time
-                   , struct list_head *pa_list, double hst)
+                   , struct list_head *pa_list, double hst
+                   , struct pa_range_cache *rc)
 {
     // Calculate integral for the current move
     double res = 0., start = move_time - hst, end = move_time + hst;
     double start_base = m->start_pos.x;
     res += pa_move_integrate(m, pa_list, 0., start, move_time, start);
     res -= pa_move_integrate(m, pa_list, 0., move_time, end, end);
+    if (likely(start >= 0. && end <= m->move_t))
+        return res;
+    // Locate the current move in the cache
+    int im = pa_cache_find(rc, m);
+    if (im < 0 || rc->e[im].start > PA_CACHE_MAX_TIME
+        || (rc->count >= PA_CACHE_SIZE && im
+            && end + rc->e[im].start > rc->e[rc->count].start))
+        im = pa_cache_reset(rc, m, start, pa_list);
+    double offset = rc->e[im].start, base = start_base - rc->base;
     // Integrate over previous moves
-    struct move *prev = m;
-    while (unlikely(start < 0.)) {
-        prev = list_prev_entry(prev, node);
-        start += prev->move_t;
-        double base = prev->start_pos.x - start_base;
-        res += pa_move_integrate(prev, pa_list, base, start
-                                 , prev->move_t, start);
+    if (unlikely(start < 0.)) {
+        double cache_start = start + offset;
+        int lo = 0, hi = im;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (rc->e[mid].start >= cache_start)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        res += pa_cache_integrate(rc, lo, im, base, cache_start);
+        struct move *prev = rc->e[lo].m;
+        double prev_start = rc->e[lo].start;
+        while (cache_start < prev_start) {
+            prev = list_prev_entry(prev, node);
+            prev_start -= prev->move_t;
+            double pbase = prev->start_pos.x - start_base;
+            res += pa_move_integrate(prev, pa_list, pbase
+                                     , cache_start - prev_start, prev->move_t
+                                     , cache_start - prev_start);
+        }
     }
     // Integrate over future moves
-    while (unlikely(end > m->move_t)) {
-        end -= m->move_t;
-        m = list_next_entry(m, node);
-        double base = m->start_pos.x - start_base;
-        res -= pa_move_integrate(m, pa_list, base, 0., end, end);
+    if (unlikely(end > m->move_t)) {
+        double cache_end = end + offset;
+        while (rc->e[rc->count].start < cache_end && rc->count < PA_CACHE_SIZE)
+            pa_cache_append(rc, list_next_entry(rc->e[rc->count-1].m, node)
+                            , pa_list);
+        int lo = im + 1, hi = rc->count;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (rc->e[mid].start <= cache_end)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        res -= pa_cache_integrate(rc, im + 1, lo, base, cache_end);
+        struct move *next = rc->e[lo-1].m;
+        double next_end = rc->e[lo].start;
+        while (cache_end > next_end) {
+            double next_start = next_end;
+            next = list_next_entry(next, node);
+            next_end += next->move_t;
+            double nbase = next->start_pos.x - start_base;
+            res -= pa_move_integrate(next, pa_list, nbase, 0.
+                                     , cache_end - next_start
+                                     , cache_end - next_start);
+        }
     }
     return res;
 }
 
+// An optional flow correction (eg, from a filament width sensor)
+// scales the extruder stepper motion by 'factor' once the nominal
+// extruder position reaches 'start_pos'.  The stepper position is a
+// continuous piecewise linear function of the nominal position:
+//     flow_position(pos) = offset + factor * pos
+// Entries are keyed by position (not time) so a correction measured
+// ahead of the nozzle is applied when that filament is extruded.
+struct flow_params {
+    double start_pos, offset, factor;
+    struct list_node node;
+};
+
+// Entries are freed once the extruder has moved past them this far
+#define FLOW_CLEANUP_DIST 100.
+
 struct extruder_stepper {
     struct stepper_kinematics sk;
     struct list_head pa_list;
     double half_smooth_time, inv_half_smooth_time2;
+    struct pa_range_cache range_cache;
+    struct list_head flow_list;
+    double flow_max_pos;
 };
 
+// Apply the flow correction to a nominal extruder position
+static double
+extruder_flow_position(struct extruder_stepper *es, double pos)
+{
+    if (pos > es->flow_max_pos)
+        es->flow_max_pos = pos;
+    struct flow_params *fp = list_last_entry(
+            &es->flow_list, struct flow_params, node);
+    if (likely(list_is_first(&fp->node, &es->flow_list) && fp->factor == 1.
+               && !fp->offset))
+        return pos;
+    while (unlikely(pos < fp->start_pos)
+           && !list_is_first(&fp->node, &es->flow_list))
+        fp = list_prev_entry(fp, node);
+    return fp->offset + fp->factor * pos;
+}
+
 static double
 extruder_calc_position(struct stepper_kinematics *sk, struct move *m
                        , double move_time)
@@ -129,20 +310,75 @@ extruder_calc_position(struct stepper_kinematics *sk, struct move *m
     double hst = es->half_smooth_time;
     if (!hst)
         // Pressure advance not enabled
-        return m->start_pos.x + move_get_distance(m, move_time);
+        return extruder_flow_position(
+            es, m->start_pos.x + move_get_distance(m, move_time));
     // Apply pressure advance and average over smooth_time
-    double area = pa_range_integrate(m, move_time, &es->pa_list, hst);
-    return m->start_pos.x + area * es->inv_half_smooth_time2;
+    if (es->range_cache.flush_time != sk->last_flush_time) {
+        // Cached moves may have been freed since the last step generation
+        es->range_cache.flush_time = sk->last_flush_time;
+        es->range_cache.count = 0;
+    }
+    double area = pa_range_integrate(m, move_time, &es->pa_list, hst
+                                     , &es->range_cache);
+    return extruder_flow_position(
+        es, m->start_pos.x + area * es->inv_half_smooth_time2);
+}
+
+// Scale extrusion by 'factor' starting at nominal extruder position
+// 'pos' (any pending corrections at or after 'pos' are discarded)
+void __visible
+extruder_set_flow_factor(struct stepper_kinematics *sk, double pos
+                         , double factor)
+{
+    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
+    // Positions that have already been generated can not be changed
+    if (pos < es->flow_max_pos)
+        pos = es->flow_max_pos;
+    struct flow_params *last_fp = list_last_entry(
+            &es->flow_list, struct flow_params, node);
+    while (last_fp->start_pos >= pos
+           && !list_is_first(&last_fp->node, &es->flow_list)) {
+        struct flow_params *prev_fp = list_prev_entry(last_fp, node);
+        list_del(&last_fp->node);
+        free(last_fp);
+        last_fp = prev_fp;
+    }
+    // Cleanup old flow parameters
+    double cleanup_pos = es->flow_max_pos - FLOW_CLEANUP_DIST;
+    struct flow_params *first_fp = list_first_entry(
+            &es->flow_list, struct flow_params, node);
+    while (!list_is_last(&first_fp->node, &es->flow_list)) {
+        struct flow_params *next_fp = list_next_entry(first_fp, node);
+        if (next_fp->start_pos >= cleanup_pos)
+            break;
+        list_del(&first_fp->node);
+        free(first_fp);
+        first_fp = next_fp;
+    }
+
+    if (last_fp->factor == factor)
+        // Retain old flow_params
+        return;
+    // Add new flow parameters (the stepper position remains continuous)
+    struct flow_params *fp = malloc(sizeof(*fp));
+    memset(fp, 0, sizeof(*fp));
+    fp->start_pos = pos;
+    fp->factor = factor;
+    fp->offset = last_fp->offset + (last_fp->factor - factor) * pos;
+    list_add_tail(&fp->node, &es->flow_list);
 }
 
 void __visible
 extruder_set_pressure_advance(struct stepper_kinematics *sk, double print_time
-                              , double pressure_advance, double smooth_time)
+                              , double pressure_advance
+                              , double pressure_advance_quad
+                              , double smooth_time)
 {
     struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
     double hst = smooth_time * .5, old_hst = es->half_smooth_time;
     es->half_smooth_time = hst;
     es->sk.gen_steps_pre_active = es->sk.gen_steps_post_active = hst;
+    es->range_cache.count = 0;
 
     // Cleanup old pressure advance parameters
     double cleanup_time = sk->last_flush_time - (old_hst > hst ? old_hst : hst);
@@ -159,8 +395,10 @@ extruder_set_pressure_advance(struct stepper_kinematics *sk, double print_time
         return;
     es->inv_half_smooth_time2 = 1. / (hst * hst);
 
-    if (list_last_entry(&es->pa_list, struct pa_params, node)->pressure_advance
-            == pressure_advance) {
+    struct pa_params *last_pa = list_last_entry(
+            &es->pa_list, struct pa_params, node);
+    if (last_pa->pressure_advance == pressure_advance
+        && last_pa->pressure_advance_quad == pressure_advance_quad) {
         // Retain old pa_params
         return;
     }
@@ -168,6 +406,7 @@ extruder_set_pressure_advance(struct stepper_kinematics *sk, double print_time
     struct pa_params *pa = malloc(sizeof(*pa));
     memset(pa, 0, sizeof(*pa));
     pa->pressure_advance = pressure_advance;
+    pa->pressure_advance_quad = pressure_advance_quad;
     pa->active_print_time = print_time;
     list_add_tail(&pa->node, &es->pa_list);
 }
@@ -183,6 +422,12 @@ extruder_stepper_alloc(void)
     struct pa_params *pa = malloc(sizeof(*pa));
     memset(pa, 0, sizeof(*pa));
     list_add_tail(&pa->node, &es->pa_list);
+    list_init(&es->flow_list);
+    struct flow_params *fp = malloc(sizeof(*fp));
+    memset(fp, 0, sizeof(*fp));
+    fp->factor = 1.;
+    list_add_tail(&fp->node, &es->flow_list);
+    es->flow_max_pos = -1e30;
     return &es->sk;
 }
 
@@ -196,5 +441,11 @@ extruder_stepper_free(struct stepper_kinematics *sk)
         list_del(&pa->node);
         free(pa);
     }
+    while (!list_empty(&es->flow_list)) {
+        struct flow_params *fp = list_first_entry(
+                &es->flow_list, struct flow_params, node);
+        list_del(&fp->node);
+        free(fp);
+    }
     free(sk);
 }
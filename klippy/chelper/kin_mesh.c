@@ -0,0 +1,244 @@
+// Bed mesh z compensation applied during step generation
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Instead of splitting each xy move into many short moves (so that
+// the z height can follow the bed mesh), the trapq holds the
+// uncompensated move and the mesh offset is added to the z
+// coordinate when a stepper position is calculated.  Each stepper
+// that depends on the z axis is wrapped with a 'mesh_stepper' which
+// forwards the adjusted position to the original kinematics.
+
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "itersolve.h" // struct stepper_kinematics
+#include "trapq.h" // struct move
+
+
+/****************************************************************
+ * Mesh table
+ ****************************************************************/
+
+// The mesh is stored as a set of bilinear coefficients for each grid
+// cell (z = a + b*tx + c*ty + d*tx*ty)
+struct cell_coefs {
+    double a, b, c, d;
+};
+
+struct bed_mesh_table {
+    int x_count, y_count;
+    double x_min, y_min, x_dist, y_dist, inv_x_dist, inv_y_dist;
+    double x_offset, y_offset;
+    double fade_start, fade_end, fade_target, tool_offset;
+    struct cell_coefs *cells;
+};
+
+static inline double
+constrain(double val, double min_val, double max_val)
+{
+    return val < min_val ? min_val : (val > max_val ? max_val : val);
+}
+
+// Find the grid index and interpolation factor along one axis
+static inline int
+linear_index(double coord, double min, double dist, double inv_dist
+             , int count, double *t)
+{
+    int idx = (coord - min) * inv_dist;
+    if (coord < min)
+        idx = 0;
+    if (idx > count - 2)
+        idx = count - 2;
+    *t = constrain((coord - (min + dist * idx)) * inv_dist, 0., 1.);
+    return idx;
+}
+
+// Bilinear interpolation of the mesh at the given xy position
+double __visible
+bed_mesh_calc_z(struct bed_mesh_table *bm, double x, double y)
+{
+    if (!bm->cells)
+        return 0.;
+    double tx, ty;
+    int xidx = linear_index(x + bm->x_offset, bm->x_min, bm->x_dist
+                            , bm->inv_x_dist, bm->x_count, &tx);
+    int yidx = linear_index(y + bm->y_offset, bm->y_min, bm->y_dist
+                            , bm->inv_y_dist, bm->y_count, &ty);
+    struct cell_coefs *cc = &bm->cells[yidx * (bm->x_count - 1) + xidx];
+    return cc->a + cc->b * tx + (cc->c + cc->d * tx) * ty;
+}
+
+// Return the z adjustment for a given (uncompensated) position
+double __visible
+bed_mesh_calc_z_adjust(struct bed_mesh_table *bm, double x, double y
+                       , double z)
+{
+    if (!bm->cells)
+        return 0.;
+    double fade_z = z + bm->tool_offset, factor = 1.;
+    if (fade_z >= bm->fade_end)
+        return bm->fade_target;
+    if (fade_z >= bm->fade_start)
+        factor = (bm->fade_end - fade_z) / (bm->fade_end - bm->fade_start);
+    double mesh_z = bed_mesh_calc_z(bm, x, y);
+    return factor * (mesh_z - bm->fade_target) + bm->fade_target;
+}
+
+// Load a new mesh (z values are ordered by row with x varying fastest)
+int __visible
+bed_mesh_set_grid(struct bed_mesh_table *bm, int x_count, int y_count
+                  , double x_min, double y_min, double x_dist
+                  , double y_dist, double *z)
+{
+    free(bm->cells);
+    bm->cells = NULL;
+    if (x_count < 2 || y_count < 2 || x_dist <= 0. || y_dist <= 0.)
+        return -1;
+    bm->cells = malloc((x_count - 1) * (y_count - 1) * sizeof(*bm->cells));
+    struct cell_coefs *cc = bm->cells;
+    int xi, yi;
+    for (yi = 0; yi < y_count - 1; yi++) {
+        double *row0 = &z[yi * x_count], *row1 = row0 + x_count;
+        for (xi = 0; xi < x_count - 1; xi++, cc++) {
+            double z00 = row0[xi], z10 = row0[xi + 1];
+            double z01 = row1[xi], z11 = row1[xi + 1];
+            cc->a = z00;
+            cc->b = z10 - z00;
+            cc->c = z01 - z00;
+            cc->d = z11 - z10 - z01 + z00;
+        }
+    }
+    bm->x_count = x_count;
+    bm->y_count = y_count;
+    bm->x_min = x_min;
+    bm->y_min = y_min;
+    bm->x_dist = x_dist;
+    bm->y_dist = y_dist;
+    bm->inv_x_dist = 1. / x_dist;
+    bm->inv_y_dist = 1. / y_dist;
+    return 0;
+}
+
+// Set the mesh offsets and z fade parameters
+void __visible
+bed_mesh_set_params(struct bed_mesh_table *bm, double x_offset
+                    , double y_offset, double fade_start, double fade_end
+                    , double fade_target, double tool_offset)
+{
+    bm->x_offset = x_offset;
+    bm->y_offset = y_offset;
+    bm->fade_start = fade_start;
+    bm->fade_end = fade_end;
+    bm->fade_target = fade_target;
+    bm->tool_offset = tool_offset;
+}
+
+struct bed_mesh_table * __visible
+bed_mesh_alloc(void)
+{
+    struct bed_mesh_table *bm = malloc(sizeof(*bm));
+    memset(bm, 0, sizeof(*bm));
+    return bm;
+}
+
+void __visible
+bed_mesh_free(struct bed_mesh_table *bm)
+{
+    if (!bm)
+        return;
+    free(bm->cells);
+    free(bm);
+}
+
+
+/****************************************************************
+ * Kinematics wrapper
+ ****************************************************************/
+
+#define DUMMY_T 500.0
+
+struct mesh_stepper {
+    struct stepper_kinematics sk;
+    struct stepper_kinematics *orig_sk;
+    struct bed_mesh_table *bm;
+    struct move m;
+};
+
+static double
+mesh_calc_position(struct stepper_kinematics *sk, struct move *m
+                   , double move_time)
+{
+    struct mesh_stepper *ms = container_of(sk, struct mesh_stepper, sk);
+    struct coord c = move_get_coord(m, move_time);
+    c.z += bed_mesh_calc_z_adjust(ms->bm, c.x, c.y, c.z);
+    ms->m.start_pos = c;
+    return ms->orig_sk->calc_position_cb(ms->orig_sk, &ms->m, DUMMY_T);
+}
+
+static double
+mesh_passthrough_calc_position(struct stepper_kinematics *sk, struct move *m
+                               , double move_time)
+{
+    struct mesh_stepper *ms = container_of(sk, struct mesh_stepper, sk);
+    return ms->orig_sk->calc_position_cb(ms->orig_sk, m, move_time);
+}
+
+// Forward post_cb calls to the original kinematics
+static void
+mesh_commanded_pos_post_fixup(struct stepper_kinematics *sk)
+{
+    struct mesh_stepper *ms = container_of(sk, struct mesh_stepper, sk);
+    ms->orig_sk->commanded_pos = sk->commanded_pos;
+    ms->orig_sk->post_cb(ms->orig_sk);
+    sk->commanded_pos = ms->orig_sk->commanded_pos;
+}
+
+// Enable or disable the mesh adjustment for a wrapped stepper
+void __visible
+mesh_stepper_set_active(struct stepper_kinematics *sk, int is_active)
+{
+    struct mesh_stepper *ms = container_of(sk, struct mesh_stepper, sk);
+    if (is_active) {
+        sk->calc_position_cb = mesh_calc_position;
+        sk->kin_flags = 0;
+    } else {
+        sk->calc_position_cb = mesh_passthrough_calc_position;
+        sk->kin_flags = ms->orig_sk->kin_flags;
+    }
+}
+
+// Wrap 'orig_sk' - the stepper position is then dependent on x and y
+int __visible
+mesh_stepper_set_sk(struct stepper_kinematics *sk
+                    , struct stepper_kinematics *orig_sk
+                    , struct bed_mesh_table *bm)
+{
+    if (!(orig_sk->active_flags & AF_Z))
+        return -1;
+    struct mesh_stepper *ms = container_of(sk, struct mesh_stepper, sk);
+    ms->orig_sk = orig_sk;
+    ms->bm = bm;
+    sk->active_flags = orig_sk->active_flags | AF_X | AF_Y;
+    sk->gen_steps_pre_active = orig_sk->gen_steps_pre_active;
+    sk->gen_steps_post_active = orig_sk->gen_steps_post_active;
+    sk->commanded_pos = orig_sk->commanded_pos;
+    sk->last_flush_time = orig_sk->last_flush_time;
+    sk->last_move_time = orig_sk->last_move_time;
+    if (orig_sk->post_cb)
+        sk->post_cb = mesh_commanded_pos_post_fixup;
+    mesh_stepper_set_active(sk, 0);
+    return 0;
+}
+
+struct stepper_kinematics * __visible
+mesh_stepper_alloc(void)
+{
+    struct mesh_stepper *ms = malloc(sizeof(*ms));
+    memset(ms, 0, sizeof(*ms));
+    ms->m.move_t = 2. * DUMMY_T;
+    return &ms->sk;
+}
@@ -19,6 +19,21 @@ polar_stepper_radius_calc_position(struct stepper_kinematics *sk, struct move *m
     return sqrt(c.x*c.x + c.y*c.y);
 }
 
+static void
+polar_stepper_radius_calc_positions(struct stepper_kinematics *sk
+                                    , struct move *m, double *move_times
+                                    , double *positions, int count)
+{
+    double sx = m->start_pos.x, rx = m->axes_r.x;
+    double sy = m->start_pos.y, ry = m->axes_r.y;
+    int i;
+    for (i = 0; i < count; i++) {
+        double move_dist = move_get_distance(m, move_times[i]);
+        double x = sx + rx * move_dist, y = sy + ry * move_dist;
+        positions[i] = sqrt(x*x + y*y);
+    }
+}
+
 static double
 polar_stepper_angle_calc_position(struct stepper_kinematics *sk, struct move *m
                                   , double move_time)
@@ -33,6 +48,26 @@ polar_stepper_angle_calc_position(struct stepper_kinematics *sk, struct move *m
     return angle;
 }
 
+static void
+polar_stepper_angle_calc_positions(struct stepper_kinematics *sk
+                                   , struct move *m, double *move_times
+                                   , double *positions, int count)
+{
+    double sx = m->start_pos.x, rx = m->axes_r.x;
+    double sy = m->start_pos.y, ry = m->axes_r.y;
+    double commanded_pos = sk->commanded_pos;
+    int i;
+    for (i = 0; i < count; i++) {
+        double move_dist = move_get_distance(m, move_times[i]);
+        double angle = atan2(sy + ry * move_dist, sx + rx * move_dist);
+        if (angle - commanded_pos > M_PI)
+            angle -= 2. * M_PI;
+        else if (angle - commanded_pos < -M_PI)
+            angle += 2. * M_PI;
+        positions[i] = angle;
+    }
+}
+
 static void
 polar_stepper_angle_post_fixup(struct stepper_kinematics *sk)
 {
@@ -50,8 +85,10 @@ polar_stepper_alloc(char type)
     memset(sk, 0, sizeof(*sk));
     if (type == 'r') {
         sk->calc_position_cb = polar_stepper_radius_calc_position;
+        sk->calc_positions_cb = polar_stepper_radius_calc_positions;
     } else if (type == 'a') {
         sk->calc_position_cb = polar_stepper_angle_calc_position;
+        sk->calc_positions_cb = polar_stepper_angle_calc_positions;
         sk->post_cb = polar_stepper_angle_post_fixup;
     }
     sk->active_flags = AF_X | AF_Y;
@@ -55,6 +55,30 @@ rotary_stepper_calc_position(struct stepper_kinematics *sk, struct move *m
                                , rs->lower_arm2 - sjz*sjz);
 }
 
+static void
+rotary_stepper_calc_positions(struct stepper_kinematics *sk, struct move *m
+                              , double *move_times, double *positions
+                              , int count)
+{
+    struct rotary_stepper *rs = container_of(sk, struct rotary_stepper, sk);
+    // Transform the move start and direction to the shoulder joint axes
+    struct coord sp = m->start_pos;
+    struct move_axes r = m->axes_r;
+    double sjz = sp.y * rs->cos - sp.x * rs->sin;
+    double sjx = sp.x * rs->cos + sp.y * rs->sin - rs->shoulder_radius;
+    double sjy = sp.z - rs->shoulder_height;
+    double rz = r.y * rs->cos - r.x * rs->sin;
+    double rx = r.x * rs->cos + r.y * rs->sin, ry = r.z;
+    int i;
+    for (i = 0; i < count; i++) {
+        double move_dist = move_get_distance(m, move_times[i]);
+        double z = sjz + rz * move_dist;
+        positions[i] = rotary_two_arm_calc(
+            sjx + rx * move_dist, sjy + ry * move_dist, rs->upper_arm2
+            , rs->lower_arm2 - z*z);
+    }
+}
+
 struct stepper_kinematics * __visible
 rotary_delta_stepper_alloc(double shoulder_radius, double shoulder_height
                            , double angle, double upper_arm, double lower_arm)
@@ -68,6 +92,7 @@ rotary_delta_stepper_alloc(double shoulder_radius, double shoulder_height
     rs->upper_arm2 = upper_arm * upper_arm;
     rs->lower_arm2 = lower_arm * lower_arm;
     rs->sk.calc_position_cb = rotary_stepper_calc_position;
+    rs->sk.calc_positions_cb = rotary_stepper_calc_positions;
     rs->sk.active_flags = AF_X | AF_Y | AF_Z;
     return &rs->sk;
 }
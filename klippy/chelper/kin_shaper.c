@@ -1,16 +1,18 @@
-// Kinematic input shapers to minimize motion vibrations in XY plane
+// Kinematic input shapers to minimize motion vibrations
 //
 // Copyright (C) 2019-2020  Kevin O'Connor <kevin@koconnor.net>
 // Copyright (C) 2020  Dmitry Butyugin <dmbutyugin@google.com>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <math.h> // sqrt, exp
+#include <math.h> // INFINITY
+#include <pthread.h> // pthread_mutex_lock
 #include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "compiler.h" // __visible
 #include "itersolve.h" // struct stepper_kinematics
+#include "pyhelper.h" // report_errno
 #include "trapq.h" // struct move
 
 
@@ -18,13 +20,42 @@
  * Shaper initialization
  ****************************************************************/
 
+#define MAX_PULSES 5
+#define MAX_COEFFS 8
+
+// While each pulse stays within the same move the shaped position is
+// a quadratic function of time.  A segment records that function
+// along with the range of move times over which it is valid.
+struct shaper_segment {
+    struct move *m;
+    double start_pos, min_time, max_time;
+    double c0, c1, c2;
+    uint32_t update_seq;
+};
+
+// Pulse times and amplitudes are stored as separate arrays (sorted by
+// time) so that all pulses can be evaluated in a single pass
 struct shaper_pulses {
     int num_pulses;
-    struct {
-        double t, a;
-    } pulses[5];
+    double t[MAX_PULSES], a[MAX_PULSES];
+    // Last move found for each pulse (relative to 'cache_m')
+    struct move *cache_m, *cache_pm[MAX_PULSES];
+    double cache_offset[MAX_PULSES];
+    // Last shaped position segment
+    struct shaper_segment seg;
+    // Polynomial smoothing kernel (used instead of pulses if num_coeffs)
+    int num_coeffs;
+    double hst, inv_hst;
+    double moments[3][MAX_COEFFS], full_moments[3];
 };
 
+// Check if the axis is shaped (by either pulses or a smoother)
+static inline int
+is_shaped(struct shaper_pulses *sp)
+{
+    return sp->num_pulses || sp->num_coeffs;
+}
+
 // Shift pulses around 'mid-point' t=0 so that the input shaper is an identity
 // transformation for constant-speed motion (i.e. input_shaper(v * T) = v * T)
 static void
@@ -33,15 +64,15 @@ shift_pulses(struct shaper_pulses *sp)
     int i;
     double ts = 0.;
     for (i = 0; i < sp->num_pulses; ++i)
-        ts += sp->pulses[i].a * sp->pulses[i].t;
+        ts += sp->a[i] * sp->t[i];
     for (i = 0; i < sp->num_pulses; ++i)
-        sp->pulses[i].t -= ts;
+        sp->t[i] -= ts;
 }
 
 static int
 init_shaper(int n, double a[], double t[], struct shaper_pulses *sp)
 {
-    if (n < 0 || n > ARRAY_SIZE(sp->pulses)) {
+    if (n < 0 || n > MAX_PULSES) {
         sp->num_pulses = 0;
         return -1;
     }
@@ -52,54 +83,337 @@ init_shaper(int n, double a[], double t[], struct shaper_pulses *sp)
     double inv_a = 1. / sum_a;
     // Reverse pulses vs their traditional definition
     for (i = 0; i < n; ++i) {
-        sp->pulses[n-i-1].a = a[i] * inv_a;
-        sp->pulses[n-i-1].t = -t[i];
+        sp->a[n-i-1] = a[i] * inv_a;
+        sp->t[n-i-1] = -t[i];
     }
     sp->num_pulses = n;
+    sp->num_coeffs = 0;
+    sp->cache_m = sp->seg.m = NULL;
     shift_pulses(sp);
     return 0;
 }
 
+// Evaluate the antiderivatives of u^j * kernel(u) (for j=0..2) at 'u'
+static inline void
+calc_moments(struct shaper_pulses *sp, double u, double res[3])
+{
+    int n = sp->num_coeffs, i, j;
+    double u_pow = u;
+    for (j = 0; j < 3; ++j) {
+        double *mc = sp->moments[j], v = 0.;
+        for (i = n - 1; i >= 0; --i)
+            v = v * u + mc[i];
+        res[j] = v * u_pow;
+        u_pow *= u;
+    }
+}
+
+// The kernel c[0] + c[1]*u + c[2]*u^2 ... is defined on u=[-1, 1] and
+// is scaled to a duration of t_sm.  It must be symmetric and integrate
+// to 1 (so that it is an identity transformation for constant speed).
+static int
+init_smoother(int n, double c[], double t_sm, struct shaper_pulses *sp)
+{
+    if (n < 0 || n > MAX_COEFFS || (n && t_sm <= 0.)) {
+        sp->num_pulses = sp->num_coeffs = 0;
+        return -1;
+    }
+    int i, j;
+    for (j = 0; j < 3; ++j)
+        for (i = 0; i < n; ++i)
+            sp->moments[j][i] = c[i] / (i + j + 1);
+    sp->num_pulses = 0;
+    sp->num_coeffs = n;
+    sp->hst = .5 * t_sm;
+    sp->inv_hst = n ? 1. / sp->hst : 0.;
+    double lo[3], hi[3];
+    calc_moments(sp, -1., lo);
+    calc_moments(sp, 1., hi);
+    for (j = 0; j < 3; ++j)
+        sp->full_moments[j] = hi[j] - lo[j];
+    sp->cache_m = sp->seg.m = NULL;
+    return 0;
+}
+
+// Return the time before and after a position that affects its shaping
+static void
+get_shaper_window(struct shaper_pulses *sp, double *pre, double *post)
+{
+    if (sp->num_coeffs) {
+        *pre = *post = sp->hst;
+    } else if (sp->num_pulses) {
+        *pre = sp->t[sp->num_pulses-1];
+        *post = -sp->t[0];
+    } else {
+        *pre = *post = 0.;
+    }
+}
+
 
 /****************************************************************
  * Generic position calculation via shaper convolution
  ****************************************************************/
 
-static inline double
-get_axis_position(struct move *m, int axis, double move_time)
+// Locate the move for each pulse.  The solver evaluates the same move
+// many times at nearby times, so each search starts from the move
+// found by the previous evaluation.
+static inline void
+start_pulse_search(struct shaper_pulses *sp, struct move *m)
 {
-    double axis_r = m->axes_r.axis[axis - 'x'];
-    double start_pos = m->start_pos.axis[axis - 'x'];
-    double move_dist = move_get_distance(m, move_time);
-    return start_pos + axis_r * move_dist;
+    if (sp->cache_m == m)
+        return;
+    sp->cache_m = m;
+    int i;
+    for (i = 0; i < sp->num_pulses; ++i) {
+        sp->cache_pm[i] = m;
+        sp->cache_offset[i] = 0.;
+    }
 }
 
-static inline double
-get_axis_position_across_moves(struct move *m, int axis, double time)
+// Find the move (and the time within it) of the given pulse
+static inline struct move *
+find_pulse_move(struct shaper_pulses *sp, int i, double move_time
+                , double *pulse_time)
 {
+    struct move *pm = sp->cache_pm[i];
+    double offset = sp->cache_offset[i];
+    double time = move_time + sp->t[i] + offset;
     while (likely(time < 0.)) {
-        m = list_prev_entry(m, node);
-        time += m->move_t;
+        pm = list_prev_entry(pm, node);
+        offset += pm->move_t;
+        time += pm->move_t;
     }
-    while (likely(time > m->move_t)) {
-        time -= m->move_t;
-        m = list_next_entry(m, node);
+    while (likely(time > pm->move_t)) {
+        offset -= pm->move_t;
+        time -= pm->move_t;
+        pm = list_next_entry(pm, node);
     }
-    return get_axis_position(m, axis, time);
+    sp->cache_pm[i] = pm;
+    sp->cache_offset[i] = offset;
+    *pulse_time = time;
+    return pm;
 }
 
-// Calculate the position from the convolution of the shaper with input signal
-static inline double
-calc_position(struct move *m, int axis, double move_time
-              , struct shaper_pulses *sp)
+// Calculate the segment of the shaper convolution at the given time
+static void
+calc_segment(struct move *m, int axis, double move_time
+             , struct shaper_pulses *sp, struct shaper_segment *seg)
 {
-    double res = 0.;
     int num_pulses = sp->num_pulses, i;
+    start_pulse_search(sp, m);
+    double min_time = -INFINITY, max_time = INFINITY;
+    double c0 = 0., c1 = 0., c2 = 0.;
     for (i = 0; i < num_pulses; ++i) {
-        double t = sp->pulses[i].t, a = sp->pulses[i].a;
-        res += a * get_axis_position_across_moves(m, axis, move_time + t);
+        double time;
+        struct move *pm = find_pulse_move(sp, i, move_time, &time);
+        // Limit the segment to the times where the pulse is in 'pm'
+        double pt = sp->t[i] + sp->cache_offset[i];
+        if (-pt > min_time)
+            min_time = -pt;
+        if (pm->move_t - pt < max_time)
+            max_time = pm->move_t - pt;
+        // Add the weighted pulse position (expanded around move_time=0)
+        double a = sp->a[i], ar = a * pm->axes_r.axis[axis - 'x'];
+        double start_v = pm->start_v, half_accel = pm->half_accel;
+        c0 += (a * pm->start_pos.axis[axis - 'x']
+               + ar * (start_v + half_accel * pt) * pt);
+        c1 += ar * (start_v + 2. * half_accel * pt);
+        c2 += ar * half_accel;
     }
-    return res;
+    seg->m = m;
+    seg->start_pos = m->start_pos.axis[axis - 'x'];
+    seg->min_time = min_time;
+    seg->max_time = max_time;
+    seg->c0 = c0;
+    seg->c1 = c1;
+    seg->c2 = c2;
+}
+
+// Check if a segment can be used at the given time ('struct move'
+// memory is reused, so the segment must also be from the current
+// trapq 'update_seq')
+static inline int
+check_segment(struct shaper_segment *seg, struct move *m, int axis
+              , double move_time, uint32_t update_seq)
+{
+    return (seg->m == m && seg->update_seq == update_seq
+            && move_time >= seg->min_time && move_time <= seg->max_time
+            && seg->start_pos == m->start_pos.axis[axis - 'x']);
+}
+
+
+/****************************************************************
+ * Position calculation via smoother convolution
+ ****************************************************************/
+
+// Calculate the position from the convolution of a smoothing kernel
+// with the input signal.  The motion within each move is a quadratic
+// function of time, so the integral over each move overlapping the
+// smoothing window is found directly from the moments of the kernel.
+static double
+calc_smoothed_position(struct move *m, int axis, double move_time
+                       , struct shaper_pulses *sp)
+{
+    double hst = sp->hst, inv_hst = sp->inv_hst;
+    // Find the move containing the start of the smoothing window
+    double start = move_time - hst;
+    while (unlikely(start < 0.)) {
+        m = list_prev_entry(m, node);
+        start += m->move_t;
+        move_time += m->move_t;
+    }
+    double res = 0., lo[3], hi[3];
+    int is_first = 1;
+    for (;;) {
+        // Express the position as a polynomial of u=(time-move_time)/hst
+        double axis_r = m->axes_r.axis[axis - 'x'];
+        double start_v = m->start_v, half_accel = m->half_accel;
+        double x0 = (m->start_pos.axis[axis - 'x']
+                     + axis_r * (start_v + half_accel * move_time) * move_time);
+        double x1 = axis_r * (start_v + 2. * half_accel * move_time) * hst;
+        double x2 = axis_r * half_accel * hst * hst;
+        int is_last = move_time + hst <= m->move_t;
+        if (likely(is_first && is_last))
+            // Smoothing window is entirely within this move
+            return (x0 * sp->full_moments[0] + x1 * sp->full_moments[1]
+                    + x2 * sp->full_moments[2]);
+        if (is_first)
+            calc_moments(sp, -1., lo);
+        else
+            calc_moments(sp, -move_time * inv_hst, lo);
+        if (is_last)
+            calc_moments(sp, 1., hi);
+        else
+            calc_moments(sp, (m->move_t - move_time) * inv_hst, hi);
+        res += (x0 * (hi[0] - lo[0]) + x1 * (hi[1] - lo[1])
+                + x2 * (hi[2] - lo[2]));
+        if (is_last)
+            return res;
+        move_time -= m->move_t;
+        m = list_next_entry(m, node);
+        is_first = 0;
+    }
+}
+
+
+/****************************************************************
+ * Segment cache shared between steppers
+ ****************************************************************/
+
+// Steppers that share a trapq (eg, the two motors of a corexy) shape
+// the same x and y positions.  A shared cache allows a segment found
+// by one stepper to be reused by the others.  Segments are stored
+// separately for each set of shaper parameters, so that steppers with
+// different shapers (eg, the two carriages of a dual carriage printer
+// in copy or mirror mode) do not evict each other's segments.
+
+#define SHARED_SEGMENTS 8
+#define SHARED_SHAPERS 4
+
+struct shared_axis {
+    int num_pulses;
+    double t[MAX_PULSES], a[MAX_PULSES];
+    struct shaper_segment segs[SHARED_SEGMENTS];
+    int next_seg;
+};
+
+struct input_shaper_cache {
+    pthread_mutex_t lock; // protects variables below
+    struct shared_axis axes[3][SHARED_SHAPERS];
+    int next_shaper[3];
+};
+
+static int
+check_shared_params(struct shared_axis *sa, struct shaper_pulses *sp)
+{
+    int n = sp->num_pulses;
+    return (sa->num_pulses == n && !memcmp(sa->t, sp->t, n * sizeof(sp->t[0]))
+            && !memcmp(sa->a, sp->a, n * sizeof(sp->a[0])));
+}
+
+// Find the shared segments for the given shaper parameters
+static struct shared_axis *
+find_shared_axis(struct input_shaper_cache *isc, int axis
+                 , struct shaper_pulses *sp)
+{
+    struct shared_axis *sa = isc->axes[axis - 'x'];
+    int i;
+    for (i = 0; i < SHARED_SHAPERS; i++)
+        if (check_shared_params(&sa[i], sp))
+            return &sa[i];
+    return NULL;
+}
+
+// Find the segment at the given time (possibly from the shared cache)
+static void
+update_segment(struct input_shaper_cache *isc, uint32_t update_seq
+               , struct move *m, int axis, double move_time
+               , struct shaper_pulses *sp)
+{
+    struct shaper_segment *seg = &sp->seg;
+    if (!isc) {
+        calc_segment(m, axis, move_time, sp, seg);
+        seg->update_seq = update_seq;
+        return;
+    }
+    pthread_mutex_lock(&isc->lock);
+    struct shared_axis *sa = find_shared_axis(isc, axis, sp);
+    if (sa) {
+        int i;
+        for (i = 0; i < SHARED_SEGMENTS; i++) {
+            struct shaper_segment *s = &sa->segs[i];
+            if (check_segment(s, m, axis, move_time, update_seq)) {
+                *seg = *s;
+                pthread_mutex_unlock(&isc->lock);
+                return;
+            }
+        }
+    }
+    pthread_mutex_unlock(&isc->lock);
+
+    calc_segment(m, axis, move_time, sp, seg);
+    seg->update_seq = update_seq;
+
+    pthread_mutex_lock(&isc->lock);
+    sa = find_shared_axis(isc, axis, sp);
+    if (!sa) {
+        // Replace the oldest set of shaper parameters
+        int *next_shaper = &isc->next_shaper[axis - 'x'];
+        sa = &isc->axes[axis - 'x'][*next_shaper];
+        *next_shaper = (*next_shaper + 1) % SHARED_SHAPERS;
+        memset(sa, 0, sizeof(*sa));
+        sa->num_pulses = sp->num_pulses;
+        memcpy(sa->t, sp->t, sizeof(sa->t));
+        memcpy(sa->a, sp->a, sizeof(sa->a));
+    }
+    sa->segs[sa->next_seg] = *seg;
+    sa->next_seg = (sa->next_seg + 1) % SHARED_SEGMENTS;
+    pthread_mutex_unlock(&isc->lock);
+}
+
+// Allocate a cache that may be shared by several input shapers
+struct input_shaper_cache * __visible
+input_shaper_cache_alloc(void)
+{
+    struct input_shaper_cache *isc = malloc(sizeof(*isc));
+    memset(isc, 0, sizeof(*isc));
+    int ret = pthread_mutex_init(&isc->lock, NULL);
+    if (ret) {
+        report_errno("input_shaper_cache_alloc pthread_mutex_init", ret);
+        free(isc);
+        return NULL;
+    }
+    return isc;
+}
+
+// Free memory associated with a 'struct input_shaper_cache' object
+void __visible
+input_shaper_cache_free(struct input_shaper_cache *isc)
+{
+    if (!isc)
+        return;
+    pthread_mutex_destroy(&isc->lock);
+    free(isc);
 }
 
 
@@ -113,18 +427,34 @@ struct input_shaper {
     struct stepper_kinematics sk;
     struct stepper_kinematics *orig_sk;
     struct move m;
-    struct shaper_pulses sx, sy;
+    struct shaper_pulses sx, sy, sz;
+    struct input_shaper_cache *cache;
+    int is_extruder;
 };
 
+// Calculate the shaped position of an axis
+static inline double
+calc_position(struct input_shaper *is, struct move *m, int axis
+              , double move_time, struct shaper_pulses *sp)
+{
+    if (sp->num_coeffs)
+        return calc_smoothed_position(m, axis, move_time, sp);
+    struct shaper_segment *seg = &sp->seg;
+    uint32_t update_seq = is->sk.tq ? is->sk.tq->update_seq : 0;
+    if (unlikely(!check_segment(seg, m, axis, move_time, update_seq)))
+        update_segment(is->cache, update_seq, m, axis, move_time, sp);
+    return seg->c0 + (seg->c1 + seg->c2 * move_time) * move_time;
+}
+
 // Optimized calc_position when only x axis is needed
 static double
 shaper_x_calc_position(struct stepper_kinematics *sk, struct move *m
                        , double move_time)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if (!is->sx.num_pulses)
+    if (!is_shaped(&is->sx))
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
-    is->m.start_pos.x = calc_position(m, 'x', move_time, &is->sx);
+    is->m.start_pos.x = calc_position(is, m, 'x', move_time, &is->sx);
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
@@ -134,51 +464,131 @@ shaper_y_calc_position(struct stepper_kinematics *sk, struct move *m
                        , double move_time)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if (!is->sy.num_pulses)
+    if (!is_shaped(&is->sy))
+        return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
+    is->m.start_pos.y = calc_position(is, m, 'y', move_time, &is->sy);
+    return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
+}
+
+// Optimized calc_position when only z axis is needed
+static double
+shaper_z_calc_position(struct stepper_kinematics *sk, struct move *m
+                       , double move_time)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    if (!is_shaped(&is->sz))
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
-    is->m.start_pos.y = calc_position(m, 'y', move_time, &is->sy);
+    is->m.start_pos.z = calc_position(is, m, 'z', move_time, &is->sz);
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
-// General calc_position for both x and y axes
+// General calc_position for any combination of x, y, and z axes
 static double
-shaper_xy_calc_position(struct stepper_kinematics *sk, struct move *m
-                        , double move_time)
+shaper_xyz_calc_position(struct stepper_kinematics *sk, struct move *m
+                         , double move_time)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if (!is->sx.num_pulses && !is->sy.num_pulses)
+    if (!is_shaped(&is->sx) && !is_shaped(&is->sy) && !is_shaped(&is->sz))
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
     is->m.start_pos = move_get_coord(m, move_time);
-    if (is->sx.num_pulses)
-        is->m.start_pos.x = calc_position(m, 'x', move_time, &is->sx);
-    if (is->sy.num_pulses)
-        is->m.start_pos.y = calc_position(m, 'y', move_time, &is->sy);
+    if (is_shaped(&is->sx))
+        is->m.start_pos.x = calc_position(is, m, 'x', move_time, &is->sx);
+    if (is_shaped(&is->sy))
+        is->m.start_pos.y = calc_position(is, m, 'y', move_time, &is->sy);
+    if (is_shaped(&is->sz))
+        is->m.start_pos.z = calc_position(is, m, 'z', move_time, &is->sz);
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
-// A callback that forwards post_cb call to the original kinematics
+// The extruder kinematics (pressure advance) depend on the velocity of
+// the extruder, so the extruder is shaped by a convolution of the
+// original kinematics' output instead of the commanded position.
+static double
+shaper_extruder_calc_position(struct stepper_kinematics *sk, struct move *m
+                              , double move_time)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    struct stepper_kinematics *orig_sk = is->orig_sk;
+    struct shaper_pulses *sp = &is->sx;
+    // The original kinematics may cache moves between flushes
+    orig_sk->last_flush_time = sk->last_flush_time;
+    if (!sp->num_pulses)
+        return orig_sk->calc_position_cb(orig_sk, m, move_time);
+    start_pulse_search(sp, m);
+    double res = 0.;
+    int i;
+    for (i = 0; i < sp->num_pulses; ++i) {
+        double time;
+        struct move *pm = find_pulse_move(sp, i, move_time, &time);
+        res += sp->a[i] * orig_sk->calc_position_cb(orig_sk, pm, time);
+    }
+    return res;
+}
+
+static int
+shaper_set_calc_position_cb(struct input_shaper *is, int active_flags)
+{
+    if (is->is_extruder)
+        is->sk.calc_position_cb = shaper_extruder_calc_position;
+    else if (active_flags == AF_X)
+        is->sk.calc_position_cb = shaper_x_calc_position;
+    else if (active_flags == AF_Y)
+        is->sk.calc_position_cb = shaper_y_calc_position;
+    else if (active_flags == AF_Z)
+        is->sk.calc_position_cb = shaper_z_calc_position;
+    else if (active_flags & (AF_X | AF_Y | AF_Z))
+        is->sk.calc_position_cb = shaper_xyz_calc_position;
+    else
+        return -1;
+    return 0;
+}
+
+static void
+shaper_reset_caches(struct input_shaper *is)
+{
+    is->sx.cache_m = is->sy.cache_m = is->sz.cache_m = NULL;
+    is->sx.seg.m = is->sy.seg.m = is->sz.seg.m = NULL;
+}
+
+// A callback that discards the move lookup cache (the cached moves may
+// be freed before the next step generation) and forwards post_cb call
+// to the original kinematics
 static void
 shaper_commanded_pos_post_fixup(struct stepper_kinematics *sk)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    shaper_reset_caches(is);
+    if (!is->orig_sk->post_cb)
+        return;
     is->orig_sk->commanded_pos = sk->commanded_pos;
     is->orig_sk->post_cb(is->orig_sk);
     sk->commanded_pos = is->orig_sk->commanded_pos;
 }
 
+static void
+add_generation_window(struct shaper_pulses *sp, double *pre_active
+                      , double *post_active)
+{
+    double pre, post;
+    get_shaper_window(sp, &pre, &post);
+    *pre_active = pre > *pre_active ? pre : *pre_active;
+    *post_active = post > *post_active ? post : *post_active;
+}
+
 static void
 shaper_note_generation_time(struct input_shaper *is)
 {
     double pre_active = 0., post_active = 0.;
-    if ((is->sk.active_flags & AF_X) && is->sx.num_pulses) {
-        pre_active = is->sx.pulses[is->sx.num_pulses-1].t;
-        post_active = -is->sx.pulses[0].t;
-    }
-    if ((is->sk.active_flags & AF_Y) && is->sy.num_pulses) {
-        pre_active = is->sy.pulses[is->sy.num_pulses-1].t > pre_active
-            ? is->sy.pulses[is->sy.num_pulses-1].t : pre_active;
-        post_active = -is->sy.pulses[0].t > post_active
-            ? -is->sy.pulses[0].t : post_active;
+    if (is->sk.active_flags & AF_X)
+        add_generation_window(&is->sx, &pre_active, &post_active);
+    if (is->sk.active_flags & AF_Y && !is->is_extruder)
+        add_generation_window(&is->sy, &pre_active, &post_active);
+    if (is->sk.active_flags & AF_Z && !is->is_extruder)
+        add_generation_window(&is->sz, &pre_active, &post_active);
+    if (is->is_extruder) {
+        // The original kinematics are evaluated at each pulse time
+        pre_active += is->orig_sk->gen_steps_pre_active;
+        post_active += is->orig_sk->gen_steps_post_active;
     }
     is->sk.gen_steps_pre_active = pre_active;
     is->sk.gen_steps_post_active = post_active;
@@ -188,57 +598,119 @@ void __visible
 input_shaper_update_sk(struct stepper_kinematics *sk)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if ((is->orig_sk->active_flags & (AF_X | AF_Y)) == (AF_X | AF_Y))
-        is->sk.calc_position_cb = shaper_xy_calc_position;
-    else if (is->orig_sk->active_flags & AF_X)
-        is->sk.calc_position_cb = shaper_x_calc_position;
-    else if (is->orig_sk->active_flags & AF_Y)
-        is->sk.calc_position_cb = shaper_y_calc_position;
+    shaper_set_calc_position_cb(is, is->orig_sk->active_flags);
     is->sk.active_flags = is->orig_sk->active_flags;
     shaper_note_generation_time(is);
 }
 
-int __visible
-input_shaper_set_sk(struct stepper_kinematics *sk
-                    , struct stepper_kinematics *orig_sk)
+static int
+shaper_set_sk(struct input_shaper *is, struct stepper_kinematics *orig_sk
+              , int is_extruder)
 {
-    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if (orig_sk->active_flags == AF_X)
-        is->sk.calc_position_cb = shaper_x_calc_position;
-    else if (orig_sk->active_flags == AF_Y)
-        is->sk.calc_position_cb = shaper_y_calc_position;
-    else if (orig_sk->active_flags & (AF_X | AF_Y))
-        is->sk.calc_position_cb = shaper_xy_calc_position;
-    else
+    is->is_extruder = is_extruder;
+    if (shaper_set_calc_position_cb(is, orig_sk->active_flags))
         return -1;
     is->sk.active_flags = orig_sk->active_flags;
     is->orig_sk = orig_sk;
     is->sk.commanded_pos = orig_sk->commanded_pos;
     is->sk.last_flush_time = orig_sk->last_flush_time;
     is->sk.last_move_time = orig_sk->last_move_time;
-    if (orig_sk->post_cb) {
-        is->sk.post_cb = shaper_commanded_pos_post_fixup;
-    }
+    is->sk.post_cb = shaper_commanded_pos_post_fixup;
+    shaper_reset_caches(is);
+    shaper_note_generation_time(is);
     return 0;
 }
 
+int __visible
+input_shaper_set_sk(struct stepper_kinematics *sk
+                    , struct stepper_kinematics *orig_sk)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    return shaper_set_sk(is, orig_sk, 0);
+}
+
+// Shape the output of extruder kinematics (configured with axis 'e')
+int __visible
+input_shaper_set_extruder_sk(struct stepper_kinematics *sk
+                             , struct stepper_kinematics *orig_sk)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    return shaper_set_sk(is, orig_sk, 1);
+}
+
+// Share calculated segments with other input shapers using the cache
+void __visible
+input_shaper_set_cache(struct stepper_kinematics *sk
+                       , struct input_shaper_cache *isc)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    is->cache = isc;
+}
+
+// Find the pulses of an axis (or NULL if the axis is not active)
+static int
+lookup_axis(struct input_shaper *is, char axis, struct shaper_pulses **sp)
+{
+    int active_flags = is->is_extruder ? 0 : is->orig_sk->active_flags;
+    *sp = NULL;
+    switch (axis) {
+    case 'x':
+        if (active_flags & AF_X)
+            *sp = &is->sx;
+        return 0;
+    case 'y':
+        if (active_flags & AF_Y)
+            *sp = &is->sy;
+        return 0;
+    case 'z':
+        if (active_flags & AF_Z)
+            *sp = &is->sz;
+        return 0;
+    case 'e':
+        if (is->is_extruder)
+            *sp = &is->sx;
+        return 0;
+    }
+    return -1;
+}
+
 int __visible
 input_shaper_set_shaper_params(struct stepper_kinematics *sk, char axis
                                , int n, double a[], double t[])
 {
-    if (axis != 'x' && axis != 'y')
-        return -1;
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    struct shaper_pulses *sp = axis == 'x' ? &is->sx : &is->sy;
+    struct shaper_pulses *sp;
+    if (lookup_axis(is, axis, &sp))
+        return -1;
     int status = 0;
     // Ignore input shaper update if the axis is not active
-    if (is->orig_sk->active_flags & (axis == 'x' ? AF_X : AF_Y)) {
+    if (sp) {
         status = init_shaper(n, a, t, sp);
         shaper_note_generation_time(is);
     }
     return status;
 }
 
+int __visible
+input_shaper_set_smoother_params(struct stepper_kinematics *sk, char axis
+                                 , int n, double c[], double t_sm)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    struct shaper_pulses *sp;
+    if (lookup_axis(is, axis, &sp))
+        return -1;
+    int status = 0;
+    // Ignore input smoother update if the axis is not active
+    if (sp) {
+        // Smoothers are not supported on the extruder output
+        if (is->is_extruder)
+            n = -1;
+        status = init_smoother(n, c, t_sm, sp);
+        shaper_note_generation_time(is);
+    }
+    return status;
+}
+
 double __visible
 input_shaper_get_step_generation_window(struct stepper_kinematics *sk)
 {
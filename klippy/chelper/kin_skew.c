@@ -0,0 +1,112 @@
+// Skew correction applied during step generation
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Instead of transforming the endpoint of every move in the host
+// python code, the trapq holds the requested (unskewed) move and the
+// skew transform is applied to the xy coordinates when a stepper
+// position is calculated.  The transform is affine, so a stepper
+// using linear kinematics remains linear when wrapped.
+
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "itersolve.h" // struct stepper_kinematics
+#include "trapq.h" // struct move
+
+#define DUMMY_T 500.0
+
+struct skew_stepper {
+    struct stepper_kinematics sk;
+    struct stepper_kinematics *orig_sk;
+    double xy_factor, xz_factor, yz_factor;
+    struct move m;
+};
+
+static double
+skew_calc_position(struct stepper_kinematics *sk, struct move *m
+                   , double move_time)
+{
+    struct skew_stepper *ss = container_of(sk, struct skew_stepper, sk);
+    struct coord c = move_get_coord(m, move_time);
+    ss->m.start_pos.x = (c.x - c.y * ss->xy_factor
+                         - c.z * (ss->xz_factor
+                                  - ss->xy_factor * ss->yz_factor));
+    ss->m.start_pos.y = c.y - c.z * ss->yz_factor;
+    ss->m.start_pos.z = c.z;
+    return ss->orig_sk->calc_position_cb(ss->orig_sk, &ss->m, DUMMY_T);
+}
+
+static double
+skew_passthrough_calc_position(struct stepper_kinematics *sk, struct move *m
+                               , double move_time)
+{
+    struct skew_stepper *ss = container_of(sk, struct skew_stepper, sk);
+    return ss->orig_sk->calc_position_cb(ss->orig_sk, m, move_time);
+}
+
+// Forward post_cb calls to the original kinematics
+static void
+skew_commanded_pos_post_fixup(struct stepper_kinematics *sk)
+{
+    struct skew_stepper *ss = container_of(sk, struct skew_stepper, sk);
+    ss->orig_sk->commanded_pos = sk->commanded_pos;
+    ss->orig_sk->post_cb(ss->orig_sk);
+    sk->commanded_pos = ss->orig_sk->commanded_pos;
+}
+
+// Set the skew factors (only valid while step generation is flushed)
+void __visible
+skew_stepper_set_factors(struct stepper_kinematics *sk, double xy_factor
+                         , double xz_factor, double yz_factor)
+{
+    struct skew_stepper *ss = container_of(sk, struct skew_stepper, sk);
+    ss->xy_factor = xy_factor;
+    ss->xz_factor = xz_factor;
+    ss->yz_factor = yz_factor;
+}
+
+// Enable or disable the skew transform for a wrapped stepper
+void __visible
+skew_stepper_set_active(struct stepper_kinematics *sk, int is_active)
+{
+    struct skew_stepper *ss = container_of(sk, struct skew_stepper, sk);
+    sk->kin_flags = ss->orig_sk->kin_flags;
+    if (is_active)
+        sk->calc_position_cb = skew_calc_position;
+    else
+        sk->calc_position_cb = skew_passthrough_calc_position;
+}
+
+// Wrap 'orig_sk' - the stepper position is then dependent on x, y, and z
+int __visible
+skew_stepper_set_sk(struct stepper_kinematics *sk
+                    , struct stepper_kinematics *orig_sk)
+{
+    if (!(orig_sk->active_flags & (AF_X | AF_Y)))
+        return -1;
+    struct skew_stepper *ss = container_of(sk, struct skew_stepper, sk);
+    ss->orig_sk = orig_sk;
+    sk->active_flags = orig_sk->active_flags | AF_X | AF_Y | AF_Z;
+    sk->gen_steps_pre_active = orig_sk->gen_steps_pre_active;
+    sk->gen_steps_post_active = orig_sk->gen_steps_post_active;
+    sk->commanded_pos = orig_sk->commanded_pos;
+    sk->last_flush_time = orig_sk->last_flush_time;
+    sk->last_move_time = orig_sk->last_move_time;
+    if (orig_sk->post_cb)
+        sk->post_cb = skew_commanded_pos_post_fixup;
+    skew_stepper_set_active(sk, 0);
+    return 0;
+}
+
+struct stepper_kinematics * __visible
+skew_stepper_alloc(void)
+{
+    struct skew_stepper *ss = malloc(sizeof(*ss));
+    memset(ss, 0, sizeof(*ss));
+    ss->m.move_t = 2. * DUMMY_T;
+    return &ss->sk;
+}
@@ -28,6 +28,24 @@ winch_stepper_calc_position(struct stepper_kinematics *sk, struct move *m
     return sqrt(dx*dx + dy*dy + dz*dz);
 }
 
+static void
+winch_stepper_calc_positions(struct stepper_kinematics *sk, struct move *m
+                             , double *move_times, double *positions
+                             , int count)
+{
+    struct winch_stepper *hs = container_of(sk, struct winch_stepper, sk);
+    struct coord a = hs->anchor, sp = m->start_pos;
+    struct move_axes r = m->axes_r;
+    int i;
+    for (i = 0; i < count; i++) {
+        move_real_t move_dist = move_get_distance(m, move_times[i]);
+        double dx = a.x - (sp.x + r.x * move_dist);
+        double dy = a.y - (sp.y + r.y * move_dist);
+        double dz = a.z - (sp.z + r.z * move_dist);
+        positions[i] = sqrt(dx*dx + dy*dy + dz*dz);
+    }
+}
+
 struct stepper_kinematics * __visible
 winch_stepper_alloc(double anchor_x, double anchor_y, double anchor_z)
 {
@@ -37,6 +55,7 @@ winch_stepper_alloc(double anchor_x, double anchor_y, double anchor_z)
     hs->anchor.y = anchor_y;
     hs->anchor.z = anchor_z;
     hs->sk.calc_position_cb = winch_stepper_calc_position;
+    hs->sk.calc_positions_cb = winch_stepper_calc_positions;
     hs->sk.active_flags = AF_X | AF_Y | AF_Z;
     return &hs->sk;
 }
@@ -0,0 +1,246 @@
+// Time varying z offset applied during step generation
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Slowly changing z adjustments (eg, thermal expansion compensation)
+// are stored as a series of linear ramps in print time.  The trapq
+// holds the requested move and the ramp value at the time of a
+// stepper position calculation is added to the z coordinate, so the
+// adjustment is spread smoothly over the moves that follow it.  The
+// wrapper may be stacked with the bed mesh and skew wrappers.
+
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "itersolve.h" // struct stepper_kinematics
+#include "list.h" // list_add_tail
+#include "trapq.h" // struct move
+
+
+/****************************************************************
+ * Offset ramps
+ ****************************************************************/
+
+// Ramps are only discarded once all wrapped steppers have generated
+// positions this far past the end of the ramp
+#define PRUNE_TIME 1.0
+#define NEVER_TIME 9999999999999999.9
+
+struct z_offset_ramp {
+    struct list_node node;
+    double start_time, end_time, start_z, end_z;
+};
+
+struct z_offset_table {
+    double base_z;
+    struct list_head ramps, steppers;
+};
+
+struct zoffset_stepper {
+    struct stepper_kinematics sk;
+    struct stepper_kinematics *orig_sk;
+    struct z_offset_table *zt;
+    struct list_node node;
+    double last_time;
+    struct move m;
+};
+
+// Return the z offset at the given print time
+double __visible
+z_offset_get_offset(struct z_offset_table *zt, double print_time)
+{
+    double z = zt->base_z;
+    struct z_offset_ramp *r;
+    list_for_each_entry(r, &zt->ramps, node) {
+        if (print_time < r->start_time)
+            break;
+        if (print_time >= r->end_time) {
+            z = r->end_z;
+            continue;
+        }
+        double t = (print_time - r->start_time) / (r->end_time - r->start_time);
+        return r->start_z + (r->end_z - r->start_z) * t;
+    }
+    return z;
+}
+
+// Free ramps that are no longer needed by any wrapped stepper
+static void
+prune_ramps(struct z_offset_table *zt)
+{
+    if (list_empty(&zt->steppers))
+        return;
+    struct zoffset_stepper *zs;
+    double min_time = NEVER_TIME;
+    list_for_each_entry(zs, &zt->steppers, node) {
+        if (zs->last_time < min_time)
+            min_time = zs->last_time;
+    }
+    min_time -= PRUNE_TIME;
+    while (!list_empty(&zt->ramps)) {
+        struct z_offset_ramp *r = list_first_entry(
+            &zt->ramps, struct z_offset_ramp, node);
+        if (r->end_time > min_time)
+            break;
+        zt->base_z = r->end_z;
+        list_del(&r->node);
+        free(r);
+    }
+}
+
+// Move from the current offset to 'z' between 'start_time' and 'end_time'
+void __visible
+z_offset_set_ramp(struct z_offset_table *zt, double start_time
+                  , double end_time, double z)
+{
+    prune_ramps(zt);
+    double start_z = z_offset_get_offset(zt, start_time);
+    // Any ramp still in progress is truncated at the new start time
+    while (!list_empty(&zt->ramps)) {
+        struct z_offset_ramp *r = list_last_entry(
+            &zt->ramps, struct z_offset_ramp, node);
+        if (r->start_time < start_time) {
+            if (r->end_time > start_time) {
+                r->end_time = start_time;
+                r->end_z = start_z;
+            }
+            break;
+        }
+        list_del(&r->node);
+        free(r);
+    }
+    if (end_time < start_time)
+        end_time = start_time;
+    struct z_offset_ramp *r = malloc(sizeof(*r));
+    r->start_time = start_time;
+    r->end_time = end_time;
+    r->start_z = start_z;
+    r->end_z = z;
+    list_add_tail(&r->node, &zt->ramps);
+}
+
+// Discard all ramps and use a constant offset (only valid while
+// step generation is flushed)
+void __visible
+z_offset_set_offset(struct z_offset_table *zt, double z)
+{
+    while (!list_empty(&zt->ramps)) {
+        struct z_offset_ramp *r = list_first_entry(
+            &zt->ramps, struct z_offset_ramp, node);
+        list_del(&r->node);
+        free(r);
+    }
+    zt->base_z = z;
+}
+
+struct z_offset_table * __visible
+z_offset_alloc(void)
+{
+    struct z_offset_table *zt = malloc(sizeof(*zt));
+    memset(zt, 0, sizeof(*zt));
+    list_init(&zt->ramps);
+    list_init(&zt->steppers);
+    return zt;
+}
+
+void __visible
+z_offset_free(struct z_offset_table *zt)
+{
+    if (!zt)
+        return;
+    z_offset_set_offset(zt, 0.);
+    free(zt);
+}
+
+
+/****************************************************************
+ * Kinematics wrapper
+ ****************************************************************/
+
+#define DUMMY_T 500.0
+
+static double
+zoffset_calc_position(struct stepper_kinematics *sk, struct move *m
+                      , double move_time)
+{
+    struct zoffset_stepper *zs = container_of(sk, struct zoffset_stepper, sk);
+    double print_time = m->print_time + move_time;
+    // Position queries from itersolve_calc_position_from_coord() use
+    // a move with a zero print_time - they are not step generation
+    if (m->print_time && print_time > zs->last_time)
+        zs->last_time = print_time;
+    struct coord c = move_get_coord(m, move_time);
+    c.z += z_offset_get_offset(zs->zt, print_time);
+    zs->m.start_pos = c;
+    return zs->orig_sk->calc_position_cb(zs->orig_sk, &zs->m, DUMMY_T);
+}
+
+static double
+zoffset_passthrough_calc_position(struct stepper_kinematics *sk
+                                  , struct move *m, double move_time)
+{
+    struct zoffset_stepper *zs = container_of(sk, struct zoffset_stepper, sk);
+    return zs->orig_sk->calc_position_cb(zs->orig_sk, m, move_time);
+}
+
+// Forward post_cb calls to the original kinematics
+static void
+zoffset_commanded_pos_post_fixup(struct stepper_kinematics *sk)
+{
+    struct zoffset_stepper *zs = container_of(sk, struct zoffset_stepper, sk);
+    zs->orig_sk->commanded_pos = sk->commanded_pos;
+    zs->orig_sk->post_cb(zs->orig_sk);
+    sk->commanded_pos = zs->orig_sk->commanded_pos;
+}
+
+// Enable or disable the z offset for a wrapped stepper
+void __visible
+zoffset_stepper_set_active(struct stepper_kinematics *sk, int is_active)
+{
+    struct zoffset_stepper *zs = container_of(sk, struct zoffset_stepper, sk);
+    if (is_active) {
+        sk->calc_position_cb = zoffset_calc_position;
+        sk->kin_flags = 0;
+    } else {
+        sk->calc_position_cb = zoffset_passthrough_calc_position;
+        sk->kin_flags = zs->orig_sk->kin_flags;
+    }
+}
+
+// Wrap 'orig_sk' - the stepper position then changes over time, so
+// steps must be generated during any xyz movement
+int __visible
+zoffset_stepper_set_sk(struct stepper_kinematics *sk
+                       , struct stepper_kinematics *orig_sk
+                       , struct z_offset_table *zt)
+{
+    if (!(orig_sk->active_flags & AF_Z) || !zt)
+        return -1;
+    struct zoffset_stepper *zs = container_of(sk, struct zoffset_stepper, sk);
+    zs->orig_sk = orig_sk;
+    zs->zt = zt;
+    zs->last_time = orig_sk->last_flush_time;
+    list_add_tail(&zs->node, &zt->steppers);
+    sk->active_flags = orig_sk->active_flags | AF_X | AF_Y;
+    sk->gen_steps_pre_active = orig_sk->gen_steps_pre_active;
+    sk->gen_steps_post_active = orig_sk->gen_steps_post_active;
+    sk->commanded_pos = orig_sk->commanded_pos;
+    sk->last_flush_time = orig_sk->last_flush_time;
+    sk->last_move_time = orig_sk->last_move_time;
+    if (orig_sk->post_cb)
+        sk->post_cb = zoffset_commanded_pos_post_fixup;
+    zoffset_stepper_set_active(sk, 0);
+    return 0;
+}
+
+struct stepper_kinematics * __visible
+zoffset_stepper_alloc(void)
+{
+    struct zoffset_stepper *zs = malloc(sizeof(*zs));
+    memset(zs, 0, sizeof(*zs));
+    zs->m.move_t = 2. * DUMMY_T;
+    return &zs->sk;
+}
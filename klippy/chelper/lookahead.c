@@ -0,0 +1,298 @@
+// Move "look-ahead" velocity planning
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// The toolhead queues each requested move here.  The code determines
+// the maximum junction speed between moves (using "approximated
+// centripetal velocity" junction deviation), and then performs a
+// backward pass over the queue (see lookahead_flush) to find the
+// acceleration, cruise, and deceleration portions of each move.  The
+// resulting trapezoids are then queued directly into a trapq.  This
+// was originally implemented in toolhead.py.
+
+#include <math.h> // sqrt
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "lookahead.h" // lookahead_alloc
+#include "trapq.h" // trapq_append
+
+struct la_move {
+    struct coord start_pos, axes_r;
+    double move_d, accel, junction_deviation;
+    // Junction speeds are tracked in velocity squared.  The delta_v2
+    // is the maximum amount of this squared-velocity that can change
+    // in this move.
+    double max_cruise_v2, delta_v2, smooth_delta_v2;
+    double max_start_v2, max_smoothed_v2, next_junction_v2;
+    // Temporary storage for moves delayed in lookahead_flush()
+    double delayed_start_v2, delayed_end_v2;
+    // Results of lookahead_flush()
+    double start_v, cruise_v, end_v;
+    double accel_t, cruise_t, decel_t;
+    int is_kinematic_move;
+};
+
+struct lookahead {
+    struct la_move *moves;
+    int moves_pos, moves_count, moves_alloc;
+};
+
+#define MAX_JUNCTION_V2 999999999.9
+
+static inline double
+min2(double a, double b)
+{
+    return a < b ? a : b;
+}
+
+// Find space for a new move at the end of the queue
+static struct la_move *
+add_slot(struct lookahead *la)
+{
+    if (la->moves_pos + la->moves_count >= la->moves_alloc) {
+        if (la->moves_pos) {
+            memmove(la->moves, &la->moves[la->moves_pos]
+                    , la->moves_count * sizeof(*la->moves));
+            la->moves_pos = 0;
+        }
+        if (la->moves_count >= la->moves_alloc) {
+            la->moves_alloc = la->moves_alloc ? la->moves_alloc * 2 : 1024;
+            la->moves = realloc(la->moves
+                                , la->moves_alloc * sizeof(*la->moves));
+        }
+    }
+    struct la_move *m = &la->moves[la->moves_pos + la->moves_count++];
+    memset(m, 0, sizeof(*m));
+    return m;
+}
+
+// Determine the maximum start velocity of a move given the previous move
+static void
+calc_junction(struct la_move *m, struct la_move *pm, double extra_axes_v2)
+{
+    if (!m->is_kinematic_move || !pm->is_kinematic_move)
+        return;
+    double max_start_v2 = min2(min2(m->max_cruise_v2, pm->max_cruise_v2)
+                               , min2(pm->next_junction_v2
+                                      , pm->max_start_v2 + pm->delta_v2));
+    max_start_v2 = min2(max_start_v2, extra_axes_v2);
+    // Find max velocity using "approximated centripetal velocity"
+    double junction_cos_theta = -(m->axes_r.x * pm->axes_r.x
+                                  + m->axes_r.y * pm->axes_r.y
+                                  + m->axes_r.z * pm->axes_r.z);
+    double sin_theta_d2 = sqrt(fmax(0.5 * (1.0 - junction_cos_theta), 0.));
+    double cos_theta_d2 = sqrt(fmax(0.5 * (1.0 + junction_cos_theta), 0.));
+    double one_minus_sin_theta_d2 = 1. - sin_theta_d2;
+    if (one_minus_sin_theta_d2 > 0. && cos_theta_d2 > 0.) {
+        double R_jd = sin_theta_d2 / one_minus_sin_theta_d2;
+        double move_jd_v2 = R_jd * m->junction_deviation * m->accel;
+        double pmove_jd_v2 = R_jd * pm->junction_deviation * pm->accel;
+        // Approximated circle must contact moves no further than mid-move
+        //   centripetal_v2 = .5 * move_d * accel * tan_theta_d2
+        double quarter_tan_theta_d2 = .25 * sin_theta_d2 / cos_theta_d2;
+        double move_centripetal_v2 = m->delta_v2 * quarter_tan_theta_d2;
+        double pmove_centripetal_v2 = pm->delta_v2 * quarter_tan_theta_d2;
+        max_start_v2 = min2(max_start_v2, min2(move_jd_v2, pmove_jd_v2));
+        max_start_v2 = min2(max_start_v2, min2(move_centripetal_v2
+                                               , pmove_centripetal_v2));
+    }
+    // Apply limits
+    m->max_start_v2 = max_start_v2;
+    m->max_smoothed_v2 = min2(max_start_v2, (pm->max_smoothed_v2
+                                             + pm->smooth_delta_v2));
+}
+
+// Add a move to the end of the look-ahead queue
+void __visible
+lookahead_add_move(struct lookahead *la, int is_kinematic_move
+                   , double start_pos_x, double start_pos_y
+                   , double start_pos_z, double axes_r_x
+                   , double axes_r_y, double axes_r_z, double move_d
+                   , double accel, double junction_deviation
+                   , double max_cruise_v2, double smooth_delta_v2
+                   , double extra_axes_v2)
+{
+    struct la_move *m = add_slot(la);
+    m->is_kinematic_move = is_kinematic_move;
+    m->start_pos.x = start_pos_x;
+    m->start_pos.y = start_pos_y;
+    m->start_pos.z = start_pos_z;
+    m->axes_r.x = axes_r_x;
+    m->axes_r.y = axes_r_y;
+    m->axes_r.z = axes_r_z;
+    m->move_d = move_d;
+    m->accel = accel;
+    m->junction_deviation = junction_deviation;
+    m->max_cruise_v2 = max_cruise_v2;
+    m->delta_v2 = 2.0 * move_d * accel;
+    m->smooth_delta_v2 = smooth_delta_v2;
+    m->next_junction_v2 = MAX_JUNCTION_V2;
+    if (la->moves_count > 1)
+        calc_junction(m, m - 1, extra_axes_v2);
+}
+
+// Limit the junction speed between the last queued move and the next move
+void __visible
+lookahead_limit_next_junction(struct lookahead *la, double max_v2)
+{
+    if (!la->moves_count)
+        return;
+    struct la_move *m = &la->moves[la->moves_pos + la->moves_count - 1];
+    m->next_junction_v2 = min2(m->next_junction_v2, max_v2);
+}
+
+// Determine the accel, cruise, and decel portions of a move
+static void
+set_junction(struct la_move *m, double start_v2, double cruise_v2
+             , double end_v2)
+{
+    // Determine accel, cruise, and decel portions of the move distance
+    double half_inv_accel = .5 / m->accel;
+    double accel_d = (cruise_v2 - start_v2) * half_inv_accel;
+    double decel_d = (cruise_v2 - end_v2) * half_inv_accel;
+    double cruise_d = m->move_d - accel_d - decel_d;
+    // Determine move velocities
+    double start_v = m->start_v = sqrt(start_v2);
+    double cruise_v = m->cruise_v = sqrt(cruise_v2);
+    double end_v = m->end_v = sqrt(end_v2);
+    // Determine time spent in each portion of move (time is the
+    // distance divided by average velocity)
+    m->accel_t = accel_d / ((start_v + cruise_v) * 0.5);
+    m->cruise_t = cruise_d / cruise_v;
+    m->decel_t = decel_d / ((end_v + cruise_v) * 0.5);
+}
+
+// Traverse the queue from last to first move and determine the
+// maximum junction speeds assuming the robot comes to a complete stop
+// after the last move.  Returns the number of moves (at the start of
+// the queue) that are ready to be queued with lookahead_queue_moves().
+// In "lazy" mode, only moves that can not change from later
+// additions to the queue are made ready.
+int __visible
+lookahead_flush(struct lookahead *la, int lazy)
+{
+    struct la_move *moves = &la->moves[la->moves_pos];
+    int update_flush_count = lazy, flush_count = la->moves_count;
+    int delayed = 0, i;
+    double next_end_v2 = 0., next_smoothed_v2 = 0., peak_cruise_v2 = 0.;
+    for (i = flush_count - 1; i >= 0; i--) {
+        struct la_move *m = &moves[i];
+        double reachable_start_v2 = next_end_v2 + m->delta_v2;
+        double start_v2 = min2(m->max_start_v2, reachable_start_v2);
+        double reachable_smoothed_v2 = next_smoothed_v2 + m->smooth_delta_v2;
+        double smoothed_v2 = min2(m->max_smoothed_v2, reachable_smoothed_v2);
+        if (smoothed_v2 < reachable_smoothed_v2) {
+            // It's possible for this move to accelerate
+            if (smoothed_v2 + m->smooth_delta_v2 > next_smoothed_v2
+                || delayed) {
+                // This move can decelerate or this is a full accel
+                // move after a full decel move
+                if (update_flush_count && peak_cruise_v2) {
+                    flush_count = i;
+                    update_flush_count = 0;
+                }
+                peak_cruise_v2 = min2(m->max_cruise_v2, (
+                    smoothed_v2 + reachable_smoothed_v2) * .5);
+                if (delayed) {
+                    // Propagate peak_cruise_v2 to any delayed moves
+                    // (which immediately follow this move)
+                    if (!update_flush_count && i < flush_count) {
+                        double mc_v2 = peak_cruise_v2;
+                        int j;
+                        for (j = i + 1; j <= i + delayed; j++) {
+                            struct la_move *dm = &moves[j];
+                            mc_v2 = min2(mc_v2, dm->delayed_start_v2);
+                            set_junction(dm, min2(dm->delayed_start_v2, mc_v2)
+                                         , mc_v2
+                                         , min2(dm->delayed_end_v2, mc_v2));
+                        }
+                    }
+                    delayed = 0;
+                }
+            }
+            if (!update_flush_count && i < flush_count) {
+                double cruise_v2 = min2((start_v2 + reachable_start_v2) * .5
+                                        , min2(m->max_cruise_v2
+                                               , peak_cruise_v2));
+                set_junction(m, min2(start_v2, cruise_v2), cruise_v2
+                             , min2(next_end_v2, cruise_v2));
+            }
+        } else {
+            // Delay calculating this move until peak_cruise_v2 is known
+            m->delayed_start_v2 = start_v2;
+            m->delayed_end_v2 = next_end_v2;
+            delayed++;
+        }
+        next_end_v2 = start_v2;
+        next_smoothed_v2 = smoothed_v2;
+    }
+    if (update_flush_count)
+        return 0;
+    return flush_count;
+}
+
+// Remove 'count' flushed moves from the start of the queue, append
+// them to the given trapq, and store their timing in 'timings'.
+// Returns the print time at the end of the last move.
+double __visible
+lookahead_queue_moves(struct lookahead *la, struct trapq *tq
+                      , double print_time, int count
+                      , struct lookahead_timing *timings)
+{
+    if (count > la->moves_count)
+        count = la->moves_count;
+    struct la_move *m = &la->moves[la->moves_pos];
+    int i;
+    for (i = 0; i < count; i++, m++) {
+        if (m->is_kinematic_move && tq)
+            trapq_append(tq, print_time, m->accel_t, m->cruise_t, m->decel_t
+                         , m->start_pos.x, m->start_pos.y, m->start_pos.z
+                         , m->axes_r.x, m->axes_r.y, m->axes_r.z
+                         , m->start_v, m->cruise_v, m->accel);
+        if (timings) {
+            struct lookahead_timing *t = &timings[i];
+            t->print_time = print_time;
+            t->accel_t = m->accel_t;
+            t->cruise_t = m->cruise_t;
+            t->decel_t = m->decel_t;
+            t->start_v = m->start_v;
+            t->cruise_v = m->cruise_v;
+            t->end_v = m->end_v;
+        }
+        print_time = print_time + m->accel_t + m->cruise_t + m->decel_t;
+    }
+    la->moves_pos += count;
+    la->moves_count -= count;
+    if (!la->moves_count)
+        la->moves_pos = 0;
+    return print_time;
+}
+
+// Discard all queued moves
+void __visible
+lookahead_reset(struct lookahead *la)
+{
+    la->moves_pos = la->moves_count = 0;
+}
+
+// Allocate a new 'lookahead' object
+struct lookahead * __visible
+lookahead_alloc(void)
+{
+    struct lookahead *la = malloc(sizeof(*la));
+    memset(la, 0, sizeof(*la));
+    return la;
+}
+
+// Free memory associated with a 'lookahead' object
+void __visible
+lookahead_free(struct lookahead *la)
+{
+    if (!la)
+        return;
+    free(la->moves);
+    free(la);
+}
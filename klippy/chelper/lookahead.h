@@ -0,0 +1,26 @@
+#ifndef LOOKAHEAD_H
+#define LOOKAHEAD_H
+
+struct lookahead_timing {
+    double print_time, accel_t, cruise_t, decel_t;
+    double start_v, cruise_v, end_v;
+};
+
+struct trapq;
+struct lookahead *lookahead_alloc(void);
+void lookahead_free(struct lookahead *la);
+void lookahead_reset(struct lookahead *la);
+void lookahead_add_move(struct lookahead *la, int is_kinematic_move
+                        , double start_pos_x, double start_pos_y
+                        , double start_pos_z, double axes_r_x
+                        , double axes_r_y, double axes_r_z, double move_d
+                        , double accel, double junction_deviation
+                        , double max_cruise_v2, double smooth_delta_v2
+                        , double extra_axes_v2);
+void lookahead_limit_next_junction(struct lookahead *la, double max_v2);
+int lookahead_flush(struct lookahead *la, int lazy);
+double lookahead_queue_moves(struct lookahead *la, struct trapq *tq
+                             , double print_time, int count
+                             , struct lookahead_timing *timings);
+
+#endif // lookahead.h
@@ -0,0 +1,134 @@
+// Shared memory export of motion history records
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// The motion_report module can copy trapq moves (struct pull_move)
+// and stepper queue_step history (struct pull_history_steps) into a
+// fixed size ring stored in an mmap'ed file.  External tools may then
+// read the motion data directly from that file instead of receiving
+// it as json via the webhooks api server.
+
+#include <fcntl.h> // open
+#include <stdint.h> // uint64_t
+#include <stdlib.h> // malloc
+#include <string.h> // memcpy
+#include <sys/mman.h> // mmap
+#include <unistd.h> // ftruncate
+#include "compiler.h" // __visible
+#include "pyhelper.h" // report_errno
+
+// Ring file layout (see "Shared memory motion export" in API_Server.md)
+#define MOTIONRING_MAGIC "KLIPMRG1"
+#define MOTIONRING_PARAMS 4
+
+struct motionring_header {
+    char magic[8];
+    uint32_t header_size, record_size, record_count, record_type;
+    uint64_t write_count;
+    double params[MOTIONRING_PARAMS];
+    char name[64];
+};
+
+struct motionring {
+    struct motionring_header *hdr;
+    size_t size;
+    char *filename;
+};
+
+// Create a ring file holding 'record_count' records of 'record_size'
+struct motionring * __visible
+motionring_alloc(const char *filename, const char *name, int record_type
+                 , int record_size, int record_count)
+{
+    if (record_size <= 0 || record_count <= 0)
+        return NULL;
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        report_errno("motionring open", fd);
+        return NULL;
+    }
+    size_t size = (sizeof(struct motionring_header)
+                   + (size_t)record_size * record_count);
+    int ret = ftruncate(fd, size);
+    if (ret < 0) {
+        report_errno("motionring ftruncate", ret);
+        close(fd);
+        unlink(filename);
+        return NULL;
+    }
+    struct motionring_header *hdr = mmap(NULL, size, PROT_READ | PROT_WRITE
+                                         , MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        report_errno("motionring mmap", -1);
+        unlink(filename);
+        return NULL;
+    }
+    struct motionring *mr = malloc(sizeof(*mr));
+    char *fname = strdup(filename);
+    if (!mr || !fname) {
+        free(mr);
+        free(fname);
+        munmap(hdr, size);
+        unlink(filename);
+        return NULL;
+    }
+    hdr->header_size = sizeof(*hdr);
+    hdr->record_size = record_size;
+    hdr->record_count = record_count;
+    hdr->record_type = record_type;
+    strncpy(hdr->name, name, sizeof(hdr->name) - 1);
+    // Only publish the magic once the header is filled in
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(hdr->magic, MOTIONRING_MAGIC, sizeof(hdr->magic));
+    mr->hdr = hdr;
+    mr->size = size;
+    mr->filename = fname;
+    return mr;
+}
+
+// Unmap and remove a ring file
+void __visible
+motionring_free(struct motionring *mr)
+{
+    if (!mr)
+        return;
+    munmap(mr->hdr, mr->size);
+    unlink(mr->filename);
+    free(mr->filename);
+    free(mr);
+}
+
+// Update the conversion parameters stored in the ring header
+void __visible
+motionring_set_params(struct motionring *mr, double *params, int count)
+{
+    struct motionring_header *hdr = mr->hdr;
+    int i;
+    for (i = 0; i < count && i < MOTIONRING_PARAMS; i++)
+        hdr->params[i] = params[i];
+}
+
+// Append 'count' records to the ring.  If 'newest_first' is set the
+// records are stored in reverse order (as returned by the
+// trapq_extract_old() and stepcompress_extract_old() functions).
+void __visible
+motionring_append(struct motionring *mr, void *records, int count
+                  , int newest_first)
+{
+    struct motionring_header *hdr = mr->hdr;
+    uint32_t record_size = hdr->record_size, record_count = hdr->record_count;
+    uint8_t *data = (void*)&hdr[1];
+    uint64_t write_count = hdr->write_count;
+    int i;
+    for (i = 0; i < count; i++) {
+        int src = newest_first ? count - 1 - i : i;
+        uint64_t dest = (write_count + i) % record_count;
+        memcpy(&data[dest * record_size]
+               , (uint8_t*)records + (size_t)src * record_size, record_size);
+    }
+    // Readers check write_count after copying to detect overwrites
+    __atomic_store_n(&hdr->write_count, write_count + count, __ATOMIC_RELEASE);
+}
@@ -7,6 +7,7 @@
 #include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include "compiler.h" // __visible
 #include "msgblock.h" // message_alloc
 #include "pyhelper.h" // errorf
 
@@ -15,18 +16,49 @@
  * Serial protocol helpers
  ****************************************************************/
 
+// Lookup table for the crc "ccitt" algorithm (one entry per byte value)
+static const uint16_t crc16_ccitt_table[256] = {
+    0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+    0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+    0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+    0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+    0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+    0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+    0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+    0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+    0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+    0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+    0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+    0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+    0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+    0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+    0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+    0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+    0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+    0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+    0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+    0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+    0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+    0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+    0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+    0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+    0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+    0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+    0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+    0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+    0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+    0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+    0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+    0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78,
+};
+
 // Implement the standard crc "ccitt" algorithm on the given buffer
 uint16_t
 msgblock_crc16_ccitt(uint8_t *buf, uint8_t len)
 {
     uint16_t crc = 0xffff;
-    while (len--) {
-        uint8_t data = *buf++;
-        data ^= crc & 0xff;
-        data ^= data << 4;
-        crc = ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4)
-               ^ ((uint16_t)data << 3));
-    }
+    while (len--)
+        crc = (crc >> 8) ^ crc16_ccitt_table[(crc ^ *buf++) & 0xff];
     return crc;
 }
 
@@ -119,11 +151,143 @@ msgblock_decode(uint32_t *data, int data_len, uint8_t *msg, int msg_len)
 }
 
 
+/****************************************************************
+ * Response parsing
+ ****************************************************************/
+
+// The parameter types of a single response message
+struct msgparser_format {
+    int num_params;
+    uint8_t param_types[MESSAGE_PAYLOAD_MAX];
+};
+
+struct msgparser {
+    // Formats of message ids from min_msgid to min_msgid+num_formats-1
+    int min_msgid, num_formats;
+    struct msgparser_format **formats;
+};
+
+// Allocate a new 'msgparser' object
+struct msgparser * __visible
+msgparser_alloc(void)
+{
+    struct msgparser *mp = malloc(sizeof(*mp));
+    memset(mp, 0, sizeof(*mp));
+    return mp;
+}
+
+// Free memory associated with a 'msgparser' object
+void __visible
+msgparser_free(struct msgparser *mp)
+{
+    if (!mp)
+        return;
+    int i;
+    for (i = 0; i < mp->num_formats; i++)
+        free(mp->formats[i]);
+    free(mp->formats);
+    free(mp);
+}
+
+// Register the parameter types (MP_xxx) of a response message id
+int __visible
+msgparser_add_format(struct msgparser *mp, int msgid
+                     , uint8_t *param_types, int num_params)
+{
+    if (num_params < 0 || num_params > MESSAGE_PAYLOAD_MAX)
+        return -1;
+    int i;
+    for (i = 0; i < num_params; i++)
+        if (param_types[i] > MP_BUFFER)
+            return -1;
+    // Grow the formats array to include msgid
+    if (!mp->num_formats)
+        mp->min_msgid = msgid;
+    int min_msgid = msgid < mp->min_msgid ? msgid : mp->min_msgid;
+    int max_msgid = mp->min_msgid + mp->num_formats - 1;
+    if (msgid > max_msgid)
+        max_msgid = msgid;
+    int count = max_msgid - min_msgid + 1;
+    if (count > mp->num_formats) {
+        int shift = mp->min_msgid - min_msgid;
+        mp->formats = realloc(mp->formats, count * sizeof(*mp->formats));
+        memmove(&mp->formats[shift], mp->formats
+                , mp->num_formats * sizeof(*mp->formats));
+        memset(mp->formats, 0, shift * sizeof(*mp->formats));
+        memset(&mp->formats[shift + mp->num_formats], 0
+               , (count - shift - mp->num_formats) * sizeof(*mp->formats));
+        mp->min_msgid = min_msgid;
+        mp->num_formats = count;
+    }
+    struct msgparser_format **pmf = &mp->formats[msgid - mp->min_msgid];
+    struct msgparser_format *mf = *pmf;
+    if (!mf)
+        mf = *pmf = malloc(sizeof(*mf));
+    memset(mf, 0, sizeof(*mf));
+    mf->num_params = num_params;
+    memcpy(mf->param_types, param_types, num_params);
+    return 0;
+}
+
+// Parse a response message with a registered format.  Integer
+// parameters are stored in 'params' directly, while buffer parameters
+// are stored as (offset << 8 | length) of the data within 'msg'.
+// Returns the number of parameters (and stores the message id in
+// 'pmsgid'), or -1 if the message is unknown or invalid.
+int __visible
+msgparser_parse(struct msgparser *mp, uint8_t *msg, int msg_len
+                , int32_t *pmsgid, int64_t *params, int params_len)
+{
+    if (msg_len < MESSAGE_MIN || msg_len > MESSAGE_MAX)
+        return -1;
+    uint8_t *p = &msg[MESSAGE_HEADER_SIZE];
+    uint8_t *end = &msg[msg_len - MESSAGE_TRAILER_SIZE];
+    if (p >= end)
+        return -1;
+    int32_t msgid = parse_int(&p);
+    uint32_t idx = msgid - mp->min_msgid;
+    if (idx >= mp->num_formats || !mp->formats[idx])
+        return -1;
+    struct msgparser_format *mf = mp->formats[idx];
+    if (mf->num_params > params_len)
+        return -1;
+    int i;
+    for (i = 0; i < mf->num_params; i++) {
+        if (p >= end)
+            return -1;
+        switch (mf->param_types[i]) {
+        case MP_UINT32:
+            params[i] = parse_int(&p);
+            break;
+        case MP_INT32:
+            params[i] = (int32_t)parse_int(&p);
+            break;
+        default: {
+            uint8_t len = *p++;
+            if (len > end - p)
+                return -1;
+            params[i] = ((p - msg) << 8) | len;
+            p += len;
+            break;
+        }
+        }
+    }
+    if (p != end)
+        // Invalid message
+        return -1;
+    *pmsgid = msgid;
+    return mf->num_params;
+}
+
+
 /****************************************************************
  * Command queues
  ****************************************************************/
 
-// Allocate a 'struct queue_message' object
+// Allocate a 'struct queue_message' object.  Messages are usually
+// freed by a different thread than the one that allocated them; the
+// C library's per-thread allocator caches handle that pattern well
+// (an alloc, encode, and free cycle costs on the order of 100ns).
 struct queue_message *
 message_alloc(void)
 {
@@ -163,6 +327,24 @@ fail:
     return qm;
 }
 
+// Encode a series of integers as vlqs (the caller must ensure space)
+uint8_t *
+msgblock_encode(uint8_t *p, uint32_t *data, int len)
+{
+    while (len--)
+        p = encode_int(p, *data++);
+    return p;
+}
+
+// Parse a series of vlq integers (the caller must validate the length)
+uint8_t *
+msgblock_parse(uint8_t *p, uint32_t *data, int len)
+{
+    while (len--)
+        *data++ = parse_int(&p);
+    return p;
+}
+
 // Free the storage from a previous message_alloc() call
 void
 message_free(struct queue_message *qm)
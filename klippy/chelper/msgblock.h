@@ -31,9 +31,14 @@ struct queue_message {
         };
     };
     uint64_t notify_id;
+    // Number of mcu move queue entries used by a stepper command
+    int move_count;
     struct list_node node;
 };
 
+// Parameter types understood by msgparser_parse()
+enum { MP_UINT32, MP_INT32, MP_BUFFER };
+
 struct clock_estimate {
     uint64_t last_clock, conv_clock;
     double conv_time, est_freq;
@@ -42,9 +47,17 @@ struct clock_estimate {
 uint16_t msgblock_crc16_ccitt(uint8_t *buf, uint8_t len);
 int msgblock_check(uint8_t *need_sync, uint8_t *buf, int buf_len);
 int msgblock_decode(uint32_t *data, int data_len, uint8_t *msg, int msg_len);
+struct msgparser *msgparser_alloc(void);
+void msgparser_free(struct msgparser *mp);
+int msgparser_add_format(struct msgparser *mp, int msgid
+                         , uint8_t *param_types, int num_params);
+int msgparser_parse(struct msgparser *mp, uint8_t *msg, int msg_len
+                    , int32_t *pmsgid, int64_t *params, int params_len);
 struct queue_message *message_alloc(void);
 struct queue_message *message_fill(uint8_t *data, int len);
 struct queue_message *message_alloc_and_encode(uint32_t *data, int len);
+uint8_t *msgblock_encode(uint8_t *p, uint32_t *data, int len);
+uint8_t *msgblock_parse(uint8_t *p, uint32_t *data, int len);
 void message_free(struct queue_message *qm);
 void message_queue_free(struct list_head *root);
 uint64_t clock_from_clock32(struct clock_estimate *ce, uint32_t clock32);
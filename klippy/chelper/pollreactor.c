@@ -4,13 +4,15 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#define _GNU_SOURCE
 #include <fcntl.h> // fcntl
-#include <math.h> // ceil
-#include <poll.h> // poll
+#include <poll.h> // ppoll
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "pollreactor.h" // pollreactor_alloc
-#include "pyhelper.h" // report_errno
+#include "pyhelper.h" // report_errno, fill_time
+
+#define PR_MAX_SLEEP 1.
 
 struct pollreactor_timer {
     double waketime;
@@ -98,7 +100,7 @@ pollreactor_update_timer(struct pollreactor *pr, int pos, double waketime)
 }
 
 // Internal code to invoke timer callbacks
-static int
+static double
 pollreactor_check_timers(struct pollreactor *pr, double eventtime, int busy)
 {
     if (eventtime >= pr->next_timer) {
@@ -118,10 +120,12 @@ pollreactor_check_timers(struct pollreactor *pr, double eventtime, int busy)
         }
     }
     if (busy)
-        return 0;
+        return 0.;
     // Calculate sleep duration
-    double timeout = ceil((pr->next_timer - eventtime) * 1000.);
-    return timeout < 1. ? 1 : (timeout > 1000. ? 1000 : (int)timeout);
+    double timeout = pr->next_timer - eventtime;
+    if (timeout > PR_MAX_SLEEP)
+        return PR_MAX_SLEEP;
+    return timeout < 0. ? 0. : timeout;
 }
 
 // Repeatedly check for timer and fd events and invoke their callbacks
@@ -131,9 +135,11 @@ pollreactor_run(struct pollreactor *pr)
     double eventtime = get_monotonic();
     int busy = 1;
     while (! pr->must_exit) {
-        int timeout = pollreactor_check_timers(pr, eventtime, busy);
+        double timeout = pollreactor_check_timers(pr, eventtime, busy);
         busy = 0;
-        int ret = poll(pr->fds, pr->num_fds, timeout);
+        // Use ppoll() so that timers are not rounded up to milliseconds
+        struct timespec ts = fill_time(timeout);
+        int ret = ppoll(pr->fds, pr->num_fds, &ts, NULL);
         eventtime = get_monotonic();
         if (ret > 0) {
             busy = 1;
@@ -142,7 +148,7 @@ pollreactor_run(struct pollreactor *pr)
                 if (pr->fds[i].revents)
                     pr->fd_callbacks[i](pr->callback_data, eventtime);
         } else if (ret < 0) {
-            report_errno("poll", ret);
+            report_errno("ppoll", ret);
             pr->must_exit = 1;
         }
     }
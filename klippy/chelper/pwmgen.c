@@ -0,0 +1,238 @@
+// Generate pwm updates that follow the toolhead velocity
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// A laser (or spindle) output should be reduced while the toolhead
+// accelerates and decelerates so that the energy delivered per
+// distance stays constant.  Instead of splitting moves, the requested
+// power level is scaled by the toolhead velocity found in the trapq.
+// The velocity is constant during cruise moves, so updates are only
+// generated every 'update_time' seconds while accelerating or
+// decelerating.  Updates are sent to the mcu in queue_pwm_out_multi
+// (or queue_digital_out_multi) messages.
+
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "list.h" // list_add_tail
+#include "msgblock.h" // msgblock_encode
+#include "stepcompress.h" // stepcompress_queue_mq_batch
+#include "trapq.h" // trapq_check_sentinels
+
+#define NEVER_TIME 9999999999999999.9
+#define MSG_MAX_UPDATES 8
+#define MSG_MAX_DATA 40
+
+struct pwm_request {
+    struct list_node node;
+    double print_time, value;
+};
+
+struct pwmgen {
+    struct trapq *tq;
+    struct stepcompress *sc;
+    int32_t msgtag;
+    uint32_t oid, invert, default_value, duration_ticks;
+    double pwm_max, full_velocity, update_time;
+    // Generation state
+    double last_time, value;
+    struct list_head requests;
+    uint64_t last_clock;
+    uint32_t last_value;
+    // Message being built
+    uint64_t msg_clock, msg_last_clock;
+    int msg_count, msg_len;
+    uint8_t msg_data[MSG_MAX_DATA + 10];
+};
+
+// Transmit the pending queue_*_multi message (if any)
+static int
+flush_msg(struct pwmgen *pg)
+{
+    if (!pg->msg_count)
+        return 0;
+    uint8_t msg[MESSAGE_PAYLOAD_MAX];
+    uint32_t hdr[3] = { pg->msgtag, pg->oid, pg->msg_clock };
+    uint8_t *p = msgblock_encode(msg, hdr, 3);
+    *p++ = pg->msg_len;
+    memcpy(p, pg->msg_data, pg->msg_len);
+    p += pg->msg_len;
+    int ret = stepcompress_queue_mq_batch(pg->sc, pg->msg_clock
+                                          , pg->msg_last_clock, pg->msg_count
+                                          , msg, p - msg);
+    pg->msg_count = pg->msg_len = 0;
+    return ret;
+}
+
+// Add an update of the pin to the pending message
+static int
+add_update(struct pwmgen *pg, uint64_t clock, uint32_t value)
+{
+    if (clock < pg->last_clock)
+        clock = pg->last_clock;
+    if (pg->msg_count && (pg->msg_count >= MSG_MAX_UPDATES
+                          || pg->msg_len > MSG_MAX_DATA)) {
+        int ret = flush_msg(pg);
+        if (ret)
+            return ret;
+    }
+    if (!pg->msg_count)
+        pg->msg_clock = pg->msg_last_clock = clock;
+    uint32_t data[2] = { clock - pg->msg_last_clock, value };
+    uint8_t *p = msgblock_encode(&pg->msg_data[pg->msg_len], data, 2);
+    pg->msg_len = p - pg->msg_data;
+    pg->msg_count++;
+    pg->msg_last_clock = pg->last_clock = clock;
+    pg->last_value = value;
+    return 0;
+}
+
+// Set the output for the period starting at 'print_time'
+static int
+set_output(struct pwmgen *pg, double print_time, double velocity)
+{
+    double power = pg->value;
+    if (velocity < pg->full_velocity)
+        power *= velocity / pg->full_velocity;
+    if (pg->invert)
+        power = 1. - power;
+    uint32_t value = power * pg->pwm_max + .5;
+    if (value == pg->last_value)
+        return 0;
+    return add_update(pg, stepcompress_calc_clock(pg->sc, print_time), value);
+}
+
+// Resend the current value before the mcu max_duration check expires
+static int
+check_resend(struct pwmgen *pg, double end_time)
+{
+    if (!pg->duration_ticks || pg->last_value == pg->default_value)
+        return 0;
+    uint64_t end_clock = stepcompress_calc_clock(pg->sc, end_time);
+    while (end_clock >= pg->last_clock + pg->duration_ticks) {
+        int ret = add_update(pg, pg->last_clock + pg->duration_ticks
+                             , pg->last_value);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+// Generate the pwm updates up until 'flush_time'
+int32_t __visible
+pwmgen_generate(struct pwmgen *pg, double flush_time)
+{
+    double t = pg->last_time;
+    if (!pg->tq || t >= flush_time) {
+        pg->last_time = flush_time;
+        return 0;
+    }
+    trapq_check_sentinels(pg->tq);
+    struct move *m = list_first_entry(&pg->tq->moves, struct move, node);
+    while (t >= m->print_time + m->move_t)
+        m = list_next_entry(m, node);
+    while (t < flush_time) {
+        // Apply requested power changes
+        double req_time = NEVER_TIME;
+        while (!list_empty(&pg->requests)) {
+            struct pwm_request *r = list_first_entry(
+                &pg->requests, struct pwm_request, node);
+            if (r->print_time > t) {
+                req_time = r->print_time;
+                break;
+            }
+            pg->value = r->value;
+            list_del(&r->node);
+            free(r);
+        }
+        // Find the period with a constant output
+        double move_end = m->print_time + m->move_t, end = move_end;
+        if (end > flush_time)
+            end = flush_time;
+        if (end > req_time)
+            end = req_time;
+        double velocity = m->start_v;
+        if (m->half_accel) {
+            if (end > t + pg->update_time)
+                end = t + pg->update_time;
+            double mid = .5 * (t + end) - m->print_time;
+            velocity += 2. * m->half_accel * mid;
+        }
+        int ret = set_output(pg, t, velocity);
+        if (ret)
+            return ret;
+        ret = check_resend(pg, end);
+        if (ret)
+            return ret;
+        t = end;
+        if (t >= move_end)
+            m = list_next_entry(m, node);
+    }
+    pg->last_time = flush_time;
+    return flush_msg(pg);
+}
+
+// Request a new power level (0.0 to 1.0) starting at 'print_time'
+void __visible
+pwmgen_set_value(struct pwmgen *pg, double print_time, double value)
+{
+    struct pwm_request *r = malloc(sizeof(*r));
+    r->print_time = print_time;
+    r->value = value;
+    list_add_tail(&r->node, &pg->requests);
+}
+
+// Set the trapq that the toolhead velocity is obtained from
+void __visible
+pwmgen_set_trapq(struct pwmgen *pg, struct trapq *tq, double start_time)
+{
+    pg->tq = tq;
+    pg->last_time = start_time;
+}
+
+// Configure the output pin
+void __visible
+pwmgen_setup(struct pwmgen *pg, struct stepcompress *sc, int32_t msgtag
+             , uint32_t oid, uint32_t invert, double pwm_max
+             , uint32_t default_value, uint32_t duration_ticks
+             , uint64_t last_clock, uint32_t last_value
+             , double full_velocity, double update_time)
+{
+    pg->sc = sc;
+    pg->msgtag = msgtag;
+    pg->oid = oid;
+    pg->invert = invert;
+    pg->pwm_max = pwm_max;
+    pg->default_value = default_value;
+    pg->duration_ticks = duration_ticks;
+    pg->last_clock = last_clock;
+    pg->last_value = last_value;
+    pg->full_velocity = full_velocity;
+    pg->update_time = update_time;
+}
+
+struct pwmgen * __visible
+pwmgen_alloc(void)
+{
+    struct pwmgen *pg = malloc(sizeof(*pg));
+    memset(pg, 0, sizeof(*pg));
+    list_init(&pg->requests);
+    return pg;
+}
+
+void __visible
+pwmgen_free(struct pwmgen *pg)
+{
+    if (!pg)
+        return;
+    while (!list_empty(&pg->requests)) {
+        struct pwm_request *r = list_first_entry(
+            &pg->requests, struct pwm_request, node);
+        list_del(&r->node);
+        free(r);
+    }
+    free(pg);
+}
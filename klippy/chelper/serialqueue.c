@@ -12,15 +12,24 @@
 // clock times, prioritizes commands, and handles retransmissions.  A
 // background thread is launched to do this work and minimize latency.
 
+#define _GNU_SOURCE
+#include <errno.h> // errno
+#include <fcntl.h> // open
 #include <linux/can.h> // // struct can_frame
+#include <linux/can/raw.h> // CAN_RAW_FD_FRAMES
 #include <math.h> // fabs
+#include <net/if.h> // struct ifreq
 #include <pthread.h> // pthread_mutex_lock
 #include <stddef.h> // offsetof
 #include <stdint.h> // uint64_t
 #include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sys/ioctl.h> // ioctl
+#include <sys/mman.h> // mmap
+#include <sys/socket.h> // sendmmsg
 #include <termios.h> // tcflush
+#include <time.h> // clock_gettime
 #include <unistd.h> // pipe
 #include "compiler.h" // __visible
 #include "list.h" // list_add_tail
@@ -32,21 +41,23 @@
 struct command_queue {
     struct list_head upcoming_queue, ready_queue;
     struct list_node node;
+    // Messages submitted, but not yet moved to upcoming_queue
+    struct list_head incoming_queue;
+    struct list_node incoming_node;
 };
 
 struct serialqueue {
     // Input reading
     struct pollreactor *pr;
-    int serial_fd, serial_fd_type, client_id;
+    int serial_fd, serial_fd_type, client_id, can_fd;
     int pipe_fds[2];
     uint8_t input_buf[4096];
     uint8_t need_sync;
     int input_pos;
+    double receive_delay;
     // Threading
     pthread_t tid;
     pthread_mutex_t lock; // protects variables below
-    pthread_cond_t cond;
-    int receive_waiting;
     // Baud / clock tracking
     int receive_window;
     double bittime_adjust, idle_time;
@@ -57,21 +68,35 @@ struct serialqueue {
     uint64_t ignore_nak_seq, last_ack_seq, retransmit_seq, rtt_sample_seq;
     struct list_head sent_queue;
     double srtt, rttvar, rto;
+    int pending_blocks;
     // Pending transmission message queues
     struct list_head pending_queues;
     int ready_bytes, upcoming_bytes, need_ack_bytes, last_ack_bytes;
-    uint64_t need_kick_clock;
     struct list_head notify_queue;
     double last_write_fail_time;
-    // Received messages
-    struct list_head receive_queue;
     // Fastreader support
     pthread_mutex_t fast_reader_dispatch_lock;
     struct list_head fast_readers;
     // Debugging
-    struct list_head old_sent, old_receive;
+    struct list_head old_sent;
+    struct capture_header *capture;
+    size_t capture_size;
     // Stats
     uint32_t bytes_write, bytes_read, bytes_retransmit, bytes_invalid;
+    uint32_t frames_write, frames_read;
+    int ready_bytes_max, need_ack_bytes_max;
+    double receive_delay_max;
+    // Submitted messages (only held briefly so that callers adding
+    // messages never wait for the background thread)
+    pthread_mutex_t submit_lock; // protects variables below
+    struct list_head incoming_queues;
+    int incoming_bytes;
+    uint64_t need_kick_clock;
+    // Received messages
+    pthread_mutex_t receive_lock; // protects variables below
+    pthread_cond_t cond;
+    int receive_waiting;
+    struct list_head receive_queue, old_receive;
 };
 
 #define SQPF_SERIAL 0
@@ -88,7 +113,9 @@ struct serialqueue {
 
 #define MIN_RTO 0.025
 #define MAX_RTO 5.000
+#define MIN_PENDING_BLOCKS 4
 #define MAX_PENDING_BLOCKS 12
+#define CAN_MAX_FRAMES DIV_ROUND_UP(MESSAGE_MAX * MAX_PENDING_BLOCKS + 1, 8)
 #define MIN_REQTIME_DELTA 0.250
 #define MIN_BACKGROUND_DELTA 0.005
 #define IDLE_QUERY_TIME 1.0
@@ -96,6 +123,44 @@ struct serialqueue {
 #define DEBUG_QUEUE_SENT 100
 #define DEBUG_QUEUE_RECEIVE 100
 
+// Binary capture file layout (see parsedump.py)
+#define CAPTURE_MAGIC "KLIPCAP1"
+#define CAPTURE_SENT       0x01
+#define CAPTURE_RECEIVE    0x02
+#define CAPTURE_RETRANSMIT 0x04
+
+struct capture_header {
+    char magic[8];
+    uint32_t header_size, record_size, record_count, reserved;
+    uint64_t write_count;
+    uint8_t pad[32];
+};
+
+struct capture_record {
+    double time;
+    uint64_t clock;
+    uint8_t flags, len, pad[6];
+    uint8_t msg[MESSAGE_MAX];
+};
+
+// Store a message block in the capture file (if one is active)
+static void
+capture_add(struct serialqueue *sq, uint8_t flags, double time
+            , uint8_t *msg, int len)
+{
+    struct capture_header *ch = sq->capture;
+    if (!ch)
+        return;
+    struct capture_record *records = (void*)&ch[1];
+    struct capture_record *cr = &records[ch->write_count % ch->record_count];
+    cr->time = time;
+    cr->clock = clock_from_time(&sq->ce, time);
+    cr->flags = flags;
+    cr->len = len;
+    memcpy(cr->msg, msg, len);
+    ch->write_count++;
+}
+
 // Create a series of empty messages and add them to a list
 static void
 debug_queue_alloc(struct list_head *root, int count)
@@ -118,7 +183,8 @@ debug_queue_add(struct list_head *root, struct queue_message *qm)
     message_free(old);
 }
 
-// Wake up the receiver thread if it is waiting
+// Wake up the receiver thread if it is waiting (caller must hold
+// sq->receive_lock)
 static void
 check_wake_receive(struct serialqueue *sq)
 {
@@ -128,6 +194,16 @@ check_wake_receive(struct serialqueue *sq)
     }
 }
 
+// Add a list of messages to the receive queue
+static void
+add_receive_messages(struct serialqueue *sq, struct list_head *msgs)
+{
+    pthread_mutex_lock(&sq->receive_lock);
+    list_join_tail(msgs, &sq->receive_queue);
+    check_wake_receive(sq);
+    pthread_mutex_unlock(&sq->receive_lock);
+}
+
 // Write to the internal pipe to wake the background thread if in poll
 static void
 kick_bg_thread(struct serialqueue *sq)
@@ -204,6 +280,19 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
         else if (sq->rto > MAX_RTO)
             sq->rto = MAX_RTO;
         sq->rtt_sample_seq = 0;
+
+        // Only keep enough blocks in flight to cover the round trip
+        // time (so that high priority messages aren't queued behind a
+        // long backlog of data on a slow link)
+        if (sq->bittime_adjust) {
+            double block_time = calculate_bittime(sq, MESSAGE_MAX);
+            int blocks = (sq->srtt + rttvar4) / block_time + 2;
+            if (blocks < MIN_PENDING_BLOCKS)
+                blocks = MIN_PENDING_BLOCKS;
+            else if (blocks > MAX_PENDING_BLOCKS)
+                blocks = MAX_PENDING_BLOCKS;
+            sq->pending_blocks = blocks;
+        }
     }
     if (list_empty(&sq->sent_queue)) {
         pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, PR_NEVER);
@@ -220,6 +309,7 @@ static void
 handle_message(struct serialqueue *sq, double eventtime, int len)
 {
     pthread_mutex_lock(&sq->lock);
+    capture_add(sq, CAPTURE_RECEIVE, eventtime, sq->input_buf, len);
 
     // Calculate receive sequence number
     uint32_t rseq_delta = ((sq->input_buf[MESSAGE_POS_SEQ] - sq->receive_seq)
@@ -238,6 +328,8 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
     sq->bytes_read += len;
 
     // Check for pending messages on notify_queue
+    struct list_head received;
+    list_init(&received);
     int must_wake = 0;
     while (!list_empty(&sq->notify_queue)) {
         struct queue_message *qm = list_first_entry(
@@ -250,10 +342,27 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         qm->len = 0;
         qm->sent_time = sq->last_receive_sent_time;
         qm->receive_time = eventtime;
-        list_add_tail(&qm->node, &sq->receive_queue);
+        list_add_tail(&qm->node, &received);
         must_wake = 1;
     }
 
+    // Check fast readers
+    struct fastreader *fr, *match = NULL;
+    list_for_each_entry(fr, &sq->fast_readers, node) {
+        if (len < fr->prefix_len + MESSAGE_MIN
+            || memcmp(&sq->input_buf[MESSAGE_HEADER_SIZE]
+                      , fr->prefix, fr->prefix_len) != 0)
+            continue;
+        match = fr;
+        break;
+    }
+
+    // Determine message timing
+    double sent_time = (rseq > sq->retransmit_seq
+                        ? sq->last_receive_sent_time : 0.);
+    double receive_time = get_monotonic(); // must be time post read()
+    receive_time -= sq->receive_delay + calculate_bittime(sq, len);
+
     // Process message
     if (len == MESSAGE_MIN) {
         // Ack/nak message
@@ -262,55 +371,84 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         else if (rseq > sq->ignore_nak_seq && !list_empty(&sq->sent_queue))
             // Duplicate Ack is a Nak - do fast retransmit
             pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, PR_NOW);
-    } else {
+    } else if (!match || !match->is_exclusive) {
         // Data message - add to receive queue
         struct queue_message *qm = message_fill(sq->input_buf, len);
-        qm->sent_time = (rseq > sq->retransmit_seq
-                         ? sq->last_receive_sent_time : 0.);
-        qm->receive_time = get_monotonic(); // must be time post read()
-        qm->receive_time -= calculate_bittime(sq, len);
-        list_add_tail(&qm->node, &sq->receive_queue);
+        qm->sent_time = sent_time;
+        qm->receive_time = receive_time;
+        list_add_tail(&qm->node, &received);
         must_wake = 1;
     }
 
-    // Check fast readers
-    struct fastreader *fr;
-    list_for_each_entry(fr, &sq->fast_readers, node) {
-        if (len < fr->prefix_len + MESSAGE_MIN
-            || memcmp(&sq->input_buf[MESSAGE_HEADER_SIZE]
-                      , fr->prefix, fr->prefix_len) != 0)
-            continue;
+    if (match) {
         // Release main lock and invoke callback
         pthread_mutex_lock(&sq->fast_reader_dispatch_lock);
         if (must_wake)
-            check_wake_receive(sq);
+            add_receive_messages(sq, &received);
         pthread_mutex_unlock(&sq->lock);
-        fr->func(fr, sq->input_buf, len);
+        match->sent_time = sent_time;
+        match->receive_time = receive_time;
+        match->func(match, sq->input_buf, len);
         pthread_mutex_unlock(&sq->fast_reader_dispatch_lock);
         return;
     }
 
     if (must_wake)
-        check_wake_receive(sq);
+        add_receive_messages(sq, &received);
     pthread_mutex_unlock(&sq->lock);
 }
 
+#define MAX_RECEIVE_DELAY 0.100
+
+// Determine how long ago the kernel received a canbus frame
+static double
+can_receive_delay(struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+            continue;
+        struct timespec ts, now;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        clock_gettime(CLOCK_REALTIME, &now);
+        double delay = ((double)(now.tv_sec - ts.tv_sec)
+                        + (double)(now.tv_nsec - ts.tv_nsec) * .000000001);
+        if (delay < 0. || delay > MAX_RECEIVE_DELAY)
+            // Timestamp not usable (eg, system time was changed)
+            return 0.;
+        return delay;
+    }
+    return 0.;
+}
+
 // Callback for input activity on the serial fd
 static void
 input_event(struct serialqueue *sq, double eventtime)
 {
     if (sq->serial_fd_type == SQT_CAN) {
-        struct can_frame cf;
-        int ret = read(sq->serial_fd, &cf, sizeof(cf));
+        // A canfd_frame can also hold a classic can_frame
+        struct canfd_frame cf;
+        struct iovec iov = { .iov_base = &cf, .iov_len = sizeof(cf) };
+        uint8_t cmsgbuf[CMSG_SPACE(sizeof(struct timespec))];
+        struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = cmsgbuf, .msg_controllen = sizeof(cmsgbuf),
+        };
+        int ret = recvmsg(sq->serial_fd, &msg, 0);
         if (ret <= 0) {
             report_errno("can read", ret);
             pollreactor_do_exit(sq->pr);
             return;
         }
-        if (cf.can_id != sq->client_id + 1)
+        sq->receive_delay = can_receive_delay(&msg);
+        if (sq->receive_delay > sq->receive_delay_max)
+            sq->receive_delay_max = sq->receive_delay;
+        sq->frames_read++;
+        if (cf.can_id != sq->client_id + 1 || cf.len > CANFD_MAX_DLEN)
             return;
-        memcpy(&sq->input_buf[sq->input_pos], cf.data, cf.can_dlc);
-        sq->input_pos += cf.can_dlc;
+        memcpy(&sq->input_buf[sq->input_pos], cf.data, cf.len);
+        sq->input_pos += cf.len;
     } else {
         int ret = read(sq->serial_fd, &sq->input_buf[sq->input_pos]
                        , sizeof(sq->input_buf) - sq->input_pos);
@@ -356,24 +494,55 @@ kick_event(struct serialqueue *sq, double eventtime)
     pollreactor_update_timer(sq->pr, SQPT_COMMAND, PR_NOW);
 }
 
+// Determine the number of bytes to place in the next canbus frame
+static int
+can_frame_size(int can_fd, int buflen)
+{
+    if (buflen <= 8 || !can_fd)
+        return buflen > 8 ? 8 : buflen;
+    // CAN-FD frames can only hold certain data lengths
+    static const uint8_t fd_lens[] = { 8, 12, 16, 20, 24, 32, 48, 64 };
+    int i = ARRAY_SIZE(fd_lens) - 1;
+    while (buflen < fd_lens[i])
+        i--;
+    return fd_lens[i];
+}
+
 // OS write of data to be sent to the mcu
-static void
+static int
 do_write(struct serialqueue *sq, void *buf, int buflen)
 {
     if (sq->serial_fd_type != SQT_CAN) {
         int ret = write(sq->serial_fd, buf, buflen);
         if (ret < 0)
             report_errno("write", ret);
-        return;
+        return 0;
     }
-    // Write to CAN fd
-    struct can_frame cf;
+    // Write to CAN fd (submitting all frames with a single syscall)
+    int can_fd = sq->can_fd;
+    struct canfd_frame cf[CAN_MAX_FRAMES];
+    struct iovec iov[CAN_MAX_FRAMES];
+    struct mmsghdr mh[CAN_MAX_FRAMES];
+    memset(mh, 0, sizeof(mh));
+    int count = 0;
     while (buflen) {
-        int size = buflen > 8 ? 8 : buflen;
-        cf.can_id = sq->client_id;
-        cf.can_dlc = size;
-        memcpy(cf.data, buf, size);
-        int ret = write(sq->serial_fd, &cf, sizeof(cf));
+        int size = can_frame_size(can_fd, buflen);
+        memset(&cf[count], 0, offsetof(struct canfd_frame, data));
+        cf[count].can_id = sq->client_id;
+        cf[count].len = size;
+        cf[count].flags = can_fd ? CANFD_BRS : 0;
+        memcpy(cf[count].data, buf, size);
+        iov[count].iov_base = &cf[count];
+        iov[count].iov_len = can_fd ? CANFD_MTU : CAN_MTU;
+        mh[count].msg_hdr.msg_iov = &iov[count];
+        mh[count].msg_hdr.msg_iovlen = 1;
+        count++;
+        buf += size;
+        buflen -= size;
+    }
+    int pos = 0;
+    while (pos < count) {
+        int ret = sendmmsg(sq->serial_fd, &mh[pos], count - pos, 0);
         if (ret < 0) {
             report_errno("can write", ret);
             double curtime = get_monotonic();
@@ -383,12 +552,12 @@ do_write(struct serialqueue *sq, void *buf, int buflen)
                 errorf("Halting reads due to CAN write errors.");
                 pollreactor_do_exit(sq->pr);
             }
-            return;
+            return pos;
         }
         sq->last_write_fail_time = 0.0;
-        buf += size;
-        buflen -= size;
+        pos += ret;
     }
+    return count;
 }
 
 // Callback timer for when a retransmit should be done
@@ -413,8 +582,10 @@ retransmit_event(struct serialqueue *sq, double eventtime)
         buflen += qm->len;
         if (!first_buflen)
             first_buflen = qm->len + 1;
+        capture_add(sq, CAPTURE_SENT | CAPTURE_RETRANSMIT, eventtime
+                    , qm->msg, qm->len);
     }
-    do_write(sq, buf, buflen);
+    sq->frames_write += do_write(sq, buf, buflen);
     sq->bytes_retransmit += buflen;
 
     // Update rto
@@ -488,6 +659,7 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
     buf[len - MESSAGE_TRAILER_CRC] = crc >> 8;
     buf[len - MESSAGE_TRAILER_CRC+1] = crc & 0xff;
     buf[len - MESSAGE_TRAILER_SYNC] = MESSAGE_SYNC;
+    capture_add(sq, CAPTURE_SENT, eventtime, buf, len);
 
     // Store message block
     double idletime = eventtime > sq->idle_time ? eventtime : sq->idle_time;
@@ -503,15 +675,40 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
         sq->rtt_sample_seq = sq->send_seq;
     sq->send_seq++;
     sq->need_ack_bytes += len;
+    if (sq->need_ack_bytes > sq->need_ack_bytes_max)
+        sq->need_ack_bytes_max = sq->need_ack_bytes;
     list_add_tail(&out->node, &sq->sent_queue);
     return len;
 }
 
+// Move messages added by serialqueue_send_batch() to their
+// command_queue's upcoming_queue
+static void
+merge_incoming(struct serialqueue *sq)
+{
+    pthread_mutex_lock(&sq->submit_lock);
+    while (!list_empty(&sq->incoming_queues)) {
+        struct command_queue *cq = list_first_entry(
+            &sq->incoming_queues, struct command_queue, incoming_node);
+        list_del(&cq->incoming_node);
+        if (list_empty(&cq->ready_queue) && list_empty(&cq->upcoming_queue))
+            list_add_tail(&cq->node, &sq->pending_queues);
+        list_join_tail(&cq->incoming_queue, &cq->upcoming_queue);
+        list_init(&cq->incoming_queue);
+    }
+    sq->upcoming_bytes += sq->incoming_bytes;
+    sq->incoming_bytes = 0;
+    pthread_mutex_unlock(&sq->submit_lock);
+}
+
 // Determine the time the next serial data should be sent
 static double
-check_send_command(struct serialqueue *sq, int pending, double eventtime)
+check_send_command(struct serialqueue *sq, int pending, double eventtime
+                   , uint64_t *kick_clock)
 {
-    if (sq->send_seq - sq->receive_seq >= MAX_PENDING_BLOCKS
+    merge_incoming(sq);
+
+    if (sq->send_seq - sq->receive_seq >= sq->pending_blocks
         && sq->receive_seq != (uint64_t)-1)
         // Need an ack before more messages can be sent
         return PR_NEVER;
@@ -544,6 +741,8 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
             list_add_tail(&qm->node, &cq->ready_queue);
             sq->upcoming_bytes -= qm->len;
             sq->ready_bytes += qm->len;
+            if (sq->ready_bytes > sq->ready_bytes_max)
+                sq->ready_bytes_max = sq->ready_bytes;
         }
         // Update min_ready_clock
         if (!list_empty(&cq->ready_queue)) {
@@ -565,7 +764,7 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
     if (! sq->ce.est_freq) {
         if (sq->ready_bytes)
             return PR_NOW;
-        sq->need_kick_clock = MAX_CLOCK;
+        *kick_clock = MAX_CLOCK;
         return PR_NEVER;
     }
     uint64_t reqclock_delta = MIN_REQTIME_DELTA * sq->ce.est_freq;
@@ -574,7 +773,7 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
     uint64_t wantclock = min_ready_clock - reqclock_delta;
     if (min_stalled_clock < wantclock)
         wantclock = min_stalled_clock;
-    sq->need_kick_clock = wantclock;
+    *kick_clock = wantclock;
     return idletime + (wantclock - ack_clock) / sq->ce.est_freq;
 }
 
@@ -582,17 +781,24 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
 static double
 command_event(struct serialqueue *sq, double eventtime)
 {
+    pthread_mutex_lock(&sq->submit_lock);
+    uint64_t kick_clock = sq->need_kick_clock;
+    pthread_mutex_unlock(&sq->submit_lock);
+
     pthread_mutex_lock(&sq->lock);
     uint8_t buf[MESSAGE_MAX * MAX_PENDING_BLOCKS];
     int buflen = 0;
     double waketime;
     for (;;) {
-        waketime = check_send_command(sq, buflen, eventtime);
+        waketime = check_send_command(sq, buflen, eventtime, &kick_clock);
         if (waketime != PR_NOW || buflen + MESSAGE_MAX > sizeof(buf)) {
             if (buflen) {
-                // Write message blocks
-                do_write(sq, buf, buflen);
+                // Write message blocks (without holding the lock)
+                pthread_mutex_unlock(&sq->lock);
+                int frames = do_write(sq, buf, buflen);
+                pthread_mutex_lock(&sq->lock);
                 sq->bytes_write += buflen;
+                sq->frames_write += frames;
                 double idletime = (eventtime > sq->idle_time
                                    ? eventtime : sq->idle_time);
                 sq->idle_time = idletime + calculate_bittime(sq, buflen);
@@ -604,6 +810,14 @@ command_event(struct serialqueue *sq, double eventtime)
         buflen += build_and_send_command(sq, &buf[buflen], buflen, eventtime);
     }
     pthread_mutex_unlock(&sq->lock);
+
+    // Update kick clock (or run again if new messages were added)
+    pthread_mutex_lock(&sq->submit_lock);
+    if (!list_empty(&sq->incoming_queues))
+        waketime = PR_NOW;
+    else
+        sq->need_kick_clock = kick_clock;
+    pthread_mutex_unlock(&sq->submit_lock);
     return waketime;
 }
 
@@ -614,9 +828,9 @@ background_thread(void *data)
     struct serialqueue *sq = data;
     pollreactor_run(sq->pr);
 
-    pthread_mutex_lock(&sq->lock);
+    pthread_mutex_lock(&sq->receive_lock);
     check_wake_receive(sq);
-    pthread_mutex_unlock(&sq->lock);
+    pthread_mutex_unlock(&sq->receive_lock);
 
     return NULL;
 }
@@ -645,9 +859,19 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     fd_set_non_blocking(serial_fd);
     fd_set_non_blocking(sq->pipe_fds[0]);
     fd_set_non_blocking(sq->pipe_fds[1]);
+    if (serial_fd_type == SQT_CAN) {
+        // Request kernel receive timestamps (to exclude host scheduling
+        // latency from message receive times)
+        int enable = 1;
+        ret = setsockopt(serial_fd, SOL_SOCKET, SO_TIMESTAMPNS
+                         , &enable, sizeof(enable));
+        if (ret < 0)
+            report_errno("can SO_TIMESTAMPNS", ret);
+    }
 
     // Retransmit setup
     sq->send_seq = 1;
+    sq->pending_blocks = MAX_PENDING_BLOCKS;
     if (serial_fd_type == SQT_DEBUGFILE) {
         // Debug file output
         sq->receive_seq = -1;
@@ -660,6 +884,7 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     // Queues
     sq->need_kick_clock = MAX_CLOCK;
     list_init(&sq->pending_queues);
+    list_init(&sq->incoming_queues);
     list_init(&sq->sent_queue);
     list_init(&sq->receive_queue);
     list_init(&sq->notify_queue);
@@ -673,6 +898,12 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
 
     // Thread setup
     ret = pthread_mutex_init(&sq->lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_mutex_init(&sq->submit_lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_mutex_init(&sq->receive_lock, NULL);
     if (ret)
         goto fail;
     ret = pthread_cond_init(&sq->cond, NULL);
@@ -712,11 +943,12 @@ serialqueue_free(struct serialqueue *sq)
     if (!pollreactor_is_exit(sq->pr))
         serialqueue_exit(sq);
     pthread_mutex_lock(&sq->lock);
+    merge_incoming(sq);
     message_queue_free(&sq->sent_queue);
-    message_queue_free(&sq->receive_queue);
     message_queue_free(&sq->notify_queue);
     message_queue_free(&sq->old_sent);
-    message_queue_free(&sq->old_receive);
+    if (sq->capture)
+        munmap(sq->capture, sq->capture_size);
     while (!list_empty(&sq->pending_queues)) {
         struct command_queue *cq = list_first_entry(
             &sq->pending_queues, struct command_queue, node);
@@ -725,6 +957,10 @@ serialqueue_free(struct serialqueue *sq)
         message_queue_free(&cq->upcoming_queue);
     }
     pthread_mutex_unlock(&sq->lock);
+    pthread_mutex_lock(&sq->receive_lock);
+    message_queue_free(&sq->receive_queue);
+    message_queue_free(&sq->old_receive);
+    pthread_mutex_unlock(&sq->receive_lock);
     pollreactor_free(sq->pr);
     free(sq);
 }
@@ -737,6 +973,7 @@ serialqueue_alloc_commandqueue(void)
     memset(cq, 0, sizeof(*cq));
     list_init(&cq->ready_queue);
     list_init(&cq->upcoming_queue);
+    list_init(&cq->incoming_queue);
     return cq;
 }
 
@@ -746,7 +983,8 @@ serialqueue_free_commandqueue(struct command_queue *cq)
 {
     if (!cq)
         return;
-    if (!list_empty(&cq->ready_queue) || !list_empty(&cq->upcoming_queue)) {
+    if (!list_empty(&cq->ready_queue) || !list_empty(&cq->upcoming_queue)
+        || !list_empty(&cq->incoming_queue)) {
         errorf("Memory leak! Can't free non-empty commandqueue");
         return;
     }
@@ -792,18 +1030,19 @@ serialqueue_send_batch(struct serialqueue *sq, struct command_queue *cq
         return;
     qm = list_first_entry(msgs, struct queue_message, node);
 
-    // Add list to cq->upcoming_queue
-    pthread_mutex_lock(&sq->lock);
-    if (list_empty(&cq->ready_queue) && list_empty(&cq->upcoming_queue))
-        list_add_tail(&cq->node, &sq->pending_queues);
-    list_join_tail(msgs, &cq->upcoming_queue);
-    sq->upcoming_bytes += len;
+    // Add list to cq->incoming_queue (the background thread moves
+    // it to cq->upcoming_queue)
+    pthread_mutex_lock(&sq->submit_lock);
+    if (list_empty(&cq->incoming_queue))
+        list_add_tail(&cq->incoming_node, &sq->incoming_queues);
+    list_join_tail(msgs, &cq->incoming_queue);
+    sq->incoming_bytes += len;
     int mustwake = 0;
     if (qm->min_clock < sq->need_kick_clock) {
         sq->need_kick_clock = 0;
         mustwake = 1;
     }
-    pthread_mutex_unlock(&sq->lock);
+    pthread_mutex_unlock(&sq->submit_lock);
 
     // Wake the background thread if necessary
     if (mustwake)
@@ -835,18 +1074,38 @@ serialqueue_send(struct serialqueue *sq, struct command_queue *cq, uint8_t *msg
     serialqueue_send_one(sq, cq, qm);
 }
 
+// Schedule the transmission of several messages (stored back to back
+// in 'msgs' with the length of each in 'lens') with a single submission
+void __visible
+serialqueue_send_multi(struct serialqueue *sq, struct command_queue *cq
+                       , uint8_t *msgs, int *lens, int count
+                       , uint64_t min_clock, uint64_t req_clock)
+{
+    struct list_head list;
+    list_init(&list);
+    int i;
+    for (i = 0; i < count; i++) {
+        struct queue_message *qm = message_fill(msgs, lens[i]);
+        qm->min_clock = min_clock;
+        qm->req_clock = req_clock;
+        list_add_tail(&qm->node, &list);
+        msgs += lens[i];
+    }
+    serialqueue_send_batch(sq, cq, &list);
+}
+
 // Return a message read from the serial port (or wait for one if none
 // available)
 void __visible
 serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
 {
-    pthread_mutex_lock(&sq->lock);
+    pthread_mutex_lock(&sq->receive_lock);
     // Wait for message to be available
     while (list_empty(&sq->receive_queue)) {
         if (pollreactor_is_exit(sq->pr))
             goto exit;
         sq->receive_waiting = 1;
-        int ret = pthread_cond_wait(&sq->cond, &sq->lock);
+        int ret = pthread_cond_wait(&sq->cond, &sq->receive_lock);
         if (ret)
             report_errno("pthread_cond_wait", ret);
     }
@@ -867,12 +1126,64 @@ serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
     else
         message_free(qm);
 
-    pthread_mutex_unlock(&sq->lock);
+    pthread_mutex_unlock(&sq->receive_lock);
     return;
 
 exit:
     pqm->len = -1;
+    pthread_mutex_unlock(&sq->receive_lock);
+}
+
+// Record all message blocks sent and received to a rolling binary
+// capture file (a record_count of zero disables the capture)
+int __visible
+serialqueue_set_capture(struct serialqueue *sq, const char *filename
+                        , int record_count)
+{
+    struct capture_header *ch = NULL;
+    size_t size = 0;
+    if (record_count > 0) {
+        // Keep the capture of the previous connection (it may hold the
+        // messages leading up to a shutdown before a FIRMWARE_RESTART)
+        char prevname[4096];
+        snprintf(prevname, sizeof(prevname), "%s.prev", filename);
+        int ret = rename(filename, prevname);
+        if (ret < 0 && errno != ENOENT)
+            report_errno("capture rename", ret);
+        int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            report_errno("capture open", fd);
+            return -1;
+        }
+        size = (sizeof(*ch)
+                + (size_t)record_count * sizeof(struct capture_record));
+        ret = ftruncate(fd, size);
+        if (ret < 0) {
+            report_errno("capture ftruncate", ret);
+            close(fd);
+            return -1;
+        }
+        ch = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ch == MAP_FAILED) {
+            report_errno("capture mmap", -1);
+            return -1;
+        }
+        memcpy(ch->magic, CAPTURE_MAGIC, sizeof(ch->magic));
+        ch->header_size = sizeof(*ch);
+        ch->record_size = sizeof(struct capture_record);
+        ch->record_count = record_count;
+    }
+
+    pthread_mutex_lock(&sq->lock);
+    struct capture_header *old = sq->capture;
+    size_t old_size = sq->capture_size;
+    sq->capture = ch;
+    sq->capture_size = size;
     pthread_mutex_unlock(&sq->lock);
+    if (old)
+        munmap(old, old_size);
+    return 0;
 }
 
 void __visible
@@ -888,6 +1199,45 @@ serialqueue_set_wire_frequency(struct serialqueue *sq, double frequency)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Enable CAN-FD frames on a canbus socket.  Returns 0 on success or
+// -1 if the socket interface does not support CAN-FD.
+int __visible
+serialqueue_set_canfd(struct serialqueue *sq)
+{
+    if (sq->serial_fd_type != SQT_CAN)
+        return -1;
+    // Check that the interface has been configured for CAN-FD
+    struct sockaddr_can addr;
+    socklen_t addrlen = sizeof(addr);
+    int ret = getsockname(sq->serial_fd, (void*)&addr, &addrlen);
+    if (ret < 0) {
+        report_errno("can getsockname", ret);
+        return -1;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    if (!if_indextoname(addr.can_ifindex, ifr.ifr_name))
+        return -1;
+    ret = ioctl(sq->serial_fd, SIOCGIFMTU, &ifr);
+    if (ret < 0) {
+        report_errno("can SIOCGIFMTU", ret);
+        return -1;
+    }
+    if (ifr.ifr_mtu != CANFD_MTU)
+        return -1;
+    int enable = 1;
+    ret = setsockopt(sq->serial_fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES
+                     , &enable, sizeof(enable));
+    if (ret < 0) {
+        report_errno("can CAN_RAW_FD_FRAMES", ret);
+        return -1;
+    }
+    pthread_mutex_lock(&sq->lock);
+    sq->can_fd = 1;
+    pthread_mutex_unlock(&sq->lock);
+    return 0;
+}
+
 void __visible
 serialqueue_set_receive_window(struct serialqueue *sq, int receive_window)
 {
@@ -942,6 +1292,39 @@ serialqueue_get_stats(struct serialqueue *sq, char *buf, int len)
              , stats.ready_bytes, stats.upcoming_bytes);
 }
 
+// Return traffic counters (the high-water marks are reset on each call)
+void __visible
+serialqueue_get_traffic(struct serialqueue *sq
+                        , struct serialqueue_traffic *traffic)
+{
+    pthread_mutex_lock(&sq->lock);
+    traffic->bytes_write = sq->bytes_write;
+    traffic->bytes_read = sq->bytes_read;
+    traffic->bytes_retransmit = sq->bytes_retransmit;
+    traffic->frames_write = sq->frames_write;
+    traffic->frames_read = sq->frames_read;
+    traffic->ready_bytes_max = sq->ready_bytes_max;
+    traffic->need_ack_bytes_max = sq->need_ack_bytes_max;
+    traffic->srtt = sq->srtt;
+    traffic->rttvar = sq->rttvar;
+    traffic->receive_delay_max = sq->receive_delay_max;
+    sq->ready_bytes_max = sq->ready_bytes;
+    sq->need_ack_bytes_max = sq->need_ack_bytes;
+    sq->receive_delay_max = 0.;
+    pthread_mutex_unlock(&sq->lock);
+}
+
+// Return an upper estimate of the round trip time (srtt + 4*rttvar -
+// as with the retransmit timeout but without the MIN_RTO limit)
+double __visible
+serialqueue_get_rtt(struct serialqueue *sq)
+{
+    pthread_mutex_lock(&sq->lock);
+    double rtt = sq->srtt + 4. * sq->rttvar;
+    pthread_mutex_unlock(&sq->lock);
+    return rtt;
+}
+
 // Extract old messages stored in the debug queues
 int __visible
 serialqueue_extract_old(struct serialqueue *sq, int sentq
@@ -949,17 +1332,18 @@ serialqueue_extract_old(struct serialqueue *sq, int sentq
 {
     int count = sentq ? DEBUG_QUEUE_SENT : DEBUG_QUEUE_RECEIVE;
     struct list_head *rootp = sentq ? &sq->old_sent : &sq->old_receive;
+    pthread_mutex_t *lock = sentq ? &sq->lock : &sq->receive_lock;
     struct list_head replacement, current;
     list_init(&replacement);
     debug_queue_alloc(&replacement, count);
     list_init(&current);
 
     // Atomically replace existing debug list with new zero'd list
-    pthread_mutex_lock(&sq->lock);
+    pthread_mutex_lock(lock);
     list_join_tail(rootp, &current);
     list_init(rootp);
     list_join_tail(&replacement, rootp);
-    pthread_mutex_unlock(&sq->lock);
+    pthread_mutex_unlock(lock);
 
     // Walk the debug list
     int pos = 0;
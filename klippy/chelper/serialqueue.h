@@ -14,6 +14,10 @@ typedef void (*fastreader_cb)(struct fastreader *fr, uint8_t *data, int len);
 struct fastreader {
     struct list_node node;
     fastreader_cb func;
+    // Don't also report matching messages via serialqueue_pull()
+    int is_exclusive;
+    // Timing of the message being dispatched (valid during callback)
+    double sent_time, receive_time;
     int prefix_len;
     uint8_t prefix[MESSAGE_MAX];
 };
@@ -25,6 +29,13 @@ struct pull_queue_message {
     uint64_t notify_id;
 };
 
+struct serialqueue_traffic {
+    uint32_t bytes_write, bytes_read, bytes_retransmit;
+    uint32_t frames_write, frames_read;
+    int ready_bytes_max, need_ack_bytes_max;
+    double srtt, rttvar, receive_delay_max;
+};
+
 struct serialqueue;
 struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
                                       , int client_id);
@@ -42,7 +53,10 @@ void serialqueue_send(struct serialqueue *sq, struct command_queue *cq
                       , uint8_t *msg, int len, uint64_t min_clock
                       , uint64_t req_clock, uint64_t notify_id);
 void serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm);
+int serialqueue_set_capture(struct serialqueue *sq, const char *filename
+                            , int record_count);
 void serialqueue_set_wire_frequency(struct serialqueue *sq, double frequency);
+int serialqueue_set_canfd(struct serialqueue *sq);
 void serialqueue_set_receive_window(struct serialqueue *sq, int receive_window);
 void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
                                , double conv_time, uint64_t conv_clock
@@ -50,6 +64,9 @@ void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
 void serialqueue_get_clock_est(struct serialqueue *sq
                                , struct clock_estimate *ce);
 void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
+void serialqueue_get_traffic(struct serialqueue *sq
+                             , struct serialqueue_traffic *traffic);
+double serialqueue_get_rtt(struct serialqueue *sq);
 int serialqueue_extract_old(struct serialqueue *sq, int sentq
                             , struct pull_queue_message *q, int max);
 
@@ -11,19 +11,23 @@
 // add parameters such that 'count' pulses occur, with each step event
 // calculating the next step event time using:
 //  next_wake_time = last_wake_time + interval; interval += add
+// Some mcus also accept an add2 parameter (the queue_step2 command)
+// that additionally does "add += add2" on each step event.
 // This code is written in C (instead of python) for processing
 // efficiency - the repetitive integer math is vastly faster in C.
 
-#include <math.h> // sqrt
+#include <math.h> // sqrt, cbrt
 #include <stddef.h> // offsetof
 #include <stdint.h> // uint32_t
 #include <stdio.h> // fprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "compiler.h" // DIV_ROUND_UP
+#include "itersolve.h" // itersolve_generate_steps
 #include "pyhelper.h" // errorf
 #include "serialqueue.h" // struct queue_message
 #include "stepcompress.h" // stepcompress_alloc
+#include "stepgen.h" // stepgen_pool_generate_steps
 
 #define CHECK_LINES 1
 #define QUEUE_START_SIZE 1024
@@ -38,27 +42,41 @@ struct stepcompress {
     uint64_t last_step_clock;
     struct list_head msg_queue;
     uint32_t oid;
-    int32_t queue_step_msgtag, set_next_step_dir_msgtag;
+    int32_t queue_step_msgtag, set_next_step_dir_msgtag, queue_step2_msgtag;
     int sdir, invert_sdir;
+    // Pending queue_steps message (that further moves may be added to)
+    int32_t queue_steps_msgtag;
+    struct queue_message *steps_qm;
+    int steps_count, steps_max, steps_len;
+    uint32_t steps_next_interval;
+    int16_t steps_add;
+    uint8_t steps_data[MESSAGE_PAYLOAD_MAX];
     // Step+dir+step filter
     uint64_t next_step_clock;
     int next_step_dir;
-    // History tracking
+    // History tracking (a ring buffer ordered from oldest to newest)
     int64_t last_position;
-    struct list_head history_list;
+    struct history_steps *history;
+    int history_start, history_count, history_alloc;
+    // Step generation
+    struct stepper_kinematics *sk;
+    // Pending move clocks of a reserved mcu move queue (if any)
+    uint64_t *move_clocks;
+    int num_move_clocks;
+    // Statistics
+    struct stepcompress_stats stats;
 };
 
 struct step_move {
     uint32_t interval;
     uint16_t count;
-    int16_t add;
+    int16_t add, add2;
 };
 
 struct history_steps {
-    struct list_node node;
     uint64_t first_clock, last_clock;
     int64_t start_position;
-    int step_count, interval, add;
+    int step_count, interval, add, add2;
 };
 
 
@@ -83,7 +101,9 @@ struct points {
 };
 
 // Given a requested step time, return the minimum and maximum
-// acceptable times
+// acceptable times.  The allowed error already scales with the local
+// step interval - it is half the time since the previous step, but
+// no more than the configured max_error.
 static inline struct points
 minmax_point(struct stepcompress *sc, uint32_t *pos)
 {
@@ -95,19 +115,45 @@ minmax_point(struct stepcompress *sc, uint32_t *pos)
     return (struct points){ point - max_error, point };
 }
 
+// Return the minimum and maximum acceptable times of the step 'count'
+// steps into the queue, after removing the contribution of the add2
+// term (add2*count*(count-1)*(count-2)/6) from them
+static inline struct points
+minmax_point_add2(struct stepcompress *sc, int32_t count, int32_t add2)
+{
+    struct points point = minmax_point(sc, sc->queue_pos + count - 1);
+    if (add2) {
+        int32_t c = (int64_t)add2 * count * (count-1) * (count-2) / 6;
+        point.minp -= c;
+        point.maxp -= c;
+    }
+    return point;
+}
+
 // The maximum add delta between two valid quadratic sequences of the
 // form "add*count*(count-1)/2 + interval*count" is "(6 + 4*sqrt(2)) *
 // maxerror / (count*count)".  The "6 + 4*sqrt(2)" is 11.65685, but
 // using 11 works well in practice.
 #define QUADRATIC_DEV 11
 
-// Find a 'step_move' that covers a series of step times
+// Find a 'step_move' that covers a series of step times.  Each 'add'
+// tried rescans the queued steps, but the search typically settles
+// within one or two attempts (long constant velocity sequences also
+// end the search once they exceed 0x200 steps), so the total cost is
+// close to linear in the number of steps.
 static struct step_move
-compress_bisect_add(struct stepcompress *sc)
+compress_bisect_add(struct stepcompress *sc, int32_t add2)
 {
     uint32_t *qlast = sc->queue_next;
-    if (qlast > sc->queue_pos + 65535)
-        qlast = sc->queue_pos + 65535;
+    int32_t maxcount = 65535;
+    if (add2) {
+        // Limit sequence so that the add2 term can't overflow
+        int32_t add2count = cbrt(6. * 0x20000000 / abs(add2));
+        if (maxcount > add2count)
+            maxcount = add2count;
+    }
+    if (qlast > sc->queue_pos + maxcount)
+        qlast = sc->queue_pos + maxcount;
     struct points point = minmax_point(sc, sc->queue_pos);
     int32_t outer_mininterval = point.minp, outer_maxinterval = point.maxp;
     int32_t add = 0, minadd = -0x8000, maxadd = 0x7fff;
@@ -124,9 +170,9 @@ compress_bisect_add(struct stepcompress *sc)
             nextcount++;
             if (&sc->queue_pos[nextcount-1] >= qlast) {
                 int32_t count = nextcount - 1;
-                return (struct step_move){ interval, count, add };
+                return (struct step_move){ interval, count, add, add2 };
             }
-            nextpoint = minmax_point(sc, sc->queue_pos + nextcount - 1);
+            nextpoint = minmax_point_add2(sc, nextcount, add2);
             int32_t nextaddfactor = nextcount*(nextcount-1)/2;
             int32_t c = add*nextaddfactor;
             if (nextmininterval*nextcount < nextpoint.minp - c)
@@ -190,10 +236,62 @@ compress_bisect_add(struct stepcompress *sc)
             break;
         add = maxadd - (maxadd - minadd) / 4;
     }
-    if (zerocount + zerocount/16 >= bestcount)
+    if (zerocount + zerocount/16 >= bestcount && !add2)
         // Prefer add=0 if it's similar to the best found sequence
-        return (struct step_move){ zerointerval, zerocount, 0 };
-    return (struct step_move){ bestinterval, bestcount, bestadd };
+        return (struct step_move){ zerointerval, zerocount, 0, 0 };
+    return (struct step_move){ bestinterval, bestcount, bestadd, add2 };
+}
+
+// Estimate the add2 term of the steps in the queue using the third
+// difference of the step times 'h' steps apart
+static int32_t
+estimate_add2(struct stepcompress *sc, int32_t h)
+{
+    uint32_t lsc = sc->last_step_clock, *qp = sc->queue_pos - 1;
+    int64_t p1 = qp[h] - lsc, p2 = qp[2*h] - lsc, p3 = qp[3*h] - lsc;
+    double d3 = p3 - 3*p2 + 3*p1;
+    double add2 = d3 / ((double)h * h * h);
+    if (add2 > 0x7fff || add2 < -0x8000)
+        return 0;
+    return lround(add2);
+}
+
+// Find a 'step_move' that covers a series of step times, using the
+// mcu's queue_step2 command if it notably extends the sequence
+static struct step_move
+compress_step_move(struct stepcompress *sc)
+{
+    struct step_move best = compress_bisect_add(sc, 0);
+    int32_t avail = sc->queue_next - sc->queue_pos;
+    if (!sc->queue_step2_msgtag || best.count < 2 || best.count >= avail)
+        return best;
+    // Try add2 estimates over sequences 50% and 100% longer than the
+    // best found so far.  Only use add2 if it covers 25% more steps
+    // (a queue_step2 command is slightly larger than a queue_step).
+    int32_t count = best.count, mincount = count + count / 4, tried = 0, i;
+    for (i = 3; i <= 4; i++) {
+        int32_t len = count * i / 2;
+        if (len > avail)
+            len = avail;
+        int32_t add2 = estimate_add2(sc, len / 3);
+        if (!add2 || add2 == tried)
+            continue;
+        tried = add2;
+        struct step_move move = compress_bisect_add(sc, add2);
+        // Truncate sequence so that 'add' fits in the mcu's int16
+        int32_t maxcount = move.count;
+        if (add2 > 0)
+            maxcount = (0x7fff - move.add) / add2 + 1;
+        else
+            maxcount = (-0x8000 - move.add) / add2 + 1;
+        if (move.count > maxcount)
+            move.count = maxcount;
+        if (move.count >= mincount) {
+            best = move;
+            mincount = move.count + 1;
+        }
+    }
+    return best;
 }
 
 
@@ -207,31 +305,42 @@ check_line(struct stepcompress *sc, struct step_move move)
 {
     if (!CHECK_LINES)
         return 0;
-    if (!move.count || (!move.interval && !move.add && move.count > 1)
+    if (!move.count || (!move.interval && !move.add && !move.add2
+                        && move.count > 1)
         || move.interval >= 0x80000000) {
-        errorf("stepcompress o=%d i=%d c=%d a=%d: Invalid sequence"
-               , sc->oid, move.interval, move.count, move.add);
+        errorf("stepcompress o=%d i=%d c=%d a=%d a2=%d: Invalid sequence"
+               , sc->oid, move.interval, move.count, move.add, move.add2);
         return ERROR_RET;
     }
     uint32_t interval = move.interval, p = 0;
+    int32_t add = move.add;
     uint16_t i;
     for (i=0; i<move.count; i++) {
         struct points point = minmax_point(sc, sc->queue_pos + i);
         p += interval;
         if (p < point.minp || p > point.maxp) {
-            errorf("stepcompress o=%d i=%d c=%d a=%d: Point %d: %d not in %d:%d"
-                   , sc->oid, move.interval, move.count, move.add
+            errorf("stepcompress o=%d i=%d c=%d a=%d a2=%d:"
+                   " Point %d: %d not in %d:%d"
+                   , sc->oid, move.interval, move.count, move.add, move.add2
                    , i+1, p, point.minp, point.maxp);
             return ERROR_RET;
         }
         if (interval >= 0x80000000) {
-            errorf("stepcompress o=%d i=%d c=%d a=%d:"
+            errorf("stepcompress o=%d i=%d c=%d a=%d a2=%d:"
                    " Point %d: interval overflow %d"
-                   , sc->oid, move.interval, move.count, move.add
+                   , sc->oid, move.interval, move.count, move.add, move.add2
                    , i+1, interval);
             return ERROR_RET;
         }
-        interval += move.add;
+        if (add > 0x7fff || add < -0x8000) {
+            errorf("stepcompress o=%d i=%d c=%d a=%d a2=%d:"
+                   " Point %d: add overflow %d"
+                   , sc->oid, move.interval, move.count, move.add, move.add2
+                   , i+1, add);
+            return ERROR_RET;
+        }
+        interval += add;
+        add += move.add2;
     }
     return 0;
 }
@@ -248,7 +357,6 @@ stepcompress_alloc(uint32_t oid)
     struct stepcompress *sc = malloc(sizeof(*sc));
     memset(sc, 0, sizeof(*sc));
     list_init(&sc->msg_queue);
-    list_init(&sc->history_list);
     sc->oid = oid;
     sc->sdir = -1;
     return sc;
@@ -264,6 +372,21 @@ stepcompress_fill(struct stepcompress *sc, uint32_t max_error
     sc->set_next_step_dir_msgtag = set_next_step_dir_msgtag;
 }
 
+// Enable use of the mcu's queue_step2 command
+void __visible
+stepcompress_fill_add2(struct stepcompress *sc, int32_t queue_step2_msgtag)
+{
+    sc->queue_step2_msgtag = queue_step2_msgtag;
+}
+
+// Enable use of the mcu's queue_steps command
+void __visible
+stepcompress_fill_queue_steps(struct stepcompress *sc
+                              , int32_t queue_steps_msgtag)
+{
+    sc->queue_steps_msgtag = queue_steps_msgtag;
+}
+
 // Set the inverted stepper direction flag
 void __visible
 stepcompress_set_invert_sdir(struct stepcompress *sc, uint32_t invert_sdir)
@@ -276,17 +399,61 @@ stepcompress_set_invert_sdir(struct stepcompress *sc, uint32_t invert_sdir)
     }
 }
 
-// Helper to free items from the history_list
+// Return the history entry at 'pos' (with 0 being the oldest entry)
+static inline struct history_steps *
+history_get(struct stepcompress *sc, int pos)
+{
+    return &sc->history[(sc->history_start + pos) & (sc->history_alloc - 1)];
+}
+
+// Return the number of history entries with a first_clock <= 'clock'
+static int
+history_find(struct stepcompress *sc, uint64_t clock)
+{
+    int low = 0, high = sc->history_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (history_get(sc, mid)->first_clock <= clock)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// Add a new (zero filled) entry to the end of the history
+static struct history_steps *
+history_add(struct stepcompress *sc, uint64_t first_clock)
+{
+    // Entries starting after the new entry were never executed (eg,
+    // steps discarded by the mcu at the end of a homing operation)
+    while (sc->history_count
+           && history_get(sc, sc->history_count - 1)->first_clock > first_clock)
+        sc->history_count--;
+    if (sc->history_count >= sc->history_alloc) {
+        int new_alloc = sc->history_alloc ? sc->history_alloc * 2 : 1024;
+        struct history_steps *h = malloc(new_alloc * sizeof(*h));
+        int i;
+        for (i = 0; i < sc->history_count; i++)
+            h[i] = *history_get(sc, i);
+        free(sc->history);
+        sc->history = h;
+        sc->history_start = 0;
+        sc->history_alloc = new_alloc;
+    }
+    struct history_steps *hs = history_get(sc, sc->history_count++);
+    memset(hs, 0, sizeof(*hs));
+    hs->first_clock = first_clock;
+    return hs;
+}
+
+// Helper to free items from the history
 static void
 free_history(struct stepcompress *sc, uint64_t end_clock)
 {
-    while (!list_empty(&sc->history_list)) {
-        struct history_steps *hs = list_last_entry(
-            &sc->history_list, struct history_steps, node);
-        if (hs->last_clock > end_clock)
-            break;
-        list_del(&hs->node);
-        free(hs);
+    while (sc->history_count && history_get(sc, 0)->last_clock <= end_clock) {
+        sc->history_start = (sc->history_start + 1) & (sc->history_alloc - 1);
+        sc->history_count--;
     }
 }
 
@@ -304,11 +471,35 @@ stepcompress_free(struct stepcompress *sc)
     if (!sc)
         return;
     free(sc->queue);
+    free(sc->move_clocks);
     message_queue_free(&sc->msg_queue);
-    free_history(sc, UINT64_MAX);
+    free(sc->history);
     free(sc);
 }
 
+// Note that the mcu has reserved 'move_num' move queue items for the
+// exclusive use of this stepper (see move_queue_reserve in the mcu)
+void __visible
+stepcompress_set_move_reserve(struct stepcompress *sc, int move_num)
+{
+    free(sc->move_clocks);
+    sc->move_clocks = NULL;
+    sc->num_move_clocks = 0;
+    if (move_num <= 0)
+        return;
+    sc->move_clocks = malloc(sizeof(*sc->move_clocks) * move_num);
+    memset(sc->move_clocks, 0, sizeof(*sc->move_clocks) * move_num);
+    sc->num_move_clocks = move_num;
+}
+
+// Set the stepper_kinematics used by steppersync_generate_steps()
+void __visible
+stepcompress_set_stepper_kinematics(struct stepcompress *sc
+                                    , struct stepper_kinematics *sk)
+{
+    sc->sk = sk;
+}
+
 uint32_t
 stepcompress_get_oid(struct stepcompress *sc)
 {
@@ -339,38 +530,130 @@ stepcompress_set_time(struct stepcompress *sc
     calc_last_step_print_time(sc);
 }
 
+// Convert a 'print_time' to an mcu clock
+uint64_t
+stepcompress_calc_clock(struct stepcompress *sc, double print_time)
+{
+    return (print_time - sc->mcu_time_offset) * sc->mcu_freq + .5;
+}
+
 // Maximium clock delta between messages in the queue
 #define CLOCK_DIFF_MAX (3<<28)
 
+// Maximum number of moves sent in a single queue_steps command
+#define QUEUE_STEPS_MAX_MOVES 16
+
+// Encode a move in the format of the queue_steps command (see
+// command_queue_steps() in src/stepper.c)
+static int
+encode_steps_move(struct stepcompress *sc, uint8_t *buf
+                  , struct step_move *move)
+{
+    uint32_t data[4] = {
+        move->count << 1 | !!move->add2
+        , move->interval - sc->steps_next_interval
+        , move->add - sc->steps_add, move->add2
+    };
+    return msgblock_encode(buf, data, move->add2 ? 4 : 3) - buf;
+}
+
+// Note a move added to the pending queue_steps data
+static void
+note_steps_move(struct stepcompress *sc, uint8_t *buf, int len
+                , struct step_move *move)
+{
+    memcpy(&sc->steps_data[sc->steps_len], buf, len);
+    sc->steps_len += len;
+    sc->steps_count++;
+    sc->steps_next_interval = move->interval + move->add * move->count;
+    sc->steps_add = move->add;
+}
+
+// Try to add a move to the last queued message (by converting it to
+// a queue_steps command).  Returns 0 on success.
+static int
+append_steps_move(struct stepcompress *sc, struct step_move *move)
+{
+    struct queue_message *qm = sc->steps_qm;
+    if (!qm || sc->steps_count >= sc->steps_max || list_empty(&sc->msg_queue)
+        || qm != list_last_entry(&sc->msg_queue, struct queue_message, node))
+        return -1;
+    uint8_t buf[4 * 5];
+    int len = encode_steps_move(sc, buf, move);
+    // Allow up to 4 bytes for the msgtag and oid (plus the length byte)
+    if (4 + 1 + sc->steps_len + len > MESSAGE_PAYLOAD_MAX)
+        return -1;
+    note_steps_move(sc, buf, len, move);
+    uint32_t hdr[2] = { sc->queue_steps_msgtag, sc->oid };
+    uint8_t *p = msgblock_encode(qm->msg, hdr, 2);
+    *p++ = sc->steps_len;
+    memcpy(p, sc->steps_data, sc->steps_len);
+    qm->len = p + sc->steps_len - qm->msg;
+    // Track the mcu move queue using the start of the last move
+    qm->min_clock = sc->last_step_clock;
+    qm->move_count = sc->steps_count;
+    return 0;
+}
+
 // Helper to create a queue_step command from a 'struct step_move'
 static void
 add_move(struct stepcompress *sc, uint64_t first_clock, struct step_move *move)
 {
-    int32_t addfactor = move->count*(move->count-1)/2;
-    uint32_t ticks = move->add*addfactor + move->interval*(move->count-1);
+    int32_t count = move->count, addfactor = count*(count-1)/2;
+    int32_t add2factor = (int64_t)count*(count-1)*(count-2)/6;
+    uint32_t ticks = (move->add2*add2factor + move->add*addfactor
+                      + move->interval*(count-1));
     uint64_t last_clock = first_clock + ticks;
-
-    // Create and queue a queue_step command
-    uint32_t msg[5] = {
-        sc->queue_step_msgtag, sc->oid, move->interval, move->count, move->add
-    };
-    struct queue_message *qm = message_alloc_and_encode(msg, 5);
+    sc->stats.move_count++;
+    sc->stats.step_count += count;
+    int is_far = (move->count == 1
+                  && first_clock >= sc->last_step_clock + CLOCK_DIFF_MAX);
+
+    // Create and queue a queue_step (or queue_step2) command
+    struct queue_message *qm;
+    if (!is_far && !append_steps_move(sc, move)) {
+        goto store_history;
+    } else if (move->add2) {
+        uint32_t msg[6] = {
+            sc->queue_step2_msgtag, sc->oid, move->interval, move->count
+            , move->add, move->add2
+        };
+        qm = message_alloc_and_encode(msg, 6);
+    } else {
+        uint32_t msg[5] = {
+            sc->queue_step_msgtag, sc->oid, move->interval, move->count
+            , move->add
+        };
+        qm = message_alloc_and_encode(msg, 5);
+    }
     qm->min_clock = qm->req_clock = sc->last_step_clock;
-    if (move->count == 1 && first_clock >= sc->last_step_clock + CLOCK_DIFF_MAX)
+    qm->move_count = 1;
+    if (is_far)
         qm->req_clock = first_clock;
     list_add_tail(&qm->node, &sc->msg_queue);
+    sc->steps_qm = NULL;
+    if (!is_far && sc->queue_steps_msgtag && sc->steps_max > 1) {
+        // Further moves may be added to this message
+        sc->steps_qm = qm;
+        sc->steps_len = sc->steps_count = 0;
+        sc->steps_next_interval = sc->steps_add = 0;
+        uint8_t buf[4 * 5];
+        int len = encode_steps_move(sc, buf, move);
+        note_steps_move(sc, buf, len, move);
+    }
+
+store_history:
     sc->last_step_clock = last_clock;
 
     // Create and store move in history tracking
-    struct history_steps *hs = malloc(sizeof(*hs));
-    hs->first_clock = first_clock;
+    struct history_steps *hs = history_add(sc, first_clock);
     hs->last_clock = last_clock;
     hs->start_position = sc->last_position;
     hs->interval = move->interval;
     hs->add = move->add;
+    hs->add2 = move->add2;
     hs->step_count = sc->sdir ? move->count : -move->count;
     sc->last_position += hs->step_count;
-    list_add_head(&hs->node, &sc->history_list);
 }
 
 // Convert previously scheduled steps into commands for the mcu
@@ -380,13 +663,17 @@ queue_flush(struct stepcompress *sc, uint64_t move_clock)
     if (sc->queue_pos >= sc->queue_next)
         return 0;
     while (sc->last_step_clock < move_clock) {
-        struct step_move move = compress_bisect_add(sc);
+        struct step_move move = compress_step_move(sc);
         int ret = check_line(sc, move);
         if (ret)
             return ret;
 
         add_move(sc, sc->last_step_clock + move.interval, &move);
 
+        if (move.count < 65535
+            && sc->queue_pos + move.count < sc->queue_next)
+            // Sequence was ended by the max_error constraints
+            sc->stats.error_limited_count++;
         if (sc->queue_pos + move.count >= sc->queue_next) {
             sc->queue_pos = sc->queue_next = sc->queue;
             break;
@@ -401,7 +688,7 @@ queue_flush(struct stepcompress *sc, uint64_t move_clock)
 static int
 stepcompress_flush_far(struct stepcompress *sc, uint64_t abs_step_clock)
 {
-    struct step_move move = { abs_step_clock - sc->last_step_clock, 1, 0 };
+    struct step_move move = { abs_step_clock - sc->last_step_clock, 1, 0, 0 };
     add_move(sc, abs_step_clock, &move);
     calc_last_step_print_time(sc);
     return 0;
@@ -500,7 +787,7 @@ queue_append(struct stepcompress *sc)
 #define SDS_FILTER_TIME .000750
 
 // Add next step time
-int
+int __visible
 stepcompress_append(struct stepcompress *sc, int sdir
                     , double print_time, double step_time)
 {
@@ -573,12 +860,10 @@ stepcompress_set_last_position(struct stepcompress *sc, uint64_t clock
         return ret;
     sc->last_position = last_position;
 
-    // Add a marker to the history list
-    struct history_steps *hs = malloc(sizeof(*hs));
-    memset(hs, 0, sizeof(*hs));
-    hs->first_clock = hs->last_clock = clock;
+    // Add a marker to the history
+    struct history_steps *hs = history_add(sc, clock);
+    hs->last_clock = clock;
     hs->start_position = last_position;
-    list_add_head(&hs->node, &sc->history_list);
     return 0;
 }
 
@@ -586,29 +871,39 @@ stepcompress_set_last_position(struct stepcompress *sc, uint64_t clock
 int64_t __visible
 stepcompress_find_past_position(struct stepcompress *sc, uint64_t clock)
 {
-    int64_t last_position = sc->last_position;
-    struct history_steps *hs;
-    list_for_each_entry(hs, &sc->history_list, node) {
-        if (clock < hs->first_clock) {
-            last_position = hs->start_position;
-            continue;
-        }
-        if (clock >= hs->last_clock)
-            return hs->start_position + hs->step_count;
-        int32_t interval = hs->interval, add = hs->add;
-        int32_t ticks = (int32_t)(clock - hs->first_clock) + interval, offset;
-        if (!add) {
-            offset = ticks / interval;
-        } else {
-            // Solve for "count" using quadratic formula
-            double a = .5 * add, b = interval - .5 * add, c = -ticks;
-            offset = (sqrt(b*b - 4*a*c) - b) / (2. * a);
+    if (!sc->history_count)
+        return sc->last_position;
+    int pos = history_find(sc, clock);
+    if (!pos)
+        return history_get(sc, 0)->start_position;
+    struct history_steps *hs = history_get(sc, pos - 1);
+    if (clock >= hs->last_clock)
+        return hs->start_position + hs->step_count;
+    int32_t interval = hs->interval, add = hs->add, add2 = hs->add2;
+    int32_t ticks = (int32_t)(clock - hs->first_clock) + interval, offset;
+    if (add2) {
+        // Bisect for the last "count" with a step time before "clock"
+        int32_t low = 0, high = abs(hs->step_count);
+        while (low < high) {
+            int64_t c = (low + high + 1) / 2;
+            int64_t t = (interval*c + add*c*(c-1)/2
+                         + add2*c*(c-1)*(c-2)/6);
+            if (t <= ticks)
+                low = c;
+            else
+                high = c - 1;
         }
-        if (hs->step_count < 0)
-            return hs->start_position - offset;
-        return hs->start_position + offset;
+        offset = low;
+    } else if (!add) {
+        offset = ticks / interval;
+    } else {
+        // Solve for "count" using quadratic formula
+        double a = .5 * add, b = interval - .5 * add, c = -ticks;
+        offset = (sqrt(b*b - 4*a*c) - b) / (2. * a);
     }
-    return last_position;
+    if (hs->step_count < 0)
+        return hs->start_position - offset;
+    return hs->start_position + offset;
 }
 
 // Queue an mcu command to go out in order with stepper commands
@@ -640,30 +935,58 @@ stepcompress_queue_mq_msg(struct stepcompress *sc, uint64_t req_clock
     return 0;
 }
 
+// Queue an already encoded mcu command that adds 'move_count' items
+// to the mcu move queue (the last of which is scheduled at 'last_clock')
+int __visible
+stepcompress_queue_mq_batch(struct stepcompress *sc, uint64_t req_clock
+                            , uint64_t last_clock, int move_count
+                            , uint8_t *msg, int len)
+{
+    if (len > MESSAGE_PAYLOAD_MAX)
+        return ERROR_RET;
+    int ret = stepcompress_flush(sc, UINT64_MAX);
+    if (ret)
+        return ret;
+
+    struct queue_message *qm = message_fill(msg, len);
+    qm->req_clock = req_clock;
+    qm->min_clock = last_clock;
+    qm->move_count = move_count;
+    list_add_tail(&qm->node, &sc->msg_queue);
+    return 0;
+}
+
 // Return history of queue_step commands
 int __visible
 stepcompress_extract_old(struct stepcompress *sc, struct pull_history_steps *p
                          , int max, uint64_t start_clock, uint64_t end_clock)
 {
-    int res = 0;
-    struct history_steps *hs;
-    list_for_each_entry(hs, &sc->history_list, node) {
-        if (start_clock >= hs->last_clock || res >= max)
+    int res = 0, pos = end_clock ? history_find(sc, end_clock - 1) : 0;
+    while (pos > 0 && res < max) {
+        struct history_steps *hs = history_get(sc, --pos);
+        if (start_clock >= hs->last_clock)
             break;
-        if (end_clock <= hs->first_clock)
-            continue;
         p->first_clock = hs->first_clock;
         p->last_clock = hs->last_clock;
         p->start_position = hs->start_position;
         p->step_count = hs->step_count;
         p->interval = hs->interval;
         p->add = hs->add;
+        p->add2 = hs->add2;
         p++;
         res++;
     }
     return res;
 }
 
+// Report the (cumulative) step compression statistics
+void __visible
+stepcompress_get_stats(struct stepcompress *sc
+                       , struct stepcompress_stats *stats)
+{
+    *stats = sc->stats;
+}
+
 
 /****************************************************************
  * Step compress synchronization
@@ -675,6 +998,9 @@ stepcompress_extract_old(struct stepcompress *sc, struct pull_history_steps *p
 // free so that new commands can be transmitted.  It also ensures the
 // mcu step queue is ordered between steppers so that no stepper
 // starves the other steppers of space in the mcu step queue.
+// Steppers with a reserved mcu move queue (see
+// stepcompress_set_move_reserve() ) are tracked separately from the
+// shared mcu move queue.
 
 struct steppersync {
     // Serial port
@@ -686,6 +1012,8 @@ struct steppersync {
     // Storage for list of pending move clocks
     uint64_t *move_clocks;
     int num_move_clocks;
+    // Support for combining moves of several steppers
+    int32_t queue_step_multi_msgtag;
 };
 
 // Allocate a new 'steppersync' object
@@ -706,6 +1034,21 @@ steppersync_alloc(struct serialqueue *sq, struct stepcompress **sc_list
     memset(ss->move_clocks, 0, sizeof(*ss->move_clocks)*move_num);
     ss->num_move_clocks = move_num;
 
+    // Limit queue_steps messages to a fraction of the mcu move queue
+    int shared_num = 0, i;
+    for (i=0; i<sc_num; i++)
+        if (!sc_list[i]->num_move_clocks)
+            shared_num++;
+    int shared_max = shared_num ? move_num / (4 * shared_num) : 0;
+    for (i=0; i<sc_num; i++) {
+        struct stepcompress *sc = sc_list[i];
+        int steps_max = (sc->num_move_clocks ? sc->num_move_clocks / 4
+                         : shared_max);
+        if (steps_max > QUEUE_STEPS_MAX_MOVES)
+            steps_max = QUEUE_STEPS_MAX_MOVES;
+        sc->steps_max = steps_max;
+    }
+
     return ss;
 }
 
@@ -733,6 +1076,14 @@ steppersync_set_time(struct steppersync *ss, double time_offset
     }
 }
 
+// Enable use of the mcu's queue_step_multi command
+void __visible
+steppersync_fill_queue_step_multi(struct steppersync *ss
+                                  , int32_t queue_step_multi_msgtag)
+{
+    ss->queue_step_multi_msgtag = queue_step_multi_msgtag;
+}
+
 // Expire the stepcompress history before the given clock time
 static void
 steppersync_history_expire(struct steppersync *ss, uint64_t end_clock)
@@ -745,13 +1096,33 @@ steppersync_history_expire(struct steppersync *ss, uint64_t end_clock)
     }
 }
 
+// Generate steps for all steppers with an associated stepper_kinematics
+int __visible
+steppersync_generate_steps(struct steppersync *ss, struct stepgen_pool *sgp
+                           , double flush_time)
+{
+    int i;
+    for (i=0; i<ss->sc_num; i++) {
+        struct stepper_kinematics *sk = ss->sc_list[i]->sk;
+        if (!sk)
+            continue;
+        int32_t ret;
+        if (sgp)
+            ret = stepgen_pool_generate_steps(sgp, sk, flush_time);
+        else
+            ret = itersolve_generate_steps(sk, flush_time);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
 // Implement a binary heap algorithm to track when the next available
 // 'struct move' in the mcu will be available
 static void
-heap_replace(struct steppersync *ss, uint64_t req_clock)
+heap_replace(uint64_t *mc, int nmc, uint64_t req_clock)
 {
-    uint64_t *mc = ss->move_clocks;
-    int nmc = ss->num_move_clocks, pos = 0;
+    int pos = 0;
     for (;;) {
         int child1_pos = 2*pos+1, child2_pos = 2*pos+2;
         uint64_t child2_clock = child2_pos < nmc ? mc[child2_pos] : UINT64_MAX;
@@ -770,6 +1141,95 @@ heap_replace(struct steppersync *ss, uint64_t req_clock)
     }
 }
 
+// State of a queue_step_multi message being built
+struct step_multi {
+    struct queue_message *qm;
+    int len;
+    uint32_t interval;
+    int16_t add;
+    uint8_t data[MESSAGE_PAYLOAD_MAX];
+};
+
+// Extract the move from a queue_step (or queue_step2) message.
+// Returns the number of integers stored in 'move' or 0 if this is
+// not a single move message.
+static int
+decode_step_move(struct stepcompress *sc, struct queue_message *qm
+                 , uint32_t *move)
+{
+    uint32_t msgtag;
+    uint8_t *p = msgblock_parse(qm->msg, &msgtag, 1);
+    int count;
+    if (msgtag == sc->queue_step_msgtag)
+        count = 4;
+    else if (sc->queue_step2_msgtag && msgtag == sc->queue_step2_msgtag)
+        count = 5;
+    else
+        return 0;
+    p = msgblock_parse(p, move, count);
+    if (p != &qm->msg[qm->len])
+        return 0;
+    return count;
+}
+
+// Encode a move (oid, interval, count, add, and optional add2) in
+// the format of the queue_step_multi command
+static int
+encode_multi_move(struct step_multi *sm, uint8_t *buf, uint32_t *move
+                  , int count)
+{
+    uint32_t add2 = count > 4 ? move[4] : 0;
+    uint32_t data[5] = {
+        move[0], move[2] << 1 | !!add2, move[1] - sm->interval
+        , (int16_t)move[3] - sm->add, add2
+    };
+    return msgblock_encode(buf, data, add2 ? 5 : 4) - buf;
+}
+
+// Try to merge a single move message into the pending
+// queue_step_multi message.  Returns 0 if 'qm' was merged (and freed).
+static int
+merge_step_multi(struct steppersync *ss, struct step_multi *sm
+                 , struct stepcompress *sc, struct queue_message *qm)
+{
+    uint32_t move[5];
+    int count = decode_step_move(sc, qm, move);
+    if (!count) {
+        sm->qm = NULL;
+        return -1;
+    }
+    uint8_t hdr[5], buf[5 * 5];
+    uint32_t msgtag = ss->queue_step_multi_msgtag;
+    int hdrlen = msgblock_encode(hdr, &msgtag, 1) - hdr;
+    int len = encode_multi_move(sm, buf, move, count);
+    struct queue_message *mqm = sm->qm;
+    if (!mqm || qm->min_clock > mqm->req_clock
+        || hdrlen + 1 + sm->len + len > MESSAGE_PAYLOAD_MAX) {
+        // Start a new group from this message
+        sm->qm = qm;
+        sm->interval = sm->add = 0;
+        sm->len = encode_multi_move(sm, sm->data, move, count);
+        sm->interval = move[1];
+        sm->add = move[3];
+        return -1;
+    }
+    memcpy(&sm->data[sm->len], buf, len);
+    sm->len += len;
+    sm->interval = move[1];
+    sm->add = move[3];
+    // Rewrite the message in queue_step_multi format
+    uint8_t *p = mqm->msg;
+    memcpy(p, hdr, hdrlen);
+    p += hdrlen;
+    *p++ = sm->len;
+    memcpy(p, sm->data, sm->len);
+    mqm->len = p + sm->len - mqm->msg;
+    if (qm->min_clock > mqm->min_clock)
+        mqm->min_clock = qm->min_clock;
+    message_free(qm);
+    return 0;
+}
+
 // Find and transmit any scheduled steps prior to the given 'move_clock'
 int __visible
 steppersync_flush(struct steppersync *ss, uint64_t move_clock
@@ -786,10 +1246,13 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock
     // Order commands by the reqclock of each pending command
     struct list_head msgs;
     list_init(&msgs);
+    struct step_multi sm;
+    sm.qm = NULL;
     for (;;) {
         // Find message with lowest reqclock
         uint64_t req_clock = MAX_CLOCK;
         struct queue_message *qm = NULL;
+        struct stepcompress *qm_sc = NULL;
         for (i=0; i<ss->sc_num; i++) {
             struct stepcompress *sc = ss->sc_list[i];
             if (!list_empty(&sc->msg_queue)) {
@@ -797,24 +1260,45 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock
                     &sc->msg_queue, struct queue_message, node);
                 if (m->req_clock < req_clock) {
                     qm = m;
+                    qm_sc = sc;
                     req_clock = m->req_clock;
                 }
             }
         }
         if (!qm || (qm->min_clock && req_clock > move_clock))
             break;
-
-        uint64_t next_avail = ss->move_clocks[0];
-        if (qm->min_clock)
+        if (qm == qm_sc->steps_qm)
+            // No further moves may be added to this message
+            qm_sc->steps_qm = NULL;
+        qm_sc->stats.message_count++;
+        qm_sc->stats.message_bytes += qm->len;
+
+        uint64_t *mc = ss->move_clocks;
+        int nmc = ss->num_move_clocks;
+        if (qm_sc->num_move_clocks) {
+            mc = qm_sc->move_clocks;
+            nmc = qm_sc->num_move_clocks;
+        }
+        uint64_t next_avail = mc[0];
+        if (qm->min_clock) {
             // The qm->min_clock field is overloaded to indicate that
             // the command uses the 'move queue' and to store the time
             // that move queue item becomes available.
-            heap_replace(ss, qm->min_clock);
+            int move_count = qm->move_count > 1 ? qm->move_count : 1;
+            while (move_count--) {
+                if (mc[0] > next_avail)
+                    next_avail = mc[0];
+                heap_replace(mc, nmc, qm->min_clock);
+            }
+        }
         // Reset the min_clock to its normal meaning (minimum transmit time)
         qm->min_clock = next_avail;
 
         // Batch this command
         list_del(&qm->node);
+        if (ss->queue_step_multi_msgtag
+            && !merge_step_multi(ss, &sm, qm_sc, qm))
+            continue;
         list_add_tail(&qm->node, &msgs);
     }
 
@@ -8,17 +8,31 @@
 struct pull_history_steps {
     uint64_t first_clock, last_clock;
     int64_t start_position;
-    int step_count, interval, add;
+    int step_count, interval, add, add2;
+};
+
+struct stepcompress_stats {
+    uint64_t move_count, step_count, error_limited_count;
+    uint64_t message_count, message_bytes;
 };
 
 struct stepcompress *stepcompress_alloc(uint32_t oid);
 void stepcompress_fill(struct stepcompress *sc, uint32_t max_error
                        , int32_t queue_step_msgtag
                        , int32_t set_next_step_dir_msgtag);
+void stepcompress_fill_add2(struct stepcompress *sc
+                            , int32_t queue_step2_msgtag);
+void stepcompress_fill_queue_steps(struct stepcompress *sc
+                                   , int32_t queue_steps_msgtag);
 void stepcompress_set_invert_sdir(struct stepcompress *sc
                                   , uint32_t invert_sdir);
 void stepcompress_free(struct stepcompress *sc);
+void stepcompress_set_move_reserve(struct stepcompress *sc, int move_num);
+struct stepper_kinematics;
+void stepcompress_set_stepper_kinematics(struct stepcompress *sc
+                                         , struct stepper_kinematics *sk);
 uint32_t stepcompress_get_oid(struct stepcompress *sc);
+uint64_t stepcompress_calc_clock(struct stepcompress *sc, double print_time);
 int stepcompress_get_step_dir(struct stepcompress *sc);
 int stepcompress_append(struct stepcompress *sc, int sdir
                         , double print_time, double step_time);
@@ -31,17 +45,27 @@ int64_t stepcompress_find_past_position(struct stepcompress *sc
 int stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len);
 int stepcompress_queue_mq_msg(struct stepcompress *sc, uint64_t req_clock
                               , uint32_t *data, int len);
+int stepcompress_queue_mq_batch(struct stepcompress *sc, uint64_t req_clock
+                                , uint64_t last_clock, int move_count
+                                , uint8_t *msg, int len);
 int stepcompress_extract_old(struct stepcompress *sc
                              , struct pull_history_steps *p, int max
                              , uint64_t start_clock, uint64_t end_clock);
+void stepcompress_get_stats(struct stepcompress *sc
+                            , struct stepcompress_stats *stats);
 
 struct serialqueue;
 struct steppersync *steppersync_alloc(
     struct serialqueue *sq, struct stepcompress **sc_list, int sc_num
     , int move_num);
 void steppersync_free(struct steppersync *ss);
+void steppersync_fill_queue_step_multi(struct steppersync *ss
+                                       , int32_t queue_step_multi_msgtag);
 void steppersync_set_time(struct steppersync *ss, double time_offset
                           , double mcu_freq);
+struct stepgen_pool;
+int steppersync_generate_steps(struct steppersync *ss, struct stepgen_pool *sgp
+                               , double flush_time);
 int steppersync_flush(struct steppersync *ss, uint64_t move_clock
                       , uint64_t clear_history_clock);
 
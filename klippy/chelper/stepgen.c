@@ -0,0 +1,229 @@
+// Parallel step generation across multiple steppers
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Once a trapq has been filled for a given flush window, each
+// stepper_kinematics / stepcompress pair can generate its steps
+// independently of the others.  This code implements a small pool of
+// worker threads that the host can use to solve the step times of
+// several steppers concurrently.  After stepgen_pool_start() is
+// called, stepgen_pool_generate_steps() requests are queued and then
+// solved together by stepgen_pool_flush().
+
+#include <pthread.h> // pthread_mutex_lock
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "itersolve.h" // itersolve_generate_steps
+#include "pyhelper.h" // get_monotonic
+#include "stepgen.h" // stepgen_pool_alloc
+#include "trapq.h" // trapq_check_sentinels
+
+#define MAX_THREADS 16
+
+struct stepgen_pool {
+    // Worker threads
+    pthread_t tids[MAX_THREADS];
+    int num_threads;
+    pthread_mutex_t lock; // protects variables below
+    pthread_cond_t work_cond, done_cond;
+    int exit_request, batch_seq, active_workers;
+    int is_batching;
+    // Steppers being solved in the current batch
+    int work_num, work_next;
+    double flush_time;
+    int32_t result;
+    // Steppers queued for the next batch (only accessed by main thread)
+    struct stepper_kinematics **sk_list;
+    int sk_num, sk_alloc;
+    // Stats
+    double last_solve_time, max_solve_time, total_solve_time;
+    uint32_t flush_count;
+};
+
+// Solve queued steppers until none remain (called with lock held)
+static void
+run_batch(struct stepgen_pool *sp)
+{
+    while (sp->work_next < sp->work_num) {
+        struct stepper_kinematics *sk = sp->sk_list[sp->work_next++];
+        double flush_time = sp->flush_time;
+        pthread_mutex_unlock(&sp->lock);
+        int32_t ret = itersolve_generate_steps(sk, flush_time);
+        pthread_mutex_lock(&sp->lock);
+        if (ret && !sp->result)
+            sp->result = ret;
+    }
+}
+
+// Main code for each worker thread
+static void *
+worker_thread(void *data)
+{
+    struct stepgen_pool *sp = data;
+    pthread_mutex_lock(&sp->lock);
+    int seen_seq = sp->batch_seq;
+    for (;;) {
+        while (!sp->exit_request && seen_seq == sp->batch_seq)
+            pthread_cond_wait(&sp->work_cond, &sp->lock);
+        if (sp->exit_request)
+            break;
+        seen_seq = sp->batch_seq;
+        sp->active_workers++;
+        run_batch(sp);
+        if (!--sp->active_workers)
+            pthread_cond_signal(&sp->done_cond);
+    }
+    pthread_mutex_unlock(&sp->lock);
+    return NULL;
+}
+
+// Request the worker threads to exit and wait for them
+static void
+stop_workers(struct stepgen_pool *sp)
+{
+    pthread_mutex_lock(&sp->lock);
+    sp->exit_request = 1;
+    pthread_cond_broadcast(&sp->work_cond);
+    pthread_mutex_unlock(&sp->lock);
+    int i;
+    for (i = 0; i < sp->num_threads; i++) {
+        int ret = pthread_join(sp->tids[i], NULL);
+        if (ret)
+            report_errno("pthread_join", ret);
+    }
+}
+
+// Allocate a new 'stepgen_pool' object (returns NULL on failure)
+struct stepgen_pool * __visible
+stepgen_pool_alloc(int num_threads)
+{
+    struct stepgen_pool *sp = malloc(sizeof(*sp));
+    memset(sp, 0, sizeof(*sp));
+    if (num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+    int ret = pthread_mutex_init(&sp->lock, NULL);
+    if (ret)
+        goto fail_lock;
+    ret = pthread_cond_init(&sp->work_cond, NULL);
+    if (ret)
+        goto fail_work_cond;
+    ret = pthread_cond_init(&sp->done_cond, NULL);
+    if (ret)
+        goto fail_done_cond;
+    // The calling thread also solves steppers, so start one less worker
+    int i;
+    for (i = 0; i < num_threads - 1; i++) {
+        ret = pthread_create(&sp->tids[i], NULL, worker_thread, sp);
+        if (ret)
+            goto fail_threads;
+        sp->num_threads++;
+    }
+    return sp;
+
+fail_threads:
+    stop_workers(sp);
+    pthread_cond_destroy(&sp->done_cond);
+fail_done_cond:
+    pthread_cond_destroy(&sp->work_cond);
+fail_work_cond:
+    pthread_mutex_destroy(&sp->lock);
+fail_lock:
+    report_errno("stepgen_pool_alloc", ret);
+    free(sp);
+    return NULL;
+}
+
+// Free memory associated with a 'stepgen_pool' object
+void __visible
+stepgen_pool_free(struct stepgen_pool *sp)
+{
+    if (!sp)
+        return;
+    stop_workers(sp);
+    pthread_cond_destroy(&sp->done_cond);
+    pthread_cond_destroy(&sp->work_cond);
+    pthread_mutex_destroy(&sp->lock);
+    free(sp->sk_list);
+    free(sp);
+}
+
+// Start queuing step generation requests
+void __visible
+stepgen_pool_start(struct stepgen_pool *sp)
+{
+    sp->is_batching = 1;
+    sp->sk_num = 0;
+}
+
+// Generate steps for a stepper (or queue it if a batch is pending)
+int32_t __visible
+stepgen_pool_generate_steps(struct stepgen_pool *sp
+                            , struct stepper_kinematics *sk, double flush_time)
+{
+    if (!sp->is_batching)
+        return itersolve_generate_steps(sk, flush_time);
+    int i;
+    for (i = 0; i < sp->sk_num; i++)
+        if (sp->sk_list[i] == sk)
+            // Already queued
+            return 0;
+    if (sp->sk_num >= sp->sk_alloc) {
+        sp->sk_alloc = sp->sk_alloc ? sp->sk_alloc * 2 : 16;
+        sp->sk_list = realloc(sp->sk_list
+                              , sp->sk_alloc * sizeof(*sp->sk_list));
+    }
+    sp->sk_list[sp->sk_num++] = sk;
+    return 0;
+}
+
+// Generate steps for all queued steppers up to the given flush_time
+int32_t __visible
+stepgen_pool_flush(struct stepgen_pool *sp, double flush_time)
+{
+    sp->is_batching = 0;
+    if (!sp->sk_num)
+        return 0;
+    double start_time = get_monotonic();
+    // Update trapq sentinels before any worker accesses the trapq
+    int i;
+    for (i = 0; i < sp->sk_num; i++)
+        if (sp->sk_list[i]->tq)
+            trapq_check_sentinels(sp->sk_list[i]->tq);
+    // Wake workers and participate in solving
+    pthread_mutex_lock(&sp->lock);
+    sp->flush_time = flush_time;
+    sp->work_num = sp->sk_num;
+    sp->work_next = sp->result = 0;
+    sp->batch_seq++;
+    if (sp->num_threads && sp->sk_num > 1)
+        pthread_cond_broadcast(&sp->work_cond);
+    run_batch(sp);
+    while (sp->active_workers)
+        pthread_cond_wait(&sp->done_cond, &sp->lock);
+    int32_t result = sp->result;
+    sp->work_num = sp->sk_num = 0;
+    pthread_mutex_unlock(&sp->lock);
+    // Update stats
+    double solve_time = get_monotonic() - start_time;
+    sp->last_solve_time = solve_time;
+    if (solve_time > sp->max_solve_time)
+        sp->max_solve_time = solve_time;
+    sp->total_solve_time += solve_time;
+    sp->flush_count++;
+    return result;
+}
+
+// Report (and reset) the step generation timing statistics
+void __visible
+stepgen_pool_get_stats(struct stepgen_pool *sp, struct stepgen_stats *stats)
+{
+    stats->last_solve_time = sp->last_solve_time;
+    stats->max_solve_time = sp->max_solve_time;
+    stats->total_solve_time = sp->total_solve_time;
+    stats->flush_count = sp->flush_count;
+    sp->max_solve_time = sp->total_solve_time = 0.;
+    sp->flush_count = 0;
+}
@@ -0,0 +1,22 @@
+#ifndef STEPGEN_H
+#define STEPGEN_H
+
+#include <stdint.h> // int32_t
+
+struct stepgen_stats {
+    double last_solve_time, max_solve_time, total_solve_time;
+    uint32_t flush_count;
+};
+
+struct stepper_kinematics;
+struct stepgen_pool *stepgen_pool_alloc(int num_threads);
+void stepgen_pool_free(struct stepgen_pool *sp);
+void stepgen_pool_start(struct stepgen_pool *sp);
+int32_t stepgen_pool_generate_steps(struct stepgen_pool *sp
+                                    , struct stepper_kinematics *sk
+                                    , double flush_time);
+int32_t stepgen_pool_flush(struct stepgen_pool *sp, double flush_time);
+void stepgen_pool_get_stats(struct stepgen_pool *sp
+                            , struct stepgen_stats *stats);
+
+#endif // stepgen.h
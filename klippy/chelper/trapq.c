@@ -6,32 +6,24 @@
 
 #include <math.h> // sqrt
 #include <stddef.h> // offsetof
-#include <stdlib.h> // malloc
+#include <stdlib.h> // malloc, posix_memalign
 #include <string.h> // memset
 #include "compiler.h" // unlikely
 #include "trapq.h" // move_get_coord
 
-// Allocate a new 'move' object
-struct move *
-move_alloc(void)
-{
-    struct move *m = malloc(sizeof(*m));
-    memset(m, 0, sizeof(*m));
-    return m;
-}
-
 // Return the distance moved given a time in a move
 inline double
 move_get_distance(struct move *m, double move_time)
 {
-    return (m->start_v + m->half_accel * move_time) * move_time;
+    move_real_t t = move_time;
+    return (m->start_v + m->half_accel * t) * t;
 }
 
 // Return the XYZ coordinates given a time in a move
 inline struct coord
 move_get_coord(struct move *m, double move_time)
 {
-    double move_dist = move_get_distance(m, move_time);
+    move_real_t move_dist = move_get_distance(m, move_time);
     return (struct coord) {
         .x = m->start_pos.x + m->axes_r.x * move_dist,
         .y = m->start_pos.y + m->axes_r.y * move_dist,
@@ -40,6 +32,54 @@ move_get_coord(struct move *m, double move_time)
 
 #define NEVER_TIME 9999999999999999.9
 
+// Moves are allocated from a per-trapq pool in cache line aligned
+// blocks so that queuing and expiring moves does not need to call
+// malloc() and free() once the queue reaches its steady state size.
+// Moves expire in time order and are reused in the order they were
+// released, so the pool behaves like a ring buffer and consecutive
+// moves tend to be adjacent in memory.
+#define MOVE_BLOCK_COUNT 64
+#define MOVE_BLOCK_ALIGN 64
+
+struct move_block {
+    struct list_node node;
+    struct move moves[MOVE_BLOCK_COUNT];
+};
+
+// Allocate a 'move' object from the trapq move pool
+static struct move *
+trapq_move_alloc(struct trapq *tq)
+{
+    if (unlikely(list_empty(&tq->free_moves))) {
+        void *data = NULL;
+        int ret = posix_memalign(&data, MOVE_BLOCK_ALIGN
+                                 , sizeof(struct move_block));
+        if (ret)
+            return NULL;
+        struct move_block *mb = data;
+        list_add_tail(&mb->node, &tq->move_blocks);
+        int i;
+        for (i = 0; i < MOVE_BLOCK_COUNT; i++)
+            list_add_tail(&mb->moves[i].node, &tq->free_moves);
+        tq->block_count++;
+        tq->free_count += MOVE_BLOCK_COUNT;
+    }
+    struct move *m = list_first_entry(&tq->free_moves, struct move, node);
+    list_del(&m->node);
+    memset(m, 0, sizeof(*m));
+    tq->free_count--;
+    tq->alloc_count++;
+    return m;
+}
+
+// Return a 'move' object to the trapq move pool
+static void
+trapq_move_free(struct trapq *tq, struct move *m)
+{
+    list_add_tail(&m->node, &tq->free_moves);
+    tq->free_count++;
+}
+
 // Allocate a new 'trapq' object
 struct trapq * __visible
 trapq_alloc(void)
@@ -47,8 +87,10 @@ trapq_alloc(void)
     struct trapq *tq = malloc(sizeof(*tq));
     memset(tq, 0, sizeof(*tq));
     list_init(&tq->moves);
-    list_init(&tq->history);
-    struct move *head_sentinel = move_alloc(), *tail_sentinel = move_alloc();
+    list_init(&tq->free_moves);
+    list_init(&tq->move_blocks);
+    struct move *head_sentinel = trapq_move_alloc(tq);
+    struct move *tail_sentinel = trapq_move_alloc(tq);
     tail_sentinel->print_time = tail_sentinel->move_t = NEVER_TIME;
     list_add_head(&head_sentinel->node, &tq->moves);
     list_add_tail(&tail_sentinel->node, &tq->moves);
@@ -59,16 +101,13 @@ trapq_alloc(void)
 void __visible
 trapq_free(struct trapq *tq)
 {
-    while (!list_empty(&tq->moves)) {
-        struct move *m = list_first_entry(&tq->moves, struct move, node);
-        list_del(&m->node);
-        free(m);
-    }
-    while (!list_empty(&tq->history)) {
-        struct move *m = list_first_entry(&tq->history, struct move, node);
-        list_del(&m->node);
-        free(m);
+    while (!list_empty(&tq->move_blocks)) {
+        struct move_block *mb = list_first_entry(&tq->move_blocks
+                                                 , struct move_block, node);
+        list_del(&mb->node);
+        free(mb);
     }
+    free(tq->history);
     free(tq);
 }
 
@@ -89,6 +128,7 @@ trapq_check_sentinels(struct trapq *tq)
     }
     tail_sentinel->print_time = m->print_time + m->move_t;
     tail_sentinel->start_pos = move_get_coord(m, m->move_t);
+    tq->update_seq++;
 }
 
 #define MAX_NULL_MOVE 1.0
@@ -101,7 +141,7 @@ trapq_add_move(struct trapq *tq, struct move *m)
     struct move *prev = list_prev_entry(tail_sentinel, node);
     if (prev->print_time + prev->move_t < m->print_time) {
         // Add a null move to fill time gap
-        struct move *null_move = move_alloc();
+        struct move *null_move = trapq_move_alloc(tq);
         null_move->start_pos = m->start_pos;
         if (!prev->print_time && m->print_time > MAX_NULL_MOVE)
             // Limit the first null move to improve numerical stability
@@ -113,6 +153,7 @@ trapq_add_move(struct trapq *tq, struct move *m)
     }
     list_add_before(&m->node, &tail_sentinel->node);
     tail_sentinel->print_time = 0.;
+    tq->update_seq++;
 }
 
 // Fill and add a move to the trapezoid velocity queue
@@ -124,9 +165,9 @@ trapq_append(struct trapq *tq, double print_time
              , double start_v, double cruise_v, double accel)
 {
     struct coord start_pos = { .x=start_pos_x, .y=start_pos_y, .z=start_pos_z };
-    struct coord axes_r = { .x=axes_r_x, .y=axes_r_y, .z=axes_r_z };
+    struct move_axes axes_r = { .x=axes_r_x, .y=axes_r_y, .z=axes_r_z };
     if (accel_t) {
-        struct move *m = move_alloc();
+        struct move *m = trapq_move_alloc(tq);
         m->print_time = print_time;
         m->move_t = accel_t;
         m->start_v = start_v;
@@ -139,7 +180,7 @@ trapq_append(struct trapq *tq, double print_time
         start_pos = move_get_coord(m, accel_t);
     }
     if (cruise_t) {
-        struct move *m = move_alloc();
+        struct move *m = trapq_move_alloc(tq);
         m->print_time = print_time;
         m->move_t = cruise_t;
         m->start_v = cruise_v;
@@ -152,7 +193,7 @@ trapq_append(struct trapq *tq, double print_time
         start_pos = move_get_coord(m, cruise_t);
     }
     if (decel_t) {
-        struct move *m = move_alloc();
+        struct move *m = trapq_move_alloc(tq);
         m->print_time = print_time;
         m->move_t = decel_t;
         m->start_v = cruise_v;
@@ -163,6 +204,112 @@ trapq_append(struct trapq *tq, double print_time
     }
 }
 
+// Add a constant acceleration move (that does not change direction)
+static void
+accel_seq_add(struct trapq *tq, struct accel_seq_state *as
+              , struct coord *start_pos, struct coord *axes_r
+              , double move_t, double accel)
+{
+    double v = as->v;
+    if (tq && move_t > 0.) {
+        double dir = v > 0. || (!v && accel > 0.) ? 1. : -1.;
+        struct move *m = trapq_move_alloc(tq);
+        m->print_time = as->print_time;
+        m->move_t = move_t;
+        m->start_v = fabs(v);
+        m->half_accel = .5 * accel * dir;
+        m->start_pos.x = start_pos->x + axes_r->x * as->d;
+        m->start_pos.y = start_pos->y + axes_r->y * as->d;
+        m->start_pos.z = start_pos->z + axes_r->z * as->d;
+        m->axes_r.x = axes_r->x * dir;
+        m->axes_r.y = axes_r->y * dir;
+        m->axes_r.z = axes_r->z * dir;
+        trapq_add_move(tq, m);
+    }
+    as->print_time += move_t;
+    as->d += (v + .5 * accel * move_t) * move_t;
+    as->v = v + accel * move_t;
+    if (as->d < as->min_d)
+        as->min_d = as->d;
+    if (as->d > as->max_d)
+        as->max_d = as->d;
+}
+
+// Append a sequence of constant acceleration segments along 'axes_r'.
+// Segment 'i' ends at sequence time 'times[i]' and has an
+// acceleration of 'accels[i]'.  Segments that reverse direction are
+// split at the point where the head stops.  The 'as' state tracks the
+// position along the sequence between calls.  If 'tq' is NULL the
+// sequence is only simulated (to find its range of motion).
+void __visible
+trapq_append_accel_seq(struct trapq *tq, struct accel_seq_state *as
+                       , double start_pos_x, double start_pos_y
+                       , double start_pos_z, double axes_r_x
+                       , double axes_r_y, double axes_r_z
+                       , double *times, double *accels, int count)
+{
+    struct coord start_pos = { .x=start_pos_x, .y=start_pos_y, .z=start_pos_z };
+    struct coord axes_r = { .x=axes_r_x, .y=axes_r_y, .z=axes_r_z };
+    int i;
+    for (i = 0; i < count; i++) {
+        double move_t = times[i] - as->last_t, accel = accels[i];
+        double end_v = as->v + accel * move_t;
+        if (fabs(end_v) < 0.000001)
+            end_v = 0.;
+        if (as->v * end_v < 0.) {
+            // The move first goes to a complete stop, then changes direction
+            double stop_t = -as->v / accel;
+            accel_seq_add(tq, as, &start_pos, &axes_r, stop_t, accel);
+            as->v = 0.;
+            move_t -= stop_t;
+        }
+        accel_seq_add(tq, as, &start_pos, &axes_r, move_t, accel);
+        as->v = end_v;
+        as->last_t = times[i];
+    }
+}
+
+// Return the history move at 'pos' (with 0 being the oldest move)
+static inline struct move *
+history_get(struct trapq *tq, int pos)
+{
+    return tq->history[(tq->history_start + pos) & (tq->history_alloc - 1)];
+}
+
+// Return the number of history moves with a print_time <= 'time'
+static int
+history_find(struct trapq *tq, double time)
+{
+    int low = 0, high = tq->history_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (history_get(tq, mid)->print_time <= time)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// Add a move to the end (newest) of the history
+static void
+history_push(struct trapq *tq, struct move *m)
+{
+    if (tq->history_count >= tq->history_alloc) {
+        int new_alloc = tq->history_alloc ? tq->history_alloc * 2 : 1024;
+        struct move **h = malloc(new_alloc * sizeof(*h));
+        int i;
+        for (i = 0; i < tq->history_count; i++)
+            h[i] = history_get(tq, i);
+        free(tq->history);
+        tq->history = h;
+        tq->history_start = 0;
+        tq->history_alloc = new_alloc;
+    }
+    int pos = tq->history_start + tq->history_count++;
+    tq->history[pos & (tq->history_alloc - 1)] = m;
+}
+
 // Expire any moves older than `print_time` from the trapezoid velocity queue
 void __visible
 trapq_finalize_moves(struct trapq *tq, double print_time
@@ -170,6 +317,7 @@ trapq_finalize_moves(struct trapq *tq, double print_time
 {
     struct move *head_sentinel = list_first_entry(&tq->moves, struct move,node);
     struct move *tail_sentinel = list_last_entry(&tq->moves, struct move, node);
+    tq->update_seq++;
     // Move expired moves from main "moves" list to "history" list
     for (;;) {
         struct move *m = list_next_entry(head_sentinel, node);
@@ -181,20 +329,18 @@ trapq_finalize_moves(struct trapq *tq, double print_time
             break;
         list_del(&m->node);
         if (m->start_v || m->half_accel)
-            list_add_head(&m->node, &tq->history);
+            history_push(tq, m);
         else
-            free(m);
+            trapq_move_free(tq, m);
     }
-    // Free old moves from history list
-    if (list_empty(&tq->history))
-        return;
-    struct move *latest = list_first_entry(&tq->history, struct move, node);
-    for (;;) {
-        struct move *m = list_last_entry(&tq->history, struct move, node);
-        if (m == latest || m->print_time + m->move_t > clear_history_time)
+    // Free old moves from history (always keeping the latest move)
+    while (tq->history_count > 1) {
+        struct move *m = history_get(tq, 0);
+        if (m->print_time + m->move_t > clear_history_time)
             break;
-        list_del(&m->node);
-        free(m);
+        tq->history_start = (tq->history_start + 1) & (tq->history_alloc - 1);
+        tq->history_count--;
+        trapq_move_free(tq, m);
     }
 }
 
@@ -207,24 +353,24 @@ trapq_set_position(struct trapq *tq, double print_time
     trapq_finalize_moves(tq, NEVER_TIME, 0);
 
     // Prune any moves in the trapq history that were interrupted
-    while (!list_empty(&tq->history)) {
-        struct move *m = list_first_entry(&tq->history, struct move, node);
+    while (tq->history_count) {
+        struct move *m = history_get(tq, tq->history_count - 1);
         if (m->print_time < print_time) {
             if (m->print_time + m->move_t > print_time)
                 m->move_t = print_time - m->print_time;
             break;
         }
-        list_del(&m->node);
-        free(m);
+        tq->history_count--;
+        trapq_move_free(tq, m);
     }
 
     // Add a marker to the trapq history
-    struct move *m = move_alloc();
+    struct move *m = trapq_move_alloc(tq);
     m->print_time = print_time;
     m->start_pos.x = pos_x;
     m->start_pos.y = pos_y;
     m->start_pos.z = pos_z;
-    list_add_head(&m->node, &tq->history);
+    history_push(tq, m);
 }
 
 // Return history of movement queue
@@ -232,13 +378,14 @@ int __visible
 trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
                   , double start_time, double end_time)
 {
-    int res = 0;
-    struct move *m;
-    list_for_each_entry(m, &tq->history, node) {
-        if (start_time >= m->print_time + m->move_t || res >= max)
+    // Find the newest move starting before end_time
+    int res = 0, pos = history_find(tq, end_time);
+    while (pos > 0 && history_get(tq, pos - 1)->print_time >= end_time)
+        pos--;
+    while (pos > 0 && res < max) {
+        struct move *m = history_get(tq, --pos);
+        if (start_time >= m->print_time + m->move_t)
             break;
-        if (end_time <= m->print_time)
-            continue;
         p->print_time = m->print_time;
         p->move_t = m->move_t;
         p->start_v = m->start_v;
@@ -254,3 +401,60 @@ trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
     }
     return res;
 }
+
+// Store the position of move 'm' at 'time' in 'coords'
+static void
+store_move_coord(struct move *m, double time, double *coords)
+{
+    double move_time = time - m->print_time;
+    if (move_time > m->move_t)
+        move_time = m->move_t;
+    struct coord c = move_get_coord(m, move_time);
+    coords[0] = c.x;
+    coords[1] = c.y;
+    coords[2] = c.z;
+}
+
+// Find the commanded position at each of 'count' times (which must be
+// in ascending order) using both queued and historical moves.  The
+// xyz positions are stored in 'coords'.  Returns the number of
+// leading times that are older than the available history (their
+// coords are not filled).
+int __visible
+trapq_find_positions(struct trapq *tq, double *times, double *coords
+                     , int count)
+{
+    int i = count - 1;
+    // Search queued moves (newest first)
+    struct move *head_sentinel = list_first_entry(&tq->moves, struct move,node);
+    struct move *m = list_last_entry(&tq->moves, struct move, node);
+    m = list_prev_entry(m, node);
+    while (i >= 0 && m != head_sentinel) {
+        if (times[i] < m->print_time) {
+            m = list_prev_entry(m, node);
+            continue;
+        }
+        store_move_coord(m, times[i], &coords[i * 3]);
+        i--;
+    }
+    // Search history (newest first)
+    int pos = i >= 0 ? history_find(tq, times[i]) : 0;
+    while (i >= 0 && pos > 0) {
+        m = history_get(tq, --pos);
+        while (i >= 0 && times[i] >= m->print_time) {
+            store_move_coord(m, times[i], &coords[i * 3]);
+            i--;
+        }
+    }
+    return i + 1;
+}
+
+// Report the trapq move pool statistics
+void __visible
+trapq_get_pool_stats(struct trapq *tq, struct trapq_pool_stats *stats)
+{
+    stats->block_count = tq->block_count;
+    stats->move_count = tq->block_count * MOVE_BLOCK_COUNT;
+    stats->free_count = tq->free_count;
+    stats->alloc_count = tq->alloc_count;
+}
@@ -1,6 +1,7 @@
 #ifndef TRAPQ_H
 #define TRAPQ_H
 
+#include <stdint.h> // uint32_t
 #include "list.h" // list_node
 
 struct coord {
@@ -12,16 +13,57 @@ struct coord {
     };
 };
 
+// Build with TRAPQ_FLOAT defined to store and evaluate the move
+// relative parameters in single precision (the print_time, move_t,
+// and start_pos bases remain double precision).  This reduces the
+// size of each move and may be faster on hosts with a slow double
+// precision fpu.  Step times are less accurate at low velocities and
+// on kinematics that amplify small position errors (such as polar
+// near its center) - compare the results with the --check-steps
+// option of scripts/bench_chelper.py.
+#if TRAPQ_FLOAT
+typedef float move_real_t;
+#else
+typedef double move_real_t;
+#endif
+
+struct move_axes {
+    union {
+        struct {
+            move_real_t x, y, z;
+        };
+        move_real_t axis[3];
+    };
+};
+
 struct move {
     double print_time, move_t;
-    double start_v, half_accel;
-    struct coord start_pos, axes_r;
+    move_real_t start_v, half_accel;
+    struct coord start_pos;
+    struct move_axes axes_r;
 
     struct list_node node;
 };
 
 struct trapq {
-    struct list_head moves, history;
+    struct list_head moves;
+    // Finalized moves (a ring buffer ordered from oldest to newest)
+    struct move **history;
+    int history_start, history_count, history_alloc;
+    // Pool of unused move objects
+    struct list_head free_moves, move_blocks;
+    uint32_t block_count, free_count, alloc_count;
+    // Incremented whenever the contents of the moves list change
+    uint32_t update_seq;
+};
+
+struct trapq_pool_stats {
+    uint32_t block_count, move_count, free_count, alloc_count;
+};
+
+// State of a sequence queued with trapq_append_accel_seq()
+struct accel_seq_state {
+    double print_time, last_t, d, v, min_d, max_d;
 };
 
 struct pull_move {
@@ -31,7 +73,6 @@ struct pull_move {
     double x_r, y_r, z_r;
 };
 
-struct move *move_alloc(void);
 double move_get_distance(struct move *m, double move_time);
 struct coord move_get_coord(struct move *m, double move_time);
 struct trapq *trapq_alloc(void);
@@ -43,11 +84,19 @@ void trapq_append(struct trapq *tq, double print_time
                   , double start_pos_x, double start_pos_y, double start_pos_z
                   , double axes_r_x, double axes_r_y, double axes_r_z
                   , double start_v, double cruise_v, double accel);
+void trapq_append_accel_seq(struct trapq *tq, struct accel_seq_state *as
+                            , double start_pos_x, double start_pos_y
+                            , double start_pos_z, double axes_r_x
+                            , double axes_r_y, double axes_r_z
+                            , double *times, double *accels, int count);
 void trapq_finalize_moves(struct trapq *tq, double print_time
                           , double clear_history_time);
 void trapq_set_position(struct trapq *tq, double print_time
                         , double pos_x, double pos_y, double pos_z);
 int trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
                       , double start_time, double end_time);
+int trapq_find_positions(struct trapq *tq, double *times, double *coords
+                         , int count);
+void trapq_get_pool_stats(struct trapq *tq, struct trapq_pool_stats *stats);
 
 #endif // trapq.h
@@ -21,6 +21,11 @@ struct trdispatch {
     uint32_t is_active, can_trigger, dispatch_reason;
 };
 
+struct trdispatch_stats {
+    double latency_max, latency_sum;
+    uint32_t report_count;
+};
+
 struct trdispatch_mcu {
     struct fastreader fr;
     struct trdispatch *td;
@@ -33,6 +38,7 @@ struct trdispatch_mcu {
     uint64_t last_status_clock, expire_clock;
     uint64_t expire_ticks, min_extend_ticks;
     struct clock_estimate ce;
+    struct trdispatch_stats stats;
 };
 
 // Send: trsync_trigger oid=%c reason=%c
@@ -78,11 +84,13 @@ handle_trsync_state(struct fastreader *fr, uint8_t *data, int len)
         goto done;
 
     if (!can_trigger) {
-        // mcu reports trigger or timeout - propagate to all mcus
+        // mcu reports trigger or timeout - propagate to the other mcus
+        // (the reporting mcu has already stopped itself)
         td->can_trigger = 0;
         struct trdispatch_mcu *m;
         list_for_each_entry(m, &td->tdm_list, node) {
-            send_trsync_trigger(m);
+            if (m != tdm)
+                send_trsync_trigger(m);
         }
         goto done;
     }
@@ -91,6 +99,17 @@ handle_trsync_state(struct fastreader *fr, uint8_t *data, int len)
     serialqueue_get_clock_est(tdm->sq, &tdm->ce);
     tdm->last_status_clock = clock_from_clock32(&tdm->ce, clock);
 
+    // Track how long the status report took to arrive
+    double latency = fr->receive_time - clock_to_time(&tdm->ce
+                                                      , tdm->last_status_clock);
+    if (latency < 0.)
+        latency = 0.;
+    struct trdispatch_stats *st = &tdm->stats;
+    if (latency > st->latency_max)
+        st->latency_max = latency;
+    st->latency_sum += latency;
+    st->report_count++;
+
     // Determine minimum acknowledged time among all mcus
     double min_time = PR_NEVER, next_min_time = PR_NEVER;
     struct trdispatch_mcu *m, *min_tdm = NULL;
@@ -222,5 +241,17 @@ trdispatch_mcu_setup(struct trdispatch_mcu *tdm
     tdm->expire_ticks = expire_ticks;
     tdm->min_extend_ticks = min_extend_ticks;
     serialqueue_get_clock_est(tdm->sq, &tdm->ce);
+    memset(&tdm->stats, 0, sizeof(tdm->stats));
+    pthread_mutex_unlock(&td->lock);
+}
+
+// Report the status message latency observed during the last test
+void __visible
+trdispatch_mcu_get_stats(struct trdispatch_mcu *tdm
+                         , struct trdispatch_stats *stats)
+{
+    struct trdispatch *td = tdm->td;
+    pthread_mutex_lock(&td->lock);
+    memcpy(stats, &tdm->stats, sizeof(*stats));
     pthread_mutex_unlock(&td->lock);
 }
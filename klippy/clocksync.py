@@ -4,10 +4,9 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, math
+import chelper
 
-RTT_AGE = .000010 / (60. * 60.)
-DECAY = 1. / 30.
-TRANSMIT_EXTRA = .001
+STARTUP_SAMPLES = 8
 
 class ClockSync:
     def __init__(self, reactor):
@@ -19,28 +18,30 @@ class ClockSync:
         self.mcu_freq = 1.
         self.last_clock = 0
         self.clock_est = (0., 0., 0.)
-        # Minimum round-trip-time tracking
-        self.min_half_rtt = 999999999.9
-        self.min_rtt_time = 0.
-        # Linear regression of mcu clock and system sent_time
-        self.time_avg = self.time_variance = 0.
-        self.clock_avg = self.clock_covariance = 0.
-        self.prediction_variance = 0.
-        self.last_prediction_time = 0.
+        # Linear regression of mcu clock and system sent_time (the
+        # regression itself runs in the C serialqueue background thread)
+        self.clocksync = self.cs_state = None
+        self.last_reset_count = 0
     def connect(self, serial):
         self.serial = serial
         self.mcu_freq = serial.msgparser.get_constant_float('CLOCK_FREQ')
+        ffi_main, ffi_lib = chelper.get_ffi()
+        clock_msgtag = serial.get_msgparser().lookup_msgid('clock clock=%u')
+        self.clocksync = ffi_main.gc(
+            ffi_lib.clocksync_alloc(serial.get_serialqueue(), clock_msgtag,
+                                    self.mcu_freq),
+            ffi_lib.clocksync_free)
+        self.cs_state = ffi_main.new('struct clocksync_state *')
         # Load initial clock and frequency
         params = serial.send_with_response('get_uptime', 'uptime')
         self.last_clock = (params['high'] << 32) | params['clock']
-        self.clock_avg = self.last_clock
-        self.time_avg = params['#sent_time']
-        self.clock_est = (self.time_avg, self.clock_avg, self.mcu_freq)
-        self.prediction_variance = (.001 * self.mcu_freq)**2
+        self.clock_est = (params['#sent_time'], self.last_clock,
+                          self.mcu_freq)
+        ffi_lib.clocksync_start(self.clocksync, params['#sent_time'],
+                                self.last_clock, STARTUP_SAMPLES)
         # Enable periodic get_clock timer
-        for i in range(8):
+        for i in range(STARTUP_SAMPLES):
             self.reactor.pause(self.reactor.monotonic() + 0.050)
-            self.last_prediction_time = -9999.
             params = serial.send_with_response('get_clock', 'clock')
             self._handle_clock(params)
         self.get_clock_cmd = serial.get_msgparser().create_command('get_clock')
@@ -64,61 +65,18 @@ class ClockSync:
         return eventtime + .9839
     def _handle_clock(self, params):
         self.queries_pending = 0
-        # Extend clock to 64bit
-        last_clock = self.last_clock
-        clock_delta = (params['clock'] - last_clock) & 0xffffffff
-        self.last_clock = clock = last_clock + clock_delta
-        # Check if this is the best round-trip-time seen so far
-        sent_time = params['#sent_time']
-        if not sent_time:
-            return
-        receive_time = params['#receive_time']
-        half_rtt = .5 * (receive_time - sent_time)
-        aged_rtt = (sent_time - self.min_rtt_time) * RTT_AGE
-        if half_rtt < self.min_half_rtt + aged_rtt:
-            self.min_half_rtt = half_rtt
-            self.min_rtt_time = sent_time
-            logging.debug("new minimum rtt %.3f: hrtt=%.6f freq=%d",
-                          sent_time, half_rtt, self.clock_est[2])
-        # Filter out samples that are extreme outliers
-        exp_clock = ((sent_time - self.time_avg) * self.clock_est[2]
-                     + self.clock_avg)
-        clock_diff2 = (clock - exp_clock)**2
-        if (clock_diff2 > 25. * self.prediction_variance
-            and clock_diff2 > (.000500 * self.mcu_freq)**2):
-            if clock > exp_clock and sent_time < self.last_prediction_time+10.:
-                logging.debug("Ignoring clock sample %.3f:"
-                              " freq=%d diff=%d stddev=%.3f",
-                              sent_time, self.clock_est[2], clock - exp_clock,
-                              math.sqrt(self.prediction_variance))
-                return
+        # Load the regression results (the C code processes each clock
+        # message as it is received, so these may lag by one sample)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.clocksync_get_state(self.clocksync, self.cs_state)
+        s = self.cs_state
+        self.last_clock = s.last_clock
+        self.clock_est = (s.est_time, s.est_clock, s.est_freq)
+        if s.reset_count != self.last_reset_count:
+            self.last_reset_count = s.reset_count
             logging.info("Resetting prediction variance %.3f:"
-                         " freq=%d diff=%d stddev=%.3f",
-                         sent_time, self.clock_est[2], clock - exp_clock,
-                         math.sqrt(self.prediction_variance))
-            self.prediction_variance = (.001 * self.mcu_freq)**2
-        else:
-            self.last_prediction_time = sent_time
-            self.prediction_variance = (
-                (1. - DECAY) * (self.prediction_variance + clock_diff2 * DECAY))
-        # Add clock and sent_time to linear regression
-        diff_sent_time = sent_time - self.time_avg
-        self.time_avg += DECAY * diff_sent_time
-        self.time_variance = (1. - DECAY) * (
-            self.time_variance + diff_sent_time**2 * DECAY)
-        diff_clock = clock - self.clock_avg
-        self.clock_avg += DECAY * diff_clock
-        self.clock_covariance = (1. - DECAY) * (
-            self.clock_covariance + diff_sent_time * diff_clock * DECAY)
-        # Update prediction from linear regression
-        new_freq = self.clock_covariance / self.time_variance
-        pred_stddev = math.sqrt(self.prediction_variance)
-        self.serial.set_clock_est(new_freq, self.time_avg + TRANSMIT_EXTRA,
-                                  int(self.clock_avg - 3. * pred_stddev), clock)
-        self.clock_est = (self.time_avg + self.min_half_rtt,
-                          self.clock_avg, new_freq)
-        #logging.debug("regr %.3f: freq=%.3f d=%d(%.3f)",
-        #              sent_time, new_freq, clock - exp_clock, pred_stddev)
+                         " freq=%d stddev=%.3f", s.last_prediction_time,
+                         s.est_freq, math.sqrt(s.prediction_variance))
     # clock frequency conversions
     def print_time_to_clock(self, print_time):
         return int(print_time * self.mcu_freq)
@@ -143,15 +101,21 @@ class ClockSync:
         return self.queries_pending <= 4
     def dump_debug(self):
         sample_time, clock, freq = self.clock_est
-        return ("clocksync state: mcu_freq=%d last_clock=%d"
-                " clock_est=(%.3f %d %.3f) min_half_rtt=%.6f min_rtt_time=%.3f"
+        msg = ("clocksync state: mcu_freq=%d last_clock=%d"
+               " clock_est=(%.3f %d %.3f)" % (
+                   self.mcu_freq, self.last_clock, sample_time, clock, freq))
+        if self.clocksync is None:
+            return msg
+        ffi_main, ffi_lib = chelper.get_ffi()
+        s = ffi_main.new('struct clocksync_state *')
+        ffi_lib.clocksync_get_state(self.clocksync, s)
+        return ("%s min_half_rtt=%.6f min_rtt_time=%.3f"
                 " time_avg=%.3f(%.3f) clock_avg=%.3f(%.3f)"
-                " pred_variance=%.3f" % (
-                    self.mcu_freq, self.last_clock, sample_time, clock, freq,
-                    self.min_half_rtt, self.min_rtt_time,
-                    self.time_avg, self.time_variance,
-                    self.clock_avg, self.clock_covariance,
-                    self.prediction_variance))
+                " pred_variance=%.3f samples=%d resets=%d" % (
+                    msg, s.min_half_rtt, s.min_rtt_time,
+                    s.time_avg, s.time_variance,
+                    s.clock_avg, s.clock_covariance,
+                    s.prediction_variance, s.sample_count, s.reset_count))
     def stats(self, eventtime):
         sample_time, clock, freq = self.clock_est
         return "freq=%d" % (freq,)
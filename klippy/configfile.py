@@ -3,7 +3,8 @@
 # Copyright (C) 2016-2024  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import sys, os, glob, re, time, logging, configparser, io
+import sys, os, glob, re, time, logging, configparser, io, shutil
+import threading, queue
 
 error = configparser.Error
 
@@ -248,6 +249,13 @@ class ConfigAutoSave:
         self.fileconfig = None
         self.status_save_pending = {}
         self.save_config_pending = False
+        # Config file writes are done in a background thread
+        self.bg_queue = queue.Queue()
+        self.bg_thread = None
+        self.write_request_count = self.write_done_count = 0
+        self.write_error = None
+        self.printer.register_event_handler("klippy:disconnect",
+                                            self._handle_disconnect)
         gcode = self.printer.lookup_object('gcode')
         gcode.register_command("SAVE_CONFIG", self.cmd_SAVE_CONFIG,
                                desc=self.cmd_SAVE_CONFIG_help)
@@ -348,8 +356,71 @@ class ConfigAutoSave:
                     msg = ("SAVE_CONFIG section '%s' option '%s' conflicts "
                            "with included value" % (section, option))
                     raise self.printer.command_error(msg)
+    def _write_config(self, cfgname, data):
+        # Determine filenames
+        datestr = time.strftime("-%Y%m%d_%H%M%S")
+        backup_name = cfgname + datestr
+        temp_name = cfgname + "_autosave"
+        if cfgname.endswith(".cfg"):
+            backup_name = cfgname[:-4] + datestr + ".cfg"
+            temp_name = cfgname[:-4] + "_autosave.cfg"
+        # Create new config file with temporary name and swap with main config
+        logging.info("SAVE_CONFIG to '%s' (backup in '%s')",
+                     cfgname, backup_name)
+        f = open(temp_name, 'w')
+        f.write(data)
+        f.flush()
+        os.fsync(f.fileno())
+        f.close()
+        if not os.path.exists(backup_name):
+            try:
+                os.link(cfgname, backup_name)
+            except OSError:
+                shutil.copy2(cfgname, backup_name)
+        os.replace(temp_name, cfgname)
+    def _bg_thread(self):
+        done = False
+        while not done:
+            req = self.bg_queue.get(True)
+            # Coalesce requests - only the most recent data is written
+            while not self.bg_queue.empty():
+                newreq = self.bg_queue.get_nowait()
+                if newreq is None:
+                    done = True
+                else:
+                    req = newreq
+            if req is None:
+                break
+            cfgname, data, count = req
+            try:
+                self._write_config(cfgname, data)
+                self.write_error = None
+            except Exception as e:
+                logging.exception("Unable to write config file")
+                self.write_error = str(e)
+            self.write_done_count = count
+    def _handle_disconnect(self):
+        if self.bg_thread is None:
+            return
+        self.bg_queue.put_nowait(None)
+        self.bg_thread.join()
+        self.bg_thread = None
+    def _queue_write(self, cfgname, data):
+        if self.bg_thread is None:
+            self.bg_thread = threading.Thread(target=self._bg_thread)
+            self.bg_thread.start()
+        self.write_request_count += 1
+        self.bg_queue.put_nowait((cfgname, data, self.write_request_count))
+        return self.write_request_count
+    def _wait_write(self, count):
+        reactor = self.printer.get_reactor()
+        eventtime = reactor.monotonic()
+        while self.write_done_count < count:
+            eventtime = reactor.pause(eventtime + .050)
+        return self.write_error
     cmd_SAVE_CONFIG_help = "Overwrite config file and restart"
     def cmd_SAVE_CONFIG(self, gcmd):
+        do_restart = gcmd.get_int('RESTART', 1, minval=0, maxval=1)
         if not self.fileconfig.sections():
             return
         # Create string containing autosave data
@@ -384,25 +455,15 @@ class ConfigAutoSave:
             logging.exception(msg)
             raise gcmd.error(msg)
         self._disallow_include_conflicts(regular_fileconfig)
-        # Determine filenames
-        datestr = time.strftime("-%Y%m%d_%H%M%S")
-        backup_name = cfgname + datestr
-        temp_name = cfgname + "_autosave"
-        if cfgname.endswith(".cfg"):
-            backup_name = cfgname[:-4] + datestr + ".cfg"
-            temp_name = cfgname[:-4] + "_autosave.cfg"
-        # Create new config file with temporary name and swap with main config
-        logging.info("SAVE_CONFIG to '%s' (backup in '%s')",
-                     cfgname, backup_name)
-        try:
-            f = open(temp_name, 'w')
-            f.write(data)
-            f.close()
-            os.rename(cfgname, backup_name)
-            os.rename(temp_name, cfgname)
-        except:
+        # Write the new config file from the background thread
+        count = self._queue_write(cfgname, data)
+        if not do_restart:
+            self.status_save_pending = {}
+            self.save_config_pending = False
+            gcmd.respond_info("Config file save queued")
+            return
+        if self._wait_write(count) is not None:
             msg = "Unable to write config file during SAVE_CONFIG"
-            logging.exception(msg)
             raise gcmd.error(msg)
         # Request a restart
         gcode = self.printer.lookup_object('gcode')
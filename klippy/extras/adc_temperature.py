@@ -14,11 +14,44 @@ SAMPLE_TIME = 0.001
 SAMPLE_COUNT = 8
 REPORT_TIME = 0.300
 RANGE_CHECK_COUNT = 4
+TABLE_SIZE = 2048
+
+# Precomputed table for fast conversion of adc values to temperatures
+class TemperatureTable:
+    def __init__(self, calc_temp):
+        self.temps = [calc_temp(i / float(TABLE_SIZE))
+                      for i in range(TABLE_SIZE + 1)]
+        self.temps.append(self.temps[-1])
+    def calc_temp(self, adc):
+        pos = adc * TABLE_SIZE
+        if pos < 0.:
+            pos = 0.
+        elif pos > TABLE_SIZE:
+            pos = float(TABLE_SIZE)
+        i = int(pos)
+        temps = self.temps
+        low_temp = temps[i]
+        return low_temp + (temps[i+1] - low_temp) * (pos - i)
+
+# Tables are shared between sensors with identical conversion parameters
+temperature_tables = {}
+
+def lookup_calc_temp(adc_convert):
+    if not hasattr(adc_convert, 'get_table_key'):
+        # Conversion is already inexpensive
+        return adc_convert.calc_temp
+    key = adc_convert.get_table_key()
+    table = temperature_tables.get(key)
+    if table is None:
+        table = temperature_tables[key] = TemperatureTable(
+            adc_convert.calc_temp)
+    return table.calc_temp
 
 # Interface between ADC and heater temperature callbacks
 class PrinterADCtoTemperature:
     def __init__(self, config, adc_convert):
         self.adc_convert = adc_convert
+        self.calc_temp = lookup_calc_temp(adc_convert)
         ppins = config.get_printer().lookup_object('pins')
         self.mcu_adc = ppins.setup_pin('adc', config.get('sensor_pin'))
         self.mcu_adc.setup_adc_callback(REPORT_TIME, self.adc_callback)
@@ -28,8 +61,12 @@ class PrinterADCtoTemperature:
         self.temperature_callback = temperature_callback
     def get_report_time_delta(self):
         return REPORT_TIME
+    def get_mcu_adc(self):
+        return self.mcu_adc
+    def calc_adc(self, temp):
+        return self.adc_convert.calc_adc(temp)
     def adc_callback(self, read_time, read_value):
-        temp = self.adc_convert.calc_temp(read_value)
+        temp = self.calc_temp(read_value)
         self.temperature_callback(read_time + SAMPLE_COUNT * SAMPLE_TIME, temp)
     def setup_minmax(self, min_temp, max_temp):
         arange = [self.adc_convert.calc_adc(t) for t in [min_temp, max_temp]]
@@ -110,7 +110,8 @@ class ADS1220:
         self.query_ads1220_cmd = self.mcu.lookup_command(
             "query_ads1220 oid=%c rest_ticks=%u", cq=cmdqueue)
         self.attach_probe_cmd = self.mcu.lookup_command(
-            "ads1220_attach_load_cell_probe oid=%c load_cell_probe_oid=%c")
+            "ads1220_attach_load_cell_probe oid=%c load_cell_probe_oid=%c"
+            " channel=%c")
         self.ffreader.setup_query_command("query_ads1220_status oid=%c",
                                           oid=self.oid, cq=cmdqueue)
 
@@ -129,8 +130,8 @@ class ADS1220:
     def add_client(self, callback):
         self.batch_bulk.add_client(callback)
 
-    def attach_load_cell_probe(self, load_cell_probe_oid):
-        self.attach_probe_cmd.send([self.oid, load_cell_probe_oid])
+    def attach_load_cell_probe(self, load_cell_probe_oid, channel=0):
+        self.attach_probe_cmd.send([self.oid, load_cell_probe_oid, channel])
 
     # Measurement decoding
     def _convert_samples(self, samples):
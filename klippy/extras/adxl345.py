@@ -39,6 +39,14 @@ class AccelQueryHelper:
         self.request_start_time = self.request_end_time = print_time
         self.msgs = []
         self.samples = []
+        self.batch_callback = None
+        self.keep_msgs = True
+    def set_batch_callback(self, callback, keep_msgs=True):
+        # Pass each batch to 'callback' as it arrives.  Without
+        # 'keep_msgs' the batches are not stored (get_samples() and
+        # write_to_file() then have no data).
+        self.batch_callback = callback
+        self.keep_msgs = keep_msgs
     def finish_measurements(self):
         toolhead = self.printer.lookup_object('toolhead')
         self.request_end_time = toolhead.get_last_move_time()
@@ -47,6 +55,10 @@ class AccelQueryHelper:
     def handle_batch(self, msg):
         if self.is_finished:
             return False
+        if self.batch_callback is not None:
+            self.batch_callback(msg)
+            if not self.keep_msgs:
+                return True
         if len(self.msgs) >= 10000:
             # Avoid filling up memory with too many samples
             return False
@@ -103,6 +115,60 @@ class AccelQueryHelper:
         write_proc.daemon = True
         write_proc.start()
 
+# Resample the measurements of several chips onto a common print_time
+# grid (using linear interpolation).  Each list in 'sample_lists'
+# contains (time, accel_x, accel_y, accel_z) tuples.  Only the time
+# range covered by all chips is returned.  Each returned row contains
+# the time followed by the x, y, and z values of each chip.
+def resample_measurements(sample_lists, sample_period=None):
+    if not sample_lists or not all(sample_lists):
+        return []
+    start_time = max([s[0][0] for s in sample_lists])
+    end_time = min([s[-1][0] for s in sample_lists])
+    if end_time <= start_time:
+        return []
+    if sample_period is None:
+        # Use the rate of the fastest chip
+        sample_period = min([(s[-1][0] - s[0][0]) / max(len(s) - 1, 1)
+                             for s in sample_lists])
+    count = int((end_time - start_time) / sample_period) + 1
+    times = [start_time + i * sample_period for i in range(count)]
+    rows = [[t] for t in times]
+    for samples in sample_lists:
+        pos = 0
+        for t, row in zip(times, rows):
+            while samples[pos+1][0] < t:
+                pos += 1
+            t0, x0, y0, z0 = samples[pos]
+            t1, x1, y1, z1 = samples[pos+1]
+            f = (t - t0) / (t1 - t0) if t1 > t0 else 0.
+            row.extend((x0 + (x1 - x0) * f, y0 + (y1 - y0) * f,
+                        z0 + (z1 - z0) * f))
+    return rows
+
+# Write the measurements of several chips (that were captured at the
+# same time) into a single file with a common time base
+def write_synchronized_file(filename, names, aclients):
+    def write_impl():
+        try:
+            # Try to re-nice writing process
+            os.nice(20)
+        except:
+            pass
+        rows = resample_measurements([a.get_samples() for a in aclients])
+        f = open(filename, "w")
+        f.write("#time")
+        for name in names:
+            name = name.replace(" ", "_")
+            f.write(",%s_x,%s_y,%s_z" % (name, name, name))
+        f.write("\n")
+        for row in rows:
+            f.write(",".join(["%.6f" % (v,) for v in row]) + "\n")
+        f.close()
+    write_proc = multiprocessing.Process(target=write_impl)
+    write_proc.daemon = True
+    write_proc.start()
+
 # Helper class for G-Code commands
 class AccelCommandHelper:
     def __init__(self, config, chip):
@@ -205,8 +271,13 @@ class ADXL345:
         mcu.add_config_cmd("query_adxl345 oid=%d rest_ticks=0"
                            % (oid,), on_restart=True)
         mcu.register_config_callback(self._build_config)
+        # Optional on-mcu filtering and decimation
+        self.decimate = bulk_sensor.SensorDecimate(
+            config, mcu, self.spi.get_command_queue(), self.data_rate)
+        self.decimate.setup_sensor(
+            "adxl345_set_decimate oid=%d decimate_oid=%d", oid)
         # Bulk sample message reading
-        chip_smooth = self.data_rate * BATCH_UPDATES * 2
+        chip_smooth = self.decimate.get_output_rate() * BATCH_UPDATES * 2
         self.ffreader = bulk_sensor.FixedFreqReader(mcu, chip_smooth, "BBBBB")
         self.last_error_count = 0
         # Process messages in batches
@@ -277,6 +348,7 @@ class ADXL345:
         self.set_reg(REG_BW_RATE, QUERY_RATES[self.data_rate])
         self.set_reg(REG_FIFO_CTL, SET_FIFO_CTL)
         # Start bulk reading
+        self.decimate.note_start()
         rest_ticks = self.mcu.seconds_to_clock(4. / self.data_rate)
         self.query_adxl345_cmd.send([self.oid, rest_ticks])
         self.set_reg(REG_POWER_CTL, 0x08)
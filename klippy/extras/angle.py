@@ -71,10 +71,17 @@ class AngleCalibration:
             phase_diff -= phases
         # Store final offset
         self.mcu_pos_offset = mcu_pos - (angle_mpos - phase_diff)
-    def apply_calibration(self, samples):
+    def get_mcu_calibration(self):
+        # Return calibration table (and direction) for use by the mcu
+        if not self.calibration:
+            return None
+        return self.calibration[:-1], self.calibration_reversed
+    def apply_calibration(self, samples, is_mcu_calibrated=False):
         calibration = self.calibration
         if not calibration:
             return None
+        if is_mcu_calibrated:
+            return self._calc_position_offset(samples)
         calibration_reversed = self.calibration_reversed
         interp_bits = ANGLE_BITS - CALIBRATION_BITS
         interp_mask = (1 << interp_bits) - 1
@@ -91,6 +98,8 @@ class AngleCalibration:
             if calibration_reversed:
                 new_angle = -new_angle
             samples[i] = (samp_time, new_angle)
+        return self._calc_position_offset(samples)
+    def _calc_position_offset(self, samples):
         if self.mcu_pos_offset is None:
             self.calc_mcu_pos_offset(samples[0])
             if self.mcu_pos_offset is None:
@@ -225,6 +234,9 @@ class AngleCalibration:
         return angles, math.sqrt(total_variance / total_count), total_count
     cmd_ANGLE_CALIBRATE_help = "Calibrate angle sensor to stepper motor"
     def cmd_ANGLE_CALIBRATE(self, gcmd):
+        if self.printer.lookup_object(self.name).is_mcu_calibrated():
+            raise gcmd.error("Unable to calibrate while angle sensor"
+                             " measurements are active")
         # Perform calibration movement and capture
         old_calibration = self.calibration
         self.calibration = []
@@ -603,6 +615,75 @@ class HelperMT6826S:
 
 BYTES_PER_SAMPLE = 3
 SAMPLES_PER_BLOCK = bulk_sensor.MAX_BULK_MSG_SIZE // BYTES_PER_SAMPLE
+PACKED_HEADER = 3 + BYTES_PER_SAMPLE
+CALIBRATION_CHUNK = 16
+
+
+######################################################################
+# Following error checking
+######################################################################
+
+FOLLOWING_CHECK_SAMPLES = 8
+FOLLOWING_EVENT_DELAY = 10.
+
+# Compare the calibrated sensor position with the commanded stepper
+# position (from the stepcompress step history) during normal printing
+class AngleFollowingCheck:
+    def __init__(self, config, angle, calibration):
+        self.printer = config.get_printer()
+        self.angle = angle
+        self.calibration = calibration
+        self.max_error = config.getfloat('max_following_error', 0., minval=0.)
+        self.angle_dist = 0.
+        self.last_error = self.peak_error = 0.
+        self.error_count = 0
+        self.min_event_systime = 0.
+        if not self.max_error:
+            return
+        if calibration.stepper_name is None:
+            raise config.error("max_following_error requires a stepper")
+        self.printer.register_event_handler("klippy:ready", self._handle_ready)
+    def _handle_ready(self):
+        mcu_stepper = self.calibration.mcu_stepper
+        rotation_dist, steps_per_rotation = mcu_stepper.get_rotation_distance()
+        self.angle_dist = rotation_dist / float(1<<ANGLE_BITS)
+        self.angle.add_client(self._handle_batch)
+    def _handle_batch(self, msg):
+        offset = msg.get('position_offset')
+        if offset is None:
+            # Sensor is not calibrated or stepper phase is not yet known
+            return True
+        # Only check a subset of the samples to limit host cpu usage
+        data = msg['data']
+        mcu_stepper = self.calibration.mcu_stepper
+        angle_dist = self.angle_dist
+        skip = max(1, len(data) // FOLLOWING_CHECK_SAMPLES)
+        error = 0.
+        for samp_time, angle in data[skip-1::skip]:
+            mcu_pos = mcu_stepper.get_past_mcu_position(samp_time)
+            cmd_pos = mcu_stepper.mcu_to_commanded_position(mcu_pos)
+            diff = angle * angle_dist + offset - cmd_pos
+            if abs(diff) > abs(error):
+                error = diff
+        self.last_error = error
+        self.peak_error = max(self.peak_error, abs(error))
+        if abs(error) > self.max_error:
+            self._note_error(error)
+        return True
+    def _note_error(self, error):
+        self.error_count += 1
+        eventtime = self.printer.get_reactor().monotonic()
+        if eventtime < self.min_event_systime:
+            return
+        self.min_event_systime = eventtime + FOLLOWING_EVENT_DELAY
+        logging.warning("angle %s: following error %.3fmm exceeds %.3fmm",
+                        self.angle.name, error, self.max_error)
+        self.printer.send_event("angle:following_error", self.angle.name,
+                                error)
+    def get_status(self, eventtime):
+        return {'following_error': self.last_error,
+                'peak_following_error': self.peak_error,
+                'following_error_count': self.error_count}
 
 SAMPLE_PERIOD = 0.000400
 BATCH_UPDATES = 0.100
@@ -616,6 +697,7 @@ class Angle:
         # Measurement conversion
         self.start_clock = self.time_shift = self.sample_ticks = 0
         self.last_sequence = self.last_angle = 0
+        self.is_packed = self.is_mcu_calibrated_active = False
         # Sensor type
         sensors = { "a1333": HelperA1333,
                     "as5047d": HelperAS5047D,
@@ -630,7 +712,7 @@ class Angle:
         self.oid = oid = mcu.create_oid()
         self.sensor_helper = sensor_class(config, self.spi, oid)
         # Setup mcu sensor_spi_angle bulk query code
-        self.query_spi_angle_cmd = None
+        self.query_spi_angle_cmd = self.enable_calibration_cmd = None
         mcu.add_config_cmd(
             "config_spi_angle oid=%d spi_oid=%d spi_angle_type=%s"
             % (oid, self.spi.get_oid(), sensor_type))
@@ -647,6 +729,8 @@ class Angle:
         api_resp = {'header': ('time', 'angle')}
         self.batch_bulk.add_mux_endpoint("angle/dump_angle",
                                          "sensor", self.name, api_resp)
+        self.following_check = AngleFollowingCheck(config, self,
+                                                   self.calibration)
     def _build_config(self):
         freq = self.mcu.seconds_to_clock(1.)
         while float(TCODE_ERROR << self.time_shift) / freq < 0.002:
@@ -655,11 +739,61 @@ class Angle:
         self.query_spi_angle_cmd = self.mcu.lookup_command(
             "query_spi_angle oid=%c clock=%u rest_ticks=%u time_shift=%c",
             cq=cmdqueue)
+        # Use mcu calibration and packed reports (when supported)
+        mcu_cal = self.calibration.get_mcu_calibration()
+        if mcu_cal is not None and self.mcu.try_lookup_command(
+                "spi_angle_set_calibration oid=%c offset=%c data=%*s"):
+            table, reversed_ = mcu_cal
+            for offset in range(0, len(table), CALIBRATION_CHUNK):
+                chunk = table[offset:offset+CALIBRATION_CHUNK]
+                data = "".join(["%02x%02x" % (v & 0xff, (v >> 8) & 0xff)
+                                for v in chunk])
+                self.mcu.add_config_cmd(
+                    "spi_angle_set_calibration oid=%d offset=%d data=%s"
+                    % (self.oid, offset, data))
+            self.enable_calibration_cmd = self.mcu.lookup_command(
+                "spi_angle_enable_calibration oid=%c enable=%c reversed=%c",
+                cq=cmdqueue)
+        if self.mcu.try_lookup_command(
+                "spi_angle_set_packed oid=%c enable=%c") is not None:
+            self.mcu.add_config_cmd("spi_angle_set_packed oid=%d enable=1"
+                                    % (self.oid,))
+            self.is_packed = True
     def get_status(self, eventtime=None):
-        return {'temperature': self.sensor_helper.last_temperature}
+        status = {'temperature': self.sensor_helper.last_temperature}
+        if self.following_check.max_error:
+            status.update(self.following_check.get_status(eventtime))
+        return status
     def add_client(self, client_cb):
         self.batch_bulk.add_client(client_cb)
+    def is_mcu_calibrated(self):
+        return self._is_measuring() and self.is_mcu_calibrated_active
     # Measurement decoding
+    def _unpack_block(self, d):
+        # Expand a packed block into a list of (tcode, angle) entries
+        mode = d[0]
+        tcode_bits = mode >> 4
+        angle_bits = (mode & 0x0f) + 1
+        sample_bits = tcode_bits + angle_bits
+        tcode_mask = (1 << tcode_bits) - 1
+        angle_mask = (1 << angle_bits) - 1
+        tcode = d[3]
+        angle = d[4] | (d[5] << 8)
+        entries = [(tcode, angle)]
+        acc = acc_bits = 0
+        for b in d[PACKED_HEADER:]:
+            acc |= b << acc_bits
+            acc_bits += 8
+            while acc_bits >= sample_bits:
+                tdelta = acc & tcode_mask
+                acc >>= tcode_bits
+                adelta = acc & angle_mask
+                acc >>= angle_bits
+                acc_bits -= sample_bits
+                tcode = (tcode + ((tdelta >> 1) ^ -(tdelta & 1))) & 0xff
+                angle = (angle + ((adelta >> 1) ^ -(adelta & 1))) & 0xffff
+                entries.append((tcode, angle))
+        return entries
     def _extract_samples(self, raw_samples):
         # Load variables to optimize inner loop below
         sample_ticks = self.sample_ticks
@@ -679,21 +813,30 @@ class Angle:
             time_shift = self.time_shift
             static_delay = self.sensor_helper.get_static_delay()
         # Process every message in raw_samples
+        is_packed = self.is_packed
         count = error_count = 0
-        samples = [None] * (len(raw_samples) * SAMPLES_PER_BLOCK)
+        samples = []
         for params in raw_samples:
-            seq_diff = (params['sequence'] - last_sequence) & 0xffff
-            last_sequence += seq_diff
-            samp_count = last_sequence * SAMPLES_PER_BLOCK
-            msg_mclock = start_clock + samp_count*sample_ticks
             d = bytearray(params['data'])
-            for i in range(len(d) // BYTES_PER_SAMPLE):
-                d_ta = d[i*BYTES_PER_SAMPLE:(i+1)*BYTES_PER_SAMPLE]
-                tcode = d_ta[0]
+            if is_packed:
+                # Packed blocks hold the index of their first sample
+                seq_diff = ((d[1] | (d[2] << 8)) - last_sequence) & 0xffff
+                last_sequence += seq_diff
+                samp_count = last_sequence
+                entries = self._unpack_block(d)
+            else:
+                seq_diff = (params['sequence'] - last_sequence) & 0xffff
+                last_sequence += seq_diff
+                samp_count = last_sequence * SAMPLES_PER_BLOCK
+                entries = [(d[i], d[i+1] | (d[i+2] << 8))
+                           for i in range(0, len(d) - BYTES_PER_SAMPLE + 1,
+                                          BYTES_PER_SAMPLE)]
+            samples.extend([None] * len(entries))
+            msg_mclock = start_clock + samp_count*sample_ticks
+            for i, (tcode, raw_angle) in enumerate(entries):
                 if tcode == TCODE_ERROR:
                     error_count += 1
                     continue
-                raw_angle = d_ta[1] | (d_ta[2] << 8)
                 angle_diff = (raw_angle - last_angle) & 0xffff
                 angle_diff -= (angle_diff & 0x8000) << 1
                 last_angle += angle_diff
@@ -729,6 +872,13 @@ class Angle:
         self.start_clock = reqclock = self.mcu.print_time_to_clock(print_time)
         rest_ticks = self.mcu.seconds_to_clock(self.sample_period)
         self.sample_ticks = rest_ticks
+        mcu_cal = self.calibration.get_mcu_calibration()
+        self.is_mcu_calibrated_active = False
+        if self.enable_calibration_cmd is not None:
+            self.is_mcu_calibrated_active = mcu_cal is not None
+            reversed_ = mcu_cal is not None and mcu_cal[1]
+            self.enable_calibration_cmd.send(
+                [self.oid, self.is_mcu_calibrated_active, reversed_])
         self.query_spi_angle_cmd.send([self.oid, reqclock, rest_ticks,
                                        self.time_shift], reqclock=reqclock)
     def _finish_measurements(self):
@@ -746,7 +896,8 @@ class Angle:
         samples, error_count = self._extract_samples(raw_samples)
         if not samples:
             return {}
-        offset = self.calibration.apply_calibration(samples)
+        offset = self.calibration.apply_calibration(
+            samples, self.is_mcu_calibrated_active)
         return {'data': samples, 'errors': error_count,
                 'position_offset': offset}
 
@@ -4,6 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, math, json, collections
+import chelper
 from . import probe
 
 PROFILE_VERSION = 1
@@ -26,6 +27,30 @@ def within(coord, min_c, max_c, tol=0.0):
     return (max_c[0] + tol) >= coord[0] >= (min_c[0] - tol) and \
         (max_c[1] + tol) >= coord[1] >= (min_c[1] - tol)
 
+# Generate an interpolated mesh from a probed matrix.  Each interpolated
+# point is a weighted sum of probed points - x_weights and y_weights
+# contain a list of (probe_index, weight) pairs for each mesh index.
+def apply_mesh_weights(z_matrix, x_weights, y_weights):
+    try:
+        import numpy as np
+    except ImportError:
+        np = None
+    if np is not None:
+        wx = np.zeros((len(x_weights), len(z_matrix[0])))
+        for idx, w in enumerate(x_weights):
+            for i, f in w:
+                wx[idx, i] = f
+        wy = np.zeros((len(y_weights), len(z_matrix)))
+        for idx, w in enumerate(y_weights):
+            for i, f in w:
+                wy[idx, i] = f
+        return wy.dot(np.array(z_matrix)).dot(wx.T).tolist()
+    x_rows = [[sum([row[i] * f for i, f in w]) for w in x_weights]
+              for row in z_matrix]
+    return [[sum([x_rows[i][col] * f for i, f in w])
+             for col in range(len(x_weights))]
+            for w in y_weights]
+
 # Constrain value between min and max
 def constrain(val, min_val, max_val):
     return min(max_val, max(min_val, val))
@@ -105,6 +130,9 @@ class BedMesh:
         self.tool_offset = 0.
         self.gcode = self.printer.lookup_object('gcode')
         self.splitter = MoveSplitter(config, self.gcode)
+        self.kin_comp = None
+        if config.getboolean('kinematic_compensation', False):
+            self.kin_comp = KinematicCompensation(self.printer)
         # setup persistent storage
         self.pmgr = ProfileManager(config, self)
         self.save_profile = self.pmgr.save_profile
@@ -130,11 +158,20 @@ class BedMesh:
         gcode_move = self.printer.load_object(config, 'gcode_move')
         gcode_move.set_move_transform(self)
         # initialize status dict
+        self.query_status = self.printer.lookup_object('query_status')
+        self.query_status.register_tracked_object('bed_mesh')
         self.update_status()
     def handle_connect(self):
         self.toolhead = self.printer.lookup_object('toolhead')
         self.bmc.print_generated_points(logging.info, truncate=True)
+        if self.kin_comp is not None:
+            # Homing and probing moves use physical coordinates
+            for event in ["homing:home_rails_begin",
+                          "homing:homing_move_begin"]:
+                self.printer.register_event_handler(
+                    event, self._exit_kinematic_mode)
     def set_mesh(self, mesh):
+        self._exit_kinematic_mode()
         if mesh is not None and self.fade_end != self.FADE_DISABLE:
             self.log_fade_complete = True
             if self.base_fade_target is None:
@@ -178,9 +215,31 @@ class BedMesh:
             return (self.fade_end - z_pos) / self.fade_dist
         else:
             return 1.
+    def _enter_kinematic_mode(self):
+        # Switch from physical toolhead coordinates (with split moves)
+        # to uncompensated coordinates with the mesh applied by the
+        # stepper kinematics
+        newpos = self.get_position()
+        self.toolhead.flush_step_generation()
+        self.kin_comp.load_mesh(self.z_mesh, self.fade_start, self.fade_end,
+                                self.fade_target, self.tool_offset)
+        self.kin_comp.set_active(True)
+        self.toolhead.set_position(newpos)
+    def _exit_kinematic_mode(self, *args):
+        kc = self.kin_comp
+        if kc is None or not kc.is_active:
+            return
+        self.toolhead.flush_step_generation()
+        newpos = self.toolhead.get_position()
+        newpos[2] += kc.calc_z_adjust(newpos[0], newpos[1], newpos[2])
+        kc.set_active(False)
+        self.toolhead.set_position(newpos)
     def get_position(self):
         # Return last, non-transformed position
-        if self.z_mesh is None:
+        if self.kin_comp is not None and self.kin_comp.is_active:
+            # Toolhead position is already uncompensated
+            self.last_position[:] = self.toolhead.get_position()
+        elif self.z_mesh is None:
             # No mesh calibrated, so send toolhead position
             self.last_position[:] = self.toolhead.get_position()
             self.last_position[2] -= self.fade_target
@@ -207,7 +266,16 @@ class BedMesh:
         return list(self.last_position)
     def move(self, newpos, speed):
         factor = self.get_z_factor(newpos[2])
-        if self.z_mesh is None or not factor:
+        if self.z_mesh is not None and self.kin_comp is not None:
+            # Mesh is applied during step generation
+            if self.kin_comp.is_active:
+                self.toolhead.move(newpos, speed)
+            else:
+                self._enter_kinematic_mode()
+                self.toolhead.move(newpos, speed)
+                gcode_move = self.printer.lookup_object('gcode_move')
+                gcode_move.reset_last_position()
+        elif self.z_mesh is None or not factor:
             # No mesh calibrated, or mesh leveling phased out.
             x, y, z = newpos[:3]
             if self.log_fade_complete:
@@ -248,6 +316,7 @@ class BedMesh:
             self.status['mesh_max'] = mesh_max
             self.status['probed_matrix'] = probed_matrix
             self.status['mesh_matrix'] = mesh_matrix
+        self.query_status.note_status_change('bed_mesh')
     def get_mesh(self):
         return self.z_mesh
     cmd_BED_MESH_OUTPUT_help = "Retrieve interpolated grid of probed z-points"
@@ -277,6 +346,7 @@ class BedMesh:
     cmd_BED_MESH_OFFSET_help = "Add X/Y offsets to the mesh lookup"
     def cmd_BED_MESH_OFFSET(self, gcmd):
         if self.z_mesh is not None:
+            self._exit_kinematic_mode()
             offsets = [None, None]
             for i, axis in enumerate(['X', 'Y']):
                 offsets[i] = gcmd.get_float(axis, None)
@@ -1254,6 +1324,49 @@ class RapidScanHelper:
         return [(pos - ofs) for pos, ofs in zip(point, offsets)]
 
 
+# Apply the mesh z adjustment in the stepper kinematics (instead of
+# splitting moves)
+class KinematicCompensation:
+    def __init__(self, printer):
+        self.printer = printer
+        self.is_active = False
+        self.mesh_steppers = []
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.table = ffi_main.gc(ffi_lib.bed_mesh_alloc(),
+                                 ffi_lib.bed_mesh_free)
+        self.calc_z_adjust_func = ffi_lib.bed_mesh_calc_z_adjust
+        self.set_active_func = ffi_lib.mesh_stepper_set_active
+        # Wrap the kinematics before other modules (eg, input_shaper)
+        printer.register_event_handler("klippy:mcu_identify",
+                                       self._handle_mcu_identify)
+    def _handle_mcu_identify(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        toolhead = self.printer.lookup_object('toolhead')
+        for s in toolhead.get_kinematics().get_steppers():
+            if s.get_trapq() is None:
+                continue
+            sk = s.get_stepper_kinematics()
+            mesh_sk = ffi_main.gc(ffi_lib.mesh_stepper_alloc(), ffi_lib.free)
+            if ffi_lib.mesh_stepper_set_sk(mesh_sk, sk, self.table) < 0:
+                continue
+            s.set_stepper_kinematics(mesh_sk)
+            self.mesh_steppers.append((mesh_sk, sk))
+    def load_mesh(self, z_mesh, fade_start, fade_end, fade_target,
+                  tool_offset):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        z_mesh.load_table(self.table)
+        x_offset, y_offset = z_mesh.get_mesh_offsets()
+        ffi_lib.bed_mesh_set_params(self.table, x_offset, y_offset,
+                                    fade_start, fade_end, fade_target,
+                                    tool_offset)
+    def calc_z_adjust(self, x, y, z):
+        return self.calc_z_adjust_func(self.table, x, y, z)
+    def set_active(self, is_active):
+        self.is_active = is_active
+        for mesh_sk, sk in self.mesh_steppers:
+            self.set_active_func(mesh_sk, is_active)
+
+
 class MoveSplitter:
     def __init__(self, config, gcode):
         self.split_delta_z = config.getfloat(
@@ -1324,6 +1437,7 @@ class ZMesh:
         self.probed_matrix = self.mesh_matrix = None
         self.mesh_params = params
         self.mesh_offsets = [0., 0.]
+        self.table = self.calc_z_func = None
         logging.debug('bed_mesh: probe/mesh parameters:')
         for key, value in self.mesh_params.items():
             logging.debug("%s :  %s" % (key, value))
@@ -1405,7 +1519,24 @@ class ZMesh:
     def build_mesh(self, z_matrix):
         self.probed_matrix = z_matrix
         self._sample(z_matrix)
+        self._update_table()
         self.print_mesh(logging.debug)
+    def load_table(self, table):
+        # Store the mesh in a C bed_mesh_table object
+        ffi_main, ffi_lib = chelper.get_ffi()
+        zvals = [z for line in self.mesh_matrix for z in line]
+        ffi_lib.bed_mesh_set_grid(table, self.mesh_x_count, self.mesh_y_count,
+                                  self.mesh_x_min, self.mesh_y_min,
+                                  self.mesh_x_dist, self.mesh_y_dist, zvals)
+    def _update_table(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        if self.table is None:
+            self.table = ffi_main.gc(ffi_lib.bed_mesh_alloc(),
+                                     ffi_lib.bed_mesh_free)
+            self.calc_z_func = ffi_lib.bed_mesh_calc_z
+        self.load_table(self.table)
+        ffi_lib.bed_mesh_set_params(self.table, self.mesh_offsets[0],
+                                    self.mesh_offsets[1], 0., 0., 0., 0.)
     def set_zero_reference(self, xpos, ypos):
         offset = self.calc_z(xpos, ypos)
         logging.info(
@@ -1416,22 +1547,22 @@ class ZMesh:
             for yidx in range(len(matrix)):
                 for xidx in range(len(matrix[yidx])):
                     matrix[yidx][xidx] -= offset
+        self._update_table()
     def set_mesh_offsets(self, offsets):
         for i, o in enumerate(offsets):
             if o is not None:
                 self.mesh_offsets[i] = o
+        if self.table is not None:
+            self._update_table()
+    def get_mesh_offsets(self):
+        return list(self.mesh_offsets)
     def get_x_coordinate(self, index):
         return self.mesh_x_min + self.mesh_x_dist * index
     def get_y_coordinate(self, index):
         return self.mesh_y_min + self.mesh_y_dist * index
     def calc_z(self, x, y):
         if self.mesh_matrix is not None:
-            tbl = self.mesh_matrix
-            tx, xidx = self._get_linear_index(x + self.mesh_offsets[0], 0)
-            ty, yidx = self._get_linear_index(y + self.mesh_offsets[1], 1)
-            z0 = lerp(tx, tbl[yidx][xidx], tbl[yidx][xidx+1])
-            z1 = lerp(tx, tbl[yidx+1][xidx], tbl[yidx+1][xidx+1])
-            return lerp(ty, z0, z1)
+            return self.calc_z_func(self.table, x, y)
         else:
             # No mesh table generated, no z-adjustment
             return 0.
@@ -1452,52 +1583,15 @@ class ZMesh:
             return round(avg_z, 2)
         else:
             return 0.
-    def _get_linear_index(self, coord, axis):
-        if axis == 0:
-            # X-axis
-            mesh_min = self.mesh_x_min
-            mesh_cnt = self.mesh_x_count
-            mesh_dist = self.mesh_x_dist
-            cfunc = self.get_x_coordinate
-        else:
-            # Y-axis
-            mesh_min = self.mesh_y_min
-            mesh_cnt = self.mesh_y_count
-            mesh_dist = self.mesh_y_dist
-            cfunc = self.get_y_coordinate
-        t = 0.
-        idx = int(math.floor((coord - mesh_min) / mesh_dist))
-        idx = constrain(idx, 0, mesh_cnt - 2)
-        t = (coord - cfunc(idx)) / mesh_dist
-        return constrain(t, 0., 1.), idx
     def _sample_direct(self, z_matrix):
         self.mesh_matrix = z_matrix
     def _sample_lagrange(self, z_matrix):
-        x_mult = self.x_mult
-        y_mult = self.y_mult
-        self.mesh_matrix = \
-            [[0. if ((i % x_mult) or (j % y_mult))
-             else z_matrix[j//y_mult][i//x_mult]
-             for i in range(self.mesh_x_count)]
-             for j in range(self.mesh_y_count)]
         xpts, ypts = self._get_lagrange_coords()
-        # Interpolate X coordinates
-        for i in range(self.mesh_y_count):
-            # only interpolate X-rows that have probed coordinates
-            if i % y_mult != 0:
-                continue
-            for j in range(self.mesh_x_count):
-                if j % x_mult == 0:
-                    continue
-                x = self.get_x_coordinate(j)
-                self.mesh_matrix[i][j] = self._calc_lagrange(xpts, x, i, 0)
-        # Interpolate Y coordinates
-        for i in range(self.mesh_x_count):
-            for j in range(self.mesh_y_count):
-                if j % y_mult == 0:
-                    continue
-                y = self.get_y_coordinate(j)
-                self.mesh_matrix[j][i] = self._calc_lagrange(ypts, y, i, 1)
+        x_weights = self._calc_lagrange_weights(
+            xpts, self.mesh_x_count, self.x_mult, self.get_x_coordinate)
+        y_weights = self._calc_lagrange_weights(
+            ypts, self.mesh_y_count, self.y_mult, self.get_y_coordinate)
+        self.mesh_matrix = apply_mesh_weights(z_matrix, x_weights, y_weights)
     def _get_lagrange_coords(self):
         xpts = []
         ypts = []
@@ -1506,122 +1600,63 @@ class ZMesh:
         for j in range(self.mesh_params['y_count']):
             ypts.append(self.get_y_coordinate(j * self.y_mult))
         return xpts, ypts
-    def _calc_lagrange(self, lpts, c, vec, axis=0):
+    def _calc_lagrange_weights(self, lpts, mesh_cnt, mult, cfunc):
+        # Determine the contribution of each probed point to each
+        # interpolated point along one axis
         pt_cnt = len(lpts)
-        total = 0.
-        for i in range(pt_cnt):
-            n = 1.
-            d = 1.
-            for j in range(pt_cnt):
-                if j == i:
-                    continue
-                n *= (c - lpts[j])
-                d *= (lpts[i] - lpts[j])
-            if axis == 0:
-                # Calc X-Axis
-                z = self.mesh_matrix[vec][i*self.x_mult]
-            else:
-                # Calc Y-Axis
-                z = self.mesh_matrix[i*self.y_mult][vec]
-            total += z * n / d
-        return total
+        weights = []
+        for idx in range(mesh_cnt):
+            if idx % mult == 0:
+                weights.append([(idx // mult, 1.)])
+                continue
+            c = cfunc(idx)
+            w = []
+            for i in range(pt_cnt):
+                n = 1.
+                d = 1.
+                for j in range(pt_cnt):
+                    if j == i:
+                        continue
+                    n *= (c - lpts[j])
+                    d *= (lpts[i] - lpts[j])
+                w.append((i, n / d))
+            weights.append(w)
+        return weights
     def _sample_bicubic(self, z_matrix):
         # should work for any number of probe points above 3x3
-        x_mult = self.x_mult
-        y_mult = self.y_mult
         c = self.mesh_params['tension']
-        self.mesh_matrix = \
-            [[0. if ((i % x_mult) or (j % y_mult))
-             else z_matrix[j//y_mult][i//x_mult]
-             for i in range(self.mesh_x_count)]
-             for j in range(self.mesh_y_count)]
-        # Interpolate X values
-        for y in range(self.mesh_y_count):
-            if y % y_mult != 0:
+        x_weights = self._calc_bicubic_weights(
+            self.mesh_params['x_count'], self.mesh_x_count, self.x_mult, c)
+        y_weights = self._calc_bicubic_weights(
+            self.mesh_params['y_count'], self.mesh_y_count, self.y_mult, c)
+        self.mesh_matrix = apply_mesh_weights(z_matrix, x_weights, y_weights)
+    def _calc_bicubic_weights(self, pt_cnt, mesh_cnt, mult, tension):
+        # The cardinal spline between control points p1 and p2 is a
+        # linear combination of the control points p0-p3
+        weights = []
+        for idx in range(mesh_cnt):
+            if idx % mult == 0:
+                weights.append([(idx // mult, 1.)])
                 continue
-            for x in range(self.mesh_x_count):
-                if x % x_mult == 0:
-                    continue
-                pts = self._get_x_ctl_pts(x, y)
-                self.mesh_matrix[y][x] = self._cardinal_spline(pts, c)
-        # Interpolate Y values
-        for x in range(self.mesh_x_count):
-            for y in range(self.mesh_y_count):
-                if y % y_mult == 0:
-                    continue
-                pts = self._get_y_ctl_pts(x, y)
-                self.mesh_matrix[y][x] = self._cardinal_spline(pts, c)
-    def _get_x_ctl_pts(self, x, y):
-        # Fetch control points and t for a X value in the mesh
-        x_mult = self.x_mult
-        x_row = self.mesh_matrix[y]
-        last_pt = self.mesh_x_count - 1 - x_mult
-        if x < x_mult:
-            p0 = p1 = x_row[0]
-            p2 = x_row[x_mult]
-            p3 = x_row[2*x_mult]
-            t = x / float(x_mult)
-        elif x > last_pt:
-            p0 = x_row[last_pt - x_mult]
-            p1 = x_row[last_pt]
-            p2 = p3 = x_row[last_pt + x_mult]
-            t = (x - last_pt) / float(x_mult)
-        else:
-            found = False
-            for i in range(x_mult, last_pt, x_mult):
-                if x > i and x < (i + x_mult):
-                    p0 = x_row[i - x_mult]
-                    p1 = x_row[i]
-                    p2 = x_row[i + x_mult]
-                    p3 = x_row[i + 2*x_mult]
-                    t = (x - i) / float(x_mult)
-                    found = True
-                    break
-            if not found:
-                raise BedMeshError(
-                    "bed_mesh: Error finding x control points")
-        return p0, p1, p2, p3, t
-    def _get_y_ctl_pts(self, x, y):
-        # Fetch control points and t for a Y value in the mesh
-        y_mult = self.y_mult
-        last_pt = self.mesh_y_count - 1 - y_mult
-        y_col = self.mesh_matrix
-        if y < y_mult:
-            p0 = p1 = y_col[0][x]
-            p2 = y_col[y_mult][x]
-            p3 = y_col[2*y_mult][x]
-            t = y / float(y_mult)
-        elif y > last_pt:
-            p0 = y_col[last_pt - y_mult][x]
-            p1 = y_col[last_pt][x]
-            p2 = p3 = y_col[last_pt + y_mult][x]
-            t = (y - last_pt) / float(y_mult)
-        else:
-            found = False
-            for i in range(y_mult, last_pt, y_mult):
-                if y > i and y < (i + y_mult):
-                    p0 = y_col[i - y_mult][x]
-                    p1 = y_col[i][x]
-                    p2 = y_col[i + y_mult][x]
-                    p3 = y_col[i + 2*y_mult][x]
-                    t = (y - i) / float(y_mult)
-                    found = True
-                    break
-            if not found:
-                raise BedMeshError(
-                    "bed_mesh: Error finding y control points")
-        return p0, p1, p2, p3, t
-    def _cardinal_spline(self, p, tension):
-        t = p[4]
-        t2 = t*t
-        t3 = t2*t
-        m1 = tension * (p[2] - p[0])
-        m2 = tension * (p[3] - p[1])
-        a = p[1] * (2*t3 - 3*t2 + 1)
-        b = p[2] * (-2*t3 + 3*t2)
-        c = m1 * (t3 - 2*t2 + t)
-        d = m2 * (t3 - t2)
-        return a + b + c + d
+            k = idx // mult
+            if k == 0:
+                ctl = (0, 0, 1, 2)
+            elif k >= pt_cnt - 2:
+                ctl = (pt_cnt - 3, pt_cnt - 2, pt_cnt - 1, pt_cnt - 1)
+            else:
+                ctl = (k - 1, k, k + 1, k + 2)
+            t = (idx - ctl[1] * mult) / float(mult)
+            t2 = t*t
+            t3 = t2*t
+            a = 2*t3 - 3*t2 + 1
+            b = -2*t3 + 3*t2
+            c = tension * (t3 - 2*t2 + t)
+            d = tension * (t3 - t2)
+            w = collections.OrderedDict()
+            for i, f in zip(ctl, (-c, a - d, b + c, d)):
+                w[i] = w.get(i, 0.) + f
+            weights.append(list(w.items()))
+        return weights
 
 
 class ProfileManager:
@@ -28,15 +28,22 @@ class BedTilt:
         x, y, z = pos[:3]
         z -= x*self.x_adjust + y*self.y_adjust + self.z_adjust
         return [x, y, z] + pos[3:]
-    def move(self, newpos, speed):
+    def calc_adjust(self, newpos):
         x, y, z = newpos[:3]
         z += x*self.x_adjust + y*self.y_adjust + self.z_adjust
-        self.toolhead.move([x, y, z] + newpos[3:], speed)
+        return [x, y, z] + newpos[3:]
+    def move(self, newpos, speed):
+        self.toolhead.move(self.calc_adjust(newpos), speed)
+    def get_fused_transform(self):
+        if not (self.x_adjust or self.y_adjust or self.z_adjust):
+            return None, self.toolhead
+        return self.calc_adjust, self.toolhead
     def update_adjust(self, x_adjust, y_adjust, z_adjust):
         self.x_adjust = x_adjust
         self.y_adjust = y_adjust
         self.z_adjust = z_adjust
         gcode_move = self.printer.lookup_object('gcode_move')
+        gcode_move.update_move_transform()
         gcode_move.reset_last_position()
         configfile = self.printer.lookup_object('configfile')
         configfile.set('bed_tilt', 'x_adjust', "%.6f" % (x_adjust,))
@@ -59,25 +66,21 @@ class BedTiltCalibrate:
     def cmd_BED_TILT_CALIBRATE(self, gcmd):
         self.probe_helper.start_probe(gcmd)
     def probe_finalize(self, offsets, positions):
-        # Setup for coordinate descent analysis
+        # Setup for least squares analysis
         z_offset = offsets[2]
         logging.info("Calculating bed_tilt with: %s", positions)
         params = { 'x_adjust': self.bedtilt.x_adjust,
                    'y_adjust': self.bedtilt.y_adjust,
                    'z_adjust': z_offset }
         logging.info("Initial bed_tilt parameters: %s", params)
-        # Perform coordinate descent
+        # Perform least squares fit
         def adjusted_height(pos, params):
             x, y, z = pos
             return (z - x*params['x_adjust'] - y*params['y_adjust']
                     - params['z_adjust'])
-        def errorfunc(params):
-            total_error = 0.
-            for pos in positions:
-                total_error += adjusted_height(pos, params)**2
-            return total_error
-        new_params = mathutil.coordinate_descent(
-            params.keys(), params, errorfunc)
+        def residuals(params):
+            return [adjusted_height(pos, params) for pos in positions]
+        new_params = mathutil.least_squares(params.keys(), params, residuals)
         # Update current bed_tilt calculations
         x_adjust = new_params['x_adjust']
         y_adjust = new_params['y_adjust']
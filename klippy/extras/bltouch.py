@@ -52,6 +52,8 @@ class BLTouchProbe:
             'pin_up_touch_mode_reports_triggered', True)
         # Calculate pin move time
         self.pin_move_time = config.getfloat('pin_move_time', 0.680, above=0.)
+        self.overlap_pin_moves = config.getboolean('overlap_pin_moves', False)
+        self.raise_check_pending = False
         # Wrappers
         self.get_mcu = self.mcu_endstop.get_mcu
         self.add_stepper = self.mcu_endstop.add_stepper
@@ -152,9 +154,34 @@ class BLTouchProbe:
             self.sync_mcu_print_time()
             self.send_cmd('reset', duration=RETRY_RESET_TIME)
             self.send_cmd('pin_up', duration=self.pin_move_time)
+    def check_raise_probe(self):
+        # Check the result of a raise that overlapped toolhead movement.
+        # The endstop is only queried (no trsync is armed) as arming a
+        # trsync would halt the probe steppers during that movement.
+        self.raise_check_pending = False
+        if not self.pin_up_not_triggered:
+            return
+        if not self.query_endstop(self.action_end_time):
+            return
+        msg = "Failed to verify BLTouch probe is raised; retrying."
+        self.gcode.respond_info(msg)
+        # Retry while the toolhead is stopped
+        self.sync_print_time()
+        self.send_cmd('reset', duration=RETRY_RESET_TIME)
+        self.send_cmd('pin_up', duration=self.pin_move_time)
+        self.verify_raise_probe()
+        self.sync_print_time()
     def lower_probe(self):
         self.test_sensor()
-        self.sync_print_time()
+        if self.overlap_pin_moves:
+            # Deploy the pin during the end of the preceding travel move
+            self.sync_mcu_print_time()
+            toolhead = self.printer.lookup_object('toolhead')
+            print_time = toolhead.get_last_move_time()
+            self.next_cmd_time = max(self.next_cmd_time,
+                                     print_time - self.pin_move_time)
+        else:
+            self.sync_print_time()
         self.send_cmd('pin_down', duration=self.pin_move_time)
         if self.probe_touch_mode:
             self.send_cmd('touch_mode')
@@ -188,6 +215,8 @@ class BLTouchProbe:
             return
         self.multi = 'FIRST'
     def multi_probe_end(self):
+        if self.raise_check_pending:
+            self.check_raise_probe()
         if self.stow_on_each_sample:
             return
         self.sync_print_time()
@@ -196,6 +225,8 @@ class BLTouchProbe:
         self.sync_print_time()
         self.multi = 'OFF'
     def probe_prepare(self, hmove):
+        if self.raise_check_pending:
+            self.check_raise_probe()
         if self.multi == 'OFF' or self.multi == 'FIRST':
             self.lower_probe()
             if self.multi == 'FIRST':
@@ -216,9 +247,13 @@ class BLTouchProbe:
             self.raise_probe()
     def probe_finish(self, hmove):
         self.wait_trigger_complete.wait()
-        if self.multi == 'OFF':
-            self.verify_raise_probe()
-        self.sync_print_time()
+        if self.multi == 'OFF' and self.overlap_pin_moves:
+            # Don't wait for the pin - it is checked before the next probe
+            self.raise_check_pending = True
+        else:
+            if self.multi == 'OFF':
+                self.verify_raise_probe()
+            self.sync_print_time()
         if hmove.check_no_movement() is not None:
             raise self.printer.command_error("BLTouch failed to deploy")
     def get_position_endstop(self):
@@ -4,6 +4,8 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, threading, struct
+import chelper
+from . import sos_filter
 
 # This "bulk sensor" module facilitates the processing of sensor chip
 # measurements that do not require the host to respond with low
@@ -109,7 +111,7 @@ class BatchWebhooksClient:
             return False
         tmp = dict(self.template)
         tmp['params'] = msg
-        self.cconn.send(tmp)
+        self.cconn.send_bulk(tmp)
         return True
 
 # Helper class to store incoming messages in a queue
@@ -199,6 +201,29 @@ class ClockSyncRegression:
         return base_time, base_chip, inv_freq
 
 MAX_BULK_MSG_SIZE = 51
+NATIVE_CHUNK_BLOCKS = 256
+
+# Sample field types of the C bulkreader (see BR_xxx in bulkreader.c)
+BR_SIGNED, BR_BIGENDIAN = 0x10, 0x20
+FIELD_SIZES = {'b': 1, 'h': 2, 'i': 4}
+
+# Return the C bulkreader field types for a struct format (or None if
+# the format can not be decoded by the C code)
+def lookup_native_fields(unpack_fmt):
+    flags = 0
+    fmt = unpack_fmt
+    if fmt[:1] in ('<', '>'):
+        if fmt[0] == '>':
+            flags = BR_BIGENDIAN
+        fmt = fmt[1:]
+    out = []
+    for c in fmt:
+        size = FIELD_SIZES.get(c.lower())
+        if size is None or (size > 1 and fmt == unpack_fmt):
+            # Unknown type (or multi-byte type with native alignment)
+            return None
+        out.append(size | flags | (BR_SIGNED if c.islower() else 0))
+    return out
 
 # Read sensor_bulk_data and calculate timestamps for devices that take
 # samples at a fixed frequency (and produce fixed data size samples).
@@ -210,9 +235,11 @@ class FixedFreqReader:
         self.unpack_from = unpack.unpack_from
         self.bytes_per_sample = unpack.size
         self.samples_per_block = MAX_BULK_MSG_SIZE // self.bytes_per_sample
+        self.native_fields = lookup_native_fields(unpack_fmt)
         self.last_sequence = self.max_query_duration = 0
         self.last_overflows = 0
         self.bulk_queue = self.oid = self.query_status_cmd = None
+        self.bulk_reader = None
     def setup_query_command(self, msgformat, oid, cq):
         # Lookup sensor query command (that responds with sensor_bulk_status)
         self.oid = oid
@@ -222,6 +249,45 @@ class FixedFreqReader:
             oid=oid, cq=cq)
         # Read sensor_bulk_data messages and store in a queue
         self.bulk_queue = BulkDataQueue(self.mcu, oid=oid)
+        self._setup_bulk_reader()
+        self._setup_packed_data()
+    def _setup_bulk_reader(self):
+        # Collect sensor_bulk_data messages in C code (when possible)
+        fields = self.native_fields
+        if fields is None:
+            return
+        bulk_data_cmd = self.mcu.lookup_command(
+            "sensor_bulk_data oid=%c sequence=%hu data=%*s")
+        ffi_main, ffi_lib = chelper.get_ffi()
+        bulk_reader = ffi_lib.bulkreader_alloc(
+            self.mcu.get_serialqueue(), self.oid,
+            bulk_data_cmd.get_command_tag(), self.bytes_per_sample,
+            self.samples_per_block, fields, len(fields))
+        if bulk_reader == ffi_main.NULL:
+            return
+        self.bulk_reader = ffi_main.gc(bulk_reader, ffi_lib.bulkreader_free)
+        max_samples = NATIVE_CHUNK_BLOCKS * self.samples_per_block
+        max_values = max_samples * len(fields)
+        self.ptimes = ffi_main.new('double[%d]' % (max_samples,))
+        self.values = ffi_main.new('int64_t[%d]' % (max_values,))
+        self.last_chip_clock = ffi_main.new('int64_t *')
+    def _setup_packed_data(self):
+        # Request compact "packed" sensor_bulk_data blocks (when supported)
+        if self.bulk_reader is None:
+            return
+        if not MAX_BULK_MSG_SIZE % self.bytes_per_sample:
+            # A full block would not fit along with the packed header
+            return
+        if self.mcu.try_lookup_command(
+                "config_sensor_bulk_encode oid=%c sensor_oid=%c"
+                " fields=%*s") is None:
+            return
+        fields = "".join(["%02x" % (f,) for f in self.native_fields])
+        self.mcu.add_config_cmd(
+            "config_sensor_bulk_encode oid=%d sensor_oid=%d fields=%s"
+            % (self.mcu.create_oid(), self.oid, fields))
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.bulkreader_set_packed(self.bulk_reader)
     def get_last_overflows(self):
         return self.last_overflows
     def _clear_duration_filter(self):
@@ -230,6 +296,9 @@ class FixedFreqReader:
         self.last_sequence = 0
         self.last_overflows = 0
         # Clear local queue (clear any stale samples from previous session)
+        if self.bulk_reader is not None:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            ffi_lib.bulkreader_start(self.bulk_reader)
         self.bulk_queue.clear_queue()
         # Set initial clock
         self._clear_duration_filter()
@@ -237,6 +306,9 @@ class FixedFreqReader:
         self._clear_duration_filter()
     def note_end(self):
         # Clear local queue (free no longer needed memory)
+        if self.bulk_reader is not None:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            ffi_lib.bulkreader_stop(self.bulk_reader)
         self.bulk_queue.clear_queue()
     def _update_clock(self, is_reset=False):
         params = self.query_status_cmd.send([self.oid])
@@ -264,10 +336,32 @@ class FixedFreqReader:
             self.clock_sync.reset(avg_mcu_clock, chip_clock)
         else:
             self.clock_sync.update(avg_mcu_clock, chip_clock)
+    # Decode the sensor_bulk_data messages collected by the C code
+    def _pull_native_samples(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        time_base, chip_base, inv_freq = self.clock_sync.get_time_translation()
+        num_fields = len(self.native_fields)
+        samples = []
+        while 1:
+            count = ffi_lib.bulkreader_pull_samples(
+                self.bulk_reader, self.last_sequence, time_base, chip_base,
+                inv_freq, self.ptimes, self.values, len(self.ptimes),
+                self.last_chip_clock)
+            if not count:
+                break
+            ptimes = ffi_main.unpack(self.ptimes, count)
+            values = ffi_main.unpack(self.values, count * num_fields)
+            samples.extend(zip(ptimes, *[values[i::num_fields]
+                                         for i in range(num_fields)]))
+        if samples:
+            self.clock_sync.set_last_chip_clock(self.last_chip_clock[0])
+        return samples
     # Convert sensor_bulk_data responses into list of samples
     def pull_samples(self):
         # Query MCU for sample timing and update clock synchronization
         self._update_clock()
+        if self.bulk_reader is not None:
+            return self._pull_native_samples()
         # Pull sensor_bulk_data messages from local queue
         raw_samples = self.bulk_queue.pull_queue()
         if not raw_samples:
@@ -295,3 +389,67 @@ class FixedFreqReader:
         self.clock_sync.set_last_chip_clock(seq * samples_per_block + i)
         del samples[count:]
         return samples
+
+
+######################################################################
+# On-mcu filtering and decimation
+######################################################################
+
+DECIMATE_LOWPASS_ORDER = 4
+DECIMATE_LOWPASS_RATIO = 0.4
+DECIMATE_COEFF_INT_BITS = 2
+DECIMATE_VALUE_INT_BITS = 19 # See DECIMATE_FRAC_BITS in sensor_decimate.c
+
+# Helper to low-pass filter and decimate 3-axis measurements on the
+# mcu (as requested by the "output_rate" config option)
+class SensorDecimate:
+    def __init__(self, config, mcu, cmd_queue, data_rate):
+        self.mcu = mcu
+        self.factor = 1
+        self.output_rate = data_rate
+        self.filters = []
+        self.oid = self.sensor_cmd = None
+        output_rate = config.getfloat('output_rate', None,
+                                      minval=data_rate / 255.,
+                                      maxval=data_rate)
+        if output_rate is None:
+            return
+        self.factor = int(data_rate / output_rate + .5)
+        if self.factor <= 1:
+            self.factor = 1
+            return
+        self.output_rate = float(data_rate) / self.factor
+        try:
+            import scipy.signal as signal
+        except:
+            raise config.error("Option output_rate requires the SciPy module")
+        sections = signal.butter(
+            DECIMATE_LOWPASS_ORDER, self.output_rate * DECIMATE_LOWPASS_RATIO,
+            btype='lowpass', fs=data_rate, output='sos')
+        fixed_filter = sos_filter.FixedPointSosFilter(
+            sections, [[0., 0.]] * len(sections), DECIMATE_COEFF_INT_BITS,
+            DECIMATE_VALUE_INT_BITS)
+        self.filters = [sos_filter.SosFilter(mcu, cmd_queue, fixed_filter)
+                        for i in range(3)]
+        self.oid = mcu.create_oid()
+    def get_output_rate(self):
+        return self.output_rate
+    def setup_sensor(self, sensor_cmd, sensor_oid):
+        # Register mcu command that attaches the filter to the sensor
+        if self.oid is None:
+            return
+        self.sensor_cmd = sensor_cmd % (sensor_oid, self.oid)
+        self.mcu.register_config_callback(self._build_config)
+    def _build_config(self):
+        for f in self.filters:
+            f.create_filter()
+        self.mcu.add_config_cmd(
+            "config_sensor_decimate oid=%d factor=%d filter_oid0=%d"
+            " filter_oid1=%d filter_oid2=%d"
+            % ((self.oid, self.factor) + tuple(f.get_oid()
+                                               for f in self.filters)))
+        self.mcu.add_config_cmd(self.sensor_cmd)
+    def note_start(self):
+        # Clear filter history from any previous session
+        for f in self.filters:
+            f.reset_filter()
@@ -244,6 +244,63 @@ class HalfStepRotaryEncoder(BaseRotaryEncoder):
          BaseRotaryEncoder.R_START | BaseRotaryEncoder.R_DIR_CCW),
     )
 
+# Rotary encoder decoded by the micro-controller (falls back to
+# decoding the pin changes on the host if the mcu doesn't support it)
+class MCU_encoder:
+    def __init__(self, printer, pin_params_list, encoder):
+        self.reactor = printer.get_reactor()
+        self.mcu = pin_params_list[0]['chip']
+        self.pin_params_list = pin_params_list
+        self.encoder = encoder
+        self.oid = None
+        self.ack_cmd = None
+        self.last_count = 0
+        self.mcu.register_config_callback(self.build_config)
+        self.fallback = MCU_buttons(printer, self.mcu)
+    def build_config(self):
+        if self.mcu.try_lookup_command(
+                "config_encoder oid=%c pin1=%u pull_up1=%c pin2=%u"
+                " pull_up2=%c invert=%c half_step=%c") is None:
+            self.fallback.setup_buttons(self.pin_params_list,
+                                        self.encoder.encoder_callback)
+            return
+        pp1, pp2 = self.pin_params_list
+        invert = pp1['invert'] | (pp2['invert'] << 1)
+        half_step = isinstance(self.encoder, HalfStepRotaryEncoder)
+        self.oid = self.mcu.create_oid()
+        self.mcu.add_config_cmd(
+            "config_encoder oid=%d pin1=%s pull_up1=%d pin2=%s pull_up2=%d"
+            " invert=%d half_step=%d" % (
+                self.oid, pp1['pin'], pp1['pullup'], pp2['pin'],
+                pp2['pullup'], invert, half_step))
+        cmd_queue = self.mcu.alloc_command_queue()
+        self.ack_cmd = self.mcu.lookup_command(
+            "encoder_ack oid=%c count=%hu", cq=cmd_queue)
+        clock = self.mcu.get_query_slot(self.oid)
+        rest_ticks = self.mcu.seconds_to_clock(QUERY_TIME)
+        self.mcu.add_config_cmd(
+            "encoder_query oid=%d clock=%d rest_ticks=%d retransmit_count=%d"
+            % (self.oid, clock, rest_ticks, RETRANSMIT_COUNT), is_init=True)
+        self.mcu.register_response(self.handle_encoder_state,
+                                   "encoder_state", self.oid)
+    def handle_encoder_state(self, params):
+        count = params['count']
+        self.ack_cmd.send([self.oid, count])
+        # Determine the number of detents since the last report
+        diff = (count - self.last_count) & 0xffff
+        diff -= (diff & 0x8000) << 1
+        if not diff:
+            return
+        self.last_count = count
+        callback = self.encoder.cw_callback
+        if diff < 0:
+            callback = self.encoder.ccw_callback
+        # Invoke callbacks in main thread
+        btime = params['#receive_time']
+        for i in range(abs(diff)):
+            self.reactor.register_async_callback(
+                (lambda et, c=callback, bt=btime: c(bt)))
+
 class DebounceButton:
     def __init__(self, config, button_action):
         self.printer = config.get_printer()
@@ -301,18 +358,21 @@ class PrinterButtons:
             if state:
                 callback(eventtime)
         self.register_adc_button(pin, min_val, max_val, pullup, helper)
-    def register_buttons(self, pins, callback):
-        # Parse pins
+    def _lookup_pins(self, pins):
         ppins = self.printer.lookup_object('pins')
-        mcu = mcu_name = None
+        mcu = None
         pin_params_list = []
         for pin in pins:
             pin_params = ppins.lookup_pin(pin, can_invert=True, can_pullup=True)
             if mcu is not None and pin_params['chip'] != mcu:
                 raise ppins.error("button pins must be on same mcu")
             mcu = pin_params['chip']
-            mcu_name = pin_params['chip_name']
             pin_params_list.append(pin_params)
+        return pin_params_list
+    def register_buttons(self, pins, callback):
+        pin_params_list = self._lookup_pins(pins)
+        mcu = pin_params_list[0]['chip']
+        mcu_name = pin_params_list[0]['chip_name']
         # Register pins and callback with the appropriate MCU
         mcu_buttons = self.mcu_buttons.get(mcu_name)
         if (mcu_buttons is None
@@ -329,7 +389,7 @@ class PrinterButtons:
         else:
             raise self.printer.config_error(
                 "%d steps per detent not supported" % steps_per_detent)
-        self.register_buttons([pin1, pin2], re.encoder_callback)
+        MCU_encoder(self.printer, self._lookup_pins([pin1, pin2]), re)
     def register_button_push(self, pin, callback):
         def helper(eventtime, state, callback=callback):
             if state:
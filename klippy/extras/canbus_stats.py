@@ -4,6 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging
+import chelper
 
 class PrinterCANBusStats:
     def __init__(self, config):
@@ -12,8 +13,20 @@ class PrinterCANBusStats:
         self.name = config.get_name().split()[-1]
         self.mcu = None
         self.get_canbus_status_cmd = None
+        self.get_can2040_stats_cmd = None
+        self.get_usb_canbus_stats_cmd = None
+        self.last_irq_ticks = self.last_query_time = None
+        self.last_bridge_counts = self.last_bridge_time = None
+        self.bridge_drop = 0
+        self.serialqueue = None
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.traffic = ffi_main.new('struct serialqueue_traffic *')
+        self.serialqueue_get_traffic = ffi_lib.serialqueue_get_traffic
+        self.last_traffic = self.last_traffic_time = None
         self.status = {'rx_error': None, 'tx_error': None, 'tx_retries': None,
-                       'bus_state': None}
+                       'bus_state': None, 'irq_load': None,
+                       'bridge_to_bus': None, 'bridge_to_host': None,
+                       'bridge_dropped': None, 'traffic': None}
         self.printer.register_event_handler("klippy:connect",
                                             self.handle_connect)
         self.printer.register_event_handler("klippy:shutdown",
@@ -30,6 +43,7 @@ class PrinterCANBusStats:
         if mcu_name != 'mcu':
             mcu_name = 'mcu ' + mcu_name
         self.mcu = self.printer.lookup_object(mcu_name)
+        self.serialqueue = self.mcu.get_serialqueue()
         # Lookup status query command
         if self.mcu.try_lookup_command("get_canbus_status") is None:
             return
@@ -37,6 +51,15 @@ class PrinterCANBusStats:
             "get_canbus_status",
             "canbus_status rx_error=%u tx_error=%u tx_retries=%u"
             " canbus_bus_state=%u")
+        if self.mcu.try_lookup_command("get_can2040_stats") is not None:
+            self.get_can2040_stats_cmd = self.mcu.lookup_query_command(
+                "get_can2040_stats",
+                "can2040_stats irq_ticks=%u irq_max=%u rx_overflow=%u")
+        if self.mcu.try_lookup_command("get_usb_canbus_stats") is not None:
+            self.get_usb_canbus_stats_cmd = self.mcu.lookup_query_command(
+                "get_usb_canbus_stats",
+                "usb_canbus_stats host_to_bus=%u host_discard=%u"
+                " bus_to_host=%u bus_drop=%u")
         # Register usb_canbus_state message handling (for usb to canbus bridge)
         self.mcu.register_response(self.handle_usb_canbus_state,
                                    "usb_canbus_state")
@@ -62,17 +85,88 @@ class PrinterCANBusStats:
         retries = prev_retries + ((params['tx_retries'] - prev_retries)
                                   & 0xffffffff)
         state = params['canbus_bus_state']
+        irq_load = self.query_irq_load(eventtime)
+        to_bus, to_host, dropped = self.query_bridge_stats(eventtime)
+        traffic = self.query_traffic(eventtime)
         self.status = {'rx_error': rx, 'tx_error': tx, 'tx_retries': retries,
-                       'bus_state': state}
+                       'bus_state': state, 'irq_load': irq_load,
+                       'bridge_to_bus': to_bus, 'bridge_to_host': to_host,
+                       'bridge_dropped': dropped, 'traffic': traffic}
         return self.reactor.monotonic() + 1.
+    def query_traffic(self, eventtime):
+        # Determine host side bandwidth and latency for this node
+        if self.serialqueue is None:
+            return None
+        t = self.traffic
+        self.serialqueue_get_traffic(self.serialqueue, t)
+        counts = (t.bytes_write, t.bytes_read, t.frames_write, t.frames_read,
+                  t.bytes_retransmit)
+        last_counts, last_time = self.last_traffic, self.last_traffic_time
+        self.last_traffic, self.last_traffic_time = counts, eventtime
+        if last_counts is None or eventtime <= last_time:
+            return None
+        duration = eventtime - last_time
+        rates = [round(((c - lc) & 0xffffffff) / duration, 1)
+                 for c, lc in zip(counts, last_counts)]
+        return {'tx_bytes': rates[0], 'rx_bytes': rates[1],
+                'tx_frames': rates[2], 'rx_frames': rates[3],
+                'retransmit_bytes': rates[4],
+                'tx_queue_max': t.ready_bytes_max,
+                'tx_inflight_max': t.need_ack_bytes_max,
+                'rtt': round(t.srtt, 6), 'rtt_var': round(t.rttvar, 6),
+                'rx_delay_max': round(t.receive_delay_max, 6)}
+    def query_bridge_stats(self, eventtime):
+        # Determine frame rates through a usb to canbus bridge
+        if self.get_usb_canbus_stats_cmd is None:
+            return None, None, None
+        params = self.get_usb_canbus_stats_cmd.send()
+        counts = (params['host_to_bus'], params['bus_to_host'],
+                  params['host_discard'], params['bus_drop'])
+        last_counts, last_time = self.last_bridge_counts, self.last_bridge_time
+        self.last_bridge_counts, self.last_bridge_time = counts, eventtime
+        if last_counts is None or eventtime <= last_time:
+            return None, None, self.bridge_drop
+        diffs = [(c - lc) & 0xffffffff for c, lc in zip(counts, last_counts)]
+        self.bridge_drop += diffs[2] + diffs[3]
+        duration = eventtime - last_time
+        return (round(diffs[0] / duration, 1), round(diffs[1] / duration, 1),
+                self.bridge_drop)
+    def query_irq_load(self, eventtime):
+        # Determine fraction of time spent in the software canbus irq
+        if self.get_can2040_stats_cmd is None:
+            return None
+        params = self.get_can2040_stats_cmd.send()
+        irq_ticks = params['irq_ticks']
+        last_ticks, last_time = self.last_irq_ticks, self.last_query_time
+        self.last_irq_ticks, self.last_query_time = irq_ticks, eventtime
+        if last_ticks is None or eventtime <= last_time:
+            return None
+        ticks = (irq_ticks - last_ticks) & 0xffffffff
+        clocks = self.mcu.seconds_to_clock(eventtime - last_time)
+        return round(float(ticks) / clocks, 3)
     def stats(self, eventtime):
         status = self.status
         if status['rx_error'] is None:
             return (False, '')
-        return (False, 'canstat_%s: bus_state=%s rx_error=%d'
-                ' tx_error=%d tx_retries=%d'
-                % (self.name, status['bus_state'], status['rx_error'],
-                   status['tx_error'], status['tx_retries']))
+        msg = ('canstat_%s: bus_state=%s rx_error=%d tx_error=%d'
+               ' tx_retries=%d'
+               % (self.name, status['bus_state'], status['rx_error'],
+                  status['tx_error'], status['tx_retries']))
+        if status['irq_load'] is not None:
+            msg += ' irq_load=%.3f' % (status['irq_load'],)
+        if status['bridge_to_bus'] is not None:
+            msg += (' bridge_to_bus=%.1f bridge_to_host=%.1f'
+                    ' bridge_dropped=%d'
+                    % (status['bridge_to_bus'], status['bridge_to_host'],
+                       status['bridge_dropped']))
+        traffic = status['traffic']
+        if traffic is not None:
+            msg += (' tx_frames=%.1f rx_frames=%.1f tx_bytes=%.1f'
+                    ' rx_bytes=%.1f tx_queue_max=%d rtt=%.6f'
+                    % (traffic['tx_frames'], traffic['rx_frames'],
+                       traffic['tx_bytes'], traffic['rx_bytes'],
+                       traffic['tx_queue_max'], traffic['rtt']))
+        return (False, msg)
     def get_status(self, eventtime):
         return self.status
 
@@ -52,6 +52,37 @@ class DisplayTemplate:
         context.update(params)
         return self.template.render(context)
 
+# Wrapper around the template "printer" object that records which
+# printer objects a display_data template references
+class DisplayStatusTracker:
+    def __init__(self, status):
+        self._status = status
+        self._deps = {}
+        self._cacheable = True
+    def reset(self):
+        self._deps = {}
+        self._cacheable = True
+    def note_uncacheable(self):
+        self._cacheable = False
+    def get_deps(self):
+        if not self._cacheable:
+            return None
+        return self._deps
+    def __getitem__(self, val):
+        res = self._status[val]
+        self._deps[str(val).strip()] = res
+        return res
+    def __contains__(self, val):
+        try:
+            self.__getitem__(val)
+        except KeyError as e:
+            return False
+        return True
+    def __iter__(self):
+        # Template depends on the full list of objects - don't cache it
+        self._cacheable = False
+        return iter(self._status)
+
 # Store [display_data my_group my_item] sections (one instance per group name)
 class DisplayGroup:
     def __init__(self, config, name, data_configs):
@@ -75,15 +106,40 @@ class DisplayGroup:
             if c.get('text'):
                 template = gcode_macro.load_template(c, 'text')
                 self.data_items.append((row, col, template))
+        # Last rendered text of each item (along with its dependencies)
+        self.render_cache = [None] * len(self.data_items)
+    def _lookup_cache(self, index, status):
+        cache = self.render_cache[index]
+        if cache is None:
+            return None
+        deps, text = cache
+        for name, prev_status in deps.items():
+            if status[name] != prev_status:
+                return None
+        return text
     def show(self, display, templates, eventtime):
         context = self.data_items[0][2].create_template_context(eventtime)
-        context['draw_progress_bar'] = display.draw_progress_bar
+        status = context['printer']
+        context['printer'] = tracker = DisplayStatusTracker(status)
+        def draw_progress_bar(row, col, width, value):
+            # Graphics are not part of the cached text
+            tracker.note_uncacheable()
+            return display.draw_progress_bar(row, col, width, value)
+        context['draw_progress_bar'] = draw_progress_bar
         def render(name, **kwargs):
             return templates[name].render(context, **kwargs)
         context['render'] = render
-        for row, col, template in self.data_items:
-            text = template.render(context)
-            display.draw_text(row, col, text.replace('\n', ''), eventtime)
+        for i, (row, col, template) in enumerate(self.data_items):
+            # Only render items whose referenced printer status changed
+            text = self._lookup_cache(i, status)
+            if text is None:
+                self.render_cache[i] = None
+                tracker.reset()
+                text = template.render(context).replace('\n', '')
+                deps = tracker.get_deps()
+                if deps is not None:
+                    self.render_cache[i] = (deps, text)
+            display.draw_text(row, col, text, eventtime)
         context.clear() # Remove circular references for better gc
 
 # Global cache of DisplayTemplate, DisplayGroup, and glyphs
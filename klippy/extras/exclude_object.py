@@ -74,10 +74,23 @@ class ExcludeObject:
 
     def _reset_state(self):
         self.objects = []
+        self.object_names = set()
         self.excluded_objects = []
+        self.excluded_names = set()
         self.current_object = None
+        self.current_excluded = False
         self.in_excluded_region = False
 
+    def _set_current_object(self, name):
+        self.current_object = name
+        self.current_excluded = name in self.excluded_names
+
+    def _set_excluded_objects(self, excluded_objects):
+        # The list is replaced (not modified) so status updates are noticed
+        self.excluded_objects = sorted(excluded_objects)
+        self.excluded_names = set(excluded_objects)
+        self.current_excluded = self.current_object in self.excluded_names
+
     def _reset_file(self):
         self._reset_state()
         self._unregister_transform()
@@ -137,6 +150,9 @@ class ExcludeObject:
             offset[3] += self.extruder_adj
             self.extruder_adj = 0
 
+        if not any(offset):
+            self.next_transform.move(newpos, speed)
+            return
         tx_pos = newpos[:]
         for i in range(len(newpos)):
             tx_pos[i] = newpos[i] - offset[i]
@@ -168,8 +184,7 @@ class ExcludeObject:
 
     def _test_in_excluded_region(self):
         # Inside cancelled object
-        return self.current_object in self.excluded_objects \
-            and self.initial_extrusion_moves == 0
+        return self.current_excluded and self.initial_extrusion_moves == 0
 
     def get_status(self, eventtime=None):
         status = {
@@ -180,8 +195,12 @@ class ExcludeObject:
         return status
 
     def move(self, newpos, speed):
-        move_in_excluded_region = self._test_in_excluded_region()
         self.last_speed = speed
+        if not self.current_excluded and not self.in_excluded_region:
+            # Fast path - not in (or leaving) an excluded object
+            self._normal_move(newpos, speed)
+            return
+        move_in_excluded_region = self._test_in_excluded_region()
 
         if move_in_excluded_region:
             if self.in_excluded_region:
@@ -198,9 +217,9 @@ class ExcludeObject:
                                     " as labeled"
     def cmd_EXCLUDE_OBJECT_START(self, gcmd):
         name = gcmd.get('NAME').upper()
-        if not any(obj["name"] == name for obj in self.objects):
+        if name not in self.object_names:
             self._add_object_definition({"name": name})
-        self.current_object = name
+        self._set_current_object(name)
         self.was_excluded_at_start = self._test_in_excluded_region()
 
     cmd_EXCLUDE_OBJECT_END_help = "Marks the end the current object"
@@ -215,7 +234,7 @@ class ExcludeObject:
                               " current object NAME=%s" %
                               (name.upper(), self.current_object))
 
-        self.current_object = None
+        self._set_current_object(None)
 
     cmd_EXCLUDE_OBJECT_help = "Cancel moves inside a specified objects"
     def cmd_EXCLUDE_OBJECT(self, gcmd):
@@ -228,10 +247,10 @@ class ExcludeObject:
                 self._unexclude_object(name)
 
             else:
-                self.excluded_objects = []
+                self._set_excluded_objects([])
 
         elif name:
-            if name.upper() not in self.excluded_objects:
+            if name.upper() not in self.excluded_names:
                 self._exclude_object(name.upper())
 
         elif current:
@@ -273,21 +292,28 @@ class ExcludeObject:
             self._list_objects(gcmd)
 
     def _add_object_definition(self, definition):
-        self.objects = sorted(self.objects + [definition],
-                              key=lambda o: o["name"])
+        name = definition["name"]
+        objects = list(self.objects)
+        # Objects are normally defined in order, so search from the end
+        pos = len(objects)
+        while pos and objects[pos - 1]["name"] > name:
+            pos -= 1
+        objects.insert(pos, definition)
+        self.objects = objects
+        self.object_names.add(name)
 
     def _exclude_object(self, name):
         self._register_transform()
         self.gcode.respond_info('Excluding object {}'.format(name.upper()))
-        if name not in self.excluded_objects:
-            self.excluded_objects = sorted(self.excluded_objects + [name])
+        if name not in self.excluded_names:
+            self._set_excluded_objects(self.excluded_objects + [name])
 
     def _unexclude_object(self, name):
         self.gcode.respond_info('Unexcluding object {}'.format(name.upper()))
-        if name in self.excluded_objects:
+        if name in self.excluded_names:
             excluded_objects = list(self.excluded_objects)
             excluded_objects.remove(name)
-            self.excluded_objects = sorted(excluded_objects)
+            self._set_excluded_objects(excluded_objects)
 
     def _list_objects(self, gcmd):
         if gcmd.get('JSON', None) is not None:
@@ -5,6 +5,9 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 from . import pulse_counter, output_pin
 
+# Maximum time between tachometer reports when using a report threshold
+TACH_MAX_REPORT_TIME = 5.
+
 class Fan:
     def __init__(self, config, default_shutdown_speed=0.):
         self.printer = config.get_printer()
@@ -93,6 +96,11 @@ class FanTachometer:
             sample_time = 1.
             self._freq_counter = pulse_counter.FrequencyCounter(
                 printer, pin, sample_time, poll_time)
+            rpm_threshold = config.getfloat('tachometer_report_threshold',
+                                            0., minval=0.)
+            if rpm_threshold:
+                self._freq_counter.setup_report_threshold(
+                    rpm_threshold * self.ppr / 30., TACH_MAX_REPORT_TIME)
 
     def get_status(self, eventtime):
         if self._freq_counter is not None:
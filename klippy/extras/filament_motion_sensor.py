@@ -4,7 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging
-from . import filament_switch_sensor
+from . import filament_switch_sensor, pulse_counter
 
 CHECK_RUNOUT_TIMEOUT = .250
 
@@ -17,8 +17,17 @@ class EncoderSensor:
         self.detection_length = config.getfloat(
                 'detection_length', 7., above=0.)
         # Configure pins
-        buttons = self.printer.load_object(config, 'buttons')
-        buttons.register_buttons([switch_pin], self.encoder_event)
+        self.counter = None
+        if config.getboolean('use_pulse_counter', False):
+            # Count encoder pulses in the mcu and report them periodically
+            poll_time = config.getfloat('pulse_poll_interval', .0015,
+                                        above=0.)
+            self.counter = pulse_counter.MCU_counter(
+                self.printer, switch_pin, CHECK_RUNOUT_TIMEOUT, poll_time)
+            self.counter.setup_callback(self._counter_callback)
+        else:
+            buttons = self.printer.load_object(config, 'buttons')
+            buttons.register_buttons([switch_pin], self.encoder_event)
         # Get printer objects
         self.reactor = self.printer.get_reactor()
         self.runout_helper = filament_switch_sensor.RunoutHelper(config)
@@ -27,6 +36,8 @@ class EncoderSensor:
         self.estimated_print_time = None
         # Initialise internal state
         self.filament_runout_pos = None
+        self.last_count = None
+        self.is_printing = False
         # Register commands and event handlers
         self.printer.register_event_handler('klippy:ready',
                 self._handle_ready)
@@ -50,9 +61,14 @@ class EncoderSensor:
         self._extruder_pos_update_timer = self.reactor.register_timer(
                 self._extruder_pos_update_event)
     def _handle_printing(self, print_time):
+        self.is_printing = True
+        if self.counter is not None:
+            # Runout is checked on each counter report
+            return
         self.reactor.update_timer(self._extruder_pos_update_timer,
                 self.reactor.NOW)
     def _handle_not_printing(self, print_time):
+        self.is_printing = False
         self.reactor.update_timer(self._extruder_pos_update_timer,
                 self.reactor.NEVER)
     def _get_extruder_pos(self, eventtime=None):
@@ -72,6 +88,29 @@ class EncoderSensor:
             # Check for filament insertion
             # Filament is always assumed to be present on an encoder event
             self.runout_helper.note_filament_present(eventtime, True)
+    def _counter_callback(self, time, count, count_time):
+        # Called from the mcu response thread
+        self.reactor.register_async_callback(
+            (lambda e: self._counter_event(e, time, count, count_time)))
+    def _counter_event(self, eventtime, time, count, count_time):
+        if self.extruder is None:
+            return
+        last_count = self.last_count
+        self.last_count = count
+        if last_count is None:
+            return
+        if count != last_count:
+            # Filament moved - the runout position is relative to the
+            # extruder position at the time of the last encoder pulse
+            self.filament_runout_pos = (
+                    self.extruder.find_past_position(count_time) +
+                    self.detection_length)
+            self.runout_helper.note_filament_present(eventtime, True)
+        elif self.is_printing:
+            # Check for filament runout at the time of the report
+            extruder_pos = self.extruder.find_past_position(time)
+            self.runout_helper.note_filament_present(eventtime,
+                    extruder_pos < self.filament_runout_pos)
 
 def load_config_prefix(config):
     return EncoderSensor(config)
@@ -43,6 +43,8 @@ class ForceMove:
         gcode = self.printer.lookup_object('gcode')
         gcode.register_command('STEPPER_BUZZ', self.cmd_STEPPER_BUZZ,
                                desc=self.cmd_STEPPER_BUZZ_help)
+        gcode.register_command('STEPPER_TIMING', self.cmd_STEPPER_TIMING,
+                               desc=self.cmd_STEPPER_TIMING_help)
         if config.getboolean("enable_force_move", False):
             gcode.register_command('FORCE_MOVE', self.cmd_FORCE_MOVE,
                                    desc=self.cmd_FORCE_MOVE_help)
@@ -98,6 +100,29 @@ class ForceMove:
         if name not in self.steppers:
             raise gcmd.error("Unknown stepper %s" % (name,))
         return self.steppers[name]
+    cmd_STEPPER_TIMING_help = "Report step timing statistics from the mcu"
+    def cmd_STEPPER_TIMING(self, gcmd):
+        reset = gcmd.get_int('RESET', 0, minval=0, maxval=1)
+        if gcmd.get('STEPPER', None) is None:
+            steppers = [s for n, s in sorted(self.steppers.items())]
+        else:
+            steppers = [self._lookup_stepper(gcmd)]
+        labels = ["<1us", "<4us", "<16us", "<64us", "<256us", "<1ms",
+                  "<4ms", ">=4ms"]
+        msgs = []
+        for stepper in steppers:
+            timing = stepper.get_step_timing(reset)
+            if timing is None:
+                continue
+            hist = " ".join(["%s:%d" % (l, c)
+                             for l, c in zip(labels, timing['hist'])])
+            msgs.append("%s: edges=%d max_late=%.1fus %s" % (
+                stepper.get_name(), timing['count'],
+                timing['max_late'] * 1000000., hist))
+        if not msgs:
+            raise gcmd.error("Step timing statistics not available"
+                             " (requires mcu CONFIG_WANT_STEPPER_TIMING_STATS)")
+        gcmd.respond_info("\n".join(msgs))
     cmd_STEPPER_BUZZ_help = "Oscillate a given stepper to help id it"
     def cmd_STEPPER_BUZZ(self, gcmd):
         stepper = self._lookup_stepper(gcmd)
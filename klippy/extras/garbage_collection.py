@@ -6,9 +6,17 @@
 import gc
 import logging
 
+# Effectively disable automatic generation 2 collections while printing
+PRINTING_THRESHOLD2 = 1<<30
+COLLECT_INTERVAL = 1.
+SLOW_COLLECT_TIME = .005
+
 class GarbageCollection:
     def __init__(self, config):
         self.printer = config.get_printer()
+        self.reactor = self.printer.get_reactor()
+        self.saved_threshold = None
+        self.collect_timer = None
         # feature check ... freeze/unfreeze is only available in python 3.7+
         can_freeze = hasattr(gc, 'freeze') and hasattr(gc, 'unfreeze')
         if can_freeze:
@@ -16,6 +24,14 @@ class GarbageCollection:
                                                 self._handle_ready)
             self.printer.register_event_handler("klippy:disconnect",
                                                 self._handle_disconnect)
+        self.printer.register_event_handler("idle_timeout:printing",
+                                            self._handle_printing)
+        self.printer.register_event_handler("idle_timeout:ready",
+                                            self._handle_not_printing)
+        self.printer.register_event_handler("idle_timeout:idle",
+                                            self._handle_not_printing)
+        self.printer.register_event_handler("klippy:shutdown",
+                                            self._handle_not_printing)
 
     def _handle_ready(self):
         logging.debug("Running full garbage collection and freezing")
@@ -27,5 +43,38 @@ class GarbageCollection:
         logging.debug("Unfreezing garbage collection")
         gc.unfreeze()
 
+    def _handle_printing(self, print_time):
+        if self.saved_threshold is not None:
+            return
+        # Only collect the young generations (from a timer) while printing
+        self.saved_threshold = gc.get_threshold()
+        t0, t1, t2 = self.saved_threshold
+        gc.set_threshold(t0, t1, PRINTING_THRESHOLD2)
+        self.collect_timer = self.reactor.register_timer(
+            self._collect_event, self.reactor.monotonic() + COLLECT_INTERVAL)
+
+    def _handle_not_printing(self, print_time=None):
+        if self.saved_threshold is None:
+            return
+        self.reactor.unregister_timer(self.collect_timer)
+        self.collect_timer = None
+        gc.set_threshold(*self.saved_threshold)
+        self.saved_threshold = None
+        self._collect(2)
+
+    def _collect(self, generation):
+        start = self.reactor.monotonic()
+        found = gc.collect(generation)
+        duration = self.reactor.monotonic() - start
+        if duration > SLOW_COLLECT_TIME or generation == 2:
+            logging.debug("Garbage collection gen%d: %d objects in %.6fs",
+                          generation, found, duration)
+
+    def _collect_event(self, eventtime):
+        # Collect pending objects before an automatic collection is needed
+        if gc.get_count()[0]:
+            self._collect(1)
+        return self.reactor.monotonic() + COLLECT_INTERVAL
+
 def load_config(config):
     return GarbageCollection(config)
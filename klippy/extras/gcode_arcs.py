@@ -7,8 +7,9 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math
+import chelper
 
-# Coordinates created by this are converted into G1 commands.
+# Coordinates created by this are sent as a path of G1 moves.
 #
 # supports XY, XZ & YZ planes with remaining axis as helical
 
@@ -29,6 +30,9 @@ class ArcSupport:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.mm_per_arc_segment = config.getfloat('resolution', 1., above=0.0)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.ffi_main = ffi_main
+        self.arc_fill_segments = ffi_lib.arc_fill_segments
 
         self.gcode_move = self.printer.load_object(config, 'gcode_move')
         self.gcode = self.printer.lookup_object('gcode')
@@ -62,7 +66,6 @@ class ArcSupport:
         if not gcodestatus['absolute_coordinates']:
             raise gcmd.error("G2/G3 does not support relative move mode")
         currentPos = gcodestatus['gcode_position']
-        absolut_extrude = gcodestatus['absolute_extrude']
 
         # Parse parameters
         asTarget = [gcmd.get_float("X", currentPos[0]),
@@ -91,7 +94,7 @@ class ArcSupport:
 
         # Build linear coordinates to move
         self.planArc(currentPos, asTarget, asPlanar, clockwise,
-                     gcmd, absolut_extrude, *axes)
+                     gcmd, *axes)
 
     # function planArc() originates from marlin plan_arc()
     # https://github.com/MarlinFirmware/Marlin
@@ -102,8 +105,7 @@ class ArcSupport:
     #
     # alpha and beta axes are the current plane, helical axis is linear travel
     def planArc(self, currentPos, targetPos, offset, clockwise,
-                gcmd, absolut_extrude,
-                alpha_axis, beta_axis, helical_axis):
+                gcmd, alpha_axis, beta_axis, helical_axis):
         # todo: sometimes produces full circles
 
         # Radius vector from center to current location
@@ -139,45 +141,28 @@ class ArcSupport:
             mm_of_travel = math.fabs(flat_mm)
         segments = max(1., math.floor(mm_of_travel / self.mm_per_arc_segment))
 
-        # Generate coordinates
+        # Generate coordinates (the final segment ends at the target)
         theta_per_segment = angular_travel / segments
         linear_per_segment = linear_travel / segments
-
+        count = int(segments)
+        coords = self.ffi_main.new("double[]", 3 * count)
+        res = self.arc_fill_segments(
+            coords, count, alpha_axis, beta_axis, helical_axis,
+            center_P, center_Q, -offset[0], -offset[1],
+            currentPos[helical_axis], theta_per_segment, linear_per_segment)
+        coords = list(coords)
+        path = list(zip(coords[0:3*res:3], coords[1:3*res:3],
+                        coords[2:3*res:3]))
+
+        g1_params = {'X': targetPos[0], 'Y': targetPos[1],
+                     'Z': targetPos[2]}
         asE = gcmd.get_float("E", None)
-        asF = gcmd.get_float("F", None)
-
-        e_per_move = e_base = 0.
         if asE is not None:
-            if absolut_extrude:
-                e_base = currentPos[3]
-            e_per_move = (asE - e_base) / segments
-
-        for i in range(1, int(segments) + 1):
-            dist_Helical = i * linear_per_segment
-            c_theta = i * theta_per_segment
-            cos_Ti = math.cos(c_theta)
-            sin_Ti = math.sin(c_theta)
-            r_P = -offset[0] * cos_Ti + offset[1] * sin_Ti
-            r_Q = -offset[0] * sin_Ti - offset[1] * cos_Ti
-
-            c = [None, None, None]
-            c[alpha_axis] = center_P + r_P
-            c[beta_axis] = center_Q + r_Q
-            c[helical_axis] = currentPos[helical_axis] + dist_Helical
-
-
-            if i == segments:
-                c = targetPos
-            # Convert coords into G1 commands
-            g1_params = {'X': c[0], 'Y': c[1], 'Z': c[2]}
-            if e_per_move:
-                g1_params['E'] = e_base + e_per_move
-                if absolut_extrude:
-                    e_base += e_per_move
-            if asF is not None:
-                g1_params['F'] = asF
-            g1_gcmd = self.gcode.create_gcode_command("G1", "G1", g1_params)
-            self.gcode_move.cmd_G1(g1_gcmd)
+            g1_params['E'] = asE
+        asF = gcmd.get_float("F", None, above=0.)
+        if asF is not None:
+            g1_params['F'] = asF
+        self.gcode_move.process_path(path, g1_params)
 
 def load_config(config):
     return ArcSupport(config)
@@ -3,7 +3,7 @@
 # Copyright (C) 2018-2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import traceback, logging, ast, copy, json
+import os, traceback, logging, ast, copy, json, hashlib
 import jinja2
 
 
@@ -39,6 +39,25 @@ class GetStatusWrapper:
             if self.__contains__(name):
                 yield name
 
+# Jinja2 environment that stores compiled templates in a disk cache
+class CachedEnvironment(jinja2.Environment):
+    def __init__(self, cache_path):
+        if not os.path.isdir(cache_path):
+            os.makedirs(cache_path)
+        jinja2.Environment.__init__(
+            self, '{%', '%}', '{', '}', cache_size=0,
+            loader=jinja2.FunctionLoader(self._get_source),
+            bytecode_cache=jinja2.FileSystemBytecodeCache(cache_path))
+        self.sources = {}
+    def _get_source(self, name):
+        return self.sources.get(name)
+    def from_string(self, source, globals=None, template_class=None):
+        # Load via the loader (keyed by the template source) so that
+        # the bytecode cache is used
+        name = hashlib.sha1(source.encode('utf-8')).hexdigest()
+        self.sources[name] = source
+        return self.get_template(name, globals=globals)
+
 # Wrapper around a Jinja2 template
 class TemplateWrapper:
     def __init__(self, printer, env, name, script):
@@ -77,7 +96,16 @@ class TemplateWrapper:
 class PrinterGCodeMacro:
     def __init__(self, config):
         self.printer = config.get_printer()
-        self.env = jinja2.Environment('{%', '%}', '{', '}')
+        cache_path = config.get('template_cache', None)
+        if cache_path is None:
+            self.env = jinja2.Environment('{%', '%}', '{', '}')
+        else:
+            cache_path = os.path.expanduser(cache_path)
+            try:
+                self.env = CachedEnvironment(cache_path)
+            except OSError as e:
+                raise config.error("Unable to create template cache '%s': %s"
+                                   % (cache_path, str(e)))
     def load_template(self, config, option, default=None):
         name = "%s:%s" % (config.get_name(), option)
         if default is None:
@@ -146,6 +174,9 @@ class GCodeMacro:
                                         name, self.cmd_SET_GCODE_VARIABLE,
                                         desc=self.cmd_SET_GCODE_VARIABLE_help)
         self.in_script = False
+        self.full_name = config.get_name()
+        self.query_status = printer.lookup_object('query_status')
+        self.query_status.register_tracked_object(self.full_name)
         self.variables = {}
         prefix = 'variable_'
         for option in config.get_prefix_options(prefix):
@@ -183,6 +214,7 @@ class GCodeMacro:
         v = dict(self.variables)
         v[variable] = literal
         self.variables = v
+        self.query_status.note_status_change(self.full_name, [variable])
     def cmd(self, gcmd):
         if self.in_script:
             raise gcmd.error("Macro %s called recursively" % (self.alias,))
@@ -35,6 +35,8 @@ class GCodeMove:
             desc = getattr(self, 'cmd_' + cmd + '_help', None)
             gcode.register_command(cmd, func, False, desc)
         gcode.register_command('G0', self.cmd_G1)
+        gcode.register_fast_handler('G1', self._fast_G1)
+        gcode.register_fast_handler('G0', self._fast_G1)
         gcode.register_command('M114', self.cmd_M114, True)
         gcode.register_command('GET_POSITION', self.cmd_GET_POSITION, True,
                                desc=self.cmd_GET_POSITION_help)
@@ -58,6 +60,7 @@ class GCodeMove:
             toolhead = self.printer.lookup_object('toolhead')
             self.move_with_transform = toolhead.move
             self.position_with_transform = toolhead.get_position
+        self.update_move_transform()
         self.reset_last_position()
     def _handle_shutdown(self):
         if not self.is_printer_ready:
@@ -88,7 +91,38 @@ class GCodeMove:
         self.move_transform = transform
         self.move_with_transform = transform.move
         self.position_with_transform = transform.get_position
+        self.update_move_transform()
         return old_transform
+    def update_move_transform(self):
+        # Transforms that only alter the requested position may provide
+        # get_fused_transform() returning (calc_position_func, next) -
+        # combine a chain of them into a single call (a calc func of
+        # None indicates the transform currently has no effect).
+        # Transforms must call this if their calc func changes.
+        transform = self.move_transform
+        if transform is None:
+            return
+        calc_funcs = []
+        while hasattr(transform, 'get_fused_transform'):
+            calc_func, next_transform = transform.get_fused_transform()
+            if next_transform is None:
+                break
+            if calc_func is not None:
+                calc_funcs.append(calc_func)
+            transform = next_transform
+        move = transform.move
+        if not calc_funcs:
+            self.move_with_transform = move
+        elif len(calc_funcs) == 1:
+            calc_func = calc_funcs[0]
+            self.move_with_transform = (
+                lambda newpos, speed: move(calc_func(newpos), speed))
+        else:
+            def fused_move(newpos, speed):
+                for calc_func in calc_funcs:
+                    newpos = calc_func(newpos)
+                move(newpos, speed)
+            self.move_with_transform = fused_move
     def _get_gcode_position(self):
         p = [lp - bp for lp, bp in zip(self.last_position, self.base_position)]
         p[3] /= self.extrude_factor
@@ -127,34 +161,69 @@ class GCodeMove:
         self.base_position[4:] = [0.] * (len(extra_axes) - 4)
         self.reset_last_position()
     # G-Code movement commands
+    def _update_position(self, params):
+        # Apply a dictionary of already parsed G1 parameters
+        axis_map = self.axis_map
+        last_position = self.last_position
+        for axis, v in params.items():
+            pos = axis_map.get(axis)
+            if pos is None:
+                continue
+            absolute_coord = self.absolute_coord
+            if axis == 'E':
+                v *= self.extrude_factor
+                if not self.absolute_extrude:
+                    absolute_coord = False
+            if not absolute_coord:
+                # value relative to position of last move
+                last_position[pos] += v
+            else:
+                # value relative to base coordinate position
+                last_position[pos] = v + self.base_position[pos]
+        gcode_speed = params.get('F')
+        if gcode_speed is not None:
+            self.speed = gcode_speed * self.speed_factor
+    def process_move(self, params):
+        # Move using a dictionary of already parsed G1 parameters
+        self._update_position(params)
+        self.move_with_transform(self.last_position, self.speed)
+    def process_path(self, path, params):
+        # Move through a list of intermediate xyz coordinates (in
+        # absolute g-code units) and then to the position in 'params'.
+        # Any extrusion is spread evenly over the path length.
+        last_position = self.last_position
+        start_e = last_position[3]
+        self._update_position(params)
+        base_x, base_y, base_z = self.base_position[:3]
+        extra = last_position[4:]
+        e_per_move = (last_position[3] - start_e) / (len(path) + 1)
+        move_with_transform = self.move_with_transform
+        speed = self.speed
+        for i, (x, y, z) in enumerate(path):
+            pos = [x + base_x, y + base_y, z + base_z,
+                   start_e + (i + 1) * e_per_move] + extra
+            move_with_transform(pos, speed)
+        move_with_transform(last_position, speed)
+    def _fast_G1(self, params):
+        if params.get('F', 1.) <= 0.:
+            # Report the error from cmd_G1()
+            return False
+        self.process_move(params)
     def cmd_G1(self, gcmd):
         # Move
         params = gcmd.get_command_parameters()
         try:
-            for axis, pos in self.axis_map.items():
-                if axis in params:
-                    v = float(params[axis])
-                    absolute_coord = self.absolute_coord
-                    if axis == 'E':
-                        v *= self.extrude_factor
-                        if not self.absolute_extrude:
-                            absolute_coord = False
-                    if not absolute_coord:
-                        # value relative to position of last move
-                        self.last_position[pos] += v
-                    else:
-                        # value relative to base coordinate position
-                        self.last_position[pos] = v + self.base_position[pos]
+            mparams = { axis: float(params[axis])
+                        for axis in self.axis_map if axis in params }
             if 'F' in params:
-                gcode_speed = float(params['F'])
-                if gcode_speed <= 0.:
-                    raise gcmd.error("Invalid speed in '%s'"
-                                     % (gcmd.get_commandline(),))
-                self.speed = gcode_speed * self.speed_factor
+                mparams['F'] = float(params['F'])
         except ValueError as e:
             raise gcmd.error("Unable to parse move '%s'"
                              % (gcmd.get_commandline(),))
-        self.move_with_transform(self.last_position, self.speed)
+        if mparams.get('F', 1.) <= 0.:
+            raise gcmd.error("Invalid speed in '%s'"
+                             % (gcmd.get_commandline(),))
+        self.process_move(mparams)
     # G-Code coordinate manipulation
     def cmd_G20(self, gcmd):
         # Set units to inches
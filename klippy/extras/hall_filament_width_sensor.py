@@ -37,6 +37,10 @@ class HallFilamentWidthSensor:
         # measurement isn't in place
         self.use_current_dia_while_delay = config.getboolean(
             'use_current_dia_while_delay', False)
+        # Apply the flow correction during extruder step generation
+        self.kinematic_compensation = config.getboolean(
+            'kinematic_compensation', False)
+        self.next_flow_position = None
         # filament array [position, filamentWidth]
         self.filament_array = []
         self.lastFilamentWidthReading = 0
@@ -118,7 +122,65 @@ class HallFilamentWidthSensor:
             self.firstExtruderUpdatePosition = (self.measurement_delay
                                                 + last_epos)
 
+    def _get_extruder_stepper(self):
+        extruder = self.toolhead.get_extruder()
+        return getattr(extruder, 'extruder_stepper', None)
+
+    def _calc_flow_factor(self, diameter):
+        if self.min_diameter <= diameter <= self.max_diameter:
+            return self.nominal_filament_dia**2 / diameter**2
+        return 1.
+
+    def _reset_flow_factor(self):
+        if not self.kinematic_compensation:
+            self.gcode.run_script_from_command("M221 S100")
+            return
+        self.next_flow_position = None
+        extruder_stepper = self._get_extruder_stepper()
+        if extruder_stepper is not None:
+            last_epos = self.toolhead.get_position()[3]
+            extruder_stepper.set_flow_factor(last_epos, 1.)
+
+    def update_flow_factor(self, extruder_stepper, last_epos):
+        # Does filament exists
+        if self.diameter <= 0.5:
+            if self.next_flow_position is not None:
+                self.next_flow_position = None
+                extruder_stepper.set_flow_factor(last_epos, 1.)
+            return
+        factor = self._calc_flow_factor(self.diameter)
+        next_pos = last_epos + self.measurement_delay
+        if self.next_flow_position is None:
+            # Filament up to the sensor has not been measured
+            if self.use_current_dia_while_delay:
+                extruder_stepper.set_flow_factor(last_epos, factor)
+            self.next_flow_position = next_pos
+        if next_pos >= self.next_flow_position:
+            extruder_stepper.set_flow_factor(next_pos, factor)
+            self.next_flow_position = next_pos + self.MEASUREMENT_INTERVAL_MM
+            if self.is_log:
+                self.gcode.respond_info("Filament width:%.3f" %
+                                        ( self.diameter ))
+
+    def flow_factor_update_event(self, eventtime):
+        # Queue flow corrections keyed by the extruder position at which
+        # the measured filament reaches the nozzle
+        last_epos = self.toolhead.get_position()[3]
+        # Check runout
+        self.runout_helper.note_filament_present(eventtime,
+            self.runout_dia_min <= self.diameter <= self.runout_dia_max)
+        extruder_stepper = self._get_extruder_stepper()
+        if extruder_stepper is not None:
+            self.update_flow_factor(extruder_stepper, last_epos)
+
+        if self.is_active:
+            return eventtime + 1
+        else:
+            return self.reactor.NEVER
+
     def extrude_factor_update_event(self, eventtime):
+        if self.kinematic_compensation:
+            return self.flow_factor_update_event(eventtime)
         # Update extrude factor
         pos = self.toolhead.get_position()
         last_epos = pos[3]
@@ -172,7 +234,7 @@ class HallFilamentWidthSensor:
         self.filament_array = []
         gcmd.respond_info("Filament width measurements cleared!")
         # Set extrude multiplier to 100%
-        self.gcode.run_script_from_command("M221 S100")
+        self._reset_flow_factor()
 
     def cmd_M405(self, gcmd):
         response = "Filament width sensor Turned On"
@@ -197,7 +259,7 @@ class HallFilamentWidthSensor:
             # Clear filament array
             self.filament_array = []
             # Set extrude multiplier to 100%
-            self.gcode.run_script_from_command("M221 S100")
+            self._reset_flow_factor()
         gcmd.respond_info(response)
 
     def cmd_Get_Raw_Values(self, gcmd):
@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2025  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, logging, threading
+import os, logging, threading, math
 
 
 ######################################################################
@@ -46,16 +46,23 @@ class Heater:
         self.next_pwm_time = 0.
         self.last_pwm_value = 0.
         # Setup control algorithm sub-class
-        algos = {'watermark': ControlBangBang, 'pid': ControlPID}
+        algos = {'watermark': ControlBangBang, 'pid': ControlPID,
+                 'mcu_pid': ControlMCUPID}
         algo = config.getchoice('control', algos)
         self.control = algo(self, config)
         # Setup output heater pin
         heater_pin = config.get('heater_pin')
-        ppins = self.printer.lookup_object('pins')
-        self.mcu_pwm = ppins.setup_pin('pwm', heater_pin)
         pwm_cycle_time = config.getfloat('pwm_cycle_time', 0.100, above=0.,
                                          maxval=self.pwm_delay)
-        self.mcu_pwm.setup_cycle_time(pwm_cycle_time)
+        self.mcu_pid = None
+        if algo is ControlMCUPID:
+            self.mcu_pwm = self.mcu_pid = MCUHeaterPID(
+                config, sensor, heater_pin, pwm_cycle_time)
+            self.control.setup_mcu_pid(self.mcu_pid)
+        else:
+            ppins = self.printer.lookup_object('pins')
+            self.mcu_pwm = ppins.setup_pin('pwm', heater_pin)
+            self.mcu_pwm.setup_cycle_time(pwm_cycle_time)
         self.mcu_pwm.setup_max_duration(MAX_HEAT_TIME)
         # Load additional modules
         self.printer.load_object(config, "verify_heater %s" % (short_name,))
@@ -80,6 +87,12 @@ class Heater:
         #logging.debug("%s: pwm=%.3f@%.3f (from %.3f@%.3f [%.3f])",
         #              self.name, value, pwm_time,
         #              self.last_temp, self.last_temp_time, self.target_temp)
+    def set_pid_target(self, read_time, target_temp):
+        # Update the target of a heater controlled by the mcu
+        if read_time > self.verify_mainthread_time:
+            target_temp = 0.
+        self.mcu_pid.set_target(read_time, target_temp)
+        self.last_pwm_value = self.mcu_pid.get_last_pwm()
     def temperature_callback(self, read_time, temp):
         with self.lock:
             time_diff = read_time - self.last_temp_time
@@ -124,6 +137,11 @@ class Heater:
             old_control = self.control
             self.control = control
             self.target_temp = 0.
+            if self.mcu_pid is not None:
+                # Return mcu to direct pwm control (disabled)
+                self.mcu_pid.set_pwm(0., 0.)
+                self.next_pwm_time = 0.
+                self.last_pwm_value = 0.
         return old_control
     def alter_target(self, target_temp):
         if target_temp:
@@ -230,6 +248,160 @@ class ControlPID:
                 or abs(self.prev_temp_deriv) > PID_SETTLE_SLOPE)
 
 
+######################################################################
+# PID control algo run on the micro-controller
+######################################################################
+
+MCU_PID_TABLE_SIZE = 32
+MCU_PID_TEMP_SCALE = 256.
+MCU_PID_POWER_SCALE = 65536.
+MCU_PID_POWER_MAX = 0xffff
+
+class ControlMCUPID:
+    def __init__(self, heater, config):
+        self.heater = heater
+        self.heater_max_power = heater.get_max_power()
+        self.Kp = config.getfloat('pid_Kp') / PID_PARAM_BASE
+        self.Ki = config.getfloat('pid_Ki') / PID_PARAM_BASE
+        self.Kd = config.getfloat('pid_Kd') / PID_PARAM_BASE
+        self.min_deriv_time = heater.get_smooth_time()
+        self.prev_temp = AMBIENT_TEMP
+        self.prev_temp_time = 0.
+        self.prev_temp_deriv = 0.
+    def setup_mcu_pid(self, mcu_pid):
+        mcu_pid.setup_pid(self.Kp, self.Ki, self.Kd, self.heater_max_power,
+                          self.min_deriv_time, self.heater.get_pwm_delay())
+    def temperature_update(self, read_time, temp, target_temp):
+        # Track temperature slope (for check_busy)
+        time_diff = read_time - self.prev_temp_time
+        temp_diff = temp - self.prev_temp
+        if time_diff >= self.min_deriv_time:
+            temp_deriv = temp_diff / time_diff
+        else:
+            temp_deriv = (self.prev_temp_deriv * (self.min_deriv_time-time_diff)
+                          + temp_diff) / self.min_deriv_time
+        self.prev_temp = temp
+        self.prev_temp_time = read_time
+        self.prev_temp_deriv = temp_deriv
+        # The PID loop itself runs on the mcu
+        self.heater.set_pid_target(read_time, target_temp)
+    def check_busy(self, eventtime, smoothed_temp, target_temp):
+        temp_diff = target_temp - smoothed_temp
+        return (abs(temp_diff) > PID_SETTLE_DELTA
+                or abs(self.prev_temp_deriv) > PID_SETTLE_SLOPE)
+
+# Interface to the mcu "heater_pid" object
+class MCUHeaterPID:
+    def __init__(self, config, sensor, heater_pin, cycle_time):
+        self.printer = config.get_printer()
+        if not hasattr(sensor, 'get_mcu_adc'):
+            raise config.error("control mcu_pid requires an mcu adc based"
+                               " temperature sensor")
+        self.sensor = sensor
+        self.mcu_adc = sensor.get_mcu_adc()
+        self.mcu_adc.disable_scan()
+        ppins = self.printer.lookup_object('pins')
+        pin_params = ppins.lookup_pin(heater_pin, can_invert=True)
+        self.mcu = pin_params['chip']
+        if self.mcu is not self.mcu_adc.get_mcu():
+            raise config.error("control mcu_pid requires heater_pin and"
+                               " sensor_pin on the same mcu")
+        self.pin = pin_params['pin']
+        self.invert = pin_params['invert']
+        self.cycle_time = cycle_time
+        self.max_duration = 0.
+        self.min_temp = config.getfloat('min_temp')
+        self.max_temp = config.getfloat('max_temp')
+        self.pid_params = None
+        self.oid = self.set_target_cmd = self.set_pwm_cmd = None
+        self.last_target = None
+        self.next_refresh_time = 0.
+        self.last_pwm = 0.
+        self.mcu.register_config_callback(self._build_config)
+    def get_mcu(self):
+        return self.mcu
+    def setup_max_duration(self, max_duration):
+        self.max_duration = max_duration
+    def setup_pid(self, Kp, Ki, Kd, max_power, min_deriv_time, sample_time):
+        self.pid_params = (Kp, Ki, Kd, max_power, min_deriv_time, sample_time)
+    def _build_table(self):
+        # Piecewise linear approximation of the sensor (raw adc to temp)
+        table = {}
+        count = MCU_PID_TABLE_SIZE
+        temp_step = (self.max_temp - self.min_temp) / (count - 1.)
+        if temp_step * MCU_PID_TEMP_SCALE >= 0x8000:
+            raise self.printer.config_error(
+                "Temperature range too large for mcu_pid")
+        for i in range(count):
+            temp = self.min_temp + (self.max_temp-self.min_temp) * i/(count-1.)
+            raw = self.mcu_adc.calc_raw_value(self.sensor.calc_adc(temp))
+            raw = max(0, min(0xffff, int(raw + .5)))
+            table[raw] = int(temp * MCU_PID_TEMP_SCALE + .5)
+        if len(table) < 2:
+            raise self.printer.config_error(
+                "Unable to build mcu_pid temperature table")
+        return sorted(table.items())
+    def _build_config(self):
+        mcu = self.mcu
+        self.oid = mcu.create_oid()
+        table = self._build_table()
+        cycle_ticks = mcu.seconds_to_clock(self.cycle_time)
+        mdur_ticks = mcu.seconds_to_clock(self.max_duration)
+        mcu.add_config_cmd(
+            "config_heater_pid oid=%d adc_oid=%d pin=%s invert=%d"
+            " cycle_ticks=%d max_duration=%d table_size=%d"
+            % (self.oid, self.mcu_adc.get_oid(), self.pin, self.invert,
+               cycle_ticks, mdur_ticks, len(table)))
+        for i, (raw, temp) in enumerate(table):
+            mcu.add_config_cmd(
+                "heater_pid_set_table oid=%d index=%d adc=%d temp=%d"
+                % (self.oid, i, raw, temp))
+        # Convert PID gains to mcu fixed point units
+        Kp, Ki, Kd, max_power, min_deriv_time, sample_time = self.pid_params
+        integ_max = 0
+        if Ki:
+            integ_max = int(max_power / Ki / sample_time * MCU_PID_TEMP_SCALE)
+        if sample_time >= min_deriv_time:
+            deriv_keep, deriv_scale = 0., 1. / sample_time
+        else:
+            deriv_keep = (min_deriv_time - sample_time) / min_deriv_time
+            deriv_scale = 1. / min_deriv_time
+        mcu.add_config_cmd(
+            "heater_pid_set_gains oid=%d kp=%d ki=%d kd=%d integ_max=%d"
+            " deriv_keep=%d deriv_scale=%d max_power=%d"
+            % (self.oid, int(Kp * MCU_PID_POWER_SCALE + .5),
+               int(Ki * sample_time * MCU_PID_POWER_SCALE + .5),
+               int(Kd * MCU_PID_POWER_SCALE + .5), integ_max,
+               int(deriv_keep * 65536.), int(deriv_scale * 65536. + .5),
+               int(max_power * MCU_PID_POWER_MAX)))
+        cmd_queue = mcu.alloc_command_queue()
+        self.set_target_cmd = mcu.lookup_command(
+            "heater_pid_set_target oid=%c target=%i", cq=cmd_queue)
+        self.set_pwm_cmd = mcu.lookup_command(
+            "heater_pid_set_pwm oid=%c value=%hu", cq=cmd_queue)
+        mcu.register_response(self._handle_heater_pid_state,
+                              "heater_pid_state", self.oid)
+    def _handle_heater_pid_state(self, params):
+        self.last_pwm = params['pwm'] / float(MCU_PID_POWER_MAX)
+    def get_last_pwm(self):
+        return self.last_pwm
+    def set_target(self, read_time, target_temp):
+        if (target_temp == self.last_target
+            and read_time < self.next_refresh_time):
+            return
+        self.last_target = target_temp
+        self.next_refresh_time = read_time + 0.75 * MAX_HEAT_TIME
+        self.set_target_cmd.send([self.oid, int(math.floor(
+            target_temp * MCU_PID_TEMP_SCALE + .5))])
+    def set_pwm(self, print_time, value):
+        # Direct pwm control (eg, during PID_CALIBRATE)
+        self.last_target = None
+        if self.set_pwm_cmd is None:
+            return
+        value = max(0., min(1., value))
+        self.set_pwm_cmd.send([self.oid, int(value * MCU_PID_POWER_MAX + .5)])
+
+
 ######################################################################
 # Sensor and heater lookup
 ######################################################################
@@ -185,6 +185,13 @@ class Homing:
         return thcoord
     def set_homed_position(self, pos):
         self.toolhead.set_position(self._fill_coord(pos))
+    def _calc_speed_ratio(self, startpos, homepos):
+        # Rails on independent axes may be homed with a single diagonal
+        # move - scale the speed so that no axis exceeds its homing speed
+        axes_d = [abs(hp - sp) for hp, sp in zip(homepos[:3], startpos[:3])]
+        if len([d for d in axes_d if d]) <= 1:
+            return 1.
+        return math.sqrt(sum([d*d for d in axes_d])) / max(axes_d)
     def home_rails(self, rails, forcepos, movepos):
         # Notify of upcoming homing operation
         self.printer.send_event("homing:home_rails_begin", self, rails)
@@ -197,25 +204,24 @@ class Homing:
         # Perform first home
         endstops = [es for rail in rails for es in rail.get_endstops()]
         hi = rails[0].get_homing_info()
+        speed_r = self._calc_speed_ratio(startpos, homepos)
         hmove = HomingMove(self.printer, endstops)
-        hmove.homing_move(homepos, hi.speed)
+        hmove.homing_move(homepos, hi.speed * speed_r)
         # Perform second home
         if hi.retract_dist:
-            # Retract
+            # Retract (each homed axis by retract_dist)
             startpos = self._fill_coord(forcepos)
             homepos = self._fill_coord(movepos)
             axes_d = [hp - sp for hp, sp in zip(homepos, startpos)]
-            move_d = math.sqrt(sum([d*d for d in axes_d[:3]]))
-            retract_r = min(1., hi.retract_dist / move_d)
-            retractpos = [hp - ad * retract_r
-                          for hp, ad in zip(homepos, axes_d)]
-            self.toolhead.move(retractpos, hi.retract_speed)
+            retract_d = [math.copysign(min(hi.retract_dist, abs(ad)), ad)
+                         for ad in axes_d]
+            retractpos = [hp - rd for hp, rd in zip(homepos, retract_d)]
+            self.toolhead.move(retractpos, hi.retract_speed * speed_r)
             # Home again
-            startpos = [rp - ad * retract_r
-                        for rp, ad in zip(retractpos, axes_d)]
+            startpos = [rp - rd for rp, rd in zip(retractpos, retract_d)]
             self.toolhead.set_position(startpos)
             hmove = HomingMove(self.printer, endstops)
-            hmove.homing_move(homepos, hi.second_homing_speed)
+            hmove.homing_move(homepos, hi.second_homing_speed * speed_r)
             if hmove.check_no_movement() is not None:
                 raise self.printer.command_error(
                     "Endstop %s still triggered after retract"
@@ -4,7 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging
-from . import bulk_sensor
+from . import bulk_sensor, bus
 
 #
 # Constants
@@ -25,17 +25,24 @@ class HX71xBase:
         self.sensor_type = sensor_type
         # Chip options
         dout_pin_name = config.get('dout_pin')
-        sclk_pin_name = config.get('sclk_pin')
         ppins = printer.lookup_object('pins')
         dout_ppin = ppins.lookup_pin(dout_pin_name)
-        sclk_ppin = ppins.lookup_pin(sclk_pin_name)
         self.mcu = mcu = dout_ppin['chip']
-        self.oid = mcu.create_oid()
-        if sclk_ppin['chip'] is not mcu:
-            raise config.error("%s config error: All pins must be "
-                               "connected to the same MCU" % (self.name,))
         self.dout_pin = dout_ppin['pin']
-        self.sclk_pin = sclk_ppin['pin']
+        # Optionally clock the chip using a hardware spi bus
+        self.spi = None
+        spi_bus = config.get('spi_bus', None)
+        if spi_bus is not None:
+            spi_speed = config.getint('spi_speed', 1000000, minval=100000,
+                                      maxval=2000000)
+            self.spi = bus.MCU_SPI(mcu, spi_bus, None, 0, spi_speed)
+        else:
+            sclk_ppin = ppins.lookup_pin(config.get('sclk_pin'))
+            if sclk_ppin['chip'] is not mcu:
+                raise config.error("%s config error: All pins must be "
+                                   "connected to the same MCU" % (self.name,))
+            self.sclk_pin = sclk_ppin['pin']
+        self.oid = mcu.create_oid()
         # Samples per second choices
         self.sps = config.getchoice('sample_rate', sample_rate_options,
                                     default=default_sample_rate)
@@ -54,9 +61,15 @@ class HX71xBase:
         # Command Configuration
         self.query_hx71x_cmd = None
         self.attach_probe_cmd = None
-        mcu.add_config_cmd(
-            "config_hx71x oid=%d gain_channel=%d dout_pin=%s sclk_pin=%s"
-            % (self.oid, self.gain_channel, self.dout_pin, self.sclk_pin))
+        if self.spi is not None:
+            mcu.add_config_cmd(
+                "config_hx71x_spi oid=%d gain_channel=%d dout_pin=%s"
+                " spi_oid=%d" % (self.oid, self.gain_channel, self.dout_pin,
+                                 self.spi.get_oid()))
+        else:
+            mcu.add_config_cmd(
+                "config_hx71x oid=%d gain_channel=%d dout_pin=%s sclk_pin=%s"
+                % (self.oid, self.gain_channel, self.dout_pin, self.sclk_pin))
         mcu.add_config_cmd("query_hx71x oid=%d rest_ticks=0"
                            % (self.oid,), on_restart=True)
 
@@ -66,7 +79,8 @@ class HX71xBase:
         self.query_hx71x_cmd = self.mcu.lookup_command(
             "query_hx71x oid=%c rest_ticks=%u")
         self.attach_probe_cmd = self.mcu.lookup_command(
-            "hx71x_attach_load_cell_probe oid=%c load_cell_probe_oid=%c")
+            "hx71x_attach_load_cell_probe oid=%c load_cell_probe_oid=%c"
+            " channel=%c")
         self.ffreader.setup_query_command("query_hx71x_status oid=%c",
                                           oid=self.oid,
                                           cq=self.mcu.alloc_command_queue())
@@ -87,8 +101,8 @@ class HX71xBase:
     def add_client(self, callback):
         self.batch_bulk.add_client(callback)
 
-    def attach_load_cell_probe(self, load_cell_probe_oid):
-        self.attach_probe_cmd.send([self.oid, load_cell_probe_oid])
+    def attach_load_cell_probe(self, load_cell_probe_oid, channel=0):
+        self.attach_probe_cmd.send([self.oid, load_cell_probe_oid, channel])
 
     # Measurement decoding
     def _convert_samples(self, samples):
@@ -72,8 +72,13 @@ class ICM20948:
         self.oid = mcu.create_oid()
         self.query_icm20948_cmd = None
         mcu.register_config_callback(self._build_config)
+        # Optional on-mcu filtering and decimation
+        self.decimate = bulk_sensor.SensorDecimate(
+            config, mcu, self.i2c.get_command_queue(), self.data_rate)
+        self.decimate.setup_sensor(
+            "icm20948_set_decimate oid=%d decimate_oid=%d", self.oid)
         # Bulk sample message reading
-        chip_smooth = self.data_rate * BATCH_UPDATES * 2
+        chip_smooth = self.decimate.get_output_rate() * BATCH_UPDATES * 2
         self.ffreader = bulk_sensor.FixedFreqReader(mcu, chip_smooth, ">hhh")
         self.last_error_count = 0
         # Process messages in batches
@@ -143,6 +148,7 @@ class ICM20948:
         self.set_reg(REG_USER_CTRL, SET_USER_FIFO_EN)
         self.read_reg(REG_INT_STATUS) # clear FIFO overflow flag
         # Start bulk reading
+        self.decimate.note_start()
         rest_ticks = self.mcu.seconds_to_clock(4. / self.data_rate)
         self.query_icm20948_cmd.send([self.oid, rest_ticks])
         self.set_reg(REG_FIFO_EN, SET_ENABLE_FIFO)
@@ -11,7 +11,8 @@ from . import shaper_defs
 class InputShaperParams:
     def __init__(self, axis, config):
         self.axis = axis
-        self.shapers = {s.name : s.init_func for s in shaper_defs.INPUT_SHAPERS}
+        self.shapers = {s.name : s for s in (shaper_defs.INPUT_SHAPERS
+                                             + shaper_defs.INPUT_SMOOTHERS)}
         shaper_type = config.get('shaper_type', 'mzv')
         self.shaper_type = config.get('shaper_type_' + axis, shaper_type)
         if self.shaper_type not in self.shapers:
@@ -35,12 +36,18 @@ class InputShaperParams:
             raise gcmd.error('Unsupported shaper type: %s' % (shaper_type,))
         self.shaper_type = shaper_type.lower()
     def get_shaper(self):
+        # Returns (n, A, T, t_sm) - a smoother has polynomial coefficients
+        # in A and its smoothing time in t_sm (otherwise t_sm is zero)
         if not self.shaper_freq:
             A, T = shaper_defs.get_none_shaper()
-        else:
-            A, T = self.shapers[self.shaper_type](
-                    self.shaper_freq, self.damping_ratio)
-        return len(A), A, T
+            return len(A), A, T, 0.
+        shaper_cfg = self.shapers[self.shaper_type]
+        if isinstance(shaper_cfg, shaper_defs.InputSmootherCfg):
+            C, t_sm = shaper_cfg.init_func(self.shaper_freq,
+                                           self.damping_ratio)
+            return len(C), C, [], t_sm
+        A, T = shaper_cfg.init_func(self.shaper_freq, self.damping_ratio)
+        return len(A), A, T, 0.
     def get_status(self):
         return collections.OrderedDict([
             ('shaper_type', self.shaper_type),
@@ -51,36 +58,48 @@ class AxisInputShaper:
     def __init__(self, axis, config):
         self.axis = axis
         self.params = InputShaperParams(axis, config)
-        self.n, self.A, self.T = self.params.get_shaper()
+        self.n, self.A, self.T, self.t_sm = self.params.get_shaper()
         self.saved = None
     def get_name(self):
         return 'shaper_' + self.axis
     def get_shaper(self):
-        return self.n, self.A, self.T
+        return self.n, self.A, self.T, self.t_sm
+    def get_step_generation_window(self):
+        # Time before or after a position that affects its shaping
+        if self.t_sm:
+            return .5 * self.t_sm
+        if not self.n:
+            return 0.
+        ts = sum([a * t for a, t in zip(self.A, self.T)]) / sum(self.A)
+        return max(max(self.T) - ts, ts - min(self.T))
     def update(self, gcmd):
         self.params.update(gcmd)
-        self.n, self.A, self.T = self.params.get_shaper()
-    def set_shaper_kinematics(self, sk):
+        self.n, self.A, self.T, self.t_sm = self.params.get_shaper()
+    def _set_params(self, sk):
         ffi_main, ffi_lib = chelper.get_ffi()
-        success = ffi_lib.input_shaper_set_shaper_params(
+        if self.t_sm:
+            return ffi_lib.input_shaper_set_smoother_params(
+                    sk, self.axis.encode(), self.n, self.A, self.t_sm) == 0
+        return ffi_lib.input_shaper_set_shaper_params(
                 sk, self.axis.encode(), self.n, self.A, self.T) == 0
+    def set_shaper_kinematics(self, sk):
+        success = self._set_params(sk)
         if not success:
             self.disable_shaping()
-            ffi_lib.input_shaper_set_shaper_params(
-                    sk, self.axis.encode(), self.n, self.A, self.T)
+            self._set_params(sk)
         return success
     def is_enabled(self):
         return self.n > 0
     def disable_shaping(self):
         if self.saved is None and self.n:
-            self.saved = (self.n, self.A, self.T)
+            self.saved = (self.n, self.A, self.T, self.t_sm)
         A, T = shaper_defs.get_none_shaper()
-        self.n, self.A, self.T = len(A), A, T
+        self.n, self.A, self.T, self.t_sm = len(A), A, T, 0.
     def enable_shaping(self):
         if self.saved is None:
             # Input shaper was not disabled
             return
-        self.n, self.A, self.T = self.saved
+        self.n, self.A, self.T, self.t_sm = self.saved
         self.saved = None
     def report(self, gcmd):
         info = ' '.join(["%s_%s:%s" % (key, self.axis, value)
@@ -95,21 +114,35 @@ class InputShaper:
                                             self._update_kinematics)
         self.toolhead = None
         self.shapers = [AxisInputShaper('x', config),
-                        AxisInputShaper('y', config)]
+                        AxisInputShaper('y', config),
+                        AxisInputShaper('z', config)]
+        # The extruder is shaped by the extruder steppers themselves
+        self.extruder_shaper = AxisInputShaper('e', config)
         self.input_shaper_stepper_kinematics = []
         self.orig_stepper_kinematics = []
+        # Shaped positions are shared between steppers on the same trapq
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.shaper_cache = ffi_main.gc(ffi_lib.input_shaper_cache_alloc(),
+                                        ffi_lib.input_shaper_cache_free)
         # Register gcode commands
         gcode = self.printer.lookup_object('gcode')
         gcode.register_command("SET_INPUT_SHAPER",
                                self.cmd_SET_INPUT_SHAPER,
                                desc=self.cmd_SET_INPUT_SHAPER_help)
     def get_shapers(self):
-        return self.shapers
+        return self.shapers + [self.extruder_shaper]
+    def _get_extruder_steppers(self):
+        steppers = []
+        for name, obj in self.printer.lookup_objects():
+            es = getattr(obj, 'extruder_stepper', None)
+            if es is not None and es not in steppers:
+                steppers.append(es)
+        return steppers
     def connect(self):
         self.toolhead = self.printer.lookup_object("toolhead")
         dual_carriage = self.printer.lookup_object('dual_carriage', None)
         if dual_carriage is not None:
-            for shaper in self.shapers:
+            for shaper in self.get_shapers():
                 if shaper.is_enabled():
                     raise self.printer.config_error(
                             'Input shaper parameters cannot be configured via'
@@ -131,6 +164,7 @@ class InputShaper:
         if res < 0:
             stepper.set_stepper_kinematics(sk)
             return None
+        ffi_lib.input_shaper_set_cache(is_sk, self.shaper_cache)
         self.orig_stepper_kinematics.append(sk)
         self.input_shaper_stepper_kinematics.append(is_sk)
         return is_sk
@@ -173,25 +207,30 @@ class InputShaper:
             if old_delay != new_delay:
                 self.toolhead.note_step_generation_scan_time(new_delay,
                                                              old_delay)
+        for es in self._get_extruder_steppers():
+            if self.extruder_shaper in failed_shapers:
+                break
+            if not es.set_input_shaper(self.extruder_shaper):
+                failed_shapers.append(self.extruder_shaper)
         if failed_shapers:
             error = error or self.printer.command_error
             raise error("Failed to configure shaper(s) %s with given parameters"
                         % (', '.join([s.get_name() for s in failed_shapers])))
     def disable_shaping(self):
-        for shaper in self.shapers:
+        for shaper in self.get_shapers():
             shaper.disable_shaping()
         self._update_input_shaping()
     def enable_shaping(self):
-        for shaper in self.shapers:
+        for shaper in self.get_shapers():
             shaper.enable_shaping()
         self._update_input_shaping()
-    cmd_SET_INPUT_SHAPER_help = "Set cartesian parameters for input shaper"
+    cmd_SET_INPUT_SHAPER_help = "Set parameters for input shaper"
     def cmd_SET_INPUT_SHAPER(self, gcmd):
         if gcmd.get_command_parameters():
-            for shaper in self.shapers:
+            for shaper in self.get_shapers():
                 shaper.update(gcmd)
             self._update_input_shaping()
-        for shaper in self.shapers:
+        for shaper in self.get_shapers():
             shaper.report(gcmd)
 
 def load_config(config):
@@ -89,11 +89,14 @@ class LDC1612:
         self.ldc1612_setup_home_cmd = self.query_ldc1612_home_state_cmd = None
         self.frequency = config.getint("frequency", DEFAULT_LDC1612_FREQ,
                                        2000000, 40000000)
+        self.intb_irq_pin = None
         if config.get('intb_pin', None) is not None:
             ppins = config.get_printer().lookup_object("pins")
             pin_params = ppins.lookup_pin(config.get('intb_pin'))
             if pin_params['chip'] != mcu:
                 raise config.error("ldc1612 intb_pin must be on same mcu")
+            if config.getboolean('intb_irq', False):
+                self.intb_irq_pin = pin_params['pin']
             mcu.add_config_cmd(
                 "config_ldc1612_with_intb oid=%d i2c_oid=%d intb_pin=%s"
                 % (oid, self.i2c.get_oid(), pin_params['pin']))
@@ -116,6 +119,14 @@ class LDC1612:
         self.batch_bulk.add_mux_endpoint("ldc1612/dump_ldc1612", "sensor",
                                          self.name, {'header': hdr})
     def _build_config(self):
+        if self.intb_irq_pin is not None:
+            if self.mcu.try_lookup_command(
+                    "ldc1612_intb_irq oid=%c intb_pin=%c") is None:
+                raise self.printer.config_error(
+                    "MCU '%s' does not support ldc1612 intb_irq"
+                    % (self.mcu.get_name(),))
+            self.mcu.add_config_cmd("ldc1612_intb_irq oid=%d intb_pin=%s"
+                                    % (self.oid, self.intb_irq_pin))
         cmdqueue = self.i2c.get_command_queue()
         self.query_ldc1612_cmd = self.mcu.lookup_command(
             "query_ldc1612 oid=%c rest_ticks=%u", cq=cmdqueue)
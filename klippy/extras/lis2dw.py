@@ -80,8 +80,13 @@ class LIS2DW:
         mcu.add_config_cmd("query_lis2dw oid=%d rest_ticks=0"
                            % (oid,), on_restart=True)
         mcu.register_config_callback(self._build_config)
+        # Optional on-mcu filtering and decimation
+        self.decimate = bulk_sensor.SensorDecimate(
+            config, mcu, self.bus.get_command_queue(), self.data_rate)
+        self.decimate.setup_sensor(
+            "lis2dw_set_decimate oid=%d decimate_oid=%d", oid)
         # Bulk sample message reading
-        chip_smooth = self.data_rate * BATCH_UPDATES * 2
+        chip_smooth = self.decimate.get_output_rate() * BATCH_UPDATES * 2
         self.ffreader = bulk_sensor.FixedFreqReader(mcu, chip_smooth, "<hhh")
         self.last_error_count = 0
         # Process messages in batches
@@ -177,6 +182,7 @@ class LIS2DW:
             # Stream mode
             self.set_reg(REG_LIS2DW_FIFO_CTRL, 0x80)
         # Start bulk reading
+        self.decimate.note_start()
         rest_ticks = self.mcu.seconds_to_clock(4. / self.data_rate)
         self.query_lis2dw_cmd.send([self.oid, rest_ticks])
         if self.lis_type == LIS2DW_TYPE:
@@ -15,6 +15,9 @@ Q2_FRAC_BITS = (32 - (1 + Q2_INT_BITS))
 Q16_INT_BITS = 16
 Q16_FRAC_BITS = (32 - (1 + Q16_INT_BITS))
 
+# the MCU sums at most 4 sensors (see MAX_CHANNELS in load_cell_probe.c)
+MAX_EXTRA_SENSORS = 3
+
 
 class TapAnalysis:
     def __init__(self, samples):
@@ -295,6 +298,76 @@ class LoadCellProbeConfigHelper:
         return sos_filter.to_fixed_32((1. / counts_per_gram), Q2_INT_BITS)
 
 
+# Combine several sensors (eg, one under each bed corner) into one sensor
+# that reports the sum of their measurements. The MCU sums the channels
+# itself while probing, this provides the same total for taring,
+# calibration and status reporting.
+class LoadCellSensorSum:
+    def __init__(self, config, sensors):
+        self._sensors = sensors
+        self._mcu = sensors[0].get_mcu()
+        self._sps = sensors[0].get_samples_per_second()
+        for sensor in sensors[1:]:
+            if sensor.get_mcu() is not self._mcu:
+                raise config.error("All load_cell_probe sensors must be"
+                                   " connected to the same MCU")
+            if sensor.get_samples_per_second() != self._sps:
+                raise config.error("All load_cell_probe sensors must use"
+                                   " the same sample_rate")
+        self._clients = []
+        self._active = [False] * len(sensors)
+        self._pending = [[] for s in sensors]
+        self._stats = [(0, 0)] * len(sensors)
+
+    def get_mcu(self):
+        return self._mcu
+
+    def get_samples_per_second(self):
+        return self._sps
+
+    def get_range(self):
+        ranges = [sensor.get_range() for sensor in self._sensors]
+        return sum([r[0] for r in ranges]), sum([r[1] for r in ranges])
+
+    def add_client(self, callback):
+        self._clients.append(callback)
+        for i, sensor in enumerate(self._sensors):
+            if not self._active[i]:
+                self._active[i] = True
+                self._pending[i] = []
+                sensor.add_client(
+                    (lambda msg, index=i: self._handle_batch(index, msg)))
+
+    def attach_load_cell_probe(self, load_cell_probe_oid, channel=0):
+        for i, sensor in enumerate(self._sensors):
+            sensor.attach_load_cell_probe(load_cell_probe_oid, i)
+
+    def _handle_batch(self, index, msg):
+        if not self._clients:
+            self._active[index] = False
+            return False
+        self._pending[index].extend(msg['data'])
+        self._stats[index] = (msg['errors'], msg['overflows'])
+        count = min([len(p) for p in self._pending])
+        if not count:
+            # Don't let one stalled sensor accumulate unbounded samples
+            for p in self._pending:
+                del p[:-self._sps]
+            return True
+        samples = []
+        for group in zip(*[p[:count] for p in self._pending]):
+            samples.append((max([s[0] for s in group]),
+                            sum([s[1] for s in group]),
+                            sum([s[2] for s in group])))
+        for p in self._pending:
+            del p[:count]
+        combined = {'data': samples,
+                    'errors': sum([s[0] for s in self._stats]),
+                    'overflows': sum([s[1] for s in self._stats])}
+        self._clients = [cb for cb in self._clients if cb(combined)]
+        return True
+
+
 # McuLoadCellProbe is the interface to `load_cell_probe` on the MCU
 # This also manages the SosFilter so all commands use one command queue
 class McuLoadCellProbe:
@@ -304,8 +377,9 @@ class McuLoadCellProbe:
     ERROR_WATCHDOG = mcu.MCU_trsync.REASON_COMMS_TIMEOUT + 3
 
     def __init__(self, config, load_cell_inst, sos_filter_inst, config_helper,
-            trigger_dispatch):
+            trigger_dispatch, channel_count=1):
         self._printer = config.get_printer()
+        self._channel_count = channel_count
         self._load_cell = load_cell_inst
         self._sos_filter = sos_filter_inst
         self._config_helper = config_helper
@@ -325,8 +399,8 @@ class McuLoadCellProbe:
     def _config_commands(self):
         self._sos_filter.create_filter()
         self._mcu.add_config_cmd(
-            "config_load_cell_probe oid=%d sos_filter_oid=%d" % (
-                self._oid, self._sos_filter.get_oid()))
+            "config_load_cell_probe oid=%d sos_filter_oid=%d channel_count=%d"
+            % (self._oid, self._sos_filter.get_oid(), self._channel_count))
 
     def _build_config(self):
         # Lookup commands
@@ -611,6 +685,17 @@ class LoadCellPrinterProbe:
         sensors.update(ads1220.ADS1220_SENSOR_TYPE)
         sensor_class = config.getchoice('sensor_type', sensors)
         sensor = sensor_class(config)
+        # Optional additional sensors that are summed with the main sensor
+        extra_names = config.getlist('extra_sensors', [])
+        if len(extra_names) > MAX_EXTRA_SENSORS:
+            raise cfg_error("Too many extra_sensors (max %d)"
+                            % (MAX_EXTRA_SENSORS,))
+        channel_count = 1 + len(extra_names)
+        if extra_names:
+            extra_sensors = [
+                self._printer.load_object(config, 'load_cell_sensor ' + name)
+                for name in extra_names]
+            sensor = LoadCellSensorSum(config, [sensor] + extra_sensors)
         self._load_cell = load_cell.LoadCell(config, sensor)
         # Read all user configuration and build modules
         config_helper = LoadCellProbeConfigHelper(config, self._load_cell)
@@ -624,7 +709,7 @@ class LoadCellPrinterProbe:
         self._probe_offsets = probe.ProbeOffsetsHelper(config)
         self._mcu_load_cell_probe = McuLoadCellProbe(config, self._load_cell,
             continuous_tare_filter_helper.get_sos_filter(), config_helper,
-            trigger_dispatch)
+            trigger_dispatch, channel_count)
         load_cell_probing_move = LoadCellProbingMove(config,
             self._mcu_load_cell_probe, self._param_helper,
             continuous_tare_filter_helper, config_helper)
@@ -0,0 +1,13 @@
+# Additional load cell sensors for a multi-sensor load_cell_probe
+#
+# Copyright (C) 2026  agent <agent@local>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+from . import hx71x, ads1220
+
+def load_config_prefix(config):
+    sensors = {}
+    sensors.update(hx71x.HX71X_SENSOR_TYPES)
+    sensors.update(ads1220.ADS1220_SENSOR_TYPE)
+    sensor_class = config.getchoice('sensor_type', sensors)
+    return sensor_class(config)
@@ -22,6 +22,7 @@ class ManualStepper:
         self.velocity = config.getfloat('velocity', 5., above=0.)
         self.accel = self.homing_accel = config.getfloat('accel', 0., minval=0.)
         self.next_cmd_time = 0.
+        self.queued_end_time = self.queued_gen_time = 0.
         self.pos_min = config.getfloat('position_min', None)
         self.pos_max = config.getfloat('position_max', None)
         # Setup iterative solver
@@ -35,15 +36,35 @@ class ManualStepper:
         self.axis_gcode_id = None
         self.instant_corner_v = 0.
         self.gaxis_limit_velocity = self.gaxis_limit_accel = 0.
+        self.printer.register_event_handler("klippy:connect",
+                                            self._handle_connect)
         # Register commands
         stepper_name = config.get_name().split()[1]
         gcode = self.printer.lookup_object('gcode')
         gcode.register_mux_command('MANUAL_STEPPER', "STEPPER",
                                    stepper_name, self.cmd_MANUAL_STEPPER,
                                    desc=self.cmd_MANUAL_STEPPER_help)
+    def _handle_connect(self):
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead.register_step_generator(self._generate_queued_steps)
+    def _generate_queued_steps(self, flush_time):
+        # Generate steps for queued moves during toolhead flushes
+        if not self.queued_end_time or flush_time <= self.queued_gen_time:
+            return
+        flush_time = min(flush_time, self.queued_end_time)
+        self.rail.generate_steps(flush_time)
+        self.queued_gen_time = flush_time
+        if flush_time >= self.queued_end_time:
+            self.trapq_finalize_moves(self.trapq, flush_time + 99999.9,
+                                      flush_time + 99999.9)
+            self.queued_end_time = self.queued_gen_time = 0.
+    def _flush_queued_moves(self):
+        if self.queued_end_time:
+            self._generate_queued_steps(self.queued_end_time)
     def sync_print_time(self):
         toolhead = self.printer.lookup_object('toolhead')
         print_time = toolhead.get_last_move_time()
+        self._flush_queued_moves()
         if self.next_cmd_time > print_time:
             toolhead.dwell(self.next_cmd_time - print_time)
         else:
@@ -73,6 +94,9 @@ class ManualStepper:
                           0., cruise_v, accel)
         return movetime + accel_t + cruise_t + accel_t
     def do_move(self, movepos, speed, accel, sync=True):
+        if not sync:
+            self.do_queued_move(movepos, speed, accel)
+            return
         self.sync_print_time()
         self.next_cmd_time = self._submit_move(self.next_cmd_time, movepos,
                                                speed, accel)
@@ -81,8 +105,17 @@ class ManualStepper:
                                   self.next_cmd_time + 99999.9)
         toolhead = self.printer.lookup_object('toolhead')
         toolhead.note_mcu_movequeue_activity(self.next_cmd_time)
-        if sync:
-            self.sync_print_time()
+        self.sync_print_time()
+    def do_queued_move(self, movepos, speed, accel):
+        # Queue the move without waiting for the toolhead - steps are
+        # generated as the toolhead flushes step generation
+        toolhead = self.printer.lookup_object('toolhead')
+        start_time = max(self.next_cmd_time, toolhead.get_last_move_time())
+        self.next_cmd_time = self._submit_move(start_time, movepos,
+                                               speed, accel)
+        self.queued_end_time = self.next_cmd_time
+        toolhead.note_mcu_movequeue_activity(self.next_cmd_time,
+                                             set_step_gen_time=True)
     def do_homing_move(self, movepos, speed, accel, triggered, check_trigger):
         if not self.can_home:
             raise self.printer.command_error(
@@ -126,6 +159,7 @@ class ManualStepper:
             self.sync_print_time()
     # Register as a gcode axis
     def command_with_gcode_axis(self, gcmd):
+        self.sync_print_time()
         gcode_move = self.printer.lookup_object("gcode_move")
         toolhead = self.printer.lookup_object('toolhead')
         gcode_axis = gcmd.get('GCODE_AXIS').upper()
@@ -138,7 +172,8 @@ class ManualStepper:
                 raise gcmd.error("Must unregister axis first")
             # Unregister
             toolhead.remove_extra_axis(self)
-            toolhead.unregister_step_generator(self.rail.generate_steps)
+            for s in self.rail.get_steppers():
+                toolhead.unregister_stepper(s)
             self.axis_gcode_id = None
             return
         if (len(gcode_axis) != 1 or not gcode_axis.isupper()
@@ -155,7 +190,8 @@ class ManualStepper:
         self.gaxis_limit_velocity = limit_velocity
         self.gaxis_limit_accel = limit_accel
         toolhead.add_extra_axis(self, self.get_position()[0])
-        toolhead.register_step_generator(self.rail.generate_steps)
+        for s in self.rail.get_steppers():
+            toolhead.register_stepper(s)
     def process_move(self, print_time, move, ea_index):
         axis_r = move.axes_r[ea_index]
         start_pos = move.start_pos[ea_index]
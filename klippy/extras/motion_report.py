@@ -3,22 +3,53 @@
 # Copyright (C) 2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging
+import logging, os
 import chelper
 from . import bulk_sensor
 
+# Record types stored in shared memory ring files (see motionring.c)
+RING_TYPE_TRAPQ = 1
+RING_TYPE_STEPPER = 2
+
+# Helper for copying extracted records to a shared memory ring file
+class MotionRing:
+    def __init__(self, printer, filename, name, record_type, cstruct,
+                 record_count):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.ring = ffi_main.gc(
+            ffi_lib.motionring_alloc(filename.encode(), name.encode(),
+                                     record_type, ffi_main.sizeof(cstruct),
+                                     record_count),
+            ffi_lib.motionring_free)
+        if self.ring == ffi_main.NULL:
+            raise printer.config_error("Unable to create motion ring file %s"
+                                       % (filename,))
+        self.motionring_append = ffi_lib.motionring_append
+        self.motionring_set_params = ffi_lib.motionring_set_params
+    def set_params(self, params):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.motionring_set_params(self.ring, ffi_main.new("double[]", params),
+                                   len(params))
+    def append_chunks(self, chunks):
+        # Chunks are (data, count) pairs of newest first extracted records
+        for data, count in chunks:
+            self.motionring_append(self.ring, data, count, 1)
+
 # Extract stepper queue_step messages
 class DumpStepper:
     def __init__(self, printer, mcu_stepper):
         self.printer = printer
         self.mcu_stepper = mcu_stepper
         self.last_batch_clock = 0
+        self.ring = None
+        self.last_export_clock = 0
+        self.last_stats_time = self.last_stats_bytes = 0.
         self.batch_bulk = bulk_sensor.BatchBulkHelper(printer,
                                                       self._process_batch)
-        api_resp = {'header': ('interval', 'count', 'add')}
+        api_resp = {'header': ('interval', 'count', 'add', 'add2')}
         self.batch_bulk.add_mux_endpoint("motion_report/dump_stepper", "name",
                                          mcu_stepper.get_name(), api_resp)
-    def get_step_queue(self, start_clock, end_clock):
+    def _extract_chunks(self, start_clock, end_clock):
         mcu_stepper = self.mcu_stepper
         res = []
         while 1:
@@ -30,7 +61,44 @@ class DumpStepper:
                 break
             end_clock = data[count-1].first_clock
         res.reverse()
+        return res
+    def get_step_queue(self, start_clock, end_clock):
+        res = self._extract_chunks(start_clock, end_clock)
         return ([d[i] for d, cnt in res for i in range(cnt-1, -1, -1)], res)
+    def start_export(self, filename, record_count):
+        self.ring = MotionRing(self.printer, filename, self.mcu_stepper.get_name(),
+                               RING_TYPE_STEPPER, 'struct pull_history_steps',
+                               record_count)
+    def export_ring(self):
+        res = self._extract_chunks(self.last_export_clock, 1<<63)
+        if not res:
+            return
+        self.ring.append_chunks(res)
+        self.last_export_clock = res[-1][0][0].last_clock
+        # Store the current clock and position conversions in the header
+        mcu_stepper = self.mcu_stepper
+        clock_to_print_time = mcu_stepper.get_mcu().clock_to_print_time
+        time_offset = clock_to_print_time(0)
+        time_per_clock = (clock_to_print_time(1<<32) - time_offset) / (1<<32)
+        self.ring.set_params([mcu_stepper.get_step_dist(),
+                              mcu_stepper.mcu_to_commanded_position(0),
+                              time_offset, time_per_clock])
+    def get_step_stats(self, eventtime):
+        stats = self.mcu_stepper.get_step_stats()
+        moves = stats['moves']
+        stats['steps_per_move'] = 0.
+        if moves:
+            stats['steps_per_move'] = round(float(stats['steps']) / moves, 1)
+        # Estimate the recent rate of bytes sent to the mcu
+        msg_bytes = stats['message_bytes']
+        elapsed = eventtime - self.last_stats_time
+        rate = 0.
+        if self.last_stats_time and elapsed > 0.:
+            rate = (msg_bytes - self.last_stats_bytes) / elapsed
+        stats['bytes_per_second'] = round(rate, 1)
+        self.last_stats_time = eventtime
+        self.last_stats_bytes = msg_bytes
+        return stats
     def log_steps(self, data):
         if not data:
             return
@@ -39,9 +107,9 @@ class DumpStepper:
                    % (self.mcu_stepper.get_name(),
                       self.mcu_stepper.get_mcu().get_name(), len(data)))
         for i, s in enumerate(data):
-            out.append("queue_step %d: t=%d p=%d i=%d c=%d a=%d"
+            out.append("queue_step %d: t=%d p=%d i=%d c=%d a=%d a2=%d"
                        % (i, s.first_clock, s.start_position, s.interval,
-                          s.step_count, s.add))
+                          s.step_count, s.add, s.add2))
         logging.info('\n'.join(out))
     def _process_batch(self, eventtime):
         data, cdata = self.get_step_queue(self.last_batch_clock, 1<<63)
@@ -56,7 +124,7 @@ class DumpStepper:
         mcu_pos = first.start_position
         start_position = self.mcu_stepper.mcu_to_commanded_position(mcu_pos)
         step_dist = self.mcu_stepper.get_step_dist()
-        d = [(s.interval, s.step_count, s.add) for s in data]
+        d = [(s.interval, s.step_count, s.add, s.add2) for s in data]
         return {"data": d, "start_position": start_position,
                 "start_mcu_position": mcu_pos, "step_distance": step_dist,
                 "first_clock": first_clock, "first_step_time": first_time,
@@ -71,13 +139,15 @@ class DumpTrapQ:
         self.name = name
         self.trapq = trapq
         self.last_batch_msg = (0., 0.)
+        self.ring = None
+        self.last_export_time = 0.
         self.batch_bulk = bulk_sensor.BatchBulkHelper(printer,
                                                       self._process_batch)
         api_resp = {'header': ('time', 'duration', 'start_velocity',
                                'acceleration', 'start_position', 'direction')}
         self.batch_bulk.add_mux_endpoint("motion_report/dump_trapq",
                                          "name", name, api_resp)
-    def extract_trapq(self, start_time, end_time):
+    def _extract_chunks(self, start_time, end_time):
         ffi_main, ffi_lib = chelper.get_ffi()
         res = []
         while 1:
@@ -91,7 +161,21 @@ class DumpTrapQ:
                 break
             end_time = data[count-1].print_time
         res.reverse()
+        return res
+    def extract_trapq(self, start_time, end_time):
+        res = self._extract_chunks(start_time, end_time)
         return ([d[i] for d, cnt in res for i in range(cnt-1, -1, -1)], res)
+    def start_export(self, filename, record_count):
+        self.ring = MotionRing(self.printer, filename, self.name,
+                               RING_TYPE_TRAPQ, 'struct pull_move',
+                               record_count)
+    def export_ring(self):
+        res = self._extract_chunks(self.last_export_time, NEVER_TIME)
+        if not res:
+            return
+        self.ring.append_chunks(res)
+        last_move = res[-1][0][0]
+        self.last_export_time = last_move.print_time + last_move.move_t
     def log_trapq(self, data):
         if not data:
             return
@@ -129,19 +213,25 @@ class DumpTrapQ:
         return {"data": d}
 
 STATUS_REFRESH_TIME = 0.250
+EXPORT_TIME = 0.500
 
 class PrinterMotionReport:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.steppers = {}
         self.trapqs = {}
+        # Optional export of motion history to shared memory ring files
+        self.export_dir = config.get('shared_memory_dir', None)
+        self.export_records = config.getint('shared_memory_records', 65536,
+                                            minval=1024)
+        self.export_timer = None
         # get_status information
         self.next_status_time = 0.
         gcode = self.printer.lookup_object('gcode')
         self.last_status = {
             'live_position': gcode.Coord(0., 0., 0., 0.),
             'live_velocity': 0., 'live_extruder_velocity': 0.,
-            'steppers': [], 'trapq': [],
+            'steppers': [], 'trapq': [], 'stepper_stats': {},
         }
         # Register handlers
         self.printer.register_event_handler("klippy:connect", self._connect)
@@ -167,6 +257,33 @@ class PrinterMotionReport:
         # Populate 'trapq' and 'steppers' in get_status result
         self.last_status['steppers'] = list(sorted(self.steppers.keys()))
         self.last_status['trapq'] = list(sorted(self.trapqs.keys()))
+        # Setup shared memory export
+        if self.export_dir is not None:
+            self._start_export()
+    # Shared memory export
+    def _start_export(self):
+        export_dir = os.path.expanduser(self.export_dir)
+        try:
+            if not os.path.isdir(export_dir):
+                os.makedirs(export_dir)
+        except OSError as e:
+            raise self.printer.config_error(
+                "Unable to create shared_memory_dir %s: %s" % (export_dir, e))
+        for prefix, dumpers in [("trapq", self.trapqs),
+                                ("stepper", self.steppers)]:
+            for name, dumper in dumpers.items():
+                fname = "%s.%s" % (prefix, name.replace(' ', '_'))
+                dumper.start_export(os.path.join(export_dir, fname),
+                                    self.export_records)
+        reactor = self.printer.get_reactor()
+        self.export_timer = reactor.register_timer(self._export_event,
+                                                   reactor.NOW)
+    def _export_event(self, eventtime):
+        for dtrapq in self.trapqs.values():
+            dtrapq.export_ring()
+        for dstepper in self.steppers.values():
+            dstepper.export_ring()
+        return eventtime + EXPORT_TIME
     # Shutdown handling
     def _dump_shutdown(self, eventtime):
         # Log stepper queue_steps on mcu that started shutdown (if any)
@@ -227,6 +344,9 @@ class PrinterMotionReport:
         self.last_status['live_position'] = toolhead.Coord(*(xyzpos + epos))
         self.last_status['live_velocity'] = xyzvelocity
         self.last_status['live_extruder_velocity'] = evelocity
+        self.last_status['stepper_stats'] = {
+            name: ds.get_step_stats(eventtime)
+            for name, ds in self.steppers.items()}
         return self.last_status
 
 def load_config(config):
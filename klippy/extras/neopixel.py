@@ -45,6 +45,11 @@ class PrinterNeoPixel:
         self.color_data = bytearray(len(self.color_map))
         self.update_color_data(self.led_helper.get_status()['color_data'])
         self.old_color_data = bytearray([d ^ 1 for d in self.color_data])
+        # Optional coalescing of rapid updates
+        self.update_interval = config.getfloat('update_interval', 0.,
+                                               minval=0.)
+        self.pending_update = None
+        self.next_update_time = 0.
         # Register callbacks
         printer.register_event_handler("klippy:connect", self.send_data)
     def build_config(self):
@@ -98,7 +103,24 @@ class PrinterNeoPixel:
                 break
         else:
             logging.info("Neopixel update did not succeed")
+    def _coalesced_update(self, eventtime):
+        reactor = self.printer.get_reactor()
+        with self.mutex:
+            reactor.pause(self.next_update_time)
+            # Only transmit the most recent request
+            led_state, print_time = self.pending_update
+            self.pending_update = None
+            self.update_color_data(led_state)
+            self.send_data(print_time)
+            self.next_update_time = reactor.monotonic() + self.update_interval
     def update_leds(self, led_state, print_time):
+        if self.update_interval:
+            is_pending = self.pending_update is not None
+            self.pending_update = (led_state, print_time)
+            if not is_pending:
+                self.printer.get_reactor().register_callback(
+                    self._coalesced_update)
+            return
         def reactor_bgfunc(eventtime):
             with self.mutex:
                 self.update_color_data(led_state)
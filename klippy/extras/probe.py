@@ -254,9 +254,12 @@ class HomingViaProbeHelper:
         toolhead = self.printer.lookup_object('toolhead')
         pos = toolhead.get_position()
         pos[2] = self.z_min_position
-        speed = self.param_helper.get_probe_params(gcmd)['probe_speed']
+        params = self.param_helper.get_probe_params(gcmd)
         phoming = self.printer.lookup_object('homing')
-        self.results.append(phoming.probing_move(self.mcu_probe, pos, speed))
+        self.results.append(phoming.probing_move(self.mcu_probe, pos,
+                                                 params['probe_speed']))
+        if params['quick_restart']:
+            toolhead.note_quick_restart()
     def pull_probed_results(self):
         res = self.results
         self.results = []
@@ -295,6 +298,8 @@ class ProbeParameterHelper:
                                                  minval=0.)
         self.samples_retries = config.getint('samples_tolerance_retries', 0,
                                              minval=0)
+        # Start the lift after each probe attempt without a startup delay
+        self.quick_restart = config.getboolean('quick_restart', False)
     def get_probe_params(self, gcmd=None):
         if gcmd is None:
             gcmd = self.dummy_gcode_cmd
@@ -314,7 +319,8 @@ class ProbeParameterHelper:
                 'sample_retract_dist': sample_retract_dist,
                 'samples_tolerance': samples_tolerance,
                 'samples_tolerance_retries': samples_retries,
-                'samples_result': samples_result}
+                'samples_result': samples_result,
+                'quick_restart': self.quick_restart}
 
 # Helper to track multiple probe attempts in a single command
 class ProbeSessionHelper:
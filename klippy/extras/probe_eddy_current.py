@@ -4,7 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, math, bisect
-import mcu
+import mcu, chelper
 from . import ldc1612, probe, manual_probe
 
 OUT_OF_RANGE = 99.9
@@ -39,8 +39,24 @@ class EddyCalibration:
         self.cal_zpos = [c[1] for c in cal]
     def apply_calibration(self, samples):
         cur_temp = self.drift_comp.get_temperature()
+        adjust_freq = self.drift_comp.adjust_freq
+        adj_freqs = [adjust_freq(freq, cur_temp) for t, freq, z in samples]
+        try:
+            import numpy as np
+        except ImportError:
+            np = None
+        if np is not None and len(samples) > 1:
+            # Vectorized version of the bisect based conversion below
+            freqs = np.array(adj_freqs)
+            zpos = np.interp(freqs, self.cal_freqs, self.cal_zpos,
+                             left=OUT_OF_RANGE, right=-OUT_OF_RANGE)
+            zpos[freqs >= self.cal_freqs[-1]] = -OUT_OF_RANGE
+            zpos = np.round(zpos, 6).tolist()
+            for i, (samp_time, freq, dummy_z) in enumerate(samples):
+                samples[i] = (samp_time, freq, zpos[i])
+            return
         for i, (samp_time, freq, dummy_z) in enumerate(samples):
-            adj_freq = self.drift_comp.adjust_freq(freq, cur_temp)
+            adj_freq = adj_freqs[i]
             pos = bisect.bisect(self.cal_freqs, adj_freq)
             if pos >= len(self.cal_zpos):
                 zpos = -OUT_OF_RANGE
@@ -235,29 +251,62 @@ class EddyGatherSamples:
                 raise self._printer.command_error(
                     "probe_eddy_current sensor outage")
             reactor.pause(systime + 0.010)
-    def _pull_freq(self, start_time, end_time):
-        # Find average sensor frequency between time range
-        msg_num = discard_msgs = 0
-        samp_sum = 0.
-        samp_count = 0
-        while msg_num < len(self._samples):
-            msg = self._samples[msg_num]
-            msg_num += 1
+    def _pull_freqs(self, probe_times):
+        # Find average sensor frequency for each (start, end) time range
+        first_start = min([pt[0] for pt in probe_times])
+        last_end = max([pt[1] for pt in probe_times])
+        # Flatten the samples that may be needed and sum them
+        times = []
+        freq_sums = [0.]
+        freq_sum = 0.
+        for msg in self._samples:
             data = msg['data']
-            if data[0][0] > end_time:
+            if data[0][0] > last_end:
                 break
-            if data[-1][0] < start_time:
-                discard_msgs = msg_num
+            if data[-1][0] < first_start:
                 continue
             for time, freq, z in data:
-                if time >= start_time and time <= end_time:
-                    samp_sum += freq
-                    samp_count += 1
+                times.append(time)
+                freq_sum += freq
+                freq_sums.append(freq_sum)
+        res = []
+        for start_time, end_time, pos_time, toolhead_pos in probe_times:
+            start_pos = bisect.bisect_left(times, start_time)
+            end_pos = bisect.bisect_right(times, end_time)
+            if end_pos <= start_pos:
+                # No sensor readings - raise error in pull_probed()
+                res.append(0.)
+                continue
+            samp_sum = freq_sums[end_pos] - freq_sums[start_pos]
+            res.append(samp_sum / (end_pos - start_pos))
+        # Discard messages that are no longer needed
+        start_time = probe_times[-1][0]
+        discard_msgs = 0
+        for msg in self._samples:
+            if msg['data'][-1][0] >= start_time:
+                break
+            discard_msgs += 1
         del self._samples[:discard_msgs]
-        if not samp_count:
-            # No sensor readings - raise error in pull_probed()
-            return 0.
-        return samp_sum / samp_count
+        return res
+    def _lookup_toolhead_positions(self, pos_times):
+        # Find toolhead positions in bulk from the toolhead trapq
+        if not pos_times:
+            return []
+        toolhead = self._printer.lookup_object('toolhead')
+        ffi_main, ffi_lib = chelper.get_ffi()
+        order = sorted(range(len(pos_times)), key=lambda i: pos_times[i])
+        times = ffi_main.new('double[]', [pos_times[i] for i in order])
+        coords = ffi_main.new('double[]', len(order) * 3)
+        missing = ffi_lib.trapq_find_positions(toolhead.get_trapq(), times,
+                                               coords, len(order))
+        res = [None] * len(pos_times)
+        for j, i in enumerate(order):
+            if j < missing:
+                # Position no longer in trapq history
+                res[i] = self._lookup_toolhead_pos(pos_times[i])
+            else:
+                res[i] = [coords[j*3], coords[j*3+1], coords[j*3+2]]
+        return res
     def _lookup_toolhead_pos(self, pos_time):
         toolhead = self._printer.lookup_object('toolhead')
         kin = toolhead.get_kinematics()
@@ -266,18 +315,35 @@ class EddyGatherSamples:
                     for s in kin.get_steppers()}
         return kin.calc_position(kin_spos)
     def _check_samples(self):
-        while self._samples and self._probe_times:
-            start_time, end_time, pos_time, toolhead_pos = self._probe_times[0]
-            if self._samples[-1]['data'][-1][0] < end_time:
+        if not self._samples or not self._probe_times:
+            return
+        # Process all probe points that have their samples available
+        last_sample_time = self._samples[-1]['data'][-1][0]
+        count = 0
+        for start_time, end_time, pos_time, toolhead_pos in self._probe_times:
+            if last_sample_time < end_time:
                 break
-            freq = self._pull_freq(start_time, end_time)
-            if pos_time is not None:
-                toolhead_pos = self._lookup_toolhead_pos(pos_time)
+            count += 1
+        if not count:
+            return
+        probe_times = self._probe_times[:count]
+        del self._probe_times[:count]
+        freqs = self._pull_freqs(probe_times)
+        pos_idx = [i for i, pt in enumerate(probe_times) if pt[2] is not None]
+        positions = self._lookup_toolhead_positions(
+            [probe_times[i][2] for i in pos_idx])
+        toolhead_positions = [pt[3] for pt in probe_times]
+        for i, pos in zip(pos_idx, positions):
+            toolhead_positions[i] = pos
+        # Convert frequencies to heights
+        samples = [(0., freq, 0.) for freq in freqs if freq]
+        self._calibration.apply_calibration(samples)
+        heights = iter([z for t, freq, z in samples])
+        for freq, toolhead_pos in zip(freqs, toolhead_positions):
             sensor_z = None
             if freq:
-                sensor_z = self._calibration.freq_to_height(freq)
+                sensor_z = next(heights)
             self._probe_results.append((sensor_z, toolhead_pos))
-            self._probe_times.pop(0)
     def pull_probed(self):
         self._await_samples()
         results = []
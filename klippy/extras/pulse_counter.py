@@ -17,11 +17,21 @@ class MCU_counter:
         self._sample_time = sample_time
         self._callback = None
         self._last_count = 0
+        self._report_threshold = 0
+        self._max_report_time = 0.
         self._mcu.register_config_callback(self.build_config)
 
     def build_config(self):
         self._mcu.add_config_cmd("config_counter oid=%d pin=%s pull_up=%d"
             % (self._oid, self._pin, self._pullup))
+        if self._max_report_time and self._mcu.try_lookup_command(
+                "counter_set_report oid=%c max_report_ticks=%u"
+                " threshold=%u") is not None:
+            max_report_ticks = self._mcu.seconds_to_clock(
+                self._max_report_time)
+            self._mcu.add_config_cmd(
+                "counter_set_report oid=%d max_report_ticks=%d threshold=%d"
+                % (self._oid, max_report_ticks, self._report_threshold))
         clock = self._mcu.get_query_slot(self._oid)
         self._poll_ticks = self._mcu.seconds_to_clock(self._poll_time)
         sample_ticks = self._mcu.seconds_to_clock(self._sample_time)
@@ -35,6 +45,12 @@ class MCU_counter:
     def setup_callback(self, cb):
         self._callback = cb
 
+    # Only report samples where the count changed by more than
+    # 'threshold' from the last report (or after max_report_time)
+    def setup_report_threshold(self, threshold, max_report_time):
+        self._report_threshold = threshold
+        self._max_report_time = max_report_time
+
     def _handle_counter_state(self, params):
         next_clock = self._mcu.clock32_to_clock64(params['next_clock'])
         time = self._mcu.clock_to_print_time(next_clock - self._poll_ticks)
@@ -56,9 +72,16 @@ class FrequencyCounter:
         self._callback = None
         self._last_time = self._last_count = None
         self._freq = 0.
+        self._sample_time = sample_time
         self._counter = MCU_counter(printer, pin, sample_time, poll_time)
         self._counter.setup_callback(self._counter_callback)
 
+    # Suppress reports while the frequency is within 'freq_threshold'
+    # of the last report
+    def setup_report_threshold(self, freq_threshold, max_report_time):
+        threshold = int(freq_threshold * self._sample_time)
+        self._counter.setup_report_threshold(threshold, max_report_time)
+
     def _counter_callback(self, time, count, count_time):
         if self._last_time is None:  # First sample
             self._last_time = time
@@ -3,7 +3,11 @@
 # Copyright (C) 2017-2025  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import chelper
+import chelper, msgproto
+
+# Maximum number of updates sent in a single queue_*_multi message
+MULTI_MAX_UPDATES = 8
+MULTI_MAX_DATA = 40
 
 class error(Exception):
     pass
@@ -20,6 +24,7 @@ class MCU_queued_pwm:
                                       ffi_lib.stepcompress_free)
         self._mcu.register_stepqueue(self._stepqueue)
         self._stepcompress_queue_mq_msg = ffi_lib.stepcompress_queue_mq_msg
+        self._stepcompress_queue_mq_batch = ffi_lib.stepcompress_queue_mq_batch
         self._mcu.register_config_callback(self._build_config)
         self._pin = pin_params['pin']
         self._invert = pin_params['invert']
@@ -27,12 +32,20 @@ class MCU_queued_pwm:
         self._last_clock = self._last_value = self._default_value = 0
         self._duration_ticks = 0
         self._pwm_max = 0.
-        self._set_cmd_tag = None
+        self._set_cmd_tag = self._multi_cmd = None
+        self._pending = []
         self._toolhead = None
+        self._pwmgen = None
+        self._full_velocity = self._update_time = 0.
         printer = self._mcu.get_printer()
         printer.register_event_handler("klippy:connect", self._handle_connect)
     def _handle_connect(self):
         self._toolhead = self._mcu.get_printer().lookup_object("toolhead")
+        if self._pwmgen is not None:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            ffi_lib.pwmgen_set_trapq(self._pwmgen, self._toolhead.get_trapq(),
+                                     0.)
+            self._toolhead.register_step_generator(self._generate_pwm)
     def get_mcu(self):
         return self._mcu
     def setup_max_duration(self, max_duration):
@@ -46,6 +59,10 @@ class MCU_queued_pwm:
             shutdown_value = 1. - shutdown_value
         self._start_value = max(0., min(1., start_value))
         self._shutdown_value = max(0., min(1., shutdown_value))
+    def setup_velocity_power(self, full_velocity, update_time):
+        # Scale the output by the toolhead velocity (see pwmgen.c)
+        self._full_velocity = full_velocity
+        self._update_time = update_time
     def _build_config(self):
         config_error = self._mcu.get_printer().config_error
         if self._max_duration and self._start_value != self._shutdown_value:
@@ -61,8 +78,7 @@ class MCU_queued_pwm:
         self._duration_ticks = self._mcu.seconds_to_clock(self._max_duration)
         if self._duration_ticks >= 1<<31:
             raise config_error("PWM pin max duration too large")
-        if self._duration_ticks:
-            self._mcu.register_flush_callback(self._flush_notification)
+        self._mcu.register_flush_callback(self._flush_notification)
         if self._hardware_pwm:
             self._pwm_max = self._mcu.get_constant_float("PWM_MAX")
             self._default_value = self._shutdown_value * self._pwm_max
@@ -80,6 +96,9 @@ class MCU_queued_pwm:
             self._set_cmd_tag = self._mcu.lookup_command(
                 "queue_pwm_out oid=%c clock=%u value=%hu",
                 cq=cmd_queue).get_command_tag()
+            self._multi_cmd = self._mcu.try_lookup_command(
+                "queue_pwm_out_multi oid=%c clock=%u data=%*s")
+            self._setup_pwmgen()
             return
         # Software PWM
         if self._shutdown_value not in [0., 1.]:
@@ -101,14 +120,50 @@ class MCU_queued_pwm:
         self._set_cmd_tag = self._mcu.lookup_command(
             "queue_digital_out oid=%c clock=%u on_ticks=%u",
             cq=cmd_queue).get_command_tag()
+        self._multi_cmd = self._mcu.try_lookup_command(
+            "queue_digital_out_multi oid=%c clock=%u data=%*s")
+        self._setup_pwmgen()
+    def _setup_pwmgen(self):
+        if not self._full_velocity:
+            return
+        if self._multi_cmd is None:
+            raise self._mcu.get_printer().config_error(
+                "Velocity based pwm requires mcu support for"
+                " queue_*_multi commands")
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self._pwmgen = ffi_main.gc(ffi_lib.pwmgen_alloc(),
+                                   ffi_lib.pwmgen_free)
+        ffi_lib.pwmgen_setup(
+            self._pwmgen, self._stepqueue, self._multi_cmd.get_command_tag(),
+            self._oid, self._invert, self._pwm_max, int(self._default_value),
+            self._duration_ticks, self._last_clock, self._last_value,
+            self._full_velocity, self._update_time)
+        start_value = self._start_value
+        if self._invert:
+            start_value = 1. - start_value
+        ffi_lib.pwmgen_set_value(self._pwmgen, 0., start_value)
+        self._pwmgen_set_value = ffi_lib.pwmgen_set_value
+        self._pwmgen_generate = ffi_lib.pwmgen_generate
+    def _generate_pwm(self, flush_time):
+        ret = self._pwmgen_generate(self._pwmgen, flush_time)
+        if ret:
+            raise error("Internal error in stepcompress")
     def _send_update(self, clock, val):
         self._last_clock = clock = max(self._last_clock, clock)
         self._last_value = val
-        data = (self._set_cmd_tag, self._oid, clock & 0xffffffff, val)
-        ret = self._stepcompress_queue_mq_msg(self._stepqueue, clock,
-                                              data, len(data))
-        if ret:
-            raise error("Internal error in stepcompress")
+        if self._multi_cmd is not None:
+            # Updates are sent in batches from _flush_notification()
+            pending = self._pending
+            if pending and pending[-1][0] == clock:
+                pending[-1] = (clock, val)
+            else:
+                pending.append((clock, val))
+        else:
+            data = (self._set_cmd_tag, self._oid, clock & 0xffffffff, val)
+            ret = self._stepcompress_queue_mq_msg(self._stepqueue, clock,
+                                                  data, len(data))
+            if ret:
+                raise error("Internal error in stepcompress")
         # Notify toolhead so that it will flush this update
         wakeclock = clock
         if self._last_value != self._default_value:
@@ -117,16 +172,53 @@ class MCU_queued_pwm:
         wake_print_time = self._mcu.clock_to_print_time(wakeclock)
         self._toolhead.note_mcu_movequeue_activity(wake_print_time)
     def set_pwm(self, print_time, value):
+        if self._pwmgen is not None:
+            # Output is generated from the toolhead trapq
+            value = max(0., min(1., value))
+            self._pwmgen_set_value(self._pwmgen, print_time, value)
+            self._toolhead.note_mcu_movequeue_activity(print_time, True)
+            return
         clock = self._mcu.print_time_to_clock(print_time)
         if self._invert:
             value = 1. - value
         v = int(max(0., min(1., value)) * self._pwm_max + 0.5)
         self._send_update(clock, v)
+    def _send_pending(self, flush_clock):
+        # Send updates scheduled before flush_clock in queue_*_multi msgs
+        pending = self._pending
+        count = 0
+        while count < len(pending) and pending[count][0] <= flush_clock:
+            count += 1
+        pos = 0
+        uint32 = msgproto.PT_uint32()
+        while pos < count:
+            start_clock = last_clock = pending[pos][0]
+            data = []
+            num = 0
+            while (pos < count and num < MULTI_MAX_UPDATES
+                   and len(data) < MULTI_MAX_DATA):
+                clock, val = pending[pos]
+                uint32.encode(data, clock - last_clock)
+                uint32.encode(data, val)
+                last_clock = clock
+                pos += 1
+                num += 1
+            msg = self._multi_cmd.encode(
+                [self._oid, start_clock & 0xffffffff, data])
+            ret = self._stepcompress_queue_mq_batch(
+                self._stepqueue, start_clock, last_clock, num, msg, len(msg))
+            if ret:
+                raise error("Internal error in stepcompress")
+        del pending[:count]
     def _flush_notification(self, print_time, clock):
-        if self._last_value != self._default_value:
+        if self._pwmgen is not None:
+            return
+        if self._duration_ticks and self._last_value != self._default_value:
             while clock >= self._last_clock + self._duration_ticks:
                 self._send_update(self._last_clock + self._duration_ticks,
                                   self._last_value)
+        if self._pending:
+            self._send_pending(clock)
 
 class PrinterOutputPin:
     def __init__(self, config):
@@ -152,6 +244,12 @@ class PrinterOutputPin:
         self.shutdown_value = config.getfloat(
             'shutdown_value', 0., minval=0., maxval=self.scale) / self.scale
         self.mcu_pin.setup_start_value(self.last_value, self.shutdown_value)
+        # Optionally scale the output by the toolhead velocity
+        full_velocity = config.getfloat('full_power_velocity', 0., minval=0.)
+        if full_velocity:
+            update_time = config.getfloat('velocity_update_time', 0.001,
+                                          minval=0.0001, maxval=0.100)
+            self.mcu_pin.setup_velocity_power(full_velocity, update_time)
         # Register commands
         pin_name = config.get_name().split()[1]
         gcode = self.printer.lookup_object('gcode')
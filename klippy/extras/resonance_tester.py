@@ -4,7 +4,11 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, math, os, time
-from . import shaper_calibrate
+import chelper
+from . import adxl345
+
+# Amount of the test sequence to queue to the toolhead at a time
+EXCITATION_CHUNK_TIME = 0.100
 
 class TestAxis:
     def __init__(self, axis=None, vib_dir=None):
@@ -28,6 +32,12 @@ class TestAxis:
     def get_point(self, l):
         return (self._vib_dir[0] * l, self._vib_dir[1] * l)
 
+# The shaper_calibrate module is only imported on first use as loading
+# it (and multiprocessing) noticeably increases klippy startup time
+def new_shaper_calibrate(printer):
+    from . import shaper_calibrate
+    return shaper_calibrate.ShaperCalibrate(printer)
+
 def _parse_axis(gcmd, raw_axis):
     if raw_axis is None:
         return None
@@ -128,67 +138,60 @@ class ResonanceTestExecutor:
         reactor = self.printer.get_reactor()
         toolhead = self.printer.lookup_object('toolhead')
         tpos = toolhead.get_position()
-        X, Y = tpos[:2]
-        # Override maximum acceleration and acceleration to
-        # deceleration based on the maximum test frequency
         systime = reactor.monotonic()
-        toolhead_info = toolhead.get_status(systime)
-        old_max_accel = toolhead_info['max_accel']
-        old_minimum_cruise_ratio = toolhead_info['minimum_cruise_ratio']
-        max_accel = max([abs(a) for _, a, _ in test_seq])
-        self.gcode.run_script_from_command(
-            "SET_VELOCITY_LIMIT ACCEL=%.3f MINIMUM_CRUISE_RATIO=0"
-            % (max_accel,))
+        old_max_accel = toolhead.get_status(systime)['max_accel']
+        ffi_main, ffi_lib = chelper.get_ffi()
+        trapq_append_accel_seq = ffi_lib.trapq_append_accel_seq
+        dir_x, dir_y = axis.get_point(1.)
+        seq_args = (tpos[0], tpos[1], tpos[2], dir_x, dir_y, 0.)
+        times = [t for t, _, _ in test_seq]
+        accels = [a for _, a, _ in test_seq]
+        # Simulate the sequence to find the final velocity (so that the
+        # head can be brought to a stop) and the range of motion
+        state = ffi_main.new("struct accel_seq_state *")
+        trapq_append_accel_seq(ffi_main.NULL, state, *(
+            seq_args + (ffi_main.new("double[]", times),
+                        ffi_main.new("double[]", accels), len(times))))
+        if state.v:
+            times.append(state.last_t + abs(state.v) / old_max_accel)
+            accels.append(-math.copysign(old_max_accel, state.v))
+            trapq_append_accel_seq(ffi_main.NULL, state, *(
+                seq_args + (ffi_main.new("double[]", times[-1:]),
+                            ffi_main.new("double[]", accels[-1:]), 1)))
+        for d in (state.min_d, state.max_d, state.d):
+            dX, dY = axis.get_point(d)
+            toolhead.check_position([tpos[0] + dX, tpos[1] + dY] + tpos[2:])
         input_shaper = self.printer.lookup_object('input_shaper', None)
         if input_shaper is not None and not gcmd.get_int('INPUT_SHAPING', 0):
             input_shaper.disable_shaping()
             gcmd.respond_info("Disabled [input_shaper] for resonance testing")
         else:
             input_shaper = None
-        last_v = last_t = last_accel = last_freq = 0.
-        for next_t, accel, freq in test_seq:
-            t_seg = next_t - last_t
-            toolhead.cmd_M204(self.gcode.create_gcode_command(
-                "M204", "M204", {"S": abs(accel)}))
-            v = last_v + accel * t_seg
-            abs_v = abs(v)
-            if abs_v < 0.000001:
-                v = abs_v = 0.
-            abs_last_v = abs(last_v)
-            v2 = v * v
-            last_v2 = last_v * last_v
-            half_inv_accel = .5 / accel
-            d = (v2 - last_v2) * half_inv_accel
-            dX, dY = axis.get_point(d)
-            nX = X + dX
-            nY = Y + dY
-            toolhead.limit_next_junction_speed(abs_last_v)
-            if v * last_v < 0:
-                # The move first goes to a complete stop, then changes direction
-                d_decel = -last_v2 * half_inv_accel
-                decel_X, decel_Y = axis.get_point(d_decel)
-                toolhead.move([X + decel_X, Y + decel_Y] + tpos[2:], abs_last_v)
-                toolhead.move([nX, nY] + tpos[2:], abs_v)
-            else:
-                toolhead.move([nX, nY] + tpos[2:], max(abs_v, abs_last_v))
+        # Queue the excitation directly into the toolhead trapq
+        trapq = toolhead.get_trapq()
+        c_times = ffi_main.new("double[]", times)
+        c_accels = ffi_main.new("double[]", accels)
+        state = ffi_main.new("struct accel_seq_state *")
+        freqs = [freq for _, _, freq in test_seq]
+        last_freq = 0.
+        pos = 0
+        while pos < len(times):
+            end_pos = pos + 1
+            chunk_end_t = times[pos] + EXCITATION_CHUNK_TIME
+            while end_pos < len(times) and times[end_pos] <= chunk_end_t:
+                end_pos += 1
+            state.print_time = toolhead.get_last_move_time()
+            trapq_append_accel_seq(trapq, state, *(
+                seq_args + (c_times + pos, c_accels + pos, end_pos - pos)))
+            dX, dY = axis.get_point(state.d)
+            toolhead.note_trapq_moves(state.print_time,
+                                      [tpos[0] + dX, tpos[1] + dY] + tpos[2:])
+            freq = freqs[min(end_pos, len(freqs)) - 1]
             if math.floor(freq) > math.floor(last_freq):
                 gcmd.respond_info("Testing frequency %.0f Hz" % (freq,))
                 reactor.pause(reactor.monotonic() + 0.01)
-            X, Y = nX, nY
-            last_t = next_t
-            last_v = v
-            last_accel = accel
             last_freq = freq
-        if last_v:
-            d_decel = -.5 * last_v2 / old_max_accel
-            decel_X, decel_Y = axis.get_point(d_decel)
-            toolhead.cmd_M204(self.gcode.create_gcode_command(
-                "M204", "M204", {"S": old_max_accel}))
-            toolhead.move([X + decel_X, Y + decel_Y] + tpos[2:], abs(last_v))
-        # Restore the original acceleration values
-        self.gcode.run_script_from_command(
-            "SET_VELOCITY_LIMIT ACCEL=%.3f MINIMUM_CRUISE_RATIO=%.3f"
-            % (old_max_accel, old_minimum_cruise_ratio))
+            pos = end_pos
         # Restore input shaper if it was disabled for resonance testing
         if input_shaper is not None:
             input_shaper.enable_shaping()
@@ -230,7 +233,7 @@ class ResonanceTester:
                 for chip_axis, chip_name in self.accel_chip_names]
 
     def _run_test(self, gcmd, axes, helper, raw_name_suffix=None,
-                  accel_chips=None, test_point=None):
+                  accel_chips=None, test_point=None, sync_name_suffix=None):
         toolhead = self.printer.lookup_object('toolhead')
         calibration_data = {axis: None for axis in axes}
 
@@ -260,6 +263,14 @@ class ResonanceTester:
                         aclient = chip.start_internal_client()
                         raw_values.append((axis, aclient, chip.name))
 
+                psd_accs = {}
+                if helper is not None:
+                    # Calculate the frequency response during the test
+                    keep_samples = (raw_name_suffix is not None
+                                    or sync_name_suffix is not None)
+                    for chip_axis, aclient, chip_name in raw_values:
+                        psd_accs[aclient] = helper.start_psd_accumulator(
+                                aclient, keep_samples)
                 # Generate moves
                 test_seq = self.generator.gen_test()
                 self.executor.run_test(test_seq, axis, gcmd)
@@ -274,14 +285,29 @@ class ResonanceTester:
                         gcmd.respond_info(
                                 "Writing raw accelerometer data to "
                                 "%s file" % (raw_name,))
+                if sync_name_suffix is not None and len(raw_values) > 1:
+                    sync_name = self.get_filename(
+                            'synced_data', sync_name_suffix, axis,
+                            point if len(test_points) > 1 else None)
+                    adxl345.write_synchronized_file(
+                            sync_name, [v[2] for v in raw_values],
+                            [v[1] for v in raw_values])
+                    gcmd.respond_info(
+                            "Writing synchronized accelerometer data to "
+                            "%s file" % (sync_name,))
                 if helper is None:
                     continue
                 for chip_axis, aclient, chip_name in raw_values:
-                    if not aclient.has_valid_samples():
+                    psd_acc = psd_accs[aclient]
+                    new_data = psd_acc.finish(aclient.request_end_time)
+                    if not psd_acc.has_valid_samples():
                         raise gcmd.error(
                             "accelerometer '%s' measured no data" % (
                                 chip_name,))
-                    new_data = helper.process_accelerometer_data(aclient)
+                    if new_data is None:
+                        raise gcmd.error(
+                            "Internal error processing accelerometer data"
+                            " from '%s'" % (chip_name,))
                     if calibration_data[axis] is None:
                         calibration_data[axis] = new_data
                     else:
@@ -316,9 +342,10 @@ class ResonanceTester:
 
         outputs = gcmd.get("OUTPUT", "resonances").lower().split(',')
         for output in outputs:
-            if output not in ['resonances', 'raw_data']:
-                raise gcmd.error("Unsupported output '%s', only 'resonances'"
-                                 " and 'raw_data' are supported" % (output,))
+            if output not in ['resonances', 'raw_data', 'synced_data']:
+                raise gcmd.error("Unsupported output '%s', only 'resonances',"
+                                 " 'raw_data', and 'synced_data' are"
+                                 " supported" % (output,))
         if not outputs:
             raise gcmd.error("No output specified, at least one of 'resonances'"
                              " or 'raw_data' must be set in OUTPUT parameter")
@@ -327,17 +354,19 @@ class ResonanceTester:
             raise gcmd.error("Invalid NAME parameter")
         csv_output = 'resonances' in outputs
         raw_output = 'raw_data' in outputs
+        sync_output = 'synced_data' in outputs
 
         # Setup calculation of resonances
         if csv_output:
-            helper = shaper_calibrate.ShaperCalibrate(self.printer)
+            helper = new_shaper_calibrate(self.printer)
         else:
             helper = None
 
         data = self._run_test(
                 gcmd, [axis], helper,
                 raw_name_suffix=name_suffix if raw_output else None,
-                accel_chips=accel_chips, test_point=test_point)[axis]
+                accel_chips=accel_chips, test_point=test_point,
+                sync_name_suffix=name_suffix if sync_output else None)[axis]
         if csv_output:
             csv_name = self.save_calibration_data(
                     'resonances', name_suffix, helper, axis, data,
@@ -368,26 +397,34 @@ class ResonanceTester:
         input_shaper = self.printer.lookup_object('input_shaper', None)
 
         # Setup shaper calibration
-        helper = shaper_calibrate.ShaperCalibrate(self.printer)
+        helper = new_shaper_calibrate(self.printer)
 
         calibration_data = self._run_test(gcmd, calibrate_axes, helper,
                                           accel_chips=accel_chips)
 
         configfile = self.printer.lookup_object('configfile')
+        axis_names = [axis.get_name() for axis in calibrate_axes]
+        gcmd.respond_info(
+                "Calculating the best input shaper parameters for %s %s"
+                % (", ".join(axis_names),
+                   "axes" if len(axis_names) > 1 else "axis"))
         for axis in calibrate_axes:
-            axis_name = axis.get_name()
-            gcmd.respond_info(
-                    "Calculating the best input shaper parameters for %s axis"
-                    % (axis_name,))
             calibration_data[axis].normalize_to_frequencies()
-            systime = self.printer.get_reactor().monotonic()
-            toolhead = self.printer.lookup_object('toolhead')
-            toolhead_info = toolhead.get_status(systime)
-            scv = toolhead_info['square_corner_velocity']
-            max_freq = self._get_max_calibration_freq()
-            best_shaper, all_shapers = helper.find_best_shaper(
-                    calibration_data[axis], max_smoothing=max_smoothing,
-                    scv=scv, max_freq=max_freq, logger=gcmd.respond_info)
+        systime = self.printer.get_reactor().monotonic()
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead_info = toolhead.get_status(systime)
+        scv = toolhead_info['square_corner_velocity']
+        max_freq = self._get_max_calibration_freq()
+        # Fit all shapers for all axes in parallel
+        fitted = helper.find_best_shapers(
+                [calibration_data[axis] for axis in calibrate_axes],
+                max_smoothing=max_smoothing, scv=scv, max_freq=max_freq)
+        for axis, (best_shaper, all_shapers) in zip(calibrate_axes, fitted):
+            axis_name = axis.get_name()
+            if len(calibrate_axes) > 1:
+                gcmd.respond_info("Results for %s axis:" % (axis_name,))
+            for shaper in all_shapers:
+                helper.report_shaper(shaper, gcmd.respond_info)
             gcmd.respond_info(
                     "Recommended shaper_type_%s = %s, shaper_freq_%s = %.1f Hz"
                     % (axis_name, best_shaper.name,
@@ -414,7 +451,7 @@ class ResonanceTester:
         self.printer.lookup_object('toolhead').dwell(meas_time)
         for chip_axis, aclient in raw_values:
             aclient.finish_measurements()
-        helper = shaper_calibrate.ShaperCalibrate(self.printer)
+        helper = new_shaper_calibrate(self.printer)
         for chip_axis, aclient in raw_values:
             if not aclient.has_valid_samples():
                 raise gcmd.error(
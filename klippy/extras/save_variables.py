@@ -4,19 +4,26 @@
 # Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, logging, ast, configparser
+import os, logging, ast, configparser, threading, queue, time
 
 class SaveVariables:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.filename = os.path.expanduser(config.get('filename'))
         self.allVariables = {}
+        # Variables are written from a background thread
+        self.write_delay = config.getfloat('write_delay', 0., minval=0.)
+        self.use_fsync = config.getboolean('fsync', True)
+        self.bg_queue = queue.Queue()
+        self.bg_thread = None
         try:
             if not os.path.exists(self.filename):
                 open(self.filename, "w").close()
             self.loadVariables()
         except self.printer.command_error as e:
             raise config.error(str(e))
+        self.printer.register_event_handler("klippy:disconnect",
+                                            self._handle_disconnect)
         gcode = self.printer.lookup_object('gcode')
         gcode.register_command('SAVE_VARIABLE', self.cmd_SAVE_VARIABLE,
                                desc=self.cmd_SAVE_VARIABLE_help)
@@ -33,6 +40,50 @@ class SaveVariables:
             logging.exception(msg)
             raise self.printer.command_error(msg)
         self.allVariables = allvars
+    def _write_variables(self, allvars):
+        varfile = configparser.ConfigParser()
+        varfile.add_section('Variables')
+        for name, val in sorted(allvars.items()):
+            varfile.set('Variables', name, repr(val))
+        tmpname = self.filename + ".tmp"
+        f = open(tmpname, "w")
+        varfile.write(f)
+        f.flush()
+        if self.use_fsync:
+            os.fsync(f.fileno())
+        f.close()
+        os.replace(tmpname, self.filename)
+    def _report_write_error(self, eventtime):
+        gcode = self.printer.lookup_object('gcode')
+        gcode.respond_raw("!! Unable to save variables to %s"
+                          % (self.filename,))
+    def _bg_thread(self):
+        done = False
+        while not done:
+            allvars = self.bg_queue.get(True)
+            if allvars is not None and self.write_delay:
+                time.sleep(self.write_delay)
+            # Only the most recent set of variables needs to be written
+            while not self.bg_queue.empty():
+                newvars = self.bg_queue.get_nowait()
+                if newvars is None:
+                    done = True
+                else:
+                    allvars = newvars
+            if allvars is None:
+                break
+            try:
+                self._write_variables(allvars)
+            except:
+                logging.exception("Unable to save variables")
+                reactor = self.printer.get_reactor()
+                reactor.register_async_callback(self._report_write_error)
+    def _handle_disconnect(self):
+        if self.bg_thread is None:
+            return
+        self.bg_queue.put_nowait(None)
+        self.bg_thread.join()
+        self.bg_thread = None
     cmd_SAVE_VARIABLE_help = "Save arbitrary variables to disk"
     def cmd_SAVE_VARIABLE(self, gcmd):
         varname = gcmd.get('VARIABLE')
@@ -45,20 +96,12 @@ class SaveVariables:
             raise gcmd.error("Unable to parse '%s' as a literal" % (value,))
         newvars = dict(self.allVariables)
         newvars[varname] = value
-        # Write file
-        varfile = configparser.ConfigParser()
-        varfile.add_section('Variables')
-        for name, val in sorted(newvars.items()):
-            varfile.set('Variables', name, repr(val))
-        try:
-            f = open(self.filename, "w")
-            varfile.write(f)
-            f.close()
-        except:
-            msg = "Unable to save variable"
-            logging.exception(msg)
-            raise gcmd.error(msg)
-        self.loadVariables()
+        self.allVariables = newvars
+        # Write file from background thread
+        if self.bg_thread is None:
+            self.bg_thread = threading.Thread(target=self._bg_thread)
+            self.bg_thread.start()
+        self.bg_queue.put_nowait(newvars)
     def get_status(self, eventtime):
         return {'variables': self.allVariables}
 
@@ -10,6 +10,8 @@ MIN_FREQ = 5.
 MAX_FREQ = 200.
 WINDOW_T_SEC = 0.5
 MAX_SHAPER_FREQ = 150.
+# Maximum number of array elements to use when evaluating many shapers
+SHAPER_EVAL_SIZE = 1000000
 
 TEST_DAMPING_RATIOS=[0.075, 0.1, 0.15]
 
@@ -43,6 +45,12 @@ class CalibrationData:
         self.data_sets = joined_data_sets
     def set_numpy(self, numpy):
         self.numpy = numpy
+    def __getstate__(self):
+        # Allow passing between processes (the numpy module can't be
+        # pickled - the receiver must call set_numpy())
+        state = dict(self.__dict__)
+        state.pop('numpy', None)
+        return state
     def normalize_to_frequencies(self):
         for psd in self._psd_list:
             # Avoid division by zero errors
@@ -55,6 +63,109 @@ class CalibrationData:
         return self._psd_map[axis]
 
 
+def calc_window_size(sampling_freq):
+    # Round up to the nearest power of 2 for faster FFT
+    return 1 << int(sampling_freq * WINDOW_T_SEC - 1).bit_length()
+
+# Incrementally calculate the power spectral density of accelerometer
+# measurements.  The samples are split into the same overlapping
+# windows as ShaperCalibrate._psd(), but each window is processed (and
+# then discarded) as soon as it is complete.
+class PSDAccumulator:
+    def __init__(self, shaper_calibrate, start_time):
+        self.helper = shaper_calibrate
+        self.numpy = np = shaper_calibrate.numpy
+        self.start_time = start_time
+        self.pending = []
+        self.pending_count = 0
+        self.buf = np.zeros((0, 4))
+        self.window = None
+        self.power_sums = [0., 0., 0.]
+        self.n_windows = 0
+        self.sample_count = 0
+        self.first_time = self.last_time = None
+    def _flush_pending(self):
+        if self.pending:
+            self.buf = self.numpy.concatenate([self.buf] + self.pending)
+            self.pending = []
+            self.pending_count = 0
+    def _process_windows(self):
+        nfft = len(self.window)
+        overlap = nfft // 2
+        step = nfft - overlap
+        buf = self.buf
+        n_windows = (len(buf) - overlap) // step
+        if n_windows <= 0:
+            return
+        count = n_windows * step
+        for i in range(3):
+            power_sum, _ = self.helper._sum_window_power(
+                    buf[:count + overlap, i + 1], self.window)
+            self.power_sums[i] = self.power_sums[i] + power_sum
+        self.n_windows += n_windows
+        self.last_time = buf[count + overlap - 1, 0]
+        # Keep the samples that overlap with the next window
+        self.buf = self.numpy.array(buf[count:])
+    def add_batch(self, msg):
+        np = self.numpy
+        data = np.array(msg['data'], dtype=float).reshape(-1, 4)
+        if not len(data) or data[-1, 0] < self.start_time:
+            return
+        if data[0, 0] < self.start_time:
+            data = data[np.searchsorted(data[:, 0], self.start_time):]
+        if self.first_time is None:
+            self.first_time = data[0, 0]
+        self.pending.append(data)
+        self.pending_count += len(data)
+        self.sample_count += len(data)
+        if self.window is None:
+            # Estimate the sampling rate to select the window size
+            self._flush_pending()
+            buf = self.buf
+            span = buf[-1, 0] - buf[0, 0]
+            if span < 2. * WINDOW_T_SEC:
+                return
+            self.window = self.helper._calc_window(
+                    calc_window_size(len(buf) / span))
+        elif len(self.buf) + self.pending_count < len(self.window):
+            return
+        self._flush_pending()
+        self._process_windows()
+    def finish(self, end_time):
+        # All samples that were already processed were taken before
+        # the toolhead reached the end of the test
+        self._flush_pending()
+        buf = self.buf
+        keep = self.numpy.searchsorted(buf[:, 0], end_time, side='right')
+        self.sample_count -= len(buf) - keep
+        self.buf = buf[:keep]
+        if self.sample_count <= 0:
+            return None
+        if len(self.buf):
+            self.last_time = self.buf[-1, 0]
+        if self.last_time is None or self.last_time <= self.first_time:
+            return None
+        sampling_freq = self.sample_count / (self.last_time - self.first_time)
+        if self.window is None:
+            self.window = self.helper._calc_window(
+                    calc_window_size(sampling_freq))
+        if self.sample_count <= len(self.window):
+            return None
+        self._process_windows()
+        if not self.n_windows:
+            return None
+        freqs, px = self.helper._finalize_psd(
+                self.power_sums[0], self.n_windows, self.window, sampling_freq)
+        _, py = self.helper._finalize_psd(
+                self.power_sums[1], self.n_windows, self.window, sampling_freq)
+        _, pz = self.helper._finalize_psd(
+                self.power_sums[2], self.n_windows, self.window, sampling_freq)
+        calibration_data = CalibrationData(freqs, px+py+pz, px, py, pz)
+        calibration_data.set_numpy(self.numpy)
+        return calibration_data
+    def has_valid_samples(self):
+        return self.sample_count > 0
+
 CalibrationResult = collections.namedtuple(
         'CalibrationResult',
         ('name', 'freq', 'vals', 'vibrs', 'smoothing', 'score', 'max_accel'))
@@ -71,9 +182,7 @@ class ShaperCalibrate:
                     "installed via `~/klippy-env/bin/pip install` (refer to "
                     "docs/Measuring_Resonances.md for more details).")
 
-    def background_process_exec(self, method, args):
-        if self.printer is None:
-            return method(*args)
+    def _start_background_process(self, method, args):
         import queuelogger
         parent_conn, child_conn = multiprocessing.Pipe()
         def wrapper():
@@ -90,22 +199,57 @@ class ShaperCalibrate:
         calc_proc = multiprocessing.Process(target=wrapper)
         calc_proc.daemon = True
         calc_proc.start()
-        # Wait for the process to finish
+        return calc_proc, parent_conn
+
+    def background_process_exec(self, method, args):
+        return self.background_process_exec_multi(method, [args])[0]
+
+    def background_process_exec_multi(self, method, args_list):
+        # Run method(*args) for each entry in 'args_list' with up to one
+        # process per cpu and return the results in order
+        if self.printer is None:
+            return [method(*args) for args in args_list]
+        try:
+            max_procs = multiprocessing.cpu_count()
+        except NotImplementedError:
+            max_procs = 1
+        results = [None] * len(args_list)
+        pending = list(range(len(args_list)))
+        running = {}
         reactor = self.printer.get_reactor()
         gcode = self.printer.lookup_object("gcode")
         eventtime = last_report_time = reactor.monotonic()
-        while calc_proc.is_alive():
+        errors = []
+        while (pending and not errors) or running:
+            while pending and not errors and len(running) < max_procs:
+                idx = pending.pop(0)
+                running[idx] = self._start_background_process(
+                        method, args_list[idx])
+            done = False
+            for idx, (calc_proc, parent_conn) in list(running.items()):
+                if parent_conn.poll():
+                    is_err, res = parent_conn.recv()
+                elif not calc_proc.is_alive() and not parent_conn.poll():
+                    is_err, res = True, "process exited unexpectedly"
+                else:
+                    continue
+                if is_err:
+                    errors.append(res)
+                else:
+                    results[idx] = res
+                calc_proc.join()
+                parent_conn.close()
+                del running[idx]
+                done = True
+            if done:
+                continue
             if eventtime > last_report_time + 5.:
                 last_report_time = eventtime
                 gcode.respond_info("Wait for calculations..", log=False)
             eventtime = reactor.pause(eventtime + .1)
-        # Return results
-        is_err, res = parent_conn.recv()
-        if is_err:
-            raise self.error("Error in remote calculation: %s" % (res,))
-        calc_proc.join()
-        parent_conn.close()
-        return res
+        if errors:
+            raise self.error("Error in remote calculation: %s" % (errors[0],))
+        return results
 
     def _split_into_windows(self, x, window_size, overlap):
         # Memory-efficient algorithm to split an input 'x' into a series
@@ -117,12 +261,13 @@ class ShaperCalibrate:
         return self.numpy.lib.stride_tricks.as_strided(
                 x, shape=shape, strides=strides, writeable=False)
 
-    def _psd(self, x, fs, nfft):
-        # Calculate power spectral density (PSD) using Welch's algorithm
+    def _calc_window(self, nfft):
+        return self.numpy.kaiser(nfft, 6.)
+
+    def _sum_window_power(self, x, window):
+        # Sum the power spectrum of each overlapping window of 'x'
         np = self.numpy
-        window = np.kaiser(nfft, 6.)
-        # Compensation for windowing loss
-        scale = 1.0 / (window**2).sum()
+        nfft = len(window)
 
         # Split into overlapping windows of size nfft
         overlap = nfft // 2
@@ -133,20 +278,30 @@ class ShaperCalibrate:
 
         # Calculate frequency response for each window using FFT
         result = np.fft.rfft(x, n=nfft, axis=0)
-        result = np.conjugate(result) * result
-        result *= scale / fs
+        result = (np.conjugate(result) * result).real
+        return result.sum(axis=-1), x.shape[-1]
+
+    def _finalize_psd(self, power_sum, n_windows, window, fs):
+        np = self.numpy
+        # Compensation for windowing loss
+        scale = 1.0 / (window**2).sum()
+        # Welch's algorithm: average response over windows
+        psd = power_sum * (scale / (fs * n_windows))
         # For one-sided FFT output the response must be doubled, except
         # the last point for unpaired Nyquist frequency (assuming even nfft)
         # and the 'DC' term (0 Hz)
-        result[1:-1,:] *= 2.
-
-        # Welch's algorithm: average response over windows
-        psd = result.real.mean(axis=-1)
+        psd[1:-1] *= 2.
 
         # Calculate the frequency bins
-        freqs = np.fft.rfftfreq(nfft, 1. / fs)
+        freqs = np.fft.rfftfreq(len(window), 1. / fs)
         return freqs, psd
 
+    def _psd(self, x, fs, nfft):
+        # Calculate power spectral density (PSD) using Welch's algorithm
+        window = self._calc_window(nfft)
+        power_sum, n_windows = self._sum_window_power(x, window)
+        return self._finalize_psd(power_sum, n_windows, window, fs)
+
     def calc_freq_response(self, raw_values):
         np = self.numpy
         if raw_values is None:
@@ -162,8 +317,7 @@ class ShaperCalibrate:
         N = data.shape[0]
         T = data[-1,0] - data[0,0]
         SAMPLING_FREQ = N / T
-        # Round up to the nearest power of 2 for faster FFT
-        M = 1 << int(SAMPLING_FREQ * WINDOW_T_SEC - 1).bit_length()
+        M = calc_window_size(SAMPLING_FREQ)
         if N <= M:
             return None
 
@@ -183,19 +337,32 @@ class ShaperCalibrate:
         calibration_data.set_numpy(self.numpy)
         return calibration_data
 
+    def start_psd_accumulator(self, aclient, keep_samples=False):
+        # Calculate the frequency response while the samples arrive
+        psd_acc = PSDAccumulator(self, aclient.request_start_time)
+        aclient.set_batch_callback(psd_acc.add_batch, keep_samples)
+        return psd_acc
+
     def _estimate_shaper(self, shaper, test_damping_ratio, test_freqs):
+        # The shaper pulses (A, T) may be 1D arrays for a single shaper, or
+        # 2D arrays (one shaper per row) to evaluate many shapers at once
         np = self.numpy
 
         A, T = np.array(shaper[0]), np.array(shaper[1])
-        inv_D = 1. / A.sum()
+        inv_D = 1. / A.sum(axis=-1)
 
         omega = 2. * math.pi * test_freqs
         damping = test_damping_ratio * omega
         omega_d = omega * math.sqrt(1. - test_damping_ratio**2)
-        W = A * np.exp(np.outer(-damping, (T[-1] - T)))
-        S = W * np.sin(np.outer(omega_d, T))
-        C = W * np.cos(np.outer(omega_d, T))
-        return np.sqrt(S.sum(axis=1)**2 + C.sum(axis=1)**2) * inv_D
+        # Arrays are indexed by [shaper,] frequency, pulse
+        A = A[..., None, :]
+        T_end = (T[..., -1:] - T)[..., None, :]
+        T = T[..., None, :]
+        W = A * np.exp(-damping[:, None] * T_end)
+        S = W * np.sin(omega_d[:, None] * T)
+        C = W * np.cos(omega_d[:, None] * T)
+        res = np.sqrt(S.sum(axis=-1)**2 + C.sum(axis=-1)**2)
+        return res * np.asarray(inv_D)[..., None]
 
     def _estimate_remaining_vibrations(self, shaper, test_damping_ratio,
                                        freq_bins, psd):
@@ -205,7 +372,7 @@ class ShaperCalibrate:
         # threshold can be igonred
         vibr_threshold = psd.max() / shaper_defs.SHAPER_VIBRATION_REDUCTION
         remaining_vibrations = self.numpy.maximum(
-                vals * psd - vibr_threshold, 0).sum()
+                vals * psd - vibr_threshold, 0).sum(axis=-1)
         all_vibrations = self.numpy.maximum(psd - vibr_threshold, 0).sum()
         return (remaining_vibrations / all_vibrations, vals)
 
@@ -254,44 +421,68 @@ class ShaperCalibrate:
         psd = calibration_data.psd_sum[freq_bins <= max_freq]
         freq_bins = freq_bins[freq_bins <= max_freq]
 
-        best_res = None
-        results = []
+        # Find the shapers to evaluate (from the highest test frequency)
+        shapers = []
+        stopped_early = False
         for test_freq in test_freqs[::-1]:
-            shaper_vibrations = 0.
-            shaper_vals = np.zeros(shape=freq_bins.shape)
-            shaper = shaper_cfg.init_func(test_freq, damping_ratio)
+            shaper = shaper_defs.get_shaper_pulses(shaper_cfg, test_freq,
+                                                   damping_ratio)
             shaper_smoothing = self._get_shaper_smoothing(shaper, scv=scv)
-            if max_smoothing and shaper_smoothing > max_smoothing and best_res:
-                return best_res
-            # Exact damping ratio of the printer is unknown, pessimizing
-            # remaining vibrations over possible damping values
+            if max_smoothing and shaper_smoothing > max_smoothing and shapers:
+                stopped_early = True
+                break
+            shapers.append((test_freq, shaper, shaper_smoothing))
+        if not shapers:
+            return None
+
+        # Exact damping ratio of the printer is unknown, pessimizing
+        # remaining vibrations over possible damping values
+        shaper_vibrations = np.zeros(len(shapers))
+        shaper_vals = np.zeros(shape=(len(shapers),) + freq_bins.shape)
+        A = np.array([shaper[0] for _, shaper, _ in shapers])
+        T = np.array([shaper[1] for _, shaper, _ in shapers])
+        chunk = max(1, SHAPER_EVAL_SIZE // (len(freq_bins) * A.shape[1]))
+        for start in range(0, len(shapers), chunk):
+            end = start + chunk
             for dr in test_damping_ratios:
                 vibrations, vals = self._estimate_remaining_vibrations(
-                        shaper, dr, freq_bins, psd)
-                shaper_vals = np.maximum(shaper_vals, vals)
-                if vibrations > shaper_vibrations:
-                    shaper_vibrations = vibrations
-            max_accel = self.find_shaper_max_accel(shaper, scv)
+                        (A[start:end], T[start:end]), dr, freq_bins, psd)
+                shaper_vals[start:end] = np.maximum(shaper_vals[start:end],
+                                                    vals)
+                shaper_vibrations[start:end] = np.maximum(
+                        shaper_vibrations[start:end], vibrations)
+
+        best_res = None
+        results = []
+        for i, (test_freq, shaper, shaper_smoothing) in enumerate(shapers):
+            vibrs = shaper_vibrations[i]
             # The score trying to minimize vibrations, but also accounting
             # the growth of smoothing. The formula itself does not have any
             # special meaning, it simply shows good results on real user data
-            shaper_score = shaper_smoothing * (shaper_vibrations**1.5 +
-                                               shaper_vibrations * .2 + .01)
+            shaper_score = shaper_smoothing * (vibrs**1.5 + vibrs * .2 + .01)
             results.append(
                     CalibrationResult(
-                        name=shaper_cfg.name, freq=test_freq, vals=shaper_vals,
-                        vibrs=shaper_vibrations, smoothing=shaper_smoothing,
-                        score=shaper_score, max_accel=max_accel))
+                        name=shaper_cfg.name, freq=test_freq,
+                        vals=shaper_vals[i], vibrs=vibrs,
+                        smoothing=shaper_smoothing, score=shaper_score,
+                        max_accel=None))
             if best_res is None or best_res.vibrs > results[-1].vibrs:
                 # The current frequency is better for the shaper.
                 best_res = results[-1]
-        # Try to find an 'optimal' shapper configuration: the one that is not
-        # much worse than the 'best' one, but gives much less smoothing
         selected = best_res
-        for res in results[::-1]:
-            if res.vibrs < best_res.vibrs * 1.1 and res.score < selected.score:
-                selected = res
-        return selected
+        if not stopped_early:
+            # Try to find an 'optimal' shapper configuration: the one that
+            # is not much worse than the 'best' one, but gives much less
+            # smoothing
+            for res in results[::-1]:
+                if (res.vibrs < best_res.vibrs * 1.1
+                        and res.score < selected.score):
+                    selected = res
+        # Only the selected shaper needs the (slow) max_accel search
+        shaper = shaper_defs.get_shaper_pulses(shaper_cfg, selected.freq,
+                                               damping_ratio)
+        max_accel = self.find_shaper_max_accel(shaper, scv)
+        return selected._replace(max_accel=max_accel)
 
     def _bisect(self, func):
         left = right = 1.
@@ -319,34 +510,61 @@ class ShaperCalibrate:
             shaper, test_accel, scv) <= TARGET_SMOOTHING)
         return max_accel
 
+    def report_shaper(self, shaper, logger):
+        logger("Fitted shaper '%s' frequency = %.1f Hz "
+               "(vibrations = %.1f%%, smoothing ~= %.3f)" % (
+                   shaper.name, shaper.freq, shaper.vibrs * 100.,
+                   shaper.smoothing))
+        logger("To avoid too much smoothing with '%s', suggested "
+               "max_accel <= %.0f mm/sec^2" % (
+                   shaper.name, round(shaper.max_accel / 100.) * 100.))
+
+    def find_best_shapers(self, calibration_datas, shapers=None,
+                          damping_ratio=None, scv=None, shaper_freqs=None,
+                          max_smoothing=None, test_damping_ratios=None,
+                          max_freq=None):
+        # Fit every shaper type for every calibration data set in parallel.
+        # Returns a list of (best_shaper, all_shapers) for each data set.
+        shapers = shapers or AUTOTUNE_SHAPERS
+        shaper_cfgs = [shaper_cfg for shaper_cfg in (
+                           shaper_defs.INPUT_SHAPERS
+                           + shaper_defs.INPUT_SMOOTHERS)
+                       if shaper_cfg.name in shapers]
+        fit_args = [(shaper_cfg, calibration_data, shaper_freqs,
+                     damping_ratio, scv, max_smoothing, test_damping_ratios,
+                     max_freq)
+                    for calibration_data in calibration_datas
+                    for shaper_cfg in shaper_cfgs]
+        fitted = self.background_process_exec_multi(self.fit_shaper,
+                                                     fit_args)
+        res = []
+        for i in range(len(calibration_datas)):
+            best_shaper = None
+            all_shapers = [shaper for shaper in fitted[
+                    i * len(shaper_cfgs):(i + 1) * len(shaper_cfgs)]
+                           if shaper is not None]
+            for shaper in all_shapers:
+                if (best_shaper is None
+                        or shaper.score * 1.2 < best_shaper.score
+                        or (shaper.score * 1.05 < best_shaper.score and
+                            shaper.smoothing * 1.1 < best_shaper.smoothing)):
+                    # Either the shaper significantly improves the score
+                    # (by 20%), or it improves the score and smoothing (by
+                    # 5% and 10% resp.)
+                    best_shaper = shaper
+            res.append((best_shaper, all_shapers))
+        return res
+
     def find_best_shaper(self, calibration_data, shapers=None,
                          damping_ratio=None, scv=None, shaper_freqs=None,
                          max_smoothing=None, test_damping_ratios=None,
                          max_freq=None, logger=None):
-        best_shaper = None
-        all_shapers = []
-        shapers = shapers or AUTOTUNE_SHAPERS
-        for shaper_cfg in shaper_defs.INPUT_SHAPERS:
-            if shaper_cfg.name not in shapers:
-                continue
-            shaper = self.background_process_exec(self.fit_shaper, (
-                shaper_cfg, calibration_data, shaper_freqs, damping_ratio,
-                scv, max_smoothing, test_damping_ratios, max_freq))
-            if logger is not None:
-                logger("Fitted shaper '%s' frequency = %.1f Hz "
-                       "(vibrations = %.1f%%, smoothing ~= %.3f)" % (
-                           shaper.name, shaper.freq, shaper.vibrs * 100.,
-                           shaper.smoothing))
-                logger("To avoid too much smoothing with '%s', suggested "
-                       "max_accel <= %.0f mm/sec^2" % (
-                           shaper.name, round(shaper.max_accel / 100.) * 100.))
-            all_shapers.append(shaper)
-            if (best_shaper is None or shaper.score * 1.2 < best_shaper.score or
-                    (shaper.score * 1.05 < best_shaper.score and
-                        shaper.smoothing * 1.1 < best_shaper.smoothing)):
-                # Either the shaper significantly improves the score (by 20%),
-                # or it improves the score and smoothing (by 5% and 10% resp.)
-                best_shaper = shaper
+        best_shaper, all_shapers = self.find_best_shapers(
+                [calibration_data], shapers, damping_ratio, scv, shaper_freqs,
+                max_smoothing, test_damping_ratios, max_freq)[0]
+        if logger is not None:
+            for shaper in all_shapers:
+                self.report_shaper(shaper, logger)
         return best_shaper, all_shapers
 
     def save_params(self, configfile, axis, shaper_name, shaper_freq):
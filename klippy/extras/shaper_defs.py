@@ -10,6 +10,11 @@ DEFAULT_DAMPING_RATIO = 0.1
 
 InputShaperCfg = collections.namedtuple(
         'InputShaperCfg', ('name', 'init_func', 'min_freq'))
+InputSmootherCfg = collections.namedtuple(
+        'InputSmootherCfg', ('name', 'init_func', 'min_freq'))
+
+# Number of pulses used to approximate a smoother during calibration
+SMOOTHER_PULSES = 64
 
 def get_none_shaper():
     return ([], [])
@@ -91,6 +96,55 @@ def get_3hump_ei_shaper(shaper_freq, damping_ratio):
     T = [0., .5*t_d, t_d, 1.5*t_d, 2.*t_d]
     return (A, T)
 
+######################################################################
+# Smoothers
+######################################################################
+
+# A smoother is a continuous polynomial kernel C[0] + C[1]*u + C[2]*u^2 ...
+# defined on u=[-1, 1] (scaled to a total duration of t_sm seconds). The
+# kernel is symmetric and integrates to 1, so it does not alter constant
+# velocity motion. The kernels below were chosen so that their frequency
+# response has a zero (or, for 'smooth_ei', two zeros at 0.8 and 1.2 times)
+# the smoother frequency.
+
+def get_zv_smoother(shaper_freq, damping_ratio=None):
+    # Parabolic kernel (response zero at tan(x) = x)
+    C = [.75, 0., -.75]
+    t_sm = 2. * 4.493409457909064 / (2. * math.pi * shaper_freq)
+    return (C, t_sm)
+
+def get_zvd_smoother(shaper_freq, damping_ratio=None):
+    # Biweight kernel (response zero at the first root of j_2(x))
+    C = [.9375, 0., -1.875, 0., .9375]
+    t_sm = 2. * 5.763459196894550 / (2. * math.pi * shaper_freq)
+    return (C, t_sm)
+
+def get_ei_smoother(shaper_freq, damping_ratio=None):
+    # Sixth degree kernel with a response below 5% from 0.8 to 1.2 times
+    # the smoother frequency
+    C = [0.8064958482646833, 0., -1.4487131104266597, 0.,
+         1.4816059774519506, 0., -0.8393887152899738]
+    t_sm = 2. * 6. / (2. * math.pi * shaper_freq)
+    return (C, t_sm)
+
+# Approximate a smoother with evenly spaced pulses (A, T)
+def get_smoother_pulses(smoother, num_pulses=SMOOTHER_PULSES):
+    C, t_sm = smoother
+    A = []
+    T = []
+    for i in range(num_pulses):
+        u = -1. + (2. * i + 1.) / num_pulses
+        A.append(sum([c * u**j for j, c in enumerate(C)]) * 2. / num_pulses)
+        T.append((i + .5) * t_sm / num_pulses)
+    return (A, T)
+
+# Return the pulses (A, T) of a shaper, or an approximation of a smoother
+def get_shaper_pulses(shaper_cfg, shaper_freq, damping_ratio):
+    shaper = shaper_cfg.init_func(shaper_freq, damping_ratio)
+    if isinstance(shaper_cfg, InputSmootherCfg):
+        return get_smoother_pulses(shaper)
+    return shaper
+
 # min_freq for each shaper is chosen to have projected max_accel ~= 1500
 INPUT_SHAPERS = [
     InputShaperCfg('zv', get_zv_shaper, min_freq=21.),
@@ -100,3 +154,9 @@ INPUT_SHAPERS = [
     InputShaperCfg('2hump_ei', get_2hump_ei_shaper, min_freq=39.),
     InputShaperCfg('3hump_ei', get_3hump_ei_shaper, min_freq=48.),
 ]
+
+INPUT_SMOOTHERS = [
+    InputSmootherCfg('smooth_zv', get_zv_smoother, min_freq=26.),
+    InputSmootherCfg('smooth_zvd', get_zvd_smoother, min_freq=28.),
+    InputSmootherCfg('smooth_ei', get_ei_smoother, min_freq=34.),
+]
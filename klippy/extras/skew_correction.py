@@ -10,6 +10,7 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 
 import math
+import chelper
 
 def calc_skew_factor(ac, bd, ad):
     side = math.sqrt(2*ac*ac + 2*bd*bd - 4*ad*ad) / 2.
@@ -27,6 +28,9 @@ class PrinterSkew:
         self.yz_factor = 0.
         self.skew_profiles = {}
         self._load_storage(config)
+        self.kin_skew = None
+        if config.getboolean('kinematic_compensation', False):
+            self.kin_skew = KinematicSkew(self.printer)
         self.printer.register_event_handler("klippy:connect",
                                             self._handle_connect)
         self.next_transform = None
@@ -41,8 +45,15 @@ class PrinterSkew:
         gcode.register_command('SKEW_PROFILE', self.cmd_SKEW_PROFILE,
                                desc=self.cmd_SKEW_PROFILE_help)
     def _handle_connect(self):
+        self.toolhead = self.printer.lookup_object('toolhead')
         gcode_move = self.printer.lookup_object('gcode_move')
         self.next_transform = gcode_move.set_move_transform(self, force=True)
+        if self.kin_skew is not None:
+            # Homing and probing moves use physical coordinates
+            for event in ["homing:home_rails_begin",
+                          "homing:homing_move_begin"]:
+                self.printer.register_event_handler(
+                    event, self._exit_kinematic_mode)
     def _load_storage(self, config):
         stored_profs = config.get_prefix_sections(self.name)
         # Remove primary skew_correction section, as it is not a stored profile
@@ -65,16 +76,59 @@ class PrinterSkew:
             + pos[2] * self.xz_factor
         skewed_y = pos[1] + pos[2] * self.yz_factor
         return [skewed_x, skewed_y] + pos[2:]
+    def _has_skew(self):
+        return bool(self.xy_factor or self.xz_factor or self.yz_factor)
+    def _enter_kinematic_mode(self):
+        # Switch from skewed toolhead coordinates to requested
+        # coordinates with the skew applied by the stepper kinematics
+        self.toolhead.flush_step_generation()
+        pos = self.toolhead.get_position()
+        self.kin_skew.set_factors(self.xy_factor, self.xz_factor,
+                                  self.yz_factor)
+        self.kin_skew.set_active(True)
+        self.toolhead.set_position(self.calc_unskew(pos))
+        gcode_move = self.printer.lookup_object('gcode_move')
+        gcode_move.update_move_transform()
+    def _exit_kinematic_mode(self, *args):
+        kin_skew = self.kin_skew
+        if kin_skew is None or not kin_skew.is_active:
+            return
+        self.toolhead.flush_step_generation()
+        pos = self.toolhead.get_position()
+        kin_skew.set_active(False)
+        self.toolhead.set_position(self.calc_skew(pos))
+        gcode_move = self.printer.lookup_object('gcode_move')
+        gcode_move.update_move_transform()
     def get_position(self):
+        if self.kin_skew is not None and self.kin_skew.is_active:
+            # Toolhead position is already unskewed
+            return self.next_transform.get_position()
         return self.calc_unskew(self.next_transform.get_position())
     def move(self, newpos, speed):
+        if self.kin_skew is not None and self._has_skew():
+            # Skew is applied during step generation
+            if not self.kin_skew.is_active:
+                self._enter_kinematic_mode()
+            self.next_transform.move(newpos, speed)
+            return
         corrected_pos = self.calc_skew(newpos)
         self.next_transform.move(corrected_pos, speed)
+    def get_fused_transform(self):
+        if not self._has_skew():
+            return None, self.next_transform
+        if self.kin_skew is not None:
+            if self.kin_skew.is_active:
+                return None, self.next_transform
+            # Route the next move through move() to enable the kinematics
+            return None, None
+        return self.calc_skew, self.next_transform
     def _update_skew(self, xy_factor, xz_factor, yz_factor):
+        self._exit_kinematic_mode()
         self.xy_factor = xy_factor
         self.xz_factor = xz_factor
         self.yz_factor = yz_factor
         gcode_move = self.printer.lookup_object('gcode_move')
+        gcode_move.update_move_transform()
         gcode_move.reset_last_position()
     cmd_GET_CURRENT_SKEW_help = "Report current printer skew"
     def cmd_GET_CURRENT_SKEW(self, gcmd):
@@ -100,7 +154,8 @@ class PrinterSkew:
             self._update_skew(0., 0., 0.)
             return
         planes = ["XY", "XZ", "YZ"]
-        for plane in planes:
+        factors = [self.xy_factor, self.xz_factor, self.yz_factor]
+        for i, plane in enumerate(planes):
             lengths = gcmd.get(plane, None)
             if lengths is not None:
                 try:
@@ -112,8 +167,8 @@ class PrinterSkew:
                     raise gcmd.error(
                         "skew_correction: improperly formatted entry for "
                         "plane [%s]\n%s" % (plane, gcmd.get_commandline()))
-                factor = plane.lower() + '_factor'
-                setattr(self, factor, calc_skew_factor(*lengths))
+                factors[i] = calc_skew_factor(*lengths)
+        self._update_skew(*factors)
     cmd_SKEW_PROFILE_help = "Profile management for skew_correction"
     def cmd_SKEW_PROFILE(self, gcmd):
         if gcmd.get('LOAD', None) is not None:
@@ -163,5 +218,36 @@ class PrinterSkew:
             'current_profile_name': self.current_profile_name
         }
 
+class KinematicSkew:
+    def __init__(self, printer):
+        self.printer = printer
+        self.is_active = False
+        self.skew_steppers = []
+        # Wrap the kinematics before other modules (eg, input_shaper)
+        printer.register_event_handler("klippy:mcu_identify",
+                                       self._handle_mcu_identify)
+    def _handle_mcu_identify(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        toolhead = self.printer.lookup_object('toolhead')
+        for s in toolhead.get_kinematics().get_steppers():
+            if s.get_trapq() is None:
+                continue
+            sk = s.get_stepper_kinematics()
+            skew_sk = ffi_main.gc(ffi_lib.skew_stepper_alloc(), ffi_lib.free)
+            if ffi_lib.skew_stepper_set_sk(skew_sk, sk) < 0:
+                continue
+            s.set_stepper_kinematics(skew_sk)
+            self.skew_steppers.append((skew_sk, sk))
+    def set_factors(self, xy_factor, xz_factor, yz_factor):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        for skew_sk, sk in self.skew_steppers:
+            ffi_lib.skew_stepper_set_factors(skew_sk, xy_factor, xz_factor,
+                                             yz_factor)
+    def set_active(self, is_active):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.is_active = is_active
+        for skew_sk, sk in self.skew_steppers:
+            ffi_lib.skew_stepper_set_active(skew_sk, is_active)
+
 def load_config(config):
     return PrinterSkew(config)
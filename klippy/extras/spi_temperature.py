@@ -40,12 +40,21 @@ class SensorBase:
         self._callback = cb
     def get_report_time_delta(self):
         return REPORT_TIME
+    def get_min_max_values(self):
+        return self.min_sample_value, self.max_sample_value
     def _build_config(self):
         self.mcu.add_config_cmd(
             "config_thermocouple oid=%u spi_oid=%u thermocouple_type=%s" % (
                 self.oid, self.spi.get_oid(), self.chip_type))
-        clock = self.mcu.get_query_slot(self.oid)
         self._report_clock = self.mcu.seconds_to_clock(REPORT_TIME)
+        sensor_groups = lookup_sensor_groups(self.mcu)
+        if sensor_groups is not None:
+            # Queried (possibly as part of a group) by SPISensorGroups
+            sensor_groups.add_sensor(self)
+            return
+        self.build_query_config()
+    def build_query_config(self):
+        clock = self.mcu.get_query_slot(self.oid)
         self.mcu.add_config_cmd(
             "query_thermocouple oid=%u clock=%u rest_ticks=%u"
             " min_value=%u max_value=%u max_invalid_count=%u" % (
@@ -53,17 +62,85 @@ class SensorBase:
                 self.min_sample_value, self.max_sample_value,
                 MAX_INVALID_COUNT), is_init=True)
     def _handle_spi_response(self, params):
-        if params['fault']:
-            self.handle_fault(params['value'], params['fault'])
+        self.note_result(params['value'], params['fault'],
+                         params['next_clock'])
+    def note_result(self, value, fault, next_clock32):
+        if fault:
+            self.handle_fault(value, fault)
             return
-        temp = self.calc_temp(params['value'])
-        next_clock      = self.mcu.clock32_to_clock64(params['next_clock'])
+        temp = self.calc_temp(value)
+        next_clock      = self.mcu.clock32_to_clock64(next_clock32)
         last_read_clock = next_clock - self._report_clock
         last_read_time  = self.mcu.clock_to_print_time(last_read_clock)
         self._callback(last_read_time, temp)
     def report_fault(self, msg):
         logging.warning(msg)
 
+# Read all the SPI temperature sensors on an mcu from a single timer
+# and report them in one message
+class SPISensorGroups:
+    MAX_SENSORS = 9
+    def __init__(self, mcu):
+        self._mcu = mcu
+        self._sensors = []
+    def add_sensor(self, sensor):
+        if not self._sensors:
+            # Registered during config callback processing, so this runs
+            # after the callbacks of all sensors
+            self._mcu.register_config_callback(self._build_config)
+        self._sensors.append(sensor)
+    def _build_config(self):
+        sensors = self._sensors
+        for i in range(0, len(sensors), self.MAX_SENSORS):
+            group = sensors[i:i+self.MAX_SENSORS]
+            if len(group) == 1:
+                group[0].build_query_config()
+                continue
+            self._build_group_config(group)
+    def _build_group_config(self, sensors):
+        mcu = self._mcu
+        oid = mcu.create_oid()
+        mcu.add_config_cmd("config_thermocouple_group oid=%d sensor_count=%d"
+                           % (oid, len(sensors)))
+        for i, sensor in enumerate(sensors):
+            min_value, max_value = sensor.get_min_max_values()
+            mcu.add_config_cmd(
+                "config_thermocouple_group_sensor oid=%d index=%d"
+                " sensor_oid=%d min_value=%u max_value=%u"
+                % (oid, i, sensor.oid, min_value, max_value))
+        clock = mcu.get_query_slot(oid)
+        mcu.add_config_cmd(
+            "query_thermocouple_group oid=%u clock=%u rest_ticks=%u"
+            " max_invalid_count=%u" % (
+                oid, clock, mcu.seconds_to_clock(REPORT_TIME),
+                MAX_INVALID_COUNT), is_init=True)
+        def handle_group_result(params):
+            data = bytearray(params['data'])
+            next_clock = params['next_clock']
+            for i, sensor in enumerate(sensors):
+                d = data[i*5:(i+1)*5]
+                value = d[0] | (d[1] << 8) | (d[2] << 16) | (d[3] << 24)
+                sensor.note_result(value, d[4], next_clock)
+        mcu.register_response(handle_group_result,
+                              "thermocouple_group_result", oid)
+
+class PrinterSPISensorGroups:
+    def __init__(self):
+        self.mcu_to_groups = {}
+def lookup_sensor_groups(mcu):
+    printer = mcu.get_printer()
+    pgroups = printer.lookup_object('spi_temperature_groups', None)
+    if pgroups is None:
+        pgroups = PrinterSPISensorGroups()
+        printer.add_object('spi_temperature_groups', pgroups)
+    if mcu not in pgroups.mcu_to_groups:
+        sensor_groups = None
+        if mcu.try_lookup_command(
+                "config_thermocouple_group oid=%c sensor_count=%c"):
+            sensor_groups = SPISensorGroups(mcu)
+        pgroups.mcu_to_groups[mcu] = sensor_groups
+    return pgroups.mcu_to_groups[mcu]
+
 
 ######################################################################
 # MAX31856 thermocouple
@@ -5,22 +5,37 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import os, time, logging
 
+# Number of callbacks to report in the periodic profile log line
+PROFILE_LOG_COUNT = 5
+
 class PrinterSysStats:
     def __init__(self, config):
         printer = config.get_printer()
+        self.reactor = printer.get_reactor()
         self.last_process_time = self.total_process_time = 0.
         self.last_load_avg = 0.
-        self.last_mem_avail = 0
-        self.mem_file = None
+        self.last_reactor_lag = 0.
+        self.last_mem_avail = self.last_mem_rss = 0
+        self.mem_file = self.statm_file = None
         try:
             self.mem_file = open("/proc/meminfo", "r")
+            self.statm_file = open("/proc/self/statm", "r")
         except:
             pass
+        self.page_kb = 4
+        if hasattr(os, 'sysconf'):
+            try:
+                self.page_kb = os.sysconf('SC_PAGE_SIZE') // 1024
+            except (ValueError, OSError):
+                pass
         printer.register_event_handler("klippy:disconnect", self._disconnect)
     def _disconnect(self):
         if self.mem_file is not None:
             self.mem_file.close()
             self.mem_file = None
+        if self.statm_file is not None:
+            self.statm_file.close()
+            self.statm_file = None
     def stats(self, eventtime):
         # Get core usage stats
         ptime = time.process_time()
@@ -31,6 +46,10 @@ class PrinterSysStats:
         self.last_load_avg = os.getloadavg()[0]
         msg = "sysload=%.2f cputime=%.3f" % (self.last_load_avg,
                                              self.total_process_time)
+        # Get reactor timer lag and number of loop wakeups
+        self.last_reactor_lag, loops = self.reactor.get_loop_stats()
+        msg = "%s reactor_lag=%.3f reactor_loops=%d" % (
+            msg, self.last_reactor_lag, loops)
         # Get available system memory
         if self.mem_file is not None:
             try:
@@ -43,11 +62,22 @@ class PrinterSysStats:
                         break
             except:
                 pass
+        # Get memory used by this process
+        if self.statm_file is not None:
+            try:
+                self.statm_file.seek(0)
+                rss_pages = int(self.statm_file.read().split()[1])
+                self.last_mem_rss = rss_pages * self.page_kb
+                msg = "%s memrss=%d" % (msg, self.last_mem_rss)
+            except:
+                pass
         return (False, msg)
     def get_status(self, eventtime):
         return {'sysload': self.last_load_avg,
                 'cputime': self.total_process_time,
-                'memavail': self.last_mem_avail}
+                'memavail': self.last_mem_avail,
+                'memrss': self.last_mem_rss,
+                'reactor_lag': self.last_reactor_lag}
 
 class PrinterStats:
     def __init__(self, config):
@@ -55,18 +85,78 @@ class PrinterStats:
         reactor = self.printer.get_reactor()
         self.stats_timer = reactor.register_timer(self.generate_stats)
         self.stats_cb = []
+        self.profile_totals = None
+        self.metrics = {}
+        self.metrics_time = 0.
         self.printer.register_event_handler("klippy:ready", self.handle_ready)
+        webhooks = self.printer.lookup_object('webhooks')
+        webhooks.register_endpoint("reactor/profile", self._handle_profile)
+        webhooks.register_endpoint("statistics/metrics", self._handle_metrics)
     def handle_ready(self):
         self.stats_cb = [o.stats for n, o in self.printer.lookup_objects()
                          if hasattr(o, 'stats')]
         if self.printer.get_start_args().get('debugoutput') is None:
             reactor = self.printer.get_reactor()
             reactor.update_timer(self.stats_timer, reactor.NOW)
+    # Reactor callback profiling
+    def _update_profile(self):
+        stats = self.printer.get_reactor().get_profile_stats()
+        totals = self.profile_totals
+        for name, (count, total_time, max_time, max_delay) in stats.items():
+            prev = totals.get(name, (0, 0., 0., 0.))
+            totals[name] = (prev[0] + count, prev[1] + total_time,
+                            max(prev[2], max_time), max(prev[3], max_delay))
+        return stats
+    def _log_profile(self, eventtime):
+        stats = self._update_profile()
+        top = sorted(stats.items(), key=(lambda i: i[1][1]), reverse=True)
+        if not top:
+            return
+        logging.info("Reactor profile %.1f: %s", eventtime,
+                     ' '.join(["%s=%d/%.6f/%.6f/%.6f" % ((n,) + s)
+                               for n, s in top[:PROFILE_LOG_COUNT]]))
+    def _handle_profile(self, web_request):
+        enable = web_request.get('enable', None, types=(bool,))
+        reactor = self.printer.get_reactor()
+        if enable is not None:
+            reactor.set_profiling(enable)
+            self.profile_totals = {} if enable else None
+        callbacks = {}
+        if self.profile_totals is not None:
+            self._update_profile()
+            for name, s in self.profile_totals.items():
+                callbacks[name] = {'count': s[0], 'total_time': s[1],
+                                   'max_time': s[2], 'max_delay': s[3]}
+        web_request.send({'enabled': self.profile_totals is not None,
+                          'callbacks': callbacks})
+    # Numeric values from the periodic stats (grouped by their prefix)
+    def _update_metrics(self, eventtime, stats):
+        metrics = {}
+        group = metrics.setdefault('printer', {})
+        for is_active, msg in stats:
+            for part in msg.split():
+                if '=' not in part:
+                    group = metrics.setdefault(part.rstrip(':'), {})
+                    continue
+                name, val = part.split('=', 1)
+                try:
+                    group[name] = float(val) if '.' in val else int(val)
+                except ValueError:
+                    pass
+            group = metrics['printer']
+        self.metrics = metrics
+        self.metrics_time = eventtime
+    def _handle_metrics(self, web_request):
+        web_request.send({'eventtime': self.metrics_time,
+                          'metrics': self.metrics})
     def generate_stats(self, eventtime):
         stats = [cb(eventtime) for cb in self.stats_cb]
+        self._update_metrics(eventtime, stats)
         if max([s[0] for s in stats]):
             logging.info("Stats %.1f: %s", eventtime,
                          ' '.join([s[1] for s in stats]))
+        if self.profile_totals is not None:
+            self._log_profile(eventtime)
         return eventtime + 1.
 
 def load_config(config):
@@ -7,22 +7,56 @@ import logging
 
 DISABLE_STALL_TIME = 0.100
 
+# Collect enable line updates so that the pins on each mcu can be set
+# with a single message
+class EnableBatch:
+    def __init__(self):
+        self.pending = []
+        self.mcus = []
+    def register_mcu(self, mcu):
+        # Pending updates are sent before the mcu sends queued steps
+        if mcu not in self.mcus:
+            self.mcus.append(mcu)
+            mcu.register_flush_callback(self._flush_notification)
+    def queue(self, print_time, mcu_enable, value):
+        self.pending.append((print_time, mcu_enable, value))
+    def _flush_notification(self, print_time, clock):
+        if self.pending:
+            self.flush()
+    def flush(self):
+        # Group updates by time and mcu (a pin updated twice is placed
+        # in a later group)
+        groups = []
+        last_group = {}
+        for print_time, mcu_enable, value in self.pending:
+            key = (print_time, mcu_enable.get_mcu())
+            group = last_group.get(key)
+            if group is None or mcu_enable in group[1]:
+                group = last_group[key] = (key, set(), [])
+                groups.append(group)
+            group[1].add(mcu_enable)
+            group[2].append((mcu_enable, value))
+        self.pending = []
+        for (print_time, mcu), pins, updates in groups:
+            mcu.set_digital_outputs(print_time, updates)
+
 # Tracking of shared stepper enable pins
 class StepperEnablePin:
-    def __init__(self, mcu_enable, enable_count):
+    def __init__(self, mcu_enable, enable_count, batch=None):
         self.mcu_enable = mcu_enable
         self.enable_count = enable_count
+        self.batch = batch
         self.is_dedicated = True
     def set_enable(self, print_time):
         if not self.enable_count:
-            self.mcu_enable.set_digital(print_time, 1)
+            self.batch.queue(print_time, self.mcu_enable, 1)
         self.enable_count += 1
     def set_disable(self, print_time):
         self.enable_count -= 1
         if not self.enable_count:
-            self.mcu_enable.set_digital(print_time, 0)
+            self.batch.queue(print_time, self.mcu_enable, 0)
 
-def setup_enable_pin(printer, pin):
+def setup_enable_pin(printer, pin, batch):
     if pin is None:
         # No enable line (stepper always enabled)
         enable = StepperEnablePin(None, 9999)
@@ -38,33 +72,45 @@ def setup_enable_pin(printer, pin):
         return enable
     mcu_enable = pin_params['chip'].setup_pin('digital_out', pin_params)
     mcu_enable.setup_max_duration(0.)
-    enable = pin_params['class'] = StepperEnablePin(mcu_enable, 0)
+    batch.register_mcu(mcu_enable.get_mcu())
+    enable = pin_params['class'] = StepperEnablePin(mcu_enable, 0, batch)
     return enable
 
 # Enable line tracking for each stepper motor
 class EnableTracking:
-    def __init__(self, stepper, enable):
+    def __init__(self, stepper, enable, batch):
         self.stepper = stepper
         self.enable = enable
+        self.batch = batch
         self.callbacks = []
         self.is_enabled = False
-        self.stepper.add_active_callback(self.motor_enable)
+        self.stepper.add_active_callback(self._active_enable)
     def register_state_callback(self, callback):
         self.callbacks.append(callback)
-    def motor_enable(self, print_time):
+    def _active_enable(self, print_time):
+        # Steppers that become active together are enabled in one
+        # message per mcu (sent on the next mcu flush)
+        self.queue_enable(print_time)
+    def queue_enable(self, print_time):
         if not self.is_enabled:
             for cb in self.callbacks:
                 cb(print_time, True)
             self.enable.set_enable(print_time)
             self.is_enabled = True
-    def motor_disable(self, print_time):
+    def queue_disable(self, print_time):
         if self.is_enabled:
             # Enable stepper on future stepper movement
             for cb in self.callbacks:
                 cb(print_time, False)
             self.enable.set_disable(print_time)
             self.is_enabled = False
-            self.stepper.add_active_callback(self.motor_enable)
+            self.stepper.add_active_callback(self._active_enable)
+    def motor_enable(self, print_time):
+        self.queue_enable(print_time)
+        self.batch.flush()
+    def motor_disable(self, print_time):
+        self.queue_disable(print_time)
+        self.batch.flush()
     def is_motor_enabled(self):
         return self.is_enabled
     def has_dedicated_enable(self):
@@ -75,6 +121,7 @@ class PrinterStepperEnable:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.enable_lines = {}
+        self.batch = EnableBatch()
         self.printer.register_event_handler("gcode:request_restart",
                                             self._handle_request_restart)
         # Register M18/M84 commands
@@ -86,14 +133,17 @@ class PrinterStepperEnable:
                                desc=self.cmd_SET_STEPPER_ENABLE_help)
     def register_stepper(self, config, mcu_stepper):
         name = mcu_stepper.get_name()
-        enable = setup_enable_pin(self.printer, config.get('enable_pin', None))
-        self.enable_lines[name] = EnableTracking(mcu_stepper, enable)
+        enable = setup_enable_pin(self.printer, config.get('enable_pin', None),
+                                  self.batch)
+        self.enable_lines[name] = EnableTracking(mcu_stepper, enable,
+                                                 self.batch)
     def motor_off(self):
         toolhead = self.printer.lookup_object('toolhead')
         toolhead.dwell(DISABLE_STALL_TIME)
         print_time = toolhead.get_last_move_time()
         for el in self.enable_lines.values():
-            el.motor_disable(print_time)
+            el.queue_disable(print_time)
+        self.batch.flush()
         toolhead.get_kinematics().clear_homing_state("xyz")
         self.printer.send_event("stepper_enable:motor_off", print_time)
         toolhead.dwell(DISABLE_STALL_TIME)
@@ -67,6 +67,9 @@ class Thermistor:
             ln_r = (inv_t - self.c1) / self.c2
         r = math.exp(ln_r) + self.inline_resistor
         return r / (self.pullup + r)
+    def get_table_key(self):
+        return ('thermistor', self.pullup, self.inline_resistor,
+                self.c1, self.c2, self.c3)
 
 # Create an ADC converter with a thermistor
 def PrinterThermistor(config, params):
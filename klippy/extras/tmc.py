@@ -93,6 +93,7 @@ class TMCErrorCheck:
         self.mcu_tmc = mcu_tmc
         self.fields = mcu_tmc.get_fields()
         self.check_timer = None
+        self.checks_active = False
         self.last_drv_status = self.last_drv_fields = None
         # Setup for GSTAT query
         reg_name = self.fields.lookup_register("drv_err")
@@ -128,8 +129,48 @@ class TMCErrorCheck:
         if self.adc_temp_reg is not None:
             pheaters = self.printer.load_object(config, 'heaters')
             pheaters.register_monitor(config)
-    def _query_register(self, reg_info, try_clear=False):
+        # Setup for checks performed by the mcu (if supported)
+        self.mcu_polls = []
+        self._setup_poll(self.drv_status_reg_info)
+        if self.gstat_reg_info is not None:
+            self._setup_poll(self.gstat_reg_info)
+        if self.adc_temp_reg is not None:
+            self._setup_poll(None)
+    def _setup_poll(self, reg_info):
+        if reg_info is None:
+            # Temperature query
+            reg_name = self.adc_temp_reg
+            mask = self.fields.all_fields[reg_name]["adc_temp"]
+            zero_mask = 0
+        else:
+            reg_name, mask, err_mask, zero_mask = reg_info[1:]
+        reactor = self.printer.get_reactor()
+        def callback(status, val):
+            reactor.register_async_callback(
+                (lambda e: self._handle_poll(reg_info, status, val)))
+        poll = self.mcu_tmc.setup_register_poll(reg_name, callback)
+        if poll is not None:
+            self.mcu_polls.append((poll, reg_info, mask, zero_mask))
+    def _check_register(self, reg_info, val):
+        # Note a register value - returns True if it indicates an error
         last_value, reg_name, mask, err_mask, cs_actual_mask = reg_info
+        if val & mask != last_value & mask:
+            fmt = self.fields.pretty_format(reg_name, val)
+            logging.info("TMC '%s' reports %s", self.stepper_name, fmt)
+        reg_info[0] = val
+        if not val & err_mask:
+            if not cs_actual_mask or val & cs_actual_mask:
+                return False
+            irun = self.fields.get_field(self.irun_field)
+            if not self.checks_active or irun < 4:
+                return False
+            if (self.irun_field == "irun"
+                and not self.fields.get_field("ihold")):
+                return False
+            # CS_ACTUAL field of zero - indicates a driver reset
+        return True
+    def _query_register(self, reg_info, try_clear=False):
+        reg_name, mask, err_mask = reg_info[1:4]
         cleared_flags = 0
         count = 0
         while 1:
@@ -143,20 +184,8 @@ class TMCErrorCheck:
                     reactor.pause(reactor.monotonic() + 0.050)
                     continue
                 raise
-            if val & mask != last_value & mask:
-                fmt = self.fields.pretty_format(reg_name, val)
-                logging.info("TMC '%s' reports %s", self.stepper_name, fmt)
-            reg_info[0] = last_value = val
-            if not val & err_mask:
-                if not cs_actual_mask or val & cs_actual_mask:
-                    break
-                irun = self.fields.get_field(self.irun_field)
-                if self.check_timer is None or irun < 4:
-                    break
-                if (self.irun_field == "irun"
-                    and not self.fields.get_field("ihold")):
-                    break
-                # CS_ACTUAL field of zero - indicates a driver reset
+            if not self._check_register(reg_info, val):
+                break
             count += 1
             if count >= 3:
                 fmt = self.fields.pretty_format(reg_name, val)
@@ -174,6 +203,23 @@ class TMCErrorCheck:
             # Ignore comms error for temperature
             self.adc_temp = None
             return
+    def _handle_poll(self, reg_info, status, val):
+        # Process a register change reported by the mcu
+        if not self.checks_active:
+            return
+        if reg_info is None:
+            self.adc_temp = None if status else val
+            return
+        try:
+            if status:
+                raise self.printer.command_error(
+                    "TMC '%s' unable to read register %s"
+                    % (self.stepper_name, reg_info[1]))
+            if self._check_register(reg_info, val):
+                # Confirm the error by reading the register again
+                self._query_register(reg_info)
+        except self.printer.command_error as e:
+            self.printer.invoke_shutdown(str(e))
     def _do_periodic_check(self, eventtime):
         try:
             self._query_register(self.drv_status_reg_info)
@@ -186,29 +232,43 @@ class TMCErrorCheck:
             return self.printer.get_reactor().NEVER
         return eventtime + 1.
     def stop_checks(self):
+        if not self.checks_active:
+            return
+        self.checks_active = False
         if self.check_timer is None:
+            for poll, reg_info, mask, zero_mask in self.mcu_polls:
+                poll.stop()
             return
         self.printer.get_reactor().unregister_timer(self.check_timer)
         self.check_timer = None
     def start_checks(self):
-        if self.check_timer is not None:
+        if self.checks_active:
             self.stop_checks()
         cleared_flags = 0
         self._query_register(self.drv_status_reg_info)
         if self.gstat_reg_info is not None:
             cleared_flags = self._query_register(self.gstat_reg_info,
                                                  try_clear=self.clear_gstat)
-        reactor = self.printer.get_reactor()
-        curtime = reactor.monotonic()
-        self.check_timer = reactor.register_timer(self._do_periodic_check,
-                                                  curtime + 1.)
+        self.checks_active = True
+        if self.mcu_polls and self.mcu_polls[0][0].is_available():
+            # Have the mcu check the registers and report changes
+            for poll, reg_info, mask, zero_mask in self.mcu_polls:
+                last_value = 0
+                if reg_info is not None:
+                    last_value = reg_info[0]
+                poll.start(mask, zero_mask, last_value)
+        else:
+            reactor = self.printer.get_reactor()
+            curtime = reactor.monotonic()
+            self.check_timer = reactor.register_timer(
+                self._do_periodic_check, curtime + 1.)
         if cleared_flags:
             reset_mask = self.fields.all_fields["GSTAT"]["reset"]
             if cleared_flags & reset_mask:
                 return True
         return False
     def get_status(self, eventtime=None):
-        if self.check_timer is None:
+        if not self.checks_active:
             return {'drv_status': None, 'temperature': None}
         temp = None
         if self.adc_temp is not None:
@@ -225,6 +285,16 @@ class TMCErrorCheck:
 # G-Code command helpers
 ######################################################################
 
+# Wrapper that records register writes (so that they may be sent later)
+class TMCWriteRecorder:
+    def __init__(self, mcu_tmc):
+        self.mcu_tmc = mcu_tmc
+        self.writes = []
+    def __getattr__(self, name):
+        return getattr(self.mcu_tmc, name)
+    def set_register(self, reg_name, val, print_time=None):
+        self.writes.append((reg_name, val))
+
 class TMCCommandHelper:
     def __init__(self, config, mcu_tmc, current_helper):
         self.printer = config.get_printer()
@@ -237,16 +307,22 @@ class TMCCommandHelper:
         self.read_registers = self.read_translate = None
         self.toff = None
         self.mcu_phase_offset = None
+        self.pending_updates = []
+        self.update_error = None
         self.stepper = None
         self.stepper_enable = self.printer.load_object(config, "stepper_enable")
         self.printer.register_event_handler("stepper:sync_mcu_position",
                                             self._handle_sync_mcu_pos)
         self.printer.register_event_handler("stepper:set_sdir_inverted",
-                                            self._handle_sync_mcu_pos)
+                                            self._handle_set_sdir_inverted)
         self.printer.register_event_handler("klippy:mcu_identify",
                                             self._handle_mcu_identify)
         self.printer.register_event_handler("klippy:connect",
                                             self._handle_connect)
+        self.printer.register_event_handler("homing:home_rails_begin",
+                                            self._handle_home_rails_begin)
+        self.printer.register_event_handler("homing:homing_move_begin",
+                                            self._handle_homing_move_begin)
         # Set microstep config options
         TMCMicrostepHelper(config, mcu_tmc)
         # Register commands
@@ -265,6 +341,45 @@ class TMCCommandHelper:
         for reg_name in list(self.fields.registers.keys()):
             val = self.fields.registers[reg_name] # Val may change during loop
             self.mcu_tmc.set_register(reg_name, val, print_time)
+    def _queue_update(self, writes):
+        # Send the register 'writes' at the end of the queued moves.  The
+        # driver write is confirmed from a background reactor callback so
+        # that the gcode queue (and move planning) is not stalled.
+        reactor = self.printer.get_reactor()
+        completion = reactor.completion()
+        self.pending_updates = [c for c in self.pending_updates
+                                if not c.test()] + [completion]
+        def do_update(print_time):
+            try:
+                for reg_name, val in writes:
+                    self.mcu_tmc.set_register(reg_name, val, print_time)
+            except self.printer.command_error as e:
+                logging.error("TMC %s update failed: %s", self.name, str(e))
+                if self.update_error is None:
+                    self.update_error = str(e)
+            completion.complete(None)
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead.register_lookahead_callback(
+            (lambda pt: reactor.register_callback(
+                (lambda ev: do_update(pt)))))
+    def _check_update_error(self):
+        if self.update_error is not None:
+            msg = self.update_error
+            self.update_error = None
+            raise self.printer.command_error(msg)
+    def _flush_updates(self):
+        # Wait for all queued register writes to be confirmed
+        if self.pending_updates:
+            toolhead = self.printer.lookup_object('toolhead')
+            toolhead.get_last_move_time()
+            for completion in self.pending_updates:
+                completion.wait()
+            self.pending_updates = []
+        self._check_update_error()
+    def _handle_home_rails_begin(self, homing_state, rails):
+        self._flush_updates()
+    def _handle_homing_move_begin(self, hmove):
+        self._flush_updates()
     cmd_INIT_TMC_help = "Initialize TMC stepper driver registers"
     def cmd_INIT_TMC(self, gcmd):
         logging.info("INIT_TMC %s", self.name)
@@ -286,11 +401,12 @@ class TMCCommandHelper:
                     "VELOCITY parameter not supported by this driver")
             value = TMCtstepHelper(self.mcu_tmc, velocity,
                                    pstepper=self.stepper)
+        self._check_update_error()
         reg_val = self.fields.set_field(field_name, value)
-        print_time = self.printer.lookup_object('toolhead').get_last_move_time()
-        self.mcu_tmc.set_register(reg_name, reg_val, print_time)
+        self._queue_update([(reg_name, reg_val)])
     cmd_SET_TMC_CURRENT_help = "Set the current of a TMC driver"
     def cmd_SET_TMC_CURRENT(self, gcmd):
+        self._check_update_error()
         ch = self.current_helper
         prev_cur, prev_hold_cur, req_hold_cur, max_cur = ch.get_current()
         run_current = gcmd.get_float('CURRENT', None, minval=0., maxval=max_cur)
@@ -301,9 +417,15 @@ class TMCCommandHelper:
                 run_current = prev_cur
             if hold_current is None:
                 hold_current = req_hold_cur
-            toolhead = self.printer.lookup_object('toolhead')
-            print_time = toolhead.get_last_move_time()
-            ch.set_current(run_current, hold_current, print_time)
+            # Update the register fields now and send them to the driver
+            # at the end of the queued moves
+            recorder = TMCWriteRecorder(ch.mcu_tmc)
+            ch.mcu_tmc = recorder
+            try:
+                ch.set_current(run_current, hold_current, None)
+            finally:
+                ch.mcu_tmc = recorder.mcu_tmc
+            self._queue_update(recorder.writes)
             prev_cur, prev_hold_cur, req_hold_cur, max_cur = ch.get_current()
         # Report values
         if prev_hold_cur is None:
@@ -326,6 +448,16 @@ class TMCCommandHelper:
     def _handle_sync_mcu_pos(self, stepper):
         if stepper.get_name() != self.stepper_name:
             return
+        if self.mcu_phase_offset is not None:
+            # The mcu step count is continuous, so a known phase offset
+            # remains valid (avoids a driver query after each homing)
+            return
+        self._calc_phase_offset(stepper)
+    def _handle_set_sdir_inverted(self, stepper):
+        if stepper.get_name() != self.stepper_name:
+            return
+        self._calc_phase_offset(stepper)
+    def _calc_phase_offset(self, stepper):
         try:
             driver_phase = self._query_phase()
         except self.printer.command_error as e:
@@ -364,7 +496,7 @@ class TMCCommandHelper:
                 logging.info("Pausing toolhead to calculate %s phase offset",
                              self.stepper_name)
                 self.printer.lookup_object('toolhead').wait_moves()
-                self._handle_sync_mcu_pos(self.stepper)
+                self._calc_phase_offset(self.stepper)
         except self.printer.command_error as e:
             self.printer.invoke_shutdown(str(e))
     def _do_disable(self, print_time):
@@ -272,6 +272,8 @@ class MCU_TMC_SPI:
                     return
         raise self.printer.command_error(
             "Unable to write tmc spi '%s' register %s" % (self.name, reg_name))
+    def setup_register_poll(self, reg_name, callback):
+        return None
     def get_tmc_frequency(self):
         return self.tmc_frequency
 
@@ -72,6 +72,7 @@ def lookup_tmc_uart_mutex(mcu):
 
 TMC_BAUD_RATE = 40000
 TMC_BAUD_RATE_AVR = 9000
+TMC_POLL_TIME = 1.
 
 # Code for sending messages on a TMC uart
 class MCU_TMC_uart_bitbang:
@@ -89,6 +90,9 @@ class MCU_TMC_uart_bitbang:
                                              select_pins_desc)
         self.instances = {}
         self.tmcuart_send_cmd = None
+        self.poll_oid = None
+        self.poll_entries = []
+        self.tmcuart_poll_entry_cmd = None
         self.mcu.register_config_callback(self.build_config)
     def build_config(self):
         baud = TMC_BAUD_RATE
@@ -103,6 +107,24 @@ class MCU_TMC_uart_bitbang:
             "tmcuart_send oid=%c write=%*s read=%c",
             "tmcuart_response oid=%c read=%*s", oid=self.oid,
             cq=self.cmd_queue, is_async=True)
+        if self.poll_oid is None or self.mcu.try_lookup_command(
+                "config_tmcuart_poll oid=%c tmcuart_oid=%c"
+                " entry_count=%c") is None:
+            return
+        # Setup mcu based register polling
+        self.mcu.add_config_cmd(
+            "config_tmcuart_poll oid=%d tmcuart_oid=%d entry_count=%d"
+            % (self.poll_oid, self.oid, len(self.poll_entries)))
+        clock = self.mcu.get_query_slot(self.poll_oid)
+        rest_ticks = self.mcu.seconds_to_clock(TMC_POLL_TIME)
+        self.mcu.add_config_cmd(
+            "query_tmcuart_poll oid=%d clock=%d rest_ticks=%d"
+            % (self.poll_oid, clock, rest_ticks), is_init=True)
+        self.tmcuart_poll_entry_cmd = self.mcu.lookup_command(
+            "tmcuart_poll_entry oid=%c index=%c write=%*s mask=%u"
+            " zero_mask=%u last_value=%u", cq=self.cmd_queue)
+        self.mcu.register_response(self._handle_poll_result,
+                                   "tmcuart_poll_result", self.poll_oid)
     def register_instance(self, rx_pin_params, tx_pin_params,
                           select_pins_desc, addr):
         if (rx_pin_params['pin'] != self.rx_pin
@@ -118,6 +140,26 @@ class MCU_TMC_uart_bitbang:
                 "Shared TMC uarts need unique address or select_pins polarity")
         self.instances[(instance_id, addr)] = True
         return instance_id
+    def add_poll_entry(self, addr, reg, callback):
+        # Request the mcu to periodically read a register
+        if self.analog_mux is not None:
+            return None
+        if self.poll_oid is None:
+            self.poll_oid = self.mcu.create_oid()
+        self.poll_entries.append((addr, reg, callback))
+        return len(self.poll_entries) - 1
+    def is_poll_available(self):
+        return self.tmcuart_poll_entry_cmd is not None
+    def set_poll_entry(self, index, mask, zero_mask, last_value):
+        addr, reg, callback = self.poll_entries[index]
+        msg = self._encode_read(0xf5, addr, reg)
+        self.tmcuart_poll_entry_cmd.send([self.poll_oid, index, msg, mask,
+                                          zero_mask, last_value])
+    def clear_poll_entry(self, index):
+        self.tmcuart_poll_entry_cmd.send([self.poll_oid, index, b"", 0, 0, 0])
+    def _handle_poll_result(self, params):
+        addr, reg, callback = self.poll_entries[params['index']]
+        callback(params['status'], params['value'])
     def _calc_crc8(self, data):
         # Generate a CRC8-ATM value for a bytearray
         crc = 0
@@ -251,5 +293,26 @@ class MCU_TMC_uart:
                     return
         raise self.printer.command_error(
             "Unable to write tmc uart '%s' register %s" % (self.name, reg_name))
+    def setup_register_poll(self, reg_name, callback):
+        # Have the mcu check a register for changes (if supported)
+        reg = self.name_to_reg[reg_name]
+        index = self.mcu_uart.add_poll_entry(self.addr, reg, callback)
+        if index is None:
+            return None
+        return TMCUartRegisterPoll(self.mcu_uart, index)
     def get_tmc_frequency(self):
         return self.tmc_frequency
+
+# Helper for a register that is read periodically by the mcu.  The
+# callback is invoked (from a background thread) with a status and
+# register value when the masked bits of the register change.
+class TMCUartRegisterPoll:
+    def __init__(self, mcu_uart, index):
+        self.mcu_uart = mcu_uart
+        self.index = index
+    def is_available(self):
+        return self.mcu_uart.is_poll_available()
+    def start(self, mask, zero_mask, last_value):
+        self.mcu_uart.set_poll_entry(self.index, mask, zero_mask, last_value)
+    def stop(self):
+        self.mcu_uart.clear_poll_entry(self.index)
@@ -0,0 +1,169 @@
+# Continuous accelerometer based vibration monitoring
+#
+# Copyright (C) 2026  agent <agent@local>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import logging, math
+
+# Only summary statistics of each accelerometer batch are retained, so
+# the monitor may run for the duration of a print.  The "rms" value of
+# an axis is calculated after removing the average (so gravity and a
+# constant tilt of the sensor are ignored) and "peak" is the largest
+# deviation from that average during the interval.
+AXES = ('x', 'y', 'z')
+
+class VibrationMonitor:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.reactor = self.printer.get_reactor()
+        self.gcode = self.printer.lookup_object('gcode')
+        self.chip_name = config.get('accel_chip').strip()
+        self.interval = config.getfloat('interval', 1., minval=0.100)
+        self.max_rms = config.getfloat('max_rms', 0., minval=0.)
+        self.max_peak = config.getfloat('max_peak', 0., minval=0.)
+        self.event_delay = config.getfloat('event_delay', 10., minval=0.)
+        self.threshold_gcode = None
+        if config.get('threshold_gcode', None) is not None:
+            gcode_macro = self.printer.load_object(config, 'gcode_macro')
+            self.threshold_gcode = gcode_macro.load_template(
+                config, 'threshold_gcode')
+        self.enable_on_start = config.getboolean('enable', False)
+        # Internal state
+        self.chip = None
+        self.aclient = None
+        self.window_end = None
+        self.count = 0
+        self.sums = [0.] * 3
+        self.sq_sums = [0.] * 3
+        self.mins = [None] * 3
+        self.maxs = [None] * 3
+        self.last_rms = [0.] * 3
+        self.last_peak = [0.] * 3
+        self.exceed_count = 0
+        self.min_event_systime = 0.
+        # Register commands and event handlers
+        self.printer.register_event_handler("klippy:connect",
+                                            self._handle_connect)
+        self.printer.register_event_handler("klippy:ready",
+                                            self._handle_ready)
+        self.gcode.register_command("VIBRATION_MONITOR",
+                                    self.cmd_VIBRATION_MONITOR,
+                                    desc=self.cmd_VIBRATION_MONITOR_help)
+    def _handle_connect(self):
+        self.chip = self.printer.lookup_object(self.chip_name, None)
+        if self.chip is None or not hasattr(self.chip,
+                                            'start_internal_client'):
+            raise self.printer.config_error(
+                "vibration_monitor accel_chip '%s' is not an accelerometer"
+                % (self.chip_name,))
+    def _handle_ready(self):
+        if self.enable_on_start:
+            self.reactor.register_callback(self._start_event)
+    def _start_event(self, eventtime):
+        try:
+            self._start()
+        except self.printer.command_error as e:
+            logging.warning("vibration_monitor: unable to start: %s", str(e))
+    # Start and stop monitoring
+    def _start(self):
+        if self.aclient is not None:
+            return
+        self._reset_window()
+        self.window_end = None
+        self.aclient = self.chip.start_internal_client()
+        self.aclient.set_batch_callback(self._handle_batch, keep_msgs=False)
+    def _stop(self):
+        if self.aclient is None:
+            return
+        # Stop the helper on the next batch (without waiting for moves)
+        self.aclient.is_finished = True
+        self.aclient = None
+    # Statistics tracking
+    def _reset_window(self):
+        self.count = 0
+        for i in range(3):
+            self.sums[i] = self.sq_sums[i] = 0.
+            self.mins[i] = self.maxs[i] = None
+    def _handle_batch(self, msg):
+        data = msg['data']
+        if not data:
+            return
+        if self.window_end is None:
+            self.window_end = data[0][0] + self.interval
+        sums, sq_sums = self.sums, self.sq_sums
+        mins, maxs = self.mins, self.maxs
+        for i in range(3):
+            vals = [s[i+1] for s in data]
+            sums[i] += sum(vals)
+            sq_sums[i] += sum([v*v for v in vals])
+            lo, hi = min(vals), max(vals)
+            if mins[i] is None or lo < mins[i]:
+                mins[i] = lo
+            if maxs[i] is None or hi > maxs[i]:
+                maxs[i] = hi
+        self.count += len(data)
+        last_time = data[-1][0]
+        if last_time >= self.window_end:
+            self._finish_window()
+            self.window_end = last_time + self.interval
+    def _finish_window(self):
+        count = self.count
+        for i in range(3):
+            avg = self.sums[i] / count
+            var = self.sq_sums[i] / count - avg * avg
+            self.last_rms[i] = math.sqrt(max(0., var))
+            self.last_peak[i] = max(self.maxs[i] - avg, avg - self.mins[i])
+        self._reset_window()
+        self._check_thresholds()
+    def _check_thresholds(self):
+        exceeded = []
+        for i, axis in enumerate(AXES):
+            rms, peak = self.last_rms[i], self.last_peak[i]
+            if ((self.max_rms and rms > self.max_rms)
+                or (self.max_peak and peak > self.max_peak)):
+                exceeded.append("%s(rms=%.1f peak=%.1f)" % (axis, rms, peak))
+        if not exceeded:
+            return
+        self.exceed_count += 1
+        eventtime = self.reactor.monotonic()
+        if eventtime < self.min_event_systime:
+            return
+        self.min_event_systime = eventtime + self.event_delay
+        msg = "Vibration limit exceeded: %s" % (' '.join(exceeded),)
+        logging.warning("vibration_monitor: %s", msg)
+        self.printer.send_event("vibration_monitor:threshold", eventtime,
+                                self.get_status(eventtime))
+        if self.threshold_gcode is not None:
+            self.reactor.register_callback(self._threshold_event)
+    def _threshold_event(self, eventtime):
+        try:
+            self.gcode.run_script(self.threshold_gcode.render())
+        except Exception:
+            logging.exception("vibration_monitor: Script running error")
+    def get_status(self, eventtime):
+        return {'enabled': self.aclient is not None,
+                'rms': dict(zip(AXES, self.last_rms)),
+                'peak': dict(zip(AXES, self.last_peak)),
+                'exceed_count': self.exceed_count}
+    cmd_VIBRATION_MONITOR_help = "Start, stop, or query vibration monitoring"
+    def cmd_VIBRATION_MONITOR(self, gcmd):
+        enable = gcmd.get_int('ENABLE', None, minval=0, maxval=1)
+        self.max_rms = gcmd.get_float('MAX_RMS', self.max_rms, minval=0.)
+        self.max_peak = gcmd.get_float('MAX_PEAK', self.max_peak, minval=0.)
+        if gcmd.get_int('RESET', 0, minval=0, maxval=1):
+            self.exceed_count = 0
+        if enable is not None:
+            if enable:
+                self._start()
+            else:
+                self._stop()
+        state = "enabled" if self.aclient is not None else "disabled"
+        gcmd.respond_info(
+            "vibration_monitor: %s max_rms=%.1f max_peak=%.1f exceeded=%d\n"
+            "rms (x, y, z): %.1f, %.1f, %.1f\n"
+            "peak (x, y, z): %.1f, %.1f, %.1f"
+            % ((state, self.max_rms, self.max_peak, self.exceed_count)
+               + tuple(self.last_rms) + tuple(self.last_peak)))
+
+def load_config(config):
+    return VibrationMonitor(config)
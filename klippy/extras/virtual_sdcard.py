@@ -3,9 +3,110 @@
 # Copyright (C) 2018-2024  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, sys, logging, io
+import os, sys, logging, io, mmap, struct, re, json, threading
 
-VALID_GCODE_EXTS = ['gcode', 'g', 'gco']
+VALID_GCODE_EXTS = ['gcode', 'g', 'gco', 'kgc']
+BATCH_SIZE = 8192
+
+# Binary "compiled" g-code files (see scripts/compile_gcode.py) start
+# with a header followed by a list of records.  A move record is the
+# opcode, the command (an index into BINARY_MOVE_CMDS), and a bitmap
+# of the present BINARY_MOVE_PARAMS followed by each param as a
+# little-endian double.  A text record is the opcode, a 16bit length,
+# and a line of utf-8 text (used for all other commands).
+BINARY_MAGIC = b"KGCB\x01\x00\x00\x00"
+BINARY_OP_MOVE, BINARY_OP_TEXT = 1, 2
+BINARY_MOVE_CMDS = ['G0', 'G1']
+BINARY_MOVE_PARAMS = 'XYZEF'
+binary_move_hdr = struct.Struct('<BBB')
+binary_text_hdr = struct.Struct('<BH')
+binary_move_info = [
+    ([p for i, p in enumerate(BINARY_MOVE_PARAMS) if mask & (1 << i)],
+     struct.Struct('<' + 'd' * bin(mask).count('1')))
+    for mask in range(1 << len(BINARY_MOVE_PARAMS))]
+BINARY_MAX_RECORD = binary_text_hdr.size + 0xffff
+
+# Encode a parsed G0/G1 command (or return None if not possible)
+def encode_binary_move(cmd, params):
+    if cmd not in BINARY_MOVE_CMDS:
+        return None
+    mask = 0
+    for p in params:
+        if p not in BINARY_MOVE_PARAMS:
+            return None
+        mask |= 1 << BINARY_MOVE_PARAMS.index(p)
+    pnames, pstruct = binary_move_info[mask]
+    return (binary_move_hdr.pack(BINARY_OP_MOVE,
+                                 BINARY_MOVE_CMDS.index(cmd), mask)
+            + pstruct.pack(*[params[p] for p in pnames]))
+
+def encode_binary_text(line):
+    data = line.encode('utf-8')
+    return binary_text_hdr.pack(BINARY_OP_TEXT, len(data)) + data
+
+# Layer index of a text g-code file.  Layer changes are found from
+# the slicer markers and the height of each layer is the first Z of a
+# G0/G1 command after the marker.  The index is built from a
+# background thread (in chunks, so the gcode regexes never hold the
+# python GIL for long) and cached in a hidden file next to the g-code
+# file (when the directory is writable).
+INDEX_CHUNK_SIZE = 1 << 20
+INDEX_SEARCH_SIZE = 4096
+layer_marker_r = re.compile(
+    br'^(?:;LAYER_CHANGE|;LAYER:|SET_PRINT_STATS_INFO .*CURRENT_LAYER=)',
+    re.MULTILINE | re.IGNORECASE)
+move_z_r = re.compile(br'^G[01][ \t][^;\n]*Z[ \t]*([-+]?[0-9.]+)',
+                      re.MULTILINE | re.IGNORECASE)
+move_e_r = re.compile(br'^G[01][ \t][^;\n]*E[ \t]*([-+]?[0-9.]+)',
+                      re.MULTILINE | re.IGNORECASE)
+
+def get_index_filename(fname):
+    dirname, basename = os.path.split(fname)
+    return os.path.join(dirname, '.' + basename + '.index')
+
+def build_file_index(fname):
+    # Return a list of (file_position, z) for each layer of a g-code file
+    # (the file is read, not mapped, as it may be truncated at any time)
+    layers = []
+    with open(fname, 'rb') as f:
+        data = f.read(INDEX_CHUNK_SIZE)
+        if data[:len(BINARY_MAGIC)] == BINARY_MAGIC:
+            return layers
+        base = 0
+        while data:
+            # Keep the next chunk available for the search of layer heights
+            more = f.read(INDEX_CHUNK_SIZE)
+            data += more
+            end = len(data)
+            if more:
+                end = data.rfind(b'\n', 0, end - len(more)) + 1
+                if not end:
+                    end = len(data) - len(more)
+            for m in layer_marker_r.finditer(data, 0, end):
+                zm = move_z_r.search(data, m.start(),
+                                     m.start() + INDEX_CHUNK_SIZE)
+                if zm is not None:
+                    layers.append((base + m.start(), float(zm.group(1))))
+            data = data[end:]
+            base += end
+    return layers
+
+def load_file_index(fname):
+    try:
+        st = os.stat(fname)
+        with open(get_index_filename(fname), 'r') as f:
+            data = json.load(f)
+        if data['size'] == st.st_size and data['mtime'] == st.st_mtime:
+            return [tuple(l) for l in data['layers']]
+    except (IOError, OSError, ValueError, KeyError, TypeError):
+        pass
+    return None
+
+def save_file_index(fname, layers):
+    st = os.stat(fname)
+    data = {'size': st.st_size, 'mtime': st.st_mtime, 'layers': layers}
+    with open(get_index_filename(fname), 'w') as f:
+        json.dump(data, f)
 
 DEFAULT_ERROR_GCODE = """
 {% if 'heaters' in printer %}
@@ -30,6 +131,9 @@ class VirtualSD:
         self.must_pause_work = self.cmd_from_sd = False
         self.next_file_position = 0
         self.work_timer = None
+        # File index
+        self.file_index = None
+        self.index_thread = None
         # Error handling
         gcode_macro = self.printer.load_object(config, 'gcode_macro')
         self.on_error_gcode = gcode_macro.load_template(
@@ -46,6 +150,9 @@ class VirtualSD:
         self.gcode.register_command(
             "SDCARD_PRINT_FILE", self.cmd_SDCARD_PRINT_FILE,
             desc=self.cmd_SDCARD_PRINT_FILE_help)
+        self.gcode.register_command(
+            "SDCARD_SEEK", self.cmd_SDCARD_SEEK,
+            desc=self.cmd_SDCARD_SEEK_help)
     def handle_shutdown(self):
         if self.work_timer is not None:
             self.must_pause_work = True
@@ -135,6 +242,7 @@ class VirtualSD:
             self.current_file.close()
             self.current_file = None
         self.file_position = self.file_size = 0
+        self.file_index = None
         self.print_stats.reset()
         self.printer.send_event("virtual_sdcard:reset_file")
     cmd_SDCARD_RESET_FILE_help = "Clears a loaded SD File. Stops the print "\
@@ -196,6 +304,57 @@ class VirtualSD:
         self.file_position = 0
         self.file_size = fsize
         self.print_stats.set_current_file(filename)
+        self._start_index(fname)
+    # File layer index
+    def _start_index(self, fname):
+        self.file_index = load_file_index(fname)
+        if self.file_index is not None or self.index_thread is not None:
+            return
+        self.index_thread = threading.Thread(target=self._bg_index,
+                                             args=(fname,))
+        self.index_thread.daemon = True
+        self.index_thread.start()
+    def _bg_index(self, fname):
+        layers = None
+        try:
+            layers = build_file_index(fname)
+        except:
+            logging.exception("virtual_sdcard index '%s'", fname)
+        else:
+            try:
+                save_file_index(fname, layers)
+            except (IOError, OSError):
+                logging.info("virtual_sdcard: unable to save index of '%s'",
+                             fname)
+        self.reactor.register_async_callback(
+            (lambda e: self._index_done(fname, layers)))
+    def _index_done(self, fname, layers):
+        self.index_thread = None
+        logging.info("virtual_sdcard: indexed %s layers in '%s'",
+                     None if layers is None else len(layers), fname)
+        if self.file_path() != fname:
+            # A different file was selected while indexing
+            if self.current_file is not None:
+                self._start_index(self.file_path())
+            return
+        self.file_index = layers
+    def _find_last_e(self, f, pos):
+        # Search backwards for the last extruder position before 'pos'
+        end = pos
+        while end > 0:
+            start = max(0, end - INDEX_SEARCH_SIZE)
+            f.seek(start)
+            data = f.read(end - start)
+            if start:
+                # Skip the partial line at the start of the block
+                skip = data.find(b'\n') + 1
+                data = data[skip:] if skip else b''
+                start += skip
+            found = move_e_r.findall(data)
+            if found:
+                return float(found[-1])
+            end = start
+        return None
     def cmd_M24(self, gcmd):
         # Start/resume SD print
         self.do_resume()
@@ -208,6 +367,38 @@ class VirtualSD:
             raise gcmd.error("SD busy")
         pos = gcmd.get_int('S', minval=0)
         self.file_position = pos
+    cmd_SDCARD_SEEK_help = "Set the SD position to the start of a layer"
+    def cmd_SDCARD_SEEK(self, gcmd):
+        if self.work_timer is not None:
+            raise gcmd.error("SD busy")
+        if self.current_file is None:
+            raise gcmd.error("No SD file loaded")
+        layers = self.file_index
+        if layers is None:
+            if self.index_thread is not None:
+                raise gcmd.error("SD file index not yet available")
+            raise gcmd.error("SD file index not available")
+        z = gcmd.get_float('Z', None)
+        if z is None:
+            gcmd.respond_info("SD file has %d indexed layers" % (len(layers),))
+            return
+        for layer_num, (pos, layer_z) in enumerate(layers):
+            if layer_z >= z - 0.000001:
+                break
+        else:
+            raise gcmd.error("No layer at Z=%.3f" % (z,))
+        last_e = None
+        try:
+            with open(self.file_path(), 'rb') as f:
+                last_e = self._find_last_e(f, pos)
+        except:
+            logging.exception("virtual_sdcard seek extruder search")
+        self.file_position = pos
+        msg = ("SD position %d: layer %d (Z=%.3f)"
+               % (pos, layer_num + 1, layer_z))
+        if last_e is not None:
+            msg += " last E=%.5f" % (last_e,)
+        gcmd.respond_info(msg)
     def cmd_M27(self, gcmd):
         # Report SD print status
         if self.current_file is None:
@@ -232,24 +423,184 @@ class VirtualSD:
             self.work_timer = None
             return self.reactor.NEVER
         self.print_stats.note_start()
+        fmap = None
+        if self.file_size:
+            try:
+                fmap = mmap.mmap(self.current_file.fileno(), 0,
+                                 access=mmap.ACCESS_READ)
+            except:
+                logging.exception("virtual_sdcard mmap")
+        if fmap is not None:
+            error_message = self._work_mmap(fmap)
+            fmap.close()
+        elif self._is_binary_file():
+            # Binary files can only be dispatched from a mapping
+            error_message = "Unable to map binary gcode file"
+        else:
+            error_message = self._work_read()
+        logging.info("Exiting SD card print (position %d)", self.file_position)
+        self.work_timer = None
+        self.cmd_from_sd = False
+        if error_message is not None:
+            self.print_stats.note_error(error_message)
+        elif self.current_file is not None:
+            self.print_stats.note_pause()
+        else:
+            self.print_stats.note_complete()
+        return self.reactor.NEVER
+    def _is_binary_file(self):
+        try:
+            with open(self.file_path(), 'rb') as f:
+                return f.read(len(BINARY_MAGIC)) == BINARY_MAGIC
+        except (IOError, OSError):
+            return False
+    def _finish_file(self):
+        self.current_file.close()
+        self.current_file = None
+        logging.info("Finished SD card print")
+        self.gcode.respond_raw("Done printing file")
+    def _run_on_error(self):
+        try:
+            self.gcode.run_script(self.on_error_gcode.render())
+        except:
+            logging.exception("virtual_sdcard on_error")
+    def _mmap_lines(self, fmap, batch_end):
+        # Generate the lines of a batch while tracking the file position.
+        # The batch is copied from the mapping before any line is run.
+        gcode_mutex = self.gcode.get_mutex()
+        is_py3 = sys.version_info.major >= 3
+        start = self.file_position
+        end = fmap.find(b'\n', max(start, batch_end - 1)) + 1
+        if not end:
+            end = fmap.rfind(b'\n', start) + 1
+        data = fmap[start:end]
+        pos = 0
+        while 1:
+            eol = data.find(b'\n', pos)
+            if eol < 0:
+                return
+            line = data[pos:eol]
+            if is_py3:
+                line = line.decode()
+            next_file_position = start + eol + 1
+            self.next_file_position = next_file_position
+            self.cmd_from_sd = True
+            yield line
+            self.cmd_from_sd = False
+            self.file_position = self.next_file_position
+            # Do we need to skip around?
+            if self.next_file_position != next_file_position:
+                return
+            pos = eol + 1
+            # Release the gcode mutex if another request is pending
+            if (next_file_position >= batch_end or self.must_pause_work
+                or gcode_mutex.has_waiters()):
+                return
+    def _binary_commands(self, fmap, batch_end):
+        # Generate the commands of a batch from a binary file
+        gcode_mutex = self.gcode.get_mutex()
+        is_py3 = sys.version_info.major >= 3
+        move_hdr_size = binary_move_hdr.size
+        text_hdr_size = binary_text_hdr.size
+        # Copy the batch from the mapping (any record starting before
+        # batch_end is complete in the copy)
+        start = max(self.file_position, len(BINARY_MAGIC))
+        data = fmap[start:batch_end + BINARY_MAX_RECORD]
+        pos = 0
+        while pos < len(data):
+            op = ord(data[pos:pos+1])
+            if op == BINARY_OP_MOVE:
+                op, cmd, mask = binary_move_hdr.unpack_from(data, pos)
+                pnames, pstruct = binary_move_info[mask]
+                pos += move_hdr_size
+                params = dict(zip(pnames, pstruct.unpack_from(data, pos)))
+                item = (BINARY_MOVE_CMDS[cmd], params)
+                pos += pstruct.size
+            elif op == BINARY_OP_TEXT:
+                op, count = binary_text_hdr.unpack_from(data, pos)
+                pos += text_hdr_size
+                line = data[pos:pos+count]
+                if is_py3:
+                    line = line.decode()
+                item = (line, None)
+                pos += count
+            else:
+                raise self.gcode.error("Invalid binary gcode file (pos %d)"
+                                       % (start + pos,))
+            next_file_position = start + pos
+            self.next_file_position = next_file_position
+            self.cmd_from_sd = True
+            yield item
+            self.cmd_from_sd = False
+            self.file_position = self.next_file_position
+            # Do we need to skip around?
+            if self.next_file_position != next_file_position:
+                return
+            # Release the gcode mutex if another request is pending
+            if (next_file_position >= batch_end or self.must_pause_work
+                or gcode_mutex.has_waiters()):
+                return
+    def _work_mmap(self, fmap):
+        # Dispatch batches of lines from a memory mapped file
+        gcode_mutex = self.gcode.get_mutex()
+        is_binary = fmap[:len(BINARY_MAGIC)] == BINARY_MAGIC
+        while not self.must_pause_work:
+            # Pause if any other request is pending in the gcode class
+            if gcode_mutex.test():
+                self.reactor.pause(self.reactor.monotonic() + 0.100)
+                continue
+            # Pages past the end of a truncated file can not be accessed
+            # (SIGBUS) - check the file size before using the mapping
+            try:
+                fsize = os.fstat(self.current_file.fileno()).st_size
+            except:
+                logging.exception("virtual_sdcard fstat")
+                break
+            if fsize < len(fmap):
+                logging.error("virtual_sdcard: file truncated during print")
+                self._run_on_error()
+                return "File truncated during print"
+            if is_binary:
+                is_eof = self.file_position >= len(fmap)
+            else:
+                is_eof = fmap.find(b'\n', self.file_position) < 0
+            if is_eof:
+                # End of file
+                self._finish_file()
+                break
+            # Dispatch commands
+            batch_end = self.file_position + BATCH_SIZE
+            try:
+                if is_binary:
+                    self.gcode.run_parsed_batch(
+                        self._binary_commands(fmap, batch_end))
+                else:
+                    self.gcode.run_script_batch(
+                        self._mmap_lines(fmap, batch_end))
+            except self.gcode.error as e:
+                self._run_on_error()
+                return str(e)
+            except:
+                logging.exception("virtual_sdcard dispatch")
+                break
+            self.reactor.pause(self.reactor.NOW)
+        return None
+    def _work_read(self):
+        # Dispatch lines read (in chunks) from the file
         gcode_mutex = self.gcode.get_mutex()
         partial_input = ""
         lines = []
-        error_message = None
         while not self.must_pause_work:
             if not lines:
                 # Read more data
                 try:
-                    data = self.current_file.read(8192)
+                    data = self.current_file.read(BATCH_SIZE)
                 except:
                     logging.exception("virtual_sdcard read")
                     break
                 if not data:
                     # End of file
-                    self.current_file.close()
-                    self.current_file = None
-                    logging.info("Finished SD card print")
-                    self.gcode.respond_raw("Done printing file")
+                    self._finish_file()
                     break
                 lines = data.split('\n')
                 lines[0] = partial_input + lines[0]
@@ -272,12 +623,8 @@ class VirtualSD:
             try:
                 self.gcode.run_script(line)
             except self.gcode.error as e:
-                error_message = str(e)
-                try:
-                    self.gcode.run_script(self.on_error_gcode.render())
-                except:
-                    logging.exception("virtual_sdcard on_error")
-                break
+                self._run_on_error()
+                return str(e)
             except:
                 logging.exception("virtual_sdcard dispatch")
                 break
@@ -289,20 +636,10 @@ class VirtualSD:
                     self.current_file.seek(self.file_position)
                 except:
                     logging.exception("virtual_sdcard seek")
-                    self.work_timer = None
-                    return self.reactor.NEVER
+                    break
                 lines = []
                 partial_input = ""
-        logging.info("Exiting SD card print (position %d)", self.file_position)
-        self.work_timer = None
-        self.cmd_from_sd = False
-        if error_message is not None:
-            self.print_stats.note_error(error_message)
-        elif self.current_file is not None:
-            self.print_stats.note_pause()
-        else:
-            self.print_stats.note_complete()
-        return self.reactor.NEVER
+        return None
 
 def load_config(config):
     return VirtualSD(config)
@@ -8,12 +8,16 @@
 # for thermal expansion of the printer frame.
 
 import threading
+import chelper
 
 KELVIN_TO_CELSIUS = -273.15
+# Time over which a change in the kinematic z offset is applied
+KIN_RAMP_TIME = 2.
 
 class ZThermalAdjuster:
     def __init__(self, config):
         self.printer = config.get_printer()
+        self.reactor = self.printer.get_reactor()
         self.gcode = self.printer.lookup_object('gcode')
         self.lock = threading.Lock()
 
@@ -22,6 +26,11 @@ class ZThermalAdjuster:
             default=0)
         self.off_above_z = config.getfloat('z_adjust_off_above', 99999999.)
         self.max_z_adjust_mm = config.getfloat('max_z_adjustment', 99999999.)
+        self.kin_offset = None
+        if config.getboolean('kinematic_compensation', False):
+            self.kin_offset = KinematicZOffset(self.printer)
+        self.kin_target = 0.
+        self.is_printing = False
 
         # Register printer events
         self.printer.register_event_handler("klippy:connect",
@@ -73,6 +82,21 @@ class ZThermalAdjuster:
         z_stepper = kin.get_steppers()[steppers.index("stepper_z")]
         self.z_step_dist = z_stepper.get_step_dist()
 
+        if self.kin_offset is not None:
+            # Homing and probing moves use physical coordinates
+            for event in ["homing:home_rails_begin",
+                          "homing:homing_move_begin"]:
+                self.printer.register_event_handler(
+                    event, self._exit_kinematic_mode)
+            self.printer.register_event_handler("toolhead:set_position",
+                                                self._handle_set_position)
+            self.printer.register_event_handler("idle_timeout:printing",
+                                                self._handle_printing)
+            self.printer.register_event_handler("idle_timeout:ready",
+                                                self._handle_not_printing)
+            self.printer.register_event_handler("idle_timeout:idle",
+                                                self._handle_not_printing)
+
     def get_status(self, eventtime):
         return {
             'temperature': self.smoothed_temp,
@@ -90,9 +114,9 @@ class ZThermalAdjuster:
             self.ref_temp_override = False
             self.z_adjust_mm = 0.
 
-    def calc_adjust(self, pos):
-        'Z adjustment calculation'
-        if pos[2] < self.off_above_z:
+    def update_adjust(self, z):
+        'Update z_adjust_mm for the given toolhead Z height'
+        if z < self.off_above_z:
             delta_t = self.smoothed_temp - self.ref_temperature
 
             # Calculate Z adjustment
@@ -106,6 +130,10 @@ class ZThermalAdjuster:
                 self.z_adjust_mm = min([self.max_z_adjust_mm*sign,
                     adjust], key=abs)
 
+    def calc_adjust(self, pos):
+        'Z adjustment calculation'
+        self.update_adjust(pos[2])
+
         # Apply Z adjustment
         new_z = pos[2] + self.z_adjust_mm
         self.last_z_adjust_mm = self.z_adjust_mm
@@ -117,11 +145,20 @@ class ZThermalAdjuster:
         return [pos[0], pos[1], unadjusted_z] + pos[3:]
 
     def get_position(self):
+        if self.kin_offset is not None and self.kin_offset.is_active:
+            # Toolhead position does not include the adjustment
+            return self.next_transform.get_position()
         position = self.calc_unadjust(self.next_transform.get_position())
         self.last_position = self.calc_adjust(position)
         return position
 
     def move(self, newpos, speed):
+        if self.kin_offset is not None and self.adjust_enable:
+            # Adjustment is applied during step generation
+            if not self.kin_offset.is_active:
+                self._enter_kinematic_mode()
+            self.next_transform.move(newpos, speed)
+            return
         # don't apply to extrude only moves or when disabled
         if (newpos[0:2] == self.last_position[0:2]) or not self.adjust_enable:
             z = newpos[2] + self.last_z_adjust_mm
@@ -132,6 +169,70 @@ class ZThermalAdjuster:
             self.next_transform.move(adjusted_pos, speed)
         self.last_position[:] = newpos
 
+    def get_fused_transform(self):
+        if self.kin_offset is not None and self.kin_offset.is_active:
+            return None, self.next_transform
+        # Route moves through move()
+        return None, None
+
+    def _enter_kinematic_mode(self):
+        # Switch from adjusted toolhead coordinates to requested
+        # coordinates with the offset applied by the stepper kinematics
+        self.toolhead.flush_step_generation()
+        pos = self.toolhead.get_position()
+        z_adjust = self.z_adjust_mm
+        self.kin_target = self.last_z_adjust_mm = z_adjust
+        self.kin_offset.set_offset(z_adjust)
+        self.kin_offset.set_active(True)
+        pos[2] -= z_adjust
+        self.toolhead.set_position(pos)
+        gcode_move = self.printer.lookup_object('gcode_move')
+        gcode_move.update_move_transform()
+
+    def _exit_kinematic_mode(self, *args):
+        kin_offset = self.kin_offset
+        if kin_offset is None or not kin_offset.is_active:
+            return
+        self.toolhead.flush_step_generation()
+        pos = self.toolhead.get_position()
+        z_adjust = self.kin_target
+        self.z_adjust_mm = self.last_z_adjust_mm = z_adjust
+        kin_offset.set_active(False)
+        pos[2] += z_adjust
+        self.toolhead.set_position(pos)
+        gcode_move = self.printer.lookup_object('gcode_move')
+        gcode_move.update_move_transform()
+
+    def _handle_set_position(self):
+        kin_offset = self.kin_offset
+        if not kin_offset.is_active:
+            return
+        # Stepper positions were calculated without any pending ramps
+        # - apply the final offset now that step generation is flushed
+        kin_offset.set_offset(self.kin_target)
+        kin_offset.reset_positions(self.toolhead.get_position())
+
+    def _handle_printing(self, print_time):
+        self.is_printing = True
+
+    def _handle_not_printing(self, print_time):
+        self.is_printing = False
+
+    def _update_kin_offset(self, eventtime):
+        # Only schedule changes while printing so that the toolhead is
+        # not woken up from an idle state
+        kin_offset = self.kin_offset
+        if (not kin_offset.is_active or not self.adjust_enable
+            or not self.is_printing):
+            return
+        self.update_adjust(self.toolhead.get_position()[2])
+        z_adjust = self.z_adjust_mm
+        if z_adjust == self.kin_target:
+            return
+        self.kin_target = self.last_z_adjust_mm = z_adjust
+        self.toolhead.register_lookahead_callback(
+            (lambda pt: kin_offset.set_ramp(pt, pt + KIN_RAMP_TIME, z_adjust)))
+
     def temperature_callback(self, read_time, temp):
         'Called everytime the Z adjust thermistor is read'
         with self.lock:
@@ -143,6 +244,8 @@ class ZThermalAdjuster:
             self.smoothed_temp += temp_diff * adj_time
             self.measured_min = min(self.measured_min, self.smoothed_temp)
             self.measured_max = max(self.measured_max, self.smoothed_temp)
+        if self.kin_offset is not None and self.kin_offset.is_active:
+            self.reactor.register_async_callback(self._update_kin_offset)
 
     def get_temp(self, eventtime):
         return self.smoothed_temp, 0.
@@ -184,5 +287,44 @@ class ZThermalAdjuster:
 
     cmd_SET_Z_THERMAL_ADJUST_help = 'Set/query Z Thermal Adjust parameters.'
 
+class KinematicZOffset:
+    def __init__(self, printer):
+        self.printer = printer
+        self.is_active = False
+        self.offset_steppers = []
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.table = ffi_main.gc(ffi_lib.z_offset_alloc(),
+                                 ffi_lib.z_offset_free)
+        # Wrap the kinematics before other modules (eg, input_shaper)
+        printer.register_event_handler("klippy:mcu_identify",
+                                       self._handle_mcu_identify)
+    def _handle_mcu_identify(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        toolhead = self.printer.lookup_object('toolhead')
+        for s in toolhead.get_kinematics().get_steppers():
+            if s.get_trapq() is None:
+                continue
+            sk = s.get_stepper_kinematics()
+            zoffset_sk = ffi_main.gc(ffi_lib.zoffset_stepper_alloc(),
+                                     ffi_lib.free)
+            if ffi_lib.zoffset_stepper_set_sk(zoffset_sk, sk, self.table) < 0:
+                continue
+            s.set_stepper_kinematics(zoffset_sk)
+            self.offset_steppers.append((s, zoffset_sk, sk))
+    def set_ramp(self, start_time, end_time, z):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.z_offset_set_ramp(self.table, start_time, end_time, z)
+    def set_offset(self, z):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.z_offset_set_offset(self.table, z)
+    def set_active(self, is_active):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.is_active = is_active
+        for s, zoffset_sk, sk in self.offset_steppers:
+            ffi_lib.zoffset_stepper_set_active(zoffset_sk, is_active)
+    def reset_positions(self, pos):
+        for s, zoffset_sk, sk in self.offset_steppers:
+            s.set_position(pos)
+
 def load_config(config):
     return ZThermalAdjuster(config)
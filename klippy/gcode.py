@@ -10,6 +10,19 @@ class CommandError(Exception):
 
 Coord = collections.namedtuple('Coord', ('x', 'y', 'z', 'e'))
 
+# Parse a simple (upper case) command line that only contains numeric
+# parameters (eg, "G1 X10 Y20 F3000").  Returns a tuple of the command
+# and a dictionary of float parameters, or None for any other line.
+simple_r = re.compile(r'([A-Z][0-9]+)((?:\s*[A-Z]\s*[-+]?'
+                      r'(?:[0-9]+\.?[0-9]*|\.[0-9]+))*)\s*$')
+simple_args_r = re.compile(r'([A-Z])\s*([-+.0-9]+)')
+def parse_simple_command(uline):
+    m = simple_r.match(uline)
+    if m is None:
+        return None
+    params = { k: float(v) for k, v in simple_args_r.findall(m.group(2)) }
+    return m.group(1), params
+
 class GCodeCommand:
     error = CommandError
     def __init__(self, gcode, command, commandline, params, need_ack):
@@ -102,6 +115,7 @@ class GCodeDispatch:
         self.base_gcode_handlers = self.gcode_handlers = {}
         self.ready_gcode_handlers = {}
         self.mux_commands = {}
+        self.fast_handlers = {}
         self.gcode_help = {}
         self.status_commands = {}
         # Register commands needed before config file is loaded
@@ -160,6 +174,18 @@ class GCodeDispatch:
                 "mux command %s %s %s already registered (%s)" % (
                     cmd, key, value, prev_values))
         prev_values[value] = func
+    def register_fast_handler(self, cmd, func):
+        # The fast handler is invoked with a dictionary of float
+        # parameters for simple lines (eg, "G1 X10 Y20 F3000").  It is
+        # only used while the regular handler for 'cmd' (registered via
+        # register_command) is still active.  The fast handler may
+        # return False to defer to the regular handler.
+        handler = self.ready_gcode_handlers.get(cmd)
+        if handler is None:
+            raise self.printer.config_error(
+                "gcode command %s must be registered before fast handler"
+                % (cmd,))
+        self.fast_handlers[cmd] = (handler, func)
     def get_command_help(self):
         return dict(self.gcode_help)
     def get_status(self, eventtime):
@@ -188,6 +214,28 @@ class GCodeDispatch:
         self._respond_state("Ready")
     # Parse input into commands
     args_r = re.compile('([A-Z_]+|[A-Z*])')
+    def _process_fast_command(self, cmd, params, need_ack):
+        fast = self.fast_handlers.get(cmd)
+        if fast is None or self.gcode_handlers.get(cmd) is not fast[0]:
+            return False
+        try:
+            if fast[1](params) is False:
+                return False
+        except self.error as e:
+            self._respond_error(str(e))
+            self.printer.send_event("gcode:command_error")
+            if not need_ack:
+                raise
+        except:
+            msg = 'Internal error on command:"%s"' % (cmd,)
+            logging.exception(msg)
+            self.printer.invoke_shutdown(msg)
+            self._respond_error(msg)
+            if not need_ack:
+                raise
+        if need_ack:
+            self.respond_raw("ok")
+        return True
     def _process_commands(self, commands, need_ack=True):
         for line in commands:
             # Ignore comments and leading/trailing spaces
@@ -195,8 +243,14 @@ class GCodeDispatch:
             cpos = line.find(';')
             if cpos >= 0:
                 line = line[:cpos]
+            uline = line.upper()
+            # Check for simple lines that have a "fast path" handler
+            sc = parse_simple_command(uline)
+            if sc is not None and self._process_fast_command(sc[0], sc[1],
+                                                             need_ack):
+                continue
             # Break line into parts and determine command
-            parts = self.args_r.split(line.upper())
+            parts = self.args_r.split(uline)
             if ''.join(parts[:2]) == 'N':
                 # Skip line number at start of command
                 cmd = ''.join(parts[3:5]).strip()
@@ -228,6 +282,27 @@ class GCodeDispatch:
     def run_script(self, script):
         with self.mutex:
             self._process_commands(script.split('\n'), need_ack=False)
+    def run_script_batch(self, lines):
+        # Run a sequence of lines (which may be a generator) while
+        # holding the gcode mutex for the entire batch
+        with self.mutex:
+            self._process_commands(lines, need_ack=False)
+    def _process_parsed_commands(self, commands):
+        for cmd, params in commands:
+            if params is None:
+                # A regular line of text
+                self._process_commands([cmd], need_ack=False)
+            elif not self._process_fast_command(cmd, params, False):
+                # No active fast handler - convert back to text
+                line = cmd + "".join([" %s%.17f" % (k, v)
+                                      for k, v in params.items()])
+                self._process_commands([line], need_ack=False)
+    def run_parsed_batch(self, commands):
+        # Similar to run_script_batch(), but each item is a tuple of
+        # (cmd, params) as returned by parse_simple_command(), or a
+        # tuple of (line, None) for any other line
+        with self.mutex:
+            self._process_parsed_commands(commands)
     def get_mutex(self):
         return self.mutex
     def create_gcode_command(self, command, commandline, params):
@@ -366,6 +441,9 @@ class GCodeDispatch:
         gcmd.respond_info("\n".join(cmdhelp), log=False)
 
 # Support reading gcode from a pseudo-tty interface
+INPUT_READ_SIZE = 16384
+MAX_PENDING_LINES = 100
+
 class GCodeIO:
     def __init__(self, printer):
         self.printer = printer
@@ -410,7 +488,7 @@ class GCodeIO:
     def _process_data(self, eventtime):
         # Read input, separate by newline, and add to pending_commands
         try:
-            data = str(os.read(self.fd, 4096).decode())
+            data = str(os.read(self.fd, INPUT_READ_SIZE).decode())
         except (os.error, UnicodeDecodeError):
             logging.exception("Read g-code")
             return
@@ -431,13 +509,13 @@ class GCodeIO:
             pending_commands.append("")
         # Handle case where multiple commands pending
         if self.is_processing_data or len(pending_commands) > 1:
-            if len(pending_commands) < 20:
+            if len(pending_commands) < MAX_PENDING_LINES:
                 # Check for M112 out-of-order
                 for line in lines:
                     if self.m112_r.match(line) is not None:
                         self.gcode.cmd_M112(None)
             if self.is_processing_data:
-                if len(pending_commands) >= 20:
+                if len(pending_commands) >= MAX_PENDING_LINES:
                     # Stop reading input
                     self.reactor.unregister_fd(self.fd_handle)
                     self.fd_handle = None
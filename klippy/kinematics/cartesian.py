@@ -36,7 +36,7 @@ class CartKinematics:
                         'safe_distance', None, minval=0.))
         for s in self.get_steppers():
             s.set_trapq(toolhead.get_trapq())
-            toolhead.register_step_generator(s.generate_steps)
+            toolhead.register_stepper(s)
         # Setup boundary checks
         max_velocity, max_accel = toolhead.get_max_velocity()
         self.max_z_velocity = config.getfloat('max_z_velocity', max_velocity,
@@ -44,6 +44,7 @@ class CartKinematics:
         self.max_z_accel = config.getfloat('max_z_accel', max_accel,
                                            above=0., maxval=max_accel)
         self.limits = [(1.0, -1.0)] * 3
+        self.concurrent_homing = config.getboolean('concurrent_homing', False)
     def get_steppers(self):
         return [s for rail in self.rails for s in rail.get_steppers()]
     def calc_position(self, stepper_positions):
@@ -74,22 +75,46 @@ class CartKinematics:
         for axis, axis_name in enumerate("xyz"):
             if axis_name in clear_axes:
                 self.limits[axis] = (1.0, -1.0)
-    def home_axis(self, homing_state, axis, rail):
+    def _calc_homing_pos(self, axis, rail, forcepos, homepos):
         # Determine movement
         position_min, position_max = rail.get_range()
         hi = rail.get_homing_info()
-        homepos = [None, None, None, None]
-        homepos[axis] = hi.position_endstop
-        forcepos = list(homepos)
+        homepos[axis] = forcepos[axis] = hi.position_endstop
         if hi.positive_dir:
             forcepos[axis] -= 1.5 * (hi.position_endstop - position_min)
         else:
             forcepos[axis] += 1.5 * (position_max - hi.position_endstop)
+    def home_axis(self, homing_state, axis, rail):
+        homepos = [None, None, None, None]
+        forcepos = list(homepos)
+        self._calc_homing_pos(axis, rail, forcepos, homepos)
         # Perform homing
         homing_state.home_rails([rail], forcepos, homepos)
+    def _can_home_xy(self, axes):
+        if (not self.concurrent_homing or self.dc_module is not None
+            or 0 not in axes or 1 not in axes):
+            return False
+        # Both rails must use the same homing speeds and retract distance
+        his = [rail.get_homing_info() for rail in self.rails[:2]]
+        return all([getattr(his[0], n) == getattr(his[1], n)
+                    for n in ['speed', 'second_homing_speed',
+                              'retract_dist', 'retract_speed']])
+    def _home_xy(self, homing_state):
+        # The x and y rails are independent - home them with one move
+        homepos = [None, None, None, None]
+        forcepos = list(homepos)
+        for axis in (0, 1):
+            self._calc_homing_pos(axis, self.rails[axis], forcepos, homepos)
+        homing_state.home_rails(self.rails[:2], forcepos, homepos)
     def home(self, homing_state):
+        axes = homing_state.get_axes()
+        home_xy = self._can_home_xy(axes)
         # Each axis is homed independently and in order
-        for axis in homing_state.get_axes():
+        for axis in axes:
+            if home_xy and axis in (0, 1):
+                if axis == [a for a in axes if a in (0, 1)][0]:
+                    self._home_xy(homing_state)
+                continue
             if self.dc_module is not None and axis == self.dual_carriage_axis:
                 self.dc_module.home(homing_state, self.dual_carriage_axis)
             else:
@@ -104,17 +129,19 @@ class CartKinematics:
                     raise move.move_error("Must home axis first")
                 raise move.move_error()
     def check_move(self, move):
-        limits = self.limits
-        xpos, ypos = move.end_pos[:2]
-        if (xpos < limits[0][0] or xpos > limits[0][1]
-            or ypos < limits[1][0] or ypos > limits[1][1]):
+        end_pos = move.end_pos
+        xpos, ypos = end_pos[0], end_pos[1]
+        xlimit, ylimit = self.limits[0], self.limits[1]
+        if (xpos < xlimit[0] or xpos > xlimit[1]
+            or ypos < ylimit[0] or ypos > ylimit[1]):
             self._check_endstops(move)
-        if not move.axes_d[2]:
+        axis_d_z = move.axes_d[2]
+        if not axis_d_z:
             # Normal XY move - use defaults
             return
         # Move with Z - update velocity and accel for slower Z axis
         self._check_endstops(move)
-        z_ratio = move.move_d / abs(move.axes_d[2])
+        z_ratio = move.move_d / abs(axis_d_z)
         move.limit_speed(
             self.max_z_velocity * z_ratio, self.max_z_accel * z_ratio)
     def get_status(self, eventtime):
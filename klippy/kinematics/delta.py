@@ -4,7 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math, logging
-import stepper, mathutil
+import stepper, mathutil, chelper
 
 # Slow moves once the ratio of tower to XY movement exceeds SLOW_RATIO
 SLOW_RATIO = 3.
@@ -50,9 +50,16 @@ class DeltaKinematics:
                        for angle in self.angles]
         for r, a, t in zip(self.rails, self.arm2, self.towers):
             r.setup_itersolve('delta_stepper_alloc', a, t[0], t[1])
+        interp_error = config.getfloat('interpolation_error', 0.,
+                                       minval=0., maxval=.001)
+        if interp_error:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            for s in self.get_steppers():
+                ffi_lib.delta_stepper_set_interpolation(
+                    s.get_stepper_kinematics(), interp_error)
         for s in self.get_steppers():
             s.set_trapq(toolhead.get_trapq())
-            toolhead.register_step_generator(s.generate_steps)
+            toolhead.register_stepper(s)
         # Setup boundary checks
         self.need_home = True
         self.limit_xy2 = -1.
@@ -11,7 +11,10 @@ class ExtruderStepper:
         self.printer = config.get_printer()
         self.name = config.get_name().split()[-1]
         self.pressure_advance = self.pressure_advance_smooth_time = 0.
+        self.pressure_advance_quad = 0.
         self.config_pa = config.getfloat('pressure_advance', 0., minval=0.)
+        self.config_pa_quad = config.getfloat('pressure_advance_quadratic',
+                                              0.)
         self.config_smooth_time = config.getfloat(
                 'pressure_advance_smooth_time', 0.040, above=0., maxval=.200)
         # Setup stepper
@@ -20,6 +23,8 @@ class ExtruderStepper:
         self.sk_extruder = ffi_main.gc(ffi_lib.extruder_stepper_alloc(),
                                        ffi_lib.extruder_stepper_free)
         self.stepper.set_stepper_kinematics(self.sk_extruder)
+        self.sk_shaper = None
+        self.shaper_delay = self.step_gen_delay = 0.
         self.motion_queue = None
         # Register commands
         self.printer.register_event_handler("klippy:connect",
@@ -40,10 +45,12 @@ class ExtruderStepper:
                                    desc=self.cmd_SYNC_EXTRUDER_MOTION_help)
     def _handle_connect(self):
         toolhead = self.printer.lookup_object('toolhead')
-        toolhead.register_step_generator(self.stepper.generate_steps)
-        self._set_pressure_advance(self.config_pa, self.config_smooth_time)
+        toolhead.register_stepper(self.stepper)
+        self._set_pressure_advance(self.config_pa, self.config_pa_quad,
+                                   self.config_smooth_time)
     def get_status(self, eventtime):
         return {'pressure_advance': self.pressure_advance,
+                'pressure_advance_quadratic': self.pressure_advance_quad,
                 'smooth_time': self.pressure_advance_smooth_time,
                 'motion_queue': self.motion_queue}
     def find_past_position(self, print_time):
@@ -63,24 +70,53 @@ class ExtruderStepper:
         self.stepper.set_position([extruder.last_position, 0., 0.])
         self.stepper.set_trapq(extruder.get_trapq())
         self.motion_queue = extruder_name
-    def _set_pressure_advance(self, pressure_advance, smooth_time):
-        old_smooth_time = self.pressure_advance_smooth_time
-        if not self.pressure_advance:
-            old_smooth_time = 0.
+    def _note_step_generation_delay(self):
+        pa_delay = 0.
+        if self.pressure_advance or self.pressure_advance_quad:
+            pa_delay = self.pressure_advance_smooth_time * .5
+        delay = pa_delay + self.shaper_delay
+        if delay != self.step_gen_delay:
+            toolhead = self.printer.lookup_object("toolhead")
+            toolhead.note_step_generation_scan_time(
+                    delay, old_delay=self.step_gen_delay)
+            self.step_gen_delay = delay
+    def _set_pressure_advance(self, pressure_advance, pressure_advance_quad,
+                              smooth_time):
         new_smooth_time = smooth_time
-        if not pressure_advance:
+        if not pressure_advance and not pressure_advance_quad:
             new_smooth_time = 0.
-        toolhead = self.printer.lookup_object("toolhead")
-        if new_smooth_time != old_smooth_time:
-            toolhead.note_step_generation_scan_time(
-                    new_smooth_time * .5, old_delay=old_smooth_time * .5)
-        ffi_main, ffi_lib = chelper.get_ffi()
-        espa = ffi_lib.extruder_set_pressure_advance
-        toolhead.register_lookahead_callback(
-            lambda print_time: espa(self.sk_extruder, print_time,
-                                    pressure_advance, new_smooth_time))
         self.pressure_advance = pressure_advance
+        self.pressure_advance_quad = pressure_advance_quad
         self.pressure_advance_smooth_time = smooth_time
+        self._note_step_generation_delay()
+        ffi_main, ffi_lib = chelper.get_ffi()
+        espa = ffi_lib.extruder_set_pressure_advance
+        def update_pa(print_time):
+            espa(self.sk_extruder, print_time, pressure_advance,
+                 pressure_advance_quad, new_smooth_time)
+            if self.sk_shaper is not None:
+                ffi_lib.input_shaper_update_sk(self.sk_shaper)
+        toolhead = self.printer.lookup_object("toolhead")
+        toolhead.register_lookahead_callback(update_pa)
+    def set_flow_factor(self, position, factor):
+        # Scale extrusion by 'factor' once the extruder reaches 'position'
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.extruder_set_flow_factor(self.sk_extruder, position, factor)
+    def set_input_shaper(self, shaper):
+        # Shape the extruder motion (the caller flushes step generation)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        if self.sk_shaper is None:
+            if not shaper.is_enabled():
+                return True
+            self.sk_shaper = ffi_main.gc(ffi_lib.input_shaper_alloc(),
+                                         ffi_lib.free)
+            ffi_lib.input_shaper_set_extruder_sk(self.sk_shaper,
+                                                 self.sk_extruder)
+            self.stepper.set_stepper_kinematics(self.sk_shaper)
+        success = shaper.set_shaper_kinematics(self.sk_shaper)
+        self.shaper_delay = shaper.get_step_generation_window()
+        self._note_step_generation_delay()
+        return success
     cmd_SET_PRESSURE_ADVANCE_help = "Set pressure advance parameters"
     def cmd_default_SET_PRESSURE_ADVANCE(self, gcmd):
         extruder = self.printer.lookup_object('toolhead').get_extruder()
@@ -93,13 +129,17 @@ class ExtruderStepper:
     def cmd_SET_PRESSURE_ADVANCE(self, gcmd):
         pressure_advance = gcmd.get_float('ADVANCE', self.pressure_advance,
                                           minval=0.)
+        pressure_advance_quad = gcmd.get_float('QUADRATIC',
+                                               self.pressure_advance_quad)
         smooth_time = gcmd.get_float('SMOOTH_TIME',
                                      self.pressure_advance_smooth_time,
                                      minval=0., maxval=.200)
-        self._set_pressure_advance(pressure_advance, smooth_time)
+        self._set_pressure_advance(pressure_advance, pressure_advance_quad,
+                                   smooth_time)
         msg = ("pressure_advance: %.6f\n"
+               "pressure_advance_quadratic: %.6f\n"
                "pressure_advance_smooth_time: %.6f"
-               % (pressure_advance, smooth_time))
+               % (pressure_advance, pressure_advance_quad, smooth_time))
         self.printer.set_rollover_info(self.name, "%s: %s" % (self.name, msg))
         gcmd.respond_info(msg, log=False)
     cmd_SET_E_ROTATION_DISTANCE_help = "Set extruder rotation distance"
@@ -207,8 +247,9 @@ class PrinterExtruder:
                 "Extrude below minimum temp\n"
                 "See the 'min_extrude_temp' config option for details")
         axis_r = move.axes_r[ea_index]
-        axis_d = move.axes_d[ea_index]
-        if (not move.axes_d[0] and not move.axes_d[1]) or axis_r < 0.:
+        axes_d = move.axes_d
+        axis_d = axes_d[ea_index]
+        if (not axes_d[0] and not axes_d[1]) or axis_r < 0.:
             # Extrude only move (or retraction move) - limit accel and velocity
             if abs(axis_d) > self.max_e_dist:
                 raise self.printer.command_error(
@@ -39,7 +39,7 @@ class HybridCoreXZKinematics:
                         'safe_distance', None, minval=0.))
         for s in self.get_steppers():
             s.set_trapq(toolhead.get_trapq())
-            toolhead.register_step_generator(s.generate_steps)
+            toolhead.register_stepper(s)
         # Setup boundary checks
         max_velocity, max_accel = toolhead.get_max_velocity()
         self.max_z_velocity = config.getfloat(
@@ -104,17 +104,19 @@ class HybridCoreXZKinematics:
                     raise move.move_error("Must home axis first")
                 raise move.move_error()
     def check_move(self, move):
-        limits = self.limits
-        xpos, ypos = move.end_pos[:2]
-        if (xpos < limits[0][0] or xpos > limits[0][1]
-            or ypos < limits[1][0] or ypos > limits[1][1]):
+        end_pos = move.end_pos
+        xpos, ypos = end_pos[0], end_pos[1]
+        xlimit, ylimit = self.limits[0], self.limits[1]
+        if (xpos < xlimit[0] or xpos > xlimit[1]
+            or ypos < ylimit[0] or ypos > ylimit[1]):
             self._check_endstops(move)
-        if not move.axes_d[2]:
+        axis_d_z = move.axes_d[2]
+        if not axis_d_z:
             # Normal XY move - use defaults
             return
         # Move with Z - update velocity and accel for slower Z axis
         self._check_endstops(move)
-        z_ratio = move.move_d / abs(move.axes_d[2])
+        z_ratio = move.move_d / abs(axis_d_z)
         move.limit_speed(
             self.max_z_velocity * z_ratio, self.max_z_accel * z_ratio)
     def get_status(self, eventtime):
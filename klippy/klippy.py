@@ -35,6 +35,7 @@ class Printer:
         self.run_result = None
         self.event_handlers = {}
         self.objects = collections.OrderedDict()
+        self.startup_times = []
         # Init printer components that must be setup prior to config
         for m in [gcode, webhooks]:
             m.add_early_printer_objects(self)
@@ -111,28 +112,50 @@ class Printer:
             raise self.config_error("Unable to load module '%s'" % (section,))
         self.objects[section] = init_func(config.getsection(section))
         return self.objects[section]
+    def _note_startup_time(self, name, start_time):
+        self.startup_times.append((self.reactor.monotonic() - start_time,
+                                   name))
+    def _log_startup_times(self, total_time):
+        times = sorted(self.startup_times, reverse=True)[:8]
+        logging.info("Startup timing: total=%.3fs %s", total_time,
+                     " ".join(["%s=%.3fs" % (n, t) for t, n in times]))
     def _read_config(self):
+        start_time = self.reactor.monotonic()
         self.objects['configfile'] = pconfig = configfile.PrinterConfig(self)
         config = pconfig.read_main_config()
         if self.bglogger is not None:
             pconfig.log_config(config)
+        self._note_startup_time("read_config", start_time)
         # Create printer components
         for m in [pins, mcu]:
+            start_time = self.reactor.monotonic()
             m.add_printer_objects(config)
+            self._note_startup_time(m.__name__, start_time)
         for section_config in config.get_prefix_sections(''):
+            start_time = self.reactor.monotonic()
             self.load_object(config, section_config.get_name(), None)
+            self._note_startup_time(section_config.get_name(), start_time)
         for m in [toolhead]:
+            start_time = self.reactor.monotonic()
             m.add_printer_objects(config)
+            self._note_startup_time(m.__name__, start_time)
         # Validate that there are no undefined parameters in the config file
         pconfig.check_unused_options(config)
     def _connect(self, eventtime):
+        self.startup_times = []
         try:
             self._read_config()
+            start_time = self.reactor.monotonic()
             self.send_event("klippy:mcu_identify")
+            self._note_startup_time("mcu_identify", start_time)
             for cb in self.event_handlers.get("klippy:connect", []):
                 if self.state_message is not message_startup:
                     return
+                start_time = self.reactor.monotonic()
                 cb()
+                self._note_startup_time(
+                    "connect:" + getattr(cb, '__module__', '?'), start_time)
+            self._log_startup_times(self.reactor.monotonic() - eventtime)
         except (self.config_error, pins.error) as e:
             logging.exception("Config error")
             self._set_state("%s\n%s" % (str(e), message_restart))
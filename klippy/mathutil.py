@@ -47,14 +47,14 @@ def coordinate_descent(adj_params, params, error_func):
                  best_err, rounds)
     return params
 
-# Helper to run the coordinate descent function in a background
-# process so that it does not block the main thread.
-def background_coordinate_descent(printer, adj_params, params, error_func):
+# Helper to run a calculation in a background process so that it
+# does not block the main thread.
+def background_calc(printer, func, args):
     parent_conn, child_conn = multiprocessing.Pipe()
     def wrapper():
         queuelogger.clear_bg_logging()
         try:
-            res = coordinate_descent(adj_params, params, error_func)
+            res = func(*args)
         except:
             child_conn.send((True, traceback.format_exc()))
             child_conn.close()
@@ -77,11 +77,120 @@ def background_coordinate_descent(printer, adj_params, params, error_func):
     # Return results
     is_err, res = parent_conn.recv()
     if is_err:
-        raise Exception("Error in coordinate descent: %s" % (res,))
+        raise Exception("Error in calibration calculation: %s" % (res,))
     calc_proc.join()
     parent_conn.close()
     return res
 
+# Helper to run the coordinate descent function in a background process
+def background_coordinate_descent(printer, adj_params, params, error_func):
+    return background_calc(printer, coordinate_descent,
+                           (adj_params, params, error_func))
+
+
+######################################################################
+# Least squares fitting
+######################################################################
+
+# Solve the linear system 'a * x = b' (returns None if singular)
+def solve_linear(a, b):
+    n = len(b)
+    m = [list(row) + [bv] for row, bv in zip(a, b)]
+    for col in range(n):
+        pivot = max(range(col, n), key=(lambda r: abs(m[r][col])))
+        if abs(m[pivot][col]) < 1e-300:
+            return None
+        m[col], m[pivot] = m[pivot], m[col]
+        prow = m[col]
+        for r in range(col + 1, n):
+            f = m[r][col] / prow[col]
+            if f:
+                row = m[r]
+                for c in range(col, n + 1):
+                    row[c] -= f * prow[c]
+    x = [0.] * n
+    for r in range(n - 1, -1, -1):
+        row = m[r]
+        x[r] = (row[n] - sum([row[c] * x[c] for c in range(r + 1, n)])
+                ) / row[r]
+    return x
+
+# Levenberg-Marquardt minimization of the sum of squared residuals.
+# The residual_func returns a list of residuals (or None if the
+# params are not valid).  Returns None if no solution was found.
+def levenberg_marquardt(adj_params, params, residual_func):
+    params = dict(params)
+    adj_params = list(adj_params)
+    res = residual_func(params)
+    if res is None:
+        return None
+    best_err = sum([r*r for r in res])
+    logging.info("Least squares initial error: %s", best_err)
+    damping = .001
+    rounds = 0
+    while rounds < 100 and best_err > 1e-30:
+        rounds += 1
+        # Estimate the jacobian with forward differences
+        jac = []
+        for param_name in adj_params:
+            orig = params[param_name]
+            step = 1e-7 * max(1., abs(orig))
+            params[param_name] = orig + step
+            dres = residual_func(params)
+            params[param_name] = orig
+            if dres is None:
+                return None
+            jac.append([(d - r) / step for d, r in zip(dres, res)])
+        jtj = [[sum([a*b for a, b in zip(ja, jb)]) for jb in jac]
+               for ja in jac]
+        jtr = [-sum([a*r for a, r in zip(ja, res)]) for ja in jac]
+        # Find a damping factor that reduces the error
+        while 1:
+            a = [list(row) for row in jtj]
+            for i in range(len(a)):
+                a[i][i] += damping * (jtj[i][i] or 1.)
+            delta = solve_linear(a, jtr)
+            if delta is not None:
+                new_params = dict(params)
+                for param_name, d in zip(adj_params, delta):
+                    new_params[param_name] += d
+                new_res = residual_func(new_params)
+                if new_res is not None:
+                    new_err = sum([r*r for r in new_res])
+                    if new_err < best_err:
+                        break
+            damping *= 10.
+            if damping > 1e10:
+                # No further improvement possible
+                logging.info("Least squares best_err: %s  rounds: %d",
+                             best_err, rounds)
+                return params
+        damping = max(damping * .1, 1e-12)
+        improvement = best_err - new_err
+        params, res, best_err = new_params, new_res, new_err
+        if improvement <= 1e-12 * best_err:
+            break
+    logging.info("Least squares best_err: %s  rounds: %d", best_err, rounds)
+    return params
+
+# Minimize the sum of squared residuals - uses coordinate descent if
+# the least squares solver is unable to find a solution.
+def least_squares(adj_params, params, residual_func):
+    res = levenberg_marquardt(adj_params, params, residual_func)
+    if res is not None:
+        return res
+    def error_func(params):
+        res = residual_func(params)
+        if res is None:
+            return 9999999999999.9
+        return sum([r*r for r in res])
+    return coordinate_descent(adj_params, params, error_func)
+
+# Helper to run the least squares function in a background process
+def background_least_squares(printer, adj_params, params, residual_func):
+    return background_calc(printer, least_squares,
+                           (adj_params, params, residual_func))
+
 
 ######################################################################
 # Trilateration
@@ -96,6 +96,8 @@ class CommandWrapper:
         self._serial.raw_send_wait_ack(cmd, minclock, reqclock, self._cmd_queue)
     def get_command_tag(self):
         return self._msgtag
+    def encode(self, data=()):
+        return self._cmd.encode(data)
 
 
 ######################################################################
@@ -212,6 +214,13 @@ class MCU_trsync:
                                           reqclock=expire_clock)
     def set_home_end_time(self, home_end_time):
         self._home_end_clock = self._mcu.print_time_to_clock(home_end_time)
+    def get_latency_stats(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        st = ffi_main.new('struct trdispatch_stats *')
+        ffi_lib.trdispatch_mcu_get_stats(self._trdispatch_mcu, st)
+        if not st.report_count:
+            return None
+        return st.latency_max, st.latency_sum / st.report_count
     def stop(self):
         self._mcu.register_response(None, "trsync_state", self._oid)
         self._trigger_completion = None
@@ -220,11 +229,13 @@ class MCU_trsync:
         params = self._trsync_query_cmd.send([self._oid,
                                               self.REASON_HOST_REQUEST])
         for s in self._steppers:
-            s.note_homing_end()
+            s.note_homing_end(query_position=False)
+        self._mcu.query_stepper_positions(self._steppers)
         return params['trigger_reason']
 
 TRSYNC_TIMEOUT = 0.025
 TRSYNC_SINGLE_MCU_TIMEOUT = 0.250
+TRSYNC_LATENCY_FACTOR = 4.
 
 class TriggerDispatch:
     def __init__(self, mcu):
@@ -233,6 +244,7 @@ class TriggerDispatch:
         ffi_main, ffi_lib = chelper.get_ffi()
         self._trdispatch = ffi_main.gc(ffi_lib.trdispatch_alloc(), ffi_lib.free)
         self._trsyncs = [MCU_trsync(mcu, self._trdispatch)]
+        self._link_latency = 0.
     def get_oid(self):
         return self._trsyncs[0].get_oid()
     def get_command_queue(self):
@@ -261,6 +273,11 @@ class TriggerDispatch:
         expire_timeout = TRSYNC_TIMEOUT
         if len(self._trsyncs) == 1:
             expire_timeout = TRSYNC_SINGLE_MCU_TIMEOUT
+        else:
+            # Allow extra time if status reports were slow to arrive
+            expire_timeout = min(max(expire_timeout, self._link_latency
+                                     * TRSYNC_LATENCY_FACTOR),
+                                 TRSYNC_SINGLE_MCU_TIMEOUT)
         for i, trsync in enumerate(self._trsyncs):
             report_offset = float(i) / len(self._trsyncs)
             trsync.start(print_time, report_offset,
@@ -275,10 +292,42 @@ class TriggerDispatch:
         if self._mcu.is_fileoutput():
             self._trigger_completion.complete(True)
         self._trigger_completion.wait()
+    def _note_latency(self):
+        msgs = []
+        max_latency = 0.
+        for trsync in self._trsyncs:
+            stats = trsync.get_latency_stats()
+            if stats is None:
+                continue
+            max_latency = max(max_latency, stats[0])
+            msgs.append("%s: max=%.6f avg=%.6f" % (
+                trsync.get_mcu().get_name(), stats[0], stats[1]))
+        if not msgs:
+            return
+        logging.info("trsync latency %s", " ".join(msgs))
+        self._link_latency = max(max_latency, self._link_latency * .5)
+    def _stop_trsync(self, trsync):
+        try:
+            return trsync.stop(), None
+        except Exception as e:
+            return None, e
     def stop(self):
         ffi_main, ffi_lib = chelper.get_ffi()
         ffi_lib.trdispatch_stop(self._trdispatch)
-        res = [trsync.stop() for trsync in self._trsyncs]
+        if len(self._trsyncs) > 1:
+            # Query each mcu concurrently
+            reactor = self._mcu.get_printer().get_reactor()
+            completions = [reactor.register_callback(
+                               (lambda e, t=trsync: self._stop_trsync(t)))
+                           for trsync in self._trsyncs]
+            results = [c.wait() for c in completions]
+            for r, err in results:
+                if err is not None:
+                    raise err
+            res = [r for r, err in results]
+            self._note_latency()
+        else:
+            res = [self._trsyncs[0].stop()]
         err_res = [r for r in res if r >= MCU_trsync.REASON_COMMS_TIMEOUT]
         if err_res:
             return err_res[0]
@@ -305,6 +354,14 @@ class MCU_endstop:
         # Setup config
         self._mcu.add_config_cmd("config_endstop oid=%d pin=%s pull_up=%d"
                                  % (self._oid, self._pin, self._pullup))
+        if self._mcu.get_endstop_irq():
+            if self._mcu.try_lookup_command(
+                    "config_endstop_irq oid=%c pin=%c") is None:
+                raise self._mcu.get_printer().config_error(
+                    "MCU '%s' does not support endstop_irq"
+                    % (self._mcu.get_name(),))
+            self._mcu.add_config_cmd("config_endstop_irq oid=%d pin=%s"
+                                     % (self._oid, self._pin))
         self._mcu.add_config_cmd(
             "endstop_home oid=%d clock=0 sample_ticks=0 sample_count=0"
             " rest_ticks=0 pin_value=0 trsync_oid=0 trigger_reason=0"
@@ -394,6 +451,11 @@ class MCU_digital_out:
         self._set_cmd.send([self._oid, clock, (not not value) ^ self._invert],
                            minclock=self._last_clock, reqclock=clock)
         self._last_clock = clock
+    def note_group_update(self, clock, value):
+        # Note an update sent via MCU.set_digital_outputs()
+        last_clock = self._last_clock
+        self._last_clock = clock
+        return self._oid, (not not value) ^ self._invert, last_clock
 
 class MCU_pwm:
     def __init__(self, mcu, pin_params):
@@ -494,8 +556,17 @@ class MCU_adc:
         self._oid = self._callback = None
         self._mcu.register_config_callback(self._build_config)
         self._inv_max_adc = 0.
+        self._allow_scan = True
     def get_mcu(self):
         return self._mcu
+    def get_oid(self):
+        return self._oid
+    def disable_scan(self):
+        # Always use a dedicated analog_in object (so its oid is known)
+        self._allow_scan = False
+    def calc_raw_value(self, value):
+        mcu_adc_max = self._mcu.get_constant_float("ADC_MAX")
+        return value * self._sample_count * mcu_adc_max
     def setup_adc_sample(self, sample_time, sample_count,
                          minval=0., maxval=1., range_check_count=0):
         self._sample_time = sample_time
@@ -508,21 +579,39 @@ class MCU_adc:
         self._callback = callback
     def get_last_value(self):
         return self._last_state
+    def get_scan_params(self):
+        # Pins with identical parameters may be sampled in one scan group
+        return (self._sample_time, self._sample_count, self._report_time,
+                self._range_check_count)
+    def get_pin(self):
+        return self._pin
+    def calc_sample_range(self):
+        mcu_adc_max = self._mcu.get_constant_float("ADC_MAX")
+        max_adc = self._sample_count * mcu_adc_max
+        self._inv_max_adc = 1.0 / max_adc
+        self._report_clock = self._mcu.seconds_to_clock(self._report_time)
+        min_sample = max(0, min(0xffff, int(self._min_sample * max_adc)))
+        max_sample = max(0, min(0xffff, int(
+            math.ceil(self._max_sample * max_adc))))
+        return min_sample, max_sample
     def _build_config(self):
         if not self._sample_count:
             return
+        adc_scan = None
+        if self._allow_scan:
+            adc_scan = self._mcu.get_adc_scan()
+        if adc_scan is not None:
+            # Configured (possibly as part of a group) by MCU_adc_scan
+            adc_scan.add_adc(self)
+            return
+        self.build_analog_in_config()
+    def build_analog_in_config(self):
         self._oid = self._mcu.create_oid()
         self._mcu.add_config_cmd("config_analog_in oid=%d pin=%s" % (
             self._oid, self._pin))
         clock = self._mcu.get_query_slot(self._oid)
         sample_ticks = self._mcu.seconds_to_clock(self._sample_time)
-        mcu_adc_max = self._mcu.get_constant_float("ADC_MAX")
-        max_adc = self._sample_count * mcu_adc_max
-        self._inv_max_adc = 1.0 / max_adc
-        self._report_clock = self._mcu.seconds_to_clock(self._report_time)
-        min_sample = max(0, min(0xffff, int(self._min_sample * max_adc)))
-        max_sample = max(0, min(0xffff, int(
-            math.ceil(self._max_sample * max_adc))))
+        min_sample, max_sample = self.calc_sample_range()
         self._mcu.add_config_cmd(
             "query_analog_in oid=%d clock=%d sample_ticks=%d sample_count=%d"
             " rest_ticks=%d min_value=%d max_value=%d range_check_count=%d" % (
@@ -532,14 +621,68 @@ class MCU_adc:
         self._mcu.register_response(self._handle_analog_in_state,
                                     "analog_in_state", self._oid)
     def _handle_analog_in_state(self, params):
-        last_value = params['value'] * self._inv_max_adc
-        next_clock = self._mcu.clock32_to_clock64(params['next_clock'])
+        self.note_adc_value(params['value'], params['next_clock'])
+    def note_adc_value(self, value, next_clock32):
+        last_value = value * self._inv_max_adc
+        next_clock = self._mcu.clock32_to_clock64(next_clock32)
         last_read_clock = next_clock - self._report_clock
         last_read_time = self._mcu.clock_to_print_time(last_read_clock)
         self._last_state = (last_value, last_read_time)
         if self._callback is not None:
             self._callback(last_read_time, last_value)
 
+# Sample analog pins that share sampling parameters in scan groups
+class MCU_adc_scan:
+    MAX_PINS = 16
+    def __init__(self, mcu):
+        self._mcu = mcu
+        self._adcs = []
+    def add_adc(self, adc):
+        if not self._adcs:
+            # Registered during config callback processing, so this runs
+            # after the callbacks of all MCU_adc objects
+            self._mcu.register_config_callback(self._build_config)
+        self._adcs.append(adc)
+    def _build_config(self):
+        groups = {}
+        for adc in self._adcs:
+            groups.setdefault(adc.get_scan_params(), []).append(adc)
+        for params, adcs in sorted(groups.items()):
+            for i in range(0, len(adcs), self.MAX_PINS):
+                group = adcs[i:i+self.MAX_PINS]
+                if len(group) == 1:
+                    group[0].build_analog_in_config()
+                    continue
+                self._build_group_config(params, group)
+    def _build_group_config(self, params, adcs):
+        sample_time, sample_count, report_time, range_check_count = params
+        mcu = self._mcu
+        oid = mcu.create_oid()
+        mcu.add_config_cmd("config_analog_scan oid=%d pin_count=%d"
+                           % (oid, len(adcs)))
+        for i, adc in enumerate(adcs):
+            min_sample, max_sample = adc.calc_sample_range()
+            mcu.add_config_cmd(
+                "config_analog_scan_pin oid=%d index=%d pin=%s"
+                " min_value=%d max_value=%d"
+                % (oid, i, adc.get_pin(), min_sample, max_sample))
+        clock = mcu.get_query_slot(oid)
+        sample_ticks = mcu.seconds_to_clock(sample_time)
+        report_clock = mcu.seconds_to_clock(report_time)
+        mcu.add_config_cmd(
+            "query_analog_scan oid=%d clock=%d sample_ticks=%d"
+            " sample_count=%d rest_ticks=%d range_check_count=%d" % (
+                oid, clock, sample_ticks, sample_count, report_clock,
+                range_check_count), is_init=True)
+        def handle_analog_scan_state(params):
+            values = bytearray(params['values'])
+            next_clock = params['next_clock']
+            for i, adc in enumerate(adcs):
+                value = values[i*2] | (values[i*2 + 1] << 8)
+                adc.note_adc_value(value, next_clock)
+        mcu.register_response(handle_analog_scan_state,
+                              "analog_scan_state", oid)
+
 
 ######################################################################
 # Main MCU class
@@ -549,6 +692,8 @@ class MCU_adc:
 MIN_SCHEDULE_TIME = 0.100
 # Maximum time all MCUs can internally schedule into the future
 MAX_NOMINAL_DURATION = 3.0
+# Maximum number of pins in a queue_digital_out_group message
+DIGITAL_OUT_GROUP_MAX = 16
 
 class MCU:
     error = error
@@ -582,6 +727,17 @@ class MCU:
         if self._baud:
             self._restart_method = config.getchoice('restart_method',
                                                     restart_methods, None)
+        # Optional binary capture of all message blocks
+        capture_file = config.get('message_capture', None)
+        if capture_file is not None:
+            capture_records = config.getint('message_capture_records', 65536,
+                                            minval=1)
+            self._serial.set_capture(os.path.expanduser(capture_file),
+                                     capture_records)
+        # Optional cache of the firmware data dictionary
+        dict_cache = config.get('dictionary_cache', None)
+        if dict_cache is not None:
+            self._serial.set_dictionary_cache(os.path.expanduser(dict_cache))
         self._reset_cmd = self._config_reset_cmd = None
         self._is_mcu_bridge = False
         self._emergency_stop_cmd = None
@@ -596,27 +752,35 @@ class MCU:
         self._restart_cmds = []
         self._init_cmds = []
         self._mcu_freq = 0.
+        self._adc_scan = None
+        self._get_positions_cmd = None
+        self._digital_group_cmd = None
         # Move command queuing
         ffi_main, self._ffi_lib = chelper.get_ffi()
         self._max_stepper_error = config.getfloat('max_stepper_error', 0.000025,
                                                   minval=0.)
+        self._endstop_irq = config.getboolean('endstop_irq', False)
         self._reserved_move_slots = 0
         self._stepqueues = []
         self._steppersync = None
         self._flush_callbacks = []
+        self._step_active_checks = []
         # Stats
         self._get_status_info = {}
         self._stats_sumsq_base = 0.
         self._mcu_tick_avg = 0.
         self._mcu_tick_stddev = 0.
         self._mcu_tick_awake = 0.
+        self._mcu_timer_insert_max = None
+        self._mcu_move_queue_min_free = None
+        self._mcu_profile = None
+        self._sched_trace_cmd = None
         # Register handlers
         printer.load_object(config, "error_mcu")
         printer.register_event_handler("klippy:firmware_restart",
                                        self._firmware_restart)
         printer.register_event_handler("klippy:mcu_identify",
                                        self._mcu_identify)
-        printer.register_event_handler("klippy:connect", self._connect)
         printer.register_event_handler("klippy:shutdown", self._shutdown)
         printer.register_event_handler("klippy:disconnect", self._disconnect)
         printer.register_event_handler("klippy:ready", self._ready)
@@ -630,6 +794,28 @@ class MCU:
         diff = count*tick_sumsq - tick_sum**2
         self._mcu_tick_stddev = c * math.sqrt(max(0., diff))
         self._mcu_tick_awake = tick_sum / self._mcu_freq
+    def _handle_timer_stats(self, params):
+        self._mcu_timer_insert_max = params['max_insert'] / self._mcu_freq
+    def _handle_move_queue_stats(self, params):
+        self._mcu_move_queue_min_free = params['min_free']
+    def _handle_profile_report(self, params):
+        self._mcu_profile = {
+            'irq_latency_max': params['irq_latency_max'] / self._mcu_freq,
+            'dispatch_max': params['dispatch_max'] / self._mcu_freq,
+            'timers': {}, 'tasks': {}}
+        self._get_status_info['profile'] = self._mcu_profile
+    def _profile_entry(self, params):
+        return {'count': params['count'],
+                'sum': params['sum'] / self._mcu_freq,
+                'max': params['max'] / self._mcu_freq}
+    def _handle_profile_timer(self, params):
+        if self._mcu_profile is not None:
+            func = "0x%x" % (params['func'],)
+            self._mcu_profile['timers'][func] = self._profile_entry(params)
+    def _handle_profile_task(self, params):
+        if self._mcu_profile is not None:
+            task = params['task_func']
+            self._mcu_profile['tasks'][task] = self._profile_entry(params)
     def _handle_shutdown(self, params):
         if self._is_shutdown:
             return
@@ -645,6 +831,32 @@ class MCU:
         logging.info("MCU '%s' %s: %s\n%s\n%s", self._name, event_type,
                      self._shutdown_msg, self._clocksync.dump_debug(),
                      self._serial.dump_debug())
+        if self._sched_trace_cmd is not None:
+            self._reactor.register_callback(self._dump_sched_trace)
+    def _format_sched_trace(self, params):
+        pos, clock = params['pos'], params['time']
+        if params['type'] == 1:
+            return "trace %d: timer func=0x%x waketime=%d clock=%d" % (
+                pos, params['info'], params['waketime'], clock)
+        msgparser = self._serial.get_msgparser()
+        mid = msgparser.messages_by_id.get(params['info'])
+        name = mid.name if mid is not None else params['info']
+        return "trace %d: command %s clock=%d" % (pos, name, clock)
+    def _dump_sched_trace(self, eventtime):
+        # Read the scheduler trace recorded by the mcu prior to shutdown
+        out = []
+        try:
+            params = self._sched_trace_cmd.send([0])
+            for pos in range(params['count']):
+                if pos:
+                    params = self._sched_trace_cmd.send([pos])
+                out.append(self._format_sched_trace(params))
+        except self._printer.command_error as e:
+            logging.info("Unable to read MCU '%s' scheduler trace: %s",
+                         self._name, str(e))
+            return
+        logging.info("Dumping mcu '%s' scheduler trace %d entries\n%s",
+                     self._name, len(out), "\n".join(out))
     def _handle_starting(self, params):
         if not self._is_shutdown:
             self._printer.invoke_async_shutdown("MCU '%s' spontaneous restart"
@@ -704,14 +916,11 @@ class MCU:
             if prev_crc is None:
                 logging.info("Sending MCU '%s' printer configuration...",
                              self._name)
-                for c in self._config_cmds:
-                    self._serial.send(c)
+                cmds = self._config_cmds
             else:
-                for c in self._restart_cmds:
-                    self._serial.send(c)
-            # Transmit init messages
-            for c in self._init_cmds:
-                self._serial.send(c)
+                cmds = self._restart_cmds
+            # Transmit config and init messages in a single batch
+            self._serial.send_multi(cmds + self._init_cmds)
         except msgproto.enumeration_error as e:
             enum_name, enum_value = e.get_enum_params()
             if enum_name == 'pin':
@@ -744,24 +953,28 @@ class MCU:
             "MCU '%s' config: %s" % (self._name, " ".join(
                 ["%s=%s" % (k, v) for k, v in self.get_constants().items()]))]
         return "\n".join(log_info)
-    def _connect(self):
-        config_params = self._send_get_config()
+    def _connect_send_config(self, config_params):
+        # Send config (or init) commands - returns True if the mcu was
+        # not already configured (and get_config should be reissued)
         if not config_params['is_config']:
             if self._restart_method == 'rpi_usb':
                 # Only configure mcu after usb power reset
                 self._check_restart("full reset before config")
-            # Not configured - send config and issue get_config again
+            # Not configured - send config
             self._send_config(None)
-            config_params = self._send_get_config()
-            if not config_params['is_config'] and not self.is_fileoutput():
-                raise error("Unable to configure MCU '%s'" % (self._name,))
-        else:
-            start_reason = self._printer.get_start_args().get("start_reason")
-            if start_reason == 'firmware_restart':
-                raise error("Failed automated reset of MCU '%s'"
-                            % (self._name,))
-            # Already configured - send init commands
-            self._send_config(config_params['crc'])
+            return True
+        start_reason = self._printer.get_start_args().get("start_reason")
+        if start_reason == 'firmware_restart':
+            raise error("Failed automated reset of MCU '%s'" % (self._name,))
+        # Already configured - send init commands
+        self._send_config(config_params['crc'])
+        return False
+    def _connect_check_config(self):
+        config_params = self._send_get_config()
+        if not config_params['is_config'] and not self.is_fileoutput():
+            raise error("Unable to configure MCU '%s'" % (self._name,))
+        return config_params
+    def _connect_finish(self, config_params):
         # Setup steppersync with the move_count returned by get_config
         move_count = config_params['move_count']
         if move_count < self._reserved_move_slots:
@@ -773,6 +986,10 @@ class MCU:
                                       move_count-self._reserved_move_slots),
             ffi_lib.steppersync_free)
         ffi_lib.steppersync_set_time(self._steppersync, 0., self._mcu_freq)
+        multi_cmd = self.try_lookup_command("queue_step_multi data=%*s")
+        if multi_cmd is not None:
+            ffi_lib.steppersync_fill_queue_step_multi(
+                self._steppersync, multi_cmd.get_command_tag())
         # Log config information
         move_msg = "Configured MCU '%s' (%d moves)" % (self._name, move_count)
         logging.info(move_msg)
@@ -830,6 +1047,17 @@ class MCU:
         self.register_response(self._handle_shutdown, 'shutdown')
         self.register_response(self._handle_shutdown, 'is_shutdown')
         self.register_response(self._handle_mcu_stats, 'stats')
+        self.register_response(self._handle_timer_stats, 'stats_timer')
+        self.register_response(self._handle_move_queue_stats,
+                               'stats_move_queue')
+        self.register_response(self._handle_profile_report, 'profile_report')
+        self.register_response(self._handle_profile_timer, 'profile_timer')
+        self.register_response(self._handle_profile_task, 'profile_task')
+        if self.try_lookup_command("sched_trace_query pos=%c") is not None:
+            self._sched_trace_cmd = self.lookup_query_command(
+                "sched_trace_query pos=%c",
+                "sched_trace_entry pos=%c count=%c type=%c info=%u"
+                " waketime=%u time=%u")
     def _ready(self):
         if self.is_fileoutput():
             return
@@ -873,6 +1101,8 @@ class MCU:
         return int(time * self._mcu_freq)
     def get_max_stepper_error(self):
         return self._max_stepper_error
+    def get_endstop_irq(self):
+        return self._endstop_irq
     def min_schedule_time(self):
         return MIN_SCHEDULE_TIME
     def max_nominal_duration(self):
@@ -886,12 +1116,78 @@ class MCU:
         self._serial.register_response(cb, msg, oid)
     def alloc_command_queue(self):
         return self._serial.alloc_command_queue()
+    def get_serialqueue(self):
+        return self._serial.get_serialqueue()
+    def get_link_rtt(self):
+        if self.is_fileoutput():
+            return None
+        return self._serial.get_link_rtt()
     def lookup_command(self, msgformat, cq=None):
         return CommandWrapper(self._serial, msgformat, cq)
     def lookup_query_command(self, msgformat, respformat, oid=None,
                              cq=None, is_async=False):
         return CommandQueryWrapper(self._serial, msgformat, respformat, oid,
                                    cq, is_async, self._printer.command_error)
+    def get_adc_scan(self):
+        if self._adc_scan is None:
+            self._adc_scan = False
+            if self.try_lookup_command(
+                    "config_analog_scan oid=%c pin_count=%c") is not None:
+                self._adc_scan = MCU_adc_scan(self)
+        return self._adc_scan or None
+    def query_stepper_positions(self, steppers):
+        # Query the position of several steppers (in a single request
+        # if the mcu supports stepper_get_positions)
+        if self.is_fileoutput():
+            return
+        if self._get_positions_cmd is None:
+            self._get_positions_cmd = False
+            if self.try_lookup_command(
+                    "stepper_get_positions oids=%*s") is not None:
+                self._get_positions_cmd = self.lookup_query_command(
+                    "stepper_get_positions oids=%*s",
+                    "stepper_positions pos=%*s")
+        if not self._get_positions_cmd:
+            for s in steppers:
+                s.query_mcu_position()
+            return
+        max_count = self.get_constants().get('STEPPER_GET_POSITIONS_MAX', 1)
+        for i in range(0, len(steppers), max_count):
+            group = steppers[i:i+max_count]
+            params = self._get_positions_cmd.send(
+                [[s.get_oid() for s in group]])
+            data = bytearray(params['pos'])
+            for j, s in enumerate(group):
+                pos = (data[j*4] | (data[j*4+1] << 8) | (data[j*4+2] << 16)
+                       | (data[j*4+3] << 24))
+                if pos & 0x80000000:
+                    pos -= 1 << 32
+                s.note_mcu_position(pos, params['#receive_time'])
+    def set_digital_outputs(self, print_time, updates):
+        # Set several digital_out pins at the same time (in a single
+        # message if the mcu supports queue_digital_out_group)
+        if self._digital_group_cmd is None:
+            self._digital_group_cmd = False
+            if self.try_lookup_command(
+                    "queue_digital_out_group clock=%u data=%*s") is not None:
+                self._digital_group_cmd = self.lookup_command(
+                    "queue_digital_out_group clock=%u data=%*s",
+                    cq=self.alloc_command_queue())
+        if not self._digital_group_cmd:
+            for mcu_pin, value in updates:
+                mcu_pin.set_digital(print_time, value)
+            return
+        clock = self.print_time_to_clock(print_time)
+        for i in range(0, len(updates), DIGITAL_OUT_GROUP_MAX):
+            data = []
+            minclock = 0
+            for mcu_pin, value in updates[i:i+DIGITAL_OUT_GROUP_MAX]:
+                oid, value, last_clock = mcu_pin.note_group_update(clock,
+                                                                   value)
+                data.extend([oid, value])
+                minclock = max(minclock, last_clock)
+            self._digital_group_cmd.send([clock, data], minclock=minclock,
+                                         reqclock=clock)
     def try_lookup_command(self, msgformat):
         try:
             return self.lookup_command(msgformat)
@@ -912,7 +1208,22 @@ class MCU:
     def clock32_to_clock64(self, clock32):
         return self._clocksync.clock32_to_clock64(clock32)
     # Restarts
+    def _log_fileoutput_summary(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        st = ffi_main.new('struct stepcompress_stats *')
+        steps = moves = msgs = 0
+        for stepqueue in self._stepqueues:
+            ffi_lib.stepcompress_get_stats(stepqueue, st)
+            steps += st.step_count
+            moves += st.move_count
+            msgs += st.message_count
+        logging.info("MCU '%s' output summary: steppers=%d steps=%d"
+                     " step_moves=%d step_messages=%d %s",
+                     self._name, len(self._stepqueues), steps, moves, msgs,
+                     self._serial.stats(self._reactor.monotonic()))
     def _disconnect(self):
+        if self.is_fileoutput():
+            self._log_fileoutput_summary()
         self._serial.disconnect()
         self._steppersync = None
     def _shutdown(self, force=False):
@@ -973,6 +1284,21 @@ class MCU:
         self._reserved_move_slots += 1
     def register_flush_callback(self, callback):
         self._flush_callbacks.append(callback)
+    def register_step_active_check(self, callback):
+        self._step_active_checks.append(callback)
+    def unregister_step_active_check(self, callback):
+        if callback in self._step_active_checks:
+            self._step_active_checks.remove(callback)
+    def generate_steps(self, flush_time, stepgen_pool):
+        if self._steppersync is None:
+            return
+        for cb in list(self._step_active_checks):
+            cb(flush_time)
+        ret = self._ffi_lib.steppersync_generate_steps(
+            self._steppersync, stepgen_pool, flush_time)
+        if ret:
+            raise error("Internal error in MCU '%s' stepcompress"
+                        % (self._name,))
     def flush_moves(self, print_time, clear_history_time):
         if self._steppersync is None:
             return
@@ -1013,6 +1339,20 @@ class MCU:
     def stats(self, eventtime):
         load = "mcu_awake=%.03f mcu_task_avg=%.06f mcu_task_stddev=%.06f" % (
             self._mcu_tick_awake, self._mcu_tick_avg, self._mcu_tick_stddev)
+        if self._mcu_timer_insert_max is not None:
+            load += " mcu_timer_insert_max=%.06f" % (
+                self._mcu_timer_insert_max,)
+        if self._mcu_move_queue_min_free is not None:
+            load += " mcu_move_queue_min_free=%d" % (
+                self._mcu_move_queue_min_free,)
+        prof = self._mcu_profile
+        if prof is not None:
+            timer_max = max([t['max'] for t in prof['timers'].values()] + [0.])
+            task_max = max([t['max'] for t in prof['tasks'].values()] + [0.])
+            load += (" mcu_irq_latency_max=%.06f mcu_dispatch_max=%.06f"
+                     " mcu_timer_func_max=%.06f mcu_task_func_max=%.06f" % (
+                         prof['irq_latency_max'], prof['dispatch_max'],
+                         timer_max, task_max))
         stats = ' '.join([load, self._serial.stats(eventtime),
                           self._clocksync.stats(eventtime)])
         parts = [s.split('=', 1) for s in stats.split()]
@@ -1020,14 +1360,60 @@ class MCU:
         self._get_status_info['last_stats'] = last_stats
         return False, '%s: %s' % (self._name, stats)
 
+# Run the given functions in parallel (via reactor greenlets) and
+# return their results once all have completed
+def run_concurrently(reactor, funcs):
+    if len(funcs) <= 1:
+        return [func() for func in funcs]
+    def wrap(func):
+        def invoke(eventtime):
+            try:
+                return func(), None
+            except Exception as e:
+                logging.debug("Concurrent task raised %s", repr(e))
+                return None, e
+        return invoke
+    completions = [reactor.register_callback(wrap(func)) for func in funcs]
+    results = [c.wait() for c in completions]
+    for res, exc in results:
+        if exc is not None:
+            raise exc
+    return [res for res, exc in results]
+
+# Configure all micro-controllers with their blocking queries overlapped
+class PrinterMCUConnect:
+    def __init__(self, printer, mcus):
+        self._printer = printer
+        self._mcus = mcus
+        printer.register_event_handler("klippy:connect", self._connect)
+    def _connect(self):
+        reactor = self._printer.get_reactor()
+        mcus = self._mcus
+        # Query the current state of all mcus
+        config_params = run_concurrently(
+            reactor, [m._send_get_config for m in mcus])
+        # Build and queue the config of each mcu (in config order)
+        need_check = [m._connect_send_config(cp)
+                      for m, cp in zip(mcus, config_params)]
+        # Wait for all newly configured mcus to report their state
+        check_mcus = [m for m, nc in zip(mcus, need_check) if nc]
+        new_params = run_concurrently(
+            reactor, [m._connect_check_config for m in check_mcus])
+        params = dict(zip(check_mcus, new_params))
+        for m, cp in zip(mcus, config_params):
+            m._connect_finish(params.get(m, cp))
+
 def add_printer_objects(config):
     printer = config.get_printer()
     reactor = printer.get_reactor()
     mainsync = clocksync.ClockSync(reactor)
-    printer.add_object('mcu', MCU(config.getsection('mcu'), mainsync))
+    mcus = [MCU(config.getsection('mcu'), mainsync)]
+    printer.add_object('mcu', mcus[0])
     for s in config.get_prefix_sections('mcu '):
-        printer.add_object(s.section, MCU(
-            s, clocksync.SecondarySync(reactor, mainsync)))
+        m = MCU(s, clocksync.SecondarySync(reactor, mainsync))
+        printer.add_object(s.section, m)
+        mcus.append(m)
+    PrinterMCUConnect(printer, mcus)
 
 def get_printer_mcu(printer, name):
     if name == 'mcu':
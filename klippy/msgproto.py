@@ -34,17 +34,25 @@ def crc16_ccitt(buf):
         crc = ((data << 8) | (crc >> 8)) ^ (data >> 4) ^ (data << 3)
     return [crc >> 8, crc & 0xff]
 
+# Parameter type codes of the C msgparser (see MP_xxx in msgblock.h)
+MP_UINT32, MP_INT32, MP_BUFFER = 0, 1, 2
+
+# Append an integer encoded as a "variable length quantity" to 'out'
+def encode_int(out, v):
+    if v >= 0xc000000 or v < -0x4000000: out.append((v>>28) & 0x7f | 0x80)
+    if v >= 0x180000 or v < -0x80000:    out.append((v>>21) & 0x7f | 0x80)
+    if v >= 0x3000 or v < -0x1000:       out.append((v>>14) & 0x7f | 0x80)
+    if v >= 0x60 or v < -0x20:           out.append((v>>7)  & 0x7f | 0x80)
+    out.append(v & 0x7f)
+
 class PT_uint32:
     is_int = True
     is_dynamic_string = False
     max_length = 5
     signed = False
+    native_type = MP_UINT32
     def encode(self, out, v):
-        if v >= 0xc000000 or v < -0x4000000: out.append((v>>28) & 0x7f | 0x80)
-        if v >= 0x180000 or v < -0x80000:    out.append((v>>21) & 0x7f | 0x80)
-        if v >= 0x3000 or v < -0x1000:       out.append((v>>14) & 0x7f | 0x80)
-        if v >= 0x60 or v < -0x20:           out.append((v>>7)  & 0x7f | 0x80)
-        out.append(v & 0x7f)
+        encode_int(out, v)
     def parse(self, s, pos):
         c = s[pos]
         pos += 1
@@ -61,6 +69,7 @@ class PT_uint32:
 
 class PT_int32(PT_uint32):
     signed = True
+    native_type = MP_INT32
 class PT_uint16(PT_uint32):
     max_length = 3
 class PT_int16(PT_int32):
@@ -73,6 +82,7 @@ class PT_string:
     is_int = False
     is_dynamic_string = True
     max_length = 64
+    native_type = MP_BUFFER
     def encode(self, out, v):
         out.append(len(v))
         out.extend(bytearray(v))
@@ -96,6 +106,7 @@ class enumeration_error(error):
 class Enumeration:
     is_int = False
     is_dynamic_string = False
+    native_type = None
     def __init__(self, pt, enum_name, enums):
         self.pt = pt
         self.max_length = pt.max_length
@@ -168,11 +179,20 @@ class MessageFormat:
         self.param_names = lookup_params(msgformat, enumerations)
         self.param_types = [t for name, t in self.param_names]
         self.name_to_type = dict(self.param_names)
+        if all([t.is_int for t in self.param_types]):
+            # Most commands only have integer parameters (and are often
+            # sent at a high rate) - use a faster encoder for them
+            self.encode = self._encode_ints
     def encode(self, params):
         out = list(self.msgid_bytes)
         for i, t in enumerate(self.param_types):
             t.encode(out, params[i])
         return out
+    def _encode_ints(self, params):
+        out = list(self.msgid_bytes)
+        for v in params:
+            encode_int(out, v)
+        return out
     def encode_by_name(self, **params):
         out = list(self.msgid_bytes)
         for name, t in self.param_names:
@@ -418,6 +438,18 @@ class MessageParser:
         return self.version, self.build_versions
     def get_messages(self):
         return list(self.messages)
+    def get_native_formats(self):
+        # Message formats that may be decoded by the C msgparser code
+        out = []
+        for msgid, mid in self.messages_by_id.items():
+            if not isinstance(mid, MessageFormat):
+                continue
+            types = [t.native_type for t in mid.param_types]
+            if None in types:
+                continue
+            names = [name for name, t in mid.param_names]
+            out.append((msgid, mid.name, names, types))
+        return out
     def get_enumerations(self):
         return dict(self.enumerations)
     def get_constants(self):
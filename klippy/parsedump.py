@@ -4,7 +4,7 @@
 # Copyright (C) 2016  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, sys, logging
+import os, sys, logging, struct
 import msgproto
 
 def read_dictionary(filename):
@@ -13,6 +13,54 @@ def read_dictionary(filename):
     dfile.close()
     return dictionary
 
+# Binary capture files (see serialqueue_set_capture() in serialqueue.c)
+CAPTURE_MAGIC = b"KLIPCAP1"
+CAPTURE_SENT, CAPTURE_RECEIVE, CAPTURE_RETRANSMIT = 0x01, 0x02, 0x04
+capture_header = struct.Struct('<8sIIIIQ')
+capture_record = struct.Struct('<dQBB6x64s')
+
+def is_capture(filename):
+    with open(filename, 'rb') as f:
+        return f.read(len(CAPTURE_MAGIC)) == CAPTURE_MAGIC
+
+# Return the (time, clock, flags, msg) records of a capture file
+def read_capture(filename):
+    with open(filename, 'rb') as f:
+        data = f.read()
+    (magic, header_size, record_size, record_count, reserved,
+     write_count) = capture_header.unpack_from(data, 0)
+    if magic != CAPTURE_MAGIC or record_size < capture_record.size:
+        raise ValueError("Invalid capture file %s" % (filename,))
+    out = []
+    for i in range(max(0, write_count - record_count), write_count):
+        pos = header_size + (i % record_count) * record_size
+        ptime, clock, flags, mlen, msg = capture_record.unpack_from(data, pos)
+        out.append((ptime, clock, flags, bytearray(msg[:mlen])))
+    return out
+
+def format_capture_record(mp, record):
+    ptime, clock, flags, msg = record
+    if flags & CAPTURE_RETRANSMIT:
+        desc = "Retransmit"
+    elif flags & CAPTURE_SENT:
+        desc = "Sent"
+    else:
+        desc = "Receive"
+    try:
+        if len(msg) <= msgproto.MESSAGE_MIN:
+            # Ack/nak block
+            msgs = ["seq: %02x" % (msg[msgproto.MESSAGE_POS_SEQ],)]
+        else:
+            msgs = mp.dump(msg)
+    except Exception as e:
+        msgs = ["Invalid message %s" % (repr(bytes(msg)),)]
+    return "%s %.6f %d %d: %s" % (desc, ptime, clock, len(msg),
+                                  ', '.join(msgs))
+
+def dump_capture(mp, data_filename):
+    for record in read_capture(data_filename):
+        sys.stdout.write(format_capture_record(mp, record) + '\n')
+
 def main():
     dict_filename, data_filename = sys.argv[1:]
 
@@ -21,6 +69,10 @@ def main():
     mp = msgproto.MessageParser()
     mp.process_identify(dictionary, decompress=False)
 
+    if is_capture(data_filename):
+        dump_capture(mp, data_filename)
+        return
+
     f = open(data_filename, 'rb')
     fd = f.fileno()
     data = bytearray()
@@ -5,6 +5,9 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, logging.handlers, threading, queue, time
 
+# Message arguments that can be safely formatted in the background thread
+IMMUTABLE_TYPES = (str, bytes, int, float, bool, type(None))
+
 # Class to forward all messages through a queue to a background thread
 class QueueHandler(logging.Handler):
     def __init__(self, queue):
@@ -12,6 +15,12 @@ class QueueHandler(logging.Handler):
         self.queue = queue
     def emit(self, record):
         try:
+            if (type(record.msg) is str and not record.exc_info
+                and type(record.args) is tuple
+                and all([type(a) in IMMUTABLE_TYPES for a in record.args])):
+                # Arguments can't change - format in background thread
+                self.queue.put_nowait(record)
+                return
             self.format(record)
             record.msg = record.message
             record.args = None
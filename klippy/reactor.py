@@ -3,17 +3,28 @@
 # Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, gc, select, math, time, logging, queue
+import os, gc, select, math, time, logging, queue, heapq
 import greenlet
 import chelper, util
 
 _NOW = 0.
 _NEVER = 9999999999999999.
 
+def _callback_name(callback):
+    obj = getattr(callback, '__self__', None)
+    name = getattr(callback, '__name__', None)
+    if obj is None or name is None:
+        return getattr(callback, '__qualname__', name) or repr(callback)
+    if isinstance(obj, greenlet.greenlet):
+        return "greenlet"
+    return "%s.%s" % (type(obj).__name__, name)
+
 class ReactorTimer:
     def __init__(self, callback, waketime):
         self.callback = callback
         self.waketime = waketime
+        # Sequence number of this timer's valid entry in the timer heap
+        self.heap_seq = None
 
 class ReactorCompletion:
     class sentinel: pass
@@ -72,6 +83,8 @@ class ReactorMutex:
         self.unlock = self.__exit__
     def test(self):
         return self.is_locked
+    def has_waiters(self):
+        return not not self.queue
     def __enter__(self):
         if not self.is_locked:
             self.is_locked = True
@@ -103,7 +116,14 @@ class SelectReactor:
         self._last_gc_times = [0., 0., 0.]
         # Timers
         self._timers = []
+        self._timer_heap = []
+        self._timer_seq = 0
         self._next_timer = self.NEVER
+        # Loop statistics
+        self._max_timer_lag = 0.
+        self._loop_count = 0
+        # Per-callback profiling (when enabled)
+        self._profile = None
         # Callbacks
         self._pipe_fds = None
         self._async_queue = queue.Queue()
@@ -116,23 +136,97 @@ class SelectReactor:
         self._all_greenlets = []
     def get_gc_stats(self):
         return tuple(self._last_gc_times)
+    def get_loop_stats(self):
+        # Report (and reset) the maximum time a timer was run after its
+        # requested waketime and the number of dispatch loop iterations
+        res = (self._max_timer_lag, self._loop_count)
+        self._max_timer_lag = 0.
+        self._loop_count = 0
+        return res
+    # Callback profiling
+    def set_profiling(self, enable):
+        if not enable:
+            self._profile = None
+        elif self._profile is None:
+            self._profile = {}
+    def get_profile_stats(self):
+        # Report (and reset) per-callback stats - returns a dictionary
+        # of name -> (count, total_time, max_time, max_delay)
+        profile = self._profile
+        if profile is None:
+            return {}
+        self._profile = {}
+        res = {}
+        for cb, stats in profile.items():
+            name = _callback_name(cb)
+            prev = res.get(name)
+            if prev is not None:
+                stats = [prev[0] + stats[0], prev[1] + stats[1],
+                         max(prev[2], stats[2]), max(prev[3], stats[3])]
+            res[name] = tuple(stats)
+        return res
+    def _profile_call(self, callback, eventtime, waketime):
+        g_dispatch = self._g_dispatch
+        start_time = self.monotonic()
+        res = callback(eventtime)
+        profile = self._profile
+        if profile is None:
+            return res
+        stats = profile.get(callback)
+        if stats is None:
+            stats = profile[callback] = [0, 0., 0., 0.]
+        stats[0] += 1
+        if waketime > self.NOW:
+            stats[3] = max(stats[3], start_time - waketime)
+        if g_dispatch is self._g_dispatch:
+            # Only measure callbacks that did not pause
+            run_time = self.monotonic() - start_time
+            stats[1] += run_time
+            stats[2] = max(stats[2], run_time)
+        return res
+    def _fd_callback(self, callback, eventtime):
+        if self._profile is None:
+            callback(eventtime)
+        else:
+            self._profile_call(callback, eventtime, eventtime)
     # Timers
+    def _push_timer(self, timer_handler, waketime):
+        # Add an entry to the timer heap - any previous entry for this
+        # timer is left in the heap and skipped when it is found stale
+        if waketime >= self.NEVER:
+            timer_handler.heap_seq = None
+            return
+        seq = self._timer_seq = self._timer_seq + 1
+        timer_handler.heap_seq = seq
+        heap = self._timer_heap
+        heapq.heappush(heap, (waketime, seq, timer_handler))
+        if len(heap) > 2 * len(self._timers) + 64:
+            # Too many stale entries - rebuild heap
+            heap[:] = [e for e in heap if e[1] == e[2].heap_seq]
+            heapq.heapify(heap)
     def update_timer(self, timer_handler, waketime):
+        if (waketime == timer_handler.waketime
+            and timer_handler.heap_seq is not None):
+            return
         timer_handler.waketime = waketime
+        self._push_timer(timer_handler, waketime)
         self._next_timer = min(self._next_timer, waketime)
     def register_timer(self, callback, waketime=NEVER):
         timer_handler = ReactorTimer(callback, waketime)
         timers = list(self._timers)
         timers.append(timer_handler)
         self._timers = timers
+        self._push_timer(timer_handler, waketime)
         self._next_timer = min(self._next_timer, waketime)
         return timer_handler
     def unregister_timer(self, timer_handler):
         timer_handler.waketime = self.NEVER
+        timer_handler.heap_seq = None
         timers = list(self._timers)
         timers.pop(timers.index(timer_handler))
         self._timers = timers
     def _check_timers(self, eventtime, busy):
+        self._loop_count += 1
         if eventtime < self._next_timer:
             if busy:
                 return 0.
@@ -149,19 +243,45 @@ class SelectReactor:
                     gc.collect(gc_level)
                     return 0.
             return min(1., max(.001, self._next_timer - eventtime))
-        self._next_timer = self.NEVER
+        # Run due timers in waketime order.  Timers rescheduled by these
+        # callbacks are not run until the next call.
+        heap = self._timer_heap
+        start_seq = self._timer_seq
         g_dispatch = self._g_dispatch
-        for t in self._timers:
-            waketime = t.waketime
-            if eventtime >= waketime:
-                t.waketime = self.NEVER
-                t.waketime = waketime = t.callback(eventtime)
-                if g_dispatch is not self._g_dispatch:
-                    self._next_timer = min(self._next_timer, waketime)
-                    self._end_greenlet(g_dispatch)
-                    return 0.
-            self._next_timer = min(self._next_timer, waketime)
+        while heap:
+            waketime, seq, t = heap[0]
+            if seq != t.heap_seq:
+                # Stale entry (timer was updated or removed)
+                heapq.heappop(heap)
+                continue
+            if waketime > eventtime or seq > start_seq:
+                break
+            heapq.heappop(heap)
+            if waketime > self.NOW:
+                self._max_timer_lag = max(self._max_timer_lag,
+                                          eventtime - waketime)
+            t.waketime = self.NEVER
+            t.heap_seq = None
+            if self._profile is None:
+                waketime = t.callback(eventtime)
+            else:
+                waketime = self._profile_call(t.callback, eventtime, waketime)
+            t.waketime = waketime
+            self._push_timer(t, waketime)
+            if g_dispatch is not self._g_dispatch:
+                self._update_next_timer()
+                self._end_greenlet(g_dispatch)
+                return 0.
+        self._update_next_timer()
         return 0.
+    def _update_next_timer(self):
+        heap = self._timer_heap
+        while heap and heap[0][1] != heap[0][2].heap_seq:
+            heapq.heappop(heap)
+        if heap:
+            self._next_timer = heap[0][0]
+        else:
+            self._next_timer = self.NEVER
     # Callbacks and Completions
     def completion(self):
         return ReactorCompletion(self)
@@ -266,18 +386,18 @@ class SelectReactor:
         while self._process:
             timeout = self._check_timers(eventtime, busy)
             busy = False
-            res = select.select(self._read_fds, self.write_fds, [], timeout)
+            res = select.select(self._read_fds, self._write_fds, [], timeout)
             eventtime = self.monotonic()
             for fd in res[0]:
                 busy = True
-                fd.read_callback(eventtime)
+                self._fd_callback(fd.read_callback, eventtime)
                 if g_dispatch is not self._g_dispatch:
                     self._end_greenlet(g_dispatch)
                     eventtime = self.monotonic()
                     break
             for fd in res[1]:
                 busy = True
-                fd.write_callback(eventtime)
+                self._fd_callback(fd.write_callback, eventtime)
                 if g_dispatch is not self._g_dispatch:
                     self._end_greenlet(g_dispatch)
                     eventtime = self.monotonic()
@@ -344,13 +464,15 @@ class PollReactor(SelectReactor):
             for fd, event in res:
                 busy = True
                 if event & (select.POLLIN | select.POLLHUP):
-                    self._fds[fd].read_callback(eventtime)
+                    self._fd_callback(self._fds[fd].read_callback,
+                                      eventtime)
                     if g_dispatch is not self._g_dispatch:
                         self._end_greenlet(g_dispatch)
                         eventtime = self.monotonic()
                         break
                 if event & select.POLLOUT:
-                    self._fds[fd].write_callback(eventtime)
+                    self._fd_callback(self._fds[fd].write_callback,
+                                      eventtime)
                     if g_dispatch is not self._g_dispatch:
                         self._end_greenlet(g_dispatch)
                         eventtime = self.monotonic()
@@ -366,7 +488,7 @@ class EPollReactor(SelectReactor):
     def register_fd(self, fd, read_callback, write_callback=None):
         file_handler = ReactorFileHandler(fd, read_callback, write_callback)
         fds = self._fds.copy()
-        fds[fd] = read_callback
+        fds[fd] = file_handler
         self._fds = fds
         self._epoll.register(fd, select.EPOLLIN | select.EPOLLHUP)
         return file_handler
@@ -395,13 +517,15 @@ class EPollReactor(SelectReactor):
             for fd, event in res:
                 busy = True
                 if event & (select.EPOLLIN | select.EPOLLHUP):
-                    self._fds[fd].read_callback(eventtime)
+                    self._fd_callback(self._fds[fd].read_callback,
+                                      eventtime)
                     if g_dispatch is not self._g_dispatch:
                         self._end_greenlet(g_dispatch)
                         eventtime = self.monotonic()
                         break
                 if event & select.EPOLLOUT:
-                    self._fds[fd].write_callback(eventtime)
+                    self._fd_callback(self._fds[fd].write_callback,
+                                      eventtime)
                     if g_dispatch is not self._g_dispatch:
                         self._end_greenlet(g_dispatch)
                         eventtime = self.monotonic()
@@ -11,6 +11,8 @@ import msgproto, chelper, util
 class error(Exception):
     pass
 
+IDENTIFY_CHUNK = 40
+
 class SerialReader:
     def __init__(self, reactor, warn_prefix=""):
         self.reactor = reactor
@@ -20,7 +22,11 @@ class SerialReader:
         self.msgparser = msgproto.MessageParser(warn_prefix=warn_prefix)
         # C interface
         self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.native_parser = None
         self.serialqueue = None
+        self.capture_file = None
+        self.capture_records = 0
+        self.dictionary_cache = None
         self.default_cmd_queue = self.alloc_command_queue()
         self.stats_buf = self.ffi_main.new('char[4096]')
         # Threading
@@ -33,8 +39,42 @@ class SerialReader:
         # Sent message notification tracking
         self.last_notify_id = 0
         self.pending_notifications = {}
+    def _setup_native_parser(self, msgparser):
+        # Load the message formats into the C msgparser
+        ffi_main, ffi_lib = self.ffi_main, self.ffi_lib
+        parser = ffi_main.gc(ffi_lib.msgparser_alloc(), ffi_lib.msgparser_free)
+        formats = {}
+        for msgid, name, names, types in msgparser.get_native_formats():
+            if ffi_lib.msgparser_add_format(parser, msgid, types, len(types)):
+                continue
+            buffers = [n for n, t in zip(names, types)
+                       if t == msgproto.MP_BUFFER]
+            formats[msgid] = (name, names, buffers)
+        self.native_parser = (parser, formats)
+    def _native_parse(self, response, count, msgbuf, msgid_buf, params_buf):
+        native_parser = self.native_parser
+        if native_parser is None:
+            return None
+        parser, formats = native_parser
+        ret = self.ffi_lib.msgparser_parse(parser, response.msg, count,
+                                           msgid_buf, params_buf,
+                                           len(params_buf))
+        if ret < 0:
+            return None
+        name, names, buffers = formats[msgid_buf[0]]
+        params = dict(zip(names, self.ffi_main.unpack(params_buf, ret)))
+        for bname in buffers:
+            v = params[bname]
+            pos = v >> 8
+            params[bname] = msgbuf[pos:pos + (v & 0xff)]
+        params['#name'] = name
+        return params
     def _bg_thread(self):
         response = self.ffi_main.new('struct pull_queue_message *')
+        msgbuf = self.ffi_main.buffer(response.msg)
+        msgid_buf = self.ffi_main.new('int32_t *')
+        params_buf = self.ffi_main.new('int64_t[%d]'
+                                       % (msgproto.MESSAGE_PAYLOAD_MAX,))
         while 1:
             self.ffi_lib.serialqueue_pull(self.serialqueue, response)
             count = response.len
@@ -46,7 +86,10 @@ class SerialReader:
                 completion = self.pending_notifications.pop(response.notify_id)
                 self.reactor.async_complete(completion, params)
                 continue
-            params = self.msgparser.parse(response.msg[0:count])
+            params = self._native_parse(response, count, msgbuf,
+                                        msgid_buf, params_buf)
+            if params is None:
+                params = self.msgparser.parse(response.msg[0:count])
             params['#sent_time'] = response.sent_time
             params['#receive_time'] = response.receive_time
             hdl = (params['#name'], params.get('oid'))
@@ -59,11 +102,52 @@ class SerialReader:
                                   self.warn_prefix)
     def _error(self, msg, *params):
         raise error(self.warn_prefix + (msg % params))
+    def _check_dictionary_cache(self):
+        # Load the cached data dictionary and verify it matches the
+        # firmware by comparing its first bytes and final bytes (the
+        # latter hold the zlib checksum of the uncompressed data)
+        try:
+            with open(self.dictionary_cache, 'rb') as f:
+                cache_data = f.read()
+        except (IOError, OSError):
+            return None
+        if len(cache_data) <= IDENTIFY_CHUNK:
+            return None
+        tail_offset = len(cache_data) - (IDENTIFY_CHUNK - 1)
+        for offset, expected in [(0, cache_data[:IDENTIFY_CHUNK]),
+                                 (tail_offset, cache_data[tail_offset:])]:
+            msg = "identify offset=%d count=%d" % (offset, IDENTIFY_CHUNK)
+            params = self.send_with_response(msg, 'identify_response')
+            if params['offset'] != offset or params['data'] != expected:
+                logging.info("%sData dictionary cache is stale",
+                             self.warn_prefix)
+                return None
+        return cache_data
+    def _write_dictionary_cache(self, identify_data):
+        tmpname = self.dictionary_cache + ".tmp"
+        try:
+            with open(tmpname, 'wb') as f:
+                f.write(identify_data)
+            os.rename(tmpname, self.dictionary_cache)
+        except (IOError, OSError) as e:
+            logging.warning("%sUnable to write data dictionary cache: %s",
+                            self.warn_prefix, e)
     def _get_identify_data(self, eventtime):
+        # Use the cached "data dictionary" if it is still valid
+        if self.dictionary_cache is not None:
+            try:
+                identify_data = self._check_dictionary_cache()
+            except error as e:
+                logging.exception("%sWait for identify_response",
+                                  self.warn_prefix)
+                return None
+            if identify_data is not None:
+                return identify_data, True
         # Query the "data dictionary" from the micro-controller
         identify_data = b""
         while 1:
-            msg = "identify offset=%d count=%d" % (len(identify_data), 40)
+            msg = "identify offset=%d count=%d" % (len(identify_data),
+                                                   IDENTIFY_CHUNK)
             try:
                 params = self.send_with_response(msg, 'identify_response')
             except error as e:
@@ -74,7 +158,7 @@ class SerialReader:
                 msgdata = params['data']
                 if not msgdata:
                     # Done
-                    return identify_data
+                    return identify_data, False
                 identify_data += msgdata
     def _start_session(self, serial_dev, serial_fd_type=b'u', client_id=0):
         self.serial_dev = serial_dev
@@ -82,18 +166,39 @@ class SerialReader:
             self.ffi_lib.serialqueue_alloc(serial_dev.fileno(),
                                            serial_fd_type, client_id),
             self.ffi_lib.serialqueue_free)
+        if self.capture_file is not None:
+            self.ffi_lib.serialqueue_set_capture(
+                self.serialqueue, self.capture_file.encode(),
+                self.capture_records)
         self.background_thread = threading.Thread(target=self._bg_thread)
         self.background_thread.start()
         # Obtain and load the data dictionary from the firmware
         completion = self.reactor.register_callback(self._get_identify_data)
-        identify_data = completion.wait(self.reactor.monotonic() + 5.)
-        if identify_data is None:
+        res = completion.wait(self.reactor.monotonic() + 5.)
+        if res is None:
             logging.info("%sTimeout on connect", self.warn_prefix)
             self.disconnect()
             return False
+        identify_data, is_cached = res
         msgparser = msgproto.MessageParser(warn_prefix=self.warn_prefix)
-        msgparser.process_identify(identify_data)
+        try:
+            msgparser.process_identify(identify_data)
+        except msgproto.error as e:
+            if not is_cached:
+                raise
+            # Corrupt cache file - discard it and retry the connection
+            logging.info("%sInvalid data dictionary cache", self.warn_prefix)
+            try:
+                os.unlink(self.dictionary_cache)
+            except OSError:
+                self.dictionary_cache = None
+            self.disconnect()
+            return False
+        if self.dictionary_cache is not None and not is_cached:
+            self._write_dictionary_cache(identify_data)
+        self.native_parser = None
         self.msgparser = msgparser
+        self._setup_native_parser(msgparser)
         self.register_response(self.handle_unknown, '#unknown')
         # Setup baud adjust
         if serial_fd_type == b'c':
@@ -107,6 +212,15 @@ class SerialReader:
         if receive_window is not None:
             self.ffi_lib.serialqueue_set_receive_window(
                 self.serialqueue, receive_window)
+        # Enable CAN-FD frames if both the mcu and interface support it
+        if (serial_fd_type == b'c'
+            and msgparser.get_constant_int('CANBUS_FD', 0)):
+            ret = self.ffi_lib.serialqueue_set_canfd(self.serialqueue)
+            if ret:
+                logging.info("%sCAN interface does not support CAN-FD"
+                             " - using classic frames", self.warn_prefix)
+            else:
+                logging.info("%sUsing CAN-FD frames", self.warn_prefix)
         return True
     def connect_canbus(self, canbus_uuid, canbus_nodeid, canbus_iface="can0"):
         import can # XXX
@@ -199,9 +313,15 @@ class SerialReader:
     def connect_file(self, debugoutput, dictionary, pace=False):
         self.serial_dev = debugoutput
         self.msgparser.process_identify(dictionary, decompress=False)
+        self._setup_native_parser(self.msgparser)
         self.serialqueue = self.ffi_main.gc(
             self.ffi_lib.serialqueue_alloc(self.serial_dev.fileno(), b'f', 0),
             self.ffi_lib.serialqueue_free)
+    def set_dictionary_cache(self, filename):
+        self.dictionary_cache = filename
+    def set_capture(self, filename, record_count):
+        self.capture_file = filename
+        self.capture_records = record_count
     def set_clock_est(self, freq, conv_time, conv_clock, last_clock):
         self.ffi_lib.serialqueue_set_clock_est(
             self.serialqueue, freq, conv_time, conv_clock, last_clock)
@@ -223,6 +343,10 @@ class SerialReader:
         self.ffi_lib.serialqueue_get_stats(self.serialqueue,
                                            self.stats_buf, len(self.stats_buf))
         return str(self.ffi_main.string(self.stats_buf).decode())
+    def get_link_rtt(self):
+        if self.serialqueue is None:
+            return None
+        return self.ffi_lib.serialqueue_get_rtt(self.serialqueue)
     def get_reactor(self):
         return self.reactor
     def get_msgparser(self):
@@ -256,6 +380,17 @@ class SerialReader:
     def send(self, msg, minclock=0, reqclock=0):
         cmd = self.msgparser.create_command(msg)
         self.raw_send(cmd, minclock, reqclock, self.default_cmd_queue)
+    def send_multi(self, msgs, minclock=0, reqclock=0):
+        # Encode and submit a list of commands in a single batch
+        cmds = [self.msgparser.create_command(msg) for msg in msgs]
+        cmds = [cmd for cmd in cmds if cmd]
+        if not cmds:
+            return
+        data = [b for cmd in cmds for b in cmd]
+        lens = self.ffi_main.new('int[]', [len(cmd) for cmd in cmds])
+        self.ffi_lib.serialqueue_send_multi(
+            self.serialqueue, self.default_cmd_queue, data, lens, len(cmds),
+            minclock, reqclock)
     def send_with_response(self, msg, response):
         cmd = self.msgparser.create_command(msg)
         src = SerialRetryCommand(self, response)
@@ -21,7 +21,8 @@ MIN_OPTIMIZED_BOTH_EDGE_DURATION = 0.000000150
 class MCU_stepper:
     def __init__(self, name, step_pin_params, dir_pin_params,
                  rotation_dist, steps_per_rotation,
-                 step_pulse_duration=None, units_in_radians=False):
+                 step_pulse_duration=None, units_in_radians=False,
+                 hardware_step_generator=False, move_queue_reserve=0):
         self._name = name
         self._rotation_dist = rotation_dist
         self._steps_per_rotation = steps_per_rotation
@@ -39,8 +40,11 @@ class MCU_stepper:
         self._dir_pin = dir_pin_params['pin']
         self._invert_dir = self._orig_invert_dir = dir_pin_params['invert']
         self._step_both_edge = self._req_step_both_edge = False
+        self._hw_step_generator = hardware_step_generator
+        self._move_queue_reserve = move_queue_reserve
         self._mcu_position_offset = 0.
         self._reset_cmd_tag = self._get_position_cmd = None
+        self._get_timing_cmd = None
         self._active_callbacks = []
         ffi_main, ffi_lib = chelper.get_ffi()
         self._stepqueue = ffi_main.gc(ffi_lib.stepcompress_alloc(oid),
@@ -50,9 +54,17 @@ class MCU_stepper:
         self._stepper_kinematics = None
         self._itersolve_generate_steps = ffi_lib.itersolve_generate_steps
         self._itersolve_check_active = ffi_lib.itersolve_check_active
+        self._stepgen_pool_generate_steps = ffi_lib.stepgen_pool_generate_steps
+        self._stepgen_pool = None
+        self._mcu_step_generation = False
         self._trapq = ffi_main.NULL
-        self._mcu.get_printer().register_event_handler('klippy:connect',
-                                                       self._query_mcu_position)
+        printer = self._mcu.get_printer()
+        printer.register_event_handler('klippy:connect', self._handle_connect)
+        printer.register_event_handler('klippy:connect',
+                                       self.query_mcu_position)
+    def _handle_connect(self):
+        toolhead = self._mcu.get_printer().lookup_object('toolhead')
+        self._stepgen_pool = toolhead.get_step_generation_pool()
     def get_mcu(self):
         return self._mcu
     def get_name(self, short=False):
@@ -97,6 +109,9 @@ class MCU_stepper:
         elif sou:
             # MCU has optimized step/unstep - better to use that
             want_both_edges = False
+        elif self._hw_step_generator:
+            # Hardware step generators produce a full pulse per step
+            want_both_edges = False
         if want_both_edges:
             self._step_both_edge = True
             invert_step = -1
@@ -109,6 +124,22 @@ class MCU_stepper:
             "config_stepper oid=%d step_pin=%s dir_pin=%s invert_step=%d"
             " step_pulse_ticks=%u" % (self._oid, self._step_pin, self._dir_pin,
                                       invert_step, step_pulse_ticks))
+        if self._hw_step_generator:
+            if self._mcu.try_lookup_command(
+                    "config_stepper_hw oid=%c step_pin=%c") is None:
+                raise self._mcu.get_printer().config_error(
+                    "MCU '%s' does not support hardware_step_generator"
+                    % (self._mcu.get_name(),))
+            self._mcu.add_config_cmd("config_stepper_hw oid=%d step_pin=%s"
+                                     % (self._oid, self._step_pin))
+        if self._move_queue_reserve:
+            if self._mcu.try_lookup_command(
+                    "move_queue_reserve oid=%c count=%hu") is None:
+                raise self._mcu.get_printer().config_error(
+                    "MCU '%s' does not support move_queue_reserve"
+                    % (self._mcu.get_name(),))
+            self._mcu.add_config_cmd("move_queue_reserve oid=%d count=%d"
+                                     % (self._oid, self._move_queue_reserve))
         self._mcu.add_config_cmd("reset_step_clock oid=%d clock=0"
                                  % (self._oid,), on_restart=True)
         step_cmd_tag = self._mcu.lookup_command(
@@ -120,11 +151,29 @@ class MCU_stepper:
         self._get_position_cmd = self._mcu.lookup_query_command(
             "stepper_get_position oid=%c",
             "stepper_position oid=%c pos=%i", oid=self._oid)
+        if self._mcu.try_lookup_command(
+                "stepper_get_timing oid=%c reset=%c") is not None:
+            self._get_timing_cmd = self._mcu.lookup_query_command(
+                "stepper_get_timing oid=%c reset=%c",
+                "stepper_timing oid=%c count=%u max_late=%u hist=%*s",
+                oid=self._oid)
         max_error = self._mcu.get_max_stepper_error()
         max_error_ticks = self._mcu.seconds_to_clock(max_error)
         ffi_main, ffi_lib = chelper.get_ffi()
         ffi_lib.stepcompress_fill(self._stepqueue, max_error_ticks,
                                   step_cmd_tag, dir_cmd_tag)
+        step2_cmd = self._mcu.try_lookup_command(
+            "queue_step2 oid=%c interval=%u count=%hu add=%hi add2=%hi")
+        if step2_cmd is not None:
+            ffi_lib.stepcompress_fill_add2(self._stepqueue,
+                                           step2_cmd.get_command_tag())
+        steps_cmd = self._mcu.try_lookup_command(
+            "queue_steps oid=%c data=%*s")
+        if steps_cmd is not None:
+            ffi_lib.stepcompress_fill_queue_steps(self._stepqueue,
+                                                  steps_cmd.get_command_tag())
+        ffi_lib.stepcompress_set_move_reserve(self._stepqueue,
+                                              self._move_queue_reserve)
     def get_oid(self):
         return self._oid
     def get_step_dist(self):
@@ -184,6 +233,14 @@ class MCU_stepper:
         count = ffi_lib.stepcompress_extract_old(self._stepqueue, data, count,
                                                  start_clock, end_clock)
         return (data, count)
+    def get_step_stats(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        stats = ffi_main.new('struct stepcompress_stats *')
+        ffi_lib.stepcompress_get_stats(self._stepqueue, stats)
+        return {'moves': stats.move_count, 'steps': stats.step_count,
+                'error_limited_moves': stats.error_limited_count,
+                'messages': stats.message_count,
+                'message_bytes': stats.message_bytes}
     def get_stepper_kinematics(self):
         return self._stepper_kinematics
     def set_stepper_kinematics(self, sk):
@@ -195,9 +252,28 @@ class MCU_stepper:
         ffi_main, ffi_lib = chelper.get_ffi()
         ffi_lib.itersolve_set_stepcompress(sk, self._stepqueue, self._step_dist)
         self.set_trapq(self._trapq)
+        self._update_mcu_step_generation()
         self._set_mcu_position(mcu_pos)
         return old_sk
-    def note_homing_end(self):
+    def _update_mcu_step_generation(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        sk = ffi_main.NULL
+        if self._mcu_step_generation:
+            sk = self._stepper_kinematics
+        ffi_lib.stepcompress_set_stepper_kinematics(self._stepqueue, sk)
+    def set_mcu_step_generation(self, enable):
+        # Generate steps from the mcu during toolhead flushes
+        enable = not not enable
+        if enable == self._mcu_step_generation:
+            return
+        self._mcu_step_generation = enable
+        self._update_mcu_step_generation()
+        if self._active_callbacks:
+            if enable:
+                self._mcu.register_step_active_check(self._check_active)
+            else:
+                self._mcu.unregister_step_active_check(self._check_active)
+    def note_homing_end(self, query_position=True):
         ffi_main, ffi_lib = chelper.get_ffi()
         ret = ffi_lib.stepcompress_reset(self._stepqueue, 0)
         if ret:
@@ -206,15 +282,17 @@ class MCU_stepper:
         ret = ffi_lib.stepcompress_queue_msg(self._stepqueue, data, len(data))
         if ret:
             raise error("Internal error in stepcompress")
-        self._query_mcu_position()
-    def _query_mcu_position(self):
+        if query_position:
+            self.query_mcu_position()
+    def query_mcu_position(self):
         if self._mcu.is_fileoutput():
             return
         params = self._get_position_cmd.send([self._oid])
-        last_pos = params['pos']
+        self.note_mcu_position(params['pos'], params['#receive_time'])
+    def note_mcu_position(self, last_pos, receive_time):
         if self._invert_dir:
             last_pos = -last_pos
-        print_time = self._mcu.estimated_print_time(params['#receive_time'])
+        print_time = self._mcu.estimated_print_time(receive_time)
         clock = self._mcu.print_time_to_clock(print_time)
         ffi_main, ffi_lib = chelper.get_ffi()
         ret = ffi_lib.stepcompress_set_last_position(self._stepqueue, clock,
@@ -223,6 +301,18 @@ class MCU_stepper:
             raise error("Internal error in stepcompress")
         self._set_mcu_position(last_pos)
         self._mcu.get_printer().send_event("stepper:sync_mcu_position", self)
+    def get_step_timing(self, reset=False):
+        # Query step timing statistics (mcus built with
+        # CONFIG_WANT_STEPPER_TIMING_STATS only)
+        if self._get_timing_cmd is None or self._mcu.is_fileoutput():
+            return None
+        params = self._get_timing_cmd.send([self._oid, int(reset)])
+        hist = bytearray(params['hist'])
+        mcu_freq = self._mcu.get_constant_float('CLOCK_FREQ')
+        return {'count': params['count'],
+                'max_late': params['max_late'] / mcu_freq,
+                'hist': [hist[i] | (hist[i+1] << 8) | (hist[i+2] << 16)
+                         | (hist[i+3] << 24) for i in range(0, len(hist), 4)]}
     def get_trapq(self):
         return self._trapq
     def set_trapq(self, tq):
@@ -234,20 +324,30 @@ class MCU_stepper:
         self._trapq = tq
         return old_tq
     def add_active_callback(self, cb):
+        if not self._active_callbacks and self._mcu_step_generation:
+            self._mcu.register_step_active_check(self._check_active)
         self._active_callbacks.append(cb)
+    def _check_active(self, flush_time):
+        sk = self._stepper_kinematics
+        ret = self._itersolve_check_active(sk, flush_time)
+        if ret:
+            cbs = self._active_callbacks
+            self._active_callbacks = []
+            if self._mcu_step_generation:
+                self._mcu.unregister_step_active_check(self._check_active)
+            for cb in cbs:
+                cb(ret)
     def generate_steps(self, flush_time):
         # Check for activity if necessary
         if self._active_callbacks:
-            sk = self._stepper_kinematics
-            ret = self._itersolve_check_active(sk, flush_time)
-            if ret:
-                cbs = self._active_callbacks
-                self._active_callbacks = []
-                for cb in cbs:
-                    cb(ret)
+            self._check_active(flush_time)
         # Generate steps
         sk = self._stepper_kinematics
-        ret = self._itersolve_generate_steps(sk, flush_time)
+        if self._stepgen_pool:
+            ret = self._stepgen_pool_generate_steps(self._stepgen_pool, sk,
+                                                    flush_time)
+        else:
+            ret = self._itersolve_generate_steps(sk, flush_time)
         if ret:
             raise error("Internal error in stepcompress")
     def is_active_axis(self, axis):
@@ -269,9 +369,13 @@ def PrinterStepper(config, units_in_radians=False):
         config, units_in_radians, True)
     step_pulse_duration = config.getfloat('step_pulse_duration', None,
                                           minval=0., maxval=.001)
+    hw_step_generator = config.getboolean('hardware_step_generator', False)
+    move_queue_reserve = config.getint('move_queue_reserve', 0, minval=0,
+                                       maxval=1024)
     mcu_stepper = MCU_stepper(name, step_pin_params, dir_pin_params,
                               rotation_dist, steps_per_rotation,
-                              step_pulse_duration, units_in_radians)
+                              step_pulse_duration, units_in_radians,
+                              hw_step_generator, move_queue_reserve)
     # Register with helper modules
     for mname in ['stepper_enable', 'force_move', 'motion_report']:
         m = printer.load_object(config, mname)
@@ -3,32 +3,56 @@
 # Copyright (C) 2016-2025  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import math, logging, importlib
+import math, logging, importlib, multiprocessing
 import mcu, chelper, kinematics.extruder
 
 # Common suffixes: _d is distance (in mm), _v is velocity (in
 #   mm/second), _v2 is velocity squared (mm^2/s^2), _t is time (in
 #   seconds), _r is ratio (scalar between 0.0 and 1.0)
 
-# Class to track each move request
+# Class to track each move request (instances are reused - see
+# ToolHead.alloc_move() - so callers must not keep references to them)
 class Move:
+    __slots__ = (
+        'toolhead', 'start_pos', 'end_pos', 'accel', 'junction_deviation',
+        'timing_callbacks', 'is_kinematic_move', 'axes_d', 'move_d',
+        'axes_r', 'min_move_t', 'max_cruise_v2', 'delta_v2',
+        'smooth_delta_v2', 'print_time', 'start_v', 'cruise_v', 'end_v',
+        'accel_t', 'cruise_t', 'decel_t')
     def __init__(self, toolhead, start_pos, end_pos, speed):
         self.toolhead = toolhead
-        self.start_pos = tuple(start_pos)
-        self.end_pos = tuple(end_pos)
+        self.timing_callbacks = []
+        self.start_pos = self.end_pos = self.axes_d = self.axes_r = ()
+        self.setup(start_pos, end_pos, speed)
+    def setup(self, start_pos, end_pos, speed):
+        toolhead = self.toolhead
+        num_axes = len(start_pos)
+        if len(self.start_pos) != num_axes:
+            self.start_pos = [0.] * num_axes
+            self.end_pos = [0.] * num_axes
+            self.axes_d = [0.] * num_axes
+            self.axes_r = [0.] * num_axes
+        if self.timing_callbacks:
+            del self.timing_callbacks[:]
+        self.start_pos[:] = start_pos
+        self.end_pos[:] = end_pos
         self.accel = toolhead.max_accel
         self.junction_deviation = toolhead.junction_deviation
-        self.timing_callbacks = []
         velocity = min(speed, toolhead.max_velocity)
         self.is_kinematic_move = True
-        self.axes_d = axes_d = [ep - sp for sp, ep in zip(start_pos, end_pos)]
-        self.move_d = move_d = math.sqrt(sum([d*d for d in axes_d[:3]]))
+        axes_d = self.axes_d
+        for i in range(num_axes):
+            axes_d[i] = end_pos[i] - start_pos[i]
+        dx, dy, dz = axes_d[0], axes_d[1], axes_d[2]
+        self.move_d = move_d = math.sqrt(dx*dx + dy*dy + dz*dz)
         if move_d < .000000001:
             # Extrude only move
-            self.end_pos = ((start_pos[0], start_pos[1], start_pos[2])
-                            + self.end_pos[3:])
+            self.end_pos[:3] = start_pos[:3]
             axes_d[0] = axes_d[1] = axes_d[2] = 0.
-            self.move_d = move_d = max([abs(ad) for ad in axes_d[3:]])
+            move_d = 0.
+            for i in range(3, num_axes):
+                move_d = max(move_d, abs(axes_d[i]))
+            self.move_d = move_d
             inv_move_d = 0.
             if move_d:
                 inv_move_d = 1. / move_d
@@ -37,17 +61,20 @@ class Move:
             self.is_kinematic_move = False
         else:
             inv_move_d = 1. / move_d
-        self.axes_r = [d * inv_move_d for d in axes_d]
+        axes_r = self.axes_r
+        for i in range(num_axes):
+            axes_r[i] = axes_d[i] * inv_move_d
         self.min_move_t = move_d / velocity
         # Junction speeds are tracked in velocity squared.  The
         # delta_v2 is the maximum amount of this squared-velocity that
         # can change in this move.
-        self.max_start_v2 = 0.
         self.max_cruise_v2 = velocity**2
         self.delta_v2 = 2.0 * move_d * self.accel
-        self.max_smoothed_v2 = 0.
         self.smooth_delta_v2 = 2.0 * move_d * toolhead.max_accel_to_decel
-        self.next_junction_v2 = 999999999.9
+        # Move timing (filled in by LookAheadQueue.queue_moves)
+        self.print_time = 0.
+        self.start_v = self.cruise_v = self.end_v = 0.
+        self.accel_t = self.cruise_t = self.decel_t = 0.
     def limit_speed(self, speed, accel):
         speed2 = speed**2
         if speed2 < self.max_cruise_v2:
@@ -56,136 +83,99 @@ class Move:
         self.accel = min(self.accel, accel)
         self.delta_v2 = 2.0 * self.move_d * self.accel
         self.smooth_delta_v2 = min(self.smooth_delta_v2, self.delta_v2)
-    def limit_next_junction_speed(self, speed):
-        self.next_junction_v2 = min(self.next_junction_v2, speed**2)
     def move_error(self, msg="Move out of range"):
         ep = self.end_pos
         m = "%s: %.3f %.3f %.3f [%.3f]" % (msg, ep[0], ep[1], ep[2], ep[3])
         return self.toolhead.printer.command_error(m)
-    def calc_junction(self, prev_move):
-        if not self.is_kinematic_move or not prev_move.is_kinematic_move:
-            return
-        # Allow extra axes to calculate maximum junction
-        ea_v2 = [ea.calc_junction(prev_move, self, e_index+3)
-                 for e_index, ea in enumerate(self.toolhead.extra_axes)]
-        max_start_v2 = min([self.max_cruise_v2,
-                            prev_move.max_cruise_v2, prev_move.next_junction_v2,
-                            prev_move.max_start_v2 + prev_move.delta_v2]
-                           + ea_v2)
-        # Find max velocity using "approximated centripetal velocity"
-        axes_r = self.axes_r
-        prev_axes_r = prev_move.axes_r
-        junction_cos_theta = -(axes_r[0] * prev_axes_r[0]
-                               + axes_r[1] * prev_axes_r[1]
-                               + axes_r[2] * prev_axes_r[2])
-        sin_theta_d2 = math.sqrt(max(0.5*(1.0-junction_cos_theta), 0.))
-        cos_theta_d2 = math.sqrt(max(0.5*(1.0+junction_cos_theta), 0.))
-        one_minus_sin_theta_d2 = 1. - sin_theta_d2
-        if one_minus_sin_theta_d2 > 0. and cos_theta_d2 > 0.:
-            R_jd = sin_theta_d2 / one_minus_sin_theta_d2
-            move_jd_v2 = R_jd * self.junction_deviation * self.accel
-            pmove_jd_v2 = R_jd * prev_move.junction_deviation * prev_move.accel
-            # Approximated circle must contact moves no further than mid-move
-            #   centripetal_v2 = .5 * self.move_d * self.accel * tan_theta_d2
-            quarter_tan_theta_d2 = .25 * sin_theta_d2 / cos_theta_d2
-            move_centripetal_v2 = self.delta_v2 * quarter_tan_theta_d2
-            pmove_centripetal_v2 = prev_move.delta_v2 * quarter_tan_theta_d2
-            max_start_v2 = min(max_start_v2, move_jd_v2, pmove_jd_v2,
-                               move_centripetal_v2, pmove_centripetal_v2)
-        # Apply limits
-        self.max_start_v2 = max_start_v2
-        self.max_smoothed_v2 = min(
-            max_start_v2, prev_move.max_smoothed_v2 + prev_move.smooth_delta_v2)
-    def set_junction(self, start_v2, cruise_v2, end_v2):
-        # Determine accel, cruise, and decel portions of the move distance
-        half_inv_accel = .5 / self.accel
-        accel_d = (cruise_v2 - start_v2) * half_inv_accel
-        decel_d = (cruise_v2 - end_v2) * half_inv_accel
-        cruise_d = self.move_d - accel_d - decel_d
-        # Determine move velocities
-        self.start_v = start_v = math.sqrt(start_v2)
-        self.cruise_v = cruise_v = math.sqrt(cruise_v2)
-        self.end_v = end_v = math.sqrt(end_v2)
-        # Determine time spent in each portion of move (time is the
-        # distance divided by average velocity)
-        self.accel_t = accel_d / ((start_v + cruise_v) * 0.5)
-        self.cruise_t = cruise_d / cruise_v
-        self.decel_t = decel_d / ((end_v + cruise_v) * 0.5)
+    def set_timing(self, timing):
+        self.print_time = timing.print_time
+        self.start_v = timing.start_v
+        self.cruise_v = timing.cruise_v
+        self.end_v = timing.end_v
+        self.accel_t = timing.accel_t
+        self.cruise_t = timing.cruise_t
+        self.decel_t = timing.decel_t
 
 LOOKAHEAD_FLUSH_TIME = 0.250
 
+MAX_JUNCTION_V2 = 999999999.9
+
 # Class to track a list of pending move requests and to facilitate
-# "look-ahead" across moves to reduce acceleration between moves.
+# "look-ahead" across moves to reduce acceleration between moves.  The
+# junction and trapezoid calculations are done in C (see lookahead.c).
 class LookAheadQueue:
     def __init__(self):
         self.queue = []
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.ffi_main = ffi_main
+        self.lookahead = ffi_main.gc(ffi_lib.lookahead_alloc(),
+                                     ffi_lib.lookahead_free)
+        self.lookahead_reset = ffi_lib.lookahead_reset
+        self.lookahead_add_move = ffi_lib.lookahead_add_move
+        self.lookahead_limit_next_junction = (
+            ffi_lib.lookahead_limit_next_junction)
+        self.lookahead_flush = ffi_lib.lookahead_flush
+        self.lookahead_queue_moves = ffi_lib.lookahead_queue_moves
     def reset(self):
         del self.queue[:]
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        self.lookahead_reset(self.lookahead)
     def set_flush_time(self, flush_time):
         self.junction_flush = flush_time
     def get_last(self):
         if self.queue:
             return self.queue[-1]
         return None
+    def limit_next_junction_speed(self, speed):
+        self.lookahead_limit_next_junction(self.lookahead, speed**2)
     def flush(self, lazy=False):
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
-        update_flush_count = lazy
-        queue = self.queue
-        flush_count = len(queue)
-        # Traverse queue from last to first move and determine maximum
-        # junction speed assuming the robot comes to a complete stop
-        # after the last move.
-        delayed = []
-        next_end_v2 = next_smoothed_v2 = peak_cruise_v2 = 0.
-        for i in range(flush_count-1, -1, -1):
-            move = queue[i]
-            reachable_start_v2 = next_end_v2 + move.delta_v2
-            start_v2 = min(move.max_start_v2, reachable_start_v2)
-            reachable_smoothed_v2 = next_smoothed_v2 + move.smooth_delta_v2
-            smoothed_v2 = min(move.max_smoothed_v2, reachable_smoothed_v2)
-            if smoothed_v2 < reachable_smoothed_v2:
-                # It's possible for this move to accelerate
-                if (smoothed_v2 + move.smooth_delta_v2 > next_smoothed_v2
-                    or delayed):
-                    # This move can decelerate or this is a full accel
-                    # move after a full decel move
-                    if update_flush_count and peak_cruise_v2:
-                        flush_count = i
-                        update_flush_count = False
-                    peak_cruise_v2 = min(move.max_cruise_v2, (
-                        smoothed_v2 + reachable_smoothed_v2) * .5)
-                    if delayed:
-                        # Propagate peak_cruise_v2 to any delayed moves
-                        if not update_flush_count and i < flush_count:
-                            mc_v2 = peak_cruise_v2
-                            for m, ms_v2, me_v2 in reversed(delayed):
-                                mc_v2 = min(mc_v2, ms_v2)
-                                m.set_junction(min(ms_v2, mc_v2), mc_v2
-                                               , min(me_v2, mc_v2))
-                        del delayed[:]
-                if not update_flush_count and i < flush_count:
-                    cruise_v2 = min((start_v2 + reachable_start_v2) * .5
-                                    , move.max_cruise_v2, peak_cruise_v2)
-                    move.set_junction(min(start_v2, cruise_v2), cruise_v2
-                                      , min(next_end_v2, cruise_v2))
-            else:
-                # Delay calculating this move until peak_cruise_v2 is known
-                delayed.append((move, start_v2, next_end_v2))
-            next_end_v2 = start_v2
-            next_smoothed_v2 = smoothed_v2
-        if update_flush_count or not flush_count:
+        flush_count = self.lookahead_flush(self.lookahead, lazy)
+        if not flush_count:
             return []
         # Remove processed moves from the queue
+        queue = self.queue
+        if flush_count == len(queue):
+            self.queue = []
+            return queue
         res = queue[:flush_count]
         del queue[:flush_count]
         return res
+    def queue_moves(self, moves, trapq, print_time):
+        # Add flushed moves to the trapq and note their timing
+        count = len(moves)
+        timings = self.ffi_main.new("struct lookahead_timing[]", count)
+        end_time = self.lookahead_queue_moves(self.lookahead, trapq,
+                                              print_time, count, timings)
+        for move, timing in zip(moves, timings):
+            move.set_timing(timing)
+        return end_time
     def add_move(self, move):
-        self.queue.append(move)
-        if len(self.queue) == 1:
+        queue = self.queue
+        queue.append(move)
+        ea_v2 = MAX_JUNCTION_V2
+        if len(queue) > 1:
+            prev_move = queue[-2]
+            if move.is_kinematic_move and prev_move.is_kinematic_move:
+                # Allow extra axes to calculate maximum junction (an
+                # axis that doesn't move in either move has no limit)
+                extra_axes = move.toolhead.extra_axes
+                axes_r, prev_axes_r = move.axes_r, prev_move.axes_r
+                for ea_index in range(3, len(axes_r)):
+                    if axes_r[ea_index] or prev_axes_r[ea_index]:
+                        ea = extra_axes[ea_index - 3]
+                        ea_v2 = min(ea_v2, ea.calc_junction(prev_move, move,
+                                                            ea_index))
+        sp = move.start_pos
+        axes_r = move.axes_r
+        self.lookahead_add_move(
+            self.lookahead, move.is_kinematic_move, sp[0], sp[1], sp[2],
+            axes_r[0], axes_r[1], axes_r[2], move.move_d, move.accel,
+            move.junction_deviation, move.max_cruise_v2,
+            move.smooth_delta_v2, ea_v2)
+        if len(queue) == 1:
             return
-        move.calc_junction(self.queue[-2])
         self.junction_flush -= move.min_move_t
         # Check if enough moves have been queued to reach the target flush time.
         return self.junction_flush <= 0.
@@ -200,10 +190,20 @@ MIN_KIN_TIME = 0.100
 MOVE_BATCH_TIME = 0.500
 STEPCOMPRESS_FLUSH_TIME = 0.050
 SDS_CHECK_TIME = 0.001 # step+dir+step filter in stepcompress.c
+MIN_BUFFER_SCALE = 0.25
+BUFFER_HOST_MARGIN = 0.150
+STEPGEN_LOAD_PERIOD = 1.0
+STEPGEN_LOAD_DECAY = 0.9
+STEPGEN_LOAD_MARGIN = 4.
 MOVE_HISTORY_EXPIRE = 30.
+MIN_MOVE_HISTORY_EXPIRE = 5.
+MOVE_POOL_MAX = 1024
 
 DRIP_SEGMENT_TIME = 0.050
 DRIP_TIME = 0.100
+MIN_DRIP_TIME = 0.040
+DRIP_RTT_FACTOR = 4.
+QUICK_RESTART_WINDOW = 0.500
 
 # Main code to track events (and their timing) on the printer toolhead
 class ToolHead:
@@ -214,7 +214,17 @@ class ToolHead:
             m for n, m in self.printer.lookup_objects(module='mcu')]
         self.mcu = self.all_mcus[0]
         self.lookahead = LookAheadQueue()
-        self.lookahead.set_flush_time(BUFFER_TIME_HIGH)
+        self.move_pool = []
+        self.max_buffer_time = config.getfloat(
+            'max_buffer_time', BUFFER_TIME_HIGH, maxval=BUFFER_TIME_HIGH,
+            minval=BUFFER_TIME_HIGH * MIN_BUFFER_SCALE)
+        self.buffer_scale = self.max_buffer_time / BUFFER_TIME_HIGH
+        self.buffer_time_low = BUFFER_TIME_LOW * self.buffer_scale
+        self.buffer_time_high = BUFFER_TIME_HIGH * self.buffer_scale
+        self.lookahead.set_flush_time(self.buffer_time_high)
+        self.move_history_time = config.getfloat(
+            'move_history_time', MOVE_HISTORY_EXPIRE,
+            minval=MIN_MOVE_HISTORY_EXPIRE)
         self.commanded_pos = [0., 0., 0., 0.]
         # Velocity and acceleration control
         self.max_velocity = config.getfloat('max_velocity', above=0.)
@@ -241,9 +251,16 @@ class ToolHead:
         self.can_pause = True
         if self.mcu.is_fileoutput():
             self.can_pause = False
+        # Adaptive buffer time tracking
+        self.adaptive_buffer_time = config.getboolean('adaptive_buffer_time',
+                                                      False)
+        if self.mcu.is_fileoutput():
+            self.adaptive_buffer_time = False
+        self.stepgen_cost = self.stepgen_span = self.stepgen_load = 0.
         self.need_check_pause = -1.
         # Print time tracking
         self.print_time = 0.
+        self.quick_restart_time = 0.
         self.special_queuing_state = "NeedPrime"
         self.priming_timer = None
         # Flush tracking
@@ -259,9 +276,30 @@ class ToolHead:
         self.trapq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
         self.trapq_append = ffi_lib.trapq_append
         self.trapq_finalize_moves = ffi_lib.trapq_finalize_moves
+        self.trapq_get_pool_stats = ffi_lib.trapq_get_pool_stats
+        self.trapq_pool_stats = ffi_main.new('struct trapq_pool_stats *')
         # Motion flushing
         self.step_generators = []
         self.flush_trapqs = [self.trapq]
+        # Optional parallel step generation
+        self.stepgen_pool = ffi_main.NULL
+        stepgen_threads = 1
+        if self.mcu.is_fileoutput():
+            # Nothing is real-time when writing to a file - use all cores
+            stepgen_threads = min(multiprocessing.cpu_count(), 16)
+        stepgen_threads = config.getint('step_generation_threads',
+                                        stepgen_threads, minval=1, maxval=16)
+        if stepgen_threads > 1:
+            sgp = ffi_lib.stepgen_pool_alloc(stepgen_threads)
+            if sgp:
+                self.stepgen_pool = ffi_main.gc(sgp, ffi_lib.stepgen_pool_free)
+            else:
+                logging.warning("Unable to start step generation threads;"
+                                " using single threaded step generation")
+        self.stepgen_pool_start = ffi_lib.stepgen_pool_start
+        self.stepgen_pool_flush = ffi_lib.stepgen_pool_flush
+        self.stepgen_pool_get_stats = ffi_lib.stepgen_pool_get_stats
+        self.stepgen_stats = ffi_main.new('struct stepgen_stats *')
         # Create kinematics class
         gcode = self.printer.lookup_object('gcode')
         self.Coord = gcode.Coord
@@ -296,24 +334,60 @@ class ToolHead:
     # Print time and flush tracking
     def _advance_flush_time(self, flush_time):
         flush_time = max(flush_time, self.last_flush_time)
+        if self.adaptive_buffer_time:
+            start_time = self.reactor.monotonic()
         # Generate steps via itersolve
         sg_flush_want = min(flush_time + STEPCOMPRESS_FLUSH_TIME,
                             self.print_time - self.kin_flush_delay)
         sg_flush_time = max(sg_flush_want, flush_time)
+        sgp = self.stepgen_pool
+        if sgp:
+            self.stepgen_pool_start(sgp)
         for sg in self.step_generators:
             sg(sg_flush_time)
+        for m in self.all_mcus:
+            m.generate_steps(sg_flush_time, sgp)
+        if sgp:
+            ret = self.stepgen_pool_flush(sgp, sg_flush_time)
+            if ret:
+                raise mcu.error("Internal error in stepcompress")
         self.min_restart_time = max(self.min_restart_time, sg_flush_time)
         # Free trapq entries that are no longer needed
         clear_history_time = self.clear_history_time
         if not self.can_pause:
-            clear_history_time = flush_time - MOVE_HISTORY_EXPIRE
+            clear_history_time = flush_time - self.move_history_time
         free_time = sg_flush_time - self.kin_flush_delay
         for trapq in self.flush_trapqs:
             self.trapq_finalize_moves(trapq, free_time, clear_history_time)
         # Flush stepcompress and mcu steppersync
         for m in self.all_mcus:
             m.flush_moves(flush_time, clear_history_time)
+        if self.adaptive_buffer_time:
+            self._note_step_generation_cost(
+                self.reactor.monotonic() - start_time,
+                flush_time - self.last_flush_time)
         self.last_flush_time = flush_time
+    def _note_step_generation_cost(self, cost, span):
+        self.stepgen_cost += cost
+        self.stepgen_span += span
+        if self.stepgen_span < STEPGEN_LOAD_PERIOD:
+            return
+        # Track the host time needed per second of generated motion
+        load = self.stepgen_cost / self.stepgen_span
+        self.stepgen_cost = self.stepgen_span = 0.
+        self.stepgen_load = max(load, self.stepgen_load * STEPGEN_LOAD_DECAY)
+        # Reduce the buffer times as long as steps for a full buffer can
+        # be generated well before the buffer drains to its low mark
+        base_scale = self.buffer_scale
+        avail = (BUFFER_TIME_LOW * base_scale
+                 - STEPGEN_LOAD_MARGIN * self.stepgen_load
+                 * BUFFER_TIME_HIGH * base_scale)
+        scale = base_scale
+        if avail > BUFFER_HOST_MARGIN:
+            scale = max(MIN_BUFFER_SCALE,
+                        base_scale * BUFFER_HOST_MARGIN / avail)
+        self.buffer_time_low = BUFFER_TIME_LOW * scale
+        self.buffer_time_high = BUFFER_TIME_HIGH * scale
     def _advance_move_time(self, next_print_time):
         pt_delay = self.kin_flush_delay + STEPCOMPRESS_FLUSH_TIME
         flush_time = max(self.last_flush_time, self.print_time - pt_delay)
@@ -329,7 +403,12 @@ class ToolHead:
         est_print_time = self.mcu.estimated_print_time(curtime)
         kin_time = max(est_print_time + MIN_KIN_TIME, self.min_restart_time)
         kin_time += self.kin_flush_delay
-        min_print_time = max(est_print_time + BUFFER_TIME_START, kin_time)
+        buffer_start = BUFFER_TIME_START
+        if est_print_time < self.quick_restart_time:
+            # Resuming promptly after a probe - don't add a startup buffer
+            buffer_start = 0.
+        self.quick_restart_time = 0.
+        min_print_time = max(est_print_time + buffer_start, kin_time)
         if min_print_time > self.print_time:
             self.print_time = min_print_time
             self.printer.send_event("toolhead:sync_print_time",
@@ -345,22 +424,22 @@ class ToolHead:
             self.need_check_pause = -1.
             self._calc_print_time()
         # Queue moves into trapezoid motion queue (trapq)
-        next_move_time = self.print_time
+        next_move_time = self.lookahead.queue_moves(moves, self.trapq,
+                                                    self.print_time)
+        extra_axes = self.extra_axes
         for move in moves:
-            if move.is_kinematic_move:
-                self.trapq_append(
-                    self.trapq, next_move_time,
-                    move.accel_t, move.cruise_t, move.decel_t,
-                    move.start_pos[0], move.start_pos[1], move.start_pos[2],
-                    move.axes_r[0], move.axes_r[1], move.axes_r[2],
-                    move.start_v, move.cruise_v, move.accel)
-            for e_index, ea in enumerate(self.extra_axes):
-                if move.axes_d[e_index + 3]:
-                    ea.process_move(next_move_time, move, e_index + 3)
-            next_move_time = (next_move_time + move.accel_t
-                              + move.cruise_t + move.decel_t)
-            for cb in move.timing_callbacks:
-                cb(next_move_time)
+            move_time = move.print_time
+            axes_d = move.axes_d
+            for ea_index in range(3, len(axes_d)):
+                if axes_d[ea_index]:
+                    extra_axes[ea_index - 3].process_move(move_time, move,
+                                                          ea_index)
+            if move.timing_callbacks:
+                end_time = (move_time + move.accel_t
+                            + move.cruise_t + move.decel_t)
+                for cb in move.timing_callbacks:
+                    cb(end_time)
+        self._release_moves(moves)
         # Generate steps for moves
         self.note_mcu_movequeue_activity(next_move_time + self.kin_flush_delay,
                                          set_step_gen_time=True)
@@ -370,7 +449,7 @@ class ToolHead:
         self._process_lookahead()
         self.special_queuing_state = "NeedPrime"
         self.need_check_pause = -1.
-        self.lookahead.set_flush_time(BUFFER_TIME_HIGH)
+        self.lookahead.set_flush_time(self.buffer_time_high)
         self.check_stall_time = 0.
     def flush_step_generation(self):
         self._flush_lookahead()
@@ -399,11 +478,11 @@ class ToolHead:
             if self.priming_timer is None:
                 self.priming_timer = self.reactor.register_timer(
                     self._priming_handler)
-            wtime = eventtime + max(0.100, buffer_time - BUFFER_TIME_LOW)
+            wtime = eventtime + max(0.100, buffer_time - self.buffer_time_low)
             self.reactor.update_timer(self.priming_timer, wtime)
         # Check if there are lots of queued moves and pause if so
         while 1:
-            pause_time = buffer_time - BUFFER_TIME_HIGH
+            pause_time = buffer_time - self.buffer_time_high
             if pause_time <= 0.:
                 break
             if not self.can_pause:
@@ -414,7 +493,8 @@ class ToolHead:
             buffer_time = self.print_time - est_print_time
         if not self.special_queuing_state:
             # In main state - defer pause checking until needed
-            self.need_check_pause = est_print_time + BUFFER_TIME_HIGH + 0.100
+            self.need_check_pause = (est_print_time + self.buffer_time_high
+                                     + 0.100)
     def _priming_handler(self, eventtime):
         self.reactor.unregister_timer(self.priming_timer)
         self.priming_timer = None
@@ -433,9 +513,9 @@ class ToolHead:
                 # In "main" state - flush lookahead if buffer runs low
                 print_time = self.print_time
                 buffer_time = print_time - est_print_time
-                if buffer_time > BUFFER_TIME_LOW:
+                if buffer_time > self.buffer_time_low:
                     # Running normally - reschedule check
-                    return eventtime + buffer_time - BUFFER_TIME_LOW
+                    return eventtime + buffer_time - self.buffer_time_low
                 # Under ran low buffer mark - flush lookahead queue
                 self._flush_lookahead()
                 if print_time != self.print_time:
@@ -467,18 +547,29 @@ class ToolHead:
         self.kin.set_position(newpos, homing_axes)
         self.printer.send_event("toolhead:set_position")
     def limit_next_junction_speed(self, speed):
-        last_move = self.lookahead.get_last()
-        if last_move is not None:
-            last_move.limit_next_junction_speed(speed)
+        self.lookahead.limit_next_junction_speed(speed)
+    def alloc_move(self, start_pos, end_pos, speed):
+        move_pool = self.move_pool
+        if move_pool:
+            move = move_pool.pop()
+            move.setup(start_pos, end_pos, speed)
+            return move
+        return Move(self, start_pos, end_pos, speed)
+    def _release_moves(self, moves):
+        move_pool = self.move_pool
+        if len(move_pool) < MOVE_POOL_MAX:
+            move_pool.extend(moves)
     def move(self, newpos, speed):
-        move = Move(self, self.commanded_pos, newpos, speed)
+        move = self.alloc_move(self.commanded_pos, newpos, speed)
         if not move.move_d:
+            self._release_moves((move,))
             return
         if move.is_kinematic_move:
             self.kin.check_move(move)
-        for e_index, ea in enumerate(self.extra_axes):
-            if move.axes_d[e_index + 3]:
-                ea.check_move(move, e_index + 3)
+        axes_d = move.axes_d
+        for ea_index in range(3, len(axes_d)):
+            if axes_d[ea_index]:
+                self.extra_axes[ea_index - 3].check_move(move, ea_index)
         self.commanded_pos[:] = move.end_pos
         want_flush = self.lookahead.add_move(move)
         if want_flush:
@@ -492,6 +583,21 @@ class ToolHead:
                 curpos[i] = coord[i]
         self.move(curpos, speed)
         self.printer.send_event("toolhead:manual_move")
+    def check_position(self, newpos):
+        # Raise an error if the toolhead can not move to 'newpos'
+        move = self.alloc_move(self.commanded_pos, newpos, self.max_velocity)
+        if move.is_kinematic_move:
+            self.kin.check_move(move)
+        self._release_moves((move,))
+    def note_trapq_moves(self, end_time, newpos):
+        # The caller appended moves directly to the toolhead trapq
+        # (starting at get_last_move_time() and ending at 'end_time' at
+        # position 'newpos') - generate steps for them
+        self.commanded_pos[:3] = newpos[:3]
+        self.note_mcu_movequeue_activity(end_time + self.kin_flush_delay,
+                                         set_step_gen_time=True)
+        self._advance_move_time(end_time)
+        self._check_pause()
     def dwell(self, delay):
         next_print_time = self.get_last_move_time() + max(0., delay)
         self._advance_move_time(next_print_time)
@@ -538,16 +644,25 @@ class ToolHead:
     def get_extra_axes(self):
         return [None, None, None] + self.extra_axes
     # Homing "drip move" handling
+    def _calc_drip_time(self):
+        # Queue steps only as far ahead as the mcu links require
+        rtts = [m.get_link_rtt() for m in self.all_mcus]
+        if None in rtts:
+            # Not connected (eg, batch mode output)
+            return DRIP_TIME
+        return min(DRIP_TIME, max(MIN_DRIP_TIME, max(rtts) * DRIP_RTT_FACTOR))
     def drip_update_time(self, next_print_time, drip_completion, addstepper=()):
         # Transition from "NeedPrime"/"Priming"/main state to "Drip" state
         self.special_queuing_state = "Drip"
         self.need_check_pause = self.reactor.NEVER
         self.reactor.update_timer(self.flush_timer, self.reactor.NEVER)
         self.do_kick_flush_timer = False
-        self.lookahead.set_flush_time(BUFFER_TIME_HIGH)
+        self.lookahead.set_flush_time(self.buffer_time_high)
         self.check_stall_time = 0.
         # Update print_time in segments until drip_completion signal
-        flush_delay = DRIP_TIME + STEPCOMPRESS_FLUSH_TIME + self.kin_flush_delay
+        drip_time = self._calc_drip_time()
+        segment_time = min(DRIP_SEGMENT_TIME, .5 * drip_time)
+        flush_delay = drip_time + STEPCOMPRESS_FLUSH_TIME + self.kin_flush_delay
         while self.print_time < next_print_time:
             if drip_completion.test():
                 break
@@ -558,7 +673,7 @@ class ToolHead:
                 # Pause before sending more steps
                 drip_completion.wait(curtime + wait_time)
                 continue
-            npt = min(self.print_time + DRIP_SEGMENT_TIME, next_print_time)
+            npt = min(self.print_time + segment_time, next_print_time)
             self.note_mcu_movequeue_activity(npt + self.kin_flush_delay,
                                              set_step_gen_time=True)
             for stepper in addstepper:
@@ -574,22 +689,19 @@ class ToolHead:
             self.lookahead.add_move(submit_move)
         moves = self.lookahead.flush()
         self._calc_print_time()
-        next_move_time = self.print_time
-        for move in moves:
-            self.trapq_append(
-                self.trapq, next_move_time,
-                move.accel_t, move.cruise_t, move.decel_t,
-                move.start_pos[0], move.start_pos[1], move.start_pos[2],
-                move.axes_r[0], move.axes_r[1], move.axes_r[2],
-                move.start_v, move.cruise_v, move.accel)
-            next_move_time = (next_move_time + move.accel_t
-                              + move.cruise_t + move.decel_t)
+        next_move_time = self.lookahead.queue_moves(moves, self.trapq,
+                                                    self.print_time)
         self.lookahead.reset()
+        self._release_moves(moves)
         return next_move_time
+    def note_quick_restart(self):
+        # The caller will promptly queue further moves (eg, lifting a
+        # probe) - allow them to start without the usual startup delay
+        self.quick_restart_time = self.print_time + QUICK_RESTART_WINDOW
     def drip_move(self, newpos, speed, drip_completion):
         # Create and verify move is valid
         newpos = newpos[:3] + self.commanded_pos[3:]
-        move = Move(self, self.commanded_pos, newpos, speed)
+        move = self.alloc_move(self.commanded_pos, newpos, speed)
         if move.move_d:
             self.kin.check_move(move)
         # Make sure stepper movement doesn't start before nominal start time
@@ -606,13 +718,29 @@ class ToolHead:
         for m in self.all_mcus:
             m.check_active(max_queue_time, eventtime)
         est_print_time = self.mcu.estimated_print_time(eventtime)
-        self.clear_history_time = est_print_time - MOVE_HISTORY_EXPIRE
+        self.clear_history_time = est_print_time - self.move_history_time
         buffer_time = self.print_time - est_print_time
         is_active = buffer_time > -60. or not self.special_queuing_state
         if self.special_queuing_state == "Drip":
             buffer_time = 0.
-        return is_active, "print_time=%.3f buffer_time=%.3f print_stall=%d" % (
+        msg = "print_time=%.3f buffer_time=%.3f print_stall=%d" % (
             self.print_time, max(buffer_time, 0.), self.print_stall)
+        if self.stepgen_pool:
+            st = self.stepgen_stats
+            self.stepgen_pool_get_stats(self.stepgen_pool, st)
+            avg_solve_time = 0.
+            if st.flush_count:
+                avg_solve_time = st.total_solve_time / st.flush_count
+            msg += " stepgen_solve_time=%.6f stepgen_max_solve_time=%.6f" % (
+                avg_solve_time, st.max_solve_time)
+        pst = self.trapq_pool_stats
+        self.trapq_get_pool_stats(self.trapq, pst)
+        msg += " trapq_moves=%d trapq_pool=%d" % (
+            pst.move_count - pst.free_count, pst.move_count)
+        if self.adaptive_buffer_time:
+            msg += " stepgen_load=%.4f buffer_time_high=%.3f" % (
+                self.stepgen_load, self.buffer_time_high)
+        return is_active, msg
     def check_busy(self, eventtime):
         est_print_time = self.mcu.estimated_print_time(eventtime)
         lookahead_empty = not self.lookahead.queue
@@ -639,11 +767,18 @@ class ToolHead:
         return self.kin
     def get_trapq(self):
         return self.trapq
+    def get_step_generation_pool(self):
+        return self.stepgen_pool
     def register_step_generator(self, handler):
         self.step_generators.append(handler)
     def unregister_step_generator(self, handler):
         if handler in self.step_generators:
             self.step_generators.remove(handler)
+    def register_stepper(self, stepper):
+        # Steps are generated in bulk by the stepper's mcu on each flush
+        stepper.set_mcu_step_generation(True)
+    def unregister_stepper(self, stepper):
+        stepper.set_mcu_step_generation(False)
     def note_step_generation_scan_time(self, delay, old_delay=0.):
         self.flush_step_generation()
         if old_delay:
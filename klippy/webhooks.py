@@ -3,7 +3,7 @@
 # Copyright (C) 2020 Eric Callahan <arksine.code@gmail.com>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license
-import logging, socket, os, sys, errno, collections
+import logging, socket, os, sys, errno, collections, struct
 import gcode
 
 try:
@@ -32,11 +32,16 @@ except ImportError:
         return json.dumps(obj, separators=(',', ':')).encode()
     def json_loads(data):
         return json.loads(data, object_hook=json_loads_byteify)
+    msgpack_dumps = None
 else:
     json_dumps = msgspec.json.encode
     json_loads = msgspec.json.decode
+    msgpack_dumps = msgspec.msgpack.encode
+msgpack_header = struct.Struct('>I')
 
 REQUEST_LOG_SIZE = 20
+SEND_BUFFER_SIZE = 65536
+MAX_BULK_QUEUE = 32
 
 class WebRequestError(gcode.CommandError):
     def __init__(self, message,):
@@ -195,6 +200,11 @@ class ClientConnection:
         self.fd_handle = self.reactor.register_fd(
             self.sock.fileno(), self.process_received, self._do_send)
         self.partial_data = self.send_buffer = b""
+        # Messages not yet encoded (only while the client is blocking)
+        self.send_queue = collections.deque()
+        self.pending_status = None
+        self.bulk_count = self.bulk_drops = 0
+        self.use_msgpack = self.want_msgpack = False
         self.is_blocking = False
         self.blocking_count = 0
         self.set_client_info("?", "New connection")
@@ -278,22 +288,89 @@ class ClientConnection:
         if result is None:
             return
         self.send(result)
-
-    def send(self, data):
-        try:
-            jmsg = json_dumps(data)
-            self.send_buffer += jmsg + b"\x03"
-        except (TypeError, ValueError) as e:
-            msg = ("json encoding error: %s" % (str(e),))
-            logging.exception(msg)
-            self.printer.invoke_shutdown(msg)
-            return
+        if self.want_msgpack:
+            # Switch encoding after sending the "info" response
+            self.want_msgpack = False
+            self.send(None)
+
+    def request_msgpack(self):
+        if msgpack_dumps is None:
+            return False
+        if not self.use_msgpack:
+            self.want_msgpack = True
+        return True
+
+    def send(self, data, is_bulk=False):
+        self.send_queue.append((data, is_bulk))
         if not self.is_blocking:
             self._do_send()
 
+    def send_status(self, data):
+        # Merge status updates while the client is not accepting data
+        ps = self.pending_status
+        if ps is not None and self.send_queue[-1][0] is ps:
+            params = data['params']
+            pparams = ps['params']
+            pparams['eventtime'] = params['eventtime']
+            pstatus = pparams['status']
+            for obj_name, fields in params['status'].items():
+                if obj_name in pstatus:
+                    pstatus[obj_name].update(fields)
+                else:
+                    pstatus[obj_name] = fields
+            return
+        self.pending_status = data
+        self.send(data)
+
+    def send_bulk(self, data):
+        # Bulk data is discarded if the client falls too far behind
+        if self.bulk_count >= MAX_BULK_QUEUE:
+            if not self.bulk_drops:
+                logging.info("webhooks client %s: discarding bulk data",
+                             self.uid)
+            self.bulk_drops += 1
+            return
+        self.bulk_count += 1
+        self.send(data, is_bulk=True)
+
+    def _encode_queue(self):
+        # Encode queued messages (up to the send buffer size)
+        send_queue = self.send_queue
+        parts = [self.send_buffer]
+        size = len(self.send_buffer)
+        while send_queue and size < SEND_BUFFER_SIZE:
+            data, is_bulk = send_queue.popleft()
+            if data is None:
+                # Marker to switch to msgpack encoding
+                self.use_msgpack = True
+                continue
+            if is_bulk:
+                self.bulk_count -= 1
+            elif data is self.pending_status:
+                self.pending_status = None
+            try:
+                if self.use_msgpack:
+                    jmsg = msgpack_dumps(data)
+                    parts.append(msgpack_header.pack(len(jmsg)))
+                    parts.append(jmsg)
+                    size += len(jmsg) + msgpack_header.size
+                    continue
+                jmsg = json_dumps(data)
+            except (TypeError, ValueError) as e:
+                msg = ("json encoding error: %s" % (str(e),))
+                logging.exception(msg)
+                self.printer.invoke_shutdown(msg)
+                continue
+            parts.append(jmsg)
+            parts.append(b"\x03")
+            size += len(jmsg) + 1
+        self.send_buffer = b"".join(parts)
+
     def _do_send(self, eventtime=None):
         if self.fd_handle is None:
             return
+        if self.send_queue:
+            self._encode_queue()
         try:
             sent = self.sock.send(self.send_buffer)
         except socket.error as e:
@@ -302,7 +379,8 @@ class ClientConnection:
                 self.close()
                 return
             sent = 0
-        if sent < len(self.send_buffer):
+        self.send_buffer = self.send_buffer[sent:]
+        if self.send_buffer or self.send_queue:
             if not self.is_blocking:
                 self.reactor.set_fd_wake(self.fd_handle, False, True)
                 self.is_blocking = True
@@ -310,7 +388,10 @@ class ClientConnection:
         elif self.is_blocking:
             self.reactor.set_fd_wake(self.fd_handle, True, False)
             self.is_blocking = False
-        self.send_buffer = self.send_buffer[sent:]
+            if self.bulk_drops:
+                logging.info("webhooks client %s: discarded %d bulk messages",
+                             self.uid, self.bulk_drops)
+                self.bulk_drops = 0
 
 class WebHooks:
     def __init__(self, printer):
@@ -361,8 +442,14 @@ class WebHooks:
 
     def _handle_info_request(self, web_request):
         client_info = web_request.get_dict('client_info', None)
+        encoding = None
         if client_info is not None:
-            web_request.get_client_connection().set_client_info(client_info)
+            cconn = web_request.get_client_connection()
+            cconn.set_client_info(client_info)
+            encoding = client_info.get('encoding')
+            if encoding is not None:
+                if encoding != 'msgpack' or not cconn.request_msgpack():
+                    encoding = 'json'
         state_message, state = self.printer.get_state_message()
         src_path = os.path.dirname(__file__)
         klipper_path = os.path.normpath(os.path.join(src_path, ".."))
@@ -377,6 +464,8 @@ class WebHooks:
         start_args = self.printer.get_start_args()
         for sa in ['log_file', 'config_file', 'software_version', 'cpu_info']:
             response[sa] = start_args.get(sa)
+        if encoding is not None:
+            response['encoding'] = encoding
         web_request.send(response)
 
     def _handle_estop_request(self, web_request):
@@ -475,11 +564,26 @@ class QueryStatusHelper:
         self.pending_queries = []
         self.query_timer = None
         self.last_query = {}
+        # Objects that report status changes via note_status_change()
+        self.tracked_objects = {}
         # Register webhooks
         webhooks = printer.lookup_object('webhooks')
         webhooks.register_endpoint("objects/list", self._handle_list)
         webhooks.register_endpoint("objects/query", self._handle_query)
         webhooks.register_endpoint("objects/subscribe", self._handle_subscribe)
+    def register_tracked_object(self, obj_name):
+        # The object promises to call note_status_change() whenever
+        # the contents of its get_status() change
+        self.tracked_objects[obj_name] = None
+    def note_status_change(self, obj_name, fields=None):
+        # Note a change to the given status fields (None for all fields)
+        if obj_name not in self.tracked_objects:
+            return
+        dirty = self.tracked_objects[obj_name]
+        if fields is None:
+            self.tracked_objects[obj_name] = None
+        elif dirty is not None:
+            dirty.update(fields)
     def _handle_list(self, web_request):
         objects = [n for n, o in self.printer.lookup_objects()
                    if hasattr(o, 'get_status')]
@@ -490,6 +594,7 @@ class QueryStatusHelper:
         msglist = self.pending_queries
         self.pending_queries = []
         msglist.extend(self.clients.values())
+        tracked = self.tracked_objects
         # Generate get_status() info for each client
         for cconn, subscription, send_func, template in msglist:
             is_query = cconn is None
@@ -499,8 +604,16 @@ class QueryStatusHelper:
             # Query each requested printer object
             cquery = {}
             for obj_name, req_items in subscription.items():
+                # Tracked objects only need to be checked for changes
+                # in their "dirty" fields (if they were queried last time)
+                dirty = tracked.get(obj_name)
+                if dirty is not None and obj_name not in last_query:
+                    dirty = None
                 res = query.get(obj_name, None)
-                if res is None:
+                if res is None and dirty is not None and not dirty:
+                    # Status unchanged since last query
+                    res = query[obj_name] = last_query[obj_name]
+                elif res is None:
                     po = self.printer.lookup_object(obj_name, None)
                     if po is None or not hasattr(po, 'get_status'):
                         res = query[obj_name] = {}
@@ -512,10 +625,20 @@ class QueryStatusHelper:
                         subscription[obj_name] = req_items
                 lres = last_query.get(obj_name, {})
                 cres = {}
-                for ri in req_items:
-                    rd = res.get(ri, None)
-                    if is_query or rd != lres.get(ri):
-                        cres[ri] = rd
+                if is_query:
+                    for ri in req_items:
+                        cres[ri] = res.get(ri, None)
+                elif dirty is None:
+                    for ri in req_items:
+                        rd = res.get(ri, None)
+                        if rd != lres.get(ri):
+                            cres[ri] = rd
+                elif dirty:
+                    for ri in req_items:
+                        if ri in dirty:
+                            rd = res.get(ri, None)
+                            if rd != lres.get(ri):
+                                cres[ri] = rd
                 if cres or is_query:
                     cquery[obj_name] = cres
             # Send data
@@ -523,6 +646,10 @@ class QueryStatusHelper:
                 tmp = dict(template)
                 tmp['params'] = {'eventtime': eventtime, 'status': cquery}
                 send_func(tmp)
+        # Changes to tracked objects have now been reported
+        for obj_name, dirty in tracked.items():
+            if dirty is None or dirty:
+                tracked[obj_name] = set()
         if not query:
             # Unregister timer if there are no longer any subscriptions
             reactor = self.printer.get_reactor()
@@ -556,11 +683,12 @@ class QueryStatusHelper:
         msg = complete.wait()
         web_request.send(msg['params'])
         if is_subscribe:
-            self.clients[cconn] = (cconn, objects, cconn.send, template)
+            self.clients[cconn] = (cconn, objects, cconn.send_status,
+                                  template)
     def _handle_subscribe(self, web_request):
         self._handle_query(web_request, is_subscribe=True)
 
 def add_early_printer_objects(printer):
     printer.add_object('webhooks', WebHooks(printer))
     GCodeHelper(printer)
-    QueryStatusHelper(printer)
+    printer.add_object('query_status', QueryStatusHelper(printer))
@@ -27,6 +27,7 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ///////////////////////////////////////////////////////////////////////////////
 #include <string>
+#include <algorithm>
 #include <exception>
 #include <string.h>
 #include <stdio.h>
@@ -159,19 +160,37 @@ Flasher::write(const char* filename, uint32_t foffset)
     _observer.onProgress(numPages, numPages);
 }
 
+uint32_t
+Flasher::checksumChunkSize()
+{
+    uint32_t pageSize = _flash->pageSize();
+    uint32_t chunkSize = _samba.checksumBufferSize() / pageSize * pageSize;
+    return chunkSize ? chunkSize : pageSize;
+}
+
+bool
+Flasher::checksumMatch(const uint8_t* buffer, uint32_t addr, uint32_t size)
+{
+    uint16_t calcCrc = 0;
+
+    for (uint32_t i = 0; i < size; i++)
+        calcCrc = _samba.checksumCalc(buffer[i], calcCrc);
+
+    return _samba.checksumBuffer(addr, size) == calcCrc;
+}
+
 bool
 Flasher::verify(const char* filename, uint32_t& pageErrors, uint32_t& totalErrors, uint32_t foffset)
 {
     FILE* infile;
     uint32_t pageSize = _flash->pageSize();
-    uint8_t bufferA[pageSize];
+    uint32_t chunkSize = _samba.canChecksumBuffer() ? checksumChunkSize() : pageSize;
+    std::vector<uint8_t> bufferA(chunkSize);
     uint8_t bufferB[pageSize];
     uint32_t pageNum = 0;
     uint32_t numPages;
     uint32_t pageOffset;
     uint32_t byteErrors = 0;
-    uint16_t calcCrc = 0;
-    uint16_t flashCrc;
     long fsize;
     size_t fbytes;
 
@@ -200,49 +219,44 @@ Flasher::verify(const char* filename, uint32_t& pageErrors, uint32_t& totalError
 
         _observer.onStatus("Verify %ld bytes of flash\n", fsize);
 
-        while ((fbytes = fread(bufferA, 1, pageSize, infile)) > 0)
+        // Compare a checksum of up to a full checksum buffer at a time
+        // and only read back the pages of a mismatched chunk
+        while ((fbytes = fread(bufferA.data(), 1, chunkSize, infile)) > 0)
         {
-            byteErrors = 0;
-            
             _observer.onProgress(pageNum, numPages);
 
-            if (_samba.canChecksumBuffer())
+            if (_samba.canChecksumBuffer()
+                && checksumMatch(bufferA.data(), (pageOffset + pageNum) * pageSize, fbytes))
             {
-                for (uint32_t i = 0; i < fbytes; i++)
-                    calcCrc = _samba.checksumCalc(bufferA[i], calcCrc);
-                
-                flashCrc = _samba.checksumBuffer((pageOffset + pageNum) * pageSize, fbytes);
-                
-                if (flashCrc != calcCrc)
-                {
-                    _flash->readPage(pageOffset + pageNum, bufferB);
-
-                    for (uint32_t i = 0; i < fbytes; i++)
-                    {
-                        if (bufferA[i] != bufferB[i])
-                            byteErrors++;
-                    }
-                }
+                pageNum += (fbytes + pageSize - 1) / pageSize;
+                if (pageNum >= numPages || fbytes != chunkSize)
+                    break;
+                continue;
             }
-            else
+
+            for (uint32_t pos = 0; pos < fbytes; pos += pageSize)
             {
+                uint32_t pbytes = std::min(pageSize, (uint32_t)fbytes - pos);
+
                 _flash->readPage(pageOffset + pageNum, bufferB);
 
-                for (uint32_t i = 0; i < fbytes; i++)
+                byteErrors = 0;
+                for (uint32_t i = 0; i < pbytes; i++)
                 {
-                    if (bufferA[i] != bufferB[i])
+                    if (bufferA[pos + i] != bufferB[i])
                         byteErrors++;
                 }
-            }
-            
-            if (byteErrors != 0)
-            {
-                pageErrors++;
-                totalErrors += byteErrors;
+
+                if (byteErrors != 0)
+                {
+                    pageErrors++;
+                    totalErrors += byteErrors;
+                }
+
+                pageNum++;
             }
 
-            pageNum++;
-            if (pageNum == numPages || fbytes != pageSize)
+            if (pageNum >= numPages || fbytes != chunkSize)
                 break;
         }
     }
@@ -258,10 +272,66 @@ Flasher::verify(const char* filename, uint32_t& pageErrors, uint32_t& totalError
     
     if (pageErrors != 0)
         return false;
-
+    
     return true;
 }
 
+// Check if the flash already holds the contents of 'filename' (using
+// the checksum support of the bootloader, if available)
+bool
+Flasher::unchanged(const char* filename, uint32_t foffset)
+{
+    FILE* infile;
+    uint32_t pageSize = _flash->pageSize();
+    long fsize;
+    size_t fbytes;
+    bool res = true;
+
+    if (!_samba.canChecksumBuffer())
+        return false;
+
+    if (foffset % pageSize != 0 || foffset >= _flash->totalSize())
+        throw FlashOffsetError();
+
+    infile = fopen(filename, "rb");
+    if (!infile)
+        throw FileOpenError(errno);
+
+    try
+    {
+        if (fseek(infile, 0, SEEK_END) != 0 || (fsize = ftell(infile)) < 0)
+            throw FileIoError(errno);
+
+        rewind(infile);
+
+        if ((fsize + pageSize - 1) / pageSize > _flash->numPages())
+            throw FileSizeError();
+
+        uint32_t chunkSize = checksumChunkSize();
+        std::vector<uint8_t> buffer(chunkSize);
+        uint32_t offset = foffset;
+
+        while ((fbytes = fread(buffer.data(), 1, chunkSize, infile)) > 0)
+        {
+            if (!checksumMatch(buffer.data(), offset, fbytes))
+            {
+                res = false;
+                break;
+            }
+            offset += fbytes;
+        }
+    }
+    catch(...)
+    {
+        fclose(infile);
+        throw;
+    }
+
+    fclose(infile);
+
+    return res;
+}
+
 void
 Flasher::read(const char* filename, uint32_t fsize, uint32_t foffset)
 {
@@ -97,11 +97,15 @@ public:
     void erase(uint32_t foffset);
     void write(const char* filename, uint32_t foffset = 0);
     bool verify(const char* filename, uint32_t& pageErrors, uint32_t& totalErrors, uint32_t foffset = 0);
+    bool unchanged(const char* filename, uint32_t foffset = 0);
     void read(const char* filename, uint32_t fsize, uint32_t foffset = 0);
     void lock(std::string& regionArg, bool enable);
     void info(FlasherInfo& info);
 
 private:
+    bool checksumMatch(const uint8_t* buffer, uint32_t addr, uint32_t size);
+    uint32_t checksumChunkSize();
+
     Samba& _samba;
     Device::FlashPtr& _flash;
     FlasherObserver& _observer;
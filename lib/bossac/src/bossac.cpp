@@ -66,6 +66,7 @@ public:
     bool help;
     bool usbPort;
     bool arduinoErase;
+    bool skipUnchanged;
 
     int readArg;
     int offsetArg;
@@ -94,6 +95,7 @@ BossaConfig::BossaConfig()
     help = false;
     usbPort = false;
     arduinoErase = false;
+    skipUnchanged = false;
 
     readArg = 0;
     offsetArg = 0;
@@ -257,6 +259,12 @@ static Option opts[] =
       'a', "arduino-erase", &config.arduinoErase,
       { ArgNone },
       "erase and reset via Arduino 1200 baud hack"
+    },
+    {
+      'k', "skip-unchanged", &config.skipUnchanged,
+      { ArgNone },
+      "skip erase, write, and verify if the flash already\n"
+      "matches FILE (requires bootloader checksum support)"
     }
 };
 
@@ -404,6 +412,13 @@ main(int argc, char* argv[])
         if (config.unlock)
             flasher.lock(config.unlockArg, false);
 
+        if (config.write && config.skipUnchanged
+            && flasher.unchanged(argv[args], config.offsetArg))
+        {
+            printf("Flash already matches %s - skipping write\n", argv[args]);
+            config.erase = config.write = config.verify = false;
+        }
+
         if (config.erase)
         {
             timer_start();
@@ -0,0 +1,352 @@
+#!/usr/bin/env python3
+# Benchmark of the host C step generation and compression code
+#
+# Copyright (C) 2026  agent <agent@local>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, time, math, random, json, zlib
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+import chelper
+from extras import shaper_defs
+
+MCU_FREQ = 72000000.
+MAX_ERROR = .000025
+STEP_DIST = .0125
+E_STEP_DIST = .002
+FLUSH_TIME = .050
+MOVE_NUM = 1024
+
+# Message tags (the generated messages are discarded so any value works)
+TAG_QUEUE_STEP, TAG_SET_NEXT_STEP_DIR, TAG_QUEUE_STEP2, TAG_QUEUE_STEPS = (
+    1, 2, 3, 4)
+
+
+######################################################################
+# Move sources
+######################################################################
+
+# Trapezoid moves between random points (with a stop at each point)
+def generate_moves(count, velocity, accel, extrude_ratio, seed):
+    rnd = random.Random(seed)
+    moves = []
+    emoves = []
+    print_time = 0.100
+    pos = (0., 0., 10.)
+    epos = 0.
+    for i in range(count):
+        npos = (rnd.uniform(-70., 70.), rnd.uniform(-70., 70.), 10.)
+        axes_d = [n - p for n, p in zip(npos, pos)]
+        move_d = math.sqrt(sum([d*d for d in axes_d]))
+        if move_d < .001:
+            continue
+        axes_r = [d / move_d for d in axes_d]
+        cruise_v = min(velocity, math.sqrt(move_d * accel))
+        accel_t = cruise_v / accel
+        cruise_t = (move_d - cruise_v * accel_t) / cruise_v
+        moves.append((print_time, accel_t, cruise_t, accel_t)
+                     + tuple(pos) + tuple(axes_r) + (0., cruise_v, accel))
+        emoves.append((print_time, accel_t, cruise_t, accel_t,
+                       epos, 0., 0., 1., 1., 0.,
+                       0., cruise_v * extrude_ratio, accel * extrude_ratio))
+        print_time += 2. * accel_t + cruise_t
+        pos = npos
+        epos += move_d * extrude_ratio
+    return moves, emoves
+
+# Convert a "dump_trapq" entry to trapq_append() parameters
+def convert_log_move(move):
+    print_time, move_t, start_v, accel, start_pos, axes_r = move
+    if accel > 0.:
+        return ((print_time, move_t, 0., 0.) + tuple(start_pos)
+                + tuple(axes_r) + (start_v, start_v + accel * move_t, accel))
+    if accel < 0.:
+        return ((print_time, 0., 0., move_t) + tuple(start_pos)
+                + tuple(axes_r) + (start_v, start_v, -accel))
+    return ((print_time, 0., move_t, 0.) + tuple(start_pos)
+            + tuple(axes_r) + (start_v, start_v, 0.))
+
+# Read the trapq moves recorded by scripts/motan/data_logger.py
+def load_log_moves(log_prefix, trapq_name):
+    f = open(log_prefix + ".json.gz", "rb")
+    comp = zlib.decompressobj(31)
+    data = b""
+    moves = []
+    while 1:
+        raw_data = f.read(65536)
+        if not raw_data:
+            break
+        parts = (data + comp.decompress(raw_data)).split(b'\x03')
+        data = parts.pop()
+        for part in parts:
+            try:
+                msg = json.loads(part)
+            except ValueError:
+                continue
+            if msg.get('q') != "trapq:" + trapq_name:
+                continue
+            moves.extend([convert_log_move(m) for m in msg['params']['data']])
+    f.close()
+    return moves
+
+
+######################################################################
+# Benchmark
+######################################################################
+
+def alloc_kinematics(ffi_lib, kin_name):
+    if kin_name == 'cartesian':
+        return [ffi_lib.cartesian_stepper_alloc(a) for a in [b'x', b'y']]
+    if kin_name == 'corexy':
+        return [ffi_lib.corexy_stepper_alloc(a) for a in [b'+', b'-']]
+    if kin_name == 'delta':
+        radius = 140.
+        arm2 = 250.**2
+        return [ffi_lib.delta_stepper_alloc(
+                    arm2, math.cos(math.radians(a)) * radius,
+                    math.sin(math.radians(a)) * radius)
+                for a in [210., 330., 90.]]
+    if kin_name == 'extruder':
+        return [ffi_lib.extruder_stepper_alloc()]
+    raise Exception("Unknown kinematics '%s'" % (kin_name,))
+
+def setup_shaper(ffi_main, ffi_lib, sk, shaper_freq, shaper_cache):
+    ssk = ffi_main.gc(ffi_lib.input_shaper_alloc(), ffi_lib.free)
+    ffi_lib.input_shaper_set_sk(ssk, sk)
+    ffi_lib.input_shaper_set_cache(ssk, shaper_cache)
+    A, T = shaper_defs.get_mzv_shaper(shaper_freq,
+                                      shaper_defs.DEFAULT_DAMPING_RATIO)
+    for axis in [b'x', b'y']:
+        ffi_lib.input_shaper_set_shaper_params(ssk, axis, len(A), A, T)
+    return ssk
+
+# Return the step clocks (negated for negative steps) in the history
+def extract_steps(ffi_main, ffi_lib, sc, step_count):
+    max_count = step_count + 16
+    data = ffi_main.new('struct pull_history_steps[]', max_count)
+    count = ffi_lib.stepcompress_extract_old(sc, data, max_count, 0, 1<<63)
+    steps = []
+    for i in range(count - 1, -1, -1):
+        s = data[i]
+        interval, add, add2 = s.interval, s.add, s.add2
+        step_clock = s.first_clock - interval
+        sign = 1
+        if s.step_count < 0:
+            sign = -1
+        for j in range(abs(s.step_count)):
+            step_clock += interval
+            interval += add
+            add += add2
+            steps.append(step_clock * sign)
+    return steps
+
+def run_benchmark(kin_name, moves, options):
+    ffi_main, ffi_lib = chelper.get_ffi()
+    # Setup serialqueue (messages are written to /dev/null)
+    outfile = open(os.devnull, "wb")
+    sq = ffi_main.gc(ffi_lib.serialqueue_alloc(outfile.fileno(), b'f', 0),
+                     ffi_lib.serialqueue_free)
+    ffi_lib.serialqueue_set_clock_est(sq, 1000000000000.,
+                                      ffi_lib.get_monotonic(), 0, 0)
+    # Setup trapq
+    tq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
+    for m in moves:
+        ffi_lib.trapq_append(tq, *m)
+    start_time = moves[0][0]
+    end_time = moves[-1][0] + sum(moves[-1][1:4])
+    # Setup stepper kinematics and stepcompress
+    step_dist = STEP_DIST
+    if kin_name == 'extruder':
+        step_dist = E_STEP_DIST
+    max_error_ticks = int(MAX_ERROR * MCU_FREQ)
+    record_steps = options.save_steps or options.check_steps
+    if record_steps:
+        # Record the exact step times (without compression error)
+        max_error_ticks = 0
+    kin_flush_delay = 0.
+    sks = []
+    scs = []
+    shaper_cache = ffi_main.gc(ffi_lib.input_shaper_cache_alloc(),
+                               ffi_lib.input_shaper_cache_free)
+    for oid, sk in enumerate(alloc_kinematics(ffi_lib, kin_name)):
+        if kin_name == 'extruder':
+            sk = ffi_main.gc(sk, ffi_lib.extruder_stepper_free)
+            ffi_lib.extruder_set_pressure_advance(sk, 0., options.pa, 0.,
+                                                  .040)
+            kin_flush_delay = max(kin_flush_delay, .020)
+        else:
+            sk = ffi_main.gc(sk, ffi_lib.free)
+        sks.append(sk)
+        if kin_name != 'extruder' and options.shaper_freq:
+            sk = setup_shaper(ffi_main, ffi_lib, sk, options.shaper_freq,
+                              shaper_cache)
+            kin_flush_delay = max(
+                kin_flush_delay,
+                ffi_lib.input_shaper_get_step_generation_window(sk))
+        sc = ffi_main.gc(ffi_lib.stepcompress_alloc(oid),
+                         ffi_lib.stepcompress_free)
+        ffi_lib.stepcompress_fill(sc, max_error_ticks, TAG_QUEUE_STEP,
+                                  TAG_SET_NEXT_STEP_DIR)
+        if options.step_cmd in ['queue_step2', 'queue_steps']:
+            ffi_lib.stepcompress_fill_add2(sc, TAG_QUEUE_STEP2)
+        if options.step_cmd == 'queue_steps':
+            ffi_lib.stepcompress_fill_queue_steps(sc, TAG_QUEUE_STEPS)
+        ffi_lib.itersolve_set_stepcompress(sk, sc, step_dist)
+        ffi_lib.itersolve_set_trapq(sk, tq)
+        ffi_lib.itersolve_set_position(sk, *moves[0][4:7])
+        ffi_lib.stepcompress_set_stepper_kinematics(sc, sk)
+        sks.append(sk)
+        scs.append(sc)
+    ss = ffi_main.gc(ffi_lib.steppersync_alloc(sq, scs, len(scs), MOVE_NUM),
+                     ffi_lib.steppersync_free)
+    ffi_lib.steppersync_set_time(ss, 0., MCU_FREQ)
+    sgp = ffi_main.NULL
+    if options.threads:
+        sgp = ffi_main.gc(ffi_lib.stepgen_pool_alloc(options.threads),
+                          ffi_lib.stepgen_pool_free)
+    # Run step generation and compression in FLUSH_TIME chunks
+    gen_time = flush_time_total = 0.
+    flush_time = start_time
+    while flush_time < end_time + kin_flush_delay:
+        flush_time += FLUSH_TIME
+        t1 = time.perf_counter()
+        if sgp:
+            ffi_lib.stepgen_pool_start(sgp)
+        ret = ffi_lib.steppersync_generate_steps(ss, sgp, flush_time)
+        if not ret and sgp:
+            ret = ffi_lib.stepgen_pool_flush(sgp, flush_time)
+        if ret:
+            raise Exception("Internal error in step generation")
+        t2 = time.perf_counter()
+        ffi_lib.trapq_finalize_moves(tq, flush_time - kin_flush_delay,
+                                     flush_time - 1.)
+        clock = int(flush_time * MCU_FREQ)
+        clear_history_clock = max(0, int((flush_time - 1.) * MCU_FREQ))
+        if record_steps:
+            clear_history_clock = 0
+        ret = ffi_lib.steppersync_flush(ss, clock, clear_history_clock)
+        if ret:
+            raise Exception("Internal error in stepcompress")
+        t3 = time.perf_counter()
+        gen_time += t2 - t1
+        flush_time_total += t3 - t2
+    # Report results
+    step_count = message_bytes = 0
+    stats = ffi_main.new('struct stepcompress_stats *')
+    steps = []
+    for sc in scs:
+        ffi_lib.stepcompress_get_stats(sc, stats)
+        step_count += stats.step_count
+        message_bytes += stats.message_bytes
+        if record_steps:
+            steps.append(extract_steps(ffi_main, ffi_lib, sc,
+                                       stats.step_count))
+    ffi_lib.serialqueue_exit(sq)
+    outfile.close()
+    total = gen_time + flush_time_total
+    print_duration = end_time - start_time
+    print("%-10s moves=%d steps=%d steps/sec=%.0f ns/step=%.1f"
+          " (itersolve=%.1f stepcompress=%.1f)"
+          " bytes/print_sec=%.0f" % (
+              kin_name, len(moves), step_count,
+              step_count / max(total, .000001),
+              1000000000. * total / max(step_count, 1),
+              1000000000. * gen_time / max(step_count, 1),
+              1000000000. * flush_time_total / max(step_count, 1),
+              message_bytes / max(print_duration, .000001)))
+    return steps
+
+# Compare step times against those from a previous --save-steps run
+def check_steps(kin_name, steps, ref_steps, options):
+    if len(steps) != len(ref_steps):
+        print("%-10s stepper count mismatch" % (kin_name,))
+        return False
+    max_diff = 0
+    for s, ref_s in zip(steps, ref_steps):
+        if len(s) != len(ref_s):
+            print("%-10s step count mismatch (%d vs %d)" % (
+                kin_name, len(s), len(ref_s)))
+            return False
+        for clock, ref_clock in zip(s, ref_s):
+            if (clock < 0) != (ref_clock < 0):
+                print("%-10s step direction mismatch at clock %d" % (
+                    kin_name, abs(ref_clock)))
+                return False
+            max_diff = max(max_diff, abs(clock - ref_clock))
+    max_diff_time = max_diff / MCU_FREQ
+    print("%-10s max step time difference %.3fus" % (
+        kin_name, max_diff_time * 1000000.))
+    return max_diff_time <= options.max_step_diff
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-k", "--kinematics", type="string", dest="kinematics",
+                    default="cartesian,corexy,delta,extruder",
+                    help="comma separated list of kinematics to test")
+    opts.add_option("-l", "--log", type="string", dest="log",
+                    help="read moves from a motan data_logger.py log prefix")
+    opts.add_option("-n", "--moves", type="int", dest="moves", default=5000,
+                    help="number of generated moves")
+    opts.add_option("-v", "--velocity", type="float", dest="velocity",
+                    default=300., help="generated move velocity")
+    opts.add_option("-a", "--accel", type="float", dest="accel",
+                    default=5000., help="generated move acceleration")
+    opts.add_option("-s", "--shaper-freq", type="float", dest="shaper_freq",
+                    default=0., help="apply an mzv input shaper at this"
+                    " frequency")
+    opts.add_option("-p", "--pressure-advance", type="float", dest="pa",
+                    default=.040, help="extruder pressure advance")
+    opts.add_option("-t", "--threads", type="int", dest="threads", default=0,
+                    help="number of step generation threads")
+    opts.add_option("-c", "--step-cmd", type="choice", dest="step_cmd",
+                    choices=['queue_step', 'queue_step2', 'queue_steps'],
+                    default="queue_steps",
+                    help="most capable mcu step command to generate")
+    opts.add_option("--save-steps", type="string", dest="save_steps",
+                    help="store the generated step times in a json file")
+    opts.add_option("--check-steps", type="string", dest="check_steps",
+                    help="compare step times against a --save-steps file")
+    opts.add_option("--max-step-diff", type="float", dest="max_step_diff",
+                    default=MAX_ERROR, help="maximum step time difference"
+                    " allowed by --check-steps (in seconds)")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    if options.log:
+        moves = load_log_moves(options.log, "toolhead")
+        emoves = load_log_moves(options.log, "extruder")
+    else:
+        moves, emoves = generate_moves(options.moves, options.velocity,
+                                       options.accel, .04, 0)
+    ref_steps = {}
+    if options.check_steps:
+        f = open(options.check_steps, 'r')
+        ref_steps = json.load(f)
+        f.close()
+    all_steps = {}
+    is_ok = True
+    for kin_name in options.kinematics.split(','):
+        kin_moves = moves
+        if kin_name == 'extruder':
+            kin_moves = emoves
+        if not kin_moves:
+            print("%-10s no moves" % (kin_name,))
+            continue
+        steps = run_benchmark(kin_name, kin_moves, options)
+        all_steps[kin_name] = steps
+        if options.check_steps:
+            if kin_name not in ref_steps:
+                print("%-10s not in %s" % (kin_name, options.check_steps))
+                is_ok = False
+            elif not check_steps(kin_name, steps, ref_steps[kin_name],
+                                 options):
+                is_ok = False
+    if options.save_steps:
+        f = open(options.save_steps, 'w')
+        json.dump(all_steps, f)
+        f.close()
+    if not is_ok:
+        sys.exit(-1)
+
+if __name__ == '__main__':
+    main()
@@ -17,6 +17,7 @@ FILEHEADER = """
 #include "command.h"
 #include "compiler.h"
 #include "initial_pins.h"
+#include "sched.h"
 """
 
 def error(msg):
@@ -39,13 +40,18 @@ class HandleCallList:
         funcname, callname = req.split()[1:]
         self.call_lists.setdefault(funcname, []).append(callname)
     def update_data_dictionary(self, data):
-        pass
+        # Task ids used in profile_task reports (see SCHED_RUN_TASK)
+        for i, f in enumerate(self.call_lists.get('ctr_run_taskfuncs', [])):
+            HandlerEnumerations.add_enumeration("task_func", f, i)
     def generate_code(self, options):
         code = []
         for funcname, funcs in self.call_lists.items():
             func_code = ['    extern void %s(void);\n    %s();' % (f, f)
                          for f in funcs]
             if funcname == 'ctr_run_taskfuncs':
+                func_code = [
+                    '    extern void %s(void);\n    SCHED_RUN_TASK(%s, %d);'
+                    % (f, f, i) for i, f in enumerate(funcs)]
                 add_poll = '    irq_poll();\n'
                 func_code = [add_poll + fc for fc in func_code]
                 func_code.append(add_poll)
@@ -415,6 +421,11 @@ ctr_lookup_output(const char *str)
             msg = self.messages_by_name[msgname]
             externs[funcname] = 1
             parsercode = self.build_parser(encoded_msgid, msg, 'response')
+            param_types = [t for name, t in msgproto.lookup_params(msg)]
+            if param_types and all([t.is_int for t in param_types]):
+                # Let command_parsef() skip the per parameter type lookup
+                flags = "HF_INT_PARAMS" if flags == "0" else (
+                    "%s | HF_INT_PARAMS" % (flags,))
             index.append(" {%s\n    .flags=%s,\n    .func=%s\n}," % (
                 parsercode, flags, funcname))
         index = "".join(index).strip()
@@ -423,11 +434,12 @@ ctr_lookup_output(const char *str)
         fmt = """
 %s
 
-const struct command_parser command_index[] PROGMEM = {
+const struct command_parser command_index[] PROGMEM __hotdata = {
 %s
 };
 
-const uint16_t command_index_size PROGMEM = ARRAY_SIZE(command_index);
+const uint16_t command_index_size PROGMEM __hotdata
+    = ARRAY_SIZE(command_index);
 """
         return fmt % (externs, index)
     def generate_param_code(self):
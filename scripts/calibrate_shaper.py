@@ -6,7 +6,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 from __future__ import print_function
-import importlib, optparse, os, sys
+import functools, importlib, multiprocessing, optparse, os, sys
 from textwrap import wrap
 import numpy as np, matplotlib
 sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
@@ -35,6 +35,30 @@ def parse_log(logname):
         calibration_data.normalize_to_frequencies()
     return calibration_data
 
+# Parse a log and calculate its frequency response (run in a worker)
+def load_log(logname):
+    data = parse_log(logname)
+    if isinstance(data, shaper_calibrate.CalibrationData):
+        return data, False
+    helper = shaper_calibrate.ShaperCalibrate(printer=None)
+    return helper.process_accelerometer_data(data), True
+
+def run_parallel(func, args, jobs):
+    if jobs <= 1 or len(args) <= 1:
+        return [func(a) for a in args]
+    pool = multiprocessing.Pool(min(jobs, len(args)))
+    try:
+        return pool.map(func, args)
+    finally:
+        pool.close()
+        pool.join()
+
+def load_logs(lognames, jobs):
+    datas = run_parallel(load_log, lognames, jobs)
+    for calibration_data, is_raw in datas:
+        calibration_data.set_numpy(np)
+    return datas
+
 ######################################################################
 # Shaper calibration
 ######################################################################
@@ -44,18 +68,13 @@ def calibrate_shaper(datas, csv_output, *, shapers, damping_ratio, scv,
                      shaper_freqs, max_smoothing, test_damping_ratios,
                      max_freq):
     helper = shaper_calibrate.ShaperCalibrate(printer=None)
-    if isinstance(datas[0], shaper_calibrate.CalibrationData):
-        calibration_data = datas[0]
-        for data in datas[1:]:
-            calibration_data.add_data(data)
-    else:
-        # Process accelerometer data
-        calibration_data = helper.process_accelerometer_data(datas[0])
-        for data in datas[1:]:
-            calibration_data.add_data(helper.process_accelerometer_data(data))
+    calibration_data, is_raw = datas[0]
+    for data, _ in datas[1:]:
+        calibration_data.add_data(data)
+    if is_raw:
+        # Raw accelerometer data is normalized after averaging
         calibration_data.normalize_to_frequencies()
 
-
     shaper, all_shapers = helper.find_best_shaper(
             calibration_data, shapers=shapers, damping_ratio=damping_ratio,
             scv=scv, shaper_freqs=shaper_freqs, max_smoothing=max_smoothing,
@@ -71,6 +90,70 @@ def calibrate_shaper(datas, csv_output, *, shapers, damping_ratio, scv,
                 csv_output, calibration_data, all_shapers)
     return shaper.name, all_shapers, calibration_data
 
+######################################################################
+# Batch reports
+######################################################################
+
+# Calibrate a single log independently of the others (run in a worker)
+def calibrate_log(logname, *, shapers, damping_ratio, scv, shaper_freqs,
+                  max_smoothing, test_damping_ratios, max_freq):
+    try:
+        calibration_data, is_raw = load_log(logname)
+    except Exception as e:
+        return logname, None, str(e)
+    calibration_data.set_numpy(np)
+    if is_raw:
+        calibration_data.normalize_to_frequencies()
+    helper = shaper_calibrate.ShaperCalibrate(printer=None)
+    shaper, all_shapers = helper.find_best_shaper(
+            calibration_data, shapers=shapers, damping_ratio=damping_ratio,
+            scv=scv, shaper_freqs=shaper_freqs, max_smoothing=max_smoothing,
+            test_damping_ratios=test_damping_ratios, max_freq=max_freq)
+    if not shaper:
+        return logname, None, "no recommended shaper"
+    freqs = calibration_data.freq_bins
+    psd = calibration_data.psd_sum[freqs <= max_freq]
+    peak_freq = freqs[freqs <= max_freq][np.argmax(psd)]
+    return logname, (shaper.name, shaper.freq, shaper.vibrs,
+                     shaper.smoothing, shaper.max_accel, peak_freq), None
+
+BATCH_FIELDS = ["file", "shaper", "freq", "vibrations", "smoothing",
+                "max_accel", "peak_freq"]
+
+def batch_report(lognames, csv_output, jobs, **kwargs):
+    results = run_parallel(functools.partial(calibrate_log, **kwargs),
+                           lognames, jobs)
+    width = max([len(fn) for fn in lognames] + [4])
+    print("%-*s %-8s %7s %6s %9s %9s %9s" % ((width,) + tuple(BATCH_FIELDS)))
+    rows = []
+    for logname, res, err in results:
+        if res is None:
+            print("%-*s error: %s" % (width, logname, err))
+            continue
+        name, freq, vibrs, smoothing, max_accel, peak_freq = res
+        print("%-*s %-8s %7.1f %5.1f%% %9.3f %9.0f %9.1f" % (
+            width, logname, name, freq, vibrs * 100., smoothing,
+            round(max_accel / 100.) * 100., peak_freq))
+        rows.append((logname,) + res)
+    if rows:
+        # Summarize the spread of results to help spot outliers
+        freqs = np.array([r[2] for r in rows])
+        counts = {}
+        for r in rows:
+            counts[r[1]] = counts.get(r[1], 0) + 1
+        print("Recommended shapers: %s" % (", ".join(
+            ["%s=%d" % (n, c) for n, c in sorted(counts.items())]),))
+        print("Shaper frequency: min=%.1f median=%.1f max=%.1f Hz" % (
+            freqs.min(), np.median(freqs), freqs.max()))
+        accels = np.array([r[5] for r in rows])
+        print("Suggested max_accel: min=%.0f median=%.0f" % (
+            accels.min(), np.median(accels)))
+    if csv_output is not None:
+        with open(csv_output, "w") as f:
+            f.write(",".join(BATCH_FIELDS) + "\n")
+            for r in rows:
+                f.write("%s,%s,%.1f,%.4f,%.3f,%.0f,%.1f\n" % r)
+
 ######################################################################
 # Plot frequency response and suggested input shapers
 ######################################################################
@@ -168,6 +251,12 @@ def main():
                     dest="test_damping_ratios", default=None,
                     help="a comma-separated liat of damping ratios to test " +
                     "input shaper for")
+    opts.add_option("-b", "--batch", action="store_true", dest="batch",
+                    help="calibrate each log separately and report a"
+                    " summary table (instead of averaging the logs)")
+    opts.add_option("-j", "--jobs", type="int", dest="jobs", default=0,
+                    help="number of parallel processes (default is the"
+                    " number of cpus)")
     options, args = opts.parse_args()
     if len(args) < 1:
         opts.error("Incorrect number of arguments")
@@ -218,9 +307,26 @@ def main():
         shapers = None
     else:
         shapers = options.shapers.lower().split(',')
+    jobs = options.jobs
+    if jobs <= 0:
+        try:
+            jobs = multiprocessing.cpu_count()
+        except NotImplementedError:
+            jobs = 1
+
+    if options.batch:
+        if options.output:
+            opts.error("The --output option is not supported with --batch")
+        batch_report(args, options.csv, jobs, shapers=shapers,
+                     damping_ratio=options.damping_ratio,
+                     scv=options.scv, shaper_freqs=shaper_freqs,
+                     max_smoothing=options.max_smoothing,
+                     test_damping_ratios=test_damping_ratios,
+                     max_freq=max_freq)
+        return
 
     # Parse data
-    datas = [parse_log(fn) for fn in args]
+    datas = load_logs(args, jobs)
 
     # Calibrate shaper and generate outputs
     selected_shaper, shapers, calibration_data = calibrate_shaper(
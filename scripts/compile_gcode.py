@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+# Convert a g-code file to the binary format used by virtual_sdcard
+#
+# Copyright (C) 2026  agent <agent@local>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, importlib
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '..', 'klippy'))
+import gcode
+virtual_sdcard = importlib.import_module('.virtual_sdcard', 'extras')
+
+def compile_file(infile, outfile):
+    move_count = text_count = 0
+    outfile.write(virtual_sdcard.BINARY_MAGIC)
+    for line in infile:
+        line = line.strip()
+        cpos = line.find(';')
+        cmdline = line
+        if cpos >= 0:
+            cmdline = line[:cpos]
+        if not cmdline.strip():
+            # Comment or empty line
+            continue
+        sc = gcode.parse_simple_command(cmdline.upper())
+        if sc is not None:
+            data = virtual_sdcard.encode_binary_move(sc[0], sc[1])
+            if data is not None:
+                outfile.write(data)
+                move_count += 1
+                continue
+        if len(line.encode('utf-8')) > 0xffff:
+            raise Exception("Line too long: %s" % (line[:60],))
+        outfile.write(virtual_sdcard.encode_binary_text(line))
+        text_count += 1
+    return move_count, text_count
+
+def main():
+    usage = "%prog [options] <input.gcode> <output.kgc>"
+    opts = optparse.OptionParser(usage)
+    options, args = opts.parse_args()
+    if len(args) != 2:
+        opts.error("Incorrect number of arguments")
+    with open(args[0], 'r') as infile:
+        with open(args[1], 'wb') as outfile:
+            move_count, text_count = compile_file(infile, outfile)
+    print("Wrote %d move and %d text records to %s"
+          % (move_count, text_count, args[1]))
+
+if __name__ == '__main__':
+    main()
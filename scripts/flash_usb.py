@@ -5,6 +5,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import sys, os, re, subprocess, optparse, time, fcntl, termios, struct
+import threading
 
 class error(Exception):
     pass
@@ -115,7 +116,7 @@ def flash_bossac(device, binfile, extra_flags=[]):
     enter_bootloader(pathname)
     pathname = wait_path(pathname, ttyname)
     baseargs = ["lib/bossac/bin/bossac", "-U", "-p", pathname]
-    args = baseargs + extra_flags + ["-w", binfile, "-v"]
+    args = baseargs + extra_flags + ["-k", "-w", binfile, "-v"]
     sys.stderr.write(" ".join(args) + '\n\n')
     res = subprocess.call(args)
     if res != 0:
@@ -354,6 +355,46 @@ MCUTYPES = {
 }
 
 
+######################################################################
+# Flashing multiple devices
+######################################################################
+
+# Flash each device from a separate process, running up to 'jobs'
+# at a time, and report the output of each once it completes
+def flash_many(devices, jobs, argv):
+    lock = threading.Lock()
+    pending = list(devices)
+    failed = []
+    def worker():
+        while 1:
+            with lock:
+                if not pending:
+                    return
+                device = pending.pop(0)
+            args = [sys.executable, os.path.abspath(__file__),
+                    "-d", device] + argv
+            proc = subprocess.Popen(args, stdout=subprocess.PIPE,
+                                    stderr=subprocess.STDOUT)
+            output = proc.communicate()[0].decode(errors='replace')
+            with lock:
+                sys.stderr.write("==== %s (%s) ====\n%s\n" % (
+                    device, "ok" if not proc.returncode else "FAILED",
+                    output))
+                if proc.returncode:
+                    failed.append(device)
+    threads = [threading.Thread(target=worker)
+               for i in range(min(jobs, len(devices)))]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    sys.stderr.write("Flashed %d of %d devices\n" % (
+        len(devices) - len(failed), len(devices)))
+    if failed:
+        sys.stderr.write("Failed devices: %s\n" % (" ".join(failed),))
+        sys.exit(-1)
+
+
 ######################################################################
 # Startup
 ######################################################################
@@ -364,7 +405,10 @@ def main():
     opts.add_option("-t", "--type", type="string", dest="mcutype",
                     help="micro-controller type")
     opts.add_option("-d", "--device", type="string", dest="device",
-                    help="serial port device")
+                    help="serial port device (or a comma separated list"
+                    " of devices to flash in parallel)")
+    opts.add_option("-j", "--jobs", type="int", dest="jobs", default=8,
+                    help="maximum number of devices to flash at once")
     opts.add_option("-s", "--start", type="int", dest="start",
                     help="start address in flash")
     opts.add_option("--no-sudo", action="store_false", dest="sudo",
@@ -384,6 +428,18 @@ def main():
     if not options.device:
         sys.stderr.write("\nPlease specify FLASH_DEVICE\n\n")
         sys.exit(-1)
+    devices = [d.strip() for d in options.device.split(',') if d.strip()]
+    if len(devices) > 1:
+        argv = ["-t", options.mcutype]
+        if options.start is not None:
+            argv += ["-s", str(options.start)]
+        if options.sudo:
+            # Obtain sudo credentials once (children can't prompt)
+            subprocess.call(["sudo", "-v"])
+        else:
+            argv.append("--no-sudo")
+        flash_many(devices, max(1, options.jobs), argv + [args[0]])
+        return
     flash_func(options, args[0])
 
 if __name__ == '__main__':
@@ -4,7 +4,7 @@
 # Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import optparse, datetime
+import os, optparse, datetime, multiprocessing
 import matplotlib
 
 MAXBANDWIDTH=25000.
@@ -18,18 +18,27 @@ APPLY_PREFIX = [
     'target', 'temp', 'pwm'
 ]
 
-def parse_log(logname, mcu):
-    if mcu is None:
-        mcu = "mcu"
+PARSE_CHUNK_SIZE = 16 * 1024 * 1024
+
+# Parse the Stats lines that start within the given byte range of a log
+def parse_log_range(args):
+    logname, mcu, start, end = args
     mcu_prefix = mcu + ":"
     apply_prefix = { p: 1 for p in APPLY_PREFIX }
-    f = open(logname, 'r')
+    f = open(logname, 'rb')
+    if start:
+        # Skip the line that straddles the start of the range
+        f.seek(start - 1)
+        f.readline()
     out = []
-    for line in f:
-        parts = line.split()
-        if not parts or parts[0] not in ('Stats', 'INFO:root:Stats'):
-            #if parts and parts[0] == 'INFO:root:shutdown:':
-            #    break
+    while f.tell() < end:
+        line = f.readline()
+        if not line:
+            break
+        if not line.startswith((b'Stats', b'INFO:root:Stats')):
+            continue
+        parts = line.decode(errors='replace').split()
+        if parts[0] not in ('Stats', 'INFO:root:Stats'):
             continue
         prefix = ""
         keyparts = {}
@@ -50,6 +59,23 @@ def parse_log(logname, mcu):
     f.close()
     return out
 
+def parse_log(logname, mcu):
+    if mcu is None:
+        mcu = "mcu"
+    # Large logs are split into chunks that are parsed in parallel
+    size = os.path.getsize(logname)
+    ranges = [(logname, mcu, pos, min(pos + PARSE_CHUNK_SIZE, size))
+              for pos in range(0, size, PARSE_CHUNK_SIZE)]
+    if len(ranges) <= 1:
+        return parse_log_range((logname, mcu, 0, size))
+    pool = multiprocessing.Pool()
+    try:
+        results = pool.map(parse_log_range, ranges)
+    finally:
+        pool.close()
+        pool.join()
+    return [d for res in results for d in res]
+
 def setup_matplotlib(output_to_file):
     global matplotlib
     if output_to_file:
@@ -4,7 +4,7 @@
 # Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import sys, re, collections, ast, itertools
+import sys, os, re, collections, ast, itertools, optparse, mmap
 
 def format_comment(line_num, line):
     return "# %6d: %s" % (line_num, line)
@@ -273,6 +273,25 @@ class MCUStream:
     def get_lines(self):
         return []
 
+trace_line_r = re.compile(r"^trace [0-9]+: .* clock=" + clock_s + "$")
+
+# MCU scheduler trace parsing
+class MCUTraceStream:
+    def __init__(self, mcu):
+        self.mcu = mcu
+        self.trace_stream = []
+    def parse_line(self, line_num, line):
+        m = trace_line_r.match(line)
+        if m is not None:
+            ts = self.mcu.trans_clock(int(m.group('clock')),
+                                      self.mcu.clock_est[0])
+            line = self.mcu.annotate(line, None, ts)
+            self.trace_stream.append((ts, line_num, line))
+            return True, None
+        return self.mcu.parse_line(line_num, line)
+    def get_lines(self):
+        return self.trace_stream
+
 stepper_move_r = re.compile(r"^queue_step " + count_s + r": t=" + clock_s
                             + r" ")
 
@@ -409,6 +428,8 @@ stats_r = re.compile(r"^Stats " + time_s + ": ")
 mcu_r = re.compile(r"MCU '(?P<mcu>[^']+)' (is_)?shutdown: (?P<reason>.*)$")
 stepper_r = re.compile(r"^Dumping stepper '(?P<name>[^']*)' \((?P<mcu>[^)]+)\) "
                        + count_s + r" queue_step:$")
+trace_r = re.compile(r"^Dumping mcu '(?P<mcu>[^']*)' scheduler trace "
+                     + count_s + " entries$")
 trapq_r = re.compile(r"^Dumping trapq '(?P<name>[^']*)' " + count_s
                      + r" moves:$")
 gcode_r = re.compile(r"Dumping gcode input " + count_s + r" blocks$")
@@ -476,6 +497,9 @@ class StatsStream:
         m = trapq_r.match(line)
         if m is not None:
             return True, TrapQStream(m.group('name'), self.mcus)
+        m = trace_r.match(line)
+        if m is not None and m.group('mcu') in self.mcus:
+            return True, MCUTraceStream(self.mcus[m.group('mcu')])
         m = gcode_r.match(line)
         if m is not None:
             return True, self.gcode_stream
@@ -517,10 +541,37 @@ class StatsStream:
             self.stats_stream[i] = (last_ts, line_num, line)
         return self.stats_stream
 
+######################################################################
+# Binary message capture
+######################################################################
+
+# Messages from a "message_capture" file (decoded with parsedump.py)
+class CaptureStream:
+    def __init__(self, capture_filename, dict_filename):
+        sys.path.append(os.path.join(os.path.dirname(
+            os.path.realpath(__file__)), '../klippy'))
+        import msgproto, parsedump
+        mp = msgproto.MessageParser()
+        mp.process_identify(parsedump.read_dictionary(dict_filename),
+                            decompress=False)
+        self.capture_stream = []
+        for record in parsedump.read_capture(capture_filename):
+            line = "Capture " + parsedump.format_capture_record(mp, record)
+            self.capture_stream.append((record[0], 0, line))
+    def get_lines(self, streams):
+        # Only report messages in the time range of the other streams
+        all_ts = [i[0] for s in streams for i in s]
+        if not all_ts:
+            return []
+        min_ts, max_ts = min(all_ts), max(all_ts)
+        return [i for i in self.capture_stream if min_ts <= i[0] <= max_ts]
+
 # Main handler for creating shutdown diagnostics file
 class GatherShutdown:
-    def __init__(self, configs, line_num, recent_lines, logname):
+    def __init__(self, configs, line_num, recent_lines, logname,
+                 capture=None):
         self.filename = "%s.shutdown%05d" % (logname, line_num)
+        self.capture = capture
         self.comments = []
         if configs:
             configs_by_id = {c.config_num: c for c in configs.values()}
@@ -559,6 +610,8 @@ class GatherShutdown:
     def finalize(self):
         # Make sure no timestamp goes backwards
         streams = [p.get_lines() for p in self.all_streams]
+        if self.capture is not None:
+            streams.append(self.capture.get_lines(streams))
         for s in streams:
             for i in range(1, len(s)):
                 if s[i-1][0] > s[i][0]:
@@ -572,42 +625,116 @@ class GatherShutdown:
             f.writelines(lines)
 
 
+######################################################################
+# Log file scanning
+######################################################################
+
+# Text found in lines that may start a config or shutdown section
+MARKERS = [b"Git version", b"Start printer at", b"===== Config file =====",
+           b"shutdown: ", b"Dumping "]
+
+# Read lines from a log, quickly skipping lines that can't be of interest
+class LogScanner:
+    def __init__(self, logname):
+        self.file = open(logname, 'rb')
+        self.data = b""
+        if os.fstat(self.file.fileno()).st_size:
+            self.data = mmap.mmap(self.file.fileno(), 0,
+                                  access=mmap.ACCESS_READ)
+        self.pos = self.line_num = 0
+        self.next_marker = -1
+        self.marker_pos = [-1] * len(MARKERS)
+    def find_marker(self, pos):
+        data, marker_pos = self.data, self.marker_pos
+        for i, m in enumerate(MARKERS):
+            if marker_pos[i] < pos:
+                mpos = data.find(m, pos)
+                marker_pos[i] = mpos if mpos >= 0 else len(data)
+        return min(marker_pos)
+    def skip_to_marker(self, keep_lines):
+        # Move to the line preceding the next marker by 'keep_lines' lines
+        data, pos = self.data, self.pos
+        if pos <= self.next_marker:
+            return
+        start = data.rfind(b"\n", pos, self.find_marker(pos)) + 1 or pos
+        self.next_marker = start
+        for i in range(keep_lines):
+            if start <= pos:
+                break
+            start = data.rfind(b"\n", pos, start - 1) + 1 or pos
+        self.line_num += data[pos:start].count(b"\n")
+        self.pos = start
+    def read_line(self):
+        data, pos = self.data, self.pos
+        if pos >= len(data):
+            return None, None
+        end = data.find(b"\n", pos)
+        if end < 0:
+            end = len(data)
+        self.pos = end + 1
+        self.line_num += 1
+        line = data[pos:end].decode(errors='replace').rstrip()
+        return self.line_num, line
+    def close(self):
+        if self.data:
+            self.data.close()
+        self.file.close()
+
+
 ######################################################################
 # Startup
 ######################################################################
 
 def main():
-    logname = sys.argv[1]
+    usage = "%prog [options] <klippy.log>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-c", "--capture", type="string", dest="capture",
+                    help="include messages from a binary message capture")
+    opts.add_option("-d", "--dictionary", type="string", dest="dictionary",
+                    help="mcu data dictionary of the message capture")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    logname = args[0]
+    capture = None
+    if options.capture is not None:
+        if options.dictionary is None:
+            opts.error("A message capture requires a data dictionary")
+        capture = CaptureStream(options.capture, options.dictionary)
     last_git = last_start = None
     configs = {}
     handler = None
     recent_lines = collections.deque([], 200)
     # Parse log file
-    with open(logname, 'rt') as f:
-        for line_num, line in enumerate(f):
-            line = line.rstrip()
-            line_num += 1
-            recent_lines.append((line_num, line))
-            if handler is not None:
-                ret = handler.add_line(line_num, line)
-                if ret:
-                    continue
-                recent_lines.clear()
-                handler = None
-            if line.startswith('Git version'):
-                last_git = format_comment(line_num, line)
-            elif line.startswith('Start printer at'):
-                last_start = format_comment(line_num, line)
-            elif line == '===== Config file =====':
-                handler = GatherConfig(configs, line_num,
-                                       recent_lines, logname)
-                handler.add_comment(last_git)
-                handler.add_comment(last_start)
-            elif 'shutdown: ' in line or line.startswith('Dumping '):
-                handler = GatherShutdown(configs, line_num,
-                                         recent_lines, logname)
-                handler.add_comment(last_git)
-                handler.add_comment(last_start)
+    scanner = LogScanner(logname)
+    while 1:
+        if handler is None:
+            scanner.skip_to_marker(recent_lines.maxlen)
+        line_num, line = scanner.read_line()
+        if line is None:
+            break
+        recent_lines.append((line_num, line))
+        if handler is not None:
+            ret = handler.add_line(line_num, line)
+            if ret:
+                continue
+            recent_lines.clear()
+            handler = None
+        if line.startswith('Git version'):
+            last_git = format_comment(line_num, line)
+        elif line.startswith('Start printer at'):
+            last_start = format_comment(line_num, line)
+        elif line == '===== Config file =====':
+            handler = GatherConfig(configs, line_num,
+                                   recent_lines, logname)
+            handler.add_comment(last_git)
+            handler.add_comment(last_start)
+        elif 'shutdown: ' in line or line.startswith('Dumping '):
+            handler = GatherShutdown(configs, line_num,
+                                     recent_lines, logname, capture)
+            handler.add_comment(last_git)
+            handler.add_comment(last_start)
+    scanner.close()
     if handler is not None:
         handler.finalize()
     # Write found config files
@@ -4,7 +4,11 @@
 # Copyright (C) 2020-2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import sys, os, optparse, socket, select, json, errno, time, zlib
+import sys, os, optparse, socket, select, json, errno, time, zlib, struct
+try:
+    import msgspec
+except ImportError:
+    msgspec = None
 
 INDEX_UPDATE_TIME = 5.0
 ClientInfo = {'program': 'motan_data_logger', 'version': 'v0.1'}
@@ -59,6 +63,7 @@ class DataLogger:
         self.poll = select.poll()
         self.poll.register(self.webhook_socket, select.POLLIN | select.POLLHUP)
         self.socket_data = b""
+        self.use_msgpack = False
         # Data log
         self.logger = LogWriter(log_prefix + ".json.gz")
         self.index = LogWriter(log_prefix + ".index.gz")
@@ -69,7 +74,11 @@ class DataLogger:
         self.db = {}
         self.next_index_time = 0.
         # Start login process
-        self.send_query("info", "info", {"client_info": ClientInfo},
+        client_info = dict(ClientInfo)
+        if msgspec is not None:
+            # Use the more compact msgpack encoding for received messages
+            client_info['encoding'] = 'msgpack'
+        self.send_query("info", "info", {"client_info": client_info},
                         self.handle_info)
     def error(self, msg):
         sys.stderr.write(msg + "\n")
@@ -88,31 +97,54 @@ class DataLogger:
         data = self.webhook_socket.recv(4096)
         if not data:
             self.finish("Socket closed")
-        parts = data.split(b"\x03")
-        parts[0] = self.socket_data + parts[0]
-        self.socket_data = parts.pop()
-        for part in parts:
-            try:
-                msg = json.loads(part)
-            except:
+        data = self.socket_data + data
+        pos = 0
+        while 1:
+            if self.use_msgpack:
+                # Messages are a 4 byte length followed by msgpack data
+                if len(data) < pos + 4:
+                    break
+                mlen = struct.unpack_from('>I', data, pos)[0]
+                if len(data) < pos + 4 + mlen:
+                    break
+                try:
+                    msg = msgspec.msgpack.decode(data[pos+4:pos+4+mlen])
+                    part = msgspec.json.encode(msg)
+                except:
+                    msg = None
+                pos += 4 + mlen
+            else:
+                end = data.find(b"\x03", pos)
+                if end < 0:
+                    break
+                part = data[pos:end]
+                try:
+                    msg = json.loads(part)
+                except:
+                    msg = None
+                pos = end + 1
+            if msg is None:
                 self.error("ERROR: Unable to parse line")
                 continue
-            self.logger.add_data(part)
-            msg_q = msg.get("q")
-            if msg_q is not None:
-                hdl = self.async_handlers.get(msg_q)
-                if hdl is not None:
-                    hdl(msg, part)
-                continue
-            msg_id = msg.get("id")
-            hdl = self.query_handlers.get(msg_id)
+            self.process_message(msg, part)
+        self.socket_data = data[pos:]
+    def process_message(self, msg, part):
+        self.logger.add_data(part)
+        msg_q = msg.get("q")
+        if msg_q is not None:
+            hdl = self.async_handlers.get(msg_q)
             if hdl is not None:
-                del self.query_handlers[msg_id]
                 hdl(msg, part)
-                if not self.query_handlers:
-                    self.flush_index()
-                continue
-            self.error("ERROR: Message with unknown id")
+            return
+        msg_id = msg.get("id")
+        hdl = self.query_handlers.get(msg_id)
+        if hdl is not None:
+            del self.query_handlers[msg_id]
+            hdl(msg, part)
+            if not self.query_handlers:
+                self.flush_index()
+            return
+        self.error("ERROR: Message with unknown id")
     def run(self):
         try:
             while 1:
@@ -131,6 +163,8 @@ class DataLogger:
         params["response_template"] = {"q": msg_id}
         self.send_query(msg_id, method, params, cb)
     def handle_info(self, msg, raw_msg):
+        if msg["result"].get("encoding") == "msgpack":
+            self.use_msgpack = True
         if msg["result"]["state"] != "ready":
             self.finish("Klipper not in ready state")
         self.send_query("list", "objects/list", {}, self.handle_list)
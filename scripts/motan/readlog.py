@@ -3,7 +3,7 @@
 # Copyright (C) 2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import json, zlib
+import json, zlib, re, logging
 
 class error(Exception):
     pass
@@ -219,7 +219,9 @@ class HandleStepQ:
         step_pos = jmsg['start_position']
         if not step_data[0][0]:
             step_data[0] = (0., step_pos, step_pos)
-        for interval, raw_count, add in jmsg['data']:
+        for step in jmsg['data']:
+            interval, raw_count, add = step[:3]
+            add2 = step[3] if len(step) > 3 else 0
             qs_dist = step_dist
             count = raw_count
             if count < 0:
@@ -228,6 +230,7 @@ class HandleStepQ:
             for i in range(count):
                 step_clock += interval
                 interval += add
+                add += add2
                 step_time = first_time + (step_clock - first_clock) * inv_freq
                 step_halfpos = step_pos + .5 * qs_dist
                 step_pos += qs_dist
@@ -320,7 +323,9 @@ class HandleStepPhase:
         step_pos = jmsg['start_mcu_position']
         if not step_data[0][0]:
             step_data[0] = (0., step_pos)
-        for interval, raw_count, add in jmsg['data']:
+        for step in jmsg['data']:
+            interval, raw_count, add = step[:3]
+            add2 = step[3] if len(step) > 3 else 0
             qs_dist = 1
             count = raw_count
             if count < 0:
@@ -329,6 +334,7 @@ class HandleStepPhase:
             for i in range(count):
                 step_clock += interval
                 interval += add
+                add += add2
                 step_time = first_time + (step_clock - first_clock) * inv_freq
                 step_pos += qs_dist
                 step_data.append((step_time, step_pos))
@@ -515,27 +521,42 @@ class JsonLogReader:
         self.file = open(filename, "rb")
         self.comp = zlib.decompressobj(31)
         self.msgs = [b""]
+        self.msg_pos = 0
     def seek(self, pos):
         self.file.seek(pos)
         self.comp = zlib.decompressobj(-15)
-    def pull_msg(self):
+    def pull_raw_msg(self):
         msgs = self.msgs
         while 1:
-            if len(msgs) > 1:
-                msg = msgs.pop(0)
-                try:
-                    json_msg = json.loads(msg)
-                except:
-                    logging.exception("Unable to parse line")
-                    continue
-                return json_msg
-            raw_data = self.file.read(8192)
+            if self.msg_pos < len(msgs) - 1:
+                msg = msgs[self.msg_pos]
+                self.msg_pos += 1
+                return msg
+            raw_data = self.file.read(65536)
             if not raw_data:
                 return None
             data = self.comp.decompress(raw_data)
             parts = data.split(b'\x03')
-            parts[0] = msgs[0] + parts[0]
+            parts[0] = msgs[-1] + parts[0]
             self.msgs = msgs = parts
+            self.msg_pos = 0
+    def decode_msg(self, msg):
+        try:
+            return json.loads(msg)
+        except:
+            logging.exception("Unable to parse line")
+            return None
+    def pull_msg(self):
+        while 1:
+            msg = self.pull_raw_msg()
+            if msg is None:
+                return None
+            json_msg = self.decode_msg(msg)
+            if json_msg is not None:
+                return json_msg
+
+# Subscription messages from the api server start with their "q" id
+QueueIdRE = re.compile(br'^\{"q": ?"([^"\\]*)"')
 
 # Store messages in per-subscription queues until handlers are ready for them
 class JsonDispatcher:
@@ -557,10 +578,19 @@ class JsonDispatcher:
                 return q.pop(0)
             if req_time + 1. < self.last_read_time:
                 return None
-            json_msg = self.log_reader.pull_msg()
-            if json_msg is None:
+            raw_msg = self.log_reader.pull_raw_msg()
+            if raw_msg is None:
                 self.is_eof = True
                 return None
+            m = QueueIdRE.match(raw_msg)
+            if m is not None:
+                qid = m.group(1).decode()
+                if qid != 'status' and qid not in self.queues:
+                    # Skip decoding of data for datasets not being graphed
+                    continue
+            json_msg = self.log_reader.decode_msg(raw_msg)
+            if json_msg is None:
+                continue
             qid = json_msg.get('q')
             if qid == 'status':
                 pt = json_msg.get('toolhead', {}).get('estimated_print_time')
@@ -22,6 +22,7 @@ import reactor
 import serialhdl
 import clocksync
 import mcu
+import msgproto
 
 ###########################################################
 #
@@ -128,6 +129,7 @@ SDIO_SEND_CMD_RESPONSE = "sdio_send_command_response oid=%c error=%c " \
     "response=%*s"
 SDIO_READ_DATA="sdio_read_data oid=%c cmd=%c argument=%u"
 SDIO_READ_DATA_RESPONSE="sdio_read_data_response oid=%c error=%c read=%u"
+SDIO_READ_BLOCKS="sdio_read_blocks oid=%c cmd=%c argument=%u count=%c"
 SDIO_WRITE_DATA="sdio_write_data oid=%c cmd=%c argument=%u"
 SDIO_WRITE_DATA_RESPONSE="sdio_write_data_response oid=%c error=%c write=%u"
 SDIO_READ_DATA_BUFFER="sdio_read_data_buffer oid=%c offset=%u len=%c"
@@ -171,6 +173,13 @@ class SDIODirect:
         self._sdio_write_data_buffer = mcu.CommandWrapper(ser,
             SDIO_WRITE_DATA_BUFFER)
         self._sdio_set_speed = mcu.CommandWrapper(ser, SDIO_SET_SPEED)
+        # Multi-block reads are optional (not available in older firmware)
+        self._sdio_read_blocks = None
+        try:
+            self._sdio_read_blocks = mcu.CommandQueryWrapper(
+                ser, SDIO_READ_BLOCKS, SDIO_READ_DATA_RESPONSE, self.oid)
+        except msgproto.error:
+            pass
 
     def sdio_send_cmd(self, cmd, argument, wait):
         return self._sdio_send_cmd.send([self.oid, cmd, argument, wait])
@@ -181,6 +190,12 @@ class SDIODirect:
     def sdio_write_data(self, cmd, argument):
         return self._sdio_write_data.send([self.oid, cmd, argument])
 
+    def has_read_blocks(self):
+        return self._sdio_read_blocks is not None
+
+    def sdio_read_blocks(self, cmd, argument, count):
+        return self._sdio_read_blocks.send([self.oid, cmd, argument, count])
+
     def sdio_read_data_buffer(self, offset, length=32):
         return self._sdio_read_data_buffer.send([self.oid, offset, length])
 
@@ -206,6 +221,10 @@ STA_NO_INIT = 1 << 0
 STA_NO_DISK = 1 << 1
 STA_WRITE_PROTECT = 1 << 2
 SECTOR_SIZE = 512
+# Maximum sectors per multi-block read (limited by the mcu data buffer)
+SDIO_MAX_READ_SECTORS = 8
+# Bytes per sdio_read_data_buffer query (must fit in one mcu response)
+SDIO_BUFFER_CHUNK = 48
 
 # FAT16/32 File System Support
 class FatFS:
@@ -261,13 +280,18 @@ class FatFS:
 
     def _fatfs_cb_disk_read(self, readbuf, sector, count):
         start = 0
-        end = SECTOR_SIZE
-        for sec in range(sector, sector + count, 1):
+        max_sectors = getattr(self.sdcard, 'max_read_sectors', 1)
+        sec = sector
+        while sec < sector + count:
+            sec_count = min(sector + count - sec, max_sectors)
             tries = 3
             buf = None
             while True:
                 try:
-                    buf = self.sdcard.read_sector(sec)
+                    if sec_count > 1:
+                        buf = self.sdcard.read_sectors(sec, sec_count)
+                    else:
+                        buf = self.sdcard.read_sector(sec)
                 except Exception:
                     tries -= 1
                     if not tries:
@@ -277,9 +301,10 @@ class FatFS:
                     break
             if buf is None:
                 return DRESULT.index("RES_ERROR")
+            end = start + len(buf)
             readbuf[start:end] = list(buf)
             start = end
-            end += SECTOR_SIZE
+            sec += sec_count
         return 0
 
     def _fatfs_cb_disk_write(self, writebuf, sector, count):
@@ -498,6 +523,7 @@ SD_COMMANDS = {
     'SEND_STATUS': 13,
     'SET_BLOCKLEN': 16,
     'READ_SINGLE_BLOCK': 17,
+    'READ_MULTIPLE_BLOCK': 18,
     'WRITE_BLOCK': 24,
     'APP_CMD': 55,
     'READ_OCR': 58,
@@ -1100,29 +1126,59 @@ class SDCardSDIO:
 
                 params = self.sdio.sdio_read_data(
                     SD_COMMANDS['READ_SINGLE_BLOCK'], offset)
-                if params['error'] != 0:
-                    raise OSError(
-                        'Read data failed. Error code=%d' %(params['error'],) )
-                if params['read'] != SECTOR_SIZE:
-                    raise OSError(
-                        'Read data failed. Expected %d bytes but got %d.' %
-                        (SECTOR_SIZE, params['read']) )
-
-                buf = bytearray()
-                offset = 0
-                while SECTOR_SIZE-len(buf)>0:
-                    rest = min(SECTOR_SIZE-len(buf), 32)
-                    params = self.sdio.sdio_read_data_buffer(
-                        offset, length=rest)
-                    temp = bytearray(params['data'])
-                    if len(temp) == 0:
-                        raise OSError("Read zero bytes from buffer")
-                    buf += temp
-                    offset += len(temp)
+                buf = self._read_data_buffer(params, SECTOR_SIZE)
             if buf is None:
                 raise OSError(err_msg)
             return buf
 
+    @property
+    def max_read_sectors(self):
+        if self.sdio.has_read_blocks():
+            return SDIO_MAX_READ_SECTORS
+        return 1
+
+    def read_sectors(self, sector, count):
+        buf = None
+        err_msg = "flash_sdcard: read error, sectors %d-%d" % (
+            sector, sector + count - 1)
+        with self.mutex:
+            if not (0 <= sector and sector + count <= self.total_sectors
+                    and 0 < count <= SDIO_MAX_READ_SECTORS):
+                err_msg += " out of range"
+            elif not self.initialized:
+                err_msg += ", SD Card not initialized"
+            else:
+                offset = sector
+                if not self.high_capacity:
+                    offset = sector * SECTOR_SIZE
+                params = self.sdio.sdio_read_blocks(
+                    SD_COMMANDS['READ_MULTIPLE_BLOCK'], offset, count)
+                buf = self._read_data_buffer(params, count * SECTOR_SIZE)
+            if buf is None:
+                raise OSError(err_msg)
+            return buf
+
+    def _read_data_buffer(self, params, size):
+        if params['error'] != 0:
+            raise OSError(
+                'Read data failed. Error code=%d' %(params['error'],) )
+        if params['read'] != size:
+            raise OSError(
+                'Read data failed. Expected %d bytes but got %d.' %
+                (size, params['read']) )
+        buf = bytearray()
+        offset = 0
+        while size-len(buf)>0:
+            rest = min(size-len(buf), SDIO_BUFFER_CHUNK)
+            params = self.sdio.sdio_read_data_buffer(
+                offset, length=rest)
+            temp = bytearray(params['data'])
+            if len(temp) == 0:
+                raise OSError("Read zero bytes from buffer")
+            buf += temp
+            offset += len(temp)
+        return buf
+
     def write_sector(self, sector, data):
         with self.mutex:
             if not 0 <= sector < self.total_sectors:
@@ -1,40 +1,198 @@
-#!/usr/bin/env python2
+#!/usr/bin/env python3
 # Script to calculate stats for each stepper from a log of messages
 #
-# Copyright (C) 2016  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2025  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import optparse
+import sys, os, optparse
+
+MOVE_NUM = 1024
+FLUSH_TIME = .050
+
+# Message tags (the generated messages are discarded so any value works)
+TAG_QUEUE_STEP, TAG_SET_NEXT_STEP_DIR = 1, 2
+
+# Length of an integer encoded as a "variable length quantity"
+def vlq_len(v):
+    sv = v if v < (1<<31) else v - (1<<32)
+    for l, bits in enumerate((5, 12, 19, 26)):
+        if -(1<<bits) <= sv < (3<<bits):
+            return l + 1
+    return 5
+
+# Estimated size of an encoded message (assuming a 1 byte message id)
+def msg_len(args):
+    return 1 + sum([vlq_len(int(v)) for n, v in args if n != 'data'])
+
+class StepperStats:
+    def __init__(self, oid):
+        self.oid = oid
+        self.dir_cmds = self.queue_cmds = self.msg_bytes = 0
+        self.pos_steps = self.neg_steps = 0
+        self.sdir = 0
+        self.clock = None
+        self.steps = []
+        self.count_hist = {}
+    def note_msg(self, args):
+        self.msg_bytes += msg_len(args)
+    def set_dir(self, sdir):
+        self.dir_cmds += 1
+        self.sdir = sdir
+    def queue_step(self, interval, count, add, add2=0):
+        self.queue_cmds += 1
+        if self.sdir:
+            self.pos_steps += count
+        else:
+            self.neg_steps += count
+        bucket = 1 << (count.bit_length() - 1) if count else 0
+        self.count_hist[bucket] = self.count_hist.get(bucket, 0) + 1
+        if self.clock is None:
+            return
+        # Reconstruct the step times (as the micro-controller would)
+        clock = self.clock
+        for i in range(count):
+            clock = (clock + interval) & 0xffffffff
+            interval += add
+            add += add2
+            self.steps.append((clock, self.sdir))
+        self.clock = clock
+    def get_clocks(self):
+        # Convert 32bit step clocks to a 64bit monotonic clock
+        out = []
+        base = last = 0
+        for clock, sdir in self.steps:
+            if clock < last:
+                base += 1 << 32
+            last = clock
+            out.append((base + clock, sdir))
+        return out
+
+# Parse a parsedump.py output file
+def parse_comms(filename):
+    steppers = {}
+    f = open(filename, 'r')
+    for line in f:
+        parts = line.split()
+        if not parts:
+            continue
+        args = [p.split('=', 1) for p in parts[1:] if '=' in p]
+        params = dict(args)
+        name = parts[0]
+        if name == 'config_stepper':
+            oid = int(params['oid'])
+            steppers[oid] = StepperStats(oid)
+            continue
+        if 'oid' not in params or int(params['oid']) not in steppers:
+            continue
+        so = steppers[int(params['oid'])]
+        if name == 'set_next_step_dir':
+            so.set_dir(int(params['dir']))
+        elif name == 'reset_step_clock':
+            so.clock = int(params['clock'])
+        elif name == 'queue_step':
+            so.queue_step(int(params['interval']), int(params['count']),
+                          int(params['add']))
+        elif name == 'queue_step2':
+            so.queue_step(int(params['interval']), int(params['count']),
+                          int(params['add']), int(params['add2']))
+        else:
+            continue
+        so.note_msg(args)
+    f.close()
+    return steppers
+
+# Run the reconstructed steps through the host stepcompress code
+def recompress(so, options):
+    sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+    import chelper
+    ffi_main, ffi_lib = chelper.get_ffi()
+    outfile = open(os.devnull, "wb")
+    sq = ffi_main.gc(ffi_lib.serialqueue_alloc(outfile.fileno(), b'f', 0),
+                     ffi_lib.serialqueue_free)
+    ffi_lib.serialqueue_set_clock_est(sq, 1000000000000.,
+                                      ffi_lib.get_monotonic(), 0, 0)
+    sc = ffi_main.gc(ffi_lib.stepcompress_alloc(so.oid),
+                     ffi_lib.stepcompress_free)
+    max_error_ticks = int(options.max_error * options.mcu_freq)
+    ffi_lib.stepcompress_fill(sc, max_error_ticks, TAG_QUEUE_STEP,
+                              TAG_SET_NEXT_STEP_DIR)
+    ss = ffi_main.gc(ffi_lib.steppersync_alloc(sq, [sc], 1, MOVE_NUM),
+                     ffi_lib.steppersync_free)
+    ffi_lib.steppersync_set_time(ss, 0., options.mcu_freq)
+    clocks = so.get_clocks()
+    flush_ticks = int(FLUSH_TIME * options.mcu_freq)
+    flush_clock = clocks[0][0] + flush_ticks
+    ffi_lib.stepcompress_reset(sc, clocks[0][0] - 1)
+    for clock, sdir in clocks:
+        while clock > flush_clock:
+            ret = ffi_lib.steppersync_flush(ss, flush_clock, flush_clock)
+            if ret:
+                raise Exception("Internal error in stepcompress")
+            flush_clock += flush_ticks
+        ret = ffi_lib.stepcompress_append(sc, sdir, 0.,
+                                          clock / options.mcu_freq)
+        if ret:
+            raise Exception("Internal error in stepcompress")
+    ret = ffi_lib.steppersync_flush(ss, clocks[-1][0] + 1, clocks[-1][0] + 1)
+    if ret:
+        raise Exception("Internal error in stepcompress")
+    stats = ffi_main.new('struct stepcompress_stats *')
+    ffi_lib.stepcompress_get_stats(sc, stats)
+    ffi_lib.serialqueue_exit(sq)
+    outfile.close()
+    return stats.message_count, stats.message_bytes
+
+def format_rate(count, duration):
+    if duration <= 0.:
+        return "-"
+    return "%.0f" % (count / duration,)
 
 def main():
     usage = "%prog [options] <comms file>"
     opts = optparse.OptionParser(usage)
+    opts.add_option("-f", "--mcu-freq", type="float", dest="mcu_freq",
+                    default=0., help="mcu clock frequency (enables rate and"
+                    " step time analysis)")
+    opts.add_option("-e", "--max-error", type="float", dest="max_error",
+                    default=0., help="recompress steps with this"
+                    " max_stepper_error (requires --mcu-freq)")
+    opts.add_option("--hist", action="store_true", dest="hist",
+                    help="report the distribution of queue_step counts"
+                    " (in power of two buckets)")
     options, args = opts.parse_args()
     if len(args) != 1:
         opts.error("Incorrect number of arguments")
-    filename = args[0]
+    if options.max_error and not options.mcu_freq:
+        opts.error("The --max-error option requires --mcu-freq")
+    steppers = parse_comms(args[0])
 
-    steppers = {}
-    f = open(filename, 'rb')
-    for line in f:
-        parts = line.split()
-        if not parts:
+    for oid, so in sorted(steppers.items()):
+        print("oid:%3d dir_cmds:%6d queue_cmds:%7d (%8d -%8d = %8d)" % (
+            oid, so.dir_cmds, so.queue_cmds, so.pos_steps, so.neg_steps,
+            so.pos_steps - so.neg_steps))
+        total_steps = so.pos_steps + so.neg_steps
+        msgs = so.queue_cmds + so.dir_cmds
+        print("    steps/queue_cmd:%.2f est_bytes:%d" % (
+            total_steps / max(so.queue_cmds, 1), so.msg_bytes))
+        if options.hist:
+            hist = " ".join(["%d:%d" % (b, c)
+                             for b, c in sorted(so.count_hist.items())])
+            print("    count_hist: %s" % (hist,))
+        clocks = so.get_clocks()
+        if not options.mcu_freq or len(clocks) < 2:
+            continue
+        duration = (clocks[-1][0] - clocks[0][0]) / options.mcu_freq
+        print("    duration:%.3fs msgs/sec:%s bytes/sec:%s" % (
+            duration, format_rate(msgs, duration),
+            format_rate(so.msg_bytes, duration)))
+        if not options.max_error:
             continue
-        args = dict([p.split('=', 1) for p in parts[1:]])
-        if parts[0] == 'config_stepper':
-            # steppers[oid] = [dir_cmds, dir, queue_cmds, pos steps, neg steps]
-            steppers[args['oid']] = [0, 0, 0, 0, 0]
-        elif parts[0] == 'set_next_step_dir':
-            so = steppers[args['oid']]
-            so[0] += 1
-            so[1] = args['dir']
-        elif parts[0] == 'queue_step':
-            so = steppers[args['oid']]
-            so[2] += 1
-            so[{'0': 3, '1': 4}[so[1]]] += int(args['count'])
-    for oid, so in sorted([(int(i[0]), i[1]) for i in steppers.items()]):
-        print "oid:%3d dir_cmds:%6d queue_cmds:%7d (%8d -%8d = %8d)" % (
-            oid, so[0], so[2], so[4], so[3], so[4]-so[3])
+        rc_msgs, rc_bytes = recompress(so, options)
+        print("    max_error=%.6f: msgs:%d bytes:%d msgs/sec:%s"
+              " bytes/sec:%s" % (
+                  options.max_error, rc_msgs, rc_bytes,
+                  format_rate(rc_msgs, duration),
+                  format_rate(rc_bytes, duration)))
 
 if __name__ == '__main__':
     main()
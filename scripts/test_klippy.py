@@ -3,7 +3,7 @@
 # Copyright (C) 2018  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import sys, os, optparse, logging, subprocess
+import sys, os, optparse, logging, subprocess, time, json
 
 TEMP_GCODE_FILE = "_test_.gcode"
 TEMP_LOG_FILE = "_test_.log"
@@ -24,6 +24,7 @@ class TestCase:
         self.tempdir = tempdir
         self.verbose = verbose
         self.keepfiles = keepfiles
+        self.wall_time = self.cpu_time = 0.
     def relpath(self, fname, rel='test'):
         if rel == 'dict':
             reldir = self.dictdir
@@ -96,7 +97,12 @@ class TestCase:
             args += ['-d', df]
         if not self.verbose:
             args += ['-l', TEMP_LOG_FILE]
+        start_wall, start_times = time.time(), os.times()
         res = subprocess.call(args)
+        end_wall, end_times = time.time(), os.times()
+        self.wall_time += end_wall - start_wall
+        self.cpu_time += ((end_times[2] + end_times[3])
+                          - (start_times[2] + start_times[3]))
         is_fail = (should_fail and not res) or (not should_fail and res)
         if is_fail:
             if not self.verbose:
@@ -132,6 +138,38 @@ class TestCase:
         sys.stdout.write(data)
 
 
+######################################################################
+# Timing
+######################################################################
+
+# Report test timing and check it against a stored baseline
+def check_timing(timings, options):
+    baseline = {}
+    if options.baseline:
+        f = open(options.baseline, 'r')
+        baseline = json.load(f)
+        f.close()
+    failures = []
+    for fname, t in sorted(timings.items()):
+        msg = "    %s: wall=%.3fs cpu=%.3fs" % (fname, t['wall'], t['cpu'])
+        base = baseline.get(fname)
+        if base is not None:
+            ratio = t['cpu'] / max(base['cpu'], .001)
+            msg += " (baseline cpu=%.3fs %+.1f%%)" % (
+                base['cpu'], (ratio - 1.) * 100.)
+            if ratio > 1. + options.tolerance:
+                failures.append(fname)
+        sys.stderr.write(msg + "\n")
+    if options.timing:
+        f = open(options.timing, 'w')
+        json.dump(timings, f, indent=2, sort_keys=True)
+        f.close()
+    if failures:
+        sys.stderr.write("\n\nTest case timing regression in %s!\n\n"
+                         % (", ".join(failures),))
+        sys.exit(-1)
+
+
 ######################################################################
 # Startup
 ######################################################################
@@ -148,12 +186,20 @@ def main():
                     help="do not remove temporary files")
     opts.add_option("-v", action="store_true", dest="verbose",
                     help="show all output from tests")
+    opts.add_option("--timing", dest="timing",
+                    help="store test timing in the given json file")
+    opts.add_option("--baseline", dest="baseline",
+                    help="compare test cpu time against a stored json file")
+    opts.add_option("--tolerance", type="float", dest="tolerance",
+                    default=.20, help="allowed cpu time increase over the"
+                    " baseline (as a fraction, default 0.20)")
     options, args = opts.parse_args()
     if len(args) < 1:
         opts.error("Incorrect number of arguments")
     logging.basicConfig(level=logging.DEBUG)
 
     # Run each test
+    timings = {}
     for fname in args:
         tc = TestCase(fname, options.dictdir, options.tempdir, options.verbose,
                       options.keepfiles)
@@ -161,8 +207,11 @@ def main():
         if res != 'success':
             sys.stderr.write("\n\nTest case %s FAILED (%s)!\n\n" % (fname, res))
             sys.exit(-1)
+        timings[fname] = {'wall': tc.wall_time, 'cpu': tc.cpu_time}
 
     sys.stderr.write("\n    All %d test cases passed\n" % (len(args),))
+    if options.timing or options.baseline:
+        check_timing(timings, options)
 
 if __name__ == '__main__':
     main()
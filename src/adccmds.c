@@ -4,6 +4,8 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_HAVE_GPIO_ADC_SCAN
+#include "adccmds.h" // analog_in_add_signal
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // struct gpio_adc
 #include "board/irq.h" // irq_disable
@@ -15,6 +17,7 @@ struct analog_in {
     uint32_t rest_time, sample_time, next_begin_time;
     uint16_t value, min_value, max_value;
     struct gpio_adc pin;
+    struct analog_in_signal *signal;
     uint8_t invalid_count, range_check_count;
     uint8_t state, sample_count;
 };
@@ -70,6 +73,22 @@ command_config_analog_in(uint32_t *args)
 }
 DECL_COMMAND(command_config_analog_in, "config_analog_in oid=%c pin=%u");
 
+// Lookup an analog_in object from its oid
+struct analog_in *
+analog_in_oid_lookup(uint8_t oid)
+{
+    return oid_lookup(oid, command_config_analog_in);
+}
+
+// Request a callback (from task context) with each reported value
+void
+analog_in_add_signal(struct analog_in *a, struct analog_in_signal *ais
+                     , analog_in_callback_t func)
+{
+    ais->func = func;
+    a->signal = ais;
+}
+
 void
 command_query_analog_in(uint32_t *args)
 {
@@ -112,12 +131,210 @@ analog_in_task(void)
         uint32_t next_begin_time = a->next_begin_time;
         a->state++;
         irq_enable();
+        if (a->signal)
+            a->signal->func(a->signal, value);
         sendf("analog_in_state oid=%c next_clock=%u value=%hu"
               , oid, next_begin_time, value);
     }
 }
 DECL_TASK(analog_in_task);
 
+
+/****************************************************************
+ * Analog scan groups
+ ****************************************************************/
+
+// A scan group samples several analog pins on one timer and reports
+// them in a single message.  Boards with HAVE_GPIO_ADC_SCAN sample
+// all the pins (and all their over-samples) with one hardware scan,
+// other boards sample the pins one after another.
+
+#define ANALOG_SCAN_MAX_PINS 16
+
+struct analog_scan_pin {
+    struct gpio_adc pin;
+    uint16_t value, min_value, max_value;
+    uint8_t invalid_count;
+};
+
+struct analog_scan {
+    struct timer timer;
+    uint32_t rest_time, sample_time, next_begin_time;
+#if CONFIG_HAVE_GPIO_ADC_SCAN
+    struct gpio_adc_scan scan;
+#endif
+    uint8_t pin_count, pin_pos, range_check_count;
+    uint8_t state, sample_count;
+    struct analog_scan_pin pins[];
+};
+
+static struct task_wake analog_scan_wake;
+
+// Verify the sampled values are within their configured ranges
+static void
+analog_scan_check_range(struct analog_scan *as)
+{
+    uint8_t i;
+    for (i=0; i<as->pin_count; i++) {
+        struct analog_scan_pin *p = &as->pins[i];
+        if (likely(p->value >= p->min_value && p->value <= p->max_value)) {
+            p->invalid_count = 0;
+        } else {
+            p->invalid_count++;
+            if (p->invalid_count >= as->range_check_count) {
+                try_shutdown("ADC out of range");
+                p->invalid_count = 0;
+            }
+        }
+    }
+}
+
+static uint_fast8_t
+analog_scan_event(struct timer *timer)
+{
+    struct analog_scan *as = container_of(timer, struct analog_scan, timer);
+#if CONFIG_HAVE_GPIO_ADC_SCAN
+    uint32_t sample_delay = gpio_adc_scan_sample(&as->scan, as->sample_count);
+    if (sample_delay) {
+        as->timer.waketime += sample_delay;
+        return SF_RESCHEDULE;
+    }
+    uint8_t i;
+    for (i=0; i<as->pin_count; i++)
+        as->pins[i].value = gpio_adc_scan_read(&as->scan, as->pins[i].pin);
+#else
+    // Read the pending pin (if ready) and start sampling the next pin
+    for (;;) {
+        struct analog_scan_pin *p = &as->pins[as->pin_pos];
+        uint32_t sample_delay = gpio_adc_sample(p->pin);
+        if (sample_delay) {
+            as->timer.waketime += sample_delay;
+            return SF_RESCHEDULE;
+        }
+        uint16_t value = gpio_adc_read(p->pin);
+        if (as->state >= as->sample_count)
+            as->state = 0;
+        if (as->state)
+            value += p->value;
+        p->value = value;
+        as->pin_pos++;
+        if (as->pin_pos >= as->pin_count)
+            break;
+    }
+    as->pin_pos = 0;
+    as->state++;
+    if (as->state < as->sample_count) {
+        as->timer.waketime += as->sample_time;
+        return SF_RESCHEDULE;
+    }
+#endif
+    analog_scan_check_range(as);
+    as->state = as->sample_count;
+    sched_wake_task(&analog_scan_wake);
+    as->next_begin_time += as->rest_time;
+    as->timer.waketime = as->next_begin_time;
+    return SF_RESCHEDULE;
+}
+
+// Cancel any sample in progress
+static void
+analog_scan_cancel(struct analog_scan *as)
+{
+#if CONFIG_HAVE_GPIO_ADC_SCAN
+    gpio_adc_scan_cancel(&as->scan);
+#else
+    if (as->pin_count)
+        gpio_adc_cancel_sample(as->pins[as->pin_pos].pin);
+#endif
+    as->pin_pos = 0;
+}
+
+void
+command_config_analog_scan(uint32_t *args)
+{
+    uint8_t pin_count = args[1];
+    if (!pin_count || pin_count > ANALOG_SCAN_MAX_PINS)
+        shutdown("Invalid analog scan pin count");
+    struct analog_scan *as = oid_alloc(
+        args[0], command_config_analog_scan
+        , sizeof(*as) + pin_count * sizeof(as->pins[0]));
+    as->timer.func = analog_scan_event;
+    as->pin_count = pin_count;
+    as->state = 1;
+}
+DECL_COMMAND(command_config_analog_scan,
+             "config_analog_scan oid=%c pin_count=%c");
+
+void
+command_config_analog_scan_pin(uint32_t *args)
+{
+    struct analog_scan *as = oid_lookup(args[0], command_config_analog_scan);
+    uint8_t index = args[1];
+    if (index >= as->pin_count)
+        shutdown("Invalid analog scan pin index");
+    struct analog_scan_pin *p = &as->pins[index];
+    p->pin = gpio_adc_setup(args[2]);
+    p->min_value = args[3];
+    p->max_value = args[4];
+#if CONFIG_HAVE_GPIO_ADC_SCAN
+    gpio_adc_scan_add(&as->scan, p->pin);
+#endif
+}
+DECL_COMMAND(command_config_analog_scan_pin,
+             "config_analog_scan_pin oid=%c index=%c pin=%u"
+             " min_value=%hu max_value=%hu");
+
+void
+command_query_analog_scan(uint32_t *args)
+{
+    struct analog_scan *as = oid_lookup(args[0], command_config_analog_scan);
+    sched_del_timer(&as->timer);
+    analog_scan_cancel(as);
+    as->next_begin_time = args[1];
+    as->timer.waketime = as->next_begin_time;
+    as->sample_time = args[2];
+    as->sample_count = args[3];
+    as->state = as->sample_count + 1;
+    as->rest_time = args[4];
+    as->range_check_count = args[5];
+    if (! as->sample_count)
+        return;
+    sched_add_timer(&as->timer);
+}
+DECL_COMMAND(command_query_analog_scan,
+             "query_analog_scan oid=%c clock=%u sample_ticks=%u"
+             " sample_count=%c rest_ticks=%u range_check_count=%c");
+
+void
+analog_scan_task(void)
+{
+    if (!sched_check_wake(&analog_scan_wake))
+        return;
+    uint8_t oid;
+    struct analog_scan *as;
+    foreach_oid(oid, as, command_config_analog_scan) {
+        if (as->state != as->sample_count)
+            continue;
+        uint8_t data[ANALOG_SCAN_MAX_PINS * 2], i;
+        irq_disable();
+        if (as->state != as->sample_count) {
+            irq_enable();
+            continue;
+        }
+        for (i=0; i<as->pin_count; i++) {
+            uint16_t value = as->pins[i].value;
+            data[i*2] = value;
+            data[i*2 + 1] = value >> 8;
+        }
+        uint32_t next_begin_time = as->next_begin_time;
+        as->state++;
+        irq_enable();
+        sendf("analog_scan_state oid=%c next_clock=%u values=%*s"
+              , oid, next_begin_time, as->pin_count * 2, data);
+    }
+}
+DECL_TASK(analog_scan_task);
+
 void
 analog_in_shutdown(void)
 {
@@ -132,5 +349,15 @@ analog_in_shutdown(void)
             sched_add_timer(&a->timer);
         }
     }
+    struct analog_scan *as;
+    foreach_oid(i, as, command_config_analog_scan) {
+        analog_scan_cancel(as);
+        if (as->sample_count) {
+            as->state = as->sample_count + 1;
+            as->next_begin_time += as->rest_time;
+            as->timer.waketime = as->next_begin_time;
+            sched_add_timer(&as->timer);
+        }
+    }
 }
 DECL_SHUTDOWN(analog_in_shutdown);
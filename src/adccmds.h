@@ -0,0 +1,18 @@
+#ifndef __ADCCMDS_H
+#define __ADCCMDS_H
+
+#include <stdint.h> // uint16_t
+
+struct analog_in_signal;
+typedef void (*analog_in_callback_t)(struct analog_in_signal *ais
+                                     , uint16_t value);
+
+struct analog_in_signal {
+    analog_in_callback_t func;
+};
+
+struct analog_in *analog_in_oid_lookup(uint8_t oid);
+void analog_in_add_signal(struct analog_in *a, struct analog_in_signal *ais
+                          , analog_in_callback_t func);
+
+#endif // adccmds.h
@@ -24,4 +24,7 @@
 
 extern void __force_link_error__unknown_type(void);
 
+#define __hotfunc
+#define __hotdata
+
 #endif // pgm.h
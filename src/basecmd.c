@@ -5,6 +5,7 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memset
+#include "autoconf.h" // CONFIG_WANT_SCHED_TIMER_STATS
 #include "basecmd.h" // oid_lookup
 #include "board/irq.h" // irq_save
 #include "board/misc.h" // alloc_maxsize
@@ -59,9 +60,13 @@ alloc_chunks(size_t size, size_t count, uint16_t *avail)
  ****************************************************************/
 
 static struct move_node *move_free_list;
+static struct move_queue_head *move_queues;
 static void *move_list;
-static uint16_t move_count;
+static uint16_t move_count, move_reserved;
 static uint8_t move_item_size;
+#if CONFIG_WANT_MOVE_QUEUE_STATS
+static uint16_t move_free_count, move_free_min;
+#endif
 
 // Is the config and move queue finalized?
 static int
@@ -73,22 +78,33 @@ is_finalized(void)
 // Free previously allocated storage from move_alloc(). Caller must
 // disable irqs.
 void
-move_free(void *m)
+move_free(struct move_queue_head *mh, void *m)
 {
-    struct move_node *mf = m;
-    mf->next = move_free_list;
-    move_free_list = mf;
+    struct move_node *mf = m, **free_list = (
+        mh->reserve ? &mh->free_list : &move_free_list);
+    mf->next = *free_list;
+    *free_list = mf;
+#if CONFIG_WANT_MOVE_QUEUE_STATS
+    if (!mh->reserve)
+        move_free_count++;
+#endif
 }
 
 // Allocate runtime storage
 void *
-move_alloc(void)
+move_alloc(struct move_queue_head *mh)
 {
     irqstatus_t flag = irq_save();
-    struct move_node *mf = move_free_list;
+    struct move_node **free_list = (
+        mh->reserve ? &mh->free_list : &move_free_list);
+    struct move_node *mf = *free_list;
     if (!mf)
         shutdown("Move queue overflow");
-    move_free_list = mf->next;
+    *free_list = mf->next;
+#if CONFIG_WANT_MOVE_QUEUE_STATS
+    if (!mh->reserve && --move_free_count < move_free_min)
+        move_free_min = move_free_count;
+#endif
     irq_restore(flag);
     return mf;
 }
@@ -139,14 +155,53 @@ move_queue_clear(struct move_queue_head *mh)
 
 // Initialize a move_queue with nodes of the give size
 void
-move_queue_setup(struct move_queue_head *mh, int size)
+move_queue_setup(uint8_t oid, struct move_queue_head *mh, int size)
 {
-    mh->first = mh->last = NULL;
+    mh->first = mh->last = mh->free_list = NULL;
+    mh->reserve = 0;
+    mh->oid = oid;
 
     if (size > UINT8_MAX || is_finalized())
         shutdown("Invalid move request size");
     if (size > move_item_size)
         move_item_size = size;
+    mh->next_queue = move_queues;
+    move_queues = mh;
+}
+
+// Reserve a number of move queue nodes for the exclusive use of a
+// move_queue
+void
+command_move_queue_reserve(uint32_t *args)
+{
+    uint8_t oid = args[0];
+    uint16_t count = args[1];
+    if (is_finalized())
+        shutdown("Invalid move queue reservation");
+    struct move_queue_head *mh;
+    for (mh = move_queues; mh; mh = mh->next_queue)
+        if (mh->oid == oid)
+            break;
+    if (!mh)
+        shutdown("Invalid move queue reservation");
+    move_reserved += count - mh->reserve;
+    mh->reserve = count;
+}
+DECL_COMMAND(command_move_queue_reserve,
+             "move_queue_reserve oid=%c count=%hu");
+
+// Link 'count' nodes (starting at node '*pos') into a free list
+static struct move_node *
+move_link_nodes(uint16_t *pos, uint16_t count)
+{
+    struct move_node *first = NULL, **pnext = &first;
+    while (count--) {
+        struct move_node *mf = move_list + (*pos)++ * move_item_size;
+        *pnext = mf;
+        pnext = &mf->next;
+    }
+    *pnext = NULL;
+    return first;
 }
 
 void
@@ -154,26 +209,44 @@ move_reset(void)
 {
     if (!move_count)
         return;
-    // Add everything in move_list to the free list.
-    uint32_t i;
-    for (i=0; i<move_count-1; i++) {
-        struct move_node *mf = move_list + i*move_item_size;
-        mf->next = move_list + (i + 1)*move_item_size;
-    }
-    struct move_node *mf = move_list + (move_count - 1)*move_item_size;
-    mf->next = NULL;
-    move_free_list = move_list;
+    // Give each reserved move_queue its nodes and add the remaining
+    // nodes to the shared free list.
+    uint16_t pos = 0;
+    struct move_queue_head *mh;
+    for (mh = move_queues; mh; mh = mh->next_queue)
+        mh->free_list = move_link_nodes(&pos, mh->reserve);
+#if CONFIG_WANT_MOVE_QUEUE_STATS
+    move_free_count = move_free_min = move_count - pos;
+#endif
+    move_free_list = move_link_nodes(&pos, move_count - pos);
 }
 DECL_SHUTDOWN(move_reset);
 
+#if CONFIG_WANT_MOVE_QUEUE_STATS
+// Return the minimum number of free shared move queue entries since
+// the last call
+static uint16_t
+move_queue_min_free(void)
+{
+    irq_disable();
+    uint16_t min_free = move_free_min;
+    move_free_min = move_free_count;
+    irq_enable();
+    return min_free;
+}
+#endif
+
 static void
 move_finalize(void)
 {
     if (is_finalized())
         shutdown("Already finalized");
-    struct move_queue_head dummy;
-    move_queue_setup(&dummy, sizeof(*move_free_list));
-    move_list = alloc_chunks(move_item_size, 1024, &move_count);
+    if (move_item_size < sizeof(*move_free_list))
+        move_item_size = sizeof(*move_free_list);
+    move_list = alloc_chunks(move_item_size, 1024 + move_reserved
+                             , &move_count);
+    if (move_count <= move_reserved)
+        shutdown("Move queue reservation too large");
     move_reset();
 }
 
@@ -245,7 +318,8 @@ void
 command_get_config(uint32_t *args)
 {
     sendf("config is_config=%c crc=%u is_shutdown=%c move_count=%hu"
-          , is_finalized(), config_crc, sched_is_shutdown(), move_count);
+          , is_finalized(), config_crc, sched_is_shutdown()
+          , move_count - move_reserved);
 }
 DECL_COMMAND_FLAGS(command_get_config, HF_IN_SHUTDOWN, "get_config");
 
@@ -268,8 +342,9 @@ config_reset(uint32_t *args)
     oid_count = 0;
     oids = NULL;
     move_free_list = NULL;
+    move_queues = NULL;
     move_list = NULL;
-    move_count = move_item_size = 0;
+    move_count = move_reserved = move_item_size = 0;
     alloc_init();
     sched_timer_reset();
     sched_clear_shutdown();
@@ -329,9 +404,19 @@ stats_update(uint32_t start, uint32_t cur)
         nextsumsq = 0xffffffff;
     sumsq = nextsumsq;
 
+#if CONFIG_WANT_SCHED_PROFILE
+    sched_profile_report(cur);
+#endif
     if (!timer_has_elapsed(stats_send_time, cur, timer_from_us(5000000)))
         return;
     sendf("stats count=%u sum=%u sumsq=%u", count, sum, sumsq);
+#if CONFIG_WANT_SCHED_TIMER_STATS
+    sendf("stats_timer max_insert=%u", sched_timer_insert_max());
+#endif
+#if CONFIG_WANT_MOVE_QUEUE_STATS
+    if (is_finalized())
+        sendf("stats_move_queue min_free=%hu", move_queue_min_free());
+#endif
     if (cur < stats_send_time)
         stats_send_time_high++;
     stats_send_time = cur;
@@ -9,17 +9,22 @@ struct move_node {
 };
 struct move_queue_head {
     struct move_node *first, *last;
+    // Storage reserved for this queue (see move_queue_reserve)
+    struct move_node *free_list;
+    struct move_queue_head *next_queue;
+    uint16_t reserve;
+    uint8_t oid;
 };
 
 void *alloc_chunk(size_t size);
-void move_free(void *m);
-void *move_alloc(void);
+void move_free(struct move_queue_head *mh, void *m);
+void *move_alloc(struct move_queue_head *mh);
 int move_queue_empty(struct move_queue_head *mh);
 struct move_node *move_queue_first(struct move_queue_head *mh);
 int move_queue_push(struct move_node *m, struct move_queue_head *mh);
 struct move_node *move_queue_pop(struct move_queue_head *mh);
 void move_queue_clear(struct move_queue_head *mh);
-void move_queue_setup(struct move_queue_head *mh, int size);
+void move_queue_setup(uint8_t oid, struct move_queue_head *mh, int size);
 void *oid_lookup(uint8_t oid, void *type);
 void *oid_alloc(uint8_t oid, void *type, uint16_t size);
 void *oid_next(uint8_t *i, void *type);
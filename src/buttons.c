@@ -1,6 +1,6 @@
-// Report on user interface buttons
+// Report on user interface buttons and rotary encoders
 //
-// Copyright (C) 2018  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2018-2025  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -161,3 +161,161 @@ buttons_task(void)
     }
 }
 DECL_TASK(buttons_task);
+
+
+/****************************************************************
+ * Rotary encoders
+ ****************************************************************/
+
+// Rotary encoder state tables from https://github.com/brianlow/Rotary
+// Copyright 2011 Ben Buxton (bb@cactii.net).
+// Licenced under the GNU GPL Version 3.
+enum { R_START = 0x0, R_DIR_CW = 0x10, R_DIR_CCW = 0x20, R_DIR_MSK = 0x30 };
+
+// Full-step table (emits a code at 00 only)
+enum {
+    RF_CW_FINAL = 0x1, RF_CW_BEGIN = 0x2, RF_CW_NEXT = 0x3,
+    RF_CCW_BEGIN = 0x4, RF_CCW_FINAL = 0x5, RF_CCW_NEXT = 0x6,
+};
+static const uint8_t full_step_states[7][4] = {
+    { R_START, RF_CW_BEGIN, RF_CCW_BEGIN, R_START },
+    { RF_CW_NEXT, R_START, RF_CW_FINAL, R_START | R_DIR_CW },
+    { RF_CW_NEXT, RF_CW_BEGIN, R_START, R_START },
+    { RF_CW_NEXT, RF_CW_BEGIN, RF_CW_FINAL, R_START },
+    { RF_CCW_NEXT, R_START, RF_CCW_BEGIN, R_START },
+    { RF_CCW_NEXT, RF_CCW_FINAL, R_START, R_START | R_DIR_CCW },
+    { RF_CCW_NEXT, RF_CCW_FINAL, RF_CCW_BEGIN, R_START },
+};
+
+// Half-step table (emits a code at 00 and 11)
+enum {
+    RH_CCW_BEGIN = 0x1, RH_CW_BEGIN = 0x2, RH_START_M = 0x3,
+    RH_CW_BEGIN_M = 0x4, RH_CCW_BEGIN_M = 0x5,
+};
+static const uint8_t half_step_states[6][4] = {
+    { RH_START_M, RH_CW_BEGIN, RH_CCW_BEGIN, R_START },
+    { RH_START_M | R_DIR_CCW, R_START, RH_CCW_BEGIN, R_START },
+    { RH_START_M | R_DIR_CW, RH_CW_BEGIN, R_START, R_START },
+    { RH_START_M, RH_CCW_BEGIN_M, RH_CW_BEGIN_M, R_START },
+    { RH_START_M, RH_START_M, RH_CW_BEGIN_M, R_START | R_DIR_CW },
+    { RH_START_M, RH_CCW_BEGIN_M, RH_START_M, R_START | R_DIR_CCW },
+};
+
+struct encoder {
+    struct timer time;
+    uint32_t rest_ticks;
+    struct gpio_in pin1, pin2;
+    const uint8_t (*states)[4];
+    uint16_t count, acked_count;
+    uint8_t state, invert, flags;
+    uint8_t retransmit_state, retransmit_count;
+};
+
+enum { EF_INFLIGHT = 1<<0 };
+
+static struct task_wake encoder_wake;
+
+static uint_fast8_t
+encoder_event(struct timer *t)
+{
+    struct encoder *e = container_of(t, struct encoder, time);
+
+    // Update the quadrature state
+    uint8_t pins = ((gpio_in_read(e->pin1) ? 1 : 0)
+                    | (gpio_in_read(e->pin2) ? 2 : 0)) ^ e->invert;
+    uint8_t state = e->states[e->state & 0x0f][pins];
+    e->state = state;
+    uint8_t dir = state & R_DIR_MSK;
+    if (dir) {
+        e->count += dir == R_DIR_CW ? 1 : -1;
+        if (!(e->flags & EF_INFLIGHT))
+            sched_wake_task(&encoder_wake);
+    }
+
+    // Check if a retransmit is needed
+    if (e->flags & EF_INFLIGHT) {
+        uint8_t retransmit_state = e->retransmit_state - 1;
+        if (retransmit_state & BF_NO_RETRANSMIT) {
+            // timeout - do retransmit
+            e->flags &= ~EF_INFLIGHT;
+            sched_wake_task(&encoder_wake);
+        }
+        e->retransmit_state = retransmit_state;
+    }
+
+    // Reschedule timer
+    e->time.waketime += e->rest_ticks;
+    return SF_RESCHEDULE;
+}
+
+void
+command_config_encoder(uint32_t *args)
+{
+    struct encoder *e = oid_alloc(args[0], command_config_encoder
+                                  , sizeof(*e));
+    e->pin1 = gpio_in_setup(args[1], args[2]);
+    e->pin2 = gpio_in_setup(args[3], args[4]);
+    e->invert = args[5];
+    e->states = args[6] ? half_step_states : full_step_states;
+    e->time.func = encoder_event;
+}
+DECL_COMMAND(command_config_encoder,
+             "config_encoder oid=%c pin1=%u pull_up1=%c pin2=%u pull_up2=%c"
+             " invert=%c half_step=%c");
+
+void
+command_encoder_query(uint32_t *args)
+{
+    struct encoder *e = oid_lookup(args[0], command_config_encoder);
+    sched_del_timer(&e->time);
+    e->time.waketime = args[1];
+    e->rest_ticks = args[2];
+    e->retransmit_count = args[3];
+    if (e->retransmit_count >= BF_NO_RETRANSMIT)
+        shutdown("Invalid encoder retransmit count");
+    e->count = e->acked_count = 0;
+    e->state = R_START;
+    e->flags = 0;
+    if (! e->rest_ticks)
+        return;
+    sched_add_timer(&e->time);
+}
+DECL_COMMAND(command_encoder_query,
+             "encoder_query oid=%c clock=%u rest_ticks=%u retransmit_count=%c");
+
+void
+command_encoder_ack(uint32_t *args)
+{
+    struct encoder *e = oid_lookup(args[0], command_config_encoder);
+    irq_disable();
+    e->acked_count = args[1];
+    e->flags &= ~EF_INFLIGHT;
+    if (e->count != e->acked_count)
+        sched_wake_task(&encoder_wake);
+    irq_enable();
+}
+DECL_COMMAND(command_encoder_ack, "encoder_ack oid=%c count=%hu");
+
+// Report the accumulated detent count (only one report is sent per
+// host round trip, so fast turns are reported in batches)
+void
+encoder_task(void)
+{
+    if (!sched_check_wake(&encoder_wake))
+        return;
+    uint8_t oid;
+    struct encoder *e;
+    foreach_oid(oid, e, command_config_encoder) {
+        irq_disable();
+        uint16_t count = e->count;
+        if (e->flags & EF_INFLIGHT || count == e->acked_count) {
+            irq_enable();
+            continue;
+        }
+        e->flags |= EF_INFLIGHT;
+        e->retransmit_state = e->retransmit_count;
+        irq_enable();
+        sendf("encoder_state oid=%c count=%hu", oid, count);
+    }
+}
+DECL_TASK(encoder_task);
@@ -69,6 +69,13 @@ parse_int(uint8_t **pp)
     return v;
 }
 
+// Parse a vlq integer (for commands that pack integers in a buffer)
+uint32_t
+command_parse_int(uint8_t **pp)
+{
+    return parse_int(pp);
+}
+
 // Write an encoded msgid (optimized 2-byte VLQ encoder)
 static uint8_t *
 encode_msgid(uint8_t *p, uint_fast16_t encoded_msgid)
@@ -92,11 +99,20 @@ command_parse_msgid(uint8_t **pp)
 }
 
 // Parse an incoming command into 'args'
-uint8_t *
+uint8_t * __hotfunc
 command_parsef(uint8_t *p, uint8_t *maxend
                , const struct command_parser *cp, uint32_t *args)
 {
     uint_fast8_t num_params = READP(cp->num_params);
+    if (READP(cp->flags) & HF_INT_PARAMS) {
+        // Fast path for the common case of only integer parameters
+        while (num_params--) {
+            if (p > maxend)
+                goto error;
+            *args++ = parse_int(&p);
+        }
+        return p;
+    }
     const uint8_t *param_types = READP(cp->param_types);
     while (num_params--) {
         if (p > maxend)
@@ -335,6 +351,7 @@ command_dispatch(uint8_t *buf, uint_fast8_t msglen)
         const struct command_parser *cp = command_lookup_parser(cmdid);
         uint32_t args[READP(cp->num_args)];
         p = command_parsef(p, msgend, cp, args);
+        sched_trace(ST_COMMAND, cmdid, 0);
         if (sched_is_shutdown() && !(READP(cp->flags) & HF_IN_SHUTDOWN)) {
             sched_report_shutdown();
             continue;
@@ -353,7 +370,7 @@ command_send_ack(void)
 }
 
 // Find a message block and then dispatch all the commands in it
-int_fast8_t
+int_fast8_t __hotfunc
 command_find_and_dispatch(uint8_t *buf, uint_fast8_t buf_len
                           , uint_fast8_t *pop_count)
 {
@@ -15,6 +15,7 @@
 
 // Flags for command handler declarations.
 #define HF_IN_SHUTDOWN   0x01   // Handler can run even when in emergency stop
+#define HF_INT_PARAMS    0x80   // Only integer params (set by buildcommands.py)
 
 // Declare a constant exported to the host
 #define DECL_CONSTANT(NAME, VALUE)                              \
@@ -74,6 +75,7 @@ enum {
 
 // command.c
 void *command_decode_ptr(uint32_t v);
+uint32_t command_parse_int(uint8_t **pp);
 uint_fast16_t command_parse_msgid(uint8_t **pp);
 uint8_t *command_parsef(uint8_t *p, uint8_t *maxend
                         , const struct command_parser *cp, uint32_t *args);
@@ -4,9 +4,11 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_WANT_ENDSTOP_IRQ
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // struct gpio
 #include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // struct timer
 #include "trsync.h" // trsync_do_trigger
@@ -17,11 +19,15 @@ struct endstop {
     uint32_t rest_time, sample_time, nextwake;
     struct trsync *ts;
     uint8_t flags, sample_count, trigger_count, trigger_reason;
+#if CONFIG_WANT_ENDSTOP_IRQ
+    struct gpio_irq irq;
+#endif
 };
 
-enum { ESF_PIN_HIGH=1<<0, ESF_HOMING=1<<1 };
+enum { ESF_PIN_HIGH=1<<0, ESF_HOMING=1<<1, ESF_IRQ=1<<2 };
 
 static uint_fast8_t endstop_oversample_event(struct timer *t);
+static uint_fast8_t endstop_irq_arm_event(struct timer *t);
 
 // Timer callback for an end stop
 static uint_fast8_t
@@ -48,7 +54,8 @@ endstop_oversample_event(struct timer *t)
     uint8_t val = gpio_in_read(e->pin);
     if ((val ? ~e->flags : e->flags) & ESF_PIN_HIGH) {
         // No longer matching - reschedule for the next attempt
-        e->time.func = endstop_event;
+        e->time.func = (CONFIG_WANT_ENDSTOP_IRQ && e->flags & ESF_IRQ
+                        ? endstop_irq_arm_event : endstop_event);
         e->time.waketime = e->nextwake;
         e->trigger_count = e->sample_count;
         return SF_RESCHEDULE;
@@ -63,6 +70,70 @@ endstop_oversample_event(struct timer *t)
     return SF_RESCHEDULE;
 }
 
+#if CONFIG_WANT_ENDSTOP_IRQ
+// Edge interrupt handler for an end stop (called from irq context)
+static void
+endstop_irq_event(struct gpio_irq *gi, uint32_t time)
+{
+    struct endstop *e = container_of(gi, struct endstop, irq);
+    gpio_irq_disable(gi);
+    // Report the edge time as the first matching sample time
+    e->nextwake = time + e->rest_time;
+    uint8_t count = e->sample_count - 1;
+    if (!count) {
+        trsync_do_trigger(e->ts, e->trigger_reason);
+        return;
+    }
+    e->trigger_count = count;
+    e->time.func = endstop_oversample_event;
+    irqstatus_t flag = irq_save();
+    uint32_t waketime = time + e->sample_time, now = timer_read_time();
+    if (timer_is_before(waketime, now))
+        // The interrupt was delayed - take the next sample soon
+        waketime = now + timer_from_us(5);
+    e->time.waketime = waketime;
+    sched_add_timer(&e->time);
+    irq_restore(flag);
+}
+
+// Timer callback that waits for an end stop edge interrupt
+static uint_fast8_t
+endstop_irq_arm_event(struct timer *t)
+{
+    struct endstop *e = container_of(t, struct endstop, time);
+    // Enable the interrupt before checking the pin so that a change
+    // between the two can not be missed
+    gpio_irq_enable(&e->irq, e->flags & ESF_PIN_HIGH);
+    uint8_t val = gpio_in_read(e->pin);
+    if ((val ? ~e->flags : e->flags) & ESF_PIN_HIGH)
+        return SF_DONE;
+    // Pin already matches - sample it from the timer
+    gpio_irq_disable(&e->irq);
+    e->nextwake = e->time.waketime + e->rest_time;
+    e->time.func = endstop_oversample_event;
+    return endstop_oversample_event(t);
+}
+
+// Stop waiting for an end stop edge interrupt
+static void
+endstop_irq_cancel(struct endstop *e)
+{
+    if (e->flags & ESF_IRQ)
+        gpio_irq_disable(&e->irq);
+}
+#else
+static uint_fast8_t
+endstop_irq_arm_event(struct timer *t)
+{
+    return SF_DONE;
+}
+
+static void
+endstop_irq_cancel(struct endstop *e)
+{
+}
+#endif
+
 void
 command_config_endstop(uint32_t *args)
 {
@@ -71,25 +142,42 @@ command_config_endstop(uint32_t *args)
 }
 DECL_COMMAND(command_config_endstop, "config_endstop oid=%c pin=%c pull_up=%c");
 
+#if CONFIG_WANT_ENDSTOP_IRQ
+// Detect end stop triggers from a gpio edge interrupt
+void
+command_config_endstop_irq(uint32_t *args)
+{
+    struct endstop *e = oid_lookup(args[0], command_config_endstop);
+    e->irq.func = endstop_irq_event;
+    gpio_irq_setup(&e->irq, args[1]);
+    e->flags = ESF_IRQ;
+}
+DECL_COMMAND(command_config_endstop_irq, "config_endstop_irq oid=%c pin=%c");
+#endif
+
 // Home an axis
 void
 command_endstop_home(uint32_t *args)
 {
     struct endstop *e = oid_lookup(args[0], command_config_endstop);
+    uint8_t irq_flag = CONFIG_WANT_ENDSTOP_IRQ ? e->flags & ESF_IRQ : 0;
+    irq_disable();
+    endstop_irq_cancel(e);
     sched_del_timer(&e->time);
+    irq_enable();
     e->time.waketime = args[1];
     e->sample_time = args[2];
     e->sample_count = args[3];
     if (!e->sample_count) {
         // Disable end stop checking
         e->ts = NULL;
-        e->flags = 0;
+        e->flags = irq_flag;
         return;
     }
     e->rest_time = args[4];
-    e->time.func = endstop_event;
+    e->time.func = irq_flag ? endstop_irq_arm_event : endstop_event;
     e->trigger_count = e->sample_count;
-    e->flags = ESF_HOMING | (args[5] ? ESF_PIN_HIGH : 0);
+    e->flags = irq_flag | ESF_HOMING | (args[5] ? ESF_PIN_HIGH : 0);
     e->ts = trsync_oid_lookup(args[6]);
     e->trigger_reason = args[7];
     sched_add_timer(&e->time);
@@ -113,3 +201,16 @@ command_endstop_query_state(uint32_t *args)
           , oid, !!(eflags & ESF_HOMING), nextwake, gpio_in_read(e->pin));
 }
 DECL_COMMAND(command_endstop_query_state, "endstop_query_state oid=%c");
+
+#if CONFIG_WANT_ENDSTOP_IRQ
+void
+endstop_shutdown(void)
+{
+    uint8_t i;
+    struct endstop *e;
+    foreach_oid(i, e, command_config_endstop) {
+        endstop_irq_cancel(e);
+    }
+}
+DECL_SHUTDOWN(endstop_shutdown);
+#endif
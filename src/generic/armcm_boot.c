@@ -17,6 +17,9 @@ DECL_CONSTANT_STR("MCU", CONFIG_MCU);
 extern uint32_t _data_start, _data_end, _data_flash;
 extern uint32_t _bss_start, _bss_end, _stack_start;
 extern uint32_t _stack_end;
+#if CONFIG_WANT_HOT_RAM && CONFIG_ARMCM_ITCM_SIZE
+extern uint32_t _itcm_start, _itcm_end, _itcm_flash;
+#endif
 
 /****************************************************************
  * Basic interrupt handlers
@@ -90,6 +93,11 @@ reset_handler_stage_two(void)
     // Copy global variables from flash to ram
     uint32_t count = (&_data_end - &_data_start) * 4;
     boot_memcpy(&_data_start, &_data_flash, count);
+#if CONFIG_WANT_HOT_RAM && CONFIG_ARMCM_ITCM_SIZE
+    // Copy time critical code from flash to itcm
+    count = (&_itcm_end - &_itcm_start) * 4;
+    boot_memcpy(&_itcm_start, &_itcm_flash, count);
+#endif
 
     // Clear the bss segment
     boot_memset(&_bss_start, 0, (&_bss_end - &_bss_start) * 4);
@@ -2,20 +2,45 @@
 #define __CANBUS_H__
 
 #include <stdint.h> // uint32_t
+#include "autoconf.h" // CONFIG_CANBUS_FD
+
+#if CONFIG_CANBUS_FD
+#define CANMSG_MAX_DATA 64
+#else
+#define CANMSG_MAX_DATA 8
+#endif
 
 struct canbus_msg {
     uint32_t id;
     uint32_t dlc;
     union {
-        uint8_t data[8];
-        uint32_t data32[2];
+        uint8_t data[CANMSG_MAX_DATA];
+        uint32_t data32[CANMSG_MAX_DATA / 4];
     };
 };
 
 #define CANMSG_ID_RTR (1<<30)
 #define CANMSG_ID_EFF (1<<31)
 
+// CAN-FD frame (sent with bit rate switching) - stored in 'dlc' field
+#define CANMSG_DLC_FD (1<<8)
+
+#if CONFIG_CANBUS_FD
+static inline uint32_t
+canbus_dlc_to_len(uint32_t dlc)
+{
+    static const uint8_t fd_lens[] = { 12, 16, 20, 24, 32, 48, 64 };
+    dlc &= 0x0f;
+    if (dlc <= 8)
+        return dlc;
+    return fd_lens[dlc - 9];
+}
+#define CANMSG_DATA_LEN(msg) ((msg)->dlc & CANMSG_DLC_FD               \
+                              ? canbus_dlc_to_len((msg)->dlc)           \
+                              : ((msg)->dlc > 8 ? 8 : (msg)->dlc))
+#else
 #define CANMSG_DATA_LEN(msg) ((msg)->dlc > 8 ? 8 : (msg)->dlc)
+#endif
 
 struct canbus_status {
     uint32_t rx_error, tx_error, tx_retries;
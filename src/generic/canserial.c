@@ -23,6 +23,7 @@
 static struct canbus_data {
     uint32_t assigned_id;
     uint8_t uuid[CANBUS_UUID_LEN];
+    uint8_t use_fd;
 
     // Tx data
     struct task_wake tx_wake;
@@ -50,6 +51,28 @@ canserial_notify_tx(void)
     sched_wake_task(&CanData.tx_wake);
 }
 
+#if CONFIG_CANBUS_FD
+DECL_CONSTANT("CANBUS_FD", 1);
+#endif
+
+// Determine the largest frame (and its dlc code) for the given data
+static int
+canserial_frame_len(int avail, uint32_t *dlc)
+{
+    if (avail <= 8 || !CONFIG_CANBUS_FD || !CanData.use_fd) {
+        int len = avail > 8 ? 8 : avail;
+        *dlc = len;
+        return len;
+    }
+    // CAN-FD frames can only hold certain data lengths
+    static const uint8_t fd_lens[] = { 8, 12, 16, 20, 24, 32, 48, 64 };
+    int i = ARRAY_SIZE(fd_lens) - 1;
+    while (avail < fd_lens[i])
+        i--;
+    *dlc = 8 + i;
+    return fd_lens[i];
+}
+
 void
 canserial_tx_task(void)
 {
@@ -64,10 +87,12 @@ canserial_tx_task(void)
     msg.id = id + 1;
     uint32_t tpos = CanData.transmit_pos, tmax = CanData.transmit_max;
     for (;;) {
-        int avail = tmax - tpos, now = avail > 8 ? 8 : avail;
+        int avail = tmax - tpos;
         if (avail <= 0)
             break;
-        msg.dlc = now;
+        int now = canserial_frame_len(avail, &msg.dlc);
+        if (CONFIG_CANBUS_FD && CanData.use_fd)
+            msg.dlc |= CANMSG_DLC_FD;
         memcpy(msg.data, &CanData.transmit_buf[tpos], now);
         int ret = canbus_send(&msg);
         if (ret <= 0)
@@ -178,6 +203,8 @@ can_process_set_klipper_nodeid(struct canbus_msg *msg)
             CanData.assigned_id = newid;
             canbus_set_filter(CanData.assigned_id);
         }
+        // Use classic frames until the host sends a CAN-FD frame
+        CanData.use_fd = 0;
     } else if (newid == CanData.assigned_id) {
         can_id_conflict();
     }
@@ -236,6 +263,8 @@ canserial_process_data(struct canbus_msg *msg)
             return;
         memcpy(&CanData.receive_buf[rpos], msg->data, len);
         CanData.receive_pos = rpos + len;
+        if (CONFIG_CANBUS_FD && msg->dlc & CANMSG_DLC_FD)
+            CanData.use_fd = 1;
         canserial_notify_rx();
     } else if (id == CANBUS_ID_ADMIN
                || (CanData.assigned_id && id == CanData.assigned_id + 1)) {
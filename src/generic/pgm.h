@@ -3,6 +3,9 @@
 // This header provides wrappers for the AVR specific "PROGMEM"
 // declarations on non-avr platforms.
 
+#include "autoconf.h" // CONFIG_WANT_HOT_RAM
+#include "compiler.h" // __section
+
 #define NEED_PROGMEM 0
 #define PROGMEM
 #define PSTR(S) S
@@ -11,4 +14,15 @@
 #define strcasecmp_P(S1, S2) strcasecmp(S1, S2)
 #define memcpy_P(DST, SRC, SIZE) memcpy((DST), (SRC), (SIZE))
 
+// Optionally place time critical code and data in ram (a __hotfunc
+// may still be inlined into its callers)
+#if CONFIG_WANT_HOT_RAM
+#define HOTSEC(S) S "." __FILE__ "." __stringify(__LINE__)
+#define __hotfunc __section(HOTSEC(".hotfunc"))
+#define __hotdata __section(HOTSEC(".hotdata"))
+#else
+#define __hotfunc
+#define __hotdata
+#endif
+
 #endif // pgm.h
@@ -44,6 +44,21 @@ serial_get_tx_byte(uint8_t *pdata)
     return 0;
 }
 
+// Tx dma - copy up to 'max' pending bytes to 'buf' (returns the count)
+uint_fast8_t
+serial_get_tx_block(uint8_t *buf, uint_fast8_t max)
+{
+    uint_fast8_t tpos = transmit_pos, tmax = transmit_max;
+    if (tpos >= tmax)
+        return 0;
+    uint_fast8_t len = tmax - tpos;
+    if (len > max)
+        len = max;
+    memcpy(buf, &transmit_buf[tpos], len);
+    transmit_pos = tpos + len;
+    return len;
+}
+
 // Remove from the receive buffer the given number of bytes
 static void
 console_pop_input(uint_fast8_t len)
@@ -9,5 +9,6 @@ void serial_enable_tx_irq(void);
 // serial_irq.c
 void serial_rx_byte(uint_fast8_t data);
 int serial_get_tx_byte(uint8_t *pdata);
+uint_fast8_t serial_get_tx_block(uint8_t *buf, uint_fast8_t max);
 
 #endif // serial_irq.h
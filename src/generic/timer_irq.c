@@ -7,6 +7,7 @@
 #include "autoconf.h" // CONFIG_CLOCK_FREQ
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_from_us
+#include "board/pgm.h" // __hotfunc
 #include "board/timer_irq.h" // timer_dispatch_many
 #include "command.h" // shutdown
 #include "sched.h" // sched_timer_dispatch
@@ -37,21 +38,23 @@ static uint32_t timer_repeat_until;
 #define TIMER_DEFER_REPEAT_TICKS timer_from_us(5)
 
 // Invoke timers - called from board irq code.
-uint32_t
+uint32_t __hotfunc
 timer_dispatch_many(void)
 {
     uint32_t tru = timer_repeat_until;
+    // Run the next software timer
+    uint32_t next = sched_timer_dispatch();
+    uint32_t now = timer_read_time();
+    int32_t diff = next - now;
     for (;;) {
-        // Run the next software timer
-        uint32_t next = sched_timer_dispatch();
-
-        uint32_t now = timer_read_time();
-        int32_t diff = next - now;
         if (diff > (int32_t)TIMER_MIN_TRY_TICKS)
             // Schedule next timer normally.
             return next;
 
         if (unlikely(timer_is_before(tru, now))) {
+            // 'now' may be stale - refresh it before checking for overload
+            now = timer_read_time();
+            diff = next - now;
             // Check if there are too many repeat timers
             if (diff < (int32_t)(-timer_from_us(1000)))
                 try_shutdown("Rescheduled timer in the past");
@@ -63,10 +66,22 @@ timer_dispatch_many(void)
         }
 
         // Next timer in the past or near future - wait for it to be ready
+        if (unlikely(diff > 0))
+            now = next;
         irq_enable();
         while (unlikely(diff > 0))
             diff = next - timer_read_time();
         irq_disable();
+
+        // Run the next software timer
+        next = sched_timer_dispatch();
+        diff = next - now;
+        if (diff > 0) {
+            // Only read the hardware timer if 'next' isn't already known
+            // to be due (the timer is at or after 'now')
+            now = timer_read_time();
+            diff = next - now;
+        }
     }
 }
 
@@ -122,6 +122,10 @@ static struct usbcan_data {
     // Data from physical canbus interface
     uint32_t canhw_pull_pos, canhw_push_pos;
     struct canbus_msg canhw_queue[32];
+
+    // Frame counters (reported via get_usb_canbus_stats)
+    uint32_t host_to_bus_count, host_discard_count;
+    uint32_t bus_to_host_count, bus_drop_count;
 } UsbCan;
 
 enum {
@@ -167,6 +171,7 @@ drain_canhw_queue(void)
             return;
         }
         UsbCan.canhw_pull_pos = pull_pos = pull_pos + 1;
+        UsbCan.bus_to_host_count++;
     }
 }
 
@@ -212,6 +217,7 @@ try_canmsg_send(struct canbus_msg *msg)
     int ret = canhw_send(msg);
     if (ret >= 0) {
         // Success
+        UsbCan.host_to_bus_count++;
         if (UsbCan.bus_send_state == BSS_DISCARDING)
             note_discard_state(0);
         UsbCan.bus_send_state = BSS_READY;
@@ -224,9 +230,11 @@ try_canmsg_send(struct canbus_msg *msg)
         note_discard_state(1);
         UsbCan.bus_send_state = BSS_DISCARDING;
     }
-    if (UsbCan.bus_send_state == BSS_DISCARDING)
+    if (UsbCan.bus_send_state == BSS_DISCARDING) {
         // Queue is stalled - just discard the message
+        UsbCan.host_discard_count++;
         return 0;
+    }
     if (UsbCan.bus_send_state == BSS_READY) {
         // Just starting to block - setup stall detection after 50ms
         UsbCan.bus_send_state = BSS_BLOCKING;
@@ -314,6 +322,17 @@ usbcan_task(void)
 }
 DECL_TASK(usbcan_task);
 
+void
+command_get_usb_canbus_stats(uint32_t *args)
+{
+    sendf("usb_canbus_stats host_to_bus=%u host_discard=%u bus_to_host=%u"
+          " bus_drop=%u"
+          , UsbCan.host_to_bus_count, UsbCan.host_discard_count
+          , readl(&UsbCan.bus_to_host_count), readl(&UsbCan.bus_drop_count));
+}
+DECL_COMMAND_FLAGS(command_get_usb_canbus_stats, HF_IN_SHUTDOWN
+                   , "get_usb_canbus_stats");
+
 // Helper function to wake usbcan_task()
 static void
 wake_usbcan_task(void)
@@ -338,9 +357,11 @@ canbus_process_data(struct canbus_msg *msg)
 {
     // Add to admin command queue
     uint32_t pushp = UsbCan.canhw_push_pos;
-    if (pushp - UsbCan.canhw_pull_pos >= ARRAY_SIZE(UsbCan.canhw_queue))
+    if (pushp - UsbCan.canhw_pull_pos >= ARRAY_SIZE(UsbCan.canhw_queue)) {
         // No space - drop message
+        UsbCan.bus_drop_count++;
         return;
+    }
     if (UsbCan.assigned_id && (msg->id & ~1) == UsbCan.assigned_id)
         // Id reserved for local
         return;
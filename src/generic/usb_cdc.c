@@ -31,7 +31,11 @@
  ****************************************************************/
 
 static struct task_wake usb_bulk_in_wake;
-static uint8_t transmit_buf[192], transmit_pos;
+
+// Responses are encoded into one buffer while the other buffer is
+// being transmitted (which avoids moving data after each packet)
+static uint8_t transmit_buf[2][96], transmit_pos[2];
+static uint8_t transmit_fill, transmit_sent;
 
 void
 usb_notify_bulk_in(void)
@@ -44,22 +48,30 @@ usb_bulk_in_task(void)
 {
     if (!sched_check_wake(&usb_bulk_in_wake))
         return;
-    uint_fast8_t tpos = transmit_pos, max_tpos = tpos;
-    if (!tpos)
-        return;
+    uint_fast8_t sbuf = transmit_fill ^ 1, spos = transmit_sent;
+    uint_fast8_t tpos = transmit_pos[sbuf];
+    if (spos >= tpos) {
+        // Transmit buffer is empty - swap with the fill buffer
+        uint_fast8_t fbuf = sbuf ^ 1;
+        tpos = transmit_pos[fbuf];
+        if (!tpos)
+            return;
+        transmit_pos[sbuf] = 0;
+        transmit_fill = sbuf;
+        sbuf = fbuf;
+        spos = 0;
+    }
+    uint_fast8_t max_tpos = tpos - spos;
     if (max_tpos > USB_CDC_EP_BULK_IN_SIZE)
         max_tpos = USB_CDC_EP_BULK_IN_SIZE;
     else if (max_tpos == USB_CDC_EP_BULK_IN_SIZE)
         max_tpos = USB_CDC_EP_BULK_IN_SIZE-1; // Avoid zero-length-packets
-    int_fast8_t ret = usb_send_bulk_in(transmit_buf, max_tpos);
-    if (ret <= 0)
-        return;
-    uint_fast8_t needcopy = tpos - ret;
-    if (needcopy) {
-        memmove(transmit_buf, &transmit_buf[ret], needcopy);
+    int_fast8_t ret = usb_send_bulk_in(&transmit_buf[sbuf][spos], max_tpos);
+    if (ret > 0)
+        spos += ret;
+    transmit_sent = spos;
+    if (ret > 0 && (spos < tpos || transmit_pos[sbuf ^ 1]))
         usb_notify_bulk_in();
-    }
-    transmit_pos = needcopy;
 }
 DECL_TASK(usb_bulk_in_task);
 
@@ -68,17 +80,18 @@ void
 console_sendf(const struct command_encoder *ce, va_list args)
 {
     // Verify space for message
-    uint_fast8_t tpos = transmit_pos, max_size = READP(ce->max_size);
-    if (tpos + max_size > sizeof(transmit_buf))
+    uint_fast8_t fbuf = transmit_fill, tpos = transmit_pos[fbuf];
+    uint_fast8_t max_size = READP(ce->max_size);
+    if (tpos + max_size > sizeof(transmit_buf[0]))
         // Not enough space for message
         return;
 
     // Generate message
-    uint8_t *buf = &transmit_buf[tpos];
+    uint8_t *buf = &transmit_buf[fbuf][tpos];
     uint_fast8_t msglen = command_encode_and_frame(buf, ce, args);
 
     // Start message transmit
-    transmit_pos = tpos + msglen;
+    transmit_pos[fbuf] = tpos + msglen;
     usb_notify_bulk_in();
 }
 
@@ -88,7 +101,10 @@ console_sendf(const struct command_encoder *ce, va_list args)
  ****************************************************************/
 
 static struct task_wake usb_bulk_out_wake;
-static uint8_t receive_buf[128], receive_pos;
+
+// Message blocks are parsed in place - data is only moved to the
+// start of the buffer when there is no room for another packet
+static uint8_t receive_buf[128], receive_pos, receive_start;
 
 void
 usb_notify_bulk_out(void)
@@ -101,8 +117,14 @@ usb_bulk_out_task(void)
 {
     if (!sched_check_wake(&usb_bulk_out_wake))
         return;
+    uint_fast8_t rstart = receive_start, rpos = receive_pos, pop_count;
+    if (rpos + USB_CDC_EP_BULK_OUT_SIZE > sizeof(receive_buf) && rstart) {
+        // Make room for another packet
+        rpos -= rstart;
+        memmove(receive_buf, &receive_buf[rstart], rpos);
+        rstart = 0;
+    }
     // Read data
-    uint_fast8_t rpos = receive_pos, pop_count;
     if (rpos + USB_CDC_EP_BULK_OUT_SIZE <= sizeof(receive_buf)) {
         int_fast8_t ret = usb_read_bulk_out(
             &receive_buf[rpos], USB_CDC_EP_BULK_OUT_SIZE);
@@ -114,16 +136,16 @@ usb_bulk_out_task(void)
         usb_notify_bulk_out();
     }
     // Process a message block
-    int_fast8_t ret = command_find_and_dispatch(receive_buf, rpos, &pop_count);
+    int_fast8_t ret = command_find_and_dispatch(
+        &receive_buf[rstart], rpos - rstart, &pop_count);
     if (ret) {
-        // Move buffer
-        uint_fast8_t needcopy = rpos - pop_count;
-        if (needcopy) {
-            memmove(receive_buf, &receive_buf[pop_count], needcopy);
+        rstart += pop_count;
+        if (rstart >= rpos)
+            rstart = rpos = 0;
+        else
             usb_notify_bulk_out();
-        }
-        rpos = needcopy;
     }
+    receive_start = rstart;
     receive_pos = rpos;
 }
 DECL_TASK(usb_bulk_out_task);
@@ -4,6 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_WANT_OUTPUT_QUEUE_MULTI
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // struct gpio_out
 #include "board/irq.h" // irq_disable
@@ -65,7 +66,7 @@ digital_load_event(struct timer *timer)
     uint32_t on_duration = m->on_duration;
     uint8_t flags = on_duration ? DF_ON : 0;
     gpio_out_write(d->pin, flags);
-    move_free(m);
+    move_free(&d->mq, m);
 
     // Calculate next end_time and flags
     uint32_t end_time = 0;
@@ -122,7 +123,7 @@ command_config_digital_out(uint32_t *args)
     d->pin = pin;
     d->flags = (args[2] ? DF_ON : 0) | (args[3] ? DF_DEFAULT_ON : 0);
     d->max_duration = args[4];
-    move_queue_setup(&d->mq, sizeof(struct digital_move));
+    move_queue_setup(args[0], &d->mq, sizeof(struct digital_move));
 }
 DECL_COMMAND(command_config_digital_out,
              "config_digital_out oid=%c pin=%u value=%c"
@@ -141,13 +142,13 @@ command_set_digital_out_pwm_cycle(uint32_t *args)
 DECL_COMMAND(command_set_digital_out_pwm_cycle,
              "set_digital_out_pwm_cycle oid=%c cycle_ticks=%u");
 
-void
-command_queue_digital_out(uint32_t *args)
+// Queue an update of a digital_out pin at the given time
+static void
+digital_out_queue(struct digital_out_s *d, uint32_t time, uint32_t on_duration)
 {
-    struct digital_out_s *d = oid_lookup(args[0], command_config_digital_out);
-    struct digital_move *m = move_alloc();
-    uint32_t time = m->waketime = args[1];
-    m->on_duration = args[2];
+    struct digital_move *m = move_alloc(&d->mq);
+    m->waketime = time;
+    m->on_duration = on_duration;
 
     irq_disable();
     int first_on_queue = move_queue_push(&m->node, &d->mq);
@@ -171,9 +172,56 @@ command_queue_digital_out(uint32_t *args)
     }
     irq_enable();
 }
+
+void
+command_queue_digital_out(uint32_t *args)
+{
+    struct digital_out_s *d = oid_lookup(args[0], command_config_digital_out);
+    digital_out_queue(d, args[1], args[2]);
+}
 DECL_COMMAND(command_queue_digital_out,
              "queue_digital_out oid=%c clock=%u on_ticks=%u");
 
+#if CONFIG_WANT_OUTPUT_QUEUE_MULTI
+// Schedule several updates of a pin in a single command.  Each update
+// is encoded as the vlq integers "clock delta" (from the previous
+// update, or from 'clock' for the first update) and "on_ticks".
+void
+command_queue_digital_out_multi(uint32_t *args)
+{
+    struct digital_out_s *d = oid_lookup(args[0], command_config_digital_out);
+    uint32_t time = args[1];
+    uint8_t *data = command_decode_ptr(args[3]), *end = &data[args[2]];
+    while (data < end) {
+        time += command_parse_int(&data);
+        uint32_t on_duration = command_parse_int(&data);
+        if (data > end)
+            shutdown("Invalid queue_digital_out_multi data");
+        digital_out_queue(d, time, on_duration);
+    }
+}
+DECL_COMMAND(command_queue_digital_out_multi,
+             "queue_digital_out_multi oid=%c clock=%u data=%*s");
+#endif
+
+// Update several pins at the same time (data is a list of oid, on_ticks
+// byte pairs)
+void
+command_queue_digital_out_group(uint32_t *args)
+{
+    uint32_t time = args[0];
+    uint8_t data_len = args[1], *data = command_decode_ptr(args[2]);
+    if (data_len & 1)
+        shutdown("Invalid queue_digital_out_group data");
+    for (; data_len; data_len -= 2, data += 2) {
+        struct digital_out_s *d = oid_lookup(data[0]
+                                             , command_config_digital_out);
+        digital_out_queue(d, time, data[1]);
+    }
+}
+DECL_COMMAND(command_queue_digital_out_group,
+             "queue_digital_out_group clock=%u data=%*s");
+
 void
 command_update_digital_out(uint32_t *args)
 {
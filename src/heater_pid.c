@@ -0,0 +1,244 @@
+// Micro-controller based heater temperature control
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// The temperature of a heater is calculated from its analog_in
+// reports (using a piecewise linear table provided by the host) and
+// a PID loop then sets the duty cycle of a software pwm output.  All
+// temperatures are in 1/256th of a degree and power levels are in
+// 1/65536th units.  The host must refresh its request regularly (via
+// heater_pid_set_target or heater_pid_set_pwm) or the mcu will shutdown
+// if the heater is still enabled.
+
+#include "adccmds.h" // analog_in_add_signal
+#include "basecmd.h" // oid_alloc
+#include "board/gpio.h" // gpio_out_write
+#include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // sched_add_timer
+
+struct heater_pid_point {
+    uint16_t adc;
+    int32_t temp;
+};
+
+struct heater_pid {
+    struct timer timer;
+    struct gpio_out pin;
+    struct analog_in_signal signal;
+    uint32_t cycle_time, cycle_start, on_duration, max_duration, end_time;
+    int32_t target, kp, ki, kd, integ, integ_max, prev_temp, deriv;
+    uint32_t deriv_scale;
+    uint16_t deriv_keep, max_power;
+    uint8_t oid, invert, flags, table_size;
+    struct heater_pid_point table[];
+};
+
+enum {
+    HP_ACTIVE=1<<0, HP_TOGGLE_OFF=1<<1, HP_DIRECT=1<<2, HP_HAVE_TEMP=1<<3,
+};
+
+// Software pwm event
+static uint_fast8_t
+heater_pid_event(struct timer *timer)
+{
+    struct heater_pid *hp = container_of(timer, struct heater_pid, timer);
+    uint32_t waketime = hp->timer.waketime;
+    if (hp->flags & HP_TOGGLE_OFF) {
+        // End of "on" portion of cycle
+        gpio_out_write(hp->pin, hp->invert);
+        hp->flags &= ~HP_TOGGLE_OFF;
+        hp->timer.waketime = hp->cycle_start + hp->cycle_time;
+        return SF_RESCHEDULE;
+    }
+    // Start of a new cycle
+    uint32_t on_duration = hp->on_duration;
+    if (on_duration && hp->max_duration
+        && !timer_is_before(waketime, hp->end_time))
+        shutdown("Missed scheduling of next heater_pid update");
+    gpio_out_write(hp->pin, !!on_duration ^ hp->invert);
+    hp->cycle_start = waketime;
+    if (on_duration && on_duration < hp->cycle_time) {
+        hp->flags |= HP_TOGGLE_OFF;
+        waketime += on_duration;
+    } else {
+        waketime += hp->cycle_time;
+    }
+    hp->timer.waketime = waketime;
+    return SF_RESCHEDULE;
+}
+
+// Set the output power level (and report it to the host)
+static void
+heater_pid_set_power(struct heater_pid *hp, uint16_t power)
+{
+    uint32_t on_duration = ((uint64_t)power * hp->cycle_time) >> 16;
+    if (power == 0xffff)
+        on_duration = hp->cycle_time;
+    irq_disable();
+    hp->on_duration = on_duration;
+    irq_enable();
+    sendf("heater_pid_state oid=%c pwm=%hu", hp->oid, power);
+}
+
+// Convert a raw adc value to a temperature
+static int32_t
+heater_pid_calc_temp(struct heater_pid *hp, uint16_t value)
+{
+    struct heater_pid_point *p = hp->table;
+    uint_fast8_t i, count = hp->table_size;
+    if (value <= p[0].adc)
+        return p[0].temp;
+    for (i=1; i<count; i++)
+        if (value < p[i].adc)
+            break;
+    if (i >= count)
+        return p[count-1].temp;
+    // Host keeps table entries close enough that this can't overflow
+    struct heater_pid_point *lo = &p[i-1], *hi = &p[i];
+    return lo->temp + ((hi->temp - lo->temp) * (int32_t)(value - lo->adc)
+                       / (int32_t)(hi->adc - lo->adc));
+}
+
+// Run the PID loop on a new adc report (called from analog_in task)
+static void
+heater_pid_signal(struct analog_in_signal *ais, uint16_t value)
+{
+    struct heater_pid *hp = container_of(ais, struct heater_pid, signal);
+    int32_t temp = heater_pid_calc_temp(hp, value);
+    if (!(hp->flags & HP_HAVE_TEMP)) {
+        hp->prev_temp = temp;
+        hp->flags |= HP_HAVE_TEMP;
+    }
+    // Calculate change of temperature
+    int32_t temp_diff = temp - hp->prev_temp;
+    int32_t deriv = ((int64_t)hp->deriv * hp->deriv_keep
+                     + (int64_t)temp_diff * hp->deriv_scale) >> 16;
+    // Calculate accumulated temperature "error"
+    int32_t err = hp->target - temp;
+    int32_t integ = hp->integ + err;
+    if (integ < 0)
+        integ = 0;
+    else if (integ > hp->integ_max)
+        integ = hp->integ_max;
+    // Calculate output
+    int64_t co = ((int64_t)hp->kp * err + (int64_t)hp->ki * integ
+                  - (int64_t)hp->kd * deriv) >> 8;
+    int64_t bounded_co = co < 0 ? 0 : co;
+    if (bounded_co > hp->max_power)
+        bounded_co = hp->max_power;
+    // Store state for next measurement
+    hp->prev_temp = temp;
+    hp->deriv = deriv;
+    if (co == bounded_co)
+        hp->integ = integ;
+    if (hp->flags & HP_DIRECT || !(hp->flags & HP_ACTIVE))
+        return;
+    heater_pid_set_power(hp, hp->target > 0 ? bounded_co : 0);
+}
+
+void
+command_config_heater_pid(uint32_t *args)
+{
+    uint8_t table_size = args[6];
+    if (table_size < 2)
+        shutdown("Invalid heater_pid table size");
+    struct heater_pid *hp = oid_alloc(
+        args[0], command_config_heater_pid
+        , sizeof(*hp) + table_size * sizeof(hp->table[0]));
+    hp->oid = args[0];
+    hp->table_size = table_size;
+    hp->invert = args[3] ? 1 : 0;
+    hp->pin = gpio_out_setup(args[2], hp->invert);
+    hp->cycle_time = args[4];
+    hp->max_duration = args[5];
+    hp->timer.func = heater_pid_event;
+    struct analog_in *a = analog_in_oid_lookup(args[1]);
+    analog_in_add_signal(a, &hp->signal, heater_pid_signal);
+}
+DECL_COMMAND(command_config_heater_pid,
+             "config_heater_pid oid=%c adc_oid=%c pin=%u invert=%c"
+             " cycle_ticks=%u max_duration=%u table_size=%c");
+
+void
+command_heater_pid_set_table(uint32_t *args)
+{
+    struct heater_pid *hp = oid_lookup(args[0], command_config_heater_pid);
+    uint8_t index = args[1];
+    if (index >= hp->table_size)
+        shutdown("Invalid heater_pid table index");
+    hp->table[index].adc = args[2];
+    hp->table[index].temp = args[3];
+}
+DECL_COMMAND(command_heater_pid_set_table,
+             "heater_pid_set_table oid=%c index=%c adc=%hu temp=%i");
+
+void
+command_heater_pid_set_gains(uint32_t *args)
+{
+    struct heater_pid *hp = oid_lookup(args[0], command_config_heater_pid);
+    hp->kp = args[1];
+    hp->ki = args[2];
+    hp->kd = args[3];
+    hp->integ_max = args[4];
+    hp->deriv_keep = args[5];
+    hp->deriv_scale = args[6];
+    hp->max_power = args[7];
+    hp->integ = 0;
+}
+DECL_COMMAND(command_heater_pid_set_gains,
+             "heater_pid_set_gains oid=%c kp=%i ki=%i kd=%i integ_max=%i"
+             " deriv_keep=%hu deriv_scale=%u max_power=%hu");
+
+// Note a host request and start the output timer if needed
+static void
+heater_pid_refresh(struct heater_pid *hp)
+{
+    irq_disable();
+    hp->end_time = timer_read_time() + hp->max_duration;
+    irq_enable();
+    if (hp->flags & HP_ACTIVE)
+        return;
+    hp->flags |= HP_ACTIVE;
+    hp->timer.waketime = timer_read_time() + timer_from_us(1000);
+    sched_add_timer(&hp->timer);
+}
+
+void
+command_heater_pid_set_target(uint32_t *args)
+{
+    struct heater_pid *hp = oid_lookup(args[0], command_config_heater_pid);
+    hp->target = args[1];
+    hp->flags &= ~HP_DIRECT;
+    heater_pid_refresh(hp);
+    if (hp->target <= 0)
+        heater_pid_set_power(hp, 0);
+}
+DECL_COMMAND(command_heater_pid_set_target,
+             "heater_pid_set_target oid=%c target=%i");
+
+void
+command_heater_pid_set_pwm(uint32_t *args)
+{
+    struct heater_pid *hp = oid_lookup(args[0], command_config_heater_pid);
+    hp->flags |= HP_DIRECT;
+    heater_pid_refresh(hp);
+    heater_pid_set_power(hp, args[1]);
+}
+DECL_COMMAND(command_heater_pid_set_pwm, "heater_pid_set_pwm oid=%c value=%hu");
+
+void
+heater_pid_shutdown(void)
+{
+    uint8_t i;
+    struct heater_pid *hp;
+    foreach_oid(i, hp, command_config_heater_pid) {
+        gpio_out_write(hp->pin, hp->invert);
+        hp->on_duration = 0;
+        hp->flags = 0;
+    }
+}
+DECL_SHUTDOWN(heater_pid_shutdown);
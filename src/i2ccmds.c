@@ -93,6 +93,58 @@ int i2c_dev_read(struct i2cdev_s *i2c, uint8_t reg_len, uint8_t *reg
         return i2c_read(i2c->i2c_hw, reg_len, reg, read_len, read);
 }
 
+// Queue a transaction that completes in the background (using the
+// i2c interrupts where the hardware supports it).  The callback is
+// invoked, possibly from irq context, once the transaction completes.
+// The callback must not queue further requests.
+static void
+i2c_dev_queue(struct i2cdev_s *i2c, struct i2c_request *req)
+{
+    uint_fast8_t flags = i2c->flags;
+    if (CONFIG_HAVE_GPIO_I2C_ASYNC && flags & IF_HARDWARE) {
+        req->config = i2c->i2c_hw;
+        i2c_queue_request(req);
+        return;
+    }
+    int ret;
+    if (req->read_len)
+        ret = i2c_dev_read(i2c, req->write_len, req->write
+                           , req->read_len, req->read);
+    else
+        ret = i2c_dev_write(i2c, req->write_len, req->write);
+    req->func(req, ret);
+}
+
+void
+i2c_dev_read_async(struct i2cdev_s *i2c, struct i2c_request *req
+                   , uint8_t reg_len, uint8_t *reg
+                   , uint8_t read_len, uint8_t *read)
+{
+    req->write = reg;
+    req->write_len = reg_len;
+    req->read = read;
+    req->read_len = read_len;
+    i2c_dev_queue(i2c, req);
+}
+
+void
+i2c_dev_write_async(struct i2cdev_s *i2c, struct i2c_request *req
+                    , uint8_t write_len, uint8_t *data)
+{
+    req->write = data;
+    req->write_len = write_len;
+    req->read_len = 0;
+    i2c_dev_queue(i2c, req);
+}
+
+// Wait for all queued transactions on the device's bus to complete
+void
+i2c_dev_wait(struct i2cdev_s *i2c)
+{
+    if (CONFIG_HAVE_GPIO_I2C_ASYNC && i2c->flags & IF_HARDWARE)
+        i2c_queue_wait(i2c->i2c_hw);
+}
+
 void command_i2c_read(uint32_t *args)
 {
     uint8_t oid = args[0];
@@ -28,4 +28,22 @@ int i2c_dev_read(struct i2cdev_s *i2c, uint8_t reg_len, uint8_t *reg
 int i2c_dev_write(struct i2cdev_s *i2c, uint8_t write_len, uint8_t *data);
 void i2c_shutdown_on_err(int ret);
 
+struct i2c_request {
+    struct i2c_request *next;
+    void (*func)(struct i2c_request *req, int ret);
+    struct i2c_config config;
+    uint8_t *write, *read;
+    uint8_t write_len, read_len;
+};
+// Provided by the board code on chips with HAVE_GPIO_I2C_ASYNC
+void i2c_queue_request(struct i2c_request *req);
+void i2c_queue_wait(struct i2c_config config);
+
+void i2c_dev_read_async(struct i2cdev_s *i2c, struct i2c_request *req
+                        , uint8_t reg_len, uint8_t *reg
+                        , uint8_t read_len, uint8_t *read);
+void i2c_dev_write_async(struct i2cdev_s *i2c, struct i2c_request *req
+                         , uint8_t write_len, uint8_t *data);
+void i2c_dev_wait(struct i2cdev_s *i2c);
+
 #endif
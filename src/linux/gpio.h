@@ -35,6 +35,8 @@ struct spi_config spi_setup(uint32_t bus, uint8_t mode, uint32_t rate);
 void spi_prepare(struct spi_config config);
 void spi_transfer(struct spi_config config, uint8_t receive_data
                   , uint8_t len, uint8_t *data);
+void spi_transfer_batch(struct spi_config config, uint8_t count
+                        , uint8_t len, uint8_t *data);
 
 struct gpio_pwm {
     int duty_fd, enable_fd;
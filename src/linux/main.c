@@ -4,8 +4,10 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <sched.h> // sched_setscheduler sched_get_priority_max
+#define _GNU_SOURCE
+#include <sched.h> // sched_setscheduler sched_setaffinity
 #include <stdio.h> // fprintf
+#include <stdlib.h> // atoi
 #include <string.h> // memset
 #include <unistd.h> // getopt
 #include <sys/mman.h> // mlockall MCL_CURRENT MCL_FUTURE
@@ -21,12 +23,36 @@ DECL_CONSTANT_STR("MCU", "linux");
  * Real-time setup
  ****************************************************************/
 
+// Restrict the process to a single (ideally isolated) cpu
 static int
-realtime_setup(void)
+cpu_setup(int cpu)
+{
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    CPU_SET(cpu, &cs);
+    int ret = sched_setaffinity(0, sizeof(cs), &cs);
+    if (ret < 0) {
+        report_errno("sched_setaffinity", ret);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+realtime_setup(int priority)
 {
     struct sched_param sp;
     memset(&sp, 0, sizeof(sp));
-    sp.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2;
+    int prio_min = sched_get_priority_min(SCHED_FIFO);
+    int prio_max = sched_get_priority_max(SCHED_FIFO);
+    if (priority <= 0)
+        priority = prio_max / 2;
+    if (priority < prio_min || priority > prio_max) {
+        fprintf(stderr, "Invalid realtime priority %d (must be %d-%d)\n"
+                , priority, prio_min, prio_max);
+        return -1;
+    }
+    sp.sched_priority = priority;
     int ret = sched_setscheduler(0, SCHED_FIFO, &sp);
     if (ret < 0) {
         report_errno("sched_setscheduler", ret);
@@ -68,9 +94,9 @@ main(int argc, char **argv)
 {
     // Parse program args
     orig_argv = argv;
-    int opt, watchdog = 0, realtime = 0;
+    int opt, watchdog = 0, realtime = 0, priority = 0, cpu = -1;
     char *serial = "/tmp/klipper_host_mcu";
-    while ((opt = getopt(argc, argv, "wrI:")) != -1) {
+    while ((opt = getopt(argc, argv, "wrI:P:C:B:")) != -1) {
         switch (opt) {
         case 'w':
             watchdog = 1;
@@ -81,15 +107,31 @@ main(int argc, char **argv)
         case 'I':
             serial = optarg;
             break;
+        case 'P':
+            realtime = 1;
+            priority = atoi(optarg);
+            break;
+        case 'C':
+            cpu = atoi(optarg);
+            break;
+        case 'B':
+            timer_set_busy_poll(atoi(optarg));
+            break;
         default:
-            fprintf(stderr, "Usage: %s [-w] [-r] [-I path]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-w] [-r] [-P priority] [-C cpu]"
+                    " [-B usecs] [-I path]\n", argv[0]);
             return -1;
         }
     }
 
     // Initial setup
+    if (cpu >= 0) {
+        int ret = cpu_setup(cpu);
+        if (ret)
+            return ret;
+    }
     if (realtime) {
-        int ret = realtime_setup();
+        int ret = realtime_setup(priority);
         if (ret)
             return ret;
     }
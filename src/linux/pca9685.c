@@ -161,7 +161,7 @@ pca9685_event(struct timer *timer)
     struct pca9685_move *m = container_of(mn, struct pca9685_move, node);
     uint16_t value = m->value;
     pca9685_write(p->fd, p->channel, value);
-    move_free(m);
+    move_free(&p->mq, m);
 
     // Check if more updates queued
     if (move_queue_empty(&p->mq)) {
@@ -200,7 +200,7 @@ command_config_pca9685(uint32_t *args)
     p->default_value = default_value;
     p->max_duration = args[7];
     p->timer.func = pca9685_event;
-    move_queue_setup(&p->mq, sizeof(struct pca9685_move));
+    move_queue_setup(args[0], &p->mq, sizeof(struct pca9685_move));
 }
 DECL_COMMAND(command_config_pca9685, "config_pca9685 oid=%c bus=%c addr=%c"
              " channel=%c cycle_ticks=%u value=%hu"
@@ -210,7 +210,7 @@ void
 command_queue_pca9685_out(uint32_t *args)
 {
     struct i2cpwm_s *p = oid_lookup(args[0], command_config_pca9685);
-    struct pca9685_move *m = move_alloc();
+    struct pca9685_move *m = move_alloc(&p->mq);
     m->waketime = args[1];
     m->value = args[2];
     if (m->value > VALUE_MAX)
@@ -117,3 +117,34 @@ spi_transfer(struct spi_config config, uint8_t receive_data
         }
     }
 }
+
+#define SPI_BATCH_MAX 32
+
+// Perform several separate transfers (each 'len' bytes) in one ioctl
+void
+spi_transfer_batch(struct spi_config config, uint8_t count
+                   , uint8_t len, uint8_t *data)
+{
+    if (!len || !count)
+        return;
+    if (count > SPI_BATCH_MAX)
+        shutdown("Invalid spi batch count");
+
+    struct spi_ioc_transfer transfers[SPI_BATCH_MAX];
+    memset(transfers, 0, count * sizeof(transfers[0]));
+    int i;
+    for (i=0; i<count; i++) {
+        struct spi_ioc_transfer *t = &transfers[i];
+        t->tx_buf = t->rx_buf = (uintptr_t)&data[i * len];
+        t->len = len;
+        t->speed_hz = config.rate;
+        t->bits_per_word = 8;
+        // Release chip select between each transfer
+        t->cs_change = i + 1 < count;
+    }
+    int ret = ioctl(config.fd, SPI_IOC_MESSAGE(count), transfers);
+    if (ret < 0) {
+        report_errno("spi batch ioctl", ret);
+        try_shutdown("Unable to issue spi ioctl");
+    }
+}
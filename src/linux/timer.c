@@ -21,6 +21,8 @@ static struct {
     time_t start_sec;
     // Flags for tracking irq_enable()/irq_disable()
     uint32_t must_wake_timers;
+    // Timers closer than this are busy-waited on instead of signaled
+    uint32_t min_try_ticks;
     // Time of next software timer (also used to convert from ticks to systime)
     uint32_t next_wake_counter;
     struct timespec next_wake;
@@ -125,7 +127,19 @@ timer_kick(void)
 #define TIMER_IDLE_REPEAT_COUNT 100
 #define TIMER_REPEAT_COUNT 20
 
-#define TIMER_MIN_TRY_TICKS timer_from_us(2)
+#define TIMER_MIN_TRY_US 2
+#define TIMER_MAX_TRY_US 1000
+
+// Set the window (in microseconds) in which timers are busy-polled
+void
+timer_set_busy_poll(uint32_t us)
+{
+    if (us < TIMER_MIN_TRY_US)
+        us = TIMER_MIN_TRY_US;
+    else if (us > TIMER_MAX_TRY_US)
+        us = TIMER_MAX_TRY_US;
+    TimerInfo.min_try_ticks = timer_from_us(us);
+}
 
 // Invoke timers
 static void
@@ -144,7 +158,7 @@ timer_dispatch(void)
 
         uint32_t now = timer_read_time();
         int32_t diff = next - now;
-        if (diff > (int32_t)TIMER_MIN_TRY_TICKS)
+        if (diff > (int32_t)TimerInfo.min_try_ticks)
             // Schedule next timer normally.
             break;
 
@@ -203,6 +217,8 @@ timer_init(void)
         report_errno("sigdelset", ret);
         return;
     }
+    if (!TimerInfo.min_try_ticks)
+        timer_set_busy_poll(TIMER_MIN_TRY_US);
     // Initialize timespec_to_time() and timespec_from_time()
     struct timespec curtime = timespec_read();
     TimerInfo.start_sec = curtime.tv_sec + 1;
@@ -36,6 +36,7 @@ typedef int64_t fixedQ48_t;
 #define ERROR_SAFETY_RANGE 0
 #define ERROR_OVERFLOW 1
 #define ERROR_WATCHDOG 2
+#define MAX_CHANNELS 4
 
 // Flags
 enum {FLAG_IS_HOMING = 1 << 0
@@ -55,6 +56,9 @@ struct load_cell_probe {
     fixedQ16_t trigger_grams_fixed;
     fixedQ2_t grams_per_count;
     struct sos_filter *sf;
+    // multi-channel (summed) sensors
+    uint8_t channel_count, channel_pending;
+    int32_t channel_counts[MAX_CHANNELS];
 };
 
 static inline uint8_t
@@ -120,10 +124,33 @@ trigger_error(struct load_cell_probe *lce, uint8_t error_code)
     trsync_do_trigger(lce->ts, lce->error_reason + error_code);
 }
 
+// Combine the latest sample of each channel. Returns 0 until every
+// channel has reported a new sample.
+static uint8_t
+sum_channels(struct load_cell_probe *lce, uint8_t channel, int32_t *sample)
+{
+    if (channel >= lce->channel_count) {
+        shutdown("load_cell_probe channel out of range");
+    }
+    lce->channel_counts[channel] = *sample;
+    lce->channel_pending |= 1 << channel;
+    if (lce->channel_pending != (1 << lce->channel_count) - 1) {
+        return 0;
+    }
+    lce->channel_pending = 0;
+    int64_t sum = 0;
+    for (uint8_t i = 0; i < lce->channel_count; i++) {
+        sum += lce->channel_counts[i];
+    }
+    // saturate, the safety range check rejects the result
+    *sample = sum > INT32_MAX ? INT32_MAX : (sum < INT32_MIN ? INT32_MIN : sum);
+    return 1;
+}
+
 // Used by Sensors to report new raw ADC sample
 void
-load_cell_probe_report_sample(struct load_cell_probe *lce
-                                , const int32_t sample)
+load_cell_probe_report_sample(struct load_cell_probe *lce, uint8_t channel
+                                , int32_t sample)
 {
     // only process samples when homing
     uint8_t is_homing = is_flag_set(FLAG_IS_HOMING, lce);
@@ -131,6 +158,11 @@ load_cell_probe_report_sample(struct load_cell_probe *lce
         return;
     }
 
+    // sum multiple sensors, sampled together, into one measurement
+    if (lce->channel_count > 1 && !sum_channels(lce, channel, &sample)) {
+        return;
+    }
+
     // save new sample
     uint32_t ticks = timer_read_time();
     lce->last_sample_ticks = ticks;
@@ -227,10 +259,15 @@ command_config_load_cell_probe(uint32_t *args)
     lce->watchdog_max = 0;
     lce->watchdog_count = 0;
     lce->sf = sos_filter_oid_lookup(args[1]);
+    uint8_t channel_count = args[2];
+    if (channel_count < 1 || channel_count > MAX_CHANNELS) {
+        shutdown("load_cell_probe channel_count out of range");
+    }
+    lce->channel_count = channel_count;
     set_endstop_range(lce, 0, 0, 0, 0, 0);
 }
 DECL_COMMAND(command_config_load_cell_probe, "config_load_cell_probe"
-                                               " oid=%c sos_filter_oid=%c");
+                            " oid=%c sos_filter_oid=%c channel_count=%c");
 
 // Lookup a load_cell_probe
 struct load_cell_probe *
@@ -275,6 +312,7 @@ command_load_cell_probe_home(uint32_t *args)
     lce->rest_ticks = args[5];
     lce->watchdog_max = args[6];
     lce->watchdog_count = 0;
+    lce->channel_pending = 0;
     lce->time.func = watchdog_event;
     set_flag(FLAG_IS_HOMING, lce);
     set_flag(FLAG_AWAIT_HOMING, lce);
@@ -30,35 +30,37 @@
   #define PCLK_UARTx PCLK_UART3
 #endif
 
-// Write tx bytes to the serial port
+#define FIFO_SIZE 16
+
+// Write tx bytes to the serial port (the fifo must be empty)
 static void
 kick_tx(void)
 {
-    for (;;) {
-        if (!(LPC_UARTx->LSR & (1<<5))) {
-            // Output fifo full - enable tx irq
-            LPC_UARTx->IER = 0x03;
-            break;
-        }
+    // The THRE flag only indicates that the entire fifo is empty
+    int i;
+    for (i = 0; i < FIFO_SIZE; i++) {
         uint8_t data;
         int ret = serial_get_tx_byte(&data);
-        if (ret) {
-            // No more data to send - disable tx irq
-            LPC_UARTx->IER = 0x01;
+        if (ret)
             break;
-        }
         LPC_UARTx->THR = data;
     }
+    // Enable tx irq if data was sent (otherwise disable it)
+    LPC_UARTx->IER = i ? 0x03 : 0x01;
 }
 
 void
 UARTx_IRQHandler(void)
 {
     uint32_t iir = LPC_UARTx->IIR, status = iir & 0x0f;
-    if (status == 0x04)
-        serial_rx_byte(LPC_UARTx->RBR);
-    else if (status == 0x02)
+    if (status == 0x04 || status == 0x0c) {
+        // Rx trigger level reached (or character timeout) - drain fifo
+        do {
+            serial_rx_byte(LPC_UARTx->RBR);
+        } while (LPC_UARTx->LSR & 0x01);
+    } else if (status == 0x02) {
         kick_tx();
+    }
 }
 
 void
@@ -84,8 +86,8 @@ serial_init(void)
     LPC_UARTx->FDR = 0x10;
     LPC_UARTx->LCR = 3; // 8N1 ; clear DLAB bit
 
-    // Enable fifo
-    LPC_UARTx->FCR = 0x01;
+    // Enable fifo (with an 8 byte rx trigger level)
+    LPC_UARTx->FCR = 0x81;
 
     // Setup pins
     gpio_peripheral(GPIO_Rx, GPIO_FUNCTION_UARTx, 0);
@@ -1,4 +1,4 @@
-// Support for bit-banging commands to WS2812 type "neopixel" LEDs
+// Support for sending commands to WS2812 type "neopixel" LEDs
 //
 // Copyright (C) 2019-2025  Kevin O'Connor <kevin@koconnor.net>
 //
@@ -22,6 +22,11 @@
 //   exceed ~5000ns. The average bit time must be at least 1250ns.
 // - The specs generally indicate a minimum high pulse and low pulse
 //   of 200ns, but the actual requirement might be smaller.
+//
+// Boards that provide a hardware transmitter (CONFIG_HAVE_GPIO_NEOPIXEL)
+// send the data in the background instead of bit-banging it.  The
+// bit-banging code is still used if the board has no hardware free
+// for the requested pin.
 
 
 
@@ -91,16 +96,36 @@ struct neopixel_s {
     neopixel_time_t bit_max_ticks;
     uint32_t last_req_time, reset_min_ticks;
     uint16_t data_size;
+#if CONFIG_HAVE_GPIO_NEOPIXEL
+    uint8_t flags;
+    struct gpio_neopixel hw;
+    uint32_t hw_ticks;
+#endif
     uint8_t data[0];
 };
 
+enum { NF_HW = 1 };
+
 void
 command_config_neopixel(uint32_t *args)
 {
-    struct gpio_out pin = gpio_out_setup(args[1], 0);
     uint16_t data_size = args[2];
     if (data_size & 0x8000)
         shutdown("Invalid neopixel data_size");
+#if CONFIG_HAVE_GPIO_NEOPIXEL
+    struct gpio_neopixel hw;
+    if (!gpio_neopixel_setup(args[1], &hw)) {
+        // Hardware transmits from a copy of the data (after the data)
+        struct neopixel_s *n = oid_alloc(args[0], command_config_neopixel
+                                         , sizeof(*n) + data_size * 2);
+        n->flags = NF_HW;
+        n->hw = hw;
+        n->data_size = data_size;
+        n->reset_min_ticks = args[4];
+        return;
+    }
+#endif
+    struct gpio_out pin = gpio_out_setup(args[1], 0);
     struct neopixel_s *n = oid_alloc(args[0], command_config_neopixel
                                      , sizeof(*n) + data_size);
     n->pin = pin;
@@ -111,16 +136,39 @@ command_config_neopixel(uint32_t *args)
 DECL_COMMAND(command_config_neopixel, "config_neopixel oid=%c pin=%u"
              " data_size=%hu bit_max_ticks=%u reset_min_ticks=%u");
 
+#if CONFIG_HAVE_GPIO_NEOPIXEL
+// Start a background transmission using the board hardware
+static int
+send_data_hw(struct neopixel_s *n)
+{
+    while (gpio_neopixel_busy(n->hw))
+        irq_poll();
+    uint8_t *tx_data = &n->data[n->data_size];
+    memcpy(tx_data, n->data, n->data_size);
+    n->last_req_time = timer_read_time();
+    n->hw_ticks = gpio_neopixel_send(n->hw, tx_data, n->data_size);
+    return 0;
+}
+#endif
+
 static int
 send_data(struct neopixel_s *n)
 {
     // Make sure the reset time has elapsed since last request
     uint32_t last_req_time = n->last_req_time, rmt = n->reset_min_ticks;
+#if CONFIG_HAVE_GPIO_NEOPIXEL
+    // Hardware transmissions complete after the request time
+    rmt += n->hw_ticks;
+#endif
     uint32_t cur = timer_read_time();
     while (cur - last_req_time < rmt) {
         irq_poll();
         cur = timer_read_time();
     }
+#if CONFIG_HAVE_GPIO_NEOPIXEL
+    if (n->flags & NF_HW)
+        return send_data_hw(n);
+#endif
 
     // Transmit data
     uint8_t *data = n->data;
@@ -28,6 +28,21 @@
 
 #define ALT_PRU_PTR(ptr) ((typeof(ptr))((uint32_t)(ptr) ^ 0x2000))
 
+// Step generator run on PRU0 (on behalf of stepper_hw.c on PRU1)
+#define PRU_STEP_GENS 4
+#define PRU_STEP_RING_SIZE 32
+
+struct pru_step_gen {
+    // Absolute step times (written by PRU1)
+    uint32_t ring[PRU_STEP_RING_SIZE];
+    // Steps queued, and steps before 'flush' are discarded (PRU1)
+    uint32_t head, flush;
+    // Steps started or discarded (written by PRU0)
+    uint32_t tail;
+    volatile uint32_t *step_reg, *unstep_reg;
+    uint32_t bit, pulse_ticks;
+};
+
 // Layout of shared memory
 struct shared_mem {
     uint32_t signal;
@@ -39,6 +54,8 @@ struct shared_mem {
     uint32_t command_index_size;
     const struct command_parser *shutdown_handler;
     uint8_t read_data[512];
+    uint32_t step_gen_count;
+    struct pru_step_gen step_gens[PRU_STEP_GENS];
 };
 
 #define SIGNAL_PRU0_WAITING 0xefefefef
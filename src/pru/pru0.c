@@ -8,8 +8,10 @@
 #include <stdint.h> // uint32_t
 #include <string.h> // memset
 #include <pru/io.h> // write_r31
+#include <pru_iep.h> // CT_IEP
 #include <pru_rpmsg.h> // pru_rpmsg_send
 #include <pru_virtio_ids.h> // VIRTIO_ID_RPMSG
+#include "autoconf.h" // CONFIG_WANT_STEPPER_HW
 #include "board/io.h" // readl
 #include "board/misc.h" // console_sendf
 #include "command.h" // command_encode_add_frame
@@ -23,6 +25,51 @@ struct pru_rpmsg_transport transport;
 static uint16_t transport_dst;
 
 
+/****************************************************************
+ * Step generation
+ ****************************************************************/
+
+// Local state of each step generator
+static struct {
+    uint32_t unstep_time, min_step_time;
+    uint8_t is_high;
+} step_state[PRU_STEP_GENS];
+
+// Generate any step pulses that are due (for stepper_hw.c on PRU1)
+static void
+check_steps(void)
+{
+    if (!CONFIG_WANT_STEPPER_HW)
+        return;
+    uint32_t i, count = readl(&SHARED_MEM->step_gen_count);
+    for (i=0; i<count; i++) {
+        struct pru_step_gen *sg = &SHARED_MEM->step_gens[i];
+        uint32_t now = CT_IEP.TMR_CNT;
+        if (step_state[i].is_high) {
+            if ((int32_t)(now - step_state[i].unstep_time) < 0)
+                continue;
+            *sg->unstep_reg = sg->bit;
+            step_state[i].is_high = 0;
+            step_state[i].min_step_time = now + sg->pulse_ticks;
+            continue;
+        }
+        uint32_t tail = sg->tail;
+        if (tail == readl(&sg->head))
+            continue;
+        if ((int32_t)(tail - readl(&sg->flush)) >= 0) {
+            uint32_t step_time = sg->ring[tail % PRU_STEP_RING_SIZE];
+            if ((int32_t)(now - step_time) < 0
+                || (int32_t)(now - step_state[i].min_step_time) < 0)
+                continue;
+            *sg->step_reg = sg->bit;
+            step_state[i].is_high = 1;
+            step_state[i].unstep_time = now + sg->pulse_ticks;
+        }
+        writel(&sg->tail, tail + 1);
+    }
+}
+
+
 /****************************************************************
  * IO
  ****************************************************************/
@@ -66,6 +113,7 @@ static void
 check_can_send(void)
 {
     for (;;) {
+        check_steps();
         uint32_t rce = readl(&SHARED_MEM->next_encoder);
         if (!rce)
             break;
@@ -201,6 +249,7 @@ process_io(void)
             flush_messages();
             while (!(read_r31() & (1 << (WAKE_PRU0_IRQ + R31_IRQ_OFFSET)))) {
                 //asm("slp 1");
+                check_steps();
             }
         }
     }
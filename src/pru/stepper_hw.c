@@ -0,0 +1,113 @@
+// Step pulse generation on PRU0 for steppers handled by PRU1
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "board/io.h" // readl
+#include "board/misc.h" // timer_read_time
+#include "command.h" // shutdown
+#include "compiler.h" // barrier
+#include "gpio.h" // gpio_out_setup
+#include "internal.h" // SHARED_MEM
+#include "sched.h" // sched_shutdown
+#include "stepper_hw.h" // stepper_hw_setup
+
+// The step times are calculated on PRU1 and placed in a ring buffer
+// in the shared memory.  PRU0 polls the ring (between its host io
+// processing) and generates the step pulses when each step time is
+// reached.  Both PRUs use the same IEP timer, so the ring holds
+// absolute times.
+
+struct stepper_hw {
+    struct pru_step_gen *sg;
+    uint32_t last;
+};
+
+static struct stepper_hw step_gens[PRU_STEP_GENS];
+
+// Configure a step generator for a step pin
+struct stepper_hw *
+stepper_hw_setup(uint8_t pin, uint8_t invert, uint32_t pulse_ticks)
+{
+    uint32_t count = SHARED_MEM->step_gen_count;
+    if (count >= PRU_STEP_GENS)
+        shutdown("No free hardware step generators");
+    struct stepper_hw *hw = &step_gens[count];
+    struct pru_step_gen *sg = hw->sg = &SHARED_MEM->step_gens[count];
+    struct gpio_out g = gpio_out_setup(pin, invert);
+    // The gpio "set" register immediately follows the "clear" register
+    sg->step_reg = invert ? g.reg : g.reg + 1;
+    sg->unstep_reg = invert ? g.reg + 1 : g.reg;
+    sg->bit = g.bit;
+    sg->pulse_ticks = pulse_ticks;
+    sg->head = sg->flush = sg->tail = 0;
+    barrier();
+    writel(&SHARED_MEM->step_gen_count, count + 1);
+    return hw;
+}
+
+// Return the number of steps that may be added to the ring
+uint_fast8_t
+stepper_hw_space(struct stepper_hw *hw)
+{
+    struct pru_step_gen *sg = hw->sg;
+    return PRU_STEP_RING_SIZE - (sg->head - readl(&sg->tail));
+}
+
+// Return the number of steps that have been queued but not yet started
+uint_fast8_t
+stepper_hw_pending(struct stepper_hw *hw)
+{
+    struct pru_step_gen *sg = hw->sg;
+    uint32_t tail = readl(&sg->tail);
+    if ((int32_t)(sg->flush - tail) > 0)
+        // Discarded steps that PRU0 has not yet skipped
+        tail = sg->flush;
+    return sg->head - tail;
+}
+
+// Add a step time to the ring
+static void
+ring_push(struct stepper_hw *hw, uint32_t step_time)
+{
+    struct pru_step_gen *sg = hw->sg;
+    uint32_t head = sg->head;
+    sg->ring[head % PRU_STEP_RING_SIZE] = step_time;
+    barrier();
+    writel(&sg->head, head + 1);
+    hw->last = step_time;
+}
+
+// Queue a step to occur 'ticks' after the start of the previous step
+void
+stepper_hw_push(struct stepper_hw *hw, int32_t ticks)
+{
+    ring_push(hw, hw->last + ticks);
+}
+
+// Queue a step to occur 'ticks' from now on an idle step generator
+void
+stepper_hw_start(struct stepper_hw *hw, int32_t ticks)
+{
+    ring_push(hw, timer_read_time() + (ticks > 0 ? ticks : 0));
+}
+
+// Number of cycles that covers PRU0 starting a step that it checked
+// just before the ring was flushed
+#define STOP_SETTLE_CYCLES 200
+
+// Discard the queued steps.  Returns the number of steps discarded.
+uint_fast8_t
+stepper_hw_stop(struct stepper_hw *hw)
+{
+    struct pru_step_gen *sg = hw->sg;
+    uint32_t head = sg->head, prev_flush = sg->flush;
+    writel(&sg->flush, head);
+    __delay_cycles(STOP_SETTLE_CYCLES);
+    uint32_t tail = readl(&sg->tail);
+    if ((int32_t)(prev_flush - tail) > 0)
+        // Don't count steps discarded by an earlier stop
+        tail = prev_flush;
+    return head - tail;
+}
@@ -0,0 +1,18 @@
+#ifndef __PRU_STEPPER_HW_H
+#define __PRU_STEPPER_HW_H
+
+#include <stdint.h> // uint32_t
+
+// Upper limit on the number of steps queued to a step generator
+#define STEPPER_HW_QUEUE_SIZE 32
+
+struct stepper_hw;
+struct stepper_hw *stepper_hw_setup(uint8_t pin, uint8_t invert
+                                    , uint32_t pulse_ticks);
+uint_fast8_t stepper_hw_space(struct stepper_hw *hw);
+uint_fast8_t stepper_hw_pending(struct stepper_hw *hw);
+void stepper_hw_start(struct stepper_hw *hw, int32_t ticks);
+void stepper_hw_push(struct stepper_hw *hw, int32_t ticks);
+uint_fast8_t stepper_hw_stop(struct stepper_hw *hw);
+
+#endif // stepper_hw.h
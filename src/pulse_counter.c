@@ -16,6 +16,9 @@ struct counter {
     uint32_t poll_ticks;
     uint32_t sample_ticks, next_sample_time;
     uint32_t count, last_count_time;
+    // Report filtering
+    uint32_t max_report_ticks, threshold, last_report_time;
+    uint32_t last_sample_count, report_delta;
     uint8_t flags;
     struct gpio_in pin;
 };
@@ -61,6 +64,17 @@ command_config_counter(uint32_t *args)
 DECL_COMMAND(command_config_counter,
              "config_counter oid=%c pin=%u pull_up=%c");
 
+// Only report samples with a significant change in rate
+void
+command_counter_set_report(uint32_t *args)
+{
+    struct counter *c = oid_lookup(args[0], command_config_counter);
+    c->max_report_ticks = args[1];
+    c->threshold = args[2];
+}
+DECL_COMMAND(command_counter_set_report,
+             "counter_set_report oid=%c max_report_ticks=%u threshold=%u");
+
 void
 command_query_counter(uint32_t *args)
 {
@@ -70,6 +84,7 @@ command_query_counter(uint32_t *args)
     c->poll_ticks = args[2];
     c->sample_ticks = args[3];
     c->next_sample_time = c->timer.waketime; // sample immediately
+    c->last_report_time = c->timer.waketime - c->max_report_ticks;
     sched_add_timer(&c->timer);
 }
 DECL_COMMAND(command_query_counter,
@@ -92,6 +107,18 @@ counter_task(void)
         uint32_t count_time = c->last_count_time;
         c->flags &= ~CF_PENDING;
         irq_enable();
+        if (c->max_report_ticks) {
+            // Skip report if the count rate is similar to the last report
+            uint32_t delta = count - c->last_sample_count;
+            c->last_sample_count = count;
+            uint32_t diff = (delta > c->report_delta ? delta - c->report_delta
+                             : c->report_delta - delta);
+            if (diff <= c->threshold && timer_is_before(
+                    waketime, c->last_report_time + c->max_report_ticks))
+                continue;
+            c->report_delta = delta;
+            c->last_report_time = waketime;
+        }
         sendf("counter_state oid=%c next_clock=%u count=%u count_clock=%u",
               oid, waketime, count, count_time);
     }
@@ -4,6 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_WANT_OUTPUT_QUEUE_MULTI
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // struct gpio_pwm
 #include "board/irq.h" // irq_disable
@@ -40,7 +41,7 @@ pwm_event(struct timer *timer)
     struct pwm_move *m = container_of(mn, struct pwm_move, node);
     uint16_t value = m->value;
     gpio_pwm_write(p->pin, value);
-    move_free(m);
+    move_free(&p->mq, m);
 
     // Check if more updates queued
     if (move_queue_empty(&p->mq)) {
@@ -73,19 +74,19 @@ command_config_pwm_out(uint32_t *args)
     p->default_value = args[4];
     p->max_duration = args[5];
     p->timer.func = pwm_event;
-    move_queue_setup(&p->mq, sizeof(struct pwm_move));
+    move_queue_setup(args[0], &p->mq, sizeof(struct pwm_move));
 }
 DECL_COMMAND(command_config_pwm_out,
              "config_pwm_out oid=%c pin=%u cycle_ticks=%u value=%hu"
              " default_value=%hu max_duration=%u");
 
-void
-command_queue_pwm_out(uint32_t *args)
+// Queue an update of a pwm pin at the given time
+static void
+pwm_out_queue(struct pwm_out_s *p, uint32_t time, uint16_t value)
 {
-    struct pwm_out_s *p = oid_lookup(args[0], command_config_pwm_out);
-    struct pwm_move *m = move_alloc();
-    m->waketime = args[1];
-    m->value = args[2];
+    struct pwm_move *m = move_alloc(&p->mq);
+    m->waketime = time;
+    m->value = value;
 
     irq_disable();
     int need_add_timer = move_queue_push(&m->node, &p->mq);
@@ -102,8 +103,37 @@ command_queue_pwm_out(uint32_t *args)
     p->timer.waketime = m->waketime;
     sched_add_timer(&p->timer);
 }
+
+void
+command_queue_pwm_out(uint32_t *args)
+{
+    struct pwm_out_s *p = oid_lookup(args[0], command_config_pwm_out);
+    pwm_out_queue(p, args[1], args[2]);
+}
 DECL_COMMAND(command_queue_pwm_out, "queue_pwm_out oid=%c clock=%u value=%hu");
 
+#if CONFIG_WANT_OUTPUT_QUEUE_MULTI
+// Schedule several updates of a pin in a single command.  Each update
+// is encoded as the vlq integers "clock delta" (from the previous
+// update, or from 'clock' for the first update) and "value".
+void
+command_queue_pwm_out_multi(uint32_t *args)
+{
+    struct pwm_out_s *p = oid_lookup(args[0], command_config_pwm_out);
+    uint32_t time = args[1];
+    uint8_t *data = command_decode_ptr(args[3]), *end = &data[args[2]];
+    while (data < end) {
+        time += command_parse_int(&data);
+        uint16_t value = command_parse_int(&data);
+        if (data > end)
+            shutdown("Invalid queue_pwm_out_multi data");
+        pwm_out_queue(p, time, value);
+    }
+}
+DECL_COMMAND(command_queue_pwm_out_multi,
+             "queue_pwm_out_multi oid=%c clock=%u data=%*s");
+#endif
+
 void
 pwm_shutdown(void)
 {
@@ -6,8 +6,11 @@
 
 #include "board/misc.h" // timer_from_us
 #include "command.h" // shutdown
+#include "compiler.h" // ARRAY_SIZE
 #include "gpio.h" // gpio_adc_setup
+#include "hardware/regs/dreq.h" // DREQ_ADC
 #include "hardware/structs/adc.h" // adc_hw
+#include "hardware/structs/dma.h" // dma_hw
 #include "hardware/structs/padsbank0.h" // padsbank0_hw
 #include "hardware/structs/resets.h" // RESETS_RESET_ADC_BITS
 #include "internal.h" // enable_pclock
@@ -42,7 +45,7 @@ gpio_adc_setup(uint32_t pin)
     return (struct gpio_adc){ .chan = chan };
 }
 
-enum { ADC_DUMMY=0xff };
+enum { ADC_DUMMY=0xff, ADC_SCAN=0xfe };
 static uint8_t last_analog_read = ADC_DUMMY;
 
 // Try to sample a value. Returns zero if sample ready, otherwise
@@ -86,3 +89,116 @@ gpio_adc_cancel_sample(struct gpio_adc g)
     if (last_analog_read == g.chan)
         last_analog_read = ADC_DUMMY;
 }
+
+
+/****************************************************************
+ * Hardware scan of several channels
+ ****************************************************************/
+
+// A scan uses the adc round robin mode to convert every channel in
+// the scan 'oversample' times back-to-back.  The results are copied
+// from the adc fifo by a dma channel (spi.c uses channels 0-3 and
+// stepper_hw.c uses channels 8 and up).
+#define ADC_SCAN_DMA_CHAN 4
+
+static uint16_t adc_scan_buf[256];
+static struct gpio_adc_scan *active_scan;
+
+// Add a channel to a scan
+void
+gpio_adc_scan_add(struct gpio_adc_scan *s, struct gpio_adc g)
+{
+    s->chan_mask |= 1 << g.chan;
+}
+
+// Halt round robin sampling and the dma transfer
+static void
+adc_scan_stop(void)
+{
+    dma_hw->abort = 1 << ADC_SCAN_DMA_CHAN;
+    while (dma_hw->abort & (1 << ADC_SCAN_DMA_CHAN))
+        ;
+    adc_hw->cs &= ~(ADC_CS_START_MANY_BITS | ADC_CS_RROBIN_BITS);
+    adc_hw->fcs = 0;
+}
+
+// Try to sample all channels of a scan.  Returns zero once the scan
+// is complete (the results must then be read with
+// gpio_adc_scan_read() before returning to the scheduler), otherwise
+// returns the number of clock ticks the caller should wait before
+// retrying this function.
+uint32_t
+gpio_adc_scan_sample(struct gpio_adc_scan *s, uint8_t oversample)
+{
+    if (active_scan == s) {
+        dma_channel_hw_t *ch = &dma_hw->ch[ADC_SCAN_DMA_CHAN];
+        if (ch->ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS)
+            return timer_from_us(5);
+        adc_scan_stop();
+        if (!(adc_hw->cs & ADC_CS_READY_BITS))
+            return timer_from_us(5);
+        active_scan = NULL;
+        last_analog_read = ADC_DUMMY;
+        return 0;
+    }
+    uint32_t cs = adc_hw->cs;
+    if (!(cs & ADC_CS_READY_BITS) || last_analog_read != ADC_DUMMY)
+        // Another sample in progress
+        return timer_from_us(5);
+
+    uint32_t mask = s->chan_mask;
+    uint32_t total = __builtin_popcount(mask) * oversample;
+    if (!total || total > ARRAY_SIZE(adc_scan_buf))
+        shutdown("Invalid ADC scan");
+    s->sample_total = total;
+
+    // Setup dma from the (flushed) adc fifo
+    if (!is_enabled_pclock(RESETS_RESET_DMA_BITS))
+        enable_pclock(RESETS_RESET_DMA_BITS);
+    adc_hw->fcs = ADC_FCS_OVER_BITS | ADC_FCS_UNDER_BITS;
+    while (!(adc_hw->fcs & ADC_FCS_EMPTY_BITS))
+        (void)adc_hw->fifo;
+    dma_channel_hw_t *ch = &dma_hw->ch[ADC_SCAN_DMA_CHAN];
+    ch->read_addr = (uint32_t)&adc_hw->fifo;
+    ch->write_addr = (uint32_t)adc_scan_buf;
+    ch->transfer_count = total;
+    ch->ctrl_trig = (DMA_CH0_CTRL_TRIG_EN_BITS
+                     | DMA_CH0_CTRL_TRIG_INCR_WRITE_BITS
+                     | (1 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB)
+                     | (ADC_SCAN_DMA_CHAN << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB)
+                     | (DREQ_ADC << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB));
+    adc_hw->fcs = (ADC_FCS_EN_BITS | ADC_FCS_DREQ_EN_BITS
+                   | (1 << ADC_FCS_THRESH_LSB));
+
+    // Start round robin sampling (from the lowest channel)
+    active_scan = s;
+    last_analog_read = ADC_SCAN;
+    adc_hw->cs = ((cs & ADC_CS_TS_EN_BITS) | ADC_CS_START_MANY_BITS
+                  | ADC_CS_EN_BITS | (mask << ADC_CS_RROBIN_LSB)
+                  | (__builtin_ctz(mask) << ADC_CS_AINSEL_LSB));
+
+    // Each conversion takes 2us
+    return timer_from_us(2 * total + 5);
+}
+
+// Return the sum of the over-samples of a channel in a completed scan
+uint16_t
+gpio_adc_scan_read(struct gpio_adc_scan *s, struct gpio_adc g)
+{
+    uint32_t mask = s->chan_mask, count = __builtin_popcount(mask);
+    uint32_t pos = __builtin_popcount(mask & ((1 << g.chan) - 1)), sum = 0;
+    for (; pos < s->sample_total; pos += count)
+        sum += adc_scan_buf[pos];
+    return sum;
+}
+
+// Cancel a scan that may have been started with gpio_adc_scan_sample()
+void
+gpio_adc_scan_cancel(struct gpio_adc_scan *s)
+{
+    if (active_scan != s)
+        return;
+    adc_scan_stop();
+    active_scan = NULL;
+    last_analog_read = ADC_DUMMY;
+}
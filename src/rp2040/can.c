@@ -9,12 +9,15 @@
 #include "autoconf.h" // CONFIG_CANBUS_FREQUENCY
 #include "board/armcm_boot.h" // armcm_enable_irq
 #include "board/io.h" // readl
+#include "board/misc.h" // timer_read_time
 #include "can2040.h" // can2040_setup
 #include "command.h" // DECL_CONSTANT_STR
 #include "fasthash.h" // fasthash64
 #include "generic/canbus.h" // canbus_notify_tx
 #include "generic/canserial.h" // CANBUS_ID_ADMIN
+#include "hardware/structs/psm.h" // psm_hw
 #include "hardware/structs/resets.h" // RESETS_RESET_PIO0_BITS
+#include "hardware/structs/sio.h" // sio_hw
 #include "internal.h" // DMA_IRQ_0_IRQn
 #include "sched.h" // DECL_INIT
 
@@ -58,6 +61,182 @@ canhw_get_status(struct canbus_status *status)
     status->bus_state = CANBUS_STATE_ACTIVE;
 }
 
+// Time spent in the PIO irq handler
+static struct {
+    uint32_t irq_ticks, irq_max, rx_overflow;
+} Can2040Stats;
+
+// Main PIO irq handler
+void
+PIOx_IRQHandler(void)
+{
+    uint32_t start = timer_read_time();
+    can2040_pio_irq_handler(&cbus);
+    uint32_t ticks = timer_read_time() - start;
+    Can2040Stats.irq_ticks += ticks;
+    if (ticks > Can2040Stats.irq_max)
+        Can2040Stats.irq_max = ticks;
+}
+
+void
+command_get_can2040_stats(uint32_t *args)
+{
+    sendf("can2040_stats irq_ticks=%u irq_max=%u rx_overflow=%u"
+          , readl(&Can2040Stats.irq_ticks), readl(&Can2040Stats.irq_max)
+          , readl(&Can2040Stats.rx_overflow));
+    Can2040Stats.irq_max = 0;
+}
+DECL_COMMAND_FLAGS(command_get_can2040_stats, HF_IN_SHUTDOWN
+                   , "get_can2040_stats");
+
+#if CONFIG_RPXXXX_CANBUS_CORE1
+
+/****************************************************************
+ * can2040 processing on second core
+ ****************************************************************/
+
+// The PIO irq runs on core1.  Received messages are passed to core0
+// via a single producer / single consumer queue and core0 is
+// signaled using the inter-core fifo.
+
+#if CONFIG_MACH_RP2040
+  #define SIO_FIFO_IRQn SIO_IRQ_PROC0_IRQn
+#else
+  #define SIO_FIFO_IRQn SIO_IRQ_FIFO_IRQn
+#endif
+
+#define RX_QUEUE_SIZE 32
+
+static struct {
+    struct can2040_msg queue[RX_QUEUE_SIZE];
+    uint32_t push_pos, pull_pos, tx_notify, tx_notify_seen;
+} CoreQueue;
+
+static uint32_t core1_stack[256] __aligned(8);
+
+// Wake up core0 (called on core1)
+static void
+core1_signal(void)
+{
+    if (sio_hw->fifo_st & SIO_FIFO_ST_RDY_BITS)
+        sio_hw->fifo_wr = 0;
+}
+
+// can2040 callback function - queue notifications for core0
+static void
+can2040_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
+{
+    if (notify & CAN2040_NOTIFY_TX) {
+        writel(&CoreQueue.tx_notify, CoreQueue.tx_notify + 1);
+        core1_signal();
+        return;
+    }
+    if (!(notify & CAN2040_NOTIFY_RX))
+        return;
+    uint32_t push_pos = CoreQueue.push_pos;
+    if (push_pos - readl(&CoreQueue.pull_pos) >= RX_QUEUE_SIZE) {
+        Can2040Stats.rx_overflow++;
+        return;
+    }
+    memcpy(&CoreQueue.queue[push_pos % RX_QUEUE_SIZE], msg, sizeof(*msg));
+    __DMB();
+    writel(&CoreQueue.push_pos, push_pos + 1);
+    core1_signal();
+}
+
+// Inter-core fifo irq handler - process messages queued by core1
+void
+SIOx_IRQHandler(void)
+{
+    while (sio_hw->fifo_st & SIO_FIFO_ST_VLD_BITS)
+        (void)sio_hw->fifo_rd;
+    sio_hw->fifo_st = 0xff;
+
+    uint32_t tx_notify = readl(&CoreQueue.tx_notify);
+    if (tx_notify != CoreQueue.tx_notify_seen) {
+        CoreQueue.tx_notify_seen = tx_notify;
+        canbus_notify_tx();
+    }
+    uint32_t pull_pos = CoreQueue.pull_pos;
+    while (pull_pos != readl(&CoreQueue.push_pos)) {
+        __DMB();
+        canbus_process_data((void*)&CoreQueue.queue[pull_pos % RX_QUEUE_SIZE]);
+        pull_pos++;
+        __DMB();
+        writel(&CoreQueue.pull_pos, pull_pos);
+    }
+}
+
+// Main code for core1 - only services the PIO irq
+static void
+core1_main(void)
+{
+#if CONFIG_MACH_RP2350
+    // Enable this core's cycle counter (used by timer_read_time)
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+    armcm_enable_irq(PIOx_IRQHandler, PIO0_IRQ_0_IRQn, 1);
+    __enable_irq();
+    for (;;)
+        __WFI();
+}
+
+static void
+core1_fifo_push(uint32_t val)
+{
+    while (!(sio_hw->fifo_st & SIO_FIFO_ST_RDY_BITS))
+        ;
+    sio_hw->fifo_wr = val;
+    __SEV();
+}
+
+static uint32_t
+core1_fifo_pop(void)
+{
+    while (!(sio_hw->fifo_st & SIO_FIFO_ST_VLD_BITS))
+        ;
+    return sio_hw->fifo_rd;
+}
+
+// Reset core1 and start it at core1_main()
+static void
+core1_launch(void)
+{
+    psm_hw->frce_off |= PSM_FRCE_OFF_PROC1_BITS;
+    while (!(psm_hw->frce_off & PSM_FRCE_OFF_PROC1_BITS))
+        ;
+    psm_hw->frce_off &= ~PSM_FRCE_OFF_PROC1_BITS;
+
+    // Handshake with bootrom (see rp2040 datasheet section 2.8.2)
+    uint32_t cmds[] = {
+        0, 0, 1, (uint32_t)VectorTable
+        , (uint32_t)&core1_stack[ARRAY_SIZE(core1_stack)]
+        , (uint32_t)core1_main
+    };
+    uint32_t seq = 0;
+    while (seq < ARRAY_SIZE(cmds)) {
+        uint32_t cmd = cmds[seq];
+        if (!cmd) {
+            while (sio_hw->fifo_st & SIO_FIFO_ST_VLD_BITS)
+                (void)sio_hw->fifo_rd;
+            __SEV();
+        }
+        core1_fifo_push(cmd);
+        seq = core1_fifo_pop() == cmd ? seq + 1 : 0;
+    }
+}
+
+static void
+can_irq_init(void)
+{
+    sio_hw->fifo_st = 0xff;
+    armcm_enable_irq(SIOx_IRQHandler, SIO_FIFO_IRQn, 1);
+    core1_launch();
+}
+
+#else // CONFIG_RPXXXX_CANBUS_CORE1
+
 // can2040 callback function - handle rx and tx notifications
 static void
 can2040_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
@@ -70,13 +249,14 @@ can2040_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
         canbus_process_data((void*)msg);
 }
 
-// Main PIO irq handler
-void
-PIOx_IRQHandler(void)
+static void
+can_irq_init(void)
 {
-    can2040_pio_irq_handler(&cbus);
+    armcm_enable_irq(PIOx_IRQHandler, PIO0_IRQ_0_IRQn, 1);
 }
 
+#endif // CONFIG_RPXXXX_CANBUS_CORE1
+
 void
 can_init(void)
 {
@@ -85,7 +265,7 @@ can_init(void)
     can2040_callback_config(&cbus, can2040_cb);
 
     // Enable irqs
-    armcm_enable_irq(PIOx_IRQHandler, PIO0_IRQ_0_IRQn, 1);
+    can_irq_init();
 
     // Start canbus
     uint32_t pclk = get_pclock_frequency(RESETS_RESET_PIO0_RESET);
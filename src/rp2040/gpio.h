@@ -19,6 +19,14 @@ struct gpio_in gpio_in_setup(uint8_t pin, int8_t pull_up);
 void gpio_in_reset(struct gpio_in g, int8_t pull_up);
 uint8_t gpio_in_read(struct gpio_in g);
 
+struct gpio_irq {
+    void (*func)(struct gpio_irq *gi, uint32_t time);
+    uint32_t pin;
+};
+void gpio_irq_setup(struct gpio_irq *gi, uint8_t pin);
+void gpio_irq_enable(struct gpio_irq *gi, uint8_t rising);
+void gpio_irq_disable(struct gpio_irq *gi);
+
 struct gpio_pwm {
     void *reg;
     uint8_t shift;
@@ -34,6 +42,32 @@ struct gpio_adc gpio_adc_setup(uint32_t pin);
 uint32_t gpio_adc_sample(struct gpio_adc g);
 uint16_t gpio_adc_read(struct gpio_adc g);
 void gpio_adc_cancel_sample(struct gpio_adc g);
+struct gpio_adc_scan {
+    uint32_t chan_mask;
+    uint16_t sample_total;
+};
+void gpio_adc_scan_add(struct gpio_adc_scan *s, struct gpio_adc g);
+uint32_t gpio_adc_scan_sample(struct gpio_adc_scan *s, uint8_t oversample);
+uint16_t gpio_adc_scan_read(struct gpio_adc_scan *s, struct gpio_adc g);
+void gpio_adc_scan_cancel(struct gpio_adc_scan *s);
+
+struct gpio_neopixel {
+    uint8_t sm;
+};
+int gpio_neopixel_setup(uint32_t pin, struct gpio_neopixel *g);
+int gpio_neopixel_busy(struct gpio_neopixel g);
+uint32_t gpio_neopixel_send(struct gpio_neopixel g, uint8_t *data
+                            , uint32_t len);
+
+struct gpio_uart {
+    void *uart;
+};
+#define GPIO_UART_ERROR 0x100
+int gpio_uart_setup(uint32_t rx_pin, uint32_t tx_pin, int8_t pull_up
+                    , uint32_t bit_ticks, struct gpio_uart *g);
+void gpio_uart_write(struct gpio_uart g, uint8_t *data, uint_fast8_t len);
+int gpio_uart_tx_busy(struct gpio_uart g);
+int gpio_uart_read(struct gpio_uart g);
 
 struct spi_config {
     void *spi;
@@ -43,6 +77,12 @@ struct spi_config spi_setup(uint32_t bus, uint8_t mode, uint32_t rate);
 void spi_prepare(struct spi_config config);
 void spi_transfer(struct spi_config config, uint8_t receive_data
                   , uint8_t len, uint8_t *data);
+struct spi_async {
+    void (*func)(struct spi_async *sa);
+};
+void spi_transfer_async(struct spi_config config, uint8_t receive_data
+                        , uint8_t len, uint8_t *data, struct spi_async *sa);
+void spi_transfer_wait(struct spi_config config);
 
 struct i2c_config {
     void *i2c;
@@ -0,0 +1,79 @@
+// Gpio edge interrupts on rp2040
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
+#include "board/misc.h" // timer_read_time
+#include "command.h" // shutdown
+#include "gpio.h" // gpio_irq_setup
+#include "hardware/structs/iobank0.h" // iobank0_hw
+#include "internal.h" // IO_IRQ_BANK0_IRQn
+#include "sched.h" // sched_shutdown
+
+// Each gpio has four interrupt bits (level low, level high, edge
+// low, edge high) - eight gpios per register
+#define EDGE_LOW_BIT  0x4
+#define EDGE_HIGH_BIT 0x8
+
+static struct gpio_irq *gpio_handlers[30];
+
+// Dispatch gpio edge interrupts
+void
+GPIO_IRQHandler(void)
+{
+    uint32_t time = timer_read_time();
+    uint32_t i;
+    for (i = 0; i < DIV_ROUND_UP(ARRAY_SIZE(gpio_handlers), 8); i++) {
+        uint32_t ints = iobank0_hw->proc0_irq_ctrl.ints[i];
+        if (!ints)
+            continue;
+        iobank0_hw->intr[i] = ints;
+        while (ints) {
+            uint32_t pos = __builtin_ctz(ints);
+            ints &= ~(0xf << (pos & ~3));
+            struct gpio_irq *gi = gpio_handlers[i * 8 + pos / 4];
+            gi->func(gi, time);
+        }
+    }
+}
+
+// Prepare an edge interrupt for a pin (the pin must already be an
+// input).  The interrupt starts disabled.
+void
+gpio_irq_setup(struct gpio_irq *gi, uint8_t pin)
+{
+    if (pin >= ARRAY_SIZE(gpio_handlers))
+        shutdown("Not a valid edge interrupt pin");
+    gi->pin = pin;
+    gpio_handlers[pin] = gi;
+    gpio_irq_disable(gi);
+    armcm_enable_irq(GPIO_IRQHandler, IO_IRQ_BANK0_IRQn, 1);
+}
+
+// Invoke gi->func (from irq context) on the next rising (or falling)
+// edge of the pin
+void
+gpio_irq_enable(struct gpio_irq *gi, uint8_t rising)
+{
+    uint32_t pin = gi->pin, reg = pin / 8, shift = (pin % 8) * 4;
+    uint32_t bits = (rising ? EDGE_HIGH_BIT : EDGE_LOW_BIT) << shift;
+    irqstatus_t flag = irq_save();
+    iobank0_hw->intr[reg] = 0xf << shift;
+    uint32_t inte = iobank0_hw->proc0_irq_ctrl.inte[reg];
+    iobank0_hw->proc0_irq_ctrl.inte[reg] = (inte & ~(0xf << shift)) | bits;
+    irq_restore(flag);
+}
+
+void
+gpio_irq_disable(struct gpio_irq *gi)
+{
+    uint32_t pin = gi->pin, reg = pin / 8, shift = (pin % 8) * 4;
+    irqstatus_t flag = irq_save();
+    uint32_t inte = iobank0_hw->proc0_irq_ctrl.inte[reg];
+    iobank0_hw->proc0_irq_ctrl.inte[reg] = inte & ~(0xf << shift);
+    iobank0_hw->intr[reg] = 0xf << shift;
+    irq_restore(flag);
+}
@@ -0,0 +1,126 @@
+// Neopixel transmission using a pio state machine on rp2040
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_CANSERIAL
+#include "board/misc.h" // timer_from_us
+#include "compiler.h" // ARRAY_SIZE
+#include "gpio.h" // gpio_neopixel_setup
+#include "internal.h" // get_pclock_frequency
+#include "hardware/regs/dreq.h" // DREQ_PIO0_TX0
+#include "hardware/structs/dma.h" // dma_hw
+#include "hardware/structs/pio.h" // pio0_hw
+#include "hardware/structs/resets.h" // RESETS_RESET_PIO0_BITS
+
+// The PIO program shifts out one bit per 10 pio cycles using side-set
+// on the data pin:
+//   0: out x, 1         side 0 [2]
+//   1: jmp !x, 3        side 1 [1]
+//   2: jmp 0            side 1 [4]
+//   3: nop              side 0 [4]
+// A zero bit is high for 2 cycles and a one bit is high for 7 cycles.
+// The state machine stalls (with the pin low) when the fifo is empty.
+static const uint16_t neopixel_program[] = {
+    0x6221, 0x1123, 0x1400, 0xa442
+};
+#define PROG_WRAP_TOP (ARRAY_SIZE(neopixel_program) - 1)
+#define PROG_CYCLES_PER_BIT 10
+#define PROG_BIT_NSECS 1250
+
+// Encoded instructions executed directly on a state machine
+#define INSTR_JMP_0         0x0000
+#define INSTR_SET_PINS_0    0xe000
+#define INSTR_SET_PINDIRS_1 0xe081
+
+#define PIO_FUNC 6
+
+// The can2040 code uses pio0 (and step generators use pio1), so pio
+// transmission is only available on builds without canbus support.
+#define neopixel_pio pio0_hw
+
+// Each state machine is fed one byte at a time by a dma channel.  The
+// 8-bit dma writes are replicated across the 32-bit fifo entry, so the
+// state machine shifts out the upper bits msb first with an 8-bit
+// autopull threshold.
+#define DMA_CHAN_BASE 5
+#define MAX_NEOPIXEL_HW 3
+
+static uint32_t neopixel_hw_count;
+
+// Allocate a state machine for a neopixel pin.  Returns non-zero if
+// no hardware is available (the caller then bit-bangs the pin).
+int
+gpio_neopixel_setup(uint32_t pin, struct gpio_neopixel *g)
+{
+    if (CONFIG_CANSERIAL || CONFIG_USBCANBUS || pin >= 30
+        || neopixel_hw_count >= MAX_NEOPIXEL_HW)
+        return -1;
+    if (!neopixel_hw_count) {
+        // Load the program
+        if (!is_enabled_pclock(RESETS_RESET_PIO0_BITS))
+            enable_pclock(RESETS_RESET_PIO0_BITS);
+        int i;
+        for (i = 0; i < ARRAY_SIZE(neopixel_program); i++)
+            neopixel_pio->instr_mem[i] = neopixel_program[i];
+        if (!is_enabled_pclock(RESETS_RESET_DMA_BITS))
+            enable_pclock(RESETS_RESET_DMA_BITS);
+    }
+    uint32_t sm = g->sm = neopixel_hw_count++;
+    pio_sm_hw_t *smhw = &neopixel_pio->sm[sm];
+
+    // Configure the state machine clock for an 800Khz bit rate
+    uint32_t pclk = get_pclock_frequency(RESETS_RESET_PIO0_BITS);
+    uint32_t cycle_freq = PROG_CYCLES_PER_BIT * (1000000000 / PROG_BIT_NSECS);
+    uint32_t div = ((uint64_t)pclk << 8) / cycle_freq;
+    smhw->clkdiv = ((div >> 8) << PIO_SM0_CLKDIV_INT_LSB
+                    | (div & 0xff) << PIO_SM0_CLKDIV_FRAC_LSB);
+    smhw->execctrl = PROG_WRAP_TOP << PIO_SM0_EXECCTRL_WRAP_TOP_LSB;
+    smhw->shiftctrl = (PIO_SM0_SHIFTCTRL_FJOIN_TX_BITS
+                       | PIO_SM0_SHIFTCTRL_AUTOPULL_BITS
+                       | (8 << PIO_SM0_SHIFTCTRL_PULL_THRESH_LSB));
+    smhw->pinctrl = ((1 << PIO_SM0_PINCTRL_SIDESET_COUNT_LSB)
+                     | (pin << PIO_SM0_PINCTRL_SIDESET_BASE_LSB)
+                     | (1 << PIO_SM0_PINCTRL_SET_COUNT_LSB)
+                     | (pin << PIO_SM0_PINCTRL_SET_BASE_LSB));
+    smhw->instr = INSTR_SET_PINS_0;
+    smhw->instr = INSTR_SET_PINDIRS_1;
+    smhw->instr = INSTR_JMP_0;
+
+    // Configure the dma channel
+    dma_channel_hw_t *ch = &dma_hw->ch[DMA_CHAN_BASE + sm];
+    ch->write_addr = (uint32_t)&neopixel_pio->txf[sm];
+    ch->al1_ctrl = (
+        DMA_CH0_CTRL_TRIG_EN_BITS
+        | (0 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB)
+        | DMA_CH0_CTRL_TRIG_INCR_READ_BITS
+        | ((DMA_CHAN_BASE + sm) << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB)
+        | ((DREQ_PIO0_TX0 + sm) << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB));
+
+    // Route the pin to the pio block
+    gpio_peripheral(pin, PIO_FUNC, 0);
+    neopixel_pio->ctrl |= 1 << (PIO_CTRL_SM_ENABLE_LSB + sm);
+    return 0;
+}
+
+// Check if a previous transmission is still being copied to the pio
+int
+gpio_neopixel_busy(struct gpio_neopixel g)
+{
+    dma_channel_hw_t *ch = &dma_hw->ch[DMA_CHAN_BASE + g.sm];
+    return !!(ch->ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS);
+}
+
+// Start transmitting 'len' bytes.  The data must not be modified until
+// the transmission completes.  Returns the transmission time in ticks.
+uint32_t
+gpio_neopixel_send(struct gpio_neopixel g, uint8_t *data, uint32_t len)
+{
+    if (!len)
+        return 0;
+    dma_channel_hw_t *ch = &dma_hw->ch[DMA_CHAN_BASE + g.sm];
+    ch->read_addr = (uint32_t)data;
+    ch->al1_transfer_count_trig = len;
+    return len * timer_from_us(8 * PROG_BIT_NSECS / 1000);
+}
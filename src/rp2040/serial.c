@@ -130,7 +130,8 @@ serial_init(void)
 
     // Enable fifo, set 8N1
     UARTx->lcr_h = UART_UARTLCR_H_FEN_BITS | UART_UARTLCR_H_WLEN_BITS;
-    UARTx->ifls = 0;
+    // Raise rx irq at half full (the rx timeout irq reports idle periods)
+    UARTx->ifls = 2 << UART_UARTIFLS_RXIFLSEL_LSB;
     UARTx->cr = (UART_UARTCR_RXE_BITS | UART_UARTCR_TXE_BITS
                  | UART_UARTCR_UARTEN_BITS);
 
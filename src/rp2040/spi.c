@@ -9,7 +9,11 @@
 #include "sched.h" // sched_shutdown"
 #include "internal.h" // pclock, gpio_peripheral
 #include "hardware/structs/spi.h" // spi_hw_t
+#include "hardware/structs/dma.h" // dma_hw
+#include "hardware/regs/dreq.h" // DREQ_SPI0_TX
 #include "hardware/regs/resets.h" // RESETS_RESET_SPI*_BITS
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
 #include "board/misc.h" // timer_is_before
 
 
@@ -110,10 +114,88 @@ spi_setup(uint32_t bus, uint8_t mode, uint32_t rate)
     return res;
 }
 
+
+
+/****************************************************************
+ * Asynchronous transfer tracking
+ ****************************************************************/
+
+// Each spi block uses a pair of dma channels (rx on the first one).
+// The stepper_hw.c code uses channels 8 and up.
+#define DMA_CHAN_BASE 0
+
+static struct spi_async *async_active[2];
+
+static uint32_t
+spi_index(spi_hw_t *spi)
+{
+    return spi == spi1_hw;
+}
+
+static uint32_t
+rx_chan(uint32_t idx)
+{
+    return DMA_CHAN_BASE + idx * 2;
+}
+
+// Finish an asynchronous transfer and invoke its callback
+static void
+spi_async_complete(uint32_t idx)
+{
+    struct spi_async *sa = async_active[idx];
+    if (!sa)
+        return;
+    dma_hw->ints0 = 1 << rx_chan(idx);
+    spi_hw_t *spi = idx ? spi1_hw : spi0_hw;
+    while (spi->sr & SPI_SSPSR_BSY_BITS)
+        ;
+    spi->dmacr = 0;
+    async_active[idx] = NULL;
+    sa->func(sa);
+}
+
+void
+SPI_DMA_IRQHandler(void)
+{
+    uint32_t ints = dma_hw->ints0;
+    uint32_t idx;
+    for (idx = 0; idx < ARRAY_SIZE(async_active); idx++)
+        if (ints & (1 << rx_chan(idx)))
+            spi_async_complete(idx);
+}
+
+// Wait for any asynchronous transfer on the bus to complete
+static void
+spi_async_wait(spi_hw_t *spi)
+{
+    uint32_t idx = spi_index(spi);
+    if (!async_active[idx])
+        return;
+    dma_channel_hw_t *rx = &dma_hw->ch[rx_chan(idx)];
+    while (rx->ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS)
+        ;
+    // Irqs may be disabled, so don't wait for the irq handler
+    irqstatus_t flag = irq_save();
+    spi_async_complete(idx);
+    irq_restore(flag);
+}
+
+void
+spi_transfer_wait(struct spi_config config)
+{
+    spi_async_wait(config.spi);
+}
+
+
+/****************************************************************
+ * Transfers
+ ****************************************************************/
+
 void
 spi_prepare(struct spi_config config)
 {
     spi_hw_t *spi = config.spi;
+    spi_async_wait(spi);
     if (spi->cr0 == config.cr0 && spi->cpsr == config.cpsr)
         return;
     uint32_t diff = spi->cr0 ^ config.cr0;
@@ -136,6 +218,7 @@ spi_transfer(struct spi_config config, uint8_t receive_data,
 {
     uint8_t *wptr = data, *end = data + len;
     spi_hw_t *spi = config.spi;
+    spi_async_wait(spi);
     while (data < end) {
         uint32_t sr = spi->sr & (SPI_SSPSR_TNF_BITS | SPI_SSPSR_RNE_BITS);
         if (sr == SPI_SSPSR_TNF_BITS && wptr < end && wptr < data + MAX_FIFO)
@@ -152,3 +235,47 @@ spi_transfer(struct spi_config config, uint8_t receive_data,
            != SPI_SSPSR_TFE_BITS)
         ;
 }
+
+// Start a dma transfer on the bus.  The callback is invoked from irq
+// context once the transfer completes.
+void
+spi_transfer_async(struct spi_config config, uint8_t receive_data
+                   , uint8_t len, uint8_t *data, struct spi_async *sa)
+{
+    spi_hw_t *spi = config.spi;
+    spi_async_wait(spi);
+    if (!len) {
+        sa->func(sa);
+        return;
+    }
+    uint32_t idx = spi_index(spi), chan = rx_chan(idx);
+    if (!(dma_hw->inte0 & (1 << chan))) {
+        // First use - enable dma irqs
+        if (!is_enabled_pclock(RESETS_RESET_DMA_BITS))
+            enable_pclock(RESETS_RESET_DMA_BITS);
+        armcm_enable_irq(SPI_DMA_IRQHandler, DMA_IRQ_0_IRQn, 2);
+        dma_hw->inte0 |= 1 << chan;
+    }
+    uint32_t dreq_tx = idx ? DREQ_SPI1_TX : DREQ_SPI0_TX;
+    uint32_t dreq_rx = idx ? DREQ_SPI1_RX : DREQ_SPI0_RX;
+
+    // Received bytes are discarded to a dummy location if not needed
+    static uint8_t discard;
+    dma_channel_hw_t *rx = &dma_hw->ch[chan], *tx = &dma_hw->ch[chan + 1];
+    rx->read_addr = (uint32_t)&spi->dr;
+    rx->write_addr = receive_data ? (uint32_t)data : (uint32_t)&discard;
+    rx->transfer_count = len;
+    rx->ctrl_trig = (DMA_CH0_CTRL_TRIG_EN_BITS
+                     | (receive_data ? DMA_CH0_CTRL_TRIG_INCR_WRITE_BITS : 0)
+                     | (chan << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB)
+                     | (dreq_rx << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB));
+    tx->read_addr = (uint32_t)data;
+    tx->write_addr = (uint32_t)&spi->dr;
+    tx->transfer_count = len;
+    async_active[idx] = sa;
+    spi->dmacr = SPI_SSPDMACR_TXDMAE_BITS | SPI_SSPDMACR_RXDMAE_BITS;
+    tx->ctrl_trig = (DMA_CH0_CTRL_TRIG_EN_BITS
+                     | DMA_CH0_CTRL_TRIG_INCR_READ_BITS
+                     | ((chan + 1) << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB)
+                     | (dreq_tx << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB));
+}
@@ -0,0 +1,274 @@
+// Hardware step pulse generation using the rp2040 PIO blocks
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_CLOCK_FREQ
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
+#include "command.h" // shutdown
+#include "internal.h" // get_pclock_frequency
+#include "sched.h" // sched_shutdown
+#include "stepper_hw.h" // stepper_hw_setup
+#include "hardware/regs/dreq.h" // DREQ_PIO1_TX0
+#include "hardware/structs/dma.h" // dma_hw
+#include "hardware/structs/iobank0.h" // iobank0_hw
+#include "hardware/structs/pio.h" // pio1_hw
+#include "hardware/structs/resets.h" // RESETS_RESET_PIO1_BITS
+
+// The PIO program waits for a delay (in pio cycles) in its tx fifo,
+// counts down that delay, and then generates a step pulse:
+//   0: pull block
+//   1: out x, 32
+//   2: jmp x--, 2
+//   3: set pins, 1
+//   4: mov x, y
+//   5: jmp x--, 5
+//   6: set pins, 0
+// The 'y' register holds the pulse duration.  Step pulses start x+y+7
+// cycles apart when the fifo is not empty, and x+3 cycles after a
+// delay is written to an idle state machine.
+static const uint16_t step_program[] = {
+    0x80a0, 0x6020, 0x0042, 0xe001, 0xa022, 0x0045, 0xe000
+};
+#define PROG_WRAP_TOP (ARRAY_SIZE(step_program) - 1)
+#define PROG_DELAY_START 1
+#define PROG_DELAY_END 3
+
+// Encoded instructions executed directly on a state machine
+#define INSTR_JMP_0        0x0000
+#define INSTR_PULL_BLOCK   0x80a0
+#define INSTR_MOV_Y_OSR    0xa047
+#define INSTR_SET_PINS_0   0xe000
+#define INSTR_SET_PINDIRS_1 0xe081
+
+#define PIO_FUNC 7
+
+// The can2040 code uses pio0, so step generators are placed on pio1
+#define step_pio pio1_hw
+
+// Step delays are written to a ring buffer in ram and then copied to
+// the pio tx fifo by a dma channel (which is paced by the fifo dreq)
+#define RING_SIZE 32
+#define RING_SIZE_BITS 7 // log2(RING_SIZE * sizeof(uint32_t))
+#define DMA_CHAN_BASE 8
+
+struct stepper_hw {
+    uint32_t ring[RING_SIZE] __aligned(RING_SIZE * sizeof(uint32_t));
+    uint32_t sm, dma_chan, pulse_cycles, frac, lag;
+    uint32_t ring_head, ring_sent;
+};
+
+static struct stepper_hw step_gens[ARRAY_SIZE(step_pio->sm)];
+static uint32_t step_gen_count, cycle_mult_hi, cycle_mult_lo;
+
+// Convert a duration in clock ticks to pio cycles (carrying the
+// fractional cycles over to the next conversion)
+static uint32_t
+ticks_to_cycles(struct stepper_hw *hw, int32_t ticks)
+{
+    if (ticks <= 0)
+        return 0;
+    uint64_t lo = (uint64_t)ticks * cycle_mult_lo + hw->frac;
+    hw->frac = lo;
+    return ticks * cycle_mult_hi + (uint32_t)(lo >> 32);
+}
+
+// Enable or disable a state machine
+static void
+sm_enable(uint32_t sm, int enable)
+{
+    irqstatus_t flag = irq_save();
+    uint32_t ctrl = step_pio->ctrl & ~(1 << (PIO_CTRL_SM_ENABLE_LSB + sm));
+    step_pio->ctrl = ctrl | (enable << (PIO_CTRL_SM_ENABLE_LSB + sm));
+    irq_restore(flag);
+}
+
+// Start a dma transfer of any unsent ring entries (if dma is idle)
+static void
+ring_kick(struct stepper_hw *hw)
+{
+    dma_channel_hw_t *ch = &dma_hw->ch[hw->dma_chan];
+    uint32_t count = hw->ring_head - hw->ring_sent;
+    if (!count || ch->ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS)
+        return;
+    ch->read_addr = (uint32_t)&hw->ring[hw->ring_sent % RING_SIZE];
+    ch->al1_transfer_count_trig = count;
+    hw->ring_sent = hw->ring_head;
+}
+
+// Continue transfers once a dma channel completes
+void
+StepperHW_IRQHandler(void)
+{
+    uint32_t ints = dma_hw->ints1;
+    dma_hw->ints1 = ints;
+    uint32_t i;
+    for (i = 0; i < step_gen_count; i++)
+        if (ints & (1 << step_gens[i].dma_chan))
+            ring_kick(&step_gens[i]);
+}
+
+// Allocate and configure a pio state machine for a step pin
+struct stepper_hw *
+stepper_hw_setup(uint8_t pin, uint8_t invert, uint32_t pulse_ticks)
+{
+    if (pin >= 30)
+        shutdown("Not a valid step pin");
+    if (step_gen_count >= ARRAY_SIZE(step_gens))
+        shutdown("No free hardware step generators");
+    if (!step_gen_count) {
+        // Load the program
+        if (!is_enabled_pclock(RESETS_RESET_PIO1_BITS))
+            enable_pclock(RESETS_RESET_PIO1_BITS);
+        int i;
+        for (i = 0; i < ARRAY_SIZE(step_program); i++)
+            step_pio->instr_mem[i] = step_program[i];
+        uint32_t pclk = get_pclock_frequency(RESETS_RESET_PIO1_BITS);
+        uint64_t mult = ((uint64_t)pclk << 32) / CONFIG_CLOCK_FREQ;
+        cycle_mult_hi = mult >> 32;
+        cycle_mult_lo = mult;
+
+        // Enable dma irqs
+        if (!is_enabled_pclock(RESETS_RESET_DMA_BITS))
+            enable_pclock(RESETS_RESET_DMA_BITS);
+        armcm_enable_irq(StepperHW_IRQHandler, DMA_IRQ_1_IRQn, 2);
+    }
+    struct stepper_hw *hw = &step_gens[step_gen_count];
+    uint32_t sm = hw->sm = step_gen_count++;
+    pio_sm_hw_t *smhw = &step_pio->sm[sm];
+
+    // Configure the state machine
+    sm_enable(sm, 0);
+    smhw->clkdiv = 1 << PIO_SM0_CLKDIV_INT_LSB;
+    smhw->execctrl = PROG_WRAP_TOP << PIO_SM0_EXECCTRL_WRAP_TOP_LSB;
+    smhw->shiftctrl = (PIO_SM0_SHIFTCTRL_FJOIN_TX_BITS
+                       | PIO_SM0_SHIFTCTRL_OUT_SHIFTDIR_BITS);
+    smhw->pinctrl = ((1 << PIO_SM0_PINCTRL_SET_COUNT_LSB)
+                     | (pin << PIO_SM0_PINCTRL_SET_BASE_LSB));
+    smhw->instr = INSTR_SET_PINS_0;
+    smhw->instr = INSTR_SET_PINDIRS_1;
+
+    // Store the pulse duration in the 'y' register
+    uint32_t pulse_cycles = ticks_to_cycles(hw, pulse_ticks);
+    hw->pulse_cycles = pulse_cycles > 3 ? pulse_cycles : 3;
+    step_pio->txf[sm] = hw->pulse_cycles - 3;
+    smhw->instr = INSTR_PULL_BLOCK;
+    smhw->instr = INSTR_MOV_Y_OSR;
+    smhw->instr = INSTR_JMP_0;
+    hw->frac = 0;
+
+    // Configure the dma channel
+    uint32_t chan = hw->dma_chan = DMA_CHAN_BASE + sm;
+    dma_channel_hw_t *ch = &dma_hw->ch[chan];
+    ch->write_addr = (uint32_t)&step_pio->txf[sm];
+    ch->al1_ctrl = (
+        DMA_CH0_CTRL_TRIG_EN_BITS
+        | (2 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB)
+        | DMA_CH0_CTRL_TRIG_INCR_READ_BITS
+        | (RING_SIZE_BITS << DMA_CH0_CTRL_TRIG_RING_SIZE_LSB)
+        | (chan << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB)
+        | ((DREQ_PIO1_TX0 + sm) << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB));
+    dma_hw->inte1 |= 1 << chan;
+
+    // Route the pin to the pio block
+    gpio_peripheral(pin, PIO_FUNC, 0);
+    if (invert)
+        iobank0_hw->io[pin].ctrl |= (IO_BANK0_GPIO0_CTRL_OUTOVER_VALUE_INVERT
+                                     << IO_BANK0_GPIO0_CTRL_OUTOVER_LSB);
+
+    sm_enable(sm, 1);
+    return hw;
+}
+
+// Return the number of ring entries not yet copied to the pio fifo
+static uint32_t
+ring_pending(struct stepper_hw *hw)
+{
+    dma_channel_hw_t *ch = &dma_hw->ch[hw->dma_chan];
+    uint32_t count = hw->ring_head - hw->ring_sent;
+    if (ch->ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS)
+        count += ch->transfer_count;
+    return count;
+}
+
+// Return the number of fifo and state machine steps not yet started
+static uint32_t
+sm_pending(struct stepper_hw *hw)
+{
+    uint32_t count = (step_pio->flevel >> (hw->sm * 8)) & 0xf;
+    uint32_t addr = step_pio->sm[hw->sm].addr;
+    return count + (addr >= PROG_DELAY_START && addr <= PROG_DELAY_END);
+}
+
+// Return the number of delays that may be added to the queue
+uint_fast8_t
+stepper_hw_space(struct stepper_hw *hw)
+{
+    return RING_SIZE - ring_pending(hw);
+}
+
+// Return the number of steps that have been queued but not yet started
+uint_fast8_t
+stepper_hw_pending(struct stepper_hw *hw)
+{
+    // Read in the order entries move through the hardware, so a step
+    // may be counted twice (but is never missed)
+    uint32_t count = ring_pending(hw);
+    return count + sm_pending(hw);
+}
+
+// Queue a step to occur 'ticks' after the start of the previous step
+void
+stepper_hw_push(struct stepper_hw *hw, int32_t ticks)
+{
+    // A step that can not start on time delays the following steps
+    // until the extra time is recovered
+    uint32_t cycles = ticks_to_cycles(hw, ticks);
+    uint32_t min_cycles = hw->pulse_cycles + 4 + hw->lag, delay = 0;
+    if (cycles >= min_cycles) {
+        delay = cycles - min_cycles;
+        hw->lag = 0;
+    } else {
+        hw->lag = min_cycles - cycles;
+    }
+    hw->ring[hw->ring_head++ % RING_SIZE] = delay;
+    ring_kick(hw);
+}
+
+// Queue a step to occur 'ticks' from now on an idle state machine
+// (written directly to the fifo to avoid the dma latency)
+void
+stepper_hw_start(struct stepper_hw *hw, int32_t ticks)
+{
+    hw->frac = hw->lag = 0;
+    uint32_t cycles = ticks_to_cycles(hw, ticks);
+    step_pio->txf[hw->sm] = cycles > 3 ? cycles - 3 : 0;
+}
+
+// Halt a state machine and discard its queued steps.  Returns the
+// number of steps that were discarded.
+uint_fast8_t
+stepper_hw_stop(struct stepper_hw *hw)
+{
+    uint32_t sm = hw->sm, chan_bit = 1 << hw->dma_chan;
+    pio_sm_hw_t *smhw = &step_pio->sm[sm];
+    sm_enable(sm, 0);
+    dma_hw->abort = chan_bit;
+    while (dma_hw->abort & chan_bit)
+        ;
+    // The aborted channel is no longer busy, but its transfer count
+    // still holds the number of entries it did not copy
+    uint_fast8_t pending = (hw->ring_head - hw->ring_sent
+                            + dma_hw->ch[hw->dma_chan].transfer_count
+                            + sm_pending(hw));
+    hw->ring_head = hw->ring_sent = 0;
+    // Changing the fifo join setting clears the fifo
+    smhw->shiftctrl ^= PIO_SM0_SHIFTCTRL_FJOIN_TX_BITS;
+    smhw->shiftctrl ^= PIO_SM0_SHIFTCTRL_FJOIN_TX_BITS;
+    smhw->instr = INSTR_SET_PINS_0;
+    smhw->instr = INSTR_JMP_0;
+    sm_enable(sm, 1);
+    return pending;
+}
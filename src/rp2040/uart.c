@@ -0,0 +1,90 @@
+// Half-duplex use of the rp2040 uarts (for tmcuart)
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_CLOCK_FREQ
+#include "compiler.h" // DIV_ROUND_CLOSEST
+#include "gpio.h" // gpio_uart_setup
+#include "hardware/structs/resets.h" // RESETS_RESET_UART0_BITS
+#include "hardware/structs/uart.h" // uart0_hw
+#include "internal.h" // gpio_peripheral
+
+#define UART_FUNC 2
+
+// Each group of four pins maps to tx, rx, cts, rts of one uart
+static int
+pin_to_uart(uint32_t pin)
+{
+    return ((pin + 4) >> 3) & 1;
+}
+
+// Configure a uart for the given tx/rx pins.  Returns non-zero if the
+// pins are not a uart pin pair or the uart is already in use.
+int
+gpio_uart_setup(uint32_t rx_pin, uint32_t tx_pin, int8_t pull_up
+                , uint32_t bit_ticks, struct gpio_uart *g)
+{
+    if (tx_pin >= 30 || tx_pin & 0x03 || rx_pin != tx_pin + 1 || !bit_ticks)
+        return -1;
+    uart_hw_t *uart = pin_to_uart(tx_pin) ? uart1_hw : uart0_hw;
+    uint32_t reset_bit = (uart == uart0_hw ? RESETS_RESET_UART0_BITS
+                          : RESETS_RESET_UART1_BITS);
+    if (is_enabled_pclock(reset_bit))
+        // Uart in use (for example, by the serial console)
+        return -1;
+    enable_pclock(reset_bit);
+
+    // Setup baud
+    uint32_t pclk = get_pclock_frequency(reset_bit);
+    uint32_t baud = DIV_ROUND_CLOSEST(CONFIG_CLOCK_FREQ, bit_ticks);
+    uint32_t div = DIV_ROUND_CLOSEST(pclk * 4, baud);
+    uart->ibrd = div >> 6;
+    uart->fbrd = div & 0x3f;
+
+    // Enable fifo, set 8N1
+    uart->lcr_h = UART_UARTLCR_H_FEN_BITS | UART_UARTLCR_H_WLEN_BITS;
+    uart->cr = (UART_UARTCR_RXE_BITS | UART_UARTCR_TXE_BITS
+                | UART_UARTCR_UARTEN_BITS);
+
+    // Setup pins
+    gpio_peripheral(rx_pin, UART_FUNC, pull_up);
+    gpio_peripheral(tx_pin, UART_FUNC, 0);
+
+    g->uart = uart;
+    return 0;
+}
+
+// Queue bytes for transmission (the tx fifo holds 32 bytes)
+void
+gpio_uart_write(struct gpio_uart g, uint8_t *data, uint_fast8_t len)
+{
+    uart_hw_t *uart = g.uart;
+    while (len--)
+        uart->dr = *data++;
+}
+
+// Check if the uart is still transmitting
+int
+gpio_uart_tx_busy(struct gpio_uart g)
+{
+    uart_hw_t *uart = g.uart;
+    return !!(uart->fr & UART_UARTFR_BUSY_BITS);
+}
+
+// Read a received byte.  Returns -1 if no data is available, otherwise
+// the byte (with GPIO_UART_ERROR set on a framing or parity error).
+int
+gpio_uart_read(struct gpio_uart g)
+{
+    uart_hw_t *uart = g.uart;
+    if (uart->fr & UART_UARTFR_RXFE_BITS)
+        return -1;
+    uint32_t dr = uart->dr;
+    int ret = dr & 0xff;
+    if (dr & (UART_UARTDR_OE_BITS | UART_UARTDR_BE_BITS
+              | UART_UARTDR_PE_BITS | UART_UARTDR_FE_BITS))
+        ret |= GPIO_UART_ERROR;
+    return ret;
+}
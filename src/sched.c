@@ -67,6 +67,18 @@ static struct timer sentinel_timer = {
     .waketime = 0x80000000,
 };
 
+// 删除定时器时使用的占位定时器
+static uint_fast8_t
+deleted_event(struct timer *t)
+{
+    return SF_DONE;  // 返回完成标志
+}
+
+// 删除定时器的占位定时器定义
+static struct timer deleted_timer = {
+    .func = deleted_event,
+};
+
 // 在定时器列表中找到定时器的位置并插入它
 static void __always_inline
 insert_timer(struct timer *pos, struct timer *t, uint32_t waketime)
@@ -88,20 +100,461 @@ insert_timer(struct timer *pos, struct timer *t, uint32_t waketime)
     prev->next = t;
 }
 
+// 记录定时器插入所用的最长时间（用于统计）
+static uint32_t timer_insert_max;
+
+static inline uint32_t
+insert_stats_start(void)
+{
+    return CONFIG_WANT_SCHED_TIMER_STATS ? timer_read_time() : 0;
+}
+
+static inline void
+insert_stats_end(uint32_t start)
+{
+    if (!CONFIG_WANT_SCHED_TIMER_STATS)
+        return;
+    uint32_t diff = timer_read_time() - start;
+    if (diff > timer_insert_max)
+        timer_insert_max = diff;
+}
+
+// 返回（并重置）定时器插入所用的最长时间
+uint32_t
+sched_timer_insert_max(void)
+{
+    irqstatus_t flag = irq_save();
+    uint32_t max = timer_insert_max;
+    timer_insert_max = 0;
+    irq_restore(flag);
+    return max;
+}
+
+
+/****************************************************************
+ * 性能分析
+ ****************************************************************/
+
+// 统计的定时器回调函数和任务函数的最大数量
+#define PROFILE_TIMER_FUNCS 8
+#define PROFILE_TASK_FUNCS 32
+
+struct profile_stats {
+    uint32_t count, sum, max;
+};
+
+static struct {
+    uint32_t irq_latency_max, dispatch_max;
+    uint_fast8_t (*timer_funcs[PROFILE_TIMER_FUNCS])(struct timer*);
+    struct profile_stats timers[PROFILE_TIMER_FUNCS];
+    struct profile_stats tasks[PROFILE_TASK_FUNCS];
+} Profile;
+
+static void
+profile_update(struct profile_stats *s, uint32_t diff)
+{
+    s->count++;
+    s->sum += diff;
+    if (diff > s->max)
+        s->max = diff;
+}
+
+// 在调用定时器回调函数之前记录中断延迟（定时器唤醒时间之后的时长）
+static inline uint32_t
+profile_timer_start(struct timer *t)
+{
+    if (!CONFIG_WANT_SCHED_PROFILE)
+        return 0;
+    uint32_t cur = timer_read_time();
+    int32_t latency = cur - t->waketime;
+    if (latency > 0 && (uint32_t)latency > Profile.irq_latency_max)
+        Profile.irq_latency_max = latency;
+    return cur;
+}
+
+// 记录定时器回调函数的运行时间
+static inline void
+profile_timer_func(uint_fast8_t (*func)(struct timer*), uint32_t start)
+{
+    if (!CONFIG_WANT_SCHED_PROFILE)
+        return;
+    uint32_t diff = timer_read_time() - start;
+    if (CONFIG_INLINE_STEPPER_HACK && !func)
+        func = stepper_event;
+    uint_fast8_t i;
+    for (i = 0; i < ARRAY_SIZE(Profile.timer_funcs); i++) {
+        if (!Profile.timer_funcs[i])
+            Profile.timer_funcs[i] = func;
+        if (Profile.timer_funcs[i] == func) {
+            profile_update(&Profile.timers[i], diff);
+            break;
+        }
+    }
+}
+
+// 记录sched_timer_dispatch()的总运行时间（包括定时器队列更新）
+static inline void
+profile_timer_end(uint32_t start)
+{
+    if (!CONFIG_WANT_SCHED_PROFILE)
+        return;
+    uint32_t diff = timer_read_time() - start;
+    if (diff > Profile.dispatch_max)
+        Profile.dispatch_max = diff;
+}
+
+#if CONFIG_WANT_SCHED_PROFILE
+
+// 在运行任务函数之前调用（来自SCHED_RUN_TASK宏）
+uint32_t
+sched_profile_task_start(void)
+{
+    return timer_read_time();
+}
+
+// 记录任务函数的运行时间（来自SCHED_RUN_TASK宏）
+void
+sched_profile_task(uint_fast8_t task_id, uint32_t start)
+{
+    uint32_t diff = timer_read_time() - start;
+    if (task_id < ARRAY_SIZE(Profile.tasks))
+        profile_update(&Profile.tasks[task_id], diff);
+}
+
+// 读取并重置一组统计数据
+static void
+profile_take(struct profile_stats *s, struct profile_stats *out)
+{
+    irqstatus_t flag = irq_save();
+    *out = *s;
+    s->count = s->sum = s->max = 0;
+    irq_restore(flag);
+}
+
+// 定期发送性能分析报告（从stats_update调用）。每次调用最多发送一条
+// 消息，以免填满发送缓冲区。
+void
+sched_profile_report(uint32_t cur)
+{
+    static uint32_t report_time, send_time;
+    static uint_fast8_t report_pos;
+    if (!report_pos) {
+        if (cur - report_time < timer_from_us(5000000))
+            return;
+        report_time = send_time = cur;
+        irqstatus_t flag = irq_save();
+        uint32_t irq_latency_max = Profile.irq_latency_max;
+        uint32_t dispatch_max = Profile.dispatch_max;
+        Profile.irq_latency_max = Profile.dispatch_max = 0;
+        irq_restore(flag);
+        sendf("profile_report irq_latency_max=%u dispatch_max=%u"
+              , irq_latency_max, dispatch_max);
+        report_pos = 1;
+        return;
+    }
+    if (cur - send_time < timer_from_us(10000))
+        return;
+    struct profile_stats s;
+    while (report_pos <= PROFILE_TIMER_FUNCS) {
+        uint_fast8_t i = report_pos++ - 1;
+        profile_take(&Profile.timers[i], &s);
+        if (!s.count)
+            continue;
+        sendf("profile_timer func=%u count=%u sum=%u max=%u"
+              , (uint32_t)(size_t)Profile.timer_funcs[i]
+              , s.count, s.sum, s.max);
+        send_time = cur;
+        return;
+    }
+    while (report_pos <= PROFILE_TIMER_FUNCS + PROFILE_TASK_FUNCS) {
+        uint_fast8_t i = report_pos++ - 1 - PROFILE_TIMER_FUNCS;
+        profile_take(&Profile.tasks[i], &s);
+        if (!s.count)
+            continue;
+        sendf("profile_task task_func=%c count=%u sum=%u max=%u"
+              , i, s.count, s.sum, s.max);
+        send_time = cur;
+        return;
+    }
+    report_pos = 0;
+}
+
+#endif // CONFIG_WANT_SCHED_PROFILE
+
+
+/****************************************************************
+ * 调度跟踪
+ ****************************************************************/
+
+#if CONFIG_WANT_SCHED_TRACE
+
+struct trace_entry {
+    uint8_t type;
+    uint32_t info, waketime, time;
+};
+
+// 最近事件的环形缓冲区
+static struct {
+    struct trace_entry entries[CONFIG_SCHED_TRACE_SIZE];
+    uint8_t pos, count;
+} Trace;
+
+// 记录一个跟踪条目（关机后停止记录，以保留导致关机的事件）
+void
+sched_trace(uint_fast8_t type, uint32_t info, uint32_t waketime)
+{
+    if (SchedStatus.shutdown_status)
+        return;
+    irqstatus_t flag = irq_save();
+    struct trace_entry *e = &Trace.entries[Trace.pos];
+    e->type = type;
+    e->info = info;
+    e->waketime = waketime;
+    e->time = timer_read_time();
+    if (++Trace.pos >= ARRAY_SIZE(Trace.entries))
+        Trace.pos = 0;
+    if (Trace.count < ARRAY_SIZE(Trace.entries))
+        Trace.count++;
+    irq_restore(flag);
+}
+
+// 报告一个跟踪条目（pos为0表示最早的条目）
+void
+command_sched_trace_query(uint32_t *args)
+{
+    uint_fast8_t pos = args[0];
+    struct trace_entry e = { 0 };
+    irqstatus_t flag = irq_save();
+    uint_fast8_t count = Trace.count;
+    if (pos < count) {
+        int_fast16_t idx = Trace.pos - count + pos;
+        if (idx < 0)
+            idx += ARRAY_SIZE(Trace.entries);
+        e = Trace.entries[idx];
+    }
+    irq_restore(flag);
+    sendf("sched_trace_entry pos=%c count=%c type=%c info=%u"
+          " waketime=%u time=%u"
+          , pos, count, e.type, e.info, e.waketime, e.time);
+}
+DECL_COMMAND_FLAGS(command_sched_trace_query, HF_IN_SHUTDOWN
+                   , "sched_trace_query pos=%c");
+
+#endif // CONFIG_WANT_SCHED_TRACE
+
+// 在调用定时器回调函数之前记录跟踪条目
+static inline void
+trace_timer(struct timer *t, uint_fast8_t (*func)(struct timer*))
+{
+    if (!CONFIG_WANT_SCHED_TRACE)
+        return;
+    if (CONFIG_INLINE_STEPPER_HACK && !func)
+        func = stepper_event;
+    sched_trace(ST_TIMER, (uint32_t)(size_t)func, t->waketime);
+}
+
+#if CONFIG_WANT_SCHED_TIMER_HEAP
+
+/****************************************************************
+ * 二叉堆定时器队列
+ ****************************************************************/
+
+// 定时器按唤醒时间存储在二叉堆中 - timer_heap[0]总是下一个要执行的
+// 定时器。周期性定时器始终在堆中，因此堆永远不会为空。
+// deleted_timer只会出现在堆顶（或根本不在堆中）。
+static struct timer *timer_heap[CONFIG_SCHED_TIMER_HEAP_SIZE] = {
+    &periodic_timer
+};
+static uint_fast8_t timer_heap_count = 1;
+
+// 将定时器从指定位置向上移动到合适的位置
+static void
+heap_sift_up(uint_fast8_t pos, struct timer *t)
+{
+    uint32_t waketime = t->waketime;
+    while (pos) {
+        uint_fast8_t parent = (pos - 1) / 2;
+        struct timer *p = timer_heap[parent];
+        if (!timer_is_before(waketime, p->waketime))
+            break;
+        timer_heap[pos] = p;
+        pos = parent;
+    }
+    timer_heap[pos] = t;
+}
+
+// 将定时器从指定位置向下移动到合适的位置
+static void
+heap_sift_down(uint_fast8_t pos, struct timer *t)
+{
+    uint32_t waketime = t->waketime;
+    uint_fast8_t count = timer_heap_count;
+    for (;;) {
+        uint_fast8_t child = 2 * pos + 1;
+        if (child >= count)
+            break;
+        struct timer *c = timer_heap[child];
+        if (child + 1 < count
+            && timer_is_before(timer_heap[child+1]->waketime, c->waketime))
+            c = timer_heap[++child];
+        if (!timer_is_before(c->waketime, waketime))
+            break;
+        timer_heap[pos] = c;
+        pos = child;
+    }
+    timer_heap[pos] = t;
+}
+
+// 将定时器添加到堆中
+static void
+heap_insert(struct timer *t)
+{
+    if (timer_heap_count >= ARRAY_SIZE(timer_heap)) {
+        // 可能在中断上下文中调用 - 不能使用shutdown()
+        try_shutdown("Timer heap overflow");
+        return;
+    }
+    heap_sift_up(timer_heap_count++, t);
+}
+
+// 从堆中移除指定位置的定时器
+static void
+heap_remove(uint_fast8_t pos)
+{
+    struct timer *last = timer_heap[--timer_heap_count];
+    if (pos >= timer_heap_count)
+        return;
+    if (pos && timer_is_before(last->waketime
+                               , timer_heap[(pos - 1) / 2]->waketime))
+        heap_sift_up(pos, last);
+    else
+        heap_sift_down(pos, last);
+}
+
+// 查找定时器在堆中的位置（如果不在堆中则返回-1）
+static int_fast8_t
+heap_find(struct timer *t)
+{
+    uint_fast8_t i;
+    for (i = 0; i < timer_heap_count; i++)
+        if (timer_heap[i] == t)
+            return i;
+    return -1;
+}
+
 // 在指定时间调度函数调用
 void
 sched_add_timer(struct timer *add)
 {
     uint32_t waketime = add->waketime;
     irqstatus_t flag = irq_save();  // 保存中断状态并禁用中断
+    uint32_t start = insert_stats_start();
+    struct timer *tl = timer_heap[0];
+
+    // 如果这个定时器比所有其他已调度的定时器都早
+    if (unlikely(timer_is_before(waketime, tl->waketime))) {
+        // 检查定时器是否太接近当前时间
+        if (timer_is_before(waketime, timer_read_time()))
+            try_shutdown("Timer too close");
+
+        // 在新定时器之前放置deleted_timer，这样硬件定时器的提前
+        // 触发（由timer_kick()引起）不会提前调用新定时器
+        deleted_timer.waketime = waketime;
+        if (tl != &deleted_timer)
+            heap_insert(&deleted_timer);
+        heap_insert(add);
+        timer_kick();  // 通知硬件定时器
+    } else {
+        heap_insert(add);
+    }
+    insert_stats_end(start);
+    irq_restore(flag);  // 恢复中断状态
+}
+
+// 删除可能正在运行的定时器
+void
+sched_del_timer(struct timer *del)
+{
+    irqstatus_t flag = irq_save();  // 保存中断状态并禁用中断
+    int_fast8_t pos = heap_find(del);
+    if (pos == 0) {
+        // 删除下一个活动定时器 - 用deleted_timer替换
+        deleted_timer.waketime = del->waketime;
+        timer_heap[0] = &deleted_timer;
+    } else if (pos > 0) {
+        heap_remove(pos);
+    }
+    irq_restore(flag);  // 恢复中断状态
+}
+
+// 调用下一个定时器 - 从板硬件中断代码调用
+unsigned int __hotfunc
+sched_timer_dispatch(void)
+{
+    // 调用定时器回调函数
+    struct timer *t = timer_heap[0];
+    uint_fast8_t (*func)(struct timer*) = t->func;
+    uint_fast8_t res;
+    uint32_t prof_start = profile_timer_start(t);
+    trace_timer(t, func);
+
+    // 步进器的内联优化
+    if (CONFIG_INLINE_STEPPER_HACK && likely(!func))
+        res = stepper_event(t);
+    else
+        res = func(t);
+    profile_timer_func(func, prof_start);
+
+    // 更新定时器堆（如果需要，重新调度当前定时器）
+    uint32_t start = insert_stats_start();
+    if (likely(timer_heap[0] == t)) {
+        if (unlikely(res == SF_DONE))
+            heap_remove(0);
+        else
+            heap_sift_down(0, t);
+    } else {
+        // 回调函数修改了堆顶 - 查找当前定时器
+        int_fast8_t pos = heap_find(t);
+        if (pos >= 0) {
+            heap_remove(pos);
+            if (res != SF_DONE)
+                heap_insert(t);
+        }
+    }
+    insert_stats_end(start);
+    profile_timer_end(prof_start);
+
+    return timer_heap[0]->waketime;
+}
+
+// 删除所有用户定时器
+void
+sched_timer_reset(void)
+{
+    deleted_timer.waketime = periodic_timer.waketime;
+    timer_heap[0] = &deleted_timer;
+    timer_heap[1] = &periodic_timer;
+    timer_heap_count = 2;
+    timer_kick();  // 通知硬件定时器
+}
+
+#else // CONFIG_WANT_SCHED_TIMER_HEAP
+
+// 在指定时间调度函数调用
+void
+sched_add_timer(struct timer *add)
+{
+    uint32_t waketime = add->waketime;
+    irqstatus_t flag = irq_save();  // 保存中断状态并禁用中断
+    uint32_t start = insert_stats_start();
     struct timer *tl = SchedStatus.timer_list;
-    
+
     // 如果这个定时器比所有其他已调度的定时器都早
     if (unlikely(timer_is_before(waketime, tl->waketime))) {
         // 检查定时器是否太接近当前时间
         if (timer_is_before(waketime, timer_read_time()))
             try_shutdown("Timer too close");
-        
+
         // 将新定时器设置为第一个要执行的定时器
         if (tl == &deleted_timer)
             add->next = deleted_timer.next;
@@ -115,27 +568,16 @@ sched_add_timer(struct timer *add)
         // 在合适的位置插入定时器
         insert_timer(tl, add, waketime);
     }
+    insert_stats_end(start);
     irq_restore(flag);  // 恢复中断状态
 }
 
-// 删除定时器时使用的占位定时器
-static uint_fast8_t
-deleted_event(struct timer *t)
-{
-    return SF_DONE;  // 返回完成标志
-}
-
-// 删除定时器的占位定时器定义
-static struct timer deleted_timer = {
-    .func = deleted_event,
-};
-
 // 删除可能正在运行的定时器
 void
 sched_del_timer(struct timer *del)
 {
     irqstatus_t flag = irq_save();  // 保存中断状态并禁用中断
-    
+
     if (SchedStatus.timer_list == del) {
         // 删除下一个活动定时器 - 用deleted_timer替换
         deleted_timer.waketime = del->waketime;
@@ -158,22 +600,26 @@ sched_del_timer(struct timer *del)
 }
 
 // 调用下一个定时器 - 从板硬件中断代码调用
-unsigned int
+unsigned int __hotfunc
 sched_timer_dispatch(void)
 {
     // 调用定时器回调函数
     struct timer *t = SchedStatus.timer_list;
+    uint_fast8_t (*func)(struct timer*) = t->func;
     uint_fast8_t res;
     uint32_t updated_waketime;
-    
+    uint32_t prof_start = profile_timer_start(t);
+    trace_timer(t, func);
+
     // 步进器的内联优化
-    if (CONFIG_INLINE_STEPPER_HACK && likely(!t->func)) {
+    if (CONFIG_INLINE_STEPPER_HACK && likely(!func)) {
         res = stepper_event(t);
         updated_waketime = t->waketime;
     } else {
-        res = t->func(t);
+        res = func(t);
         updated_waketime = t->waketime;
     }
+    profile_timer_func(func, prof_start);
 
     // 更新定时器列表（如果需要，重新调度当前定时器）
     unsigned int next_waketime = updated_waketime;
@@ -185,6 +631,7 @@ sched_timer_dispatch(void)
             SchedStatus.last_insert = t->next;
     } else if (!timer_is_before(updated_waketime, t->next->waketime)) {
         // 定时器需要重新调度
+        uint32_t start = insert_stats_start();
         next_waketime = t->next->waketime;
         SchedStatus.timer_list = t->next;
         struct timer *pos = SchedStatus.last_insert;
@@ -192,7 +639,9 @@ sched_timer_dispatch(void)
             pos = SchedStatus.timer_list;
         insert_timer(pos, t, updated_waketime);
         SchedStatus.last_insert = t;
+        insert_stats_end(start);
     }
+    profile_timer_end(prof_start);
 
     return next_waketime;
 }
@@ -208,6 +657,8 @@ sched_timer_reset(void)
     timer_kick();  // 通知硬件定时器
 }
 
+#endif // CONFIG_WANT_SCHED_TIMER_HEAP
+
 
 /****************************************************************
  * 任务管理
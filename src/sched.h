@@ -2,6 +2,7 @@
 #define __SCHED_H
 
 #include <stdint.h> // uint32_t
+#include "autoconf.h" // CONFIG_WANT_SCHED_PROFILE
 #include "ctr.h" // DECL_CTR
 
 // Declare an init function (called at firmware startup)
@@ -20,6 +21,9 @@ struct timer {
 
 enum { SF_DONE=0, SF_RESCHEDULE=1 };
 
+// Scheduler trace entry types (see sched_trace() )
+enum { ST_TIMER=1, ST_COMMAND=2 };
+
 // Task waking struct
 struct task_wake {
     uint8_t wake;
@@ -30,6 +34,10 @@ void sched_add_timer(struct timer*);
 void sched_del_timer(struct timer *del);
 unsigned int sched_timer_dispatch(void);
 void sched_timer_reset(void);
+uint32_t sched_timer_insert_max(void);
+uint32_t sched_profile_task_start(void);
+void sched_profile_task(uint_fast8_t task_id, uint32_t start);
+void sched_profile_report(uint32_t cur);
 void sched_wake_tasks(void);
 uint8_t sched_check_set_tasks_busy(void);
 void sched_wake_task(struct task_wake *w);
@@ -41,6 +49,25 @@ void sched_shutdown(uint_fast8_t reason) __noreturn;
 void sched_report_shutdown(void);
 void sched_main(void);
 
+// Record a scheduler trace entry (when enabled)
+#if CONFIG_WANT_SCHED_TRACE
+void sched_trace(uint_fast8_t type, uint32_t info, uint32_t waketime);
+#else
+static inline void
+sched_trace(uint_fast8_t type, uint32_t info, uint32_t waketime) { }
+#endif
+
+// Run a task function (used by generated ctr_run_taskfuncs() code)
+#if CONFIG_WANT_SCHED_PROFILE
+#define SCHED_RUN_TASK(FUNC, ID) do {                                   \
+        uint32_t __start = sched_profile_task_start();                  \
+        FUNC();                                                         \
+        sched_profile_task((ID), __start);                              \
+    } while (0)
+#else
+#define SCHED_RUN_TASK(FUNC, ID) FUNC()
+#endif
+
 // Compiler glue for DECL_X macros above.
 #define _DECL_CALLLIST(NAME, FUNC)                                      \
     DECL_CTR("_DECL_CALLLIST " __stringify(NAME) " " __stringify(FUNC))
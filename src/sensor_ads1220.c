@@ -23,6 +23,7 @@ struct ads1220_adc {
     uint8_t pending_flag, data_count;
     struct sensor_bulk sb;
     struct load_cell_probe *lce;
+    uint8_t lce_channel;
 };
 
 // Flag types
@@ -98,7 +99,8 @@ ads1220_read_adc(struct ads1220_adc *ads1220, uint8_t oid)
 
     // endstop is optional, report if enabled and no errors
     if (ads1220->lce) {
-        load_cell_probe_report_sample(ads1220->lce, counts);
+        load_cell_probe_report_sample(ads1220->lce, ads1220->lce_channel
+                                      , counts);
     }
 
     add_sample(ads1220, oid, counts);
@@ -123,9 +125,10 @@ ads1220_attach_load_cell_probe(uint32_t *args) {
     uint8_t oid = args[0];
     struct ads1220_adc *ads1220 = oid_lookup(oid, command_config_ads1220);
     ads1220->lce = load_cell_probe_oid_lookup(args[1]);
+    ads1220->lce_channel = args[2];
 }
 DECL_COMMAND(ads1220_attach_load_cell_probe,
-    "ads1220_attach_load_cell_probe oid=%c load_cell_probe_oid=%c");
+    "ads1220_attach_load_cell_probe oid=%c load_cell_probe_oid=%c channel=%c");
 
 // start/stop capturing ADC data
 void
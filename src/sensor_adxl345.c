@@ -4,25 +4,34 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <string.h> // memcpy
+#include <string.h> // memset
+#include "autoconf.h" // CONFIG_WANT_SENSOR_DECIMATE
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_read_time
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // DECL_TASK
 #include "sensor_bulk.h" // sensor_bulk_report
-#include "spicmds.h" // spidev_transfer
+#include "spicmds.h" // spidev_transfer_async
+
+#define ADXL_MSG_SIZE 9
+#define ADXL_BATCH_COUNT 16
 
 struct adxl345 {
     struct timer timer;
     uint32_t rest_ticks;
     struct spidev_s *spi;
+    struct spidev_async async;
     uint8_t flags;
+    uint8_t msg[ADXL_MSG_SIZE];
     struct sensor_bulk sb;
+#if CONFIG_HAVE_GPIO_SPI_BATCH
+    uint8_t batch_msg[ADXL_BATCH_COUNT * ADXL_MSG_SIZE];
+#endif
 };
 
 enum {
-    AX_PENDING = 1<<0,
+    AX_PENDING = 1<<0, AX_BUSY = 1<<1, AX_DONE = 1<<2, AX_DATA_ERROR = 1<<3,
 };
 
 static struct task_wake adxl345_wake;
@@ -37,6 +46,15 @@ adxl345_event(struct timer *timer)
     return SF_DONE;
 }
 
+// Callback from spidev_transfer_async() once a query completes
+static void
+adxl_query_done(struct spidev_async *sa)
+{
+    struct adxl345 *ax = container_of(sa, struct adxl345, async);
+    ax->flags |= AX_DONE;
+    sched_wake_task(&adxl345_wake);
+}
+
 void
 command_config_adxl345(uint32_t *args)
 {
@@ -44,6 +62,7 @@ command_config_adxl345(uint32_t *args)
                                    , sizeof(*ax));
     ax->timer.func = adxl345_event;
     ax->spi = spidev_oid_lookup(args[1]);
+    ax->async.func = adxl_query_done;
 }
 DECL_COMMAND(command_config_adxl345, "config_adxl345 oid=%c spi_oid=%c");
 
@@ -67,23 +86,25 @@ adxl_reschedule_timer(struct adxl345 *ax)
 
 #define BYTES_PER_SAMPLE 5
 
-// Query accelerometer data
+// Start a background read of accelerometer data
 static void
-adxl_query(struct adxl345 *ax, uint8_t oid)
+adxl_start_query(struct adxl345 *ax)
+{
+    uint8_t *msg = ax->msg;
+    memset(msg, 0, sizeof(ax->msg));
+    msg[0] = AR_DATAX0 | AM_READ | AM_MULTI;
+    ax->flags |= AX_BUSY;
+    spidev_transfer_async(ax->spi, 1, sizeof(ax->msg), msg, &ax->async);
+}
+
+// Store a measurement in the local buffer
+static void
+adxl_add_sample(struct adxl345 *ax, uint8_t oid, uint8_t *msg, int is_error)
 {
-    // Read data
-    uint8_t msg[9] = { AR_DATAX0 | AM_READ | AM_MULTI, 0, 0, 0, 0, 0, 0, 0, 0 };
-    spidev_transfer(ax->spi, 1, sizeof(msg), msg);
-    // Extract x, y, z measurements
-    uint_fast8_t fifo_status = msg[8] & ~0x80; // Ignore trigger bit
     uint8_t *d = &ax->sb.data[ax->sb.data_count];
-    if (((msg[2] & 0xf0) && (msg[2] & 0xf0) != 0xf0)
-        || ((msg[4] & 0xf0) && (msg[4] & 0xf0) != 0xf0)
-        || ((msg[6] & 0xf0) && (msg[6] & 0xf0) != 0xf0)
-        || (msg[7] != SET_FIFO_CTL) || (fifo_status > 32)) {
+    if (is_error) {
         // Data error - may be a CS, MISO, MOSI, or SCLK glitch
         d[0] = d[1] = d[2] = d[3] = d[4] = 0xff;
-        fifo_status = 0;
     } else {
         // Copy data
         d[0] = msg[1]; // x low bits
@@ -95,12 +116,90 @@ adxl_query(struct adxl345 *ax, uint8_t oid)
     ax->sb.data_count += BYTES_PER_SAMPLE;
     if (ax->sb.data_count + BYTES_PER_SAMPLE > ARRAY_SIZE(ax->sb.data))
         sensor_bulk_report(&ax->sb, oid);
+}
+
+#if CONFIG_WANT_SENSOR_DECIMATE
+// Filter a measurement and only store every Nth result
+static void
+adxl_decimate(struct adxl345 *ax, uint8_t oid, uint8_t *msg, int is_error)
+{
+    int32_t v[3];
+    uint_fast8_t i;
+    for (i = 0; i < 3; i++)
+        v[i] = (int16_t)(msg[i*2 + 1] | (msg[i*2 + 2] << 8));
+    if (is_error)
+        ax->flags |= AX_DATA_ERROR;
+    if (!sensor_decimate_sample(ax->sb.decimate, is_error ? NULL : v))
+        return;
+    // Report an error if any measurement in this period was invalid
+    is_error = ax->flags & AX_DATA_ERROR;
+    ax->flags &= ~AX_DATA_ERROR;
+    for (i = 0; i < 3; i++) {
+        // Clamp to the 13-bit range of the chip
+        int32_t val = v[i] < -4096 ? -4096 : (v[i] > 4095 ? 4095 : v[i]);
+        msg[i*2 + 1] = val;
+        msg[i*2 + 2] = val >> 8;
+    }
+    adxl_add_sample(ax, oid, msg, is_error);
+}
+#endif
+
+// Store the measurement from a query message and return its fifo status
+static uint_fast8_t
+adxl_process_msg(struct adxl345 *ax, uint8_t oid, uint8_t *msg)
+{
+    // Extract x, y, z measurements
+    uint_fast8_t fifo_status = msg[8] & ~0x80; // Ignore trigger bit
+    int is_error = (((msg[2] & 0xf0) && (msg[2] & 0xf0) != 0xf0)
+                    || ((msg[4] & 0xf0) && (msg[4] & 0xf0) != 0xf0)
+                    || ((msg[6] & 0xf0) && (msg[6] & 0xf0) != 0xf0)
+                    || (msg[7] != SET_FIFO_CTL) || (fifo_status > 32));
+    if (is_error)
+        fifo_status = 0;
+#if CONFIG_WANT_SENSOR_DECIMATE
+    if (ax->sb.decimate)
+        adxl_decimate(ax, oid, msg, is_error);
+    else
+#endif
+        adxl_add_sample(ax, oid, msg, is_error);
     // Check fifo status
     if (fifo_status >= 31)
         ax->sb.possible_overflows++;
+    return fifo_status;
+}
+
+#if CONFIG_HAVE_GPIO_SPI_BATCH
+// Read several pending fifo entries in a single bus operation
+static uint_fast8_t
+adxl_query_batch(struct adxl345 *ax, uint8_t oid, uint_fast8_t fifo_status)
+{
+    uint_fast8_t i, count = fifo_status - 1;
+    if (count > ADXL_BATCH_COUNT)
+        count = ADXL_BATCH_COUNT;
+    uint8_t *msg = ax->batch_msg;
+    memset(msg, 0, count * ADXL_MSG_SIZE);
+    for (i=0; i<count; i++)
+        msg[i * ADXL_MSG_SIZE] = AR_DATAX0 | AM_READ | AM_MULTI;
+    spidev_transfer_batch(ax->spi, count, ADXL_MSG_SIZE, msg);
+    for (i=0; i<count; i++)
+        fifo_status = adxl_process_msg(ax, oid, &msg[i * ADXL_MSG_SIZE]);
+    return fifo_status;
+}
+#endif
+
+// Process accelerometer data from a completed query
+static void
+adxl_query(struct adxl345 *ax, uint8_t oid)
+{
+    ax->flags &= ~(AX_BUSY | AX_DONE);
+    uint_fast8_t fifo_status = adxl_process_msg(ax, oid, ax->msg);
+#if CONFIG_HAVE_GPIO_SPI_BATCH
+    if (fifo_status > 1)
+        fifo_status = adxl_query_batch(ax, oid, fifo_status);
+#endif
     if (fifo_status > 1) {
-        // More data in fifo - wake this task again
-        sched_wake_task(&adxl345_wake);
+        // More data in fifo - start reading it now
+        adxl_start_query(ax);
     } else {
         // Sleep until next check time
         ax->flags &= ~AX_PENDING;
@@ -114,6 +213,7 @@ command_query_adxl345(uint32_t *args)
     struct adxl345 *ax = oid_lookup(args[0], command_config_adxl345);
 
     sched_del_timer(&ax->timer);
+    spidev_transfer_wait(ax->spi);
     ax->flags = 0;
     if (!args[1])
         // End measurements
@@ -126,6 +226,17 @@ command_query_adxl345(uint32_t *args)
 }
 DECL_COMMAND(command_query_adxl345, "query_adxl345 oid=%c rest_ticks=%u");
 
+#if CONFIG_WANT_SENSOR_DECIMATE
+void
+command_adxl345_set_decimate(uint32_t *args)
+{
+    struct adxl345 *ax = oid_lookup(args[0], command_config_adxl345);
+    ax->sb.decimate = sensor_decimate_oid_lookup(args[1]);
+}
+DECL_COMMAND(command_adxl345_set_decimate,
+             "adxl345_set_decimate oid=%c decimate_oid=%c");
+#endif
+
 void
 command_query_adxl345_status(uint32_t *args)
 {
@@ -154,8 +265,10 @@ adxl345_task(void)
     struct adxl345 *ax;
     foreach_oid(oid, ax, command_config_adxl345) {
         uint_fast8_t flags = ax->flags;
-        if (flags & AX_PENDING)
+        if (flags & AX_DONE)
             adxl_query(ax, oid);
+        else if ((flags & (AX_PENDING | AX_BUSY)) == AX_PENDING)
+            adxl_start_query(ax);
     }
 }
 DECL_TASK(adxl345_task);
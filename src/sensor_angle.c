@@ -4,6 +4,8 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_WANT_SENSOR_ANGLE_PACKED
 #include "basecmd.h" // oid_alloc
 #include "board/misc.h" // timer_read_time
 #include "board/gpio.h" // gpio_out_write
@@ -35,19 +37,42 @@ enum {
 
 #define MAX_SPI_READ_TIME timer_from_us(50)
 
+#define CALIBRATION_BITS 6
+#define CALIBRATION_COUNT (1 << CALIBRATION_BITS)
+#define INTERP_BITS (16 - CALIBRATION_BITS)
+
+#define BYTES_PER_SAMPLE 3
+#define PACKED_HEADER (3 + BYTES_PER_SAMPLE)
+#define PACKED_DATA_SIZE (sizeof(((struct sensor_bulk *)0)->data) \
+                          - PACKED_HEADER)
+
 struct spi_angle {
     struct timer timer;
     uint32_t rest_ticks;
     struct spidev_s *spi;
     uint8_t flags, chip_type, time_shift, overflow;
+    uint8_t oid, mode;
     struct sensor_bulk sb;
+#if CONFIG_WANT_SENSOR_ANGLE_CALIBRATE
+    uint16_t calibration[CALIBRATION_COUNT];
+#endif
+#if CONFIG_WANT_SENSOR_ANGLE_PACKED
+    uint16_t sample_count, pack_start, last_data;
+    uint8_t pack_count, tcode_bits, data_bits, last_tcode;
+    uint8_t pack_first[BYTES_PER_SAMPLE];
+    // Each packed sample uses at least 8 bits
+    uint8_t tcode_deltas[PACKED_DATA_SIZE];
+    uint16_t data_deltas[PACKED_DATA_SIZE];
+#endif
 };
 
 enum {
     SA_PENDING = 1<<2,
 };
 
-#define BYTES_PER_SAMPLE 3
+enum {
+    SAM_CALIBRATE = 1<<0, SAM_REVERSED = 1<<1, SAM_PACKED = 1<<2,
+};
 
 static struct task_wake angle_wake;
 
@@ -79,14 +104,182 @@ command_config_spi_angle(uint32_t *args)
     if (!spidev_have_cs_pin(sa->spi))
         shutdown("angle sensor requires cs pin");
     sa->chip_type = chip_type;
+    sa->oid = args[0];
 }
 DECL_COMMAND(command_config_spi_angle,
              "config_spi_angle oid=%c spi_oid=%c spi_angle_type=%c");
 
+#if CONFIG_WANT_SENSOR_ANGLE_CALIBRATE
+
+// Store part of the calibration table (a list of 16-bit angles)
+void
+command_spi_angle_set_calibration(uint32_t *args)
+{
+    struct spi_angle *sa = oid_lookup(args[0], command_config_spi_angle);
+    uint_fast8_t offset = args[1], count = args[2] / 2, i;
+    uint8_t *data = command_decode_ptr(args[3]);
+    if (offset + count > CALIBRATION_COUNT)
+        shutdown("Invalid spi_angle calibration");
+    for (i = 0; i < count; i++)
+        sa->calibration[offset + i] = data[i*2] | (data[i*2 + 1] << 8);
+}
+DECL_COMMAND(command_spi_angle_set_calibration,
+             "spi_angle_set_calibration oid=%c offset=%c data=%*s");
+
+void
+command_spi_angle_enable_calibration(uint32_t *args)
+{
+    struct spi_angle *sa = oid_lookup(args[0], command_config_spi_angle);
+    uint_fast8_t mode = sa->mode & ~(SAM_CALIBRATE | SAM_REVERSED);
+    if (args[1])
+        mode |= SAM_CALIBRATE | (args[2] ? SAM_REVERSED : 0);
+    sa->mode = mode;
+}
+DECL_COMMAND(command_spi_angle_enable_calibration,
+             "spi_angle_enable_calibration oid=%c enable=%c reversed=%c");
+
+// Linearly interpolate a raw angle using the calibration table
+static uint_fast16_t
+angle_calibrate(struct spi_angle *sa, uint_fast16_t angle)
+{
+    uint_fast8_t bucket = angle >> INTERP_BITS;
+    uint16_t cal1 = sa->calibration[bucket];
+    uint16_t cal2 = sa->calibration[(bucket + 1) % CALIBRATION_COUNT];
+    int32_t diff = (int16_t)(cal2 - cal1);
+    int32_t adj = (int32_t)(angle & ((1 << INTERP_BITS) - 1)) * diff;
+    uint_fast16_t new_angle = cal1 + ((adj + (1 << (INTERP_BITS - 1)))
+                                      >> INTERP_BITS);
+    if (sa->mode & SAM_REVERSED)
+        new_angle = -new_angle;
+    return new_angle & 0xffff;
+}
+
+#endif
+
+#if CONFIG_WANT_SENSOR_ANGLE_PACKED
+
+// The "packed" report format sends each sensor_bulk_data block as a
+// header byte (holding the tcode and angle bit widths), the 16-bit
+// index of the first sample, the first sample, and then the
+// difference of each following sample from its predecessor.  The
+// differences are zigzag encoded and stored as a little-endian bit
+// stream.  Blocks hold a variable number of samples.
+void
+command_spi_angle_set_packed(uint32_t *args)
+{
+    struct spi_angle *sa = oid_lookup(args[0], command_config_spi_angle);
+    if (args[1])
+        sa->mode |= SAM_PACKED;
+    else
+        sa->mode &= ~SAM_PACKED;
+}
+DECL_COMMAND(command_spi_angle_set_packed,
+             "spi_angle_set_packed oid=%c enable=%c");
+
+// Return the number of bits needed to store 'v'
+static uint_fast8_t
+bit_width(uint_fast16_t v)
+{
+    uint_fast8_t width = 0;
+    while (v >> width)
+        width++;
+    return width;
+}
+
+// Return the bits needed to store 'count' differences at the given widths
+static uint_fast16_t
+packed_bits(uint_fast8_t count, uint_fast8_t tcode_bits
+            , uint_fast8_t data_bits)
+{
+    // Each sample uses at least 8 bits so that the host can determine
+    // the sample count from the message length
+    uint_fast8_t sample_bits = tcode_bits + data_bits;
+    return count * (sample_bits < 8 ? 8 : sample_bits);
+}
+
+// Send the pending packed block
+static void
+angle_pack_flush(struct spi_angle *sa)
+{
+    uint_fast8_t tcode_bits = sa->tcode_bits, data_bits = sa->data_bits;
+    if (tcode_bits + data_bits < 8)
+        data_bits = 8 - tcode_bits;
+    uint8_t *p = sa->sb.data;
+    p[0] = (tcode_bits << 4) | (data_bits - 1);
+    p[1] = sa->pack_start;
+    p[2] = sa->pack_start >> 8;
+    memcpy(&p[3], sa->pack_first, BYTES_PER_SAMPLE);
+    p += PACKED_HEADER;
+    uint32_t acc = 0;
+    uint_fast8_t acc_bits = 0, i;
+    for (i = 0; i < sa->pack_count - 1; i++) {
+        acc |= (uint32_t)sa->tcode_deltas[i] << acc_bits;
+        acc_bits += tcode_bits;
+        acc |= (uint32_t)sa->data_deltas[i] << acc_bits;
+        acc_bits += data_bits;
+        while (acc_bits >= 8) {
+            *p++ = acc;
+            acc >>= 8;
+            acc_bits -= 8;
+        }
+    }
+    if (acc_bits)
+        *p++ = acc;
+    sa->sb.data_count = p - sa->sb.data;
+    sensor_bulk_report(&sa->sb, sa->oid);
+    sa->pack_count = 0;
+}
+
+// Add an entry to the pending packed block
+static void
+angle_pack(struct spi_angle *sa, uint_fast8_t tcode, uint_fast16_t data)
+{
+    uint_fast16_t sample_index = sa->sample_count++;
+    if (sa->pack_count) {
+        int8_t tdiff = tcode - sa->last_tcode;
+        int16_t ddiff = data - sa->last_data;
+        uint8_t tdelta = ((uint8_t)tdiff << 1) ^ (tdiff < 0 ? 0xff : 0x00);
+        uint16_t ddelta = ((uint16_t)ddiff << 1) ^ (ddiff < 0 ? 0xffff : 0);
+        uint_fast8_t tcode_bits = bit_width(tdelta);
+        uint_fast8_t data_bits = bit_width(ddelta);
+        if (tcode_bits < sa->tcode_bits)
+            tcode_bits = sa->tcode_bits;
+        if (data_bits < sa->data_bits)
+            data_bits = sa->data_bits;
+        uint_fast8_t count = sa->pack_count;
+        if (packed_bits(count, tcode_bits, data_bits) <= PACKED_DATA_SIZE*8) {
+            sa->tcode_deltas[count - 1] = tdelta;
+            sa->data_deltas[count - 1] = ddelta;
+            sa->tcode_bits = tcode_bits;
+            sa->data_bits = data_bits;
+            sa->pack_count = count + 1;
+            sa->last_tcode = tcode;
+            sa->last_data = data;
+            return;
+        }
+        angle_pack_flush(sa);
+    }
+    // Start a new block
+    sa->pack_start = sample_index;
+    sa->pack_first[0] = tcode;
+    sa->pack_first[1] = data;
+    sa->pack_first[2] = data >> 8;
+    sa->pack_count = 1;
+    sa->tcode_bits = 0;
+    sa->data_bits = 1;
+    sa->last_tcode = tcode;
+    sa->last_data = data;
+}
+
+#endif
+
 // Send spi_angle_data message if buffer is full
 static void
 angle_check_report(struct spi_angle *sa, uint8_t oid)
 {
+    if (CONFIG_WANT_SENSOR_ANGLE_PACKED && sa->mode & SAM_PACKED)
+        // Packed blocks are sent from angle_pack()
+        return;
     if (sa->sb.data_count + BYTES_PER_SAMPLE > ARRAY_SIZE(sa->sb.data))
         sensor_bulk_report(&sa->sb, oid);
 }
@@ -95,6 +288,16 @@ angle_check_report(struct spi_angle *sa, uint8_t oid)
 static void
 angle_add(struct spi_angle *sa, uint_fast8_t tcode, uint_fast16_t data)
 {
+#if CONFIG_WANT_SENSOR_ANGLE_CALIBRATE
+    if (sa->mode & SAM_CALIBRATE && tcode != TCODE_ERROR)
+        data = angle_calibrate(sa, data);
+#endif
+#if CONFIG_WANT_SENSOR_ANGLE_PACKED
+    if (sa->mode & SAM_PACKED) {
+        angle_pack(sa, tcode, data);
+        return;
+    }
+#endif
     sa->sb.data[sa->sb.data_count] = tcode;
     sa->sb.data[sa->sb.data_count + 1] = data;
     sa->sb.data[sa->sb.data_count + 2] = data >> 8;
@@ -299,6 +502,9 @@ command_query_spi_angle(uint32_t *args)
     sa->timer.waketime = args[1];
     sa->rest_ticks = args[2];
     sensor_bulk_reset(&sa->sb);
+#if CONFIG_WANT_SENSOR_ANGLE_PACKED
+    sa->sample_count = sa->pack_count = 0;
+#endif
     sa->time_shift = args[3];
     sched_add_timer(&sa->timer);
 }
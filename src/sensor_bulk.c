@@ -4,6 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_WANT_SENSOR_DECIMATE
 #include "command.h" // sendf
 #include "sensor_bulk.h" // sensor_bulk_report
 
@@ -14,14 +15,28 @@ sensor_bulk_reset(struct sensor_bulk *sb)
     sb->sequence = 0;
     sb->possible_overflows = 0;
     sb->data_count = 0;
+    if (CONFIG_WANT_SENSOR_DECIMATE && sb->decimate)
+        sensor_decimate_reset(sb->decimate);
 }
 
 // Report local measurement buffer
 void
 sensor_bulk_report(struct sensor_bulk *sb, uint8_t oid)
 {
+    uint8_t *data = sb->data;
+    uint_fast8_t len = sb->data_count;
+    uint8_t buf[sizeof(sb->data) + 1];
+    if (CONFIG_WANT_SENSOR_BULK_ENCODE) {
+        // Check for a packed encoding request at the start of each session
+        if (!sb->sequence)
+            sb->encode = sensor_bulk_encode_lookup(oid);
+        if (sb->encode) {
+            len = sensor_bulk_encode(sb->encode, buf, data, len);
+            data = buf;
+        }
+    }
     sendf("sensor_bulk_data oid=%c sequence=%hu data=%*s"
-          , oid, sb->sequence, sb->data_count, sb->data);
+          , oid, sb->sequence, len, data);
     sb->data_count = 0;
     sb->sequence++;
 }
@@ -31,8 +46,43 @@ void
 sensor_bulk_status(struct sensor_bulk *sb, uint8_t oid
                    , uint32_t time1, uint32_t query_ticks, uint32_t fifo)
 {
+    if (CONFIG_WANT_SENSOR_DECIMATE && sb->decimate)
+        fifo = sensor_decimate_pending(sb->decimate, fifo);
     sendf("sensor_bulk_status oid=%c clock=%u query_ticks=%u next_sequence=%hu"
           " buffered=%u possible_overflows=%hu"
           , oid, time1, query_ticks, sb->sequence
           , sb->data_count + fifo, sb->possible_overflows);
 }
+
+// Note 'count' bytes of new measurements (each a set of three 16-bit
+// values) stored after the existing data in the local buffer
+void
+sensor_bulk_add_int16(struct sensor_bulk *sb, uint8_t count, int big_endian)
+{
+    if (!CONFIG_WANT_SENSOR_DECIMATE || !sb->decimate) {
+        sb->data_count += count;
+        return;
+    }
+    // Filter and decimate the new measurements in place
+    uint8_t *in = &sb->data[sb->data_count], *out = in;
+    for (; count >= 6; count -= 6, in += 6) {
+        int32_t v[3];
+        uint_fast8_t i;
+        for (i = 0; i < 3; i++) {
+            uint8_t *p = &in[i * 2];
+            v[i] = (int16_t)(big_endian ? (p[0] << 8) | p[1]
+                                        : p[0] | (p[1] << 8));
+        }
+        if (!sensor_decimate_sample(sb->decimate, v))
+            continue;
+        for (i = 0; i < 3; i++) {
+            int32_t val = v[i] < INT16_MIN ? INT16_MIN
+                          : (v[i] > INT16_MAX ? INT16_MAX : v[i]);
+            uint8_t *p = &out[i * 2];
+            p[!big_endian] = val >> 8;
+            p[!!big_endian] = val;
+        }
+        out += 6;
+    }
+    sb->data_count = out - sb->data;
+}
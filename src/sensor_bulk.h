@@ -1,15 +1,30 @@
 #ifndef __SENSOR_BULK_H
 #define __SENSOR_BULK_H
 
+#include <stdint.h> // uint8_t
+
 struct sensor_bulk {
     uint16_t sequence, possible_overflows;
     uint8_t data_count;
     uint8_t data[51];
+    struct sensor_decimate *decimate;
+    struct sensor_bulk_encode *encode;
 };
 
 void sensor_bulk_reset(struct sensor_bulk *sb);
 void sensor_bulk_report(struct sensor_bulk *sb, uint8_t oid);
 void sensor_bulk_status(struct sensor_bulk *sb, uint8_t oid
                         , uint32_t time1, uint32_t query_ticks, uint32_t fifo);
+void sensor_bulk_add_int16(struct sensor_bulk *sb, uint8_t count
+                           , int big_endian);
+
+struct sensor_decimate *sensor_decimate_oid_lookup(uint8_t oid);
+void sensor_decimate_reset(struct sensor_decimate *sd);
+int sensor_decimate_sample(struct sensor_decimate *sd, int32_t *values);
+uint32_t sensor_decimate_pending(struct sensor_decimate *sd, uint32_t fifo);
+
+struct sensor_bulk_encode *sensor_bulk_encode_lookup(uint8_t sensor_oid);
+uint_fast8_t sensor_bulk_encode(struct sensor_bulk_encode *se, uint8_t *out
+                                , uint8_t *data, uint_fast8_t len);
 
 #endif // sensor_bulk.h
@@ -0,0 +1,169 @@
+// Compact "packed" encoding of sensor_bulk_data payloads
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Measurements of most sensors change slowly relative to their
+// sample rate.  The code here can send each sensor_bulk_data block as
+// the first sample followed by the difference of each field from its
+// value in the previous sample.  The differences are "zigzag" encoded
+// (so small negative values are small) and packed into a bit stream
+// using the smallest bit width that fits all differences in the
+// block.  The first byte of the payload holds that bit width (or 0xff
+// if the block is sent unmodified because packing would not save
+// space).  See bulkreader.c for the matching host decoder.
+
+#include <string.h> // memcpy
+#include "basecmd.h" // oid_alloc
+#include "compiler.h" // DIV_ROUND_UP
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // shutdown
+#include "sensor_bulk.h" // sensor_bulk_encode
+
+// Field types (size in bytes plus flags - matches BR_xxx in bulkreader.c)
+#define SBE_SIZE_MASK 0x0f
+#define SBE_BIGENDIAN 0x20
+
+#define SBE_RAW 0xff
+#define MAX_FIELDS 16
+
+struct sensor_bulk_encode {
+    uint8_t sensor_oid, field_count, bytes_per_sample;
+    uint8_t fields[0];
+};
+
+void
+command_config_sensor_bulk_encode(uint32_t *args)
+{
+    uint_fast8_t field_count = args[2], bytes_per_sample = 0, i;
+    uint8_t *fields = command_decode_ptr(args[3]);
+    if (!field_count || field_count > MAX_FIELDS)
+        shutdown("Invalid sensor_bulk_encode fields");
+    for (i = 0; i < field_count; i++) {
+        uint_fast8_t size = fields[i] & SBE_SIZE_MASK;
+        if (size != 1 && size != 2 && size != 4)
+            shutdown("Invalid sensor_bulk_encode fields");
+        bytes_per_sample += size;
+    }
+    // A full block sent unmodified must still fit after the header byte
+    if (!(sizeof(((struct sensor_bulk *)0)->data) % bytes_per_sample))
+        shutdown("Invalid sensor_bulk_encode fields");
+    struct sensor_bulk_encode *se = oid_alloc(
+        args[0], command_config_sensor_bulk_encode, sizeof(*se) + field_count);
+    se->sensor_oid = args[1];
+    se->field_count = field_count;
+    se->bytes_per_sample = bytes_per_sample;
+    memcpy(se->fields, fields, field_count);
+}
+DECL_COMMAND(command_config_sensor_bulk_encode,
+             "config_sensor_bulk_encode oid=%c sensor_oid=%c fields=%*s");
+
+// Find the encoder (if any) registered for the given sensor
+struct sensor_bulk_encode *
+sensor_bulk_encode_lookup(uint8_t sensor_oid)
+{
+    uint8_t oid;
+    struct sensor_bulk_encode *se;
+    foreach_oid(oid, se, command_config_sensor_bulk_encode) {
+        if (se->sensor_oid == sensor_oid)
+            return se;
+    }
+    return NULL;
+}
+
+// Read a field as an unsigned integer
+static uint32_t
+get_field(uint8_t *p, uint_fast8_t field_type)
+{
+    uint_fast8_t size = field_type & SBE_SIZE_MASK, i;
+    uint32_t v = 0;
+    for (i = 0; i < size; i++) {
+        uint_fast8_t pos = field_type & SBE_BIGENDIAN ? i : size - 1 - i;
+        v = (v << 8) | p[pos];
+    }
+    return v;
+}
+
+// Return the zigzag encoded difference of a field between two samples
+static uint32_t
+field_delta(uint8_t *prev, uint8_t *cur, uint_fast8_t field_type)
+{
+    uint_fast8_t shift = 32 - (field_type & SBE_SIZE_MASK) * 8;
+    uint32_t d = get_field(cur, field_type) - get_field(prev, field_type);
+    int32_t sd = (int32_t)(d << shift) >> shift;
+    return ((uint32_t)sd << 1) ^ (uint32_t)(sd >> 31);
+}
+
+// Encode 'len' bytes of samples from 'data' into 'out'.  Returns the
+// number of bytes stored in 'out' (at most len + 1).
+uint_fast8_t
+sensor_bulk_encode(struct sensor_bulk_encode *se, uint8_t *out
+                   , uint8_t *data, uint_fast8_t len)
+{
+    uint_fast8_t field_count = se->field_count, bps = se->bytes_per_sample;
+    uint_fast8_t count = len / bps, i, j;
+
+    // Find the bit width needed to store all differences
+    uint32_t max_delta = 0;
+    for (i = 1; i < count; i++) {
+        uint8_t *prev = &data[(i - 1) * bps], *cur = &data[i * bps];
+        for (j = 0; j < field_count; j++) {
+            uint_fast8_t field_type = se->fields[j];
+            uint32_t delta = field_delta(prev, cur, field_type);
+            if (delta > max_delta)
+                max_delta = delta;
+            uint_fast8_t size = field_type & SBE_SIZE_MASK;
+            prev += size;
+            cur += size;
+        }
+    }
+    uint_fast8_t width = 0;
+    while (width < 32 && max_delta >> width)
+        width++;
+    // Each sample must use at least 8 bits so the host can determine
+    // the sample count from the payload length
+    uint_fast8_t min_width = DIV_ROUND_UP(8, field_count);
+    if (width < min_width)
+        width = min_width;
+    uint32_t bits = (uint32_t)(count > 1 ? count - 1 : 0) * field_count * width;
+    if (len % bps || 1 + bps + DIV_ROUND_UP(bits, 8) >= 1 + len) {
+        // Packing would not save space - send unmodified
+        out[0] = SBE_RAW;
+        memcpy(&out[1], data, len);
+        return len + 1;
+    }
+
+    // Store the first sample followed by the packed differences
+    out[0] = width;
+    memcpy(&out[1], data, bps);
+    uint8_t *p = &out[1 + bps];
+    uint32_t acc = 0;
+    uint_fast8_t acc_bits = 0;
+    for (i = 1; i < count; i++) {
+        uint8_t *prev = &data[(i - 1) * bps], *cur = &data[i * bps];
+        for (j = 0; j < field_count; j++) {
+            uint_fast8_t field_type = se->fields[j];
+            uint32_t delta = field_delta(prev, cur, field_type);
+            uint_fast8_t remaining = width;
+            while (remaining) {
+                uint_fast8_t n = remaining > 16 ? 16 : remaining;
+                acc |= (delta & ((1UL << n) - 1)) << acc_bits;
+                acc_bits += n;
+                delta >>= n;
+                remaining -= n;
+                while (acc_bits >= 8) {
+                    *p++ = acc;
+                    acc >>= 8;
+                    acc_bits -= 8;
+                }
+            }
+            uint_fast8_t size = field_type & SBE_SIZE_MASK;
+            prev += size;
+            cur += size;
+        }
+    }
+    if (acc_bits)
+        *p++ = acc;
+    return p - out;
+}
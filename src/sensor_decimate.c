@@ -0,0 +1,74 @@
+// Filtering and decimation of bulk sensor measurements
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "basecmd.h" // oid_alloc
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // shutdown
+#include "sensor_bulk.h" // sensor_decimate_sample
+#include "sos_filter.h" // sosfilt
+
+// Measurements are filtered as fixed point values with 12 fractional bits
+#define DECIMATE_FRAC_BITS 12
+
+struct sensor_decimate {
+    struct sos_filter *filters[3];
+    uint8_t factor, count;
+};
+
+void
+command_config_sensor_decimate(uint32_t *args)
+{
+    if (!args[1])
+        shutdown("Invalid sensor decimation factor");
+    struct sensor_decimate *sd = oid_alloc(
+        args[0], command_config_sensor_decimate, sizeof(*sd));
+    sd->factor = args[1];
+    uint_fast8_t i;
+    for (i = 0; i < ARRAY_SIZE(sd->filters); i++)
+        sd->filters[i] = sos_filter_oid_lookup(args[2 + i]);
+}
+DECL_COMMAND(command_config_sensor_decimate,
+             "config_sensor_decimate oid=%c factor=%c"
+             " filter_oid0=%c filter_oid1=%c filter_oid2=%c");
+
+struct sensor_decimate *
+sensor_decimate_oid_lookup(uint8_t oid)
+{
+    return oid_lookup(oid, command_config_sensor_decimate);
+}
+
+// Restart the decimation count (called when measurements start)
+void
+sensor_decimate_reset(struct sensor_decimate *sd)
+{
+    sd->count = 0;
+}
+
+// Filter a measurement of three axes in place.  Returns non-zero if
+// the filtered measurement should be reported.  If 'values' is NULL
+// the measurement is invalid - it is not filtered, but it still
+// counts towards the decimation factor.
+int
+sensor_decimate_sample(struct sensor_decimate *sd, int32_t *values)
+{
+    uint_fast8_t i;
+    for (i = 0; values && i < ARRAY_SIZE(sd->filters); i++) {
+        int32_t v = sosfilt(sd->filters[i], values[i] << DECIMATE_FRAC_BITS);
+        values[i] = (v + (1 << (DECIMATE_FRAC_BITS - 1))) >> DECIMATE_FRAC_BITS;
+    }
+    if (++sd->count < sd->factor)
+        return 0;
+    sd->count = 0;
+    return 1;
+}
+
+// Convert a count of measurement bytes pending in a sensor fifo to
+// the number of bytes that will be reported after decimation
+uint32_t
+sensor_decimate_pending(struct sensor_decimate *sd, uint32_t fifo)
+{
+    return fifo / sd->factor;
+}
@@ -12,9 +12,11 @@
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // sched_add_timer
 #include "sensor_bulk.h" // sensor_bulk_report
+#include "spicmds.h" // spidev_transfer
 #include "load_cell_probe.h" // load_cell_probe_report_sample
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h> // memset
 
 struct hx71x_adc {
     struct timer timer;
@@ -24,8 +26,10 @@ struct hx71x_adc {
     uint32_t last_error;
     struct gpio_in dout; // pin used to receive data from the hx71x
     struct gpio_out sclk; // pin used to generate clock for the hx71x
+    struct spidev_s *spi; // optional spi bus (mosi wired to hx71x sclk)
     struct sensor_bulk sb;
     struct load_cell_probe *lce;
+    uint8_t lce_channel;
 };
 
 enum {
@@ -95,6 +99,27 @@ hx71x_raw_read(struct gpio_in dout, struct gpio_out sclk, int num_bits)
     return bits_read;
 }
 
+// Read 'num_bits' using a hardware spi bus.  Each clock pulse is sent
+// as a "10" bit pair on mosi and the data bit is sampled (on miso)
+// during the low half of the pulse.
+static uint32_t
+hx71x_spi_read(struct spidev_s *spi, int num_bits)
+{
+    uint8_t buf[DIV_ROUND_UP(27 * 2, 8)];
+    uint_fast8_t len = DIV_ROUND_UP(num_bits * 2, 8), rem = num_bits % 4;
+    memset(buf, 0xaa, len);
+    if (rem)
+        buf[len - 1] = 0xaa00 >> (rem * 2);
+    spidev_transfer(spi, 1, len, buf);
+    uint32_t bits_read = 0;
+    uint_fast8_t i;
+    for (i = 0; i < num_bits; i++) {
+        uint_fast8_t bit = (buf[i / 4] >> (6 - (i % 4) * 2)) & 1;
+        bits_read = (bits_read << 1) | bit;
+    }
+    return bits_read;
+}
+
 
 /****************************************************************
  * HX711 and HX717 Sensor Support
@@ -149,7 +174,11 @@ hx71x_read_adc(struct hx71x_adc *hx71x, uint8_t oid)
 {
     // Read from sensor
     uint_fast8_t gain_channel = hx71x->gain_channel;
-    uint32_t adc = hx71x_raw_read(hx71x->dout, hx71x->sclk, 24 + gain_channel);
+    uint32_t adc;
+    if (CONFIG_WANT_SPI && hx71x->spi)
+        adc = hx71x_spi_read(hx71x->spi, 24 + gain_channel);
+    else
+        adc = hx71x_raw_read(hx71x->dout, hx71x->sclk, 24 + gain_channel);
 
     // Clear pending flag (and note if an overflow occurred)
     irq_disable();
@@ -179,7 +208,7 @@ hx71x_read_adc(struct hx71x_adc *hx71x, uint8_t oid)
 
     // probe is optional, report if enabled
     if (hx71x->last_error == 0 && hx71x->lce) {
-        load_cell_probe_report_sample(hx71x->lce, counts);
+        load_cell_probe_report_sample(hx71x->lce, hx71x->lce_channel, counts);
     }
 
     // Add measurement to buffer
@@ -205,14 +234,35 @@ command_config_hx71x(uint32_t *args)
 DECL_COMMAND(command_config_hx71x, "config_hx71x oid=%c gain_channel=%c"
              " dout_pin=%u sclk_pin=%u");
 
+#if CONFIG_WANT_SPI
+// Create a hx71x sensor clocked by a hardware spi bus
+void
+command_config_hx71x_spi(uint32_t *args)
+{
+    struct hx71x_adc *hx71x = oid_alloc(args[0]
+                , command_config_hx71x, sizeof(*hx71x));
+    hx71x->timer.func = hx71x_event;
+    uint8_t gain_channel = args[1];
+    if (gain_channel < 1 || gain_channel > 4) {
+        shutdown("HX71x gain/channel out of range 1-4");
+    }
+    hx71x->gain_channel = gain_channel;
+    hx71x->dout = gpio_in_setup(args[2], 1);
+    hx71x->spi = spidev_oid_lookup(args[3]);
+}
+DECL_COMMAND(command_config_hx71x_spi, "config_hx71x_spi oid=%c"
+             " gain_channel=%c dout_pin=%u spi_oid=%c");
+#endif
+
 void
 hx71x_attach_load_cell_probe(uint32_t *args) {
     uint8_t oid = args[0];
     struct hx71x_adc *hx71x = oid_lookup(oid, command_config_hx71x);
     hx71x->lce = load_cell_probe_oid_lookup(args[1]);
+    hx71x->lce_channel = args[2];
 }
 DECL_COMMAND(hx71x_attach_load_cell_probe, "hx71x_attach_load_cell_probe oid=%c"
-    " load_cell_probe_oid=%c");
+    " load_cell_probe_oid=%c channel=%c");
 
 // start/stop capturing ADC data
 void
@@ -226,11 +276,13 @@ command_query_hx71x(uint32_t *args)
     hx71x->rest_ticks = args[1];
     if (!hx71x->rest_ticks) {
         // End measurements
-        gpio_out_write(hx71x->sclk, 1); // put chip in power down state
+        if (!hx71x->spi)
+            gpio_out_write(hx71x->sclk, 1); // put chip in power down state
         return;
     }
     // Start new measurements
-    gpio_out_write(hx71x->sclk, 0); // wake chip from power down
+    if (!hx71x->spi)
+        gpio_out_write(hx71x->sclk, 0); // wake chip from power down
     sensor_bulk_reset(&hx71x->sb);
     irq_disable();
     hx71x->timer.waketime = timer_read_time() + hx71x->rest_ticks;
@@ -8,6 +8,7 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_WANT_SENSOR_DECIMATE
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_read_time
 #include "basecmd.h" // oid_alloc
@@ -97,21 +98,24 @@ static void
 ic20948_query(struct icm20948 *ic, uint8_t oid)
 {
     // If not enough bytes to fill report read MPU FIFO's fill
-    if (ic->fifo_pkts_bytes < BYTES_PER_BLOCK)
+    uint_fast8_t read_len = BYTES_PER_BLOCK - ic->sb.data_count;
+    if (ic->fifo_pkts_bytes < read_len)
         ic->fifo_pkts_bytes = get_fifo_status(ic);
 
     // If we have enough bytes to fill the buffer do it and send report
-    if (ic->fifo_pkts_bytes >= BYTES_PER_BLOCK) {
+    if (ic->fifo_pkts_bytes >= read_len) {
         uint8_t reg = AR_FIFO;
-        read_mpu(ic->i2c, sizeof(reg), &reg, BYTES_PER_BLOCK, &ic->sb.data[0]);
-        ic->sb.data_count = BYTES_PER_BLOCK;
-        ic->fifo_pkts_bytes -= BYTES_PER_BLOCK;
-        sensor_bulk_report(&ic->sb, oid);
+        read_mpu(ic->i2c, sizeof(reg), &reg, read_len
+                 , &ic->sb.data[ic->sb.data_count]);
+        ic->fifo_pkts_bytes -= read_len;
+        sensor_bulk_add_int16(&ic->sb, read_len, 1);
+        if (ic->sb.data_count >= BYTES_PER_BLOCK)
+            sensor_bulk_report(&ic->sb, oid);
     }
 
     // If we have enough bytes remaining to fill another report wake again
     //  otherwise schedule timed wakeup
-    if (ic->fifo_pkts_bytes >= BYTES_PER_BLOCK) {
+    if (ic->fifo_pkts_bytes >= BYTES_PER_BLOCK - ic->sb.data_count) {
         sched_wake_task(&icm20948_wake);
     } else {
         ic->flags &= ~AX_PENDING;
@@ -143,6 +147,17 @@ command_query_icm20948(uint32_t *args)
 }
 DECL_COMMAND(command_query_icm20948, "query_icm20948 oid=%c rest_ticks=%u");
 
+#if CONFIG_WANT_SENSOR_DECIMATE
+void
+command_icm20948_set_decimate(uint32_t *args)
+{
+    struct icm20948 *ic = oid_lookup(args[0], command_config_icm20948);
+    ic->sb.decimate = sensor_decimate_oid_lookup(args[1]);
+}
+DECL_COMMAND(command_icm20948_set_decimate,
+             "icm20948_set_decimate oid=%c decimate_oid=%c");
+#endif
+
 void
 command_query_icm20948_status(uint32_t *args)
 {
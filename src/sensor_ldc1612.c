@@ -6,7 +6,9 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_WANT_SENSOR_IRQ
 #include "basecmd.h" // oid_alloc
+#include "board/gpio.h" // gpio_in_read
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_read_time
 #include "command.h" // DECL_COMMAND
@@ -16,7 +18,7 @@
 #include "trsync.h" // trsync_do_trigger
 
 enum {
-    LDC_PENDING = 1<<0, LDC_HAVE_INTB = 1<<1,
+    LDC_PENDING = 1<<0, LDC_HAVE_INTB = 1<<1, LDC_IRQ = 1<<2,
     LH_AWAIT_HOMING = 1<<1, LH_CAN_TRIGGER = 1<<2
 };
 
@@ -27,6 +29,9 @@ struct ldc1612 {
     uint8_t flags;
     struct sensor_bulk sb;
     struct gpio_in intb_pin;
+#if CONFIG_WANT_SENSOR_IRQ
+    struct gpio_irq irq;
+#endif
     // homing
     struct trsync *ts;
     uint8_t homing_flags;
@@ -59,6 +64,51 @@ ldc1612_event(struct timer *timer)
     return SF_RESCHEDULE;
 }
 
+#if CONFIG_WANT_SENSOR_IRQ
+// Edge interrupt handler for the intb line (called from irq context)
+static void
+ldc1612_irq_event(struct gpio_irq *gi, uint32_t time)
+{
+    struct ldc1612 *ld = container_of(gi, struct ldc1612, irq);
+    gpio_irq_disable(gi);
+    ld->flags |= LDC_PENDING;
+    sched_wake_task(&ldc1612_wake);
+}
+
+// Wait for the intb line to be asserted
+static void
+ldc1612_irq_arm(struct ldc1612 *ld)
+{
+    // Enable the interrupt before checking the line so that an
+    // assertion between the two can not be missed
+    irq_disable();
+    gpio_irq_enable(&ld->irq, 0);
+    if (check_intb_asserted(ld)) {
+        gpio_irq_disable(&ld->irq);
+        ld->flags |= LDC_PENDING;
+        sched_wake_task(&ldc1612_wake);
+    }
+    irq_enable();
+}
+
+static void
+ldc1612_irq_cancel(struct ldc1612 *ld)
+{
+    if (ld->flags & LDC_IRQ)
+        gpio_irq_disable(&ld->irq);
+}
+#else
+static void
+ldc1612_irq_arm(struct ldc1612 *ld)
+{
+}
+
+static void
+ldc1612_irq_cancel(struct ldc1612 *ld)
+{
+}
+#endif
+
 void
 command_config_ldc1612(uint32_t *args)
 {
@@ -80,6 +130,22 @@ command_config_ldc1612_with_intb(uint32_t *args)
 DECL_COMMAND(command_config_ldc1612_with_intb,
              "config_ldc1612_with_intb oid=%c i2c_oid=%c intb_pin=%c");
 
+#if CONFIG_WANT_SENSOR_IRQ
+// Read samples from an edge interrupt on the intb line (instead of
+// polling the line from a timer)
+void
+command_ldc1612_intb_irq(uint32_t *args)
+{
+    struct ldc1612 *ld = oid_lookup(args[0], command_config_ldc1612);
+    if (!(ld->flags & LDC_HAVE_INTB))
+        shutdown("ldc1612 intb_irq requires an intb pin");
+    ld->irq.func = ldc1612_irq_event;
+    gpio_irq_setup(&ld->irq, args[1]);
+    ld->flags |= LDC_IRQ;
+}
+DECL_COMMAND(command_ldc1612_intb_irq, "ldc1612_intb_irq oid=%c intb_pin=%c");
+#endif
+
 void
 command_ldc1612_setup_home(uint32_t *args)
 {
@@ -196,15 +262,22 @@ command_query_ldc1612(uint32_t *args)
 {
     struct ldc1612 *ld = oid_lookup(args[0], command_config_ldc1612);
 
+    irq_disable();
+    ldc1612_irq_cancel(ld);
     sched_del_timer(&ld->timer);
     ld->flags &= ~LDC_PENDING;
+    irq_enable();
+    ld->rest_ticks = args[1];
     if (!args[1])
         // End measurements
         return;
 
     // Start new measurements query
-    ld->rest_ticks = args[1];
     sensor_bulk_reset(&ld->sb);
+    if (CONFIG_WANT_SENSOR_IRQ && ld->flags & LDC_IRQ) {
+        ldc1612_irq_arm(ld);
+        return;
+    }
     irq_disable();
     ld->timer.waketime = timer_read_time() + ld->rest_ticks;
     sched_add_timer(&ld->timer);
@@ -249,6 +322,21 @@ ldc1612_task(void)
         if (!(flags & LDC_PENDING))
             continue;
         ldc1612_query(ld, oid);
+        if (CONFIG_WANT_SENSOR_IRQ && flags & LDC_IRQ && ld->rest_ticks)
+            ldc1612_irq_arm(ld);
     }
 }
 DECL_TASK(ldc1612_task);
+
+#if CONFIG_WANT_SENSOR_IRQ
+void
+ldc1612_shutdown(void)
+{
+    uint8_t i;
+    struct ldc1612 *ld;
+    foreach_oid(i, ld, command_config_ldc1612) {
+        ldc1612_irq_cancel(ld);
+    }
+}
+DECL_SHUTDOWN(ldc1612_shutdown);
+#endif
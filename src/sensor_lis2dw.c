@@ -5,7 +5,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <string.h> // memcpy
+#include <string.h> // memset
 #include "autoconf.h" // CONFIG_WANT_SPI
 #include "board/gpio.h" // irq_disable
 #include "board/irq.h" // irq_disable
@@ -14,8 +14,8 @@
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // DECL_TASK
 #include "sensor_bulk.h" // sensor_bulk_report
-#include "spicmds.h" // spidev_transfer
-#include "i2ccmds.h" // i2cdev_s
+#include "spicmds.h" // spidev_transfer_async
+#include "i2ccmds.h" // i2c_dev_read_async
 
 #define LIS_AR_DATAX0 0x28
 #define LIS_AM_READ   0x80
@@ -32,14 +32,18 @@ struct lis2dw {
         struct spidev_s *spi;
         struct i2cdev_s *i2c;
     };
+    struct spidev_async async;
+    struct i2c_request i2c_data_req, i2c_fifo_req;
+    int8_t i2c_ret;
     uint8_t bus_type;
     uint8_t flags;
     uint8_t model;
+    uint8_t msg[7], fifo[2];
     struct sensor_bulk sb;
 };
 
 enum {
-    LIS_PENDING = 1<<0,
+    LIS_PENDING = 1<<0, LIS_BUSY = 1<<1, LIS_DONE = 1<<2, LIS_READ_FIFO = 1<<3,
 };
 
 enum {
@@ -68,6 +72,33 @@ lis2dw_event(struct timer *timer)
     return SF_DONE;
 }
 
+// Callback from spidev_transfer_async() once a read completes
+static void
+lis2dw_spi_read_done(struct spidev_async *sa)
+{
+    struct lis2dw *ax = container_of(sa, struct lis2dw, async);
+    ax->flags |= LIS_DONE;
+    sched_wake_task(&lis2dw_wake);
+}
+
+// Callbacks from i2c_dev_read_async() once a read completes
+static void
+lis2dw_i2c_data_done(struct i2c_request *req, int ret)
+{
+    struct lis2dw *ax = container_of(req, struct lis2dw, i2c_data_req);
+    ax->i2c_ret = ret;
+}
+
+static void
+lis2dw_i2c_fifo_done(struct i2c_request *req, int ret)
+{
+    struct lis2dw *ax = container_of(req, struct lis2dw, i2c_fifo_req);
+    if (ret)
+        ax->i2c_ret = ret;
+    ax->flags |= LIS_DONE;
+    sched_wake_task(&lis2dw_wake);
+}
+
 void
 command_config_lis2dw(uint32_t *args)
 {
@@ -79,6 +110,7 @@ command_config_lis2dw(uint32_t *args)
         case SPI_SERIAL:
             if (CONFIG_WANT_SPI) {
                 ax->spi = spidev_oid_lookup(args[1]);
+                ax->async.func = lis2dw_spi_read_done;
                 ax->bus_type = SPI_SERIAL;
                 break;
             } else {
@@ -87,6 +119,8 @@ command_config_lis2dw(uint32_t *args)
         case I2C_SERIAL:
             if (CONFIG_WANT_I2C) {
                ax->i2c = i2cdev_oid_lookup(args[1]);
+               ax->i2c_data_req.func = lis2dw_i2c_data_done;
+               ax->i2c_fifo_req.func = lis2dw_i2c_fifo_done;
                ax->bus_type = I2C_SERIAL;
                break;
             } else {
@@ -118,64 +152,71 @@ lis2dw_reschedule_timer(struct lis2dw *ax)
     irq_enable();
 }
 
-// Query accelerometer data
+// Start a background read of the accelerometer data and fifo status
 static void
-lis2dw_query(struct lis2dw *ax, uint8_t oid)
+lis2dw_start_query(struct lis2dw *ax)
 {
-    uint8_t fifo_empty = 0;
-    uint8_t fifo_ovrn = 0;
-    uint8_t *d = &ax->sb.data[ax->sb.data_count];
-
+    memset(ax->msg, 0, sizeof(ax->msg));
+    memset(ax->fifo, 0, sizeof(ax->fifo));
+    ax->flags |= LIS_BUSY;
     if (CONFIG_WANT_SPI && ax->bus_type == SPI_SERIAL) {
-        uint8_t msg[7] = {0};
-        uint8_t fifo[2] = {LIS_FIFO_SAMPLES | LIS_AM_READ , 0};
-
-        msg[0] = LIS_AR_DATAX0 | LIS_AM_READ;
-        if (ax->model == LIS3DH)
-            msg[0] |= LIS_MS_SPI;
-
-        spidev_transfer(ax->spi, 1, sizeof(msg), msg);
-
-        spidev_transfer(ax->spi, 1, sizeof(fifo), fifo);
-
+        ax->msg[0] = LIS_AR_DATAX0 | LIS_AM_READ;
         if (ax->model == LIS3DH)
-            fifo_empty = fifo[1] & 0x20;
-        else
-            fifo_empty = fifo[1] & 0x3F;
-
-        fifo_ovrn = fifo[1] & 0x40;
-
-        for (uint32_t i = 0; i < BYTES_PER_SAMPLE; i++)
-            d[i] = msg[i + 1];
+            ax->msg[0] |= LIS_MS_SPI;
+        spidev_transfer_async(ax->spi, 1, sizeof(ax->msg), ax->msg
+                              , &ax->async);
     } else if (CONFIG_WANT_I2C && ax->bus_type == I2C_SERIAL) {
-        uint8_t msg_reg[] = {LIS_AR_DATAX0};
+        // Both reads are queued together - the fifo read signals done
+        ax->msg[0] = LIS_AR_DATAX0;
         if (ax->model == LIS3DH)
-            msg_reg[0] |= LIS_MS_I2C;
-        uint8_t msg[6];
-        uint8_t fifo_reg[1] = {LIS_FIFO_SAMPLES};
-        uint8_t fifo[1];
-
-        int ret;
-        ret = i2c_dev_read(ax->i2c, sizeof(msg_reg), msg_reg
-                    , sizeof(msg), msg);
-        i2c_shutdown_on_err(ret);
+            ax->msg[0] |= LIS_MS_I2C;
+        ax->fifo[0] = LIS_FIFO_SAMPLES;
+        ax->i2c_ret = I2C_BUS_SUCCESS;
+        i2c_dev_read_async(ax->i2c, &ax->i2c_data_req, 1, &ax->msg[0]
+                           , sizeof(ax->msg) - 1, &ax->msg[1]);
+        i2c_dev_read_async(ax->i2c, &ax->i2c_fifo_req, 1, &ax->fifo[0]
+                           , sizeof(ax->fifo) - 1, &ax->fifo[1]);
+    }
+}
 
-        ret = i2c_dev_read(ax->i2c, sizeof(fifo_reg), fifo_reg
-                    , sizeof(fifo), fifo);
-        i2c_shutdown_on_err(ret);
+// Start a background read of the fifo status register
+static void
+lis2dw_spi_start_fifo(struct lis2dw *ax)
+{
+    ax->fifo[0] = LIS_FIFO_SAMPLES | LIS_AM_READ;
+    ax->fifo[1] = 0;
+    ax->flags |= LIS_BUSY | LIS_READ_FIFO;
+    spidev_transfer_async(ax->spi, 1, sizeof(ax->fifo), ax->fifo, &ax->async);
+}
 
-        if (ax->model == LIS3DH)
-            fifo_empty = fifo[0] & 0x20;
-        else
-            fifo_empty = fifo[0] & 0x3F;
+// Process accelerometer data from a completed query
+static void
+lis2dw_query(struct lis2dw *ax, uint8_t oid)
+{
+    uint_fast8_t flags = ax->flags;
+    ax->flags = flags & ~(LIS_BUSY | LIS_DONE | LIS_READ_FIFO);
+    if (CONFIG_WANT_SPI && ax->bus_type == SPI_SERIAL) {
+        if (!(flags & LIS_READ_FIFO)) {
+            // Data registers read - now read the fifo status
+            lis2dw_spi_start_fifo(ax);
+            return;
+        }
+    } else if (CONFIG_WANT_I2C && ax->bus_type == I2C_SERIAL) {
+        i2c_shutdown_on_err(ax->i2c_ret);
+    }
 
-        fifo_ovrn = fifo[0] & 0x40;
+    uint8_t *d = &ax->sb.data[ax->sb.data_count];
+    for (uint32_t i = 0; i < BYTES_PER_SAMPLE; i++)
+        d[i] = ax->msg[i + 1];
 
-        for (uint32_t i = 0; i < BYTES_PER_SAMPLE; i++)
-            d[i] = msg[i];
-    }
+    uint8_t fifo_empty;
+    if (ax->model == LIS3DH)
+        fifo_empty = ax->fifo[1] & 0x20;
+    else
+        fifo_empty = ax->fifo[1] & 0x3F;
+    uint8_t fifo_ovrn = ax->fifo[1] & 0x40;
 
-    ax->sb.data_count += BYTES_PER_SAMPLE;
+    sensor_bulk_add_int16(&ax->sb, BYTES_PER_SAMPLE, 0);
     if (ax->sb.data_count + BYTES_PER_SAMPLE > ARRAY_SIZE(ax->sb.data))
         sensor_bulk_report(&ax->sb, oid);
 
@@ -185,8 +226,8 @@ lis2dw_query(struct lis2dw *ax, uint8_t oid)
 
     // check if we need to run the task again (more packets in fifo?)
     if (!fifo_empty) {
-        // More data in fifo - wake this task again
-        sched_wake_task(&lis2dw_wake);
+        // More data in fifo - start reading it now
+        lis2dw_start_query(ax);
     } else {
         // Sleep until next check time
         ax->flags &= ~LIS_PENDING;
@@ -200,6 +241,10 @@ command_query_lis2dw(uint32_t *args)
     struct lis2dw *ax = oid_lookup(args[0], command_config_lis2dw);
 
     sched_del_timer(&ax->timer);
+    if (CONFIG_WANT_SPI && ax->bus_type == SPI_SERIAL)
+        spidev_transfer_wait(ax->spi);
+    else if (CONFIG_WANT_I2C && ax->bus_type == I2C_SERIAL)
+        i2c_dev_wait(ax->i2c);
     ax->flags = 0;
     if (!args[1])
         // End measurements
@@ -212,6 +257,17 @@ command_query_lis2dw(uint32_t *args)
 }
 DECL_COMMAND(command_query_lis2dw, "query_lis2dw oid=%c rest_ticks=%u");
 
+#if CONFIG_WANT_SENSOR_DECIMATE
+void
+command_lis2dw_set_decimate(uint32_t *args)
+{
+    struct lis2dw *ax = oid_lookup(args[0], command_config_lis2dw);
+    ax->sb.decimate = sensor_decimate_oid_lookup(args[1]);
+}
+DECL_COMMAND(command_lis2dw_set_decimate,
+             "lis2dw_set_decimate oid=%c decimate_oid=%c");
+#endif
+
 void
 command_query_lis2dw_status(uint32_t *args)
 {
@@ -254,8 +310,10 @@ lis2dw_task(void)
     struct lis2dw *ax;
     foreach_oid(oid, ax, command_config_lis2dw) {
         uint_fast8_t flags = ax->flags;
-        if (flags & LIS_PENDING)
+        if (flags & LIS_DONE)
             lis2dw_query(ax, oid);
+        else if ((flags & (LIS_PENDING | LIS_BUSY)) == LIS_PENDING)
+            lis2dw_start_query(ax);
     }
 }
 DECL_TASK(lis2dw_task);
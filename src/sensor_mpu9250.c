@@ -7,13 +7,14 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_WANT_SENSOR_DECIMATE
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_read_time
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // DECL_TASK
 #include "sensor_bulk.h" // sensor_bulk_report
-#include "i2ccmds.h" // i2cdev_oid_lookup
+#include "i2ccmds.h" // i2c_dev_read_async
 
 // Chip registers
 #define AR_FIFO_COUNT_H 0x72
@@ -29,13 +30,15 @@ struct mpu9250 {
     struct timer timer;
     uint32_t rest_ticks;
     struct i2cdev_s *i2c;
+    struct i2c_request req;
     uint16_t fifo_max, fifo_pkts_bytes;
-    uint8_t flags;
+    uint8_t flags, reg, msg[2];
+    int8_t ret;
     struct sensor_bulk sb;
 };
 
 enum {
-    AX_PENDING = 1<<0,
+    AX_PENDING = 1<<0, AX_BUSY = 1<<1, AX_DONE = 1<<2, AX_READ_DATA = 1<<3,
 };
 
 static struct task_wake mpu9250_wake;
@@ -50,6 +53,16 @@ mpu9250_event(struct timer *timer)
     return SF_DONE;
 }
 
+// Callback from i2c_dev_read_async() once a read completes
+static void
+mpu9250_read_done(struct i2c_request *req, int ret)
+{
+    struct mpu9250 *mp = container_of(req, struct mpu9250, req);
+    mp->ret = ret;
+    mp->flags |= AX_DONE;
+    sched_wake_task(&mpu9250_wake);
+}
+
 void
 command_config_mpu9250(uint32_t *args)
 {
@@ -57,6 +70,7 @@ command_config_mpu9250(uint32_t *args)
                                    , sizeof(*mp));
     mp->timer.func = mpu9250_event;
     mp->i2c = i2cdev_oid_lookup(args[1]);
+    mp->req.func = mpu9250_read_done;
 }
 DECL_COMMAND(command_config_mpu9250, "config_mpu9250 oid=%c i2c_oid=%c");
 
@@ -78,40 +92,52 @@ read_mpu(struct i2cdev_s *i2c, uint8_t reg_len, uint8_t *reg
     i2c_shutdown_on_err(ret);
 }
 
-// Reads the fifo byte count from the device.
-static uint16_t
-get_fifo_status(struct mpu9250 *mp)
+// Start a background read of the fifo byte count or fifo data
+static void
+mp9250_start_query(struct mpu9250 *mp)
 {
-    uint8_t reg[] = {AR_FIFO_COUNT_H};
-    uint8_t msg[2];
-    read_mpu(mp->i2c, sizeof(reg), reg, sizeof(msg), msg);
-    uint16_t fifo_bytes = ((msg[0] & 0x1f) << 8) | msg[1];
-    if (fifo_bytes > mp->fifo_max)
-        mp->fifo_max = fifo_bytes;
-    return fifo_bytes;
+    uint_fast8_t read_len = BYTES_PER_BLOCK - mp->sb.data_count;
+    if (mp->fifo_pkts_bytes < read_len) {
+        // Not enough bytes to fill report - read MPU FIFO's fill
+        mp->flags |= AX_BUSY;
+        mp->reg = AR_FIFO_COUNT_H;
+        i2c_dev_read_async(mp->i2c, &mp->req, sizeof(mp->reg), &mp->reg
+                           , sizeof(mp->msg), mp->msg);
+    } else {
+        // Enough bytes to fill the buffer - read them
+        mp->flags |= AX_BUSY | AX_READ_DATA;
+        mp->reg = AR_FIFO;
+        i2c_dev_read_async(mp->i2c, &mp->req, sizeof(mp->reg), &mp->reg
+                           , read_len, &mp->sb.data[mp->sb.data_count]);
+    }
 }
 
-// Query accelerometer data
+// Process the results of a completed read
 static void
 mp9250_query(struct mpu9250 *mp, uint8_t oid)
 {
-    // If not enough bytes to fill report read MPU FIFO's fill
-    if (mp->fifo_pkts_bytes < BYTES_PER_BLOCK)
-        mp->fifo_pkts_bytes = get_fifo_status(mp);
-
-    // If we have enough bytes to fill the buffer do it and send report
-    if (mp->fifo_pkts_bytes >= BYTES_PER_BLOCK) {
-        uint8_t reg = AR_FIFO;
-        read_mpu(mp->i2c, sizeof(reg), &reg, BYTES_PER_BLOCK, &mp->sb.data[0]);
-        mp->sb.data_count = BYTES_PER_BLOCK;
-        mp->fifo_pkts_bytes -= BYTES_PER_BLOCK;
-        sensor_bulk_report(&mp->sb, oid);
+    uint_fast8_t flags = mp->flags;
+    mp->flags = flags & ~(AX_BUSY | AX_DONE | AX_READ_DATA);
+    i2c_shutdown_on_err(mp->ret);
+
+    if (flags & AX_READ_DATA) {
+        // Send report (once enough measurements remain after decimation)
+        uint_fast8_t read_len = BYTES_PER_BLOCK - mp->sb.data_count;
+        mp->fifo_pkts_bytes -= read_len;
+        sensor_bulk_add_int16(&mp->sb, read_len, 1);
+        if (mp->sb.data_count >= BYTES_PER_BLOCK)
+            sensor_bulk_report(&mp->sb, oid);
+    } else {
+        uint16_t fifo_bytes = ((mp->msg[0] & 0x1f) << 8) | mp->msg[1];
+        if (fifo_bytes > mp->fifo_max)
+            mp->fifo_max = fifo_bytes;
+        mp->fifo_pkts_bytes = fifo_bytes;
     }
 
-    // If we have enough bytes remaining to fill another report wake again
+    // If we have enough bytes to fill a report read them now
     //  otherwise schedule timed wakeup
-    if (mp->fifo_pkts_bytes >= BYTES_PER_BLOCK) {
-        sched_wake_task(&mpu9250_wake);
+    if (mp->fifo_pkts_bytes >= BYTES_PER_BLOCK - mp->sb.data_count) {
+        mp9250_start_query(mp);
     } else {
         mp->flags &= ~AX_PENDING;
         mp9250_reschedule_timer(mp);
@@ -124,6 +150,7 @@ command_query_mpu9250(uint32_t *args)
     struct mpu9250 *mp = oid_lookup(args[0], command_config_mpu9250);
 
     sched_del_timer(&mp->timer);
+    i2c_dev_wait(mp->i2c);
     mp->flags = 0;
     if (!args[1]) {
         // End measurements
@@ -142,6 +169,17 @@ command_query_mpu9250(uint32_t *args)
 }
 DECL_COMMAND(command_query_mpu9250, "query_mpu9250 oid=%c rest_ticks=%u");
 
+#if CONFIG_WANT_SENSOR_DECIMATE
+void
+command_mpu9250_set_decimate(uint32_t *args)
+{
+    struct mpu9250 *mp = oid_lookup(args[0], command_config_mpu9250);
+    mp->sb.decimate = sensor_decimate_oid_lookup(args[1]);
+}
+DECL_COMMAND(command_mpu9250_set_decimate,
+             "mpu9250_set_decimate oid=%c decimate_oid=%c");
+#endif
+
 void
 command_query_mpu9250_status(uint32_t *args)
 {
@@ -176,8 +214,10 @@ mpu9250_task(void)
     struct mpu9250 *mp;
     foreach_oid(oid, mp, command_config_mpu9250) {
         uint_fast8_t flags = mp->flags;
-        if (flags & AX_PENDING)
+        if (flags & AX_DONE)
             mp9250_query(mp, oid);
+        else if ((flags & (AX_PENDING | AX_BUSY)) == AX_PENDING)
+            mp9250_start_query(mp);
     }
 }
 DECL_TASK(mpu9250_task);
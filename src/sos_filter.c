@@ -35,15 +35,20 @@ overflows_int32(int64_t value) {
 }
 
 // Multiply a coefficient in fixedQ_coeff_t by a value fixedQ_value_t
-static inline fixedQ_value_t
-fixed_mul(struct sos_filter *sf, const fixedQ_coeff_t coeff
-        , const fixedQ_value_t value) {
+// keeping the full 64bit product
+static inline int64_t
+fixed_mul(const fixedQ_coeff_t coeff, const fixedQ_value_t value) {
     // This optimizes to single cycle SMULL on Arm Coretex M0+
-    int64_t product = (int64_t)coeff * (int64_t)value;
-    // round up at the last bit to be shifted away
-    product += sf->coeff_rounding;
-    // shift the decimal right to discard the coefficient fractional bits
-    int64_t result = product >> sf->coeff_frac_bits;
+    return (int64_t)coeff * (int64_t)value;
+}
+
+// Convert a sum of fixed_mul() products back to a fixedQ_value_t
+static inline fixedQ_value_t
+fixed_reduce(const int64_t sum, const uint8_t frac_bits
+             , const uint32_t rounding) {
+    // round up at the last bit to be shifted away and discard the
+    // coefficient fractional bits
+    int64_t result = (sum + rounding) >> frac_bits;
     // check for overflow of int32_t
     if (overflows_int32(result)) {
         shutdown("fixed_mul: overflow");
@@ -60,23 +65,30 @@ sosfilt(struct sos_filter *sf, const int32_t unfiltered_value) {
         shutdown("sos_filter not property initialized");
     }
 
-    // an empty filter performs no filtering
-    if (sf->n_sections == 0) {
-        return unfiltered_value;
-    }
-
+    // The products of each output are summed in 64bits and only rounded
+    // once. This needs fewer shifts and overflow checks per section and
+    // compiles to multiply-accumulate (SMLAL) instructions on Cortex-M3
+    // and later.
+    const uint8_t frac_bits = sf->coeff_frac_bits;
+    const uint32_t rounding = sf->coeff_rounding;
     fixedQ_value_t cur_val = unfiltered_value;
-    // foreach section
-    for (int section_idx = 0; section_idx < sf->n_sections; section_idx++) {
-        struct sos_filter_section *section = &(sf->filter[section_idx]);
+    struct sos_filter_section *section = sf->filter;
+    struct sos_filter_section *end = &sf->filter[sf->n_sections];
+    // an empty filter performs no filtering
+    for (; section < end; section++) {
+        const fixedQ_coeff_t *coeff = section->coeff;
+        fixedQ_value_t *state = section->state;
         // apply the section's filter coefficients to input
-        fixedQ_value_t next_val = fixed_mul(sf, section->coeff[0], cur_val);
-        next_val += section->state[0];
-        section->state[0] = fixed_mul(sf, section->coeff[1], cur_val)
-                            - fixed_mul(sf, section->coeff[3], next_val)
-                            + (section->state[1]);
-        section->state[1] = fixed_mul(sf, section->coeff[2], cur_val)
-                            - fixed_mul(sf, section->coeff[4], next_val);
+        int64_t next_sum = fixed_mul(coeff[0], cur_val)
+                           + ((int64_t)state[0] << frac_bits);
+        fixedQ_value_t next_val = fixed_reduce(next_sum, frac_bits, rounding);
+        int64_t state0_sum = fixed_mul(coeff[1], cur_val)
+                             - fixed_mul(coeff[3], next_val)
+                             + ((int64_t)state[1] << frac_bits);
+        int64_t state1_sum = fixed_mul(coeff[2], cur_val)
+                             - fixed_mul(coeff[4], next_val);
+        state[0] = fixed_reduce(state0_sum, frac_bits, rounding);
+        state[1] = fixed_reduce(state1_sum, frac_bits, rounding);
         cur_val = next_val;
     }
 
@@ -20,6 +20,10 @@ struct spidev_s {
     };
     struct gpio_out pin;
     uint8_t flags;
+#if CONFIG_HAVE_GPIO_SPI_ASYNC
+    struct spi_async async;
+    struct spidev_async *async_req;
+#endif
 };
 
 enum {
@@ -109,6 +113,77 @@ spidev_transfer(struct spidev_s *spi, uint8_t receive_data
         gpio_out_write(spi->pin, !(flags & SF_CS_ACTIVE_HIGH));
 }
 
+#if CONFIG_HAVE_GPIO_SPI_ASYNC
+// Release the cs pin once a background transfer completes
+static void
+spidev_async_done(struct spi_async *sa)
+{
+    struct spidev_s *spi = container_of(sa, struct spidev_s, async);
+    uint_fast8_t flags = spi->flags;
+    if (flags & SF_HAVE_PIN)
+        gpio_out_write(spi->pin, !(flags & SF_CS_ACTIVE_HIGH));
+    struct spidev_async *req = spi->async_req;
+    req->func(req);
+}
+#endif
+
+// Start a transfer that completes in the background (using dma where
+// the hardware supports it).  The callback is invoked, possibly from
+// irq context, once the transfer is complete.  The data buffer must
+// remain valid until then.  Must only be called from task context.
+void
+spidev_transfer_async(struct spidev_s *spi, uint8_t receive_data
+                      , uint8_t data_len, uint8_t *data
+                      , struct spidev_async *sa)
+{
+#if CONFIG_HAVE_GPIO_SPI_ASYNC
+    uint_fast8_t flags = spi->flags;
+    if (flags & SF_HARDWARE) {
+        // Waits for any prior background transfer on the bus
+        spi_prepare(spi->spi_config);
+
+        if (flags & SF_HAVE_PIN)
+            gpio_out_write(spi->pin, !!(flags & SF_CS_ACTIVE_HIGH));
+
+        spi->async.func = spidev_async_done;
+        spi->async_req = sa;
+        spi_transfer_async(spi->spi_config, receive_data, data_len, data
+                           , &spi->async);
+        return;
+    }
+#endif
+    spidev_transfer(spi, receive_data, data_len, data);
+    sa->func(sa);
+}
+
+// Wait for any background transfer on the device's bus to complete
+void
+spidev_transfer_wait(struct spidev_s *spi)
+{
+#if CONFIG_HAVE_GPIO_SPI_ASYNC
+    if (spi->flags & SF_HARDWARE)
+        spi_transfer_wait(spi->spi_config);
+#endif
+}
+
+// Perform 'count' separate receive transfers of 'data_len' bytes each
+void
+spidev_transfer_batch(struct spidev_s *spi, uint8_t count
+                      , uint8_t data_len, uint8_t *data)
+{
+#if CONFIG_HAVE_GPIO_SPI_BATCH
+    if ((spi->flags & (SF_HARDWARE|SF_HAVE_PIN)) == SF_HARDWARE) {
+        // Chip select is managed by the bus - submit all at once
+        spi_prepare(spi->spi_config);
+        spi_transfer_batch(spi->spi_config, count, data_len, data);
+        return;
+    }
+#endif
+    uint_fast8_t i;
+    for (i=0; i<count; i++)
+        spidev_transfer(spi, 1, data_len, &data[i * data_len]);
+}
+
 void
 command_spi_transfer(uint32_t *args)
 {
@@ -10,5 +10,14 @@ int spidev_have_cs_pin(struct spidev_s *spi);
 struct gpio_out spidev_get_cs_pin(struct spidev_s *spi);
 void spidev_transfer(struct spidev_s *spi, uint8_t receive_data
                      , uint8_t data_len, uint8_t *data);
+struct spidev_async {
+    void (*func)(struct spidev_async *sa);
+};
+void spidev_transfer_async(struct spidev_s *spi, uint8_t receive_data
+                           , uint8_t data_len, uint8_t *data
+                           , struct spidev_async *sa);
+void spidev_transfer_wait(struct spidev_s *spi);
+void spidev_transfer_batch(struct spidev_s *spi, uint8_t count
+                           , uint8_t data_len, uint8_t *data);
 
 #endif // spicmds.h
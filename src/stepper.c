@@ -4,15 +4,20 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <string.h> // memset
 #include "autoconf.h" // CONFIG_*
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // gpio_out_write
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_is_before
+#include "board/pgm.h" // __hotfunc
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // struct timer
 #include "stepper.h" // stepper_event
 #include "trsync.h" // trsync_add_signal
+#if CONFIG_WANT_STEPPER_HW
+ #include "board/stepper_hw.h" // stepper_hw_push
+#endif
 
 DECL_CONSTANT("STEPPER_STEP_BOTH_EDGE", 1);
 
@@ -32,21 +37,38 @@ struct stepper_move {
     uint32_t interval;
     int16_t add;
     uint16_t count;
+#if CONFIG_WANT_STEPPER_ADD2
+    int16_t add2;
+#endif
     uint8_t flags;
 };
 
 enum { MF_DIR=1<<0 };
 
+#define STEPPER_TIMING_BUCKETS 8
+
 struct stepper {
     struct timer time;
     uint32_t interval;
     int16_t add;
+#if CONFIG_WANT_STEPPER_ADD2
+    int16_t add2;
+#endif
     uint32_t count;
     uint32_t next_step_time, step_pulse_ticks;
     struct gpio_out step_pin, dir_pin;
     uint32_t position;
     struct move_queue_head mq;
     struct trsync_signal stop_signal;
+#if CONFIG_WANT_STEPPER_HW
+    struct stepper_hw *hw;
+    uint32_t hw_last, *hw_times;
+    uint8_t hw_pos, hw_flags;
+#endif
+#if CONFIG_WANT_STEPPER_TIMING_STATS
+    uint32_t timing_count, timing_max;
+    uint32_t timing_hist[STEPPER_TIMING_BUCKETS];
+#endif
     // gcc (pre v6) does better optimization when uint8_t are bitfields
     uint8_t flags : 8;
 };
@@ -55,11 +77,30 @@ enum { POSITION_BIAS=0x40000000 };
 
 enum {
     SF_LAST_DIR=1<<0, SF_NEXT_DIR=1<<1, SF_INVERT_STEP=1<<2, SF_NEED_RESET=1<<3,
-    SF_SINGLE_SCHED=1<<4, SF_OPTIMIZED_PATH=1<<5, SF_HAVE_ADD=1<<6
+    SF_SINGLE_SCHED=1<<4, SF_OPTIMIZED_PATH=1<<5, SF_HAVE_ADD=1<<6,
+    SF_ADD16=1<<7
 };
 
-// Setup a stepper for the next move in its queue
+enum { HWF_DIR=1<<0 };
+
+// Time to start a step on an idle hardware step generator
+#define HW_LEAD_TICKS timer_from_us(50)
+
+// Check if every step interval of a move fits in 16 bits.  The
+// stepper_event_avr() code can then update the interval using cheaper
+// 16bit math.  Fast moves (the ones that matter) always qualify.
 static uint_fast8_t
+stepper_is_add16(uint32_t interval, int16_t add, uint16_t count)
+{
+    if (interval >= 0x18000)
+        return 0;
+    int32_t first = (int32_t)interval + add;
+    int32_t last = first + (int32_t)add * (count - 1);
+    return first >= 0 && first <= 0xffff && last >= 0 && last <= 0xffff;
+}
+
+// Setup a stepper for the next move in its queue
+static uint_fast8_t __hotfunc
 stepper_load_next(struct stepper *s)
 {
     if (move_queue_empty(&s->mq)) {
@@ -74,15 +115,34 @@ stepper_load_next(struct stepper *s)
     uint32_t move_interval = m->interval;
     uint_fast16_t move_count = m->count;
     int_fast16_t move_add = m->add;
+#if CONFIG_WANT_STEPPER_ADD2
+    int_fast16_t move_add2 = m->add2;
+    s->add2 = move_add2;
+#endif
     uint_fast8_t need_dir_change = m->flags & MF_DIR;
-    move_free(m);
+    move_free(&s->mq, m);
 
     // Add all steps to s->position (stepper_get_position() can calc mid-move)
     s->position = (need_dir_change ? -s->position : s->position) + move_count;
 
     // Load next move into 'struct stepper'
-    s->add = move_add;
     s->interval = move_interval + move_add;
+#if CONFIG_WANT_STEPPER_ADD2
+    move_add += move_add2;
+#endif
+    s->add = move_add;
+#if CONFIG_WANT_STEPPER_HW
+    if (s->hw) {
+        // Using stepper_event_hw() (it handles the direction change
+        // once the hardware has completed all previously queued steps)
+        s->next_step_time += move_interval;
+        s->time.waketime = s->next_step_time - HW_LEAD_TICKS;
+        s->count = move_count;
+        if (need_dir_change)
+            s->hw_flags |= HWF_DIR;
+        return SF_RESCHEDULE;
+    }
+#endif
     if (HAVE_EDGE_OPTIMIZATION && s->flags & SF_OPTIMIZED_PATH) {
         // Using optimized stepper_event_edge()
         s->time.waketime += move_interval;
@@ -91,7 +151,13 @@ stepper_load_next(struct stepper *s)
         // Using optimized stepper_event_avr()
         s->time.waketime += move_interval;
         s->count = move_count;
-        s->flags = move_add ? s->flags | SF_HAVE_ADD : s->flags & ~SF_HAVE_ADD;
+        uint_fast8_t flags = s->flags & ~(SF_HAVE_ADD | SF_ADD16);
+        if (move_add) {
+            flags |= SF_HAVE_ADD;
+            if (stepper_is_add16(move_interval, move_add, move_count))
+                flags |= SF_ADD16;
+        }
+        s->flags = flags;
     } else {
         // Using fully scheduled stepper_event_full() code (the scheduler
         // may be called twice for each step)
@@ -135,7 +201,7 @@ stepper_load_next(struct stepper *s)
 #endif
 
 // Optimized step function to step on each step pin edge
-static uint_fast8_t
+static uint_fast8_t __hotfunc
 stepper_event_edge(struct timer *t)
 {
     struct stepper *s = container_of(t, struct stepper, time);
@@ -145,6 +211,9 @@ stepper_event_edge(struct timer *t)
         s->count = count;
         s->time.waketime += s->interval;
         s->interval += s->add;
+#if CONFIG_WANT_STEPPER_ADD2
+        s->add += s->add2;
+#endif
         return SF_RESCHEDULE;
     }
     return stepper_load_next(s);
@@ -156,7 +225,7 @@ stepper_event_edge(struct timer *t)
 #endif
 
 // AVR optimized step function
-static uint_fast8_t
+static uint_fast8_t __hotfunc
 stepper_event_avr(struct timer *t)
 {
     struct stepper *s = container_of(t, struct stepper, time);
@@ -166,8 +235,14 @@ stepper_event_avr(struct timer *t)
         *pcount = count;
         s->time.waketime += s->interval;
         gpio_out_toggle_noirq(s->step_pin);
-        if (s->flags & SF_HAVE_ADD)
+        uint_fast8_t flags = s->flags;
+        if (likely(flags & SF_ADD16)) {
+            // Interval known to stay in 16 bits - skip upper bytes
+            uint16_t *pinterval = (void*)&s->interval;
+            *pinterval += s->add;
+        } else if (flags & SF_HAVE_ADD) {
             s->interval += s->add;
+        }
         return SF_RESCHEDULE;
     }
     uint_fast8_t ret = stepper_load_next(s);
@@ -175,13 +250,38 @@ stepper_event_avr(struct timer *t)
     return ret;
 }
 
+#if CONFIG_WANT_STEPPER_TIMING_STATS
+// Note how late a step pin edge was relative to its scheduled time
+static void
+stepper_note_timing(struct stepper *s, uint32_t curtime)
+{
+    int32_t late = curtime - s->time.waketime;
+    if (late < 0)
+        late = 0;
+    s->timing_count++;
+    if (late > s->timing_max)
+        s->timing_max = late;
+    // Histogram buckets are: <1us, <4us, <16us, ..., <4096us, >=4096us
+    uint32_t us = late / timer_from_us(1);
+    uint_fast8_t bucket = 0;
+    while (us && bucket < STEPPER_TIMING_BUCKETS - 1) {
+        us >>= 2;
+        bucket++;
+    }
+    s->timing_hist[bucket]++;
+}
+#endif
+
 // Regular "fully scheduled" step function
-static uint_fast8_t
+static uint_fast8_t __hotfunc
 stepper_event_full(struct timer *t)
 {
     struct stepper *s = container_of(t, struct stepper, time);
     gpio_out_toggle_noirq(s->step_pin);
     uint32_t curtime = timer_read_time();
+#if CONFIG_WANT_STEPPER_TIMING_STATS
+    stepper_note_timing(s, curtime);
+#endif
     uint32_t min_next_time = curtime + s->step_pulse_ticks;
     uint32_t count = s->count - 1;
     if (likely(count & 1 && !(s->flags & SF_SINGLE_SCHED)))
@@ -190,6 +290,9 @@ stepper_event_full(struct timer *t)
     if (likely(count)) {
         s->next_step_time += s->interval;
         s->interval += s->add;
+#if CONFIG_WANT_STEPPER_ADD2
+        s->add += s->add2;
+#endif
         if (unlikely(timer_is_before(s->next_step_time, min_next_time)))
             // The next step event is too close - push it back
             goto reschedule_min;
@@ -205,8 +308,91 @@ reschedule_min:
     return SF_RESCHEDULE;
 }
 
+#if CONFIG_WANT_STEPPER_HW
+
+// Minimum time required to add a step to a busy step generator
+#define HW_MARGIN_TICKS timer_from_us(2)
+// Maximum time between steps queued to a busy step generator
+#define HW_MAX_DELAY_TICKS timer_from_us(100000)
+
+// Step function for steppers using a hardware step generator.  The
+// step times are calculated here and queued to the hardware (which
+// then generates the step pulses itself).
+static uint_fast8_t __hotfunc
+stepper_event_hw(struct timer *t)
+{
+    struct stepper *s = container_of(t, struct stepper, time);
+    struct stepper_hw *hw = s->hw;
+    uint_fast8_t pending = stepper_hw_pending(hw);
+    uint_fast8_t space = stepper_hw_space(hw);
+    for (;;) {
+        if (!s->count && stepper_load_next(s) == SF_DONE)
+            return SF_DONE;
+        uint32_t curtime = timer_read_time();
+        uint32_t step_time = s->next_step_time, last = s->hw_last;
+        uint32_t last_end = last + s->step_pulse_ticks;
+        if (pending && !(s->hw_flags & HWF_DIR)
+            && timer_is_before(curtime + HW_MARGIN_TICKS, last_end)
+            && step_time - last < HW_MAX_DELAY_TICKS) {
+            // Queue step relative to the previously queued step
+            if (!space) {
+                // Wake once about half the queued steps have completed
+                uint32_t waketime = s->hw_times[(s->hw_pos - pending / 2 - 1)
+                                                % STEPPER_HW_QUEUE_SIZE];
+                if (timer_is_before(waketime, curtime + HW_MARGIN_TICKS))
+                    waketime = curtime + HW_MARGIN_TICKS;
+                s->time.waketime = waketime;
+                return SF_RESCHEDULE;
+            }
+            stepper_hw_push(hw, step_time - last);
+        } else {
+            // Must wait for the hardware to complete all queued steps
+            if (pending || last_end - curtime <= s->step_pulse_ticks) {
+                uint32_t waketime = curtime + HW_MARGIN_TICKS;
+                if (timer_is_before(waketime, last_end))
+                    waketime = last_end;
+                s->time.waketime = waketime;
+                return SF_RESCHEDULE;
+            }
+            uint32_t min_time = curtime;
+            if (s->hw_flags & HWF_DIR) {
+                // Must ensure minimum time between dir change and step
+                gpio_out_toggle_noirq(s->dir_pin);
+                s->hw_flags &= ~HWF_DIR;
+                s->hw_last = curtime;
+                min_time = curtime + s->step_pulse_ticks;
+            }
+            if (timer_is_before(curtime + HW_LEAD_TICKS, step_time)) {
+                s->time.waketime = step_time - HW_LEAD_TICKS;
+                return SF_RESCHEDULE;
+            }
+            int32_t diff = step_time - curtime;
+            if (diff < (int32_t)-timer_from_us(1000))
+                shutdown("Stepper too far in past");
+            if (timer_is_before(step_time, min_time))
+                step_time = min_time;
+            stepper_hw_start(hw, step_time - curtime);
+        }
+        s->hw_last = step_time;
+        s->hw_times[s->hw_pos++ % STEPPER_HW_QUEUE_SIZE] = step_time;
+        pending++;
+        space--;
+        uint32_t count = s->count - 1;
+        s->count = count;
+        if (count) {
+            s->next_step_time += s->interval;
+            s->interval += s->add;
+#if CONFIG_WANT_STEPPER_ADD2
+            s->add += s->add2;
+#endif
+        }
+    }
+}
+
+#endif
+
 // Optimized entry point for step function (may be inlined into sched.c code)
-uint_fast8_t
+uint_fast8_t __hotfunc
 stepper_event(struct timer *t)
 {
     if (HAVE_EDGE_OPTIMIZATION)
@@ -229,7 +415,7 @@ command_config_stepper(uint32_t *args)
     s->dir_pin = gpio_out_setup(args[2], 0);
     s->position = -POSITION_BIAS;
     s->step_pulse_ticks = args[4];
-    move_queue_setup(&s->mq, sizeof(struct stepper_move));
+    move_queue_setup(args[0], &s->mq, sizeof(struct stepper_move));
     if (HAVE_EDGE_OPTIMIZATION) {
         if (invert_step < 0 && s->step_pulse_ticks <= EDGE_STEP_TICKS)
             s->flags |= SF_OPTIMIZED_PATH;
@@ -254,19 +440,28 @@ stepper_oid_lookup(uint8_t oid)
     return oid_lookup(oid, command_config_stepper);
 }
 
-// Schedule a set of steps with a given timing
+#if CONFIG_WANT_STEPPER_HW
+// Route a stepper's step pin to a hardware step generator
 void
-command_queue_step(uint32_t *args)
+command_config_stepper_hw(uint32_t *args)
 {
     struct stepper *s = stepper_oid_lookup(args[0]);
-    struct stepper_move *m = move_alloc();
-    m->interval = args[1];
-    m->count = args[2];
-    if (!m->count)
-        shutdown("Invalid count parameter");
-    m->add = args[3];
-    m->flags = 0;
+    if (s->flags & SF_SINGLE_SCHED)
+        shutdown("Hardware stepper can not step on both edges");
+    s->hw = stepper_hw_setup(args[1], s->flags & SF_INVERT_STEP
+                             , s->step_pulse_ticks);
+    s->hw_times = alloc_chunk(sizeof(*s->hw_times) * STEPPER_HW_QUEUE_SIZE);
+    s->flags &= ~SF_OPTIMIZED_PATH;
+    s->time.func = stepper_event_hw;
+}
+DECL_COMMAND(command_config_stepper_hw,
+             "config_stepper_hw oid=%c step_pin=%c");
+#endif
 
+// Add a move to the stepper's queue (and start stepper if idle)
+static void
+stepper_queue_move(struct stepper *s, struct stepper_move *m)
+{
     irq_disable();
     uint8_t flags = s->flags;
     if (!!(flags & SF_LAST_DIR) != !!(flags & SF_NEXT_DIR)) {
@@ -277,7 +472,7 @@ command_queue_step(uint32_t *args)
         s->flags = flags;
         move_queue_push(&m->node, &s->mq);
     } else if (flags & SF_NEED_RESET) {
-        move_free(m);
+        move_free(&s->mq, m);
     } else {
         s->flags = flags;
         move_queue_push(&m->node, &s->mq);
@@ -286,9 +481,113 @@ command_queue_step(uint32_t *args)
     }
     irq_enable();
 }
+
+// Schedule a set of steps with a given timing
+void __hotfunc
+command_queue_step(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    struct stepper_move *m = move_alloc(&s->mq);
+    m->interval = args[1];
+    m->count = args[2];
+    if (!m->count)
+        shutdown("Invalid count parameter");
+    m->add = args[3];
+#if CONFIG_WANT_STEPPER_ADD2
+    m->add2 = 0;
+#endif
+    m->flags = 0;
+    stepper_queue_move(s, m);
+}
 DECL_COMMAND(command_queue_step,
              "queue_step oid=%c interval=%u count=%hu add=%hi");
 
+#if CONFIG_WANT_STEPPER_ADD2
+// Schedule a set of steps whose 'add' also changes on each step
+void
+command_queue_step2(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    struct stepper_move *m = move_alloc(&s->mq);
+    m->interval = args[1];
+    m->count = args[2];
+    if (!m->count)
+        shutdown("Invalid count parameter");
+    m->add = args[3];
+    m->add2 = args[4];
+    m->flags = 0;
+    stepper_queue_move(s, m);
+}
+DECL_COMMAND(command_queue_step2,
+             "queue_step2 oid=%c interval=%u count=%hu add=%hi add2=%hi");
+#endif
+
+#if CONFIG_WANT_STEPPER_QUEUE_STEPS
+// Schedule several moves sent in a compact form.  Each move is
+// encoded as the vlq integers "count<<1|has_add2", the difference
+// between its interval and the interval that would follow the
+// previous move, the difference between its add and the previous
+// move's add, and (if has_add2) add2.
+void
+command_queue_steps(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    uint8_t *data = command_decode_ptr(args[2]), *end = &data[args[1]];
+    uint32_t next_interval = 0;
+    int16_t add = 0;
+    while (data < end) {
+        uint32_t count_flag = command_parse_int(&data);
+        uint16_t count = count_flag >> 1;
+        uint32_t interval = next_interval + command_parse_int(&data);
+        add += command_parse_int(&data);
+        int16_t add2 = count_flag & 1 ? command_parse_int(&data) : 0;
+        if (!count || data > end)
+            shutdown("Invalid queue_steps data");
+        struct stepper_move *m = move_alloc(&s->mq);
+        m->interval = interval;
+        m->count = count;
+        m->add = add;
+        m->add2 = add2;
+        m->flags = 0;
+        stepper_queue_move(s, m);
+        next_interval = interval + add * count;
+    }
+}
+DECL_COMMAND(command_queue_steps, "queue_steps oid=%c data=%*s");
+
+// Schedule moves for several steppers in a single command.  Each move
+// is encoded as the vlq integers "oid", "count<<1|has_add2", the
+// difference between its interval and the previous move's interval,
+// the difference between its add and the previous move's add, and
+// (if has_add2) add2.
+void
+command_queue_step_multi(uint32_t *args)
+{
+    uint8_t *data = command_decode_ptr(args[1]), *end = &data[args[0]];
+    uint32_t interval = 0;
+    int16_t add = 0;
+    while (data < end) {
+        uint8_t oid = command_parse_int(&data);
+        uint32_t count_flag = command_parse_int(&data);
+        uint16_t count = count_flag >> 1;
+        interval += command_parse_int(&data);
+        add += command_parse_int(&data);
+        int16_t add2 = count_flag & 1 ? command_parse_int(&data) : 0;
+        if (!count || data > end)
+            shutdown("Invalid queue_step_multi data");
+        struct stepper *s = stepper_oid_lookup(oid);
+        struct stepper_move *m = move_alloc(&s->mq);
+        m->interval = interval;
+        m->count = count;
+        m->add = add;
+        m->add2 = add2;
+        m->flags = 0;
+        stepper_queue_move(s, m);
+    }
+}
+DECL_COMMAND(command_queue_step_multi, "queue_step_multi data=%*s");
+#endif
+
 // Set the direction of the next queued step
 void
 command_set_next_step_dir(uint32_t *args)
@@ -322,6 +621,14 @@ stepper_get_position(struct stepper *s)
 {
     uint32_t position = s->position;
     // If stepper is mid-move, subtract out steps not yet taken
+#if CONFIG_WANT_STEPPER_HW
+    if (s->hw) {
+        // Steps queued in the hardware precede any pending dir change
+        uint_fast8_t pending = stepper_hw_pending(s->hw);
+        position -= s->count;
+        position += s->hw_flags & HWF_DIR ? pending : -pending;
+    } else
+#endif
     if (s->flags & SF_SINGLE_SCHED)
         position -= s->count;
     else
@@ -345,14 +652,84 @@ command_stepper_get_position(uint32_t *args)
 }
 DECL_COMMAND(command_stepper_get_position, "stepper_get_position oid=%c");
 
+#define MAX_POSITIONS 12
+
+// Report the current position of several steppers at the same instant
+void
+command_stepper_get_positions(uint32_t *args)
+{
+    uint8_t count = args[0], *oids = command_decode_ptr(args[1]);
+    if (count > MAX_POSITIONS)
+        shutdown("Too many steppers in stepper_get_positions");
+    struct stepper *steppers[MAX_POSITIONS];
+    uint_fast8_t i;
+    for (i=0; i<count; i++)
+        steppers[i] = stepper_oid_lookup(oids[i]);
+    uint32_t positions[MAX_POSITIONS];
+    irq_disable();
+    for (i=0; i<count; i++)
+        positions[i] = stepper_get_position(steppers[i]);
+    irq_enable();
+    uint8_t data[MAX_POSITIONS * 4];
+    for (i=0; i<count; i++) {
+        uint32_t pos = positions[i] - POSITION_BIAS;
+        data[i*4] = pos;
+        data[i*4 + 1] = pos >> 8;
+        data[i*4 + 2] = pos >> 16;
+        data[i*4 + 3] = pos >> 24;
+    }
+    sendf("stepper_positions pos=%*s", count * 4, data);
+}
+DECL_COMMAND(command_stepper_get_positions, "stepper_get_positions oids=%*s");
+DECL_CONSTANT("STEPPER_GET_POSITIONS_MAX", MAX_POSITIONS);
+
+#if CONFIG_WANT_STEPPER_TIMING_STATS
+// Report (and optionally reset) the step timing statistics
+void
+command_stepper_get_timing(uint32_t *args)
+{
+    uint8_t oid = args[0];
+    struct stepper *s = stepper_oid_lookup(oid);
+    uint8_t hist[STEPPER_TIMING_BUCKETS * 4];
+    irq_disable();
+    uint32_t count = s->timing_count, max_late = s->timing_max, i;
+    for (i=0; i<STEPPER_TIMING_BUCKETS; i++) {
+        uint32_t v = s->timing_hist[i];
+        hist[i*4] = v;
+        hist[i*4 + 1] = v >> 8;
+        hist[i*4 + 2] = v >> 16;
+        hist[i*4 + 3] = v >> 24;
+    }
+    if (args[1]) {
+        s->timing_count = s->timing_max = 0;
+        memset(s->timing_hist, 0, sizeof(s->timing_hist));
+    }
+    irq_enable();
+    sendf("stepper_timing oid=%c count=%u max_late=%u hist=%*s"
+          , oid, count, max_late, sizeof(hist), hist);
+}
+DECL_COMMAND(command_stepper_get_timing, "stepper_get_timing oid=%c reset=%c");
+#endif
+
 // Stop all moves for a given stepper (caller must disable IRQs)
 static void
 stepper_stop(struct trsync_signal *tss, uint8_t reason)
 {
     struct stepper *s = container_of(tss, struct stepper, stop_signal);
     sched_del_timer(&s->time);
+#if CONFIG_WANT_STEPPER_HW
+    if (s->hw) {
+        // Steps discarded from the hardware are treated as not taken
+        uint_fast8_t discarded = stepper_hw_stop(s->hw);
+        s->position += s->hw_flags & HWF_DIR ? discarded : -discarded;
+        s->hw_last = timer_read_time();
+    }
+#endif
     s->next_step_time = s->time.waketime = 0;
     s->position = -stepper_get_position(s);
+#if CONFIG_WANT_STEPPER_HW
+    s->hw_flags = 0;
+#endif
     s->count = 0;
     s->flags = ((s->flags & (SF_INVERT_STEP|SF_SINGLE_SCHED|SF_OPTIMIZED_PATH))
                 | SF_NEED_RESET);
@@ -364,7 +741,7 @@ stepper_stop(struct trsync_signal *tss, uint8_t reason)
     while (!move_queue_empty(&s->mq)) {
         struct move_node *mn = move_queue_pop(&s->mq);
         struct stepper_move *m = container_of(mn, struct stepper_move, node);
-        move_free(m);
+        move_free(&s->mq, m);
     }
 }
 
@@ -0,0 +1,37 @@
+// Code for crc16_ccitt using the stm32 hardware crc unit
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "board/irq.h" // irq_save
+#include "board/misc.h" // crc16_ccitt
+#include "internal.h" // enable_pclock
+#include "sched.h" // DECL_INIT
+
+// 16bit polynomial with bit reversed input (by byte) and output
+#define CRC_CR_CCITT (CRC_CR_POLYSIZE_0 | CRC_CR_REV_IN_0 | CRC_CR_REV_OUT)
+
+// Implement the standard crc "ccitt" algorithm on the given buffer
+uint16_t
+crc16_ccitt(uint8_t *buf, uint_fast8_t len)
+{
+    volatile uint8_t *dr = (void*)&CRC->DR;
+    irqstatus_t flag = irq_save();
+    CRC->CR = CRC_CR_CCITT | CRC_CR_RESET;
+    while (len--)
+        *dr = *buf++;
+    uint16_t crc = CRC->DR;
+    irq_restore(flag);
+    return crc;
+}
+
+void
+crc16_ccitt_init(void)
+{
+    enable_pclock(CRC_BASE);
+    CRC->POL = 0x1021;
+    CRC->INIT = 0xffff;
+    CRC->CR = CRC_CR_CCITT | CRC_CR_RESET;
+}
+DECL_INIT(crc16_ccitt_init);
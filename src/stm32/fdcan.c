@@ -98,14 +98,25 @@ struct fdcan_fifo {
 
 #define FDCAN_XTD (1<<30)
 #define FDCAN_RTR (1<<29)
+#define FDCAN_FDF (1<<21)
+#define FDCAN_BRS (1<<20)
+
+// The stm32h7 has a configurable message ram - use deeper fifos there
+#if CONFIG_MACH_STM32H7
+ #define FDCAN_RXF0_SIZE 16
+ #define FDCAN_TXFIFO_SIZE 16
+#else
+ #define FDCAN_RXF0_SIZE 3
+ #define FDCAN_TXFIFO_SIZE 3
+#endif
 
 struct fdcan_msg_ram {
     uint32_t FLS[28]; // Filter list standard
     uint32_t FLE[16]; // Filter list extended
-    struct fdcan_fifo RXF0[3];
+    struct fdcan_fifo RXF0[FDCAN_RXF0_SIZE];
     struct fdcan_fifo RXF1[3];
     uint32_t TEF[6]; // Tx event FIFO
-    struct fdcan_fifo TXFIFO[3];
+    struct fdcan_fifo TXFIFO[FDCAN_TXFIFO_SIZE];
 };
 
 struct fdcan_ram_layout {
@@ -138,9 +149,17 @@ canhw_send(struct canbus_msg *msg)
         ids = (msg->id & 0x7ff) << 18;
     ids |= msg->id & CANMSG_ID_RTR ? FDCAN_RTR : 0;
     txfifo->id_section = ids;
-    txfifo->dlc_section = (msg->dlc & 0x0f) << 16;
-    txfifo->data[0] = msg->data32[0];
-    txfifo->data[1] = msg->data32[1];
+    uint32_t dlcs = (msg->dlc & 0x0f) << 16;
+    if (CONFIG_CANBUS_FD && msg->dlc & CANMSG_DLC_FD) {
+        txfifo->dlc_section = dlcs | FDCAN_FDF | FDCAN_BRS;
+        uint32_t i, words = DIV_ROUND_UP(CANMSG_DATA_LEN(msg), 4);
+        for (i = 0; i < words; i++)
+            txfifo->data[i] = msg->data32[i];
+    } else {
+        txfifo->dlc_section = dlcs;
+        txfifo->data[0] = msg->data32[0];
+        txfifo->data[1] = msg->data32[1];
+    }
     barrier();
     SOC_CAN->TXBAR = ((uint32_t)1 << w_index);
     return CANMSG_DATA_LEN(msg);
@@ -242,9 +261,16 @@ CAN_IRQHandler(void)
             else
                 msg.id = (ids >> 18) & 0x7ff;
             msg.id |= ids & FDCAN_RTR ? CANMSG_ID_RTR : 0;
-            msg.dlc = (rxf0->dlc_section >> 16) & 0x0f;
+            uint32_t dlcs = rxf0->dlc_section;
+            msg.dlc = (dlcs >> 16) & 0x0f;
             msg.data32[0] = rxf0->data[0];
             msg.data32[1] = rxf0->data[1];
+            if (CONFIG_CANBUS_FD && dlcs & FDCAN_FDF) {
+                msg.dlc |= CANMSG_DLC_FD;
+                uint32_t i, words = DIV_ROUND_UP(CANMSG_DATA_LEN(&msg), 4);
+                for (i = 2; i < words; i++)
+                    msg.data32[i] = rxf0->data[i];
+            }
             barrier();
             SOC_CAN->RXF0A = idx;
 
@@ -317,6 +343,34 @@ compute_btr(uint32_t pclock, uint32_t bitrate)
     return make_btr(sjw, time_seg1, time_seg2, brp);
 }
 
+// Configure the CAN-FD data phase bit timing
+static void
+setup_data_btr(uint32_t pclock, uint32_t bitrate)
+{
+    uint32_t bit_clocks = pclock / bitrate; // clock ticks per bit
+
+    // Use the lowest brp (most time quanta) that gives the exact bit time
+    uint32_t qs;
+    for (qs = 25; qs > 5; qs--)
+        if (bit_clocks % qs == 0)
+            break;
+    uint32_t brp       = bit_clocks / qs;
+    uint32_t time_seg2 = qs / 4; // sample at ~75%
+    uint32_t time_seg1 = qs - (1 + time_seg2);
+    uint32_t sjw       = time_seg2;
+
+    uint32_t dbtp = (((sjw - 1) << FDCAN_DBTP_DSJW_Pos)
+                     | ((time_seg1 - 1) << FDCAN_DBTP_DTSEG1_Pos)
+                     | ((time_seg2 - 1) << FDCAN_DBTP_DTSEG2_Pos)
+                     | ((brp - 1) << FDCAN_DBTP_DBRP_Pos));
+    if (brp <= 2) {
+        // Transmitter delay compensation is needed at high data rates
+        dbtp |= FDCAN_DBTP_TDC;
+        SOC_CAN->TDCR = ((1 + time_seg1) * brp) << FDCAN_TDCR_TDCO_Pos;
+    }
+    SOC_CAN->DBTP = dbtp;
+}
+
 void
 can_init(void)
 {
@@ -349,6 +403,12 @@ can_init(void)
 
     SOC_CAN->NBTP = btr;
 
+    if (CONFIG_CANBUS_FD) {
+        /* Enable CAN-FD frames with bit rate switching */
+        SOC_CAN->CCCR |= FDCAN_CCCR_FDOE | FDCAN_CCCR_BRSE;
+        setup_data_btr(pclock, CONFIG_CANBUS_FD_DATA_FREQUENCY);
+    }
+
 #if CONFIG_MACH_STM32H7
     /* Setup message RAM addresses */
     uint32_t f0sa = (uint32_t)MSG_RAM.RXF0 - SRAMCAN_BASE;
@@ -24,6 +24,14 @@ struct gpio_in gpio_in_setup(uint32_t pin, int32_t pull_up);
 void gpio_in_reset(struct gpio_in g, int32_t pull_up);
 uint8_t gpio_in_read(struct gpio_in g);
 
+struct gpio_irq {
+    void (*func)(struct gpio_irq *gi, uint32_t time);
+    uint32_t bit;
+};
+void gpio_irq_setup(struct gpio_irq *gi, uint32_t pin);
+void gpio_irq_enable(struct gpio_irq *gi, uint8_t rising);
+void gpio_irq_disable(struct gpio_irq *gi);
+
 struct gpio_pwm {
   void *reg;
 };
@@ -53,6 +61,12 @@ struct spi_config spi_setup(uint32_t bus, uint8_t mode, uint32_t rate);
 void spi_prepare(struct spi_config config);
 void spi_transfer(struct spi_config config, uint8_t receive_data
                   , uint8_t len, uint8_t *data);
+struct spi_async {
+    void (*func)(struct spi_async *sa);
+};
+void spi_transfer_async(struct spi_config config, uint8_t receive_data
+                        , uint8_t len, uint8_t *data, struct spi_async *sa);
+void spi_transfer_wait(struct spi_config config);
 
 struct i2c_config {
     void *i2c;
@@ -0,0 +1,166 @@
+// Gpio edge interrupts on stm32 (via the EXTI controller)
+//
+// Copyright (C) 2026  agent <agent@local>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
+#include "board/misc.h" // timer_read_time
+#include "command.h" // shutdown
+#include "gpio.h" // gpio_irq_setup
+#include "internal.h" // GPIO2PORT
+#include "sched.h" // sched_shutdown
+
+#if CONFIG_MACH_STM32H7
+ #define EXTI_IMR EXTI_D1->IMR1
+ #define EXTI_PR EXTI_D1->PR1
+ #define EXTI_RTSR EXTI->RTSR1
+ #define EXTI_FTSR EXTI->FTSR1
+#elif CONFIG_MACH_STM32G0
+ #define EXTI_IMR EXTI->IMR1
+ #define EXTI_RTSR EXTI->RTSR1
+ #define EXTI_FTSR EXTI->FTSR1
+#elif CONFIG_MACH_STM32G4 || CONFIG_MACH_STM32L4
+ #define EXTI_IMR EXTI->IMR1
+ #define EXTI_PR EXTI->PR1
+ #define EXTI_RTSR EXTI->RTSR1
+ #define EXTI_FTSR EXTI->FTSR1
+#else
+ #define EXTI_IMR EXTI->IMR
+ #define EXTI_PR EXTI->PR
+ #define EXTI_RTSR EXTI->RTSR
+ #define EXTI_FTSR EXTI->FTSR
+#endif
+
+// Each EXTI line (pin number) may only be routed to a single port
+static struct gpio_irq *exti_handlers[16];
+
+static uint32_t
+exti_pending(void)
+{
+#if CONFIG_MACH_STM32G0
+    return EXTI->RPR1 | EXTI->FPR1;
+#else
+    return EXTI_PR;
+#endif
+}
+
+static void
+exti_clear(uint32_t bits)
+{
+#if CONFIG_MACH_STM32G0
+    EXTI->RPR1 = bits;
+    EXTI->FPR1 = bits;
+#else
+    EXTI_PR = bits;
+#endif
+}
+
+// Dispatch gpio edge interrupts
+void
+EXTI_IRQHandler(void)
+{
+    uint32_t time = timer_read_time();
+    uint32_t pending = exti_pending() & EXTI_IMR & 0xffff;
+    exti_clear(pending);
+    while (pending) {
+        uint32_t line = __builtin_ctz(pending);
+        pending &= pending - 1;
+        struct gpio_irq *gi = exti_handlers[line];
+        gi->func(gi, time);
+    }
+}
+
+// Route a pin's EXTI line to the given port
+static void
+exti_route(uint32_t line, uint32_t port)
+{
+#if CONFIG_MACH_STM32G0
+    volatile uint32_t *exticr = &EXTI->EXTICR[line / 4];
+    uint32_t shift = (line % 4) * 8, mask = 0xff;
+#elif CONFIG_MACH_STM32F1
+    volatile uint32_t *exticr = &AFIO->EXTICR[line / 4];
+    uint32_t shift = (line % 4) * 4, mask = 0x0f;
+    enable_pclock(AFIO_BASE);
+#else
+    volatile uint32_t *exticr = &SYSCFG->EXTICR[line / 4];
+    uint32_t shift = (line % 4) * 4, mask = 0x0f;
+    enable_pclock(SYSCFG_BASE);
+#endif
+    *exticr = (*exticr & ~(mask << shift)) | (port << shift);
+}
+
+// Enable the irq vector that services an EXTI line
+static void
+exti_enable_vector(uint32_t line)
+{
+#if CONFIG_MACH_STM32F0 || CONFIG_MACH_STM32G0
+    if (line <= 1)
+        armcm_enable_irq(EXTI_IRQHandler, EXTI0_1_IRQn, 1);
+    else if (line <= 3)
+        armcm_enable_irq(EXTI_IRQHandler, EXTI2_3_IRQn, 1);
+    else
+        armcm_enable_irq(EXTI_IRQHandler, EXTI4_15_IRQn, 1);
+#else
+    if (line == 0)
+        armcm_enable_irq(EXTI_IRQHandler, EXTI0_IRQn, 1);
+    else if (line == 1)
+        armcm_enable_irq(EXTI_IRQHandler, EXTI1_IRQn, 1);
+    else if (line == 2)
+        armcm_enable_irq(EXTI_IRQHandler, EXTI2_IRQn, 1);
+    else if (line == 3)
+        armcm_enable_irq(EXTI_IRQHandler, EXTI3_IRQn, 1);
+    else if (line == 4)
+        armcm_enable_irq(EXTI_IRQHandler, EXTI4_IRQn, 1);
+    else if (line <= 9)
+        armcm_enable_irq(EXTI_IRQHandler, EXTI9_5_IRQn, 1);
+    else
+        armcm_enable_irq(EXTI_IRQHandler, EXTI15_10_IRQn, 1);
+#endif
+}
+
+// Prepare an edge interrupt for a pin (the pin must already be an
+// input).  The interrupt starts disabled.
+void
+gpio_irq_setup(struct gpio_irq *gi, uint32_t pin)
+{
+    uint32_t line = pin % 16;
+    if (exti_handlers[line])
+        shutdown("Pin number already has an edge interrupt");
+    gi->bit = 1 << line;
+    exti_handlers[line] = gi;
+    irqstatus_t flag = irq_save();
+    EXTI_IMR &= ~gi->bit;
+    exti_route(line, GPIO2PORT(pin));
+    irq_restore(flag);
+    exti_enable_vector(line);
+}
+
+// Invoke gi->func (from irq context) on the next rising (or falling)
+// edge of the pin
+void
+gpio_irq_enable(struct gpio_irq *gi, uint8_t rising)
+{
+    uint32_t bit = gi->bit;
+    irqstatus_t flag = irq_save();
+    if (rising) {
+        EXTI_FTSR &= ~bit;
+        EXTI_RTSR |= bit;
+    } else {
+        EXTI_RTSR &= ~bit;
+        EXTI_FTSR |= bit;
+    }
+    exti_clear(bit);
+    EXTI_IMR |= bit;
+    irq_restore(flag);
+}
+
+void
+gpio_irq_disable(struct gpio_irq *gi)
+{
+    irqstatus_t flag = irq_save();
+    EXTI_IMR &= ~gi->bit;
+    exti_clear(gi->bit);
+    irq_restore(flag);
+}
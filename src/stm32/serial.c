@@ -6,6 +6,7 @@
 
 #include "autoconf.h" // CONFIG_SERIAL_BAUD
 #include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
 #include "board/serial_irq.h" // serial_rx_byte
 #include "command.h" // DECL_CONSTANT_STR
 #include "internal.h" // enable_pclock
@@ -70,6 +71,29 @@
   #define USARTx_IRQn USART6_IRQn
 #endif
 
+// Dma stream used to transmit (from the stm32f4 reference manual dma
+// request mapping tables - streams used by spi async are avoided)
+#if !CONFIG_MACH_STM32F4
+#elif CONFIG_STM32_SERIAL_USART1 || CONFIG_STM32_SERIAL_USART1_ALT_PB7_PB6
+  #define TX_DMA DMA2
+  #define TX_DMA_STREAM DMA2_Stream7
+  #define TX_DMA_CHANNEL 4
+  #define TX_DMA_FLAGS (0x3d << 22)
+  #define TX_DMA_IRQn DMA2_Stream7_IRQn
+#elif CONFIG_STM32_SERIAL_USART2 || CONFIG_STM32_SERIAL_USART2_ALT_PD6_PD5
+  #define TX_DMA DMA1
+  #define TX_DMA_STREAM DMA1_Stream6
+  #define TX_DMA_CHANNEL 4
+  #define TX_DMA_FLAGS (0x3d << 16)
+  #define TX_DMA_IRQn DMA1_Stream6_IRQn
+#elif CONFIG_STM32_SERIAL_USART6 || CONFIG_STM32_SERIAL_USART6_ALT_PC7_PC6
+  #define TX_DMA DMA2
+  #define TX_DMA_STREAM DMA2_Stream6
+  #define TX_DMA_CHANNEL 5
+  #define TX_DMA_FLAGS (0x3d << 16)
+  #define TX_DMA_IRQn DMA2_Stream6_IRQn
+#endif
+
 #define CR1_FLAGS (USART_CR1_UE | USART_CR1_RE | USART_CR1_TE   \
                    | USART_CR1_RXNEIE)
 
@@ -92,12 +116,69 @@ USARTx_IRQHandler(void)
     }
 }
 
+#ifdef TX_DMA
+
+// Transmit blocks of data using dma (instead of a tx irq per byte)
+static uint8_t tx_dma_buf[64];
+
+// Start the transmit of the next block (if any) - irqs must be disabled
+static void
+tx_dma_kick(void)
+{
+    DMA_Stream_TypeDef *stream = TX_DMA_STREAM;
+    if (stream->CR & DMA_SxCR_EN)
+        // Transfer still in progress
+        return;
+    uint_fast8_t len = serial_get_tx_block(tx_dma_buf, sizeof(tx_dma_buf));
+    if (!len)
+        return;
+    TX_DMA->HIFCR = TX_DMA_FLAGS;
+    stream->M0AR = (uint32_t)tx_dma_buf;
+    stream->NDTR = len;
+    stream->CR = ((TX_DMA_CHANNEL << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_MINC
+                  | DMA_SxCR_DIR_0 | DMA_SxCR_TCIE | DMA_SxCR_EN);
+}
+
+void
+TX_DMA_IRQHandler(void)
+{
+    TX_DMA->HIFCR = TX_DMA_FLAGS;
+    tx_dma_kick();
+}
+
+void
+serial_enable_tx_irq(void)
+{
+    irqstatus_t flag = irq_save();
+    tx_dma_kick();
+    irq_restore(flag);
+}
+
+static void
+tx_dma_init(void)
+{
+    RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN | RCC_AHB1ENR_DMA2EN;
+    RCC->AHB1ENR;
+    TX_DMA_STREAM->PAR = (uint32_t)&USARTx->DR;
+    USARTx->CR3 = USART_CR3_DMAT;
+    armcm_enable_irq(TX_DMA_IRQHandler, TX_DMA_IRQn, 0);
+}
+
+#else
+
 void
 serial_enable_tx_irq(void)
 {
     USARTx->CR1 = CR1_FLAGS | USART_CR1_TXEIE;
 }
 
+static void
+tx_dma_init(void)
+{
+}
+
+#endif
+
 void
 serial_init(void)
 {
@@ -108,6 +189,7 @@ serial_init(void)
     USARTx->BRR = (((div / 16) << USART_BRR_DIV_Mantissa_Pos)
                    | ((div % 16) << USART_BRR_DIV_Fraction_Pos));
     USARTx->CR1 = CR1_FLAGS;
+    tx_dma_init();
     armcm_enable_irq(USARTx_IRQHandler, USARTx_IRQn, 0);
 
     gpio_peripheral(GPIO_Rx, GPIO_FUNCTION(GPIO_AF_MODE), 1);
@@ -4,7 +4,10 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_HAVE_GPIO_SPI_ASYNC
+#include "board/armcm_boot.h" // armcm_enable_irq
 #include "board/io.h" // readb, writeb
+#include "board/irq.h" // irq_save
 #include "command.h" // shutdown
 #include "gpio.h" // spi_setup
 #include "internal.h" // gpio_peripheral
@@ -122,10 +125,164 @@ spi_setup(uint32_t bus, uint8_t mode, uint32_t rate)
     return (struct spi_config){ .spi = spi, .spi_cr1 = cr1 };
 }
 
+
+
+/****************************************************************
+ * Asynchronous transfer tracking
+ ****************************************************************/
+
+#if CONFIG_HAVE_GPIO_SPI_ASYNC
+
+// Dma streams used for each spi block (from the stm32f4 reference
+// manual dma request mapping tables)
+struct spi_dma_info {
+    SPI_TypeDef *spi;
+    DMA_TypeDef *dma;
+    uint8_t rx_stream, tx_stream, channel;
+};
+
+static const struct spi_dma_info spi_dma[] = {
+    { SPI1, DMA2, 2, 5, 3 },
+    { SPI2, DMA1, 3, 4, 0 },
+#ifdef SPI3
+    { SPI3, DMA1, 0, 5, 0 },
+#endif
+#ifdef SPI4
+    { SPI4, DMA2, 0, 1, 4 },
+#endif
+};
+
+static struct spi_async *async_active[ARRAY_SIZE(spi_dma)];
+
+static DMA_Stream_TypeDef *
+dma_stream(DMA_TypeDef *dma, uint32_t stream)
+{
+    return (void*)dma + 0x10 + 0x18 * stream;
+}
+
+// Return the position of a stream's flags in the LISR/HISR registers
+static uint32_t
+dma_flag_shift(uint32_t stream)
+{
+    static const uint8_t shifts[] = { 0, 6, 16, 22 };
+    return shifts[stream & 3];
+}
+
+static uint32_t
+dma_rx_complete(const struct spi_dma_info *di)
+{
+    DMA_TypeDef *dma = di->dma;
+    uint32_t isr = di->rx_stream >= 4 ? dma->HISR : dma->LISR;
+    return (isr >> dma_flag_shift(di->rx_stream)) & DMA_LISR_TCIF0;
+}
+
+static void
+dma_clear_flags(DMA_TypeDef *dma, uint32_t stream)
+{
+    uint32_t flags = 0x3d << dma_flag_shift(stream);
+    if (stream >= 4)
+        dma->HIFCR = flags;
+    else
+        dma->LIFCR = flags;
+}
+
+static int
+spi_dma_lookup(SPI_TypeDef *spi)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(spi_dma); i++)
+        if (spi_dma[i].spi == spi)
+            return i;
+    return -1;
+}
+
+// Finish an asynchronous transfer and invoke its callback
+static void
+spi_async_complete(int idx)
+{
+    struct spi_async *sa = async_active[idx];
+    if (!sa)
+        return;
+    const struct spi_dma_info *di = &spi_dma[idx];
+    dma_clear_flags(di->dma, di->rx_stream);
+    dma_clear_flags(di->dma, di->tx_stream);
+    SPI_TypeDef *spi = di->spi;
+    while ((spi->SR & (SPI_SR_TXE|SPI_SR_BSY)) != SPI_SR_TXE)
+        ;
+    spi->CR2 &= ~(SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
+    async_active[idx] = NULL;
+    sa->func(sa);
+}
+
+void
+SPI_DMA_IRQHandler(void)
+{
+    int idx;
+    for (idx = 0; idx < ARRAY_SIZE(spi_dma); idx++)
+        if (async_active[idx] && dma_rx_complete(&spi_dma[idx]))
+            spi_async_complete(idx);
+}
+
+// Enable the irqs of the rx dma streams
+static void
+spi_async_enable_irqs(void)
+{
+    static uint8_t is_enabled;
+    if (is_enabled)
+        return;
+    is_enabled = 1;
+    RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN | RCC_AHB1ENR_DMA2EN;
+    RCC->AHB1ENR;
+    armcm_enable_irq(SPI_DMA_IRQHandler, DMA2_Stream2_IRQn, 2);
+    armcm_enable_irq(SPI_DMA_IRQHandler, DMA1_Stream3_IRQn, 2);
+#ifdef SPI3
+    armcm_enable_irq(SPI_DMA_IRQHandler, DMA1_Stream0_IRQn, 2);
+#endif
+#ifdef SPI4
+    armcm_enable_irq(SPI_DMA_IRQHandler, DMA2_Stream0_IRQn, 2);
+#endif
+}
+
+// Wait for any asynchronous transfer on the bus to complete
+static void
+spi_async_wait(SPI_TypeDef *spi)
+{
+    int idx = spi_dma_lookup(spi);
+    if (idx < 0 || !async_active[idx])
+        return;
+    while (!dma_rx_complete(&spi_dma[idx]))
+        ;
+    // Irqs may be disabled, so don't wait for the irq handler
+    irqstatus_t flag = irq_save();
+    spi_async_complete(idx);
+    irq_restore(flag);
+}
+
+void
+spi_transfer_wait(struct spi_config config)
+{
+    spi_async_wait(config.spi);
+}
+
+#else
+
+static void
+spi_async_wait(SPI_TypeDef *spi)
+{
+}
+
+#endif
+
+
+/****************************************************************
+ * Transfers
+ ****************************************************************/
+
 void
 spi_prepare(struct spi_config config)
 {
     SPI_TypeDef *spi = config.spi;
+    spi_async_wait(spi);
     uint32_t cr1 = spi->CR1;
     if (cr1 == config.spi_cr1)
         return;
@@ -148,6 +305,7 @@ spi_transfer(struct spi_config config, uint8_t receive_data,
     SPI_TypeDef *spi = config.spi;
     uint8_t *wptr = data;
     uint8_t *end = data + len;
+    spi_async_wait(spi);
     while (data < end) {
         if (CAN_BUFFER) {
             uint32_t sr = spi->SR & (SPI_SR_TXE | SPI_SR_RXNE);
@@ -169,3 +327,46 @@ spi_transfer(struct spi_config config, uint8_t receive_data,
     while ((spi->SR & (SPI_SR_TXE|SPI_SR_BSY)) != SPI_SR_TXE)
         ;
 }
+
+#if CONFIG_HAVE_GPIO_SPI_ASYNC
+
+// Start a dma transfer on the bus.  The callback is invoked from irq
+// context once the transfer completes.
+void
+spi_transfer_async(struct spi_config config, uint8_t receive_data
+                   , uint8_t len, uint8_t *data, struct spi_async *sa)
+{
+    SPI_TypeDef *spi = config.spi;
+    int idx = spi_dma_lookup(spi);
+    if (idx < 0 || !len) {
+        // No dma support on this bus
+        spi_transfer(config, receive_data, len, data);
+        sa->func(sa);
+        return;
+    }
+    spi_async_wait(spi);
+    const struct spi_dma_info *di = &spi_dma[idx];
+    DMA_TypeDef *dma = di->dma;
+    spi_async_enable_irqs();
+
+    // Received bytes are discarded to a dummy location if not needed
+    static uint8_t discard;
+    uint32_t chsel = di->channel << DMA_SxCR_CHSEL_Pos;
+    DMA_Stream_TypeDef *rx = dma_stream(dma, di->rx_stream);
+    DMA_Stream_TypeDef *tx = dma_stream(dma, di->tx_stream);
+    dma_clear_flags(dma, di->rx_stream);
+    dma_clear_flags(dma, di->tx_stream);
+    rx->PAR = (uint32_t)&spi->DR;
+    rx->M0AR = receive_data ? (uint32_t)data : (uint32_t)&discard;
+    rx->NDTR = len;
+    rx->CR = (chsel | (receive_data ? DMA_SxCR_MINC : 0)
+              | DMA_SxCR_TCIE | DMA_SxCR_EN);
+    tx->PAR = (uint32_t)&spi->DR;
+    tx->M0AR = (uint32_t)data;
+    tx->NDTR = len;
+    tx->CR = chsel | DMA_SxCR_MINC | DMA_SxCR_DIR_0 | DMA_SxCR_EN;
+    async_active[idx] = sa;
+    spi->CR2 |= SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+}
+
+#endif
@@ -4,6 +4,9 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_HAVE_GPIO_I2C_ASYNC
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
 #include "board/misc.h" // timer_is_before
 #include "command.h" // shutdown
 #include "gpio.h" // i2c_setup
@@ -175,6 +178,290 @@ i2c_setup(uint32_t bus, uint32_t rate, uint8_t addr)
     return (struct i2c_config){ .i2c=i2c, .addr=addr<<1 };
 }
 
+
+
+/****************************************************************
+ * Interrupt driven transactions
+ ****************************************************************/
+
+#if CONFIG_HAVE_GPIO_I2C_ASYNC
+
+enum { ES_WRITE, ES_READ, ES_STOP };
+
+struct i2c_engine {
+    struct timer timer;
+    struct i2c_request *head, **tailp;
+    uint8_t *data;
+    uint8_t remaining, state;
+    int8_t ret;
+};
+
+static I2C_TypeDef * const engine_i2c[] = {
+    I2C1,
+#ifdef I2C2
+    I2C2,
+#endif
+#ifdef I2C3
+    I2C3,
+#endif
+};
+
+static struct i2c_engine engines[ARRAY_SIZE(engine_i2c)];
+
+#define I2C_CR1_IRQS (I2C_CR1_TXIE | I2C_CR1_RXIE | I2C_CR1_TCIE \
+                      | I2C_CR1_NACKIE | I2C_CR1_STOPIE)
+#define I2C_ASYNC_TIMEOUT timer_from_us(5000)
+
+static int
+engine_lookup(I2C_TypeDef *i2c)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(engine_i2c); i++)
+        if (engine_i2c[i] == i2c)
+            return i;
+    return -1;
+}
+
+// Issue the start condition for the current phase of a transaction
+static void
+engine_start_phase(I2C_TypeDef *i2c, struct i2c_engine *e)
+{
+    struct i2c_request *req = e->head;
+    uint32_t addr = req->config.addr;
+    if (e->state == ES_WRITE) {
+        e->data = req->write;
+        e->remaining = req->write_len;
+        i2c->ISR = I2C_ISR_TXE; // Flush any stale tx byte
+        i2c->CR2 = (I2C_CR2_START | addr
+                    | (req->write_len << I2C_CR2_NBYTES_Pos)
+                    | (req->read_len ? 0 : I2C_CR2_AUTOEND));
+    } else {
+        e->data = req->read;
+        e->remaining = req->read_len;
+        i2c->CR2 = (I2C_CR2_START | I2C_CR2_RD_WRN | addr
+                    | (req->read_len << I2C_CR2_NBYTES_Pos)
+                    | I2C_CR2_AUTOEND);
+    }
+}
+
+// Start the transaction at the head of the queue
+static void
+engine_begin(I2C_TypeDef *i2c, struct i2c_engine *e)
+{
+    struct i2c_request *req = e->head;
+    e->state = req->write_len || !req->read_len ? ES_WRITE : ES_READ;
+    e->ret = I2C_BUS_SUCCESS;
+    e->timer.waketime = timer_read_time() + I2C_ASYNC_TIMEOUT;
+    engine_start_phase(i2c, e);
+}
+
+// Remove the completed transaction from the head of the queue
+static struct i2c_request *
+engine_pop(struct i2c_engine *e)
+{
+    struct i2c_request *req = e->head;
+    e->head = req->next;
+    if (!e->head)
+        e->tailp = &e->head;
+    return req;
+}
+
+// Process i2c hardware events for a bus
+static void
+engine_event(uint32_t idx)
+{
+    struct i2c_engine *e = &engines[idx];
+    I2C_TypeDef *i2c = engine_i2c[idx];
+    struct i2c_request *req = e->head;
+    if (!req)
+        return;
+    uint32_t isr = i2c->ISR;
+    if (isr & I2C_ISR_RXNE) {
+        uint8_t b = i2c->RXDR;
+        if (e->state == ES_READ && e->remaining) {
+            *e->data++ = b;
+            e->remaining--;
+        }
+    }
+    if (isr & I2C_ISR_NACKF) {
+        // Report the same error codes as i2c_read() and i2c_write()
+        i2c->ICR = I2C_ICR_NACKCF;
+        int ret = I2C_BUS_NACK;
+        if (e->state == ES_WRITE && e->remaining == req->write_len)
+            ret = I2C_BUS_START_NACK;
+        else if (e->state == ES_READ && e->remaining == req->read_len)
+            ret = (req->write_len ? I2C_BUS_START_READ_NACK
+                   : I2C_BUS_START_NACK);
+        e->ret = ret;
+        e->state = ES_STOP;
+        i2c->CR2 |= I2C_CR2_STOP;
+    }
+    if (isr & I2C_ISR_STOPF) {
+        // Transaction complete - start the next one
+        i2c->ICR = I2C_ICR_STOPCF;
+        int ret = e->ret;
+        sched_del_timer(&e->timer);
+        engine_pop(e);
+        if (e->head) {
+            engine_begin(i2c, e);
+            sched_add_timer(&e->timer);
+        } else {
+            i2c->CR1 = I2C_CR1_PE;
+        }
+        req->func(req, ret);
+        return;
+    }
+    if (e->state == ES_STOP)
+        return;
+    if (isr & I2C_ISR_TXIS && e->remaining) {
+        i2c->TXDR = *e->data++;
+        e->remaining--;
+    }
+    if (isr & I2C_ISR_TC) {
+        // Register write complete - issue a restart and read the data
+        e->state = ES_READ;
+        engine_start_phase(i2c, e);
+    }
+}
+
+void
+I2C_IRQHandler(void)
+{
+    uint32_t idx;
+    for (idx = 0; idx < ARRAY_SIZE(engines); idx++)
+        engine_event(idx);
+}
+
+// Abort a transaction that did not complete in time
+static uint_fast8_t
+engine_timeout(struct timer *t)
+{
+    struct i2c_engine *e = container_of(t, struct i2c_engine, timer);
+    I2C_TypeDef *i2c = engine_i2c[e - engines];
+    // Clearing the PE bit resets the i2c state machine
+    i2c->CR1 = 0;
+    i2c->CR1;
+    struct i2c_request *req = engine_pop(e);
+    if (e->head) {
+        i2c->CR1 = I2C_CR1_PE | I2C_CR1_IRQS;
+        engine_begin(i2c, e);
+    } else {
+        i2c->CR1 = I2C_CR1_PE;
+    }
+    req->func(req, I2C_BUS_TIMEOUT);
+    return e->head ? SF_RESCHEDULE : SF_DONE;
+}
+
+static void
+engine_enable_irqs(void)
+{
+#if CONFIG_MACH_STM32F0 || CONFIG_MACH_STM32G0
+    armcm_enable_irq(I2C_IRQHandler, I2C1_IRQn, 2);
+  #if defined(I2C3)
+    armcm_enable_irq(I2C_IRQHandler, I2C2_3_IRQn, 2);
+  #elif defined(I2C2)
+    armcm_enable_irq(I2C_IRQHandler, I2C2_IRQn, 2);
+  #endif
+#else
+    armcm_enable_irq(I2C_IRQHandler, I2C1_EV_IRQn, 2);
+  #ifdef I2C2
+    armcm_enable_irq(I2C_IRQHandler, I2C2_EV_IRQn, 2);
+  #endif
+  #ifdef I2C3
+    armcm_enable_irq(I2C_IRQHandler, I2C3_EV_IRQn, 2);
+  #endif
+#endif
+}
+
+// Queue an i2c transaction.  The request callback is invoked from irq
+// context once the transaction completes.
+void
+i2c_queue_request(struct i2c_request *req)
+{
+    I2C_TypeDef *i2c = req->config.i2c;
+    int idx = engine_lookup(i2c);
+    if (idx < 0 || sched_is_shutdown()) {
+        // Perform the transaction immediately
+        int ret;
+        if (req->read_len)
+            ret = i2c_read(req->config, req->write_len, req->write
+                           , req->read_len, req->read);
+        else
+            ret = i2c_write(req->config, req->write_len, req->write);
+        req->func(req, ret);
+        return;
+    }
+    struct i2c_engine *e = &engines[idx];
+    req->next = NULL;
+    irqstatus_t flag = irq_save();
+    if (!e->tailp) {
+        // First use of this bus
+        e->tailp = &e->head;
+        e->timer.func = engine_timeout;
+        engine_enable_irqs();
+    }
+    int is_idle = !e->head;
+    *e->tailp = req;
+    e->tailp = &req->next;
+    if (is_idle) {
+        i2c->CR1 = I2C_CR1_PE | I2C_CR1_IRQS;
+        engine_begin(i2c, e);
+        sched_add_timer(&e->timer);
+    }
+    irq_restore(flag);
+}
+
+// Wait for all queued transactions on a bus to complete
+static void
+i2c_async_wait(I2C_TypeDef *i2c)
+{
+    int idx = engine_lookup(i2c);
+    if (idx < 0)
+        return;
+    struct i2c_engine *e = &engines[idx];
+    while (e->head)
+        irq_poll();
+}
+
+void
+i2c_queue_wait(struct i2c_config config)
+{
+    i2c_async_wait(config.i2c);
+}
+
+// Discard queued transactions on a shutdown
+void
+i2c_async_shutdown(void)
+{
+    uint32_t idx;
+    for (idx = 0; idx < ARRAY_SIZE(engines); idx++) {
+        struct i2c_engine *e = &engines[idx];
+        if (!e->head)
+            continue;
+        I2C_TypeDef *i2c = engine_i2c[idx];
+        i2c->CR1 = 0;
+        i2c->CR1;
+        i2c->CR1 = I2C_CR1_PE;
+        e->head = NULL;
+        e->tailp = &e->head;
+    }
+}
+DECL_SHUTDOWN(i2c_async_shutdown);
+
+#else
+
+static void
+i2c_async_wait(I2C_TypeDef *i2c)
+{
+}
+
+#endif
+
+
+/****************************************************************
+ * Blocking transactions
+ ****************************************************************/
+
 static int
 i2c_wait(I2C_TypeDef *i2c, uint32_t set, uint32_t timeout)
 {
@@ -193,6 +480,7 @@ int
 i2c_write(struct i2c_config config, uint8_t write_len, uint8_t *write)
 {
     I2C_TypeDef *i2c = config.i2c;
+    i2c_async_wait(i2c);
     uint32_t timeout = timer_read_time() + timer_from_us(5000);
     int ret = I2C_BUS_SUCCESS;
     uint8_t *write_orig = write;
@@ -219,6 +507,7 @@ i2c_read(struct i2c_config config, uint8_t reg_len, uint8_t *reg
          , uint8_t read_len, uint8_t *read)
 {
     I2C_TypeDef *i2c = config.i2c;
+    i2c_async_wait(i2c);
     uint32_t timeout = timer_read_time() + timer_from_us(5000);
     int ret = I2C_BUS_SUCCESS;
     uint8_t *write_orig = reg;
@@ -10,6 +10,7 @@
 #include "board/io.h" // readl
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_read_time
+#include "board/pgm.h" // __hotfunc
 #include "sched.h" // DECL_INIT
 #include "command.h" // DECL_SHUTDOWN
 #include "board/timer_irq.h" // timer_dispatch_many
@@ -103,7 +104,7 @@ DECL_SHUTDOWN(timer_reset);
  ****************************************************************/
 
 // Hardware timer IRQ handler - dispatch software timers
-void __aligned(16)
+void __aligned(16) __hotfunc
 TIMx_IRQHandler(void)
 {
     irq_disable();
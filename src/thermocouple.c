@@ -84,13 +84,11 @@ DECL_COMMAND(command_query_thermocouple,
              "query_thermocouple oid=%c clock=%u rest_ticks=%u"
              " min_value=%u max_value=%u max_invalid_count=%c");
 
+// Check a reading and stop if it is repeatedly outside the allowed range
 static void
-thermocouple_respond(struct thermocouple_spi *spi, uint32_t next_begin_time
-                     , uint32_t value, uint8_t fault, uint8_t oid)
+thermocouple_check_result(struct thermocouple_spi *spi, uint32_t value
+                          , uint8_t fault)
 {
-    sendf("thermocouple_result oid=%c next_clock=%u value=%u fault=%c",
-          oid, next_begin_time, value, fault);
-    /* check the result and stop if below or above allowed range */
     if (fault || value < spi->min_value || value > spi->max_value) {
         spi->invalid_count++;
         if (spi->invalid_count < spi->max_invalid)
@@ -100,67 +98,83 @@ thermocouple_respond(struct thermocouple_spi *spi, uint32_t next_begin_time
     spi->invalid_count = 0;
 }
 
-static void
-thermocouple_handle_max31855(struct thermocouple_spi *spi
-                             , uint32_t next_begin_time, uint8_t oid)
+static uint8_t
+thermocouple_read_max31855(struct thermocouple_spi *spi, uint32_t *pvalue)
 {
     uint8_t msg[4] = { 0x00, 0x00, 0x00, 0x00 };
     spidev_transfer(spi->spi, 1, sizeof(msg), msg);
     uint32_t value;
     memcpy(&value, msg, sizeof(value));
     value = be32_to_cpu(value);
-    thermocouple_respond(spi, next_begin_time, value, value & 0x07, oid);
+    *pvalue = value;
+    return value & 0x07;
 }
 
 #define MAX31856_LTCBH_REG 0x0C
 #define MAX31856_SR_REG 0x0F
 
-static void
-thermocouple_handle_max31856(struct thermocouple_spi *spi
-                             , uint32_t next_begin_time, uint8_t oid)
+static uint8_t
+thermocouple_read_max31856(struct thermocouple_spi *spi, uint32_t *pvalue)
 {
     uint8_t msg[4] = { MAX31856_LTCBH_REG, 0x00, 0x00, 0x00 };
     spidev_transfer(spi->spi, 1, sizeof(msg), msg);
     uint32_t value;
     memcpy(&value, msg, sizeof(value));
-    value = be32_to_cpu(value) & 0x00ffffff;
+    *pvalue = be32_to_cpu(value) & 0x00ffffff;
     // Read faults
     msg[0] = MAX31856_SR_REG;
     msg[1] = 0x00;
     spidev_transfer(spi->spi, 1, 2, msg);
-    thermocouple_respond(spi, next_begin_time, value, msg[1], oid);
+    return msg[1];
 }
 
 #define MAX31865_RTDMSB_REG 0x01
 #define MAX31865_FAULTSTAT_REG 0x07
 
-static void
-thermocouple_handle_max31865(struct thermocouple_spi *spi
-                             , uint32_t next_begin_time, uint8_t oid)
+static uint8_t
+thermocouple_read_max31865(struct thermocouple_spi *spi, uint32_t *pvalue)
 {
     uint8_t msg[4] = { MAX31865_RTDMSB_REG, 0x00, 0x00, 0x00 };
     spidev_transfer(spi->spi, 1, 3, msg);
     uint32_t value;
     memcpy(&value, msg, sizeof(value));
     value = (be32_to_cpu(value) >> 8) & 0xffff;
+    *pvalue = value;
     // Read faults
     msg[0] = MAX31865_FAULTSTAT_REG;
     msg[1] = 0x00;
     spidev_transfer(spi->spi, 1, 2, msg);
-    uint8_t fault = (msg[1] & ~0x03) | (value & 0x0001);
-    thermocouple_respond(spi, next_begin_time, value, fault, oid);
+    return (msg[1] & ~0x03) | (value & 0x0001);
 }
 
-static void
-thermocouple_handle_max6675(struct thermocouple_spi *spi
-                            , uint32_t next_begin_time, uint8_t oid)
+static uint8_t
+thermocouple_read_max6675(struct thermocouple_spi *spi, uint32_t *pvalue)
 {
     uint8_t msg[2] = { 0x00, 0x00};
     spidev_transfer(spi->spi, 1, sizeof(msg), msg);
     uint16_t value;
     memcpy(&value, msg, sizeof(msg));
     value = be16_to_cpu(value);
-    thermocouple_respond(spi, next_begin_time, value, value & 0x06, oid);
+    *pvalue = value;
+    return value & 0x06;
+}
+
+// Read the chip and return its fault status
+static uint8_t
+thermocouple_read(struct thermocouple_spi *spi, uint32_t *pvalue)
+{
+    switch (spi->chip_type) {
+    case TS_CHIP_MAX31855:
+        return thermocouple_read_max31855(spi, pvalue);
+    case TS_CHIP_MAX31856:
+        return thermocouple_read_max31856(spi, pvalue);
+    case TS_CHIP_MAX31865:
+        return thermocouple_read_max31865(spi, pvalue);
+    case TS_CHIP_MAX6675:
+        return thermocouple_read_max6675(spi, pvalue);
+    }
+    *pvalue = 0;
+    return 0;
 }
 
 // task to read thermocouple and send response
@@ -178,20 +192,139 @@ thermocouple_task(void)
         uint32_t next_begin_time = spi->timer.waketime;
         spi->flags &= ~TS_PENDING;
         irq_enable();
-        switch (spi->chip_type) {
-        case TS_CHIP_MAX31855:
-            thermocouple_handle_max31855(spi, next_begin_time, oid);
-            break;
-        case TS_CHIP_MAX31856:
-            thermocouple_handle_max31856(spi, next_begin_time, oid);
-            break;
-        case TS_CHIP_MAX31865:
-            thermocouple_handle_max31865(spi, next_begin_time, oid);
-            break;
-        case TS_CHIP_MAX6675:
-            thermocouple_handle_max6675(spi, next_begin_time, oid);
-            break;
-        }
+        uint32_t value;
+        uint8_t fault = thermocouple_read(spi, &value);
+        sendf("thermocouple_result oid=%c next_clock=%u value=%u fault=%c",
+              oid, next_begin_time, value, fault);
+        thermocouple_check_result(spi, value, fault);
     }
 }
 DECL_TASK(thermocouple_task);
+
+
+/****************************************************************
+ * Thermocouple groups
+ ****************************************************************/
+
+// A group reads several chips back to back from one timer and
+// reports all of their results in a single message.
+
+#define THERMOCOUPLE_GROUP_MAX 9
+#define GROUP_BYTES_PER_SENSOR 5
+
+struct thermocouple_group {
+    struct timer timer;
+    uint32_t rest_time;
+    uint8_t sensor_count, flags;
+    struct thermocouple_spi *sensors[];
+};
+
+static struct task_wake thermocouple_group_wake;
+
+static uint_fast8_t
+thermocouple_group_event(struct timer *timer)
+{
+    struct thermocouple_group *tg = container_of(
+        timer, struct thermocouple_group, timer);
+    sched_wake_task(&thermocouple_group_wake);
+    tg->flags |= TS_PENDING;
+    tg->timer.waketime += tg->rest_time;
+    return SF_RESCHEDULE;
+}
+
+void
+command_config_thermocouple_group(uint32_t *args)
+{
+    uint8_t sensor_count = args[1];
+    if (!sensor_count || sensor_count > THERMOCOUPLE_GROUP_MAX)
+        shutdown("Invalid thermocouple group sensor count");
+    struct thermocouple_group *tg = oid_alloc(
+        args[0], command_config_thermocouple_group
+        , sizeof(*tg) + sensor_count * sizeof(tg->sensors[0]));
+    tg->timer.func = thermocouple_group_event;
+    tg->sensor_count = sensor_count;
+}
+DECL_COMMAND(command_config_thermocouple_group,
+             "config_thermocouple_group oid=%c sensor_count=%c");
+
+void
+command_config_thermocouple_group_sensor(uint32_t *args)
+{
+    struct thermocouple_group *tg = oid_lookup(
+        args[0], command_config_thermocouple_group);
+    uint8_t index = args[1];
+    if (index >= tg->sensor_count)
+        shutdown("Invalid thermocouple group sensor index");
+    struct thermocouple_spi *spi = oid_lookup(
+        args[2], command_config_thermocouple);
+    spi->min_value = args[3];
+    spi->max_value = args[4];
+    tg->sensors[index] = spi;
+}
+DECL_COMMAND(command_config_thermocouple_group_sensor,
+             "config_thermocouple_group_sensor oid=%c index=%c sensor_oid=%c"
+             " min_value=%u max_value=%u");
+
+void
+command_query_thermocouple_group(uint32_t *args)
+{
+    struct thermocouple_group *tg = oid_lookup(
+        args[0], command_config_thermocouple_group);
+    sched_del_timer(&tg->timer);
+    tg->timer.waketime = args[1];
+    tg->rest_time = args[2];
+    if (!tg->rest_time)
+        return;
+    uint8_t i;
+    for (i=0; i<tg->sensor_count; i++) {
+        struct thermocouple_spi *spi = tg->sensors[i];
+        if (!spi)
+            shutdown("Thermocouple group not fully configured");
+        spi->max_invalid = args[3];
+        spi->invalid_count = 0;
+    }
+    sched_add_timer(&tg->timer);
+}
+DECL_COMMAND(command_query_thermocouple_group,
+             "query_thermocouple_group oid=%c clock=%u rest_ticks=%u"
+             " max_invalid_count=%c");
+
+// task to read thermocouple groups and send responses
+void
+thermocouple_group_task(void)
+{
+    if (!sched_check_wake(&thermocouple_group_wake))
+        return;
+    uint8_t oid;
+    struct thermocouple_group *tg;
+    foreach_oid(oid, tg, command_config_thermocouple_group) {
+        if (!(tg->flags & TS_PENDING))
+            continue;
+        irq_disable();
+        uint32_t next_begin_time = tg->timer.waketime;
+        tg->flags &= ~TS_PENDING;
+        irq_enable();
+        uint8_t data[THERMOCOUPLE_GROUP_MAX * GROUP_BYTES_PER_SENSOR], i;
+        uint8_t *d = data;
+        for (i=0; i<tg->sensor_count; i++) {
+            uint32_t value;
+            uint8_t fault = thermocouple_read(tg->sensors[i], &value);
+            d[0] = value;
+            d[1] = value >> 8;
+            d[2] = value >> 16;
+            d[3] = value >> 24;
+            d[4] = fault;
+            d += GROUP_BYTES_PER_SENSOR;
+        }
+        sendf("thermocouple_group_result oid=%c next_clock=%u data=%*s"
+              , oid, next_begin_time, d - data, data);
+        // Check ranges after reporting (so the host sees the readings)
+        for (i=0, d=data; i<tg->sensor_count; i++) {
+            uint32_t value = (d[0] | (d[1] << 8) | ((uint32_t)d[2] << 16)
+                              | ((uint32_t)d[3] << 24));
+            thermocouple_check_result(tg->sensors[i], value, d[4]);
+            d += GROUP_BYTES_PER_SENSOR;
+        }
+    }
+}
+DECL_TASK(thermocouple_group_task);
@@ -5,6 +5,7 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_HAVE_GPIO_UART
 #include "board/gpio.h" // gpio_out_write
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_read_time
@@ -14,17 +15,23 @@
 
 struct tmcuart_s {
     struct timer timer;
+    struct tmcuart_poll_s *poll;
     struct gpio_out tx_pin;
     struct gpio_in rx_pin;
     uint8_t flags;
     uint8_t pos, read_count, write_count;
     uint32_t cfg_bit_time, bit_time;
     uint8_t data[10];
+#if CONFIG_HAVE_GPIO_UART
+    struct gpio_uart uart;
+    uint8_t hw_polls;
+#endif
 };
 
 enum {
     TU_LINE_HIGH = 1<<0, TU_ACTIVE = 1<<1, TU_READ_SYNC = 1<<2,
-    TU_REPORT = 1<<3, TU_PULLUP = 1<<4, TU_SINGLE_WIRE = 1<<5
+    TU_REPORT = 1<<3, TU_PULLUP = 1<<4, TU_SINGLE_WIRE = 1<<5, TU_HW = 1<<6,
+    TU_POLL = 1<<7
 };
 
 static struct task_wake tmcuart_wake;
@@ -35,9 +42,22 @@ tmcuart_reset_line(struct tmcuart_s *t)
 {
     if (t->flags & TU_SINGLE_WIRE)
         gpio_out_reset(t->tx_pin, 1);
-    else
+    else if (!(t->flags & TU_HW))
         gpio_out_write(t->tx_pin, 1);
-    t->flags = (t->flags & (TU_PULLUP | TU_SINGLE_WIRE)) | TU_LINE_HIGH;
+    t->flags = ((t->flags & (TU_PULLUP | TU_SINGLE_WIRE | TU_HW | TU_POLL))
+                | TU_LINE_HIGH);
+}
+
+// Extract a serial frame (start bit, 8 data bits, stop bit) from a
+// message encoded as a bit stream
+static uint_fast16_t
+tmcuart_get_frame(uint8_t *data, uint_fast8_t frame)
+{
+    uint_fast8_t pos = frame * 10, i;
+    uint_fast16_t v = 0;
+    for (i = 0; i < 10; i++, pos++)
+        v |= ((data[pos >> 3] >> (pos & 0x07)) & 0x01) << i;
+    return v;
 }
 
 // Helper function to end a transmission and schedule a response
@@ -50,6 +70,12 @@ tmcuart_finalize(struct tmcuart_s *t)
     return SF_DONE;
 }
 
+
+
+/****************************************************************
+ * Bit-banging transmission
+ ****************************************************************/
+
 // Event handler for reading uart bits
 static uint_fast8_t
 tmcuart_read_event(struct timer *timer)
@@ -169,6 +195,102 @@ tmcuart_send_sync_event(struct timer *timer)
     return SF_RESCHEDULE;
 }
 
+
+
+/****************************************************************
+ * Hardware uart transmission
+ ****************************************************************/
+
+#if CONFIG_HAVE_GPIO_UART
+
+// The host sends and expects messages encoded as a bit stream (with
+// start and stop bits).  When a board uart is available the mcu
+// converts between that bit stream and the bytes sent on the uart.
+
+// Store a serial frame for a received byte in the bit stream
+static void
+tmcuart_hw_put_byte(struct tmcuart_s *t, uint_fast8_t frame, int v)
+{
+    // A reception error is reported with an invalid stop bit
+    uint_fast16_t bits = ((v & 0xff) << 1) | (v & GPIO_UART_ERROR ? 0 : 0x200);
+    uint_fast8_t pos = frame * 10, i;
+    for (i = 0; i < 10; i++, pos++) {
+        uint8_t mask = 1 << (pos & 0x07);
+        if (bits & (1 << i))
+            t->data[pos >> 3] |= mask;
+        else
+            t->data[pos >> 3] &= ~mask;
+    }
+}
+
+// Event handler for collecting the response bytes
+static uint_fast8_t
+tmcuart_hw_read_event(struct timer *timer)
+{
+    struct tmcuart_s *t = container_of(timer, struct tmcuart_s, timer);
+    uint_fast8_t frames = t->read_count / 10;
+    for (;;) {
+        int v = gpio_uart_read(t->uart);
+        if (v < 0)
+            break;
+        tmcuart_hw_put_byte(t, t->pos++, v);
+        if (t->pos >= frames)
+            return tmcuart_finalize(t);
+    }
+    if (!t->hw_polls--) {
+        // Timeout
+        t->read_count = 0;
+        return tmcuart_finalize(t);
+    }
+    t->timer.waketime += t->bit_time * 10;
+    return SF_RESCHEDULE;
+}
+
+// Event handler for waiting until the uart completes the transmission
+static uint_fast8_t
+tmcuart_hw_send_event(struct timer *timer)
+{
+    struct tmcuart_s *t = container_of(timer, struct tmcuart_s, timer);
+    if (gpio_uart_tx_busy(t->uart)) {
+        t->timer.waketime += t->bit_time;
+        return SF_RESCHEDULE;
+    }
+    // Discard the echo of the transmitted bytes
+    while (gpio_uart_read(t->uart) >= 0)
+        ;
+    if (!t->read_count)
+        return tmcuart_finalize(t);
+    // Allow the same 64 bit time response delay as the bit-bang code
+    t->pos = 0;
+    t->hw_polls = t->read_count / 10 + 7;
+    t->timer.func = tmcuart_hw_read_event;
+    t->timer.waketime += t->bit_time * 10;
+    return SF_RESCHEDULE;
+}
+
+// Start a transmission using the board uart
+static void
+tmcuart_hw_send(struct tmcuart_s *t)
+{
+    uint8_t frames = t->write_count / 10, buf[sizeof(t->data)], i;
+    for (i = 0; i < frames; i++)
+        buf[i] = tmcuart_get_frame(t->data, i) >> 1;
+    t->bit_time = t->cfg_bit_time;
+    t->timer.func = tmcuart_hw_send_event;
+    irq_disable();
+    gpio_uart_write(t->uart, buf, frames);
+    t->timer.waketime = timer_read_time() + t->bit_time * 10 * frames;
+    sched_add_timer(&t->timer);
+    irq_enable();
+}
+
+#endif // CONFIG_HAVE_GPIO_UART
+
+
+/****************************************************************
+ * Command interface
+ ****************************************************************/
+
 void
 command_config_tmcuart(uint32_t *args)
 {
@@ -176,9 +298,18 @@ command_config_tmcuart(uint32_t *args)
                                     , sizeof(*t));
     uint8_t pull_up = args[2];
     uint32_t rx_pin = args[1], tx_pin = args[3];
+    t->cfg_bit_time = args[4];
+#if CONFIG_HAVE_GPIO_UART
+    // Use a board uart if the pins support it
+    if (rx_pin != tx_pin
+        && !gpio_uart_setup(rx_pin, tx_pin, !!pull_up, t->cfg_bit_time
+                            , &t->uart)) {
+        t->flags = TU_HW | TU_LINE_HIGH;
+        return;
+    }
+#endif
     t->rx_pin = gpio_in_setup(rx_pin, !!pull_up);
     t->tx_pin = gpio_out_setup(tx_pin, 1);
-    t->cfg_bit_time = args[4];
     t->flags = (TU_LINE_HIGH | (pull_up ? TU_PULLUP : 0)
                 | (rx_pin == tx_pin ? TU_SINGLE_WIRE : 0));
 }
@@ -186,24 +317,23 @@ DECL_COMMAND(command_config_tmcuart,
              "config_tmcuart oid=%c rx_pin=%u pull_up=%c"
              " tx_pin=%u bit_time=%u");
 
-// Parse and schedule a TMC UART transmission request
-void
-command_tmcuart_send(uint32_t *args)
+// Schedule a TMC UART transmission
+static void
+tmcuart_start(struct tmcuart_s *t, uint8_t *write, uint8_t write_len
+              , uint8_t read_len, uint8_t flags)
 {
-    struct tmcuart_s *t = oid_lookup(args[0], command_config_tmcuart);
-    if (t->flags & TU_ACTIVE)
-        // Uart is busy - silently drop this request (host should retransmit)
-        return;
-    uint8_t write_len = args[1];
-    uint8_t *write = command_decode_ptr(args[2]);
-    uint8_t read_len = args[3];
-    if (write_len > sizeof(t->data) || read_len > sizeof(t->data))
-        shutdown("tmcuart data too large");
     memcpy(t->data, write, write_len);
     t->pos = 0;
-    t->flags = (t->flags & (TU_LINE_HIGH|TU_PULLUP|TU_SINGLE_WIRE)) | TU_ACTIVE;
+    t->flags = ((t->flags & (TU_LINE_HIGH|TU_PULLUP|TU_SINGLE_WIRE|TU_HW))
+                | TU_ACTIVE | flags);
     t->write_count = write_len * 8;
     t->read_count = read_len * 8;
+#if CONFIG_HAVE_GPIO_UART
+    if (t->flags & TU_HW) {
+        tmcuart_hw_send(t);
+        return;
+    }
+#endif
     if (write_len >= 1 && (t->data[0] & 0x3f) == 0x2a) {
         t->timer.func = tmcuart_send_sync_event;
     } else {
@@ -215,6 +345,222 @@ command_tmcuart_send(uint32_t *args)
     sched_add_timer(&t->timer);
     irq_enable();
 }
+
+
+/****************************************************************
+ * Periodic register polling
+ ****************************************************************/
+
+// A poller repeatedly reads a list of registers (from all the drivers
+// on a uart) and only reports a register to the host when the value
+// of the masked bits changes, when the bits in 'zero_mask' become
+// zero or non-zero, or when the register can not be read.
+
+struct tmcuart_poll_entry {
+    uint32_t mask, zero_mask, last_value;
+    uint8_t write[5], write_len, fail_count;
+};
+
+struct tmcuart_poll_s {
+    struct timer timer;
+    struct tmcuart_s *t;
+    uint32_t rest_ticks;
+    uint8_t oid, flags, pos, entry_count;
+    uint8_t host_write_len, host_read_len, host_data[10];
+    struct tmcuart_poll_entry entries[0];
+};
+
+enum { TP_RUN = 1<<0, TP_HOST = 1<<1 };
+
+#define POLL_READ_LEN 10
+#define POLL_MAX_FAILS 3
+
+// Timer event to start a new round of register reads
+static uint_fast8_t
+tmcuart_poll_event(struct timer *timer)
+{
+    struct tmcuart_poll_s *p = container_of(timer, struct tmcuart_poll_s
+                                            , timer);
+    p->flags |= TP_RUN;
+    sched_wake_task(&tmcuart_wake);
+    p->timer.waketime += p->rest_ticks;
+    return SF_RESCHEDULE;
+}
+
+// Calculate the CRC8-ATM of a message (as done by the TMC drivers)
+static uint8_t
+tmcuart_crc8(uint8_t *data, uint_fast8_t len)
+{
+    uint8_t crc = 0;
+    while (len--) {
+        uint8_t b = *data++, i;
+        for (i = 0; i < 8; i++, b >>= 1) {
+            if ((crc >> 7) ^ (b & 0x01))
+                crc = (crc << 1) ^ 0x07;
+            else
+                crc <<= 1;
+        }
+    }
+    return crc;
+}
+
+// Decode a register read response and report it if needed
+static void
+tmcuart_poll_process(struct tmcuart_poll_s *p)
+{
+    struct tmcuart_s *t = p->t;
+    struct tmcuart_poll_entry *e = &p->entries[p->pos];
+    if (!e->write_len)
+        // Entry disabled while the read was in progress
+        return;
+    uint8_t msg[8], i, valid = t->read_count == POLL_READ_LEN * 8;
+    for (i = 0; valid && i < ARRAY_SIZE(msg); i++) {
+        uint_fast16_t frame = tmcuart_get_frame(t->data, i);
+        valid = (frame & 0x201) == 0x200;
+        msg[i] = frame >> 1;
+    }
+    uint8_t reg = tmcuart_get_frame(e->write, 2) >> 1;
+    if (!valid || msg[0] != 0x05 || msg[1] != 0xff || msg[2] != reg
+        || tmcuart_crc8(msg, 7) != msg[7]) {
+        if (++e->fail_count >= POLL_MAX_FAILS) {
+            e->fail_count = 0;
+            sendf("tmcuart_poll_result oid=%c index=%c status=%c value=%u"
+                  , p->oid, p->pos, 1, 0);
+        }
+        return;
+    }
+    e->fail_count = 0;
+    uint32_t value = ((msg[3] << 24) | (msg[4] << 16) | (msg[5] << 8)
+                      | msg[6]);
+    uint32_t last = e->last_value, zero_mask = e->zero_mask;
+    if (!((value ^ last) & e->mask)
+        && !(value & zero_mask) == !(last & zero_mask))
+        return;
+    e->last_value = value;
+    sendf("tmcuart_poll_result oid=%c index=%c status=%c value=%u"
+          , p->oid, p->pos, 0, value);
+}
+
+// Start the next uart transmission (if the uart is idle)
+static void
+tmcuart_poll_kick(struct tmcuart_poll_s *p)
+{
+    struct tmcuart_s *t = p->t;
+    if (t->flags & (TU_ACTIVE | TU_REPORT | TU_POLL))
+        return;
+    if (p->flags & TP_HOST) {
+        // Host request arrived while the uart was polling
+        irq_disable();
+        p->flags &= ~TP_HOST;
+        irq_enable();
+        tmcuart_start(t, p->host_data, p->host_write_len, p->host_read_len
+                      , 0);
+        return;
+    }
+    if (!(p->flags & TP_RUN))
+        return;
+    uint8_t pos = p->pos;
+    while (pos < p->entry_count && !p->entries[pos].write_len)
+        pos++;
+    if (pos >= p->entry_count) {
+        // Round complete
+        irq_disable();
+        p->flags &= ~TP_RUN;
+        irq_enable();
+        p->pos = 0;
+        return;
+    }
+    p->pos = pos;
+    struct tmcuart_poll_entry *e = &p->entries[pos];
+    tmcuart_start(t, e->write, e->write_len, POLL_READ_LEN, TU_POLL);
+}
+
+void
+command_config_tmcuart_poll(uint32_t *args)
+{
+    struct tmcuart_s *t = oid_lookup(args[1], command_config_tmcuart);
+    uint8_t entry_count = args[2];
+    if (t->poll)
+        shutdown("tmcuart already has a poller");
+    struct tmcuart_poll_s *p = oid_alloc(
+        args[0], command_config_tmcuart_poll
+        , sizeof(*p) + entry_count * sizeof(p->entries[0]));
+    p->timer.func = tmcuart_poll_event;
+    p->t = t;
+    p->oid = args[0];
+    p->entry_count = entry_count;
+    t->poll = p;
+}
+DECL_COMMAND(command_config_tmcuart_poll,
+             "config_tmcuart_poll oid=%c tmcuart_oid=%c entry_count=%c");
+
+// Set the register read message of a poll entry (an empty message
+// disables the entry)
+void
+command_tmcuart_poll_entry(uint32_t *args)
+{
+    struct tmcuart_poll_s *p = oid_lookup(args[0]
+                                          , command_config_tmcuart_poll);
+    uint8_t index = args[1], write_len = args[2];
+    uint8_t *write = command_decode_ptr(args[3]);
+    if (index >= p->entry_count || write_len > sizeof(p->entries[0].write))
+        shutdown("Invalid tmcuart poll entry");
+    struct tmcuart_poll_entry *e = &p->entries[index];
+    memcpy(e->write, write, write_len);
+    e->write_len = write_len;
+    e->mask = args[4];
+    e->zero_mask = args[5];
+    e->last_value = args[6];
+    e->fail_count = 0;
+}
+DECL_COMMAND(command_tmcuart_poll_entry,
+             "tmcuart_poll_entry oid=%c index=%c write=%*s mask=%u"
+             " zero_mask=%u last_value=%u");
+
+void
+command_query_tmcuart_poll(uint32_t *args)
+{
+    struct tmcuart_poll_s *p = oid_lookup(args[0]
+                                          , command_config_tmcuart_poll);
+    sched_del_timer(&p->timer);
+    irq_disable();
+    p->flags &= ~TP_RUN;
+    irq_enable();
+    p->rest_ticks = args[2];
+    if (!p->rest_ticks)
+        return;
+    p->timer.waketime = args[1];
+    sched_add_timer(&p->timer);
+}
+DECL_COMMAND(command_query_tmcuart_poll,
+             "query_tmcuart_poll oid=%c clock=%u rest_ticks=%u");
+
+// Parse and schedule a TMC UART transmission request
+void
+command_tmcuart_send(uint32_t *args)
+{
+    struct tmcuart_s *t = oid_lookup(args[0], command_config_tmcuart);
+    uint8_t write_len = args[1];
+    uint8_t *write = command_decode_ptr(args[2]);
+    uint8_t read_len = args[3];
+    if (write_len > sizeof(t->data) || read_len > sizeof(t->data))
+        shutdown("tmcuart data too large");
+    if (t->flags & (TU_ACTIVE | TU_POLL)) {
+        struct tmcuart_poll_s *p = t->poll;
+        if (t->flags & TU_POLL && !(p->flags & TP_HOST)) {
+            // Send this request once the current poll completes
+            memcpy(p->host_data, write, write_len);
+            p->host_write_len = write_len;
+            p->host_read_len = read_len;
+            irq_disable();
+            p->flags |= TP_HOST;
+            irq_enable();
+        }
+        // Uart is busy - silently drop this request (host should retransmit)
+        return;
+    }
+    tmcuart_start(t, write, write_len, read_len, 0);
+}
 DECL_COMMAND(command_tmcuart_send, "tmcuart_send oid=%c write=%*s read=%c");
 
 // Report completed response message back to host
@@ -226,13 +572,21 @@ tmcuart_task(void)
     uint8_t oid;
     struct tmcuart_s *t;
     foreach_oid(oid, t, command_config_tmcuart) {
-        if (!(t->flags & TU_REPORT))
-            continue;
-        irq_disable();
-        t->flags &= ~TU_REPORT;
-        irq_enable();
-        sendf("tmcuart_response oid=%c read=%*s"
-              , oid, t->read_count / 8, t->data);
+        if (t->flags & TU_REPORT) {
+            uint8_t flags = t->flags;
+            irq_disable();
+            t->flags &= ~(TU_REPORT | TU_POLL);
+            irq_enable();
+            if (flags & TU_POLL) {
+                tmcuart_poll_process(t->poll);
+                t->poll->pos++;
+            } else {
+                sendf("tmcuart_response oid=%c read=%*s"
+                      , oid, t->read_count / 8, t->data);
+            }
+        }
+        if (t->poll)
+            tmcuart_poll_kick(t->poll);
     }
 }
 DECL_TASK(tmcuart_task);